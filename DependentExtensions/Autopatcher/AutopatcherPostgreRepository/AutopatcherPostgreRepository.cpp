@@ -18,6 +18,7 @@
 // libpq-fe.h is part of PostgreSQL which must be installed on this computer to use the PostgreRepository
 #include "libpq-fe.h"
 #include "CreatePatch.h"
+#include "PatchCache.h"
 #include "AutopatcherPatchContext.h"
 // #include "DR_SHA1.h"
 #include <stdlib.h>
@@ -109,6 +110,14 @@ bool AutopatcherPostgreRepository::CreateAutopatcherTables(void)
 	PQclear(result);
 	return res;
 }
+AutopatcherPostgreRepository2::AutopatcherPostgreRepository2()
+{
+	patchCache=0;
+}
+void AutopatcherPostgreRepository2::SetPatchCache(PatchCache *_patchCache)
+{
+	patchCache=_patchCache;
+}
 bool AutopatcherPostgreRepository2::CreateAutopatcherTables(void)
 {
 	if (isConnected==false)
@@ -2009,7 +2018,11 @@ bool AutopatcherPostgreRepository2::MakePatchBSDiff(FILE *fpOld, int contentLeng
 	fseek(fpNew, 0, SEEK_SET);
 	fread(newContent, contentLengthNew, 1, fpNew);
 
-	bool b = CreatePatch(oldContent, contentLengthOld, newContent, contentLengthNew, patch, patchLength);
+	bool b;
+	if (patchCache)
+		b = patchCache->GetPatch(oldContent, contentLengthOld, newContent, contentLengthNew, patch, patchLength);
+	else
+		b = CreatePatch(oldContent, contentLengthOld, newContent, contentLengthNew, patch, patchLength);
 
 	if (b==false)
 	{
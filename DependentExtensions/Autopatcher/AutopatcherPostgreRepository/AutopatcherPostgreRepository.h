@@ -32,6 +32,7 @@ typedef struct pg_result PGresult;
 namespace RakNet
 {
 class FileListProgress;
+class PatchCache;
 
 /// \ingroup Autopatcher
 ///  An implementation of the AutopatcherRepositoryInterface to use PostgreSQL to store the relevant data
@@ -127,6 +128,8 @@ protected:
 class RAK_DLL_EXPORT AutopatcherPostgreRepository2 : public AutopatcherPostgreRepository
 {
 public:
+	AutopatcherPostgreRepository2();
+
 	virtual bool CreateAutopatcherTables(void);
 	virtual bool GetMostRecentChangelistWithPatches(RakNet::RakString &applicationName, FileList *patchedFiles, FileList *addedFiles, FileList *addedOrModifiedFileHashes, FileList *deletedFiles, double *priorRowPatchTime, double *mostRecentRowPatchTime);
 	virtual bool UpdateApplicationFiles(const char *applicationName, const char *applicationDirectory, const char *userName, FileListProgress *cb);
@@ -139,10 +142,15 @@ public:
 	/// \param[out] patchLength Write the length of the resultant patch here
 	/// \param[out] patchAlgorithm Stored in the database. Use if you want to represent what algorithm was used. Transmitted to the client for decompression
 	virtual int MakePatch(const char *oldFile, const char *newFile, char **patch, unsigned int *patchLength, int *patchAlgorithm);
+
+	/// Look up and store bsdiff patches in  _patchCache, so the same pair of file versions is only ever diffed once
+	/// \param[in] _patchCache Not deallocated by this class. Pass 0 to always call CreatePatch()
+	void SetPatchCache(PatchCache *_patchCache);
 protected:
 	// Implements MakePatch using bsDiff. Uses a lot of memory, should not use for files above about 100 megabytes.
 	virtual bool MakePatchBSDiff(FILE *fpOld, int contentLengthOld, FILE *fpNew, int contentLengthNew, char **patch, unsigned int *patchLength);
 
+	PatchCache *patchCache;
 };
 
 } // namespace RakNet
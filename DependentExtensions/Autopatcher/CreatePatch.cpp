@@ -25,6 +25,10 @@
  */
  
 #include "MemoryCompressor.h"
+#include "CreatePatch.h"
+#include "ThreadPool.h"
+#include "DS_List.h"
+#include "RakSleep.h"
 
 #if 0
 __FBSDID("$FreeBSD: src/usr.bin/bsdiff/bsdiff/bsdiff.c,v 1.1 2005/08/06 01:59:05 cperciva Exp $");
@@ -70,19 +74,22 @@ static void errx(int i, ...)
 #define O_BINARY _O_BINARY 
 #endif
 
-static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
+// Vh is the rank array as of the start of the current doubling pass, V is the rank array being written.
+// They are the same array when sorting on one thread. When sorting groups in parallel, V is written by other threads
+// so group comparisons must read from a snapshot instead.
+static void split(off_t *I,off_t *V,const off_t *Vh,off_t start,off_t len,off_t h)
 {
 	off_t i,j,k,x,tmp,jj,kk;
 
 	if(len<16) {
 		for(k=start;k<start+len;k+=j) {
-			j=1;x=V[I[k]+h];
+			j=1;x=Vh[I[k]+h];
 			for(i=1;k+i<start+len;i++) {
-				if(V[I[k+i]+h]<x) {
-					x=V[I[k+i]+h];
+				if(Vh[I[k+i]+h]<x) {
+					x=Vh[I[k+i]+h];
 					j=0;
 				};
-				if(V[I[k+i]+h]==x) {
+				if(Vh[I[k+i]+h]==x) {
 					tmp=I[k+j];I[k+j]=I[k+i];I[k+i]=tmp;
 					j++;
 				};
@@ -93,19 +100,19 @@ static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
 		return;
 	};
 
-	x=V[I[start+len/2]+h];
+	x=Vh[I[start+len/2]+h];
 	jj=0;kk=0;
 	for(i=start;i<start+len;i++) {
-		if(V[I[i]+h]<x) jj++;
-		if(V[I[i]+h]==x) kk++;
+		if(Vh[I[i]+h]<x) jj++;
+		if(Vh[I[i]+h]==x) kk++;
 	};
 	jj+=start;kk+=jj;
 
 	i=start;j=0;k=0;
 	while(i<jj) {
-		if(V[I[i]+h]<x) {
+		if(Vh[I[i]+h]<x) {
 			i++;
-		} else if(V[I[i]+h]==x) {
+		} else if(Vh[I[i]+h]==x) {
 			tmp=I[i];I[i]=I[jj+j];I[jj+j]=tmp;
 			j++;
 		} else {
@@ -115,7 +122,7 @@ static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
 	};
 
 	while(jj+j<kk) {
-		if(V[I[jj+j]+h]==x) {
+		if(Vh[I[jj+j]+h]==x) {
 			j++;
 		} else {
 			tmp=I[jj+j];I[jj+j]=I[kk+k];I[kk+k]=tmp;
@@ -123,18 +130,116 @@ static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
 		};
 	};
 
-	if(jj>start) split(I,V,start,jj-start,h);
+	if(jj>start) split(I,V,Vh,start,jj-start,h);
 
 	for(i=0;i<kk-jj;i++) V[I[jj+i]]=kk-1;
 	if(jj==kk-1) I[jj]=-1;
 
-	if(start+len>kk) split(I,V,kk,start+len-kk,h);
+	if(start+len>kk) split(I,V,Vh,kk,start+len-kk,h);
 }
 
-static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
+typedef ThreadPool<void*, void*> PatchThreadPool;
+
+// Below this many bytes the suffix sort and the diff stay on the calling thread
+static const off_t PARALLEL_SORT_MIN_SIZE=1<<20;
+static const off_t PARALLEL_SORT_MIN_PASS_SIZE=1<<16;
+static const off_t PARALLEL_DIFF_MIN_BLOCK_SIZE=1<<20;
+
+// Runs all jobs added to pool, and blocks until they have returned
+static void WaitForPatchJobs(PatchThreadPool *pool, unsigned jobCount)
+{
+	unsigned finished=0;
+	while (finished<jobCount)
+	{
+		if (pool->HasOutputFast() && pool->HasOutput())
+		{
+			pool->GetOutput();
+			finished++;
+		}
+		else
+			RakSleep(1);
+	}
+}
+
+struct SortJob
+{
+	off_t *I,*V;
+	const off_t *Vh;
+	off_t h;
+	// start,len pairs of unsorted groups
+	const off_t *groups;
+	unsigned groupCount;
+};
+
+static void* SortJobThread(void* input, bool *returnOutput, void* perThreadData)
+{
+	(void) perThreadData;
+	SortJob *job=(SortJob*) input;
+	unsigned i;
+	for (i=0; i < job->groupCount; i++)
+		split(job->I,job->V,job->Vh,job->groups[i*2],job->groups[i*2+1],job->h);
+	*returnOutput=true;
+	return job;
+}
+
+// Splits every unsorted group of one doubling pass. Groups are independent as long as ranks are read from a snapshot taken at the start of the pass.
+static bool SplitGroups(off_t *I,off_t *V,off_t *Vh,off_t oldsize,off_t h,DataStructures::List<off_t> &groups,off_t groupedElements,PatchThreadPool *pool,int numThreads)
+{
+	unsigned groupCount=groups.Size()/2;
+	unsigned i;
+	if (pool==0 || groupedElements<PARALLEL_SORT_MIN_PASS_SIZE)
+	{
+		for (i=0; i < groupCount; i++)
+			split(I,V,V,groups[i*2],groups[i*2+1],h);
+		return true;
+	}
+
+	memcpy(Vh,V,(oldsize+1)*sizeof(off_t));
+
+	// Several jobs per thread so one huge group does not leave the others idle
+	unsigned maxJobs=(unsigned) numThreads*4;
+	SortJob *jobs=(SortJob*)malloc(maxJobs*sizeof(SortJob));
+	if (jobs==0)
+		return false;
+	off_t elementsPerJob=groupedElements/maxJobs+1;
+	unsigned jobCount=0, firstGroup=0;
+	off_t elementsInJob=0;
+	for (i=0; i < groupCount; i++)
+	{
+		elementsInJob+=groups[i*2+1];
+		if (elementsInJob>=elementsPerJob || i+1==groupCount || jobCount+1==maxJobs)
+		{
+			if (jobCount+1==maxJobs)
+				i=groupCount-1;
+			jobs[jobCount].I=I;
+			jobs[jobCount].V=V;
+			jobs[jobCount].Vh=Vh;
+			jobs[jobCount].h=h;
+			jobs[jobCount].groups=&groups[firstGroup*2];
+			jobs[jobCount].groupCount=i+1-firstGroup;
+			pool->AddInput(SortJobThread, &jobs[jobCount]);
+			jobCount++;
+			firstGroup=i+1;
+			elementsInJob=0;
+		}
+	}
+	WaitForPatchJobs(pool, jobCount);
+	free(jobs);
+	return true;
+}
+
+static bool qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize,PatchThreadPool *pool,int numThreads)
 {
 	off_t buckets[256];
 	off_t i,h,len;
+	off_t *Vh=0;
+	off_t groupedElements;
+	DataStructures::List<off_t> groups;
+
+	if (pool && oldsize>=PARALLEL_SORT_MIN_SIZE)
+		Vh=(off_t*)malloc((oldsize+1)*sizeof(off_t));
+	if (Vh==0)
+		pool=0;
 
 	//for(i=0;i<256;i++) buckets[i]=0;
 	memset(buckets, 0, sizeof(buckets));
@@ -152,6 +257,8 @@ static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
 
 	for(h=1;I[0]!=-(oldsize+1);h+=h) {
 		len=0;
+		groupedElements=0;
+		groups.Clear(true, _FILE_AND_LINE_);
 		for(i=0;i<oldsize+1;) {
 			if(I[i]<0) {
 				len-=I[i];
@@ -159,15 +266,30 @@ static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
 			} else {
 				if(len) I[i-len]=-len;
 				len=V[I[i]]+1-i;
-				split(I,V,i,len,h);
+				if (pool==0) {
+					split(I,V,V,i,len,h);
+				} else {
+					// Group heads ahead of i are not touched by split, so the whole pass can be gathered first
+					groups.Push(i, _FILE_AND_LINE_);
+					groups.Push(len, _FILE_AND_LINE_);
+					groupedElements+=len;
+				}
 				i+=len;
 				len=0;
 			};
 		};
 		if(len) I[i-len]=-len;
+		if (pool && groups.Size() && SplitGroups(I,V,Vh,oldsize,h,groups,groupedElements,pool,numThreads)==false)
+		{
+			free(Vh);
+			return false;
+		}
 	};
 
 	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
+	if (Vh)
+		free(Vh);
+	return true;
 }
 
 static off_t matchlen(u_char *old,off_t oldsize,u_char *_new,off_t newsize)
@@ -236,15 +358,32 @@ static void offtout(off_t x,u_char *buf)
 	if(x<0) buf[7]|=0x80;
 }
 
-// This function modifies the main() function included in bsdiff.c of bsdiff-4.3 found at http://www.daemonology.net/bsdiff/
-// It is changed to be a standalone function, to work entirely in memory, and to use my class MemoryCompressor as an interface to BZip
-// Up to the caller to delete out
-bool CreatePatch(const char *old, unsigned oldsize, char *_new, unsigned int newsize, char **out, unsigned *outSize)
+// The control, diff and extra data produced for a range of the new file
+struct DiffBlock
 {
-//	int fd;
-//	u_char *old,*new;
-//	off_t oldsize,newsize;
-	off_t *I,*V;
+	off_t *I;
+	u_char *old;
+	off_t oldsize;
+	u_char *_new;
+	off_t newsize;
+
+	// lenf, extra length, seek triples
+	DataStructures::List<off_t> ctrl;
+	u_char *db,*eb;
+	off_t dblen,eblen;
+	// Position in old the last seek in ctrl moves to
+	off_t lastpos;
+	bool success;
+};
+
+// The scan loop of bsdiff, run over DiffBlock::_new. Starts at old position 0, as if _new were the whole file.
+static bool DiffBlockRun(DiffBlock *block)
+{
+	off_t *I=block->I;
+	u_char *old=block->old;
+	off_t oldsize=block->oldsize;
+	u_char *_new=block->_new;
+	off_t newsize=block->newsize;
 	off_t scan,pos,len;
 	off_t lastscan,lastpos,lastoffset;
 	off_t oldscore,scsc;
@@ -253,99 +392,26 @@ bool CreatePatch(const char *old, unsigned oldsize, char *_new, unsigned int new
 	off_t i;
 	off_t dblen,eblen;
 	u_char *db,*eb;
-	u_char buf[8];
-	u_char header[32];
-	MemoryCompressor patch;
-//	unsigned outWriteOffset;
-//	FILE * pf;
-//	BZFILE * pfbz2;
-//	int bz2err;
-
-
-//	if(argc!=4) errx(1,"usage: %s oldfile newfile patchfile\n",argv[0]);
-
-	/* Allocate oldsize+1 bytes instead of oldsize bytes to ensure
-		that we never try to malloc(0) and get a NULL pointer */
-	/*
-	if(((fd=open(argv[1],O_RDONLY | _O_BINARY ,0))<0) ||
-		((oldsize=lseek(fd,0,SEEK_END))==-1) ||
-		((old=malloc(oldsize+1))==NULL) ||
-		(lseek(fd,0,SEEK_SET)!=0) ||
-		(read(fd,old,oldsize)!=oldsize) ||
-		(close(fd)==-1)) err(1,"%s",argv[1]);
-		*/
-
-	if(((I=(off_t*)malloc((oldsize+1)*sizeof(off_t)))==NULL) ||
-		((V=(off_t*)malloc((oldsize+1)*sizeof(off_t)))==NULL))
-		// err(1,NULL);
-			return false;
-
-	qsufsort(I,V,(u_char*)old,oldsize);
-
-	free(V);
 
 	/* Allocate newsize+1 bytes instead of newsize bytes to ensure
 		that we never try to malloc(0) and get a NULL pointer */
-	/*
-	if(((fd=open(argv[2],O_RDONLY | _O_BINARY ,0))<0) ||
-		((newsize=lseek(fd,0,SEEK_END))==-1) ||
-		((new=malloc(newsize+1))==NULL) ||
-		(lseek(fd,0,SEEK_SET)!=0) ||
-		(read(fd,new,newsize)!=newsize) ||
-		(close(fd)==-1)) err(1,"%s",argv[2]);
-
-		*/
-
-	if(((db=(u_char*)malloc(newsize+1))==NULL) ||
-		((eb=(u_char*)malloc(newsize+1))==NULL))
-		// err(1,NULL);
-		{
-			free(I);
-			return false;
-		}
+	db=(u_char*)malloc(newsize+1);
+	eb=(u_char*)malloc(newsize+1);
+	block->db=db;
+	block->eb=eb;
+	if (db==0 || eb==0)
+		return false;
 
 	dblen=0;
 	eblen=0;
 
-	/* Create the patch file */
-//	if ((pf = fopen(argv[3], "wb")) == NULL)
-//		err(1, "%s", argv[3]);
-
-	/* Header is
-		0	8	 "BSDIFF40"
-		8	8	length of bzip2ed ctrl block
-		16	8	length of bzip2ed diff block
-		24	8	length of new file */
-	/* File is
-		0	32	Header
-		32	??	Bzip2ed ctrl block
-		??	??	Bzip2ed diff block
-		??	??	Bzip2ed extra block */
-
-	memcpy(header,"BSDIFF40",8);
-	offtout(0, header + 8);
-	offtout(0, header + 16);
-	offtout(newsize, header + 24);
-//	if (fwrite(header, 32, 1, pf) != 1)
-//		err(1, "fwrite(%s)", argv[3]);
-
-	// Allocate enough to hold any output
-//	*out = (char*) malloc(oldsize+newsize);
-	// Copy out the header
-//	memcpy(*out, header, 32);
-	//outWriteOffset=32;
-
-	/* Compute the differences, writing ctrl as we go */
-//	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-//		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-
-	scan=0;len=0;
+	scan=0;len=0;pos=0;
 	lastscan=0;lastpos=0;lastoffset=0;
 	while(scan<newsize) {
 		oldscore=0;
 
 		for(scsc=scan+=len;scan<newsize;scan++) {
-			len=search(I,(u_char*)old,oldsize,(u_char*)_new+scan,newsize-scan,
+			len=search(I,old,oldsize,_new+scan,newsize-scan,
 					0,oldsize,&pos);
 
 			for(;scsc<scan+len;scsc++)
@@ -401,41 +467,9 @@ bool CreatePatch(const char *old, unsigned oldsize, char *_new, unsigned int new
 			dblen+=lenf;
 			eblen+=(scan-lenb)-(lastscan+lenf);
 
-			offtout(lenf,buf);
-			if (patch.Compress((char*)buf, 8, false)==false)
-			{
-				free(db);
-				free(eb);
-				free(I);
-				return false;
-			}
-			//BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			//if (bz2err != BZ_OK)
-			//	errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			offtout((scan-lenb)-(lastscan+lenf),buf);
-			if (patch.Compress((char*)buf, 8, false)==false)
-			{
-				free(db);
-				free(eb);
-				free(I);
-				return false;
-			}
-			//BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			//if (bz2err != BZ_OK)
-			//	errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			offtout((pos-lenb)-(lastpos+lenf),buf);
-			if (patch.Compress((char*)buf, 8, false)==false)
-			{
-				free(db);
-				free(eb);
-				free(I);
-				return false;
-			}
-			//BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			//if (bz2err != BZ_OK)
-			//	errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+			block->ctrl.Push(lenf, _FILE_AND_LINE_);
+			block->ctrl.Push((scan-lenb)-(lastscan+lenf), _FILE_AND_LINE_);
+			block->ctrl.Push((pos-lenb)-(lastpos+lenf), _FILE_AND_LINE_);
 
 			lastscan=scan-lenb;
 			lastpos=pos-lenb;
@@ -443,102 +477,200 @@ bool CreatePatch(const char *old, unsigned oldsize, char *_new, unsigned int new
 		};
 	};
 
-//	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-//	if (bz2err != BZ_OK)
-//		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+	block->dblen=dblen;
+	block->eblen=eblen;
+	block->lastpos=lastpos;
+	return true;
+}
 
-	/* Compute size of compressed ctrl data */
-//	if ((len = ftello(pf)) == -1)
-//		err(1, "ftello");
-	if (patch.Compress(0,0,true)==false)
+static void* DiffBlockThread(void* input, bool *returnOutput, void* perThreadData)
+{
+	(void) perThreadData;
+	DiffBlock *block=(DiffBlock*) input;
+	block->success=DiffBlockRun(block);
+	*returnOutput=true;
+	return block;
+}
+
+bool CreatePatch(const char *old, unsigned oldsize, char *_new, unsigned int newsize, char **out, unsigned *outSize)
+{
+	return CreatePatch(old, oldsize, _new, newsize, out, outSize, 1);
+}
+
+// This function modifies the main() function included in bsdiff.c of bsdiff-4.3 found at http://www.daemonology.net/bsdiff/
+// It is changed to be a standalone function, to work entirely in memory, and to use my class MemoryCompressor as an interface to BZip
+// With more than one thread, the new file is cut into blocks which are diffed against all of old at the same time. Each block but the
+// last has its final seek adjusted to land on old position 0, which is where the next block assumes it starts.
+// Up to the caller to delete out
+bool CreatePatch(const char *old, unsigned oldsize, char *_new, unsigned int newsize, char **out, unsigned *outSize, int numThreads)
+{
+	off_t *I,*V;
+	off_t len;
+	off_t i;
+	unsigned blockIndex, numBlocks;
+	DiffBlock *blocks;
+	u_char *ctrlBuf;
+	unsigned ctrlLength;
+	u_char header[32];
+	MemoryCompressor patch;
+	PatchThreadPool pool;
+	PatchThreadPool *poolPtr=0;
+	bool success=true;
+
+	if (numThreads<1)
+		numThreads=1;
+	numBlocks=1;
+	if (numThreads>1)
 	{
-		free(db);
-		free(eb);
-		free(I);
+		numBlocks=(unsigned)(newsize/PARALLEL_DIFF_MIN_BLOCK_SIZE);
+		if (numBlocks>(unsigned) numThreads)
+			numBlocks=(unsigned) numThreads;
+		if (numBlocks<1)
+			numBlocks=1;
+		if ((numBlocks>1 || (off_t) oldsize>=PARALLEL_SORT_MIN_SIZE) && pool.StartThreads(numThreads, 0))
+			poolPtr=&pool;
+		else
+			numBlocks=1;
+	}
+
+	if(((I=(off_t*)malloc((oldsize+1)*sizeof(off_t)))==NULL) ||
+		((V=(off_t*)malloc((oldsize+1)*sizeof(off_t)))==NULL))
+	{
+		if (I)
+			free(I);
 		return false;
 	}
-	len=patch.GetTotalOutputSize()+32; // test: len should be 188
-	offtout(len-32, header + 8);
-	//memcpy(*out+outWriteOffset, patch.GetOutput(), patch.GetTotalOutputSize());
-	//outWriteOffset+=patch.GetTotalOutputSize();
-	//patch.Clear(_FILE_AND_LINE_);
-	
 
-	/* Write compressed diff data */
-//	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-//		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-//	BZ2_bzWrite(&bz2err, pfbz2, db, dblen);
-	if (patch.Compress((char*)db,dblen,true)==false)
+	success=qsufsort(I,V,(u_char*)old,oldsize,poolPtr,numThreads);
+	free(V);
+	if (success==false)
 	{
-		free(db);
-		free(eb);
 		free(I);
 		return false;
 	}
-//	memcpy(*out+outWriteOffset, patch.GetOutput(), patch.GetTotalOutputSize());
-//	outWriteOffset+=patch.GetTotalOutputSize();
-//	patch.Clear(_FILE_AND_LINE_);
-//	if (bz2err != BZ_OK)
-//		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-//	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-//	if (bz2err != BZ_OK)
-//		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
 
-	/* Compute size of compressed diff data */
-//	if ((newsize = ftello(pf)) == -1)
-//		err(1, "ftello");
-	newsize=32+patch.GetTotalOutputSize();
-	offtout(newsize - len, header + 16);
-//	memcpy(*out+outWriteOffset, patch.GetOutput(), patch.GetTotalOutputSize());
-//	outWriteOffset+=patch.GetTotalOutputSize();
-//	patch.Clear(_FILE_AND_LINE_);
+	blocks = new DiffBlock[numBlocks];
+	for (blockIndex=0; blockIndex < numBlocks; blockIndex++)
+	{
+		off_t blockStart=(off_t)(((unsigned long long) newsize*blockIndex)/numBlocks);
+		off_t blockEnd=(off_t)(((unsigned long long) newsize*(blockIndex+1))/numBlocks);
+		blocks[blockIndex].I=I;
+		blocks[blockIndex].old=(u_char*)old;
+		blocks[blockIndex].oldsize=oldsize;
+		blocks[blockIndex]._new=(u_char*)_new+blockStart;
+		blocks[blockIndex].newsize=blockEnd-blockStart;
+		blocks[blockIndex].db=0;
+		blocks[blockIndex].eb=0;
+		blocks[blockIndex].dblen=0;
+		blocks[blockIndex].eblen=0;
+		blocks[blockIndex].lastpos=0;
+		blocks[blockIndex].success=false;
+	}
 
-	/* Write compressed extra data */
-//	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-//		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-//	BZ2_bzWrite(&bz2err, pfbz2, eb, eblen);
-	if (patch.Compress((char*)eb,eblen,true)==false)
+	if (numBlocks==1)
 	{
-		free(db);
-		free(eb);
-		free(I);
-		return false;
+		blocks[0].success=DiffBlockRun(&blocks[0]);
 	}
-//	memcpy(*out+outWriteOffset, patch.GetOutput(), patch.GetTotalOutputSize());
-//	outWriteOffset+=patch.GetTotalOutputSize();
-//	patch.Clear(_FILE_AND_LINE_);
-//	if (bz2err != BZ_OK)
-//		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-//	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-//	if (bz2err != BZ_OK)
-//		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+	else
+	{
+		for (blockIndex=0; blockIndex < numBlocks; blockIndex++)
+			pool.AddInput(DiffBlockThread, &blocks[blockIndex]);
+		WaitForPatchJobs(&pool, numBlocks);
+	}
+	if (poolPtr)
+		pool.StopThreads();
 
-	/* Seek to the beginning, write the header, and close the file */
-//	if (fseeko(pf, 0, SEEK_SET))
-//		err(1, "fseeko");
-//	if (fwrite(header, 32, 1, pf) != 1)
-//		err(1, "fwrite(%s)", argv[3]);
-//	if (fclose(pf))
-//		err(1, "fclose");
-
-//	memcpy(*out,header,32);
-//	*out=(char*) realloc(*out, outWriteOffset);
-//	*outSize=outWriteOffset;
-
-	*outSize=patch.GetTotalOutputSize()+32;
-	*out = new char [*outSize];
-	memcpy(*out, header, 32);
-	memcpy(*out+32, patch.GetOutput(), patch.GetTotalOutputSize());
-	
+	ctrlLength=0;
+	for (blockIndex=0; blockIndex < numBlocks; blockIndex++)
+	{
+		if (blocks[blockIndex].success==false)
+			success=false;
+		ctrlLength+=blocks[blockIndex].ctrl.Size()*8;
+	}
+
+	/* Header is
+		0	8	 "BSDIFF40"
+		8	8	length of bzip2ed ctrl block
+		16	8	length of bzip2ed diff block
+		24	8	length of new file */
+	/* File is
+		0	32	Header
+		32	??	Bzip2ed ctrl block
+		??	??	Bzip2ed diff block
+		??	??	Bzip2ed extra block */
+
+	memcpy(header,"BSDIFF40",8);
+	offtout(0, header + 8);
+	offtout(0, header + 16);
+	offtout(newsize, header + 24);
+
+	ctrlBuf=0;
+	if (success)
+	{
+		ctrlBuf=(u_char*)malloc(ctrlLength+1);
+		if (ctrlBuf==0)
+			success=false;
+	}
+	if (success)
+	{
+		unsigned ctrlOffset=0;
+		for (blockIndex=0; blockIndex < numBlocks; blockIndex++)
+		{
+			DataStructures::List<off_t> &ctrl=blocks[blockIndex].ctrl;
+			// Seek back to the start of old, where the next block begins
+			if (blockIndex+1 < numBlocks)
+				ctrl[ctrl.Size()-1]-=blocks[blockIndex].lastpos;
+			for (i=0; i < (off_t) ctrl.Size(); i++)
+			{
+				offtout(ctrl[(unsigned) i],ctrlBuf+ctrlOffset);
+				ctrlOffset+=8;
+			}
+		}
+		success=patch.Compress((char*)ctrlBuf, ctrlLength, true);
+	}
+
+	if (success)
+	{
+		len=patch.GetTotalOutputSize()+32;
+		offtout(len-32, header + 8);
+
+		/* Write compressed diff data */
+		for (blockIndex=0; blockIndex < numBlocks && success; blockIndex++)
+			success=patch.Compress((char*)blocks[blockIndex].db,blocks[blockIndex].dblen,blockIndex+1==numBlocks);
+	}
+
+	if (success)
+	{
+		/* Compute size of compressed diff data */
+		offtout(32+patch.GetTotalOutputSize() - len, header + 16);
+
+		/* Write compressed extra data */
+		for (blockIndex=0; blockIndex < numBlocks && success; blockIndex++)
+			success=patch.Compress((char*)blocks[blockIndex].eb,blocks[blockIndex].eblen,blockIndex+1==numBlocks);
+	}
+
+	if (success)
+	{
+		*outSize=patch.GetTotalOutputSize()+32;
+		*out = new char [*outSize];
+		memcpy(*out, header, 32);
+		memcpy(*out+32, patch.GetOutput(), patch.GetTotalOutputSize());
+	}
 
 	/* Free the memory we used */
-	free(db);
-	free(eb);
+	if (ctrlBuf)
+		free(ctrlBuf);
+	for (blockIndex=0; blockIndex < numBlocks; blockIndex++)
+	{
+		if (blocks[blockIndex].db)
+			free(blocks[blockIndex].db);
+		if (blocks[blockIndex].eb)
+			free(blocks[blockIndex].eb);
+	}
+	delete [] blocks;
 	free(I);
-	//free(old);
-	//free(new);
 
-	return true;
+	return success;
 }
 
 
@@ -616,7 +748,7 @@ int DIFF_main(int argc,char *argv[])
 	if(((I=(off_t*)malloc((oldsize+1)*sizeof(off_t)))==NULL) ||
 		((V=(off_t*)malloc((oldsize+1)*sizeof(off_t)))==NULL)) err(1,NULL);
 
-	qsufsort(I,V,old,oldsize);
+	qsufsort(I,V,old,oldsize,0,1);
 
 	free(V);
 
@@ -1,3 +1,7 @@
 /// Given \a old and \a new , return \a out which will contain a patch to get from \a old to \a new .  \a out is allocated for you.
 bool CreatePatch(const char *old, unsigned oldsize, char *_new, unsigned int newsize, char **out, unsigned *outSize);
 
+/// Same as CreatePatch() above, but sorts \a old and diffs blocks of \a _new on \a numThreads threads. The result is read by ApplyPatch() as usual.
+/// Files under a megabyte are still done on the calling thread. Large files split into blocks may give a slightly larger patch than with one thread.
+/// The parallel sort reads ranks from a snapshot, which costs another (oldsize+1)*sizeof(off_t) bytes and somewhat more total work, so only use this with idle cores.
+bool CreatePatch(const char *old, unsigned oldsize, char *_new, unsigned int newsize, char **out, unsigned *outSize, int numThreads);
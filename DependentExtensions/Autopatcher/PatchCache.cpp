@@ -0,0 +1,139 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "PatchCache.h"
+#include "CreatePatch.h"
+#include "FileOperations.h"
+#include <stdio.h>
+#include <string.h>
+
+using namespace RakNet;
+
+static void HashContent(const char *data, unsigned dataLength, unsigned char hash[SHA1_LENGTH])
+{
+	CSHA1 sha1;
+	sha1.Reset();
+	sha1.Update((unsigned char*) data, dataLength);
+	sha1.Final();
+	memcpy(hash, sha1.GetHash(), SHA1_LENGTH);
+}
+
+PatchCache::PatchCache()
+{
+	numThreads=1;
+	cacheHits=0;
+	cacheMisses=0;
+}
+PatchCache::~PatchCache()
+{
+}
+void PatchCache::SetCacheDirectory(const char *_cacheDirectory, int _numThreads)
+{
+	cacheDirectory=_cacheDirectory;
+	if (cacheDirectory.IsEmpty()==false && IsSlash(cacheDirectory.C_String()[cacheDirectory.GetLength()-1])==false)
+		cacheDirectory+="/";
+	numThreads=_numThreads;
+}
+bool PatchCache::GetPatch(const char *old, unsigned oldsize, char *_new, unsigned int newsize, char **out, unsigned *outSize)
+{
+	if (cacheDirectory.IsEmpty())
+		return CreatePatch(old, oldsize, _new, newsize, out, outSize, numThreads);
+
+	unsigned char oldHash[SHA1_LENGTH], newHash[SHA1_LENGTH];
+	RakNet::RakString path;
+	HashContent(old, oldsize, oldHash);
+	HashContent(_new, newsize, newHash);
+	GetCachePath(oldHash, newHash, path);
+
+	if (ReadPatch(path.C_String(), out, outSize))
+	{
+		statsMutex.Lock();
+		cacheHits++;
+		statsMutex.Unlock();
+		return true;
+	}
+
+	statsMutex.Lock();
+	unsigned int missIndex=++cacheMisses;
+	statsMutex.Unlock();
+
+	if (CreatePatch(old, oldsize, _new, newsize, out, outSize, numThreads)==false)
+		return false;
+
+	// Failing to cache is not an error, the patch is still valid
+	WritePatch(path.C_String(), missIndex, *out, *outSize);
+	return true;
+}
+unsigned int PatchCache::GetCacheHits(void) const
+{
+	return cacheHits;
+}
+unsigned int PatchCache::GetCacheMisses(void) const
+{
+	return cacheMisses;
+}
+void PatchCache::GetCachePath(const unsigned char oldHash[SHA1_LENGTH], const unsigned char newHash[SHA1_LENGTH], RakNet::RakString &path) const
+{
+	char hex[SHA1_LENGTH*4+2];
+	int i;
+	for (i=0; i < SHA1_LENGTH; i++)
+		sprintf(hex+i*2, "%02x", oldHash[i]);
+	hex[SHA1_LENGTH*2]='_';
+	for (i=0; i < SHA1_LENGTH; i++)
+		sprintf(hex+SHA1_LENGTH*2+1+i*2, "%02x", newHash[i]);
+	// Spread files over 256 subdirectories, so directories stay small with many patches
+	path=cacheDirectory;
+	path.AppendBytes(hex, 2);
+	path+="/";
+	path+=hex;
+	path+=".bsdiff";
+}
+bool PatchCache::ReadPatch(const char *path, char **out, unsigned *outSize) const
+{
+	FILE *fp = fopen(path, "rb");
+	if (fp==0)
+		return false;
+	fseek(fp, 0, SEEK_END);
+	long length = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if (length<=0)
+	{
+		fclose(fp);
+		return false;
+	}
+	*out = new char [length];
+	if (fread(*out, 1, length, fp)!=(size_t) length)
+	{
+		delete [] *out;
+		*out=0;
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+	*outSize=(unsigned) length;
+	return true;
+}
+bool PatchCache::WritePatch(const char *path, unsigned int missIndex, const char *patch, unsigned patchSize) const
+{
+	// Write under a unique name then rename, so a reader never sees a partial patch
+	RakNet::RakString tempPath("%s.%p.%u.tmp", path, this, missIndex);
+	if (WriteFileWithDirectories(tempPath.C_String(), (char*) patch, patchSize)==false)
+		return false;
+#ifdef _WIN32
+	// rename does not replace an existing file on Windows
+	remove(path);
+#endif
+	if (rename(tempPath.C_String(), path)!=0)
+	{
+		remove(tempPath.C_String());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,62 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief On-disk cache of patches created by CreatePatch(), keyed by the hashes of the old and new file contents.
+
+#ifndef __PATCH_CACHE_H
+#define __PATCH_CACHE_H
+
+#include "Export.h"
+#include "RakString.h"
+#include "SimpleMutex.h"
+#include "DR_SHA1.h"
+
+namespace RakNet
+{
+
+/// Remembers every patch generated, not just the most recent one, as a file named after the SHA1 of the old and new contents.
+/// Files that have already been diffed, such as when the same content is uploaded again under a different application, are not diffed again.
+/// Files in the cache directory are written to a temporary name then renamed, so several servers can share one directory.
+class RAK_DLL_EXPORT PatchCache
+{
+public:
+	PatchCache();
+	~PatchCache();
+
+	/// \param[in] _cacheDirectory Where to store patches. Created if it does not exist.
+	/// \param[in] _numThreads Passed to CreatePatch() on a cache miss
+	void SetCacheDirectory(const char *_cacheDirectory, int _numThreads=1);
+
+	/// Same as CreatePatch(), but returns a copy of the patch from disk if it was created before
+	/// \param[out] out Allocated with new [], same as CreatePatch()
+	/// \return true on success, false if CreatePatch() failed
+	bool GetPatch(const char *old, unsigned oldsize, char *_new, unsigned int newsize, char **out, unsigned *outSize);
+
+	/// Number of GetPatch() calls that were read from disk
+	unsigned int GetCacheHits(void) const;
+
+	/// Number of GetPatch() calls that ran CreatePatch()
+	unsigned int GetCacheMisses(void) const;
+
+protected:
+	void GetCachePath(const unsigned char oldHash[SHA1_LENGTH], const unsigned char newHash[SHA1_LENGTH], RakNet::RakString &path) const;
+	bool ReadPatch(const char *path, char **out, unsigned *outSize) const;
+	bool WritePatch(const char *path, unsigned int missIndex, const char *patch, unsigned patchSize) const;
+
+	RakNet::RakString cacheDirectory;
+	int numThreads;
+	unsigned int cacheHits, cacheMisses;
+	RakNet::SimpleMutex statsMutex;
+};
+
+} // namespace RakNet
+
+#endif
@@ -11,14 +11,7 @@
 #include "ProfanityFilter.h"
 #include "Rand.h"
 #include "RakAssert.h"
-#include "LinuxStrings.h"
-
-#if defined(_WIN32)
-#include <malloc.h> // alloca
-#elif (defined(__GNUC__)  || defined(__GCCXML__))
-#include <alloca.h>
-#else
-#endif
+#include <string.h>
 
 using namespace RakNet;
 
@@ -27,6 +20,7 @@ char ProfanityFilter::WORDCHARS[] = "abcdefghijklmnopqrstuvwxyz0123456789";
 
 ProfanityFilter::ProfanityFilter()
 {
+	AddNode();
 }
 
 ProfanityFilter::~ProfanityFilter()
@@ -51,46 +45,44 @@ int ProfanityFilter::FilterProfanity(const char *input, char *output, bool filte
 		return 0;
 
 	int count = 0;
-	char* b = (char *) alloca(strlen(input) + 1); 
-	strcpy(b, input);
-	_strlwr(b);
-	char *start = b;
-	if (output)
+	// RoomsPlugin filters chat in place
+	if (output && output!=input)
 		strcpy(output,input);
 
-	start = strpbrk(start, WORDCHARS);
-	while (start != 0)
+	const char *c = input;
+	const char *start;
+	int node, symbol;
+	while (*c)
 	{
-		size_t len = strspn(start, WORDCHARS);
-		if (len > 0)
+		if (GetWordSymbol(*c) < 0)
 		{
-			// we a have a word - let's check if it's a BAAAD one
-			char saveChar = start[len];
-			start[len] = '\0';
+			c++;
+			continue;
+		}
 
-			// loop through profanity list			
-			for (unsigned int i = 0, size = words.Size(); i < size; i++)
+		// we a have a word - walk it through the trie to see if it's a BAAAD one
+		start = c;
+		node = 0;
+		while ((symbol = GetWordSymbol(*c)) >= 0)
+		{
+			if (node >= 0)
 			{
-				if (_stricmp(start, words[i].C_String()) == 0)
-				{
-					count++;
-
-					// size_t len = words[i].size();
-					if (filter && output)
-					{
-						for (unsigned int j = 0; j < len; j++)
-						{
-							output[start + j - b] = RandomBanChar();
-						}
-					}
-					break;
-				}				
+				node = transitions[node * WORD_SYMBOLS + symbol];
+				if (node == 0)
+					node = -1;
 			}
-			start[len] = saveChar;
+			c++;
 		}
 
-		start += len;
-		start = strpbrk(start, WORDCHARS);
+		if (node >= 0 && isWordEnd[node])
+		{
+			count++;
+			if (filter && output)
+			{
+				for (const char *p = start; p < c; p++)
+					output[p - input] = RandomBanChar();
+			}
+		}
 	}
 
 	return count;
@@ -103,4 +95,40 @@ int ProfanityFilter::Count()
 void ProfanityFilter::AddWord(RakNet::RakString newWord)
 {
 	words.Insert(newWord, _FILE_AND_LINE_ );
+
+	// Input is split into words at any character not in WORDCHARS, so other words never match
+	const char *c = newWord.C_String();
+	if (c[0]==0)
+		return;
+	int node = 0, symbol;
+	for (; *c; c++)
+	{
+		symbol = GetWordSymbol(*c);
+		if (symbol < 0)
+			return;
+		if (transitions[node * WORD_SYMBOLS + symbol] == 0)
+		{
+			int newNode = AddNode();
+			transitions[node * WORD_SYMBOLS + symbol] = newNode;
+		}
+		node = transitions[node * WORD_SYMBOLS + symbol];
+	}
+	isWordEnd[node] = true;
+}
+int ProfanityFilter::GetWordSymbol(char c)
+{
+	if (c >= 'a' && c <= 'z')
+		return c - 'a';
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= '0' && c <= '9')
+		return 26 + c - '0';
+	return -1;
+}
+int ProfanityFilter::AddNode(void)
+{
+	for (int i = 0; i < WORD_SYMBOLS; i++)
+		transitions.Insert(0, _FILE_AND_LINE_ );
+	isWordEnd.Insert(false, _FILE_AND_LINE_ );
+	return (int) isWordEnd.Size() - 1;
 }
\ No newline at end of file
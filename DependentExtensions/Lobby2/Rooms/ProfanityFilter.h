@@ -35,6 +35,15 @@ public:
 private:	
 	DataStructures::List<RakNet::RakString> words;
 
+	// Words are only matched whole, so a trie of them, walked once per word of the input, finds any of them in one pass
+	// Node n moves on symbol s to node transitions[n*WORD_SYMBOLS+s], 0 for no word continuing that way. Node 0 is the root
+	enum {WORD_SYMBOLS=36};
+	DataStructures::List<int> transitions;
+	DataStructures::List<bool> isWordEnd;
+	// Index into WORDCHARS, with upper case folded to lower case. -1 for characters that separate words
+	static int GetWordSymbol(char c);
+	int AddNode(void);
+
 	char RandomBanChar();
 
 	static char BANCHARS[];
@@ -14,6 +14,8 @@
 #include "GetTime.h"
 #include "BitStream.h"
 #include "TableSerializer.h"
+#include "SuperFastHash.h"
+#include <stdio.h>
 
 static const RakNet::TimeMS MINIMUM_QUICK_JOIN_TIMEOUT=5000;
 static const RakNet::TimeMS MAXIMUM_QUICK_JOIN_TIMEOUT=60000 * 5;
@@ -38,6 +40,7 @@ QuickJoinUser::QuickJoinUser()
 {
 	networkedQuickJoinUser.query.queries=0;
 	totalTimeWaiting=0;
+	queryGroup=0;
 }
 QuickJoinUser::~QuickJoinUser()
 {
@@ -509,7 +512,7 @@ RoomsErrorCode AllGamesRoomsContainer::JoinByFilter(GameIdentifier gameIdentifie
 }
 RoomsErrorCode AllGamesRoomsContainer::LeaveRoom(RoomsParticipant* roomsParticipant, RemoveUserResult *removeUserResult)
 {
-	if (roomsParticipant->GetRoom()==false)
+	if (roomsParticipant->GetRoom()==0)
 		return REC_LEAVE_ROOM_NOT_IN_ROOM;
 	else if (roomsParticipant->GetInQuickJoin())
 		return REC_LEAVE_ROOM_CURRENTLY_IN_QUICK_JOIN;
@@ -704,6 +707,7 @@ RoomsErrorCode AllGamesRoomsContainer::SetCustomRoomProperties(RoomsParticipant*
 		row = roomsParticipant->GetRoom()->tableRow;
 		*(row->cells[oldTableIndex])=*(table->GetRowByIndex(0,0)->cells[newTableIndex]);		
 	}
+	roomsParticipant->GetRoom()->OnPropertiesChanged();
 	return REC_SUCCESS;
 }
 void AllGamesRoomsContainer::GetRoomProperties(RoomID roomId, Room **room, DataStructures::Table *table)
@@ -861,7 +865,8 @@ RoomsErrorCode AllGamesRoomsContainer::ProcessQuickJoins(
 	joinedRoomMembers.Clear(false, _FILE_AND_LINE_);
 	for (i=0; i < perGamesRoomsContainers.Size(); i++)
 	{
-		numRoomsCreated=perGamesRoomsContainers[i]->ProcessQuickJoins(timeoutExpired, joinedRoomMembers, dereferencedPointers, elapsedTime, nextRoomId);
+		// nextRoomId was the last ID used
+		numRoomsCreated=perGamesRoomsContainers[i]->ProcessQuickJoins(timeoutExpired, joinedRoomMembers, dereferencedPointers, elapsedTime, nextRoomId+1);
 		nextRoomId += numRoomsCreated;
 	}
 	unsigned int j;
@@ -877,6 +882,251 @@ RoomsErrorCode AllGamesRoomsContainer::AddTitle(GameIdentifier gameIdentifier)
 	return REC_SUCCESS;
 }
 
+// ----------------------------  RoomPropertyIndex  ----------------------------
+
+// Keys below these are never hashes
+static const unsigned int PROPERTY_INDEX_NOT_FILED=0;
+static const unsigned int PROPERTY_INDEX_UNKEYED=1;
+
+RoomPropertyIndex::RoomPropertyIndex()
+{
+}
+RoomPropertyIndex::~RoomPropertyIndex()
+{
+	unsigned int i,j;
+	for (i=0; i < indexedColumns.Size(); i++)
+	{
+		DataStructures::List<DataStructures::List<Room*>*> keyRooms;
+		DataStructures::List<unsigned int> keys;
+		indexedColumns[i]->rooms.GetAsList(keyRooms, keys, _FILE_AND_LINE_);
+		for (j=0; j < keyRooms.Size(); j++)
+			delete keyRooms[j];
+		delete indexedColumns[i];
+	}
+}
+void RoomPropertyIndex::AddRoom(Room *room)
+{
+	room->propertyIndex=this;
+	room->propertyIndexChanged=false;
+	MarkChanged(room);
+}
+void RoomPropertyIndex::RemoveRoom(Room *room)
+{
+	unsigned int i;
+	for (i=0; i < indexedColumns.Size() && i < room->propertyIndexEntries.Size(); i++)
+		Unfile(i, room);
+	if (room->propertyIndexChanged)
+	{
+		changedRooms.RemoveAtIndexFast(changedRooms.GetIndexOf(room));
+		room->propertyIndexChanged=false;
+	}
+	room->propertyIndex=0;
+}
+void RoomPropertyIndex::MarkChanged(Room *room)
+{
+	// Until something is indexed, rooms are filed when a column is first indexed
+	if (indexedColumns.Size()==0 || room->propertyIndexChanged)
+		return;
+	room->propertyIndexChanged=true;
+	changedRooms.Insert(room, _FILE_AND_LINE_ );
+}
+bool RoomPropertyIndex::GetCandidates(DataStructures::Table *roomsTable, DataStructures::Table::FilterQuery *queries, unsigned int numQueries, DataStructures::List<unsigned> &roomIds)
+{
+	roomIds.Clear(true, _FILE_AND_LINE_);
+	if (queries==0 || numQueries==0)
+		return false;
+
+	UpdateChangedRooms();
+
+	// Of the queries that can use an index, the one passing the fewest rooms
+	DataStructures::List<Room*> *bestRooms=0;
+	IndexedColumn *bestColumn=0;
+	unsigned int bestSize=(unsigned int) -1;
+	unsigned int queryIndex, columnIndex, size;
+	// Indexed column and key of each query that can use an index
+	unsigned int termColumns[32], termKeys[32];
+	unsigned int numTerms=0;
+	for (queryIndex=0; queryIndex < numQueries; queryIndex++)
+	{
+		DataStructures::Table::FilterQuery *query = &queries[queryIndex];
+		if (query->operation!=DataStructures::Table::QF_EQUAL || query->cellValue==0 || query->cellValue->isEmpty)
+			continue;
+		if (query->columnName[0])
+			columnIndex=roomsTable->ColumnIndex(query->columnName);
+		else
+			columnIndex=query->columnIndex;
+		if (columnIndex>=roomsTable->GetColumnCount())
+			continue;
+		DataStructures::Table::ColumnType columnType = roomsTable->GetColumnType(columnIndex);
+		if (columnType!=DataStructures::Table::NUMERIC && columnType!=DataStructures::Table::STRING)
+			continue;
+		// QueryTable() skips string comparisons without a string
+		if (columnType==DataStructures::Table::STRING && query->cellValue->c==0)
+			continue;
+
+		IndexedColumn *indexedColumn = GetIndexedColumn(roomsTable, columnIndex);
+		unsigned int key = GetKey(query->cellValue, columnType);
+		if (numTerms < sizeof(termKeys)/sizeof(termKeys[0]))
+		{
+			termColumns[numTerms]=indexedColumns.GetIndexOf(indexedColumn);
+			termKeys[numTerms]=key;
+			numTerms++;
+		}
+		DataStructures::List<Room*> *keyRooms = GetKeyRooms(indexedColumn, key, false);
+		size = indexedColumn->unkeyedRooms.Size();
+		if (keyRooms)
+			size+=keyRooms->Size();
+		if (bestColumn==0 || size < bestSize)
+		{
+			bestColumn=indexedColumn;
+			bestRooms=keyRooms;
+			bestSize=size;
+		}
+	}
+	if (bestColumn==0)
+		return false;
+
+	unsigned int i;
+	if (bestRooms)
+	{
+		for (i=0; i < bestRooms->Size(); i++)
+			AddCandidate((*bestRooms)[i], termColumns, termKeys, numTerms, roomIds);
+	}
+	for (i=0; i < bestColumn->unkeyedRooms.Size(); i++)
+		AddCandidate(bestColumn->unkeyedRooms[i], termColumns, termKeys, numTerms, roomIds);
+	return true;
+}
+void RoomPropertyIndex::AddCandidate(Room *room, unsigned int *termColumns, unsigned int *termKeys, unsigned int numTerms, DataStructures::List<unsigned> &roomIds)
+{
+	// Rooms filed under another key in any of the other indexed columns cannot pass
+	unsigned int i, key;
+	for (i=0; i < numTerms; i++)
+	{
+		key = room->propertyIndexEntries[termColumns[i]].key;
+		if (key!=termKeys[i] && key!=PROPERTY_INDEX_UNKEYED)
+			return;
+	}
+	roomIds.Insert(room->GetID(), _FILE_AND_LINE_ );
+}
+RoomPropertyIndex::IndexedColumn* RoomPropertyIndex::GetIndexedColumn(DataStructures::Table *roomsTable, unsigned int columnIndex)
+{
+	unsigned int i;
+	for (i=0; i < indexedColumns.Size(); i++)
+	{
+		if (indexedColumns[i]->columnIndex==columnIndex)
+			return indexedColumns[i];
+	}
+
+	IndexedColumn *indexedColumn = new IndexedColumn;
+	indexedColumn->columnIndex=columnIndex;
+	indexedColumn->columnType=roomsTable->GetColumnType(columnIndex);
+	indexedColumns.Insert(indexedColumn, _FILE_AND_LINE_ );
+
+	// File every room under the new column
+	DataStructures::Page<unsigned, DataStructures::Table::Row*, _TABLE_BPLUS_TREE_ORDER> *cur = roomsTable->GetRows().GetListHead();
+	int j;
+	while (cur)
+	{
+		for (j=0; j < cur->size; j++)
+			File(indexedColumns.Size()-1, (Room*)cur->data[j]->cells[DefaultRoomColumns::TC_LOBBY_ROOM_PTR]->ptr);
+		cur=cur->next;
+	}
+	return indexedColumn;
+}
+DataStructures::List<Room*> *RoomPropertyIndex::GetKeyRooms(IndexedColumn *indexedColumn, unsigned int key, bool create)
+{
+	if (key==PROPERTY_INDEX_UNKEYED)
+		return &indexedColumn->unkeyedRooms;
+	DataStructures::List<Room*> **keyRooms = indexedColumn->rooms.Peek(key);
+	if (keyRooms)
+		return *keyRooms;
+	if (create==false)
+		return 0;
+	DataStructures::List<Room*> *newKeyRooms = new DataStructures::List<Room*>;
+	indexedColumn->rooms.Push(key, newKeyRooms, _FILE_AND_LINE_ );
+	return newKeyRooms;
+}
+void RoomPropertyIndex::File(unsigned int indexedColumnIndex, Room *room)
+{
+	IndexedColumn *indexedColumn = indexedColumns[indexedColumnIndex];
+	unsigned int key = GetKey(room->tableRow->cells[indexedColumn->columnIndex], indexedColumn->columnType);
+	while (room->propertyIndexEntries.Size() <= indexedColumnIndex)
+	{
+		Entry entry;
+		entry.key=PROPERTY_INDEX_NOT_FILED;
+		entry.position=0;
+		room->propertyIndexEntries.Insert(entry, _FILE_AND_LINE_ );
+	}
+	if (room->propertyIndexEntries[indexedColumnIndex].key==key)
+		return;
+	Unfile(indexedColumnIndex, room);
+	// Empty cells pass no QF_EQUAL query
+	if (key==PROPERTY_INDEX_NOT_FILED)
+		return;
+	DataStructures::List<Room*> *keyRooms = GetKeyRooms(indexedColumn, key, true);
+	room->propertyIndexEntries[indexedColumnIndex].key=key;
+	room->propertyIndexEntries[indexedColumnIndex].position=keyRooms->Size();
+	keyRooms->Insert(room, _FILE_AND_LINE_ );
+}
+void RoomPropertyIndex::Unfile(unsigned int indexedColumnIndex, Room *room)
+{
+	Entry *entry = &room->propertyIndexEntries[indexedColumnIndex];
+	if (entry->key==PROPERTY_INDEX_NOT_FILED)
+		return;
+	IndexedColumn *indexedColumn = indexedColumns[indexedColumnIndex];
+	DataStructures::List<Room*> *keyRooms = GetKeyRooms(indexedColumn, entry->key, false);
+	RakAssert(keyRooms && (*keyRooms)[entry->position]==room);
+
+	// Move the last room into the place of this one
+	unsigned int last = keyRooms->Size()-1;
+	if (entry->position!=last)
+	{
+		Room *moved = (*keyRooms)[last];
+		(*keyRooms)[entry->position]=moved;
+		moved->propertyIndexEntries[indexedColumnIndex].position=entry->position;
+	}
+	keyRooms->RemoveFromEnd();
+	if (keyRooms->Size()==0 && entry->key!=PROPERTY_INDEX_UNKEYED)
+	{
+		indexedColumn->rooms.Remove(entry->key, _FILE_AND_LINE_ );
+		delete keyRooms;
+	}
+	entry->key=PROPERTY_INDEX_NOT_FILED;
+}
+void RoomPropertyIndex::UpdateChangedRooms(void)
+{
+	unsigned int i,j;
+	for (i=0; i < changedRooms.Size(); i++)
+	{
+		for (j=0; j < indexedColumns.Size(); j++)
+			File(j, changedRooms[i]);
+		changedRooms[i]->propertyIndexChanged=false;
+	}
+	changedRooms.Clear(true, _FILE_AND_LINE_);
+}
+unsigned int RoomPropertyIndex::GetKey(const DataStructures::Table::Cell *cell, DataStructures::Table::ColumnType columnType)
+{
+	if (cell->isEmpty)
+		return PROPERTY_INDEX_NOT_FILED;
+	unsigned int key;
+	if (columnType==DataStructures::Table::STRING)
+	{
+		if (cell->c==0)
+			return PROPERTY_INDEX_UNKEYED;
+		key = SuperFastHash(cell->c, (int) strlen(cell->c));
+	}
+	else
+	{
+		// So 0 and -0, which compare equal, hash the same
+		double value = cell->i==0.0 ? 0.0 : cell->i;
+		key = SuperFastHash((const char*) &value, sizeof(value));
+	}
+	// Hashes only have to be equal for equal values, so colliding with the reserved keys is harmless
+	if (key<=PROPERTY_INDEX_UNKEYED)
+		key+=PROPERTY_INDEX_UNKEYED+1;
+	return key;
+}
+
 // ----------------------------  PerGameRoomsContainer  ----------------------------
 
 PerGameRoomsContainer::PerGameRoomsContainer()
@@ -904,6 +1154,7 @@ RoomsErrorCode PerGameRoomsContainer::CreateRoom(RoomCreationParameters *roomCre
 	DataStructures::List<DataStructures::Table::Cell> initialCellValues;
 	DataStructures::Table::Row *row = roomsTable.AddRow(lobbyRoomId,initialCellValues);
 	roomCreationParameters->roomOutput = new Room(lobbyRoomId, roomCreationParameters, row, roomCreationParameters->firstUser);
+	propertyIndex.AddRoom(roomCreationParameters->roomOutput);
 	roomCreationParameters->firstUser->SetPerGameRoomsContainer(this);
 	RakAssert(roomCreationParameters->firstUser->GetRoom()==roomCreationParameters->roomOutput);
 	return REC_SUCCESS;
@@ -981,6 +1232,34 @@ int PerGameRoomsContainer::RoomsSortByTimeThenTotalSlots( Room* const &key, Room
 		return 1;
 	return strcmp(key->GetStringProperty(DefaultRoomColumns::TC_ROOM_NAME),data->GetStringProperty(DefaultRoomColumns::TC_ROOM_NAME));
 }
+// Equal for equal queries, so members waiting with the same query can share the rooms it passes
+static void GetQueryKey(RoomQuery *roomQuery, RakNet::RakString &key)
+{
+	key.Clear();
+	if (roomQuery->queries==0)
+		return;
+	char buff[128];
+	unsigned int i;
+	int j;
+	for (i=0; i < roomQuery->numQueries; i++)
+	{
+		DataStructures::Table::FilterQuery *query = &roomQuery->queries[i];
+		DataStructures::Table::Cell *cell = query->cellValue;
+		key+=query->columnName;
+		sprintf(buff, "|%u|%i|%i|%.17g|%p|", query->columnIndex, (int) query->operation, (int) cell->isEmpty, cell->i, cell->ptr);
+		key+=buff;
+		// Strings and binary data are i bytes long
+		if (cell->c)
+		{
+			for (j=0; j < (int) cell->i; j++)
+			{
+				sprintf(buff, "%02x", (unsigned char) cell->c[j]);
+				key+=buff;
+			}
+		}
+		key+=";";
+	}
+}
 unsigned PerGameRoomsContainer::ProcessQuickJoins( DataStructures::List<QuickJoinUser*> &timeoutExpired,
 					   DataStructures::List<JoinedRoomResult> &joinedRoomMembers,
 					   DataStructures::List<QuickJoinUser*> &dereferencedPointers,
@@ -999,29 +1278,67 @@ unsigned PerGameRoomsContainer::ProcessQuickJoins( DataStructures::List<QuickJoi
 	RoomsErrorCode roomsErrorCode;
 	Room *room;
 	double totalRoomSlots, remainingRoomSlots;
-	DataStructures::OrderedList<Room*, Room*, RoomsSortByTimeThenTotalSlots> potentialRooms;
 	DataStructures::OrderedList<QuickJoinUser *, QuickJoinUser *, QuickJoinUser::SortByTotalTimeWaiting> quickJoinMemberTimeSort;
 	DataStructures::List<Room*> allRooms;
 	GetAllRooms(allRooms);
 
+	// Many members usually wait with the same query, so the work for a query is done once per group of members with equal queries
+	DataStructures::Hash<RakNet::RakString, unsigned int, 1024, RakNet::RakString::ToInteger> queryGroupsByKey;
+	RakNet::RakString queryKey;
+	unsigned int numQueryGroups=0, queryGroup;
+	for (quickJoinIndex=0; quickJoinIndex < quickJoinList.Size(); quickJoinIndex++)
+	{
+		GetQueryKey(&quickJoinList[quickJoinIndex]->networkedQuickJoinUser.query, queryKey);
+		unsigned int *existingGroup = queryGroupsByKey.Peek(queryKey);
+		if (existingGroup)
+			quickJoinList[quickJoinIndex]->queryGroup=*existingGroup;
+		else
+		{
+			queryGroupsByKey.Push(queryKey, numQueryGroups, _FILE_AND_LINE_ );
+			quickJoinList[quickJoinIndex]->queryGroup=numQueryGroups++;
+		}
+	}
+	queryGroupsByKey.Clear(_FILE_AND_LINE_);
+	// Rooms passing the query of each group, found when a member of the group first needs them
+	DataStructures::List<Room*> queryGroupRooms;
+	DataStructures::List<unsigned int> queryGroupFirstRoom, queryGroupNumRooms;
+
 	while (1)
 	{
 		// 1. Clear all quickJoinWorkingList from all rooms
 		for (roomIndex=0; roomIndex < allRooms.Size(); roomIndex++)
 			allRooms[roomIndex]->quickJoinWorkingList.Clear(true, _FILE_AND_LINE_ );
 
-		// 2. Use RoomPrioritySort to get all rooms they can potentially join
+		queryGroupRooms.Clear(true, _FILE_AND_LINE_ );
+		queryGroupFirstRoom.Clear(true, _FILE_AND_LINE_ );
+		queryGroupNumRooms.Clear(true, _FILE_AND_LINE_ );
+		for (queryGroup=0; queryGroup < numQueryGroups; queryGroup++)
+		{
+			queryGroupFirstRoom.Insert((unsigned int) -1, _FILE_AND_LINE_ );
+			queryGroupNumRooms.Insert(0, _FILE_AND_LINE_ );
+		}
+
+		// 2. Get all rooms they can potentially join
 		// 3. For each of these rooms, record that this member can potentially join by storing a copy of the pointer into quickJoinWorkingList, if minimumPlayers => total room slots
 		for (quickJoinIndex=0; quickJoinIndex < quickJoinList.Size(); quickJoinIndex++)
 		{
-			RoomPrioritySort( quickJoinList[quickJoinIndex]->roomsParticipant, &quickJoinList[quickJoinIndex]->networkedQuickJoinUser.query, potentialRooms );
+			QuickJoinUser *quickJoinUser = quickJoinList[quickJoinIndex];
+			queryGroup = quickJoinUser->queryGroup;
+			if (queryGroupFirstRoom[queryGroup]==(unsigned int) -1)
+			{
+				queryGroupFirstRoom[queryGroup]=queryGroupRooms.Size();
+				GetRoomsPassingQuery(&quickJoinUser->networkedQuickJoinUser.query, queryGroupRooms);
+				queryGroupNumRooms[queryGroup]=queryGroupRooms.Size()-queryGroupFirstRoom[queryGroup];
+			}
 
-			for (roomIndex=0; roomIndex < potentialRooms.Size(); roomIndex++)
+			for (roomIndex=queryGroupFirstRoom[queryGroup]; roomIndex < queryGroupFirstRoom[queryGroup]+queryGroupNumRooms[queryGroup]; roomIndex++)
 			{
-				totalRoomSlots = potentialRooms[roomIndex]->GetNumericProperty(DefaultRoomColumns::TC_TOTAL_PUBLIC_PLUS_RESERVED_SLOTS);
-				if (totalRoomSlots >= quickJoinList[quickJoinIndex]->networkedQuickJoinUser.minimumPlayers-1 &&
-					potentialRooms[roomIndex]->ParticipantCanJoinRoom(quickJoinList[quickJoinIndex]->roomsParticipant, false, true)==PCJRR_SUCCESS )
-					potentialRooms[roomIndex]->quickJoinWorkingList.Insert( quickJoinList[quickJoinIndex], _FILE_AND_LINE_  );
+				room = queryGroupRooms[roomIndex];
+				totalRoomSlots = room->GetNumericProperty(DefaultRoomColumns::TC_TOTAL_PUBLIC_PLUS_RESERVED_SLOTS);
+				if (totalRoomSlots >= quickJoinUser->networkedQuickJoinUser.minimumPlayers-1 &&
+					room->IsHiddenToParticipant(quickJoinUser->roomsParticipant)==false &&
+					room->ParticipantCanJoinRoom(quickJoinUser->roomsParticipant, false, true)==PCJRR_SUCCESS )
+					room->quickJoinWorkingList.Insert( quickJoinUser, _FILE_AND_LINE_  );
 			}
 		}
 
@@ -1034,11 +1351,24 @@ unsigned PerGameRoomsContainer::ProcessQuickJoins( DataStructures::List<QuickJoi
 			remainingRoomSlots = room->GetNumericProperty(DefaultRoomColumns::TC_REMAINING_PUBLIC_PLUS_RESERVED_SLOTS);
 			if (remainingRoomSlots>0 && room->quickJoinWorkingList.Size() >= (unsigned int) remainingRoomSlots)
 			{
+				// Members who filled an earlier room are no longer waiting
+				unsigned int numStillWaiting=0;
+				for (quickJoinIndex=0; quickJoinIndex < room->quickJoinWorkingList.Size(); quickJoinIndex++)
+				{
+					if (room->quickJoinWorkingList[quickJoinIndex]->roomsParticipant->GetInQuickJoin())
+						numStillWaiting++;
+				}
+				if (numStillWaiting < (unsigned int) remainingRoomSlots)
+					continue;
+
 				quickJoinMemberTimeSort.Clear(false, _FILE_AND_LINE_ );
 
 				// Sort those waiting in quick join from longest waiting to least waiting. Those longest waiting are processed first
 				for (quickJoinIndex=0; quickJoinIndex < (int) room->quickJoinWorkingList.Size(); quickJoinIndex++)
-					quickJoinMemberTimeSort.Insert( room->quickJoinWorkingList[quickJoinIndex], room->quickJoinWorkingList[quickJoinIndex], true, _FILE_AND_LINE_  );
+				{
+					if (room->quickJoinWorkingList[quickJoinIndex]->roomsParticipant->GetInQuickJoin())
+						quickJoinMemberTimeSort.Insert( room->quickJoinWorkingList[quickJoinIndex], room->quickJoinWorkingList[quickJoinIndex], true, _FILE_AND_LINE_  );
+				}
 
 				for (quickJoinIndex=0; quickJoinIndex < (unsigned) remainingRoomSlots; quickJoinIndex++)
 				{
@@ -1076,6 +1406,9 @@ unsigned PerGameRoomsContainer::ProcessQuickJoins( DataStructures::List<QuickJoi
 	QuickJoinUser *quickJoinMember;
 	RoomCreationParameters roomCreationParameters;
 	DataStructures::List<QuickJoinUser*> potentialNewRoommates;
+	// For each query group, 0 if not yet known, 1 if its members would not join the room of the current member, 2 if they would
+	DataStructures::List<unsigned char> queryGroupJoinsNewRoom;
+	bool createdRoom;
 
 	// 6. If the current member created a roomOutput, find out how many subsequent members would join based on the custom filter
 	quickJoinIndex=0;
@@ -1103,26 +1436,37 @@ unsigned PerGameRoomsContainer::ProcessQuickJoins( DataStructures::List<QuickJoi
 		}
 
 		potentialNewRoommates.Clear(true, _FILE_AND_LINE_ );
+		queryGroupJoinsNewRoom.Clear(true, _FILE_AND_LINE_ );
+		for (queryGroup=0; queryGroup < numQueryGroups; queryGroup++)
+			queryGroupJoinsNewRoom.Insert(0, _FILE_AND_LINE_ );
+		createdRoom=false;
 		for (quickJoinIndex2=quickJoinIndex+1; quickJoinIndex2 < quickJoinList.Size(); quickJoinIndex2++)
 		{
-			resultTable.Clear();
-			unsigned columnIndices[1];
-			columnIndices[0]=DefaultRoomColumns::TC_LOBBY_ROOM_PTR;
 			JoinedRoomResult joinedRoomResult;
 
-			DataStructures::Table::FilterQuery subQueries[MAX_CUSTOM_QUERY_FIELDS];
-			unsigned int subQueryCount;
-			unsigned int subQueryIndex;
-			for (subQueryIndex=0, subQueryCount=0; subQueryIndex < quickJoinList[quickJoinIndex2]->networkedQuickJoinUser.query.numQueries; subQueryIndex++)
+			// Members with the same query get the same answer
+			queryGroup = quickJoinList[quickJoinIndex2]->queryGroup;
+			if (queryGroupJoinsNewRoom[queryGroup]==0)
 			{
-				if (potentialNewRoom.ColumnIndex(quickJoinList[quickJoinIndex2]->networkedQuickJoinUser.query.queries[subQueryIndex].columnName)!=-1)
+				resultTable.Clear();
+				unsigned columnIndices[1];
+				columnIndices[0]=DefaultRoomColumns::TC_LOBBY_ROOM_PTR;
+
+				DataStructures::Table::FilterQuery subQueries[MAX_CUSTOM_QUERY_FIELDS];
+				unsigned int subQueryCount;
+				unsigned int subQueryIndex;
+				for (subQueryIndex=0, subQueryCount=0; subQueryIndex < quickJoinList[quickJoinIndex2]->networkedQuickJoinUser.query.numQueries; subQueryIndex++)
 				{
-					subQueries[subQueryCount++]=quickJoinList[quickJoinIndex2]->networkedQuickJoinUser.query.queries[subQueryIndex];
+					if (potentialNewRoom.ColumnIndex(quickJoinList[quickJoinIndex2]->networkedQuickJoinUser.query.queries[subQueryIndex].columnName)!=-1)
+					{
+						subQueries[subQueryCount++]=quickJoinList[quickJoinIndex2]->networkedQuickJoinUser.query.queries[subQueryIndex];
+					}
 				}
-			}
 
-			potentialNewRoom.QueryTable(columnIndices,1,subQueries,subQueryCount,0,0,&resultTable);
-			if (resultTable.GetRowCount()>0)
+				potentialNewRoom.QueryTable(columnIndices,1,subQueries,subQueryCount,0,0,&resultTable);
+				queryGroupJoinsNewRoom[queryGroup] = resultTable.GetRowCount()>0 ? 2 : 1;
+			}
+			if (queryGroupJoinsNewRoom[queryGroup]==2)
 			{
 				potentialNewRoommates.Insert(quickJoinList[quickJoinIndex2], _FILE_AND_LINE_ );
 				if (potentialNewRoommates.Size()>=(unsigned int) quickJoinMember->networkedQuickJoinUser.minimumPlayers-1)
@@ -1153,12 +1497,15 @@ unsigned PerGameRoomsContainer::ProcessQuickJoins( DataStructures::List<QuickJoi
 					joinedRoomMembers.Insert(joinedRoomResult, _FILE_AND_LINE_ );
 					RemoveUserFromQuickJoin(quickJoinMember->roomsParticipant, &qju);
 					dereferencedPointers.Insert(qju, _FILE_AND_LINE_ );
-					continue;
+					// quickJoinIndex now holds the next member
+					createdRoom=true;
+					break;
 				}
 			}
 		}
 
-		quickJoinIndex++;
+		if (createdRoom==false)
+			quickJoinIndex++;
 	}
 
 
@@ -1192,6 +1539,7 @@ bool PerGameRoomsContainer::DestroyRoomIfDead(Room *room)
 {
 	if (roomsTable.GetRowByID(room->GetID())==room->tableRow)
 	{
+		propertyIndex.RemoveRoom(room);
 		roomsTable.RemoveRow(room->GetID());
 		delete room;
 		return true;
@@ -1209,73 +1557,79 @@ void PerGameRoomsContainer::ChangeHandle(RakNet::RakString oldHandle, RakNet::Ra
 
 RoomsErrorCode PerGameRoomsContainer::SearchByFilter( RoomsParticipant* roomsParticipant, RoomQuery *roomQuery, DataStructures::OrderedList<Room*, Room*, AllGamesRoomsContainer::RoomsSortByName> &roomsOutput, bool onlyJoinable )
 {
-	DataStructures::Table resultTable;
-	unsigned columnIndices[1];
-	columnIndices[0]=DefaultRoomColumns::TC_LOBBY_ROOM_PTR;
-
 	// Process user queries
-	roomsTable.QueryTable(columnIndices,1,roomQuery->queries,roomQuery->numQueries,0,0,&resultTable);
+	DataStructures::List<Room*> rooms;
+	GetRoomsPassingQuery(roomQuery, rooms);
 
 	roomsOutput.Clear(false, _FILE_AND_LINE_);
-	DataStructures::Page<unsigned, DataStructures::Table::Row*, _TABLE_BPLUS_TREE_ORDER> *cur = resultTable.GetRows().GetListHead();
-	int i;
+	unsigned i;
 	Room *room;
-	while (cur)
+	for (i=0; i < rooms.Size(); i++)
 	{
-		for (i=0; i < cur->size; i++)
-		{
-			// Put all the pointers in the roomSort list, filtering out those you cannot join (full, or no public and you are not invited)
-			room = (Room*) cur->data[i]->cells[0]->ptr;
-			if ( (onlyJoinable==false || room->ParticipantCanJoinRoom(roomsParticipant, false, true)==PCJRR_SUCCESS) &&
-				room->IsHiddenToParticipant(roomsParticipant)==false)
-				roomsOutput.Insert(room,room,true, _FILE_AND_LINE_ );
-		}
-		cur=cur->next;
+		// Put all the pointers in the roomSort list, filtering out those you cannot join (full, or no public and you are not invited)
+		room = rooms[i];
+		if ( (onlyJoinable==false || room->ParticipantCanJoinRoom(roomsParticipant, false, true)==PCJRR_SUCCESS) &&
+			room->IsHiddenToParticipant(roomsParticipant)==false)
+			roomsOutput.Insert(room,room,true, _FILE_AND_LINE_ );
 	}
 	return REC_SUCCESS;
 }
 void PerGameRoomsContainer::RoomPrioritySort( RoomsParticipant* roomsParticipant, RoomQuery *roomQuery, DataStructures::OrderedList<Room*, Room*, RoomsSortByTimeThenTotalSlots> &roomsOutput )
 {
+	// Must pass room query. If you don't care about room filters, just join any room
+	// Of those that pass room query, sort by time (lower is first). If within one minute of each other, sort by number of users in playable slots (higher if first)
+	DataStructures::List<Room*> rooms;
+	GetRoomsPassingQuery(roomQuery, rooms);
+
+	roomsOutput.Clear(false, _FILE_AND_LINE_);
+	unsigned i;
+	Room *room;
+	for (i=0; i < rooms.Size(); i++)
+	{
+		// Put all the pointers in the roomSort list, filtering out those you cannot join (full, or no public and you are not invited)
+		room = rooms[i];
+		if (room->ParticipantCanJoinRoom(roomsParticipant, false, true)==PCJRR_SUCCESS &&
+			room->IsHiddenToParticipant(roomsParticipant)==false)
+			roomsOutput.Insert(room,room,true, _FILE_AND_LINE_ );
+	}
+}
+void PerGameRoomsContainer::GetRoomsPassingQuery( RoomQuery *roomQuery, DataStructures::List<Room*> &rooms )
+{
+	DataStructures::Page<unsigned, DataStructures::Table::Row*, _TABLE_BPLUS_TREE_ORDER> *cur;
 	int i;
-	// If you don't care about room filters, just join any room
 	if (roomQuery==0 || roomQuery->numQueries==0 || roomQuery->queries==0)
 	{
-		DataStructures::List<Room*> rooms;
-		GetAllRooms(rooms);
-		for (i=0; (unsigned) i < rooms.Size(); i++)
+		cur = roomsTable.GetRows().GetListHead();
+		while (cur)
 		{
-			Room *room = rooms[i];
-			if (room->ParticipantCanJoinRoom(roomsParticipant, false, true)==PCJRR_SUCCESS &&
-				room->IsHiddenToParticipant(roomsParticipant)==false)
-					roomsOutput.Insert(rooms[i], rooms[i], true, _FILE_AND_LINE_ );
+			for (i=0; i < cur->size; i++)
+				rooms.Insert((Room*)cur->data[i]->cells[DefaultRoomColumns::TC_LOBBY_ROOM_PTR]->ptr, _FILE_AND_LINE_ );
+			cur=cur->next;
 		}
 		return;
 	}
 
-	// Must pass room query
-	// Of those that pass room query, sort by time (lower is first). If within one minute of each other, sort by number of users in playable slots (higher if first)
-	// Be sure to return columns TC_LOBBY_ROOM_PTR, TC_USED_PUBLIC_PLUS_RESERVED_SLOTS, TC_LOBBY_ROOM_PTR
-
 	DataStructures::Table resultTable;
 	unsigned columnIndices[1];
 	columnIndices[0]=DefaultRoomColumns::TC_LOBBY_ROOM_PTR;
 
-	// Process user queries
-	roomsTable.QueryTable(columnIndices,1,roomQuery->queries,roomQuery->numQueries,0,0,&resultTable);
+	// Only query the rooms an index says can pass, if any of the queries can use one
+	DataStructures::List<unsigned> roomIds;
+	if (propertyIndex.GetCandidates(&roomsTable, roomQuery->queries, roomQuery->numQueries, roomIds))
+	{
+		// QueryTable() takes no row IDs to mean all of them
+		if (roomIds.Size()==0)
+			return;
+		roomsTable.QueryTable(columnIndices,1,roomQuery->queries,roomQuery->numQueries,&roomIds[0],roomIds.Size(),&resultTable);
+	}
+	else
+		roomsTable.QueryTable(columnIndices,1,roomQuery->queries,roomQuery->numQueries,0,0,&resultTable);
 
-	roomsOutput.Clear(false, _FILE_AND_LINE_);
-	DataStructures::Page<unsigned, DataStructures::Table::Row*, _TABLE_BPLUS_TREE_ORDER> *cur = resultTable.GetRows().GetListHead();
-	Room *room;
+	cur = resultTable.GetRows().GetListHead();
 	while (cur)
 	{
 		for (i=0; i < cur->size; i++)
-		{
-			// Put all the pointers in the roomSort list, filtering out those you cannot join (full, or no public and you are not invited)
-			room = (Room*) cur->data[i]->cells[0]->ptr;
-			if (room->ParticipantCanJoinRoom(roomsParticipant, false, true)==PCJRR_SUCCESS &&
-				room->IsHiddenToParticipant(roomsParticipant)==false)
-				roomsOutput.Insert(room,room,true, _FILE_AND_LINE_ );
-		}
+			rooms.Insert((Room*) cur->data[i]->cells[0]->ptr, _FILE_AND_LINE_ );
 		cur=cur->next;
 	}
 }
@@ -1343,6 +1697,8 @@ Room::Room( RoomID _roomId, RoomCreationParameters *roomCreationParameters, Data
 
 	lobbyRoomId=_roomId;
 	tableRow=_row;
+	propertyIndex=0;
+	propertyIndexChanged=false;
 	
 	autoLockReadyStatus=roomCreationParameters->networkedRoomCreationParameters.autoLockReadyStatus;
 	hiddenFromSearches=roomCreationParameters->networkedRoomCreationParameters.hiddenFromSearches;
@@ -1401,6 +1757,7 @@ void Room::UpdateUsedSlots( DataStructures::Table::Row* tableRow, Slots *totalSl
 void Room::UpdateUsedSlots( Slots *totalSlots, Slots *usedSlots )
 {
 	UpdateUsedSlots(tableRow, totalSlots, usedSlots);
+	OnPropertiesChanged();
 }
 Slots Room::GetTotalSlots(void) const
 {
@@ -1736,6 +2093,7 @@ RoomsErrorCode Room::SetDestroyOnModeratorLeave(RoomsParticipant* roomsParticipa
 		return REC_SET_DESTROY_ON_MODERATOR_LEAVE_MUST_BE_MODERATOR;
 
 	tableRow->cells[DefaultRoomColumns::TC_DESTROY_ON_MODERATOR_LEAVE]->Set((int) destroyOnModeratorLeave);
+	OnPropertiesChanged();
 	return REC_SUCCESS;
 }
 RoomsErrorCode Room::SetReadyStatus(RoomsParticipant* roomsParticipant, bool isReady)
@@ -2067,10 +2425,17 @@ const char *Room::GetStringProperty(int index) const
 void Room::SetNumericProperty(int index, double value)
 {
 	tableRow->cells[index]->Set(value);
+	OnPropertiesChanged();
 }
 void Room::SetStringProperty(int index, const char *value)
 {
 	tableRow->cells[index]->Set(value);
+	OnPropertiesChanged();
+}
+void Room::OnPropertiesChanged(void)
+{
+	if (propertyIndex)
+		propertyIndex->MarkChanged(this);
 }
 RoomsErrorCode Room::RemoveUser(RoomsParticipant* roomsParticipant,RemoveUserResult *removeUserResult)
 {
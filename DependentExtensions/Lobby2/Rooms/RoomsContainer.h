@@ -15,6 +15,7 @@
 #include "DS_Table.h"
 #include "RoomsErrorCodes.h"
 #include "DS_List.h"
+#include "DS_Hash.h"
 #include "RakNetTypes.h"
 #include "IntervalTimer.h"
 #include "RoomTypes.h"
@@ -327,6 +328,10 @@ struct QuickJoinUser
 
 	// Which user
 	RoomsParticipant* roomsParticipant;
+
+	// Internal - members with equal queries share one during ProcessQuickJoins
+	unsigned int queryGroup;
+
 	static int SortByTotalTimeWaiting( QuickJoinUser* const &key, QuickJoinUser* const &data );
 	static int SortByMinimumSlots( QuickJoinUser* const &key, QuickJoinUser* const &data );
 };
@@ -457,6 +462,55 @@ protected:
 	RoomID nextRoomId;
 };
 
+// Finds the rooms that may pass a query without visiting every row of PerGameRoomsContainer::roomsTable
+// Numeric and string columns are indexed by value the first time a query tests them with QF_EQUAL
+// Rooms whose properties changed are indexed again before the next query, so changes cost nothing until a query needs them
+class RoomPropertyIndex
+{
+public:
+	RoomPropertyIndex();
+	~RoomPropertyIndex();
+
+	// Where a room is filed in one indexed column
+	struct Entry
+	{
+		unsigned int key;
+		unsigned int position;
+	};
+
+	void AddRoom(Room *room);
+	void RemoveRoom(Room *room);
+	// Call when any cell of the row of room may have changed
+	void MarkChanged(Room *room);
+
+	// Writes to roomIds the rooms that may pass the queries, a superset that DataStructures::Table::QueryTable() should narrow down
+	// Returns false if no query can use an index, so every room has to be queried
+	bool GetCandidates(DataStructures::Table *roomsTable, DataStructures::Table::FilterQuery *queries, unsigned int numQueries, DataStructures::List<unsigned> &roomIds);
+
+	static unsigned long KeyToInteger(const unsigned int &key) {return key;}
+
+protected:
+	struct IndexedColumn
+	{
+		unsigned int columnIndex;
+		DataStructures::Table::ColumnType columnType;
+		// Rooms by hash of the cell value
+		DataStructures::Hash<unsigned int, DataStructures::List<Room*>*, 4096, RoomPropertyIndex::KeyToInteger> rooms;
+		// String cells without a string, which QueryTable() does not compare so pass any query
+		DataStructures::List<Room*> unkeyedRooms;
+	};
+	IndexedColumn* GetIndexedColumn(DataStructures::Table *roomsTable, unsigned int columnIndex);
+	DataStructures::List<Room*> *GetKeyRooms(IndexedColumn *indexedColumn, unsigned int key, bool create);
+	void File(unsigned int indexedColumnIndex, Room *room);
+	void Unfile(unsigned int indexedColumnIndex, Room *room);
+	void UpdateChangedRooms(void);
+	void AddCandidate(Room *room, unsigned int *termColumns, unsigned int *termKeys, unsigned int numTerms, DataStructures::List<unsigned> &roomIds);
+	static unsigned int GetKey(const DataStructures::Table::Cell *cell, DataStructures::Table::ColumnType columnType);
+
+	DataStructures::List<IndexedColumn*> indexedColumns;
+	DataStructures::List<Room*> changedRooms;
+};
+
 class PerGameRoomsContainer
 {
 public:
@@ -505,8 +559,12 @@ public:
 	
 	RoomsErrorCode SearchByFilter( RoomsParticipant* roomsParticipant, RoomQuery *roomQuery, DataStructures::OrderedList<Room*, Room*, AllGamesRoomsContainer::RoomsSortByName> &roomsOutput, bool onlyJoinable );
 
+	// Appends the rooms passing roomQuery to rooms, in order of room ID. All rooms if roomQuery has no queries
+	void GetRoomsPassingQuery( RoomQuery *roomQuery, DataStructures::List<Room*> &rooms );
+
 	friend class AllGamesRoomsContainer;
 	IntervalTimer nextQuickJoinProcess;
+	RoomPropertyIndex propertyIndex;
 };
 
 // Holds all the members of a particular roomOutput
@@ -603,6 +661,8 @@ protected:
 		Slots GetTotalSlots(void) const;
 		void SetTotalSlots(Slots *totalSlots);
 		Slots GetUsedSlots(void) const;
+		// Call after writing to tableRow
+		void OnPropertiesChanged(void);
 		
 
 		RoomLockState roomLockState;
@@ -610,10 +670,16 @@ protected:
 		friend struct RoomDescriptor;
 		friend class PerGameRoomsContainer;
 		friend class AllGamesRoomsContainer;
+		friend class RoomPropertyIndex;
 
 		RoomID lobbyRoomId;
 		DataStructures::Table::Row *tableRow;
 
+		// Maintained by RoomPropertyIndex
+		RoomPropertyIndex *propertyIndex;
+		DataStructures::List<RoomPropertyIndex::Entry> propertyIndexEntries;
+		bool propertyIndexChanged;
+
 		bool autoLockReadyStatus;
 		bool hiddenFromSearches;
 //		bool destroyOnModeratorLeave;
@@ -19,6 +19,11 @@
 #include <stdlib.h>
 #include "GetTime.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define _RAKVOICE_USE_SSE2
+#include <emmintrin.h>
+#endif
+
 #ifdef _DEBUG
 #include <stdio.h>
 #endif
@@ -33,6 +38,50 @@ using namespace RakNet;
 #include <stdio.h>
 #endif
 
+// Adds 16 bit samples to the float output buffer
+static void MixSamples(float *output, const short *input, unsigned int count)
+{
+	unsigned int i=0;
+#ifdef _RAKVOICE_USE_SSE2
+	for (; i+8 <= count; i+=8)
+	{
+		__m128i samples = _mm_loadu_si128((const __m128i*) (input+i));
+		// Sign extend to 32 bits by unpacking each sample into the high half of a dword and shifting it back down
+		__m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+		__m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+		_mm_storeu_ps(output+i, _mm_add_ps(_mm_loadu_ps(output+i), _mm_cvtepi32_ps(low)));
+		_mm_storeu_ps(output+i+4, _mm_add_ps(_mm_loadu_ps(output+i+4), _mm_cvtepi32_ps(high)));
+	}
+#endif
+	for (; i < count; i++)
+		output[i]+=input[i];
+}
+
+// Converts the float output buffer to 16 bit samples, clamping to the range of a short
+static void ConvertToShort(short *output, const float *input, unsigned int count)
+{
+	unsigned int i=0;
+#ifdef _RAKVOICE_USE_SSE2
+	__m128 maxValue = _mm_set1_ps(32767.0f);
+	__m128 minValue = _mm_set1_ps(-32768.0f);
+	for (; i+8 <= count; i+=8)
+	{
+		__m128i low = _mm_cvttps_epi32(_mm_max_ps(_mm_min_ps(_mm_loadu_ps(input+i), maxValue), minValue));
+		__m128i high = _mm_cvttps_epi32(_mm_max_ps(_mm_min_ps(_mm_loadu_ps(input+i+4), maxValue), minValue));
+		_mm_storeu_si128((__m128i*) (output+i), _mm_packs_epi32(low, high));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		if (input[i]>32767.0f)
+			output[i]=32767;
+		else if (input[i]<-32768.0f)
+			output[i]=-32768;
+		else
+			output[i]=(short)input[i];
+	}
+}
+
 int RakNet::VoiceChannelComp( const RakNetGUID &key, VoiceChannel * const &data )
 {
 	if (key < data->guid)
@@ -50,10 +99,18 @@ RakVoice::RakVoice()
 	defaultDENOISEState=false;
 	defaultVBRState=false;
 	loopbackMode=false;
+	numWorkerThreads=0;
+	minJitterFrames=RAKVOICE_DEFAULT_MIN_JITTER_FRAMES;
+	maxJitterFrames=RAKVOICE_DEFAULT_MAX_JITTER_FRAMES;
+	outputFrameNumber=0;
+	workerJobsDone.InitEvent();
 }
 RakVoice::~RakVoice()
 {
 	Deinit();
+	// A worker thread may still be returning from SetEvent() on workerJobsDone
+	workerPool.StopThreads();
+	workerJobsDone.CloseEvent();
 }
 void RakVoice::Init(unsigned short sampleRate, unsigned bufferSizeBytes)
 {
@@ -103,6 +160,43 @@ bool RakVoice::IsLoopbackMode(void) const
 {
 	return loopbackMode;
 }
+void RakVoice::SetNumWorkerThreads(int numThreads)
+{
+	RakAssert(numThreads>=0);
+	if (workerPool.WasStarted())
+		workerPool.StopThreads();
+	numWorkerThreads=numThreads;
+	if (numWorkerThreads>0)
+		workerPool.StartThreads(numWorkerThreads, 0);
+}
+int RakVoice::GetNumWorkerThreads(void) const
+{
+	return numWorkerThreads;
+}
+void RakVoice::SetJitterBufferDepth(unsigned minFrames, unsigned maxFrames)
+{
+	RakAssert(minFrames<=maxFrames);
+	minJitterFrames=minFrames;
+	maxJitterFrames=maxFrames;
+	for (unsigned i=0; i < voiceChannels.Size(); i++)
+	{
+		if (voiceChannels[i]->jitterTargetFrames < minJitterFrames)
+			voiceChannels[i]->jitterTargetFrames=minJitterFrames;
+		else if (voiceChannels[i]->jitterTargetFrames > maxJitterFrames)
+			voiceChannels[i]->jitterTargetFrames=maxJitterFrames;
+	}
+}
+bool RakVoice::GetJitterBufferStats(RakNetGUID guid, RakVoiceJitterStats *stats) const
+{
+	bool objectExists;
+	unsigned index = voiceChannels.GetIndexFromKey(guid, &objectExists);
+	if (objectExists==false)
+		return false;
+	*stats=voiceChannels[index]->stats;
+	stats->targetDepthFrames=voiceChannels[index]->jitterTargetFrames;
+	stats->bufferedFrames=GetBufferedBytesToReturn(guid)/bufferSizeBytes;
+	return true;
+}
 void RakVoice::RequestVoiceChannel(RakNetGUID recipient)
 {
 	// Send a reliable ordered message to the other system to open a voice channel
@@ -208,18 +302,9 @@ bool RakVoice::IsSendingVoiceDataTo(RakNetGUID recipient)
 }
 void RakVoice::ReceiveFrame(void *outputBuffer)
 {
-	short *out = (short*)outputBuffer;
-	unsigned i;
 	// Convert the floats to final 16-bits output
-	for (i=0; i < bufferSizeBytes / SAMPLESIZE; i++)
-	{
-		if (bufferedOutput[i]>32767.0f)
-			out[i]=32767;
-		else if (bufferedOutput[i]<-32768.0f)
-			out[i]=-32768;
-		else
-			out[i]=(short)bufferedOutput[i];
-	}
+	ConvertToShort((short*)outputBuffer, bufferedOutput, bufferSizeBytes / SAMPLESIZE);
+	outputFrameNumber++;
 
 	// Done with this block.  Zero all the values in Update
 	zeroBufferedOutput=true;
@@ -318,16 +403,8 @@ void RakVoice::OnShutdown(void)
 
 void RakVoice::Update(void)
 {
-	unsigned i,j, bytesAvailable, speexFramesAvailable, speexBlockSize;
-	unsigned bytesWaitingToReturn;
-	int bytesWritten;
+	unsigned i, bytesAvailable, speexBlockSize;
 	VoiceChannel *channel;
-	char *inputBuffer;
-	char tempOutput[2048];
-	// 1 byte for ID, and 2 bytes(short) for Message number
-	static const int headerSize=sizeof(unsigned char) + sizeof(unsigned short);
-	// First byte is ID for RakNet
-	tempOutput[0]=ID_RAKVOICE_DATA;
 	
 	RakNet::TimeMS currentTime = RakNet::GetTimeMS();
 
@@ -337,17 +414,17 @@ void RakVoice::Update(void)
 	// Allow all channels to write, and set the output to zero in preparation
 	if (zeroBufferedOutput)
 	{
-		for (i=0; i < bufferedOutputCount; i++)
-			bufferedOutput[i]=0.0f;
+		memset(bufferedOutput, 0, sizeof(float)*bufferedOutputCount);
 		for (i=0; i < voiceChannels.Size(); i++)
 			voiceChannels[i]->copiedOutgoingBufferToBufferedOutput=false;
 		zeroBufferedOutput=false;
 	}
 
-	// For each channel
+	// Pick the channels to encode this update
 	for (i=0; i < voiceChannels.Size(); i++)
 	{
 		channel=voiceChannels[i];
+		channel->encodeThisUpdate=false;
 
 		if (currentTime - channel->lastSend > 50) // Throttle to 20 sends a second
 		{
@@ -377,182 +454,285 @@ void RakVoice::Update(void)
 			}
 #endif
 
-#ifdef _TEST_LOOPBACK
-			/*
-			if (bufferSizeBytes<bytesAvailable)
+			// Only counts as a send if there is at least one frame for speex to encode
+			if (bytesAvailable >= speexBlockSize)
 			{
-				printf("Update: bytesAvailable=%i writeIndex=%i readIndex=%i\n",bytesAvailable, channel->outgoingWriteIndex, channel->outgoingReadIndex);
-				memcpy(channel->incomingBuffer + channel->incomingWriteIndex, channel->outgoingBuffer+channel->outgoingReadIndex, bufferSizeBytes);
-				channel->incomingWriteIndex=(channel->incomingWriteIndex+bufferSizeBytes) % totalBufferSize;
-				channel->outgoingReadIndex=(channel->outgoingReadIndex+bufferSizeBytes) % totalBufferSize;
+				channel->encodeThisUpdate=true;
+				channel->lastSend=currentTime;
 			}
-			return;
-			*/
-#endif
+		}
+	}
 
-			// Find out how many frames we can read out of the buffer for speex to encode and send these out.
-			speexFramesAvailable = bytesAvailable / speexBlockSize;
+	// Encode outgoing data and decode data queued by OnVoiceData.
+	// Each channel only uses its own speex state and buffers, so channels can be processed in parallel.
+	if (numWorkerThreads>0 && voiceChannels.Size()>1)
+		ProcessChannelsOnWorkers();
+	else
+	{
+		for (i=0; i < voiceChannels.Size(); i++)
+			ProcessChannel(voiceChannels[i]);
+	}
 
-			// Encode all available frames and send them unreliable sequenced
-			if (speexFramesAvailable > 0)
-			{
-				SpeexBits speexBits;
-				speex_bits_init(&speexBits);
-				while (speexFramesAvailable-- > 0)
-				{
-					speex_bits_reset(&speexBits);
-
-					// If the input data would wrap around the buffer, copy it to another buffer first
-					if (channel->outgoingReadIndex + speexBlockSize >= totalBufferSize)
-					{
-#ifdef _DEBUG
-						RakAssert(speexBlockSize < 2048-1);
-#endif
-						unsigned t;
-						for (t=0; t < speexBlockSize; t++)
-							tempOutput[t+headerSize]=channel->outgoingBuffer[t%totalBufferSize];
-						inputBuffer=tempOutput+headerSize;
-					}
-					else
-						inputBuffer=channel->outgoingBuffer+channel->outgoingReadIndex;
+	// Sending and mixing use state shared between channels, so are done on this thread
+	for (i=0; i < voiceChannels.Size(); i++)
+	{
+		channel=voiceChannels[i];
+		SendEncodedMessages(channel);
+		MixChannel(channel);
+	}
+}
+void RakVoice::ProcessChannelsOnWorkers(void)
+{
+	unsigned i;
+	RakVoiceJob job;
+	job.rakVoice=this;
+	for (i=0; i < voiceChannels.Size(); i++)
+	{
+		job.channel=voiceChannels[i];
+		if (job.channel->encodeThisUpdate || job.channel->pendingVoiceData.GetNumberOfBitsUsed()>0)
+		{
+			workerJobsRunning.Increment();
+			workerPool.AddInput(ProcessChannelJob, job);
+		}
+	}
 
-#ifdef _DEBUG
-					/*
-					printf("In: ");
-					if (shortSampleType)
-					{
-						short *blah = (short*) inputBuffer;
-						for (int p=0; p < 5; p++)
-						{
-							printf("%.i ", blah[p]);
-						}
-					}
-					else
-					{
-						float *blah = (float*) inputBuffer;
-						for (int p=0; p < 5; p++)
-						{
-							printf("%.3f ", blah[p]);
-						}
-					}
-
-					printf("\n");
-*/
-#endif
-					int is_speech=1;
+	// Rather than wait idle, take jobs no worker thread has started on this thread too.
+	// Each worker thread takes from the front of its own queue, so take from the back.
+	for (;;)
+	{
+		workerPool.LockInput();
+		if (workerPool.InputSize()==0)
+		{
+			workerPool.UnlockInput();
+			break;
+		}
+		job=workerPool.GetInputAtIndex(workerPool.InputSize()-1);
+		workerPool.RemoveInputAtIndex(workerPool.InputSize()-1);
+		workerPool.UnlockInput();
+		ProcessChannel(job.channel);
+		workerJobsRunning.Decrement();
+	}
 
-					// Run preprocessor if required
-					if (defaultDENOISEState||defaultVADState){
-						is_speech=speex_preprocess((SpeexPreprocessState*)channel->pre_state,(spx_int16_t*) inputBuffer, NULL );
-					}
+	// Wait for the jobs still running on the worker threads. The event may still be set from an earlier call, so recheck the count after waking
+	while (workerJobsRunning.GetValue()!=0)
+		workerJobsDone.WaitOnEvent(1000);
+}
+RakVoiceJob RakVoice::ProcessChannelJob(RakVoiceJob job, bool *returnOutput, void* perThreadData)
+{
+	(void) perThreadData;
+	job.rakVoice->ProcessChannel(job.channel);
+	*returnOutput=false;
+	if (job.rakVoice->workerJobsRunning.Decrement()==0)
+		job.rakVoice->workerJobsDone.SetEvent();
+	return job;
+}
+void RakVoice::ProcessChannel(VoiceChannel *channel)
+{
+	// Decode data that arrived while using worker threads
+	if (channel->pendingVoiceData.GetNumberOfBitsUsed()>0)
+	{
+		unsigned char message[2048];
+		unsigned short length;
+		while (channel->pendingVoiceData.Read(length) && channel->pendingVoiceData.ReadAlignedBytes(message, length))
+			DecodeVoiceData(channel, message, length);
+		channel->pendingVoiceData.Reset();
+	}
 
-					if ((is_speech)||(!defaultVADState)){
-						is_speech = speex_encode_int(channel->enc_state, (spx_int16_t*) inputBuffer, &speexBits);
-					}
+	if (channel->encodeThisUpdate)
+		EncodeChannel(channel);
+}
+void RakVoice::EncodeChannel(VoiceChannel *channel)
+{
+	unsigned bytesAvailable, speexFramesAvailable, speexBlockSize;
+	int bytesWritten;
+	char *inputBuffer;
+	char tempOutput[2048];
+	// 1 byte for ID, and 2 bytes(short) for Message number
+	static const int headerSize=sizeof(unsigned char) + sizeof(unsigned short);
+	// First byte is ID for RakNet
+	tempOutput[0]=ID_RAKVOICE_DATA;
 
-					channel->outgoingReadIndex=(channel->outgoingReadIndex+speexBlockSize)%totalBufferSize;
+	unsigned totalBufferSize=bufferSizeBytes * FRAME_OUTGOING_BUFFER_COUNT;
+	if (channel->outgoingWriteIndex>=channel->outgoingReadIndex)
+		bytesAvailable=channel->outgoingWriteIndex-channel->outgoingReadIndex;
+	else
+		bytesAvailable=channel->outgoingWriteIndex + (totalBufferSize-channel->outgoingReadIndex);
+	speexBlockSize = channel->speexOutgoingFrameSampleCount * SAMPLESIZE;
 
-					// If no speech detected, don't send this frame
-					if ((!is_speech)&&(defaultVADState)){
-						continue;
-					}
+	// Find out how many frames we can read out of the buffer for speex to encode and send these out.
+	speexFramesAvailable = bytesAvailable / speexBlockSize;
 
-					channel->isSendingVoiceData=true;
+	// Encode all available frames. They are sent unreliable by SendEncodedMessages
+	SpeexBits speexBits;
+	speex_bits_init(&speexBits);
+	while (speexFramesAvailable-- > 0)
+	{
+		speex_bits_reset(&speexBits);
 
+		// If the input data would wrap around the buffer, copy it to another buffer first
+		if (channel->outgoingReadIndex + speexBlockSize >= totalBufferSize)
+		{
 #ifdef _DEBUG
-//					printf("Update: bytesAvailable=%i writeIndex=%i readIndex=%i\n",bytesAvailable, channel->outgoingWriteIndex, channel->outgoingReadIndex);
+			RakAssert(speexBlockSize < 2048-1);
 #endif
+			unsigned t;
+			for (t=0; t < speexBlockSize; t++)
+				tempOutput[t+headerSize]=channel->outgoingBuffer[(channel->outgoingReadIndex+t)%totalBufferSize];
+			inputBuffer=tempOutput+headerSize;
+		}
+		else
+			inputBuffer=channel->outgoingBuffer+channel->outgoingReadIndex;
+
+		int is_speech=1;
+
+		// Run preprocessor if required
+		if (defaultDENOISEState||defaultVADState){
+			is_speech=speex_preprocess((SpeexPreprocessState*)channel->pre_state,(spx_int16_t*) inputBuffer, NULL );
+		}
+
+		if ((is_speech)||(!defaultVADState)){
+			is_speech = speex_encode_int(channel->enc_state, (spx_int16_t*) inputBuffer, &speexBits);
+		}
+
+		channel->outgoingReadIndex=(channel->outgoingReadIndex+speexBlockSize)%totalBufferSize;
 
-					bytesWritten = speex_bits_write(&speexBits, tempOutput+headerSize, 2048-headerSize);
+		// If no speech detected, don't send this frame
+		if ((!is_speech)&&(defaultVADState)){
+			continue;
+		}
+
+		channel->isSendingVoiceData=true;
+
+		bytesWritten = speex_bits_write(&speexBits, tempOutput+headerSize, 2048-headerSize);
 #ifdef _DEBUG
-					// If this assert hits then you need to increase the size of the temp buffer, but this is really a bug because
-					// voice packets should never be bigger than a few hundred bytes.
-					RakAssert(bytesWritten!=2048-headerSize);
+		// If this assert hits then you need to increase the size of the temp buffer, but this is really a bug because
+		// voice packets should never be bigger than a few hundred bytes.
+		RakAssert(bytesWritten!=2048-headerSize);
 #endif
 
-//					static int bytesSent=0;
-//					bytesSent+= bytesWritten+headerSize;
-//					printf("bytesSent=%i\n", bytesSent);
-
 #ifdef PRINT_DEBUG_INFO
 static int voicePacketsSent=0;
 printf("%i ", voicePacketsSent++);
 #endif
 
-					// at +1, because the first byte in the buffer has the ID for RakNet.
-					memcpy(tempOutput+1, &channel->outgoingMessageNumber, sizeof(unsigned short));
-					channel->outgoingMessageNumber++;
-					RakNet::BitStream tempOutputBs((unsigned char*) tempOutput,bytesWritten+headerSize,false);
-					SendUnified(&tempOutputBs, HIGH_PRIORITY, UNRELIABLE,0,channel->guid,false);
-
-					if (loopbackMode)
-					{
-						Packet p;
-						p.length=bytesWritten+1;
-						p.data=(unsigned char*)tempOutput;
-						p.guid=channel->guid;
-						p.systemAddress=rakPeerInterface->GetSystemAddressFromGuid(p.guid);
-						OnVoiceData(&p);
-					}
-				}
-
-				speex_bits_destroy(&speexBits);
-				channel->lastSend=currentTime;
-			}
+		// at +1, because the first byte in the buffer has the ID for RakNet.
+		memcpy(tempOutput+1, &channel->outgoingMessageNumber, sizeof(unsigned short));
+		channel->outgoingMessageNumber++;
+		channel->encodedMessages.Write((unsigned short) (bytesWritten+headerSize));
+		channel->encodedMessages.WriteAlignedBytes((const unsigned char*) tempOutput, bytesWritten+headerSize);
+	}
+
+	speex_bits_destroy(&speexBits);
+}
+void RakVoice::SendEncodedMessages(VoiceChannel *channel)
+{
+	if (channel->encodedMessages.GetNumberOfBitsUsed()==0)
+		return;
+
+	unsigned char message[2048];
+	unsigned short length;
+	while (channel->encodedMessages.Read(length) && channel->encodedMessages.ReadAlignedBytes(message, length))
+	{
+		RakNet::BitStream tempOutputBs(message,length,false);
+		SendUnified(&tempOutputBs, HIGH_PRIORITY, UNRELIABLE,0,channel->guid,false);
+
+		if (loopbackMode)
+		{
+			Packet p;
+			p.length=length;
+			p.data=message;
+			p.guid=channel->guid;
+			p.systemAddress=rakPeerInterface->GetSystemAddressFromGuid(p.guid);
+			OnVoiceData(&p);
 		}
+	}
+	channel->encodedMessages.Reset();
+}
+void RakVoice::MixChannel(VoiceChannel *channel)
+{
+	// As sound buffer blocks fill up, I add their values to RakVoice::bufferedOutput .  Then when the user calls ReceiveFrame they get that value, already
+	// processed.  This is necessary because that function needs to run as fast as possible so I remove all processing there that I can.  Otherwise the sound
+	// plays back distorted and popping
+	if (channel->copiedOutgoingBufferToBufferedOutput)
+		return;
+
+	unsigned bytesWaitingToReturn;
+	unsigned totalBufferSize=bufferSizeBytes * FRAME_INCOMING_BUFFER_COUNT;
+	if (channel->incomingReadIndex <= channel->incomingWriteIndex)
+		bytesWaitingToReturn=channel->incomingWriteIndex-channel->incomingReadIndex;
+	else
+		bytesWaitingToReturn=totalBufferSize-channel->incomingReadIndex+channel->incomingWriteIndex;
 
-		// As sound buffer blocks fill up, I add their values to RakVoice::bufferedOutput .  Then when the user calls ReceiveFrame they get that value, already
-		// processed.  This is necessary because that function needs to run as fast as possible so I remove all processing there that I can.  Otherwise the sound
-		// plays back distorted and popping
-		if (channel->copiedOutgoingBufferToBufferedOutput==false)
+	if (bytesWaitingToReturn>0 && channel->ranDry)
+	{
+		// Data arrived again soon enough after running dry that a deeper buffer would have covered the gap, so this was late data rather than the end of speech
+		channel->ranDry=false;
+		if (outputFrameNumber-channel->ranDryAtFrame <= maxJitterFrames)
 		{
-			if (channel->incomingReadIndex <= channel->incomingWriteIndex)
-				bytesWaitingToReturn=channel->incomingWriteIndex-channel->incomingReadIndex;
-			else
-				bytesWaitingToReturn=totalBufferSize-channel->incomingReadIndex+channel->incomingWriteIndex;
+			channel->stats.underflowCount++;
+			if (channel->jitterTargetFrames < maxJitterFrames)
+				channel->jitterTargetFrames++;
+			channel->jitterStableFrames=0;
+		}
+	}
 
-			if (bytesWaitingToReturn==0)
-			{
-				channel->bufferOutput=true;
-			}
-			else if (channel->bufferOutput==false || bytesWaitingToReturn > bufferSizeBytes*2)
-			{
-				// Block running this again until the user calls ReceiveFrame since every call to ReceiveFrame only gets zero or one output blocks from
-				// each channel
-				channel->copiedOutgoingBufferToBufferedOutput=true;
-
-				// Stop buffering output.  We won't start buffering again until there isn't enough data to read.
-				channel->bufferOutput=false;
-
-				// Cap to the size of the output buffer.  But we do write less if less is available, with the rest silence
-				if (bytesWaitingToReturn > bufferSizeBytes)
-				{
-					bytesWaitingToReturn=bufferSizeBytes;
-				}
-				else
-				{
-					// Align the write index so when we increment the partial block read (which is always aligned) it computes out to 0 bytes waiting
-					channel->incomingWriteIndex=channel->incomingReadIndex+bufferSizeBytes;
-					if (channel->incomingWriteIndex==totalBufferSize)
-						channel->incomingWriteIndex=0;
-				}
-
-				short *in = (short *) (channel->incomingBuffer+channel->incomingReadIndex);
-				for (j=0; j < bytesWaitingToReturn / SAMPLESIZE; j++)
-				{
-					// Write short to float so if the range goes over the range of a float we can still add and subtract the correct final value.
-					// It will be clamped at the end
-					bufferedOutput[j]+=in[j%(totalBufferSize/SAMPLESIZE)];
-				}
-
-				// Update the read index.  Always update by bufferSizeBytes, not bytesWaitingToReturn.
-				// if bytesWaitingToReturn < bufferSizeBytes then the rest is silence since this means the buffer ran out or we stopped sending.
-				channel->incomingReadIndex+=bufferSizeBytes;
-				if (channel->incomingReadIndex==totalBufferSize)
-					channel->incomingReadIndex=0;
-
-			//	printf("%f %f\n", channel->incomingReadIndex/(float)bufferSizeBytes, channel->incomingWriteIndex/(float)bufferSizeBytes);
-			}
+	if (bytesWaitingToReturn==0)
+	{
+		if (channel->bufferOutput==false)
+		{
+			channel->ranDry=true;
+			channel->ranDryAtFrame=outputFrameNumber;
+		}
+		channel->bufferOutput=true;
+	}
+	else if (channel->bufferOutput==false || bytesWaitingToReturn > bufferSizeBytes*channel->jitterTargetFrames)
+	{
+		// Block running this again until the user calls ReceiveFrame since every call to ReceiveFrame only gets zero or one output blocks from
+		// each channel
+		channel->copiedOutgoingBufferToBufferedOutput=true;
+
+		// Stop buffering output.  We won't start buffering again until there isn't enough data to read.
+		channel->bufferOutput=false;
+
+		// Too far behind, so skip a frame to bring the latency back down
+		if (bytesWaitingToReturn > bufferSizeBytes*(channel->jitterTargetFrames+RAKVOICE_JITTER_DROP_FRAMES))
+		{
+			channel->incomingReadIndex+=bufferSizeBytes;
+			if (channel->incomingReadIndex==totalBufferSize)
+				channel->incomingReadIndex=0;
+			bytesWaitingToReturn-=bufferSizeBytes;
+			channel->stats.framesDropped++;
+		}
+
+		// Cap to the size of the output buffer.  But we do write less if less is available, with the rest silence
+		if (bytesWaitingToReturn > bufferSizeBytes)
+		{
+			bytesWaitingToReturn=bufferSizeBytes;
+		}
+		else
+		{
+			// Align the write index so when we increment the partial block read (which is always aligned) it computes out to 0 bytes waiting
+			channel->incomingWriteIndex=channel->incomingReadIndex+bufferSizeBytes;
+			if (channel->incomingWriteIndex==totalBufferSize)
+				channel->incomingWriteIndex=0;
+		}
+
+		// Add to the float buffer so if the sum goes over the range of a short we can still add and subtract the correct final value.
+		// It will be clamped in ReceiveFrame
+		MixSamples(bufferedOutput, (const short *) (channel->incomingBuffer+channel->incomingReadIndex), bytesWaitingToReturn / SAMPLESIZE);
+
+		// Update the read index.  Always update by bufferSizeBytes, not bytesWaitingToReturn.
+		// if bytesWaitingToReturn < bufferSizeBytes then the rest is silence since this means the buffer ran out or we stopped sending.
+		channel->incomingReadIndex+=bufferSizeBytes;
+		if (channel->incomingReadIndex==totalBufferSize)
+			channel->incomingReadIndex=0;
+
+		channel->stats.framesPlayed++;
+		if (++channel->jitterStableFrames >= RAKVOICE_JITTER_STABLE_FRAMES)
+		{
+			channel->jitterStableFrames=0;
+			if (channel->jitterTargetFrames > minJitterFrames)
+				channel->jitterTargetFrames--;
 		}
 	}
 }
@@ -667,6 +847,12 @@ void RakVoice::OpenChannel(Packet *packet)
 	channel->incomingWriteIndex=0;
 	channel->lastSend=0;
 	channel->incomingMessageNumber=0;
+	channel->jitterTargetFrames=minJitterFrames;
+	channel->jitterStableFrames=0;
+	channel->ranDry=false;
+	channel->ranDryAtFrame=0;
+	memset(&channel->stats, 0, sizeof(channel->stats));
+	channel->encodeThisUpdate=false;
 
 	// Initialize preprocessor
 	channel->pre_state = speex_preprocess_state_init(channel->speexOutgoingFrameSampleCount, sampleRate);
@@ -784,82 +970,75 @@ void RakVoice::OnVoiceData(Packet *packet)
 {
 	bool objectExists;
 	unsigned index;
+
+	index = voiceChannels.GetIndexFromKey(packet->guid, &objectExists);
+	if (objectExists)
+	{
+		if (numWorkerThreads>0)
+		{
+			// Decoded on a worker thread in the next call to Update
+			if (packet->length <= 2048)
+			{
+				voiceChannels[index]->pendingVoiceData.Write((unsigned short) packet->length);
+				voiceChannels[index]->pendingVoiceData.WriteAlignedBytes(packet->data, packet->length);
+			}
+		}
+		else
+			DecodeVoiceData(voiceChannels[index], packet->data, packet->length);
+	}
+}
+void RakVoice::DecodeVoiceData(VoiceChannel *channel, const unsigned char *data, unsigned int length)
+{
 	unsigned short packetMessageNumber, messagesSkipped;
-	VoiceChannel *channel;
 	char tempOutput[2048];
 	unsigned int i;
 	// 1 byte for ID, 2 bytes(short) for message number
 	static const int headerSize=sizeof(unsigned char) + sizeof(unsigned short);
 
-	index = voiceChannels.GetIndexFromKey(packet->guid, &objectExists);
-	if (objectExists)
-	{
-		SpeexBits speexBits;
-		speex_bits_init(&speexBits);
-		channel=voiceChannels[index];
-		memcpy(&packetMessageNumber, packet->data+1, sizeof(unsigned short));
+	if (length < (unsigned int) headerSize)
+		return;
 
-		// Intentional overflow
-		messagesSkipped=packetMessageNumber-channel->incomingMessageNumber;
-		if (messagesSkipped > ((unsigned short)-1)/2)
-		{
+	memcpy(&packetMessageNumber, data+1, sizeof(unsigned short));
+
+	// Intentional overflow
+	messagesSkipped=packetMessageNumber-channel->incomingMessageNumber;
+	if (messagesSkipped > ((unsigned short)-1)/2)
+	{
 #ifdef PRINT_DEBUG_INFO
-			printf("--- UNDERFLOW ---\n");
+		printf("--- UNDERFLOW ---\n");
 #endif
-			// Underflow, just ignore it
-			return;
-		}
+		// Underflow, just ignore it
+		channel->stats.packetsLate++;
+		return;
+	}
 #ifdef PRINT_DEBUG_INFO
-		if (messagesSkipped>0)
-			printf("%i messages skipped\n", messagesSkipped);
+	if (messagesSkipped>0)
+		printf("%i messages skipped\n", messagesSkipped);
 #endif
-		// Don't do more than 100 ms of messages skipped.  Discard the rest.
-		int maxSkip = (int)(100.0f / (float) sampleRate);
-		for (i=0; i < (unsigned) messagesSkipped && i < (unsigned) maxSkip; i++)
-		{
-			speex_decode_int(channel->dec_state, 0, (spx_int16_t*)tempOutput);
+	channel->stats.packetsLost+=messagesSkipped;
 
-			// Write to buffer a 'message skipped' interpolation
-			WriteOutputToChannel(channel, tempOutput);
-		}
-	
-		channel->incomingMessageNumber=packetMessageNumber+1;
+	// Don't do more than 100 ms of messages skipped.  Discard the rest.
+	int maxSkip = (int) (channel->remoteSampleRate / 10 / channel->speexIncomingFrameSampleCount);
+	for (i=0; i < (unsigned) messagesSkipped && i < (unsigned) maxSkip; i++)
+	{
+		speex_decode_int(channel->dec_state, 0, (spx_int16_t*)tempOutput);
+
+		// Write to buffer a 'message skipped' interpolation
+		WriteOutputToChannel(channel, tempOutput);
+	}
 
-		// Write to incomingBuffer the decoded data
-		speex_bits_read_from(&speexBits, (char*)(packet->data+headerSize), packet->length-headerSize);
-		speex_decode_int(channel->dec_state, &speexBits, (spx_int16_t*)tempOutput);
+	channel->incomingMessageNumber=packetMessageNumber+1;
 
-#ifdef _DEBUG
-		{
-			/*
-			printf("Out: ");
-			if (channel->remoteIsShortSampleType)
-			{
-				short *blah = (short*) tempOutput;
-				for (int p=0; p < 5; p++)
-				{
-					printf("%.i ", blah[p]);
-				}
-			}
-			else
-			{
-				float *blah = (float*) tempOutput;
-				for (int p=0; p < 5; p++)
-				{
-					printf("%.3f ", blah[p]);
-				}
-			}
-			
-			printf("\n");
-			*/
-		}
-#endif
+	// Write to incomingBuffer the decoded data
+	SpeexBits speexBits;
+	speex_bits_init(&speexBits);
+	speex_bits_read_from(&speexBits, (char*)(data+headerSize), length-headerSize);
+	speex_decode_int(channel->dec_state, &speexBits, (spx_int16_t*)tempOutput);
 
-		// Write to buffer
-		WriteOutputToChannel(channel, tempOutput);
+	// Write to buffer
+	WriteOutputToChannel(channel, tempOutput);
 
-		speex_bits_destroy(&speexBits);
-	}
+	speex_bits_destroy(&speexBits);
 }
 void RakVoice::WriteOutputToChannel(VoiceChannel *channel, char *dataToWrite)
 {
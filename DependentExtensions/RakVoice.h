@@ -19,6 +19,10 @@
 #include "PluginInterface2.h"
 #include "DS_OrderedList.h"
 #include "NativeTypes.h"
+#include "BitStream.h"
+#include "ThreadPool.h"
+#include "SignaledEvent.h"
+#include "LocklessTypes.h"
 
 namespace RakNet {
 
@@ -28,6 +32,33 @@ class RakPeerInterface;
 #define FRAME_OUTGOING_BUFFER_COUNT 100
 #define FRAME_INCOMING_BUFFER_COUNT 100
 
+// Default range of the adaptive jitter buffer, in frames of bufferSizeBytes. See RakVoice::SetJitterBufferDepth
+#define RAKVOICE_DEFAULT_MIN_JITTER_FRAMES 2
+#define RAKVOICE_DEFAULT_MAX_JITTER_FRAMES 6
+// Once this many frames more than the target depth are buffered, one frame is dropped to bring the latency back down
+#define RAKVOICE_JITTER_DROP_FRAMES 4
+// After this many frames played without an underflow, the target depth is lowered by one frame
+#define RAKVOICE_JITTER_STABLE_FRAMES 250
+
+/// Jitter buffer statistics for one voice channel, returned by RakVoice::GetJitterBufferStats
+struct RakVoiceJitterStats
+{
+	/// How many frames are buffered before playback starts, or restarts after running dry
+	unsigned targetDepthFrames;
+	/// How many frames are buffered right now
+	unsigned bufferedFrames;
+	/// Frames mixed into the output
+	unsigned framesPlayed;
+	/// How many times playback ran dry while the remote system was still sending
+	unsigned underflowCount;
+	/// Frames discarded because the buffer was too far above the target depth
+	unsigned framesDropped;
+	/// Packets that never arrived, according to the message numbers
+	unsigned packetsLost;
+	/// Packets that arrived after a later packet was already decoded, and were discarded
+	unsigned packetsLate;
+};
+
 /// \internal
 struct VoiceChannel
 {
@@ -56,9 +87,33 @@ struct VoiceChannel
 	unsigned short incomingMessageNumber;  // The ID_VOICE message number we expect to get.  Used to drop out of order and detect how many missing packets in a sequence
 
 	RakNet::TimeMS lastSend;
+
+	// Adaptive jitter buffer. Depth is in frames of bufferSizeBytes.
+	unsigned jitterTargetFrames;
+	unsigned jitterStableFrames;
+	// Set when playback runs dry, to tell a late packet from the end of speech when data arrives again
+	bool ranDry;
+	unsigned ranDryAtFrame;
+	RakVoiceJitterStats stats;
+
+	// Set by Update for channels whose outgoing data is encoded this update
+	bool encodeThisUpdate;
+	// Encoded ID_RAKVOICE_DATA messages waiting to be sent, each written as an unsigned short length followed by the message
+	RakNet::BitStream encodedMessages;
+	// ID_RAKVOICE_DATA messages waiting to be decoded by a worker thread, in the same format
+	RakNet::BitStream pendingVoiceData;
 };
 int VoiceChannelComp( const RakNetGUID &key, VoiceChannel * const &data );
 
+class RakVoice;
+
+/// \internal
+struct RakVoiceJob
+{
+	RakVoice *rakVoice;
+	VoiceChannel *channel;
+};
+
 /// Voice compression and transmission interface
 class RAK_DLL_EXPORT RakVoice : public PluginInterface2
 {
@@ -186,6 +241,32 @@ public:
 	/// \return true if enabled, false otherwise.
 	bool IsLoopbackMode(void) const;
 
+	/// \brief Encodes and decodes voice channels on worker threads during Update()
+	/// \details Each channel has its own speex state, so channels are processed in parallel, one job per channel. The thread calling Update() takes jobs as well, and waits until all are done.<BR>
+	/// With worker threads, ID_RAKVOICE_DATA is decoded in the next call to Update() rather than when it arrives.<BR>
+	/// Sending and mixing into the output stays on the thread calling Update().<BR>
+	/// Defaults to 0, which does all work on the thread calling Update(). Worth enabling with many channels open and spare cores.
+	/// \param[in] numThreads Number of worker threads to start, or 0 to stop them
+	void SetNumWorkerThreads(int numThreads);
+
+	/// \return The number of worker threads, as passed to SetNumWorkerThreads()
+	int GetNumWorkerThreads(void) const;
+
+	/// \brief Sets the range of the adaptive jitter buffer
+	/// \details Playback of a channel starts once more than the target depth is buffered. The target starts at \a minFrames.<BR>
+	/// Every time playback runs dry while the remote system is still talking, the target goes up by one frame, to at most \a maxFrames.<BR>
+	/// After RAKVOICE_JITTER_STABLE_FRAMES frames without running dry it goes back down by one frame.<BR>
+	/// If more than RAKVOICE_JITTER_DROP_FRAMES frames above the target are buffered, a frame is dropped so latency does not build up.
+	/// \param[in] minFrames Smallest target depth, in frames of bufferSizeBytes. Defaults to RAKVOICE_DEFAULT_MIN_JITTER_FRAMES
+	/// \param[in] maxFrames Largest target depth, in frames of bufferSizeBytes. Defaults to RAKVOICE_DEFAULT_MAX_JITTER_FRAMES
+	void SetJitterBufferDepth(unsigned minFrames, unsigned maxFrames);
+
+	/// \brief Returns jitter buffer statistics for one voice channel
+	/// \param[in] guid The system to query
+	/// \param[out] stats Statistics for that channel, counted from when the channel was opened
+	/// \return false if there is no voice channel open with \a guid
+	bool GetJitterBufferStats(RakNetGUID guid, RakVoiceJitterStats *stats) const;
+
 	// --------------------------------------------------------------------------------------------
 	// Message handling functions
 	// --------------------------------------------------------------------------------------------
@@ -197,6 +278,13 @@ protected:
 	void OnOpenChannelRequest(Packet *packet);
 	void OnOpenChannelReply(Packet *packet);
 	virtual void OnVoiceData(Packet *packet);
+	void DecodeVoiceData(VoiceChannel *channel, const unsigned char *data, unsigned int length);
+	void EncodeChannel(VoiceChannel *channel);
+	void ProcessChannel(VoiceChannel *channel);
+	void ProcessChannelsOnWorkers(void);
+	void SendEncodedMessages(VoiceChannel *channel);
+	void MixChannel(VoiceChannel *channel);
+	static RakVoiceJob ProcessChannelJob(RakVoiceJob job, bool *returnOutput, void* perThreadData);
 	void OpenChannel(Packet *packet);
 	void FreeChannelMemory(RakNetGUID recipient);
 	void FreeChannelMemory(unsigned index, bool removeIndex);
@@ -215,6 +303,14 @@ protected:
 	bool defaultDENOISEState;
 	bool defaultVBRState;
 	bool loopbackMode;
+	int numWorkerThreads;
+	ThreadPool<RakVoiceJob, RakVoiceJob> workerPool;
+	// Jobs added by ProcessChannelsOnWorkers() not yet finished. The job that finishes last sets workerJobsDone
+	RakNet::LocklessUint32_t workerJobsRunning;
+	RakNet::SignaledEvent workerJobsDone;
+	unsigned minJitterFrames, maxJitterFrames;
+	// Incremented by ReceiveFrame
+	unsigned outputFrameNumber;
 
 };
 
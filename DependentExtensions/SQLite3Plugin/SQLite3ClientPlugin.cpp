@@ -79,6 +79,23 @@ unsigned int SQLite3ClientPlugin::_sqlite3_exec(RakNet::RakString dbIdentifier,
 	++nextQueryId;
 	return nextQueryId-1;
 }
+unsigned int SQLite3ClientPlugin::_sqlite3_exec(RakNet::RakString dbIdentifier, RakNet::RakString inputStatement, const DataStructures::List<RakNet::RakString> &parameters,
+										  PacketPriority priority, PacketReliability reliability, char orderingChannel, const SystemAddress &systemAddress)
+{
+	RakNet::BitStream bsOut;
+	bsOut.Write((MessageID)ID_SQLite3_EXEC);
+	bsOut.Write(nextQueryId);
+	bsOut.Write(dbIdentifier);
+	bsOut.Write(inputStatement);
+	bsOut.Write(true);
+	bsOut.Write(true);
+	bsOut.Write(parameters.Size());
+	for (unsigned int i=0; i < parameters.Size(); i++)
+		bsOut.Write(parameters[i]);
+	SendUnified(&bsOut, priority,reliability,orderingChannel,systemAddress,false);
+	++nextQueryId;
+	return nextQueryId-1;
+}
 
 PluginReceiveResult SQLite3ClientPlugin::OnReceive(Packet *packet)
 {
@@ -114,6 +114,20 @@ public:
 	unsigned int _sqlite3_exec(RakNet::RakString dbIdentifier, RakNet::RakString inputStatement,
 		PacketPriority priority, PacketReliability reliability, char orderingChannel, const SystemAddress &systemAddress);
 
+	/// Execute a statement with parameters on the remote system
+	/// Each ? in \a inputStatement is bound to the matching entry in \a parameters as text, so the parameters do not need to be escaped.
+	/// The server keeps the statement prepared, so sending the same \a inputStatement again with different \a parameters skips the SQL parser.
+	/// \param[in] dbIdentifier Which database to use, added with AddDBHandle()
+	/// \param[in] inputStatement SQL statement to execute
+	/// \param[in] parameters Values for each ? in \a inputStatement, in order
+	/// \param[in] priority See RakPeerInterface::Send()
+	/// \param[in] reliability See RakPeerInterface::Send()
+	/// \param[in] orderingChannel See RakPeerInterface::Send()
+	/// \param[in] systemAddress See RakPeerInterface::Send()
+	/// \return Query ID. Will be returned in _sqlite3_exec
+	unsigned int _sqlite3_exec(RakNet::RakString dbIdentifier, RakNet::RakString inputStatement, const DataStructures::List<RakNet::RakString> &parameters,
+		PacketPriority priority, PacketReliability reliability, char orderingChannel, const SystemAddress &systemAddress);
+
 	/// \internal For plugin handling
 	virtual PluginReceiveResult OnReceive(Packet *packet);
 
@@ -12,40 +12,292 @@
 #include "MessageIdentifiers.h"
 #include "BitStream.h"
 #include "GetTime.h"
+#include "LinuxStrings.h"
 
 using namespace RakNet;
 
+// In namespace RakNet so argument dependent lookup finds them from DS_Multilist
+namespace RakNet
+{
 bool operator<( const DataStructures::MLKeyRef<RakNet::RakString> &inputKey, const SQLite3ServerPlugin::NamedDBHandle &cls ) {return inputKey.Get() < cls.dbIdentifier;}
 bool operator>( const DataStructures::MLKeyRef<RakNet::RakString> &inputKey, const SQLite3ServerPlugin::NamedDBHandle &cls ) {return inputKey.Get() > cls.dbIdentifier;}
 bool operator==( const DataStructures::MLKeyRef<RakNet::RakString> &inputKey, const SQLite3ServerPlugin::NamedDBHandle &cls ) {return inputKey.Get() == cls.dbIdentifier;}
+}
+
+
+// Writes rows straight from sqlite3_step in the format of SQLite3Table::Serialize, without building an SQLite3Table
+// Like sqlite3_exec, column names are taken from the first row returned, and are not sent if no rows are returned
+struct SQLite3ResultWriter
+{
+	SQLite3ResultWriter(RakNet::BitStream *_bitStream) {bitStream=_bitStream; numRows=0; wroteColumnNames=false;}
+	void WriteRow(sqlite3_stmt *statement)
+	{
+		int numColumns = sqlite3_column_count(statement);
+		int idx;
+		if (wroteColumnNames==false)
+		{
+			bitStream->Write((unsigned int) numColumns);
+			for (idx=0; idx < numColumns; idx++)
+				RakNet::RakString::Serialize(sqlite3_column_name(statement, idx), bitStream);
+			numRowsOffset=bitStream->GetWriteOffset();
+			bitStream->Write(numRows);
+			wroteColumnNames=true;
+		}
+		for (idx=0; idx < numColumns; idx++)
+		{
+			const char *text = (const char *) sqlite3_column_text(statement, idx);
+			if (text)
+				RakNet::RakString::Serialize(text, bitStream);
+			else
+				RakNet::RakString::Serialize("", bitStream);
+		}
+		numRows++;
+	}
+	void Finish(void)
+	{
+		if (wroteColumnNames==false)
+		{
+			bitStream->Write((unsigned int) 0);
+			bitStream->Write((unsigned int) 0);
+			return;
+		}
+		BitSize_t endOffset = bitStream->GetWriteOffset();
+		bitStream->SetWriteOffset(numRowsOffset);
+		bitStream->Write(numRows);
+		bitStream->SetWriteOffset(endOffset);
+	}
+
+	RakNet::BitStream *bitStream;
+	BitSize_t numRowsOffset;
+	unsigned int numRows;
+	bool wroteColumnNames;
+};
+
+static bool IsOnlyWhitespace(const char *str)
+{
+	while (*str)
+	{
+		if (*str!=' ' && *str!='\t' && *str!='\r' && *str!='\n' && *str!=';')
+			return false;
+		str++;
+	}
+	return true;
+}
+static bool IsReadOnlyStatement(sqlite3_stmt *statement, const char *sql)
+{
+#if SQLITE_VERSION_NUMBER >= 3007004
+	(void) sql;
+	return sqlite3_stmt_readonly(statement)!=0;
+#else
+	// This version of SQLite cannot report it, so only send plain SELECT statements to the read connections
+	(void) statement;
+	while (*sql==' ' || *sql=='\t' || *sql=='\r' || *sql=='\n')
+		sql++;
+	return _strnicmp(sql, "SELECT", 6)==0;
+#endif
+}
+// Returns the prepared statement for sql, preparing it the first time it is seen on this connection
+// Text with more than one statement is not prepared, and returns 0 with isSingleStatement false
+static sqlite3_stmt* GetStatement(SQLite3ServerPlugin::SQLite3Connection *connection, const RakNet::RakString &sql, bool *isSingleStatement, RakNet::RakString &errorMsg)
+{
+	*isSingleStatement=true;
+	sqlite3_stmt **cachedStatement = connection->statementCache.Peek(sql);
+	if (cachedStatement)
+		return *cachedStatement;
 
+	sqlite3_stmt *statement=0;
+	const char *tail=0;
+	if (sqlite3_prepare_v2(connection->dbHandle, sql.C_String(), (int) sql.GetLength()+1, &statement, &tail)!=SQLITE_OK)
+	{
+		errorMsg=sqlite3_errmsg(connection->dbHandle);
+		if (statement)
+			sqlite3_finalize(statement);
+		return 0;
+	}
+	if (statement==0 || (tail && IsOnlyWhitespace(tail)==false))
+	{
+		if (statement)
+			sqlite3_finalize(statement);
+		*isSingleStatement=false;
+		return 0;
+	}
 
-int PerRowCallback(void *userArgument, int argc, char **argv, char **azColName)
+	if (connection->statementCache.Size()>=SQLite3_STATEMENT_CACHE_SIZE)
+		connection->FinalizeStatements();
+	connection->statementCache.Push(sql, statement, _FILE_AND_LINE_);
+	return statement;
+}
+static void BindParameters(sqlite3_stmt *statement, const DataStructures::List<RakNet::RakString> &parameters)
 {
-	SQLite3Table *outputTable = (SQLite3Table*)userArgument;
+	int parameterCount = sqlite3_bind_parameter_count(statement);
 	unsigned int idx;
-	if (outputTable->columnNames.Size()==0)
+	for (idx=0; idx < parameters.Size() && (int) idx < parameterCount; idx++)
+		sqlite3_bind_text(statement, idx+1, parameters[idx].C_String(), (int) parameters[idx].GetLength(), SQLITE_TRANSIENT);
+}
+// Steps through every row, then resets the statement so it can be used again
+static void StepStatement(sqlite3 *dbHandle, sqlite3_stmt *statement, SQLite3ResultWriter *resultWriter, RakNet::RakString &errorMsg)
+{
+	int res;
+	while ((res=sqlite3_step(statement))==SQLITE_ROW)
+		resultWriter->WriteRow(statement);
+	if (res!=SQLITE_DONE)
+		errorMsg=sqlite3_errmsg(dbHandle);
+	sqlite3_reset(statement);
+	sqlite3_clear_bindings(statement);
+}
+// Same as sqlite3_exec, for text holding more than one statement. Stops at the first error.
+static void StepMultipleStatements(SQLite3ServerPlugin::SQLite3Connection *connection, const char *sql, const DataStructures::List<RakNet::RakString> &parameters, SQLite3ResultWriter *resultWriter, RakNet::RakString &errorMsg)
+{
+	const char *tail=sql;
+	while (errorMsg.IsEmpty() && tail && IsOnlyWhitespace(tail)==false)
 	{
-		for (idx=0; idx < (unsigned int) argc; idx++)
-			outputTable->columnNames.Push(azColName[idx], _FILE_AND_LINE_ );
+		sqlite3_stmt *statement=0;
+		if (sqlite3_prepare_v2(connection->dbHandle, tail, -1, &statement, &tail)!=SQLITE_OK)
+		{
+			errorMsg=sqlite3_errmsg(connection->dbHandle);
+			if (statement)
+				sqlite3_finalize(statement);
+			return;
+		}
+		// Comment or empty statement
+		if (statement==0)
+			continue;
+		BindParameters(statement, parameters);
+		StepStatement(connection->dbHandle, statement, resultWriter, errorMsg);
+		sqlite3_finalize(statement);
 	}
-	SQLite3Row *row = RakNet::OP_NEW<SQLite3Row>(_FILE_AND_LINE_);
-	outputTable->rows.Push(row,_FILE_AND_LINE_);
-	for (idx=0; idx < (unsigned int) argc; idx++)
+}
+
+void SQLite3ServerPlugin::ExecStatement(SQLite3ConnectionPool *connectionPool, bool useReader, const RakNet::RakString &inputStatement, const DataStructures::List<RakNet::RakString> &parameters, RakNet::BitStream *bsOut, RakNet::RakString &errorMsg, bool *confirmedReadOnly)
+{
+	SQLite3ResultWriter resultWriter(bsOut);
+	bool isSingleStatement;
+	*confirmedReadOnly=false;
+
+	// There can be more threads than read connections, if another database has more, so when they are all busy the query runs on the writer instead
+	SQLite3Connection *reader = useReader ? connectionPool->AcquireReader() : 0;
+	if (reader)
 	{
-		if (argv[idx])
-			row->entries.Push(argv[idx], _FILE_AND_LINE_ );
-		else
-			row->entries.Push("", _FILE_AND_LINE_ );
+		sqlite3_stmt *statement = GetStatement(reader, inputStatement, &isSingleStatement, errorMsg);
+		if (statement)
+		{
+			BindParameters(statement, parameters);
+			StepStatement(reader->dbHandle, statement, &resultWriter, errorMsg);
+		}
+		connectionPool->ReleaseReader(reader);
+		resultWriter.Finish();
+		return;
 	}
-	return 0;
+
+	connectionPool->writerMutex.Lock();
+	sqlite3_stmt *statement = GetStatement(&connectionPool->writer, inputStatement, &isSingleStatement, errorMsg);
+	if (statement)
+	{
+		*confirmedReadOnly=IsReadOnlyStatement(statement, inputStatement.C_String());
+		BindParameters(statement, parameters);
+		StepStatement(connectionPool->writer.dbHandle, statement, &resultWriter, errorMsg);
+	}
+	else if (isSingleStatement==false)
+	{
+		StepMultipleStatements(&connectionPool->writer, inputStatement.C_String(), parameters, &resultWriter, errorMsg);
+	}
+	connectionPool->writerMutex.Unlock();
+	resultWriter.Finish();
+}
+
+SQLite3ServerPlugin::SQLite3Connection::SQLite3Connection()
+{
+	dbHandle=0;
+}
+SQLite3ServerPlugin::SQLite3Connection::~SQLite3Connection()
+{
+	FinalizeStatements();
+}
+void SQLite3ServerPlugin::SQLite3Connection::FinalizeStatements(void)
+{
+	DataStructures::List<sqlite3_stmt*> statements;
+	DataStructures::List<RakNet::RakString> sql;
+	statementCache.GetAsList(statements, sql, _FILE_AND_LINE_);
+	for (unsigned int i=0; i < statements.Size(); i++)
+		sqlite3_finalize(statements[i]);
+	statementCache.Clear(_FILE_AND_LINE_);
+}
+SQLite3ServerPlugin::SQLite3ConnectionPool::SQLite3ConnectionPool()
+{
+#ifdef SQLite3_STATEMENT_EXECUTE_THREADED
+	writerBusy=false;
+#endif
+}
+SQLite3ServerPlugin::SQLite3ConnectionPool::~SQLite3ConnectionPool()
+{
+#ifdef SQLite3_STATEMENT_EXECUTE_THREADED
+	ClearQueuedStatements();
+#endif
+	// Read connections are only ever opened by AddDBFile(), so always belong to this class
+	for (unsigned int i=0; i < readers.Size(); i++)
+	{
+		readers[i]->FinalizeStatements();
+		sqlite3_close(readers[i]->dbHandle);
+		RakNet::OP_DELETE(readers[i], _FILE_AND_LINE_);
+	}
+	writer.FinalizeStatements();
+}
+SQLite3ServerPlugin::SQLite3Connection* SQLite3ServerPlugin::SQLite3ConnectionPool::AcquireReader(void)
+{
+	SQLite3Connection *reader=0;
+	readersMutex.Lock();
+	if (idleReaders.Size())
+		reader=idleReaders.Pop();
+	readersMutex.Unlock();
+	return reader;
+}
+void SQLite3ServerPlugin::SQLite3ConnectionPool::ReleaseReader(SQLite3Connection *reader)
+{
+	readersMutex.Lock();
+	idleReaders.Push(reader, _FILE_AND_LINE_);
+	readersMutex.Unlock();
+}
+bool SQLite3ServerPlugin::SQLite3ConnectionPool::IsConfirmedReadOnly(const RakNet::RakString &sql)
+{
+	return readers.Size()>0 && readOnlyStatements.HasData(sql);
 }
+void SQLite3ServerPlugin::SQLite3ConnectionPool::ConfirmReadOnly(const RakNet::RakString &sql)
+{
+	if (readers.Size()==0 || readOnlyStatements.HasData(sql))
+		return;
+	if (readOnlyStatements.Size()>=SQLite3_STATEMENT_CACHE_SIZE)
+		readOnlyStatements.Clear(_FILE_AND_LINE_);
+	readOnlyStatements.Push(sql, true, _FILE_AND_LINE_);
+}
+#ifdef SQLite3_STATEMENT_EXECUTE_THREADED
+void SQLite3ServerPlugin::SQLite3ConnectionPool::ClearQueuedStatements(void)
+{
+	while (writerQueue.Size())
+		rakFree_Ex(writerQueue.Pop().data, _FILE_AND_LINE_);
+	writerBusy=false;
+	DataStructures::List<DataStructures::Queue<SQLExecThreadInput> > queues;
+	DataStructures::List<SystemAddress> senders;
+	waitingStatements.GetAsList(queues, senders, _FILE_AND_LINE_);
+	for (unsigned int i=0; i < queues.Size(); i++)
+	{
+		while (queues[i].Size())
+			rakFree_Ex(queues[i].Pop().data, _FILE_AND_LINE_);
+	}
+	waitingStatements.Clear(_FILE_AND_LINE_);
+}
+#endif
+
 SQLite3ServerPlugin::SQLite3ServerPlugin()
 {
+#ifdef SQLite3_STATEMENT_EXECUTE_THREADED
+	sqlThreadCount=0;
+#endif
 }
 SQLite3ServerPlugin::~SQLite3ServerPlugin()
 {
 	StopThreads();
+	for (unsigned int i=0; i < dbHandles.GetSize(); i++)
+		RakNet::OP_DELETE(dbHandles[i].connectionPool, _FILE_AND_LINE_);
 }
 bool SQLite3ServerPlugin::AddDBHandle(RakNet::RakString dbIdentifier, sqlite3 *dbHandle, bool dbAutoCreated)
 {
@@ -59,31 +311,92 @@ bool SQLite3ServerPlugin::AddDBHandle(RakNet::RakString dbIdentifier, sqlite3 *d
 	ndbh.dbIdentifier=dbIdentifier;
 	ndbh.dbAutoCreated=dbAutoCreated;
 	ndbh.whenCreated=RakNet::GetTimeMS();
+	ndbh.connectionPool=RakNet::OP_NEW<SQLite3ConnectionPool>(_FILE_AND_LINE_);
+	ndbh.connectionPool->writer.dbHandle=dbHandle;
 	dbHandles.InsertAtIndex(ndbh,idx,_FILE_AND_LINE_);
 	
 #ifdef SQLite3_STATEMENT_EXECUTE_THREADED
 	if (sqlThreadPool.WasStarted()==false)
+	{
 		sqlThreadPool.StartThreads(1,0);
+		sqlThreadCount=1;
+	}
 #endif
 
 	return true;
 }
-void SQLite3ServerPlugin::RemoveDBHandle(RakNet::RakString dbIdentifier, bool alsoCloseConnection)
+bool SQLite3ServerPlugin::AddDBFile(RakNet::RakString dbIdentifier, const char *filename, int numReadConnections)
 {
-	unsigned int idx = dbHandles.GetIndexOf(dbIdentifier);
-	if (idx!=(unsigned int)-1)
+	if (dbIdentifier.IsEmpty() || dbHandles.GetInsertionIndex(dbIdentifier)==(unsigned int)-1)
+		return false;
+
+	sqlite3 *writerHandle;
+	if (sqlite3_open_v2(filename, &writerHandle, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, 0)!=SQLITE_OK)
 	{
-		if (alsoCloseConnection)
+		sqlite3_close(writerHandle);
+		return false;
+	}
+#if SQLITE_VERSION_NUMBER >= 3007000
+	sqlite3_exec(writerHandle, "PRAGMA journal_mode=WAL;", 0, 0, 0);
+#endif
+	// Without WAL, readers and the writer lock each other out for a short time on commit
+	sqlite3_busy_timeout(writerHandle, 5000);
+
+	if (AddDBHandle(dbIdentifier, writerHandle, false)==false)
+	{
+		sqlite3_close(writerHandle);
+		return false;
+	}
+	SQLite3ConnectionPool *connectionPool = dbHandles[dbHandles.GetIndexOf(dbIdentifier)].connectionPool;
+
+	for (int i=0; i < numReadConnections; i++)
+	{
+		sqlite3 *readerHandle;
+		if (sqlite3_open_v2(filename, &readerHandle, SQLITE_OPEN_READONLY, 0)!=SQLITE_OK)
 		{
-			printf("Closed %s\n", dbIdentifier.C_String());
-			sqlite3_close(dbHandles[idx].dbHandle);
+			sqlite3_close(readerHandle);
+			break;
 		}
-		dbHandles.RemoveAtIndex(idx,_FILE_AND_LINE_);
+		sqlite3_busy_timeout(readerHandle, 5000);
+		SQLite3Connection *reader = RakNet::OP_NEW<SQLite3Connection>(_FILE_AND_LINE_);
+		reader->dbHandle=readerHandle;
+		connectionPool->readers.Push(reader, _FILE_AND_LINE_);
+		connectionPool->idleReaders.Push(reader, _FILE_AND_LINE_);
+	}
+
+#ifdef SQLite3_STATEMENT_EXECUTE_THREADED
+	// Queued statements stay in the input queue while the threads restart
+	int threadsNeeded = 1 + (int) connectionPool->readers.Size();
+	if (threadsNeeded > sqlThreadCount)
+	{
+		sqlThreadPool.StopThreads();
+		sqlThreadPool.StartThreads(threadsNeeded,0);
+		sqlThreadCount=threadsNeeded;
+	}
+#endif
+
+	return true;
+}
+void SQLite3ServerPlugin::RemoveDBHandleAtIndex(unsigned int idx, bool alsoCloseConnection)
+{
+	// Prepared statements must be finalized before the connection can be closed
+	RakNet::OP_DELETE(dbHandles[idx].connectionPool, _FILE_AND_LINE_);
+	if (alsoCloseConnection)
+	{
+		printf("Closed %s\n", dbHandles[idx].dbIdentifier.C_String());
+		sqlite3_close(dbHandles[idx].dbHandle);
+	}
+	dbHandles.RemoveAtIndex(idx,_FILE_AND_LINE_);
 #ifdef SQLite3_STATEMENT_EXECUTE_THREADED
 	if (dbHandles.GetSize()==0)
 		StopThreads();
 #endif // SQLite3_STATEMENT_EXECUTE_THREADED
-	}
+}
+void SQLite3ServerPlugin::RemoveDBHandle(RakNet::RakString dbIdentifier, bool alsoCloseConnection)
+{
+	unsigned int idx = dbHandles.GetIndexOf(dbIdentifier);
+	if (idx!=(unsigned int)-1)
+		RemoveDBHandleAtIndex(idx, alsoCloseConnection);
 }
 void SQLite3ServerPlugin::RemoveDBHandle(sqlite3 *dbHandle, bool alsoCloseConnection)
 {
@@ -92,20 +405,28 @@ void SQLite3ServerPlugin::RemoveDBHandle(sqlite3 *dbHandle, bool alsoCloseConnec
 	{
 		if (dbHandles[idx].dbHandle==dbHandle)
 		{
-			if (alsoCloseConnection)
-			{
-				printf("Closed %s\n", dbHandles[idx].dbIdentifier.C_String());
-				sqlite3_close(dbHandles[idx].dbHandle);
-			}
-			dbHandles.RemoveAtIndex(idx,_FILE_AND_LINE_);
-#ifdef SQLite3_STATEMENT_EXECUTE_THREADED
-			if (dbHandles.GetSize()==0)
-				StopThreads();
-#endif // SQLite3_STATEMENT_EXECUTE_THREADED
+			RemoveDBHandleAtIndex(idx, alsoCloseConnection);
 			return;
 		}
 	}
 }
+// Reads what follows the isRequest bit. Older clients do not send parameters.
+static void ReadParameters(RakNet::BitStream *bsIn, DataStructures::List<RakNet::RakString> &parameters)
+{
+	bool hasParameters=false;
+	bsIn->Read(hasParameters);
+	if (hasParameters==false)
+		return;
+	unsigned int numParameters=0;
+	bsIn->Read(numParameters);
+	RakNet::RakString parameter;
+	for (unsigned int i=0; i < numParameters; i++)
+	{
+		if (bsIn->Read(parameter)==false)
+			break;
+		parameters.Push(parameter, _FILE_AND_LINE_);
+	}
+}
 #ifdef SQLite3_STATEMENT_EXECUTE_THREADED
 void SQLite3ServerPlugin::Update(void)
 {
@@ -116,6 +437,11 @@ void SQLite3ServerPlugin::Update(void)
 		RakNet::BitStream bsOut((unsigned char*) output.data, output.length,false);
 		SendUnified(&bsOut, MEDIUM_PRIORITY,RELIABLE_ORDERED,0,output.sender,false);
 		rakFree_Ex(output.data,_FILE_AND_LINE_);
+
+		// Skip databases removed while the statement was running
+		unsigned int idx = dbHandles.GetIndexOf(output.dbIdentifier);
+		if (idx!=(unsigned int)-1 && dbHandles[idx].connectionPool==output.connectionPool)
+			OnStatementDone(output.connectionPool, output);
 	}
 }
 SQLite3ServerPlugin::SQLExecThreadOutput ExecStatementThread(SQLite3ServerPlugin::SQLExecThreadInput threadInput, bool *returnOutput, void* perThreadData)
@@ -123,6 +449,7 @@ SQLite3ServerPlugin::SQLExecThreadOutput ExecStatementThread(SQLite3ServerPlugin
 	unsigned int queryId;
 	RakNet::RakString dbIdentifier;
 	RakNet::RakString inputStatement;
+	DataStructures::List<RakNet::RakString> parameters;
 	RakNet::BitStream bsIn((unsigned char*) threadInput.data, threadInput.length, false);
 	bsIn.IgnoreBytes(sizeof(MessageID));
 	bsIn.Read(queryId);
@@ -131,16 +458,12 @@ SQLite3ServerPlugin::SQLExecThreadOutput ExecStatementThread(SQLite3ServerPlugin
 	// bool isRequest;
 	// bsIn.Read(isRequest);
 	bsIn.IgnoreBits(1);
+	ReadParameters(&bsIn, parameters);
 
-	char *errorMsg;
 	RakNet::RakString errorMsgStr;
-	SQLite3Table outputTable;					
-	sqlite3_exec(threadInput.dbHandle, inputStatement.C_String(), PerRowCallback, &outputTable, &errorMsg);
-	if (errorMsg)
-	{
-		errorMsgStr=errorMsg;
-		sqlite3_free(errorMsg);
-	}
+	RakNet::BitStream bsResult;
+	bool confirmedReadOnly;
+	SQLite3ServerPlugin::ExecStatement(threadInput.connectionPool, threadInput.useReader, inputStatement, parameters, &bsResult, errorMsgStr, &confirmedReadOnly);
 
 	RakNet::BitStream bsOut;
 	bsOut.Write((MessageID)ID_SQLite3_EXEC);
@@ -149,7 +472,7 @@ SQLite3ServerPlugin::SQLExecThreadOutput ExecStatementThread(SQLite3ServerPlugin
 	bsOut.Write(inputStatement);
 	bsOut.Write(false);
 	bsOut.Write(errorMsgStr);
-	outputTable.Serialize(&bsOut);
+	bsOut.Write(&bsResult);
 
 	// Free input data
 	rakFree_Ex(threadInput.data,_FILE_AND_LINE_);
@@ -160,11 +483,64 @@ SQLite3ServerPlugin::SQLExecThreadOutput ExecStatementThread(SQLite3ServerPlugin
 	memcpy(threadOutput.data,bsOut.GetData(),bsOut.GetNumberOfBytesUsed());
 	threadOutput.length=bsOut.GetNumberOfBytesUsed();
 	threadOutput.sender=threadInput.sender;	
+	threadOutput.connectionPool=threadInput.connectionPool;
+	threadOutput.dbIdentifier=dbIdentifier;
+	threadOutput.statement=inputStatement;
+	threadOutput.ranOnWriter=threadInput.useReader==false;
+	threadOutput.confirmedReadOnly=confirmedReadOnly;
 	// SendUnified(&bsOut, MEDIUM_PRIORITY,RELIABLE_ORDERED,0,packet->systemAddress,false);
 
 	*returnOutput=true;
 	return threadOutput;
 }
+void SQLite3ServerPlugin::QueueStatement(SQLite3ConnectionPool *connectionPool, const SQLExecThreadInput &input)
+{
+	// Only one statement per system runs at a time, so a query never overtakes an earlier write from the same system, and replies are sent in order
+	DataStructures::Queue<SQLExecThreadInput> *waiting = connectionPool->waitingStatements.Peek(input.sender);
+	if (waiting)
+	{
+		waiting->Push(input, _FILE_AND_LINE_);
+		return;
+	}
+	connectionPool->waitingStatements.Push(input.sender, DataStructures::Queue<SQLExecThreadInput>(), _FILE_AND_LINE_);
+	RunStatement(connectionPool, input);
+}
+void SQLite3ServerPlugin::RunStatement(SQLite3ConnectionPool *connectionPool, SQLExecThreadInput input)
+{
+	// Anything the writer has not yet found to only read goes to the writer, which runs one statement at a time in the order received
+	input.useReader=connectionPool->IsConfirmedReadOnly(input.statement);
+	if (input.useReader==false)
+	{
+		if (connectionPool->writerBusy)
+		{
+			connectionPool->writerQueue.Push(input, _FILE_AND_LINE_);
+			return;
+		}
+		connectionPool->writerBusy=true;
+	}
+	sqlThreadPool.AddInput(ExecStatementThread, input);
+}
+void SQLite3ServerPlugin::OnStatementDone(SQLite3ConnectionPool *connectionPool, const SQLExecThreadOutput &output)
+{
+	if (output.confirmedReadOnly)
+		connectionPool->ConfirmReadOnly(output.statement);
+
+	if (output.ranOnWriter)
+	{
+		if (connectionPool->writerQueue.Size())
+			sqlThreadPool.AddInput(ExecStatementThread, connectionPool->writerQueue.Pop());
+		else
+			connectionPool->writerBusy=false;
+	}
+
+	DataStructures::Queue<SQLExecThreadInput> *waiting = connectionPool->waitingStatements.Peek(output.sender);
+	if (waiting==0)
+		return;
+	if (waiting->Size())
+		RunStatement(connectionPool, waiting->Pop());
+	else
+		connectionPool->waitingStatements.Remove(output.sender, _FILE_AND_LINE_);
+}
 #endif // SQLite3_STATEMENT_EXECUTE_THREADED
 
 PluginReceiveResult SQLite3ServerPlugin::OnReceive(Packet *packet)
@@ -205,19 +581,21 @@ PluginReceiveResult SQLite3ServerPlugin::OnReceive(Packet *packet)
 					input.data=(char*) rakMalloc_Ex(packet->length, _FILE_AND_LINE_);
 					memcpy(input.data,packet->data,packet->length);
 					input.dbHandle=dbHandles[idx].dbHandle;
+					input.connectionPool=dbHandles[idx].connectionPool;
 					input.length=packet->length;
 					input.sender=packet->systemAddress;
-					sqlThreadPool.AddInput(ExecStatementThread, input);
+					input.statement=inputStatement;
+					QueueStatement(input.connectionPool, input);
 #else
-					char *errorMsg;
+					DataStructures::List<RakNet::RakString> parameters;
+					ReadParameters(&bsIn, parameters);
 					RakNet::RakString errorMsgStr;
-					SQLite3Table outputTable;					
-					sqlite3_exec(dbHandles[idx].dbHandle, inputStatement.C_String(), PerRowCallback, &outputTable, &errorMsg);
-					if (errorMsg)
-					{
-						errorMsgStr=errorMsg;
-						sqlite3_free(errorMsg);
-					}
+					RakNet::BitStream bsResult;
+					SQLite3ConnectionPool *connectionPool = dbHandles[idx].connectionPool;
+					bool confirmedReadOnly;
+					ExecStatement(connectionPool, connectionPool->IsConfirmedReadOnly(inputStatement), inputStatement, parameters, &bsResult, errorMsgStr, &confirmedReadOnly);
+					if (confirmedReadOnly)
+						connectionPool->ConfirmReadOnly(inputStatement);
 					RakNet::BitStream bsOut;
 					bsOut.Write((MessageID)ID_SQLite3_EXEC);
 					bsOut.Write(queryId);
@@ -225,7 +603,7 @@ PluginReceiveResult SQLite3ServerPlugin::OnReceive(Packet *packet)
 					bsOut.Write(inputStatement);
 					bsOut.Write(false);
 					bsOut.Write(errorMsgStr);
-					outputTable.Serialize(&bsOut);
+					bsOut.Write(&bsResult);
 					SendUnified(&bsOut, MEDIUM_PRIORITY,RELIABLE_ORDERED,0,packet->systemAddress,false);
 #endif
 				}
@@ -249,16 +627,20 @@ void SQLite3ServerPlugin::StopThreads(void)
 {
 #ifdef SQLite3_STATEMENT_EXECUTE_THREADED
 	sqlThreadPool.StopThreads();
+	sqlThreadCount=0;
 	unsigned int i;
 	for (i=0; i < sqlThreadPool.InputSize(); i++)
 	{
-		RakNet::OP_DELETE(sqlThreadPool.GetInputAtIndex(i).data, _FILE_AND_LINE_);
+		rakFree_Ex(sqlThreadPool.GetInputAtIndex(i).data, _FILE_AND_LINE_);
 	}
 	sqlThreadPool.ClearInput();
 	for (i=0; i < sqlThreadPool.OutputSize(); i++)
 	{
-		RakNet::OP_DELETE(sqlThreadPool.GetOutputAtIndex(i).data, _FILE_AND_LINE_);
+		rakFree_Ex(sqlThreadPool.GetOutputAtIndex(i).data, _FILE_AND_LINE_);
 	}
 	sqlThreadPool.ClearOutput();
+	// The statements these were waiting for were just dropped
+	for (i=0; i < dbHandles.GetSize(); i++)
+		dbHandles[i].connectionPool->ClearQueuedStatements();
 #endif
 }
@@ -22,13 +22,23 @@
 /// \ingroup SQL_LITE_3_PLUGIN
 #define SQLite3_STATEMENT_EXECUTE_THREADED
 
+/// \brief How many prepared statements to keep per connection
+/// \details The SQL text of each statement received is prepared once and reused, so repeated queries skip the SQL parser.<BR>
+/// When a connection has this many statements cached, they are all finalized and the cache starts over.
+/// \ingroup SQL_LITE_3_PLUGIN
+#ifndef SQLite3_STATEMENT_CACHE_SIZE
+#define SQLite3_STATEMENT_CACHE_SIZE 64
+#endif
+
 #include "RakNetTypes.h"
 #include "Export.h"
 #include "PluginInterface2.h"
 #include "PacketPriority.h"
 #include "SocketIncludes.h"
 #include "DS_Multilist.h"
+#include "DS_Hash.h"
 #include "RakString.h"
+#include "SimpleMutex.h"
 #include "sqlite3.h"
 #include "SQLite3PluginCommon.h"
 
@@ -59,6 +69,15 @@ public:
 	/// \return true on success, false on dbIdentifier empty, or already in use
 	virtual bool AddDBHandle(RakNet::RakString dbIdentifier, sqlite3 *dbHandle, bool dbAutoCreated=false);
 
+	/// Open \a filename once for writing, and \a numReadConnections more times for reading
+	/// Statements run on the writer, one at a time in the order received. Once the writer has run a statement and found it only reads the database, later copies of that statement run on whichever read connection is free, so several queries can run at once.
+	/// Statements from the same system run in the order they were sent, whichever connection they use.
+	/// The journal is put in WAL mode if the SQLite version supports it (3.7.0 and up), so readers do not wait on the writer either.
+	/// If SQLite3_STATEMENT_EXECUTE_THREADED is defined, starts enough execution threads to keep every connection busy.
+	/// Remove with RemoveDBHandle(dbIdentifier, true), so the connections opened here are closed.
+	/// \return true on success, false on dbIdentifier empty or already in use, or the file could not be opened
+	virtual bool AddDBFile(RakNet::RakString dbIdentifier, const char *filename, int numReadConnections=3);
+
 	/// Stop using a dbHandle, lookup either by identifier or by pointer.
 	/// If SQLite3_STATEMENT_EXECUTE_THREADED is defined, do not call this while processing commands, since the commands run in a thread and might be using the dbHandle
 	/// Call before closing the handle or else SQLite3Plugin won't know that it was closed, and will continue using it
@@ -70,42 +89,111 @@ public:
 	virtual void OnAttach(void);
 	virtual void OnDetach(void);
 
-	/// \internal
-	struct NamedDBHandle
-	{
-		RakNet::RakString dbIdentifier;
-		sqlite3 *dbHandle;
-		bool dbAutoCreated;
-		RakNet::TimeMS whenCreated;
-	};
+	struct SQLite3ConnectionPool;
 
 #ifdef SQLite3_STATEMENT_EXECUTE_THREADED
 	virtual void Update(void);
 	/// \internal
 	struct SQLExecThreadInput
 	{
-		SQLExecThreadInput() {data=0; packet=0;}
+		SQLExecThreadInput() {data=0; packet=0; connectionPool=0; useReader=false;}
 		char *data;
 		unsigned int length;
 		SystemAddress sender;
 		RakNet::TimeMS whenMessageArrived;
 		sqlite3 *dbHandle;
 		RakNet::Packet *packet;
+		SQLite3ConnectionPool *connectionPool;
+		RakNet::RakString statement;
+		bool useReader;
 	};
 
 	/// \internal
 	struct SQLExecThreadOutput
 	{
-		SQLExecThreadOutput() {data=0; packet=0;}
+		SQLExecThreadOutput() {data=0; packet=0; connectionPool=0; ranOnWriter=false; confirmedReadOnly=false;}
 		char *data;
 		unsigned int length;
 		SystemAddress sender;
 		RakNet::Packet *packet;
+		SQLite3ConnectionPool *connectionPool;
+		RakNet::RakString dbIdentifier;
+		RakNet::RakString statement;
+		bool ranOnWriter;
+		bool confirmedReadOnly;
 	};
 #endif // SQLite3_STATEMENT_EXECUTE_THREADED
 
+	/// \internal A connection and the statements prepared on it. Only used by one thread at a time.
+	struct SQLite3Connection
+	{
+		SQLite3Connection();
+		~SQLite3Connection();
+		void FinalizeStatements(void);
+
+		sqlite3 *dbHandle;
+		DataStructures::Hash<RakNet::RakString, sqlite3_stmt*, SQLite3_STATEMENT_CACHE_SIZE, RakNet::RakString::ToInteger> statementCache;
+	};
+
+	/// \internal The connection that writes, and the connections added by AddDBFile() that only read
+	struct SQLite3ConnectionPool
+	{
+		SQLite3ConnectionPool();
+		~SQLite3ConnectionPool();
+		/// Returns 0 if all read connections are in use, or there are none
+		SQLite3Connection* AcquireReader(void);
+		void ReleaseReader(SQLite3Connection *reader);
+		/// True if the writer has run \a sql and found it to be one statement that only reads. Always false without read connections.
+		bool IsConfirmedReadOnly(const RakNet::RakString &sql);
+		void ConfirmReadOnly(const RakNet::RakString &sql);
+
+		SQLite3Connection writer;
+		RakNet::SimpleMutex writerMutex;
+		DataStructures::List<SQLite3Connection*> readers;
+		DataStructures::List<SQLite3Connection*> idleReaders;
+		RakNet::SimpleMutex readersMutex;
+		// Only used by the thread that calls OnReceive()
+		DataStructures::Hash<RakNet::RakString, bool, SQLite3_STATEMENT_CACHE_SIZE, RakNet::RakString::ToInteger> readOnlyStatements;
+
+#ifdef SQLite3_STATEMENT_EXECUTE_THREADED
+		/// Frees the statements that are waiting to run
+		void ClearQueuedStatements(void);
+
+		// The rest is only used by the thread that calls OnReceive() and Update()
+		// Statements for the writer that are waiting for the one running on it
+		DataStructures::Queue<SQLExecThreadInput> writerQueue;
+		bool writerBusy;
+		// Systems with a statement running on this database, and their statements received since
+		DataStructures::Hash<SystemAddress, DataStructures::Queue<SQLExecThreadInput>, 64, SystemAddress::ToInteger> waitingStatements;
+#endif
+	};
+
+	/// \internal
+	struct NamedDBHandle
+	{
+		RakNet::RakString dbIdentifier;
+		sqlite3 *dbHandle;
+		bool dbAutoCreated;
+		RakNet::TimeMS whenCreated;
+		SQLite3ConnectionPool *connectionPool;
+	};
+
+	/// \internal Runs \a inputStatement, writing any result rows to \a bsOut in the format read by SQLite3Table::Deserialize()
+	/// Runs on a read connection if \a useReader is true and one is free, else on the writer. \a confirmedReadOnly is set if the writer found \a inputStatement to be one statement that only reads.
+	static void ExecStatement(SQLite3ConnectionPool *connectionPool, bool useReader, const RakNet::RakString &inputStatement, const DataStructures::List<RakNet::RakString> &parameters, RakNet::BitStream *bsOut, RakNet::RakString &errorMsg, bool *confirmedReadOnly);
+
 protected:
 	virtual void StopThreads(void);
+	void RemoveDBHandleAtIndex(unsigned int idx, bool alsoCloseConnection);
+
+#ifdef SQLite3_STATEMENT_EXECUTE_THREADED
+	// Runs input once the statement running for the same system on the same database, if any, is done
+	void QueueStatement(SQLite3ConnectionPool *connectionPool, const SQLExecThreadInput &input);
+	// Passes input to a thread, or to the writer queue if it is not confirmed to only read
+	void RunStatement(SQLite3ConnectionPool *connectionPool, SQLExecThreadInput input);
+	// Starts the statements that were waiting for output
+	void OnStatementDone(SQLite3ConnectionPool *connectionPool, const SQLExecThreadOutput &output);
+#endif
 
 	// List of databases added with AddDBHandle()
 	DataStructures::Multilist<ML_ORDERED_LIST, NamedDBHandle, RakNet::RakString> dbHandles;
@@ -114,13 +202,16 @@ protected:
 	// The point of the sqlThreadPool is so that SQL queries, which are blocking, happen in the thread and don't slow down the rest of the application
 	// The sqlThreadPool has a queue for incoming processing requests.  As systems disconnect their pending requests are removed from the list.
 	ThreadPool<SQLExecThreadInput, SQLExecThreadOutput> sqlThreadPool;
+	// One thread per connection that can run at once
+	int sqlThreadCount;
 #endif
 };
 
-};
-
+// In namespace RakNet so argument dependent lookup finds them from DS_Multilist
 extern bool operator<( const DataStructures::MLKeyRef<RakNet::RakString> &inputKey, const RakNet::SQLite3ServerPlugin::NamedDBHandle &cls );
 extern bool operator>( const DataStructures::MLKeyRef<RakNet::RakString> &inputKey, const RakNet::SQLite3ServerPlugin::NamedDBHandle &cls );
 extern bool operator==( const DataStructures::MLKeyRef<RakNet::RakString> &inputKey, const RakNet::SQLite3ServerPlugin::NamedDBHandle &cls );
 
+};
+
 #endif
@@ -0,0 +1,194 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Times CreatePatch() and PatchCache over a synthetic asset tree
+
+
+#include "CreatePatch.h"
+#include "ApplyPatch.h"
+#include "PatchCache.h"
+#include "GetTime.h"
+#include "RakString.h"
+#include "DS_List.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct Asset
+{
+	RakNet::RakString path;
+	char *oldData, *newData;
+	unsigned int oldSize, newSize;
+};
+
+static unsigned int randomSeed=12345;
+static unsigned int NextRandom(void)
+{
+	randomSeed=randomSeed*1103515245+12345;
+	return randomSeed>>8;
+}
+
+// Asset-like content: runs of repeated records mixed with noise, so the patch compresses like real data
+static void FillAsset(char *data, unsigned int size)
+{
+	unsigned int i=0;
+	while (i < size)
+	{
+		unsigned int runLength=16+NextRandom()%240;
+		unsigned char record[16];
+		unsigned int j;
+		for (j=0; j < sizeof(record); j++)
+			record[j]=(unsigned char) NextRandom();
+		for (j=0; j < runLength && i < size; j++, i++)
+			data[i]=(char) (record[j%sizeof(record)] + (NextRandom()%8==0 ? 1 : 0));
+	}
+}
+
+// Simulates an artist's edit: some bytes changed, some chunks inserted and removed
+static void EditAsset(const char *oldData, unsigned int oldSize, char **newData, unsigned int *newSize)
+{
+	*newData=new char[oldSize+oldSize/8+64];
+	unsigned int readOffset=0, writeOffset=0;
+	while (readOffset < oldSize)
+	{
+		unsigned int copyLength=4096+NextRandom()%65536;
+		if (copyLength > oldSize-readOffset)
+			copyLength=oldSize-readOffset;
+		memcpy(*newData+writeOffset, oldData+readOffset, copyLength);
+		readOffset+=copyLength;
+		writeOffset+=copyLength;
+
+		switch (NextRandom()%4)
+		{
+		case 0:
+			// Modify
+			if (writeOffset>64)
+			{
+				unsigned int k;
+				for (k=0; k < 32; k++)
+					(*newData)[writeOffset-1-NextRandom()%64]^=(char) NextRandom();
+			}
+			break;
+		case 1:
+			// Insert
+			if (writeOffset+64 < oldSize+oldSize/8)
+			{
+				FillAsset(*newData+writeOffset, 64);
+				writeOffset+=64;
+			}
+			break;
+		case 2:
+			// Remove
+			readOffset+=NextRandom()%256;
+			break;
+		}
+	}
+	*newSize=writeOffset;
+}
+
+static bool PatchAll(DataStructures::List<Asset> &assets, int numThreads, RakNet::PatchCache *cache, RakNet::TimeUS *elapsed, unsigned int *totalPatchSize)
+{
+	unsigned int i;
+	RakNet::TimeUS patchTime=0;
+	*totalPatchSize=0;
+	for (i=0; i < assets.Size(); i++)
+	{
+		char *patch, *patched;
+		unsigned int patchSize, patchedSize;
+		bool b;
+		RakNet::TimeUS startTime=RakNet::GetTimeUS();
+		if (cache)
+			b=cache->GetPatch(assets[i].oldData, assets[i].oldSize, assets[i].newData, assets[i].newSize, &patch, &patchSize);
+		else
+			b=CreatePatch(assets[i].oldData, assets[i].oldSize, assets[i].newData, assets[i].newSize, &patch, &patchSize, numThreads);
+		patchTime+=RakNet::GetTimeUS()-startTime;
+		if (b==false)
+		{
+			printf("CreatePatch failed on %s\n", assets[i].path.C_String());
+			return false;
+		}
+		*totalPatchSize+=patchSize;
+
+		if (ApplyPatch(assets[i].oldData, assets[i].oldSize, &patched, &patchedSize, patch, patchSize)==false ||
+			patchedSize!=assets[i].newSize ||
+			memcmp(patched, assets[i].newData, patchedSize)!=0)
+		{
+			printf("Patch for %s did not reproduce the new file\n", assets[i].path.C_String());
+			return false;
+		}
+		delete [] patch;
+		delete [] patched;
+	}
+	*elapsed=patchTime;
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int numFiles=12;
+	unsigned int largestFileMegabytes=8;
+	int numThreads=4;
+	const char *cacheDirectory="PatchCacheBenchmark";
+	if (argc>1)
+		numFiles=atoi(argv[1]);
+	if (argc>2)
+		largestFileMegabytes=atoi(argv[2]);
+	if (argc>3)
+		numThreads=atoi(argv[3]);
+	if (argc>4)
+		cacheDirectory=argv[4];
+
+	printf("Times CreatePatch over a synthetic asset tree.\n");
+	printf("%i files, largest %i megabytes, %i threads, cache in %s\n", numFiles, largestFileMegabytes, numThreads, cacheDirectory);
+
+	DataStructures::List<Asset> assets;
+	unsigned int i;
+	unsigned long long totalBytes=0;
+	for (i=0; i < numFiles; i++)
+	{
+		Asset asset;
+		// A few large packs and many small textures and scripts
+		asset.oldSize=(largestFileMegabytes*1024*1024) >> (i%6);
+		if (asset.oldSize < 4096)
+			asset.oldSize=4096;
+		asset.path=RakNet::RakString("Assets/Level%i/asset%i.pak", i/4, i);
+		asset.oldData=new char[asset.oldSize];
+		FillAsset(asset.oldData, asset.oldSize);
+		EditAsset(asset.oldData, asset.oldSize, &asset.newData, &asset.newSize);
+		totalBytes+=asset.newSize;
+		assets.Push(asset, _FILE_AND_LINE_);
+	}
+	printf("Generated %.2f megabytes of new content\n\n", (double) totalBytes/(1024.0*1024.0));
+
+	RakNet::TimeUS singleTime, multiTime, cacheMissTime, cacheHitTime;
+	unsigned int singleSize, multiSize, cacheSize;
+	if (PatchAll(assets, 1, 0, &singleTime, &singleSize)==false)
+		return 1;
+	printf("1 thread:    %8.1f ms, patches total %u bytes\n", singleTime/1000.0, singleSize);
+	if (PatchAll(assets, numThreads, 0, &multiTime, &multiSize)==false)
+		return 1;
+	printf("%i threads:   %8.1f ms, patches total %u bytes, %.2fx faster\n", numThreads, multiTime/1000.0, multiSize, (double) singleTime/(double) (multiTime ? multiTime : 1));
+
+	RakNet::PatchCache cache;
+	cache.SetCacheDirectory(cacheDirectory, numThreads);
+	if (PatchAll(assets, numThreads, &cache, &cacheMissTime, &cacheSize)==false)
+		return 1;
+	if (PatchAll(assets, numThreads, &cache, &cacheHitTime, &cacheSize)==false)
+		return 1;
+	printf("Cache pass 1: %8.1f ms\nCache pass 2: %8.1f ms (%u hits, %u misses)\n", cacheMissTime/1000.0, cacheHitTime/1000.0, cache.GetCacheHits(), cache.GetCacheMisses());
+
+	for (i=0; i < assets.Size(); i++)
+	{
+		delete [] assets[i].oldData;
+		delete [] assets[i].newData;
+	}
+	return 0;
+}
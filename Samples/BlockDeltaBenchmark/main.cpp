@@ -0,0 +1,173 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Measures what DirectoryDeltaTransfer sends with SetBlockDeltaMinimumFileLength() for typical edits to a large asset file, compared with sending the whole file, and the CPU time on each side
+
+
+#include "BlockDelta.h"
+#include "FileOperations.h"
+#include "BitStream.h"
+#include "Rand.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+using namespace RakNet;
+
+static const char *OLD_PATH="BlockDeltaBenchmarkOld.bin";
+static const char *NEW_PATH="BlockDeltaBenchmarkNew.bin";
+static const char *REBUILT_PATH="BlockDeltaBenchmarkRebuilt.bin";
+
+// Like compressed assets, which do not repeat
+static void FillRandom(char *data, unsigned int length)
+{
+	fillBufferMT(data, length);
+}
+
+static double CpuMilliseconds(clock_t startTime)
+{
+	return (double) (clock()-startTime)*1000.0/CLOCKS_PER_SEC;
+}
+
+// Edits the old file into newData, returning the new length
+static unsigned int Edit(int edit, const char *oldData, unsigned int oldLength, char *newData)
+{
+	unsigned int i, offset, length;
+	switch (edit)
+	{
+	case 0:
+		// A few values changed in place, as when a header or table is updated
+		memcpy(newData, oldData, oldLength);
+		for (i=0; i < 16; i++)
+			FillRandom(newData+randomMT()%(oldLength-64), 64);
+		return oldLength;
+	case 1:
+		// Everything after each insertion shifts, which blocks at fixed offsets could not match
+		length=0;
+		offset=0;
+		for (i=0; i < 16; i++)
+		{
+			unsigned int insertAt=oldLength/16*i+randomMT()%(oldLength/16);
+			memcpy(newData+length, oldData+offset, insertAt-offset);
+			length+=insertAt-offset;
+			offset=insertAt;
+			FillRandom(newData+length, 10);
+			length+=10;
+		}
+		memcpy(newData+length, oldData+offset, oldLength-offset);
+		length+=oldLength-offset;
+		return length;
+	case 2:
+		// A new asset in the middle of the pack
+		offset=oldLength/2;
+		memcpy(newData, oldData, offset);
+		FillRandom(newData+offset, 65536);
+		memcpy(newData+offset+65536, oldData+offset, oldLength-offset);
+		return oldLength+65536;
+	case 3:
+		// An asset removed from the middle of the pack
+		offset=oldLength/3;
+		length=oldLength/16;
+		memcpy(newData, oldData, offset);
+		memcpy(newData+offset, oldData+offset+length, oldLength-offset-length);
+		return oldLength-length;
+	case 4:
+		// New assets at the end
+		memcpy(newData, oldData, oldLength);
+		FillRandom(newData+oldLength, oldLength/16);
+		return oldLength+oldLength/16;
+	default:
+		// One asset replaced by a new version of the same length
+		offset=oldLength/4;
+		memcpy(newData, oldData, oldLength);
+		FillRandom(newData+offset, oldLength/16);
+		return oldLength;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int megabytes=64;
+	if (argc>1)
+		megabytes=atoi(argv[1]);
+	if (megabytes<1)
+		megabytes=1;
+
+	printf("Measures what DirectoryDeltaTransfer sends with SetBlockDeltaMinimumFileLength()\nfor typical edits to a large asset file, compared with sending the whole file,\nand the CPU time on each side\n");
+	printf("Difficulty: Intermediate\n\n");
+
+	unsigned int oldLength=megabytes*1048576;
+	char *oldData=new char[oldLength];
+	char *newData=new char[oldLength+oldLength/8+65536];
+	seedMT(12345);
+	FillRandom(oldData, oldLength);
+	if (WriteFileWithDirectories(OLD_PATH, oldData, oldLength)==false)
+	{
+		printf("Could not write %s\n", OLD_PATH);
+		return 1;
+	}
+	printf("%u MB file, %u byte blocks\n\n", megabytes, BlockDelta::GetBlockLength(oldLength));
+	printf("The receiver sends signatures of its file, and the sender a delta. Milliseconds are CPU time\n");
+	printf("  Edit                              Signatures        Delta   Sent, %% of file   Sign ms   Delta ms   Rebuild ms\n");
+
+	const char *editNames[6]=
+	{
+		"64 bytes changed in 16 places",
+		"10 bytes inserted in 16 places",
+		"64 KB inserted in the middle",
+		"1/16 of the file deleted",
+		"1/16 of the file appended",
+		"1/16 of the file rewritten",
+	};
+	bool allRebuilt=true;
+	for (int edit=0; edit < 6; edit++)
+	{
+		unsigned int newLength=Edit(edit, oldData, oldLength, newData);
+		WriteFileWithDirectories(NEW_PATH, newData, newLength);
+
+		// Receiver
+		clock_t startTime=clock();
+		BlockSignatures signatures;
+		BlockDelta::GetSignatures(OLD_PATH, &signatures);
+		RakNet::BitStream signaturesBitstream;
+		signatures.Serialize(&signaturesBitstream);
+		double signMilliseconds=CpuMilliseconds(startTime);
+
+		// Sender
+		startTime=clock();
+		BlockSignatures receivedSignatures;
+		receivedSignatures.Deserialize(&signaturesBitstream);
+		RakNet::BitStream delta;
+		bool deltaWritten=BlockDelta::GetDelta(receivedSignatures, NEW_PATH, &delta, newLength);
+		double deltaMilliseconds=CpuMilliseconds(startTime);
+
+		// Receiver
+		startTime=clock();
+		bool rebuilt=deltaWritten && BlockDelta::ApplyDelta(OLD_PATH, (const char*) delta.GetData(), delta.GetNumberOfBytesUsed(), REBUILT_PATH);
+		double rebuildMilliseconds=CpuMilliseconds(startTime);
+		if (rebuilt==false)
+			allRebuilt=false;
+		remove(REBUILT_PATH);
+
+		unsigned int sent=signaturesBitstream.GetNumberOfBytesUsed()+delta.GetNumberOfBytesUsed();
+		printf("  %-32s %11u %12u   %15.2f   %7.0f   %8.0f   %10.0f%s\n", editNames[edit],
+			signaturesBitstream.GetNumberOfBytesUsed(), delta.GetNumberOfBytesUsed(), sent*100.0/newLength,
+			signMilliseconds, deltaMilliseconds, rebuildMilliseconds, rebuilt ? "" : "   NOT REBUILT");
+	}
+	printf("\nWithout deltas, each edit sends the whole file, %u MB or more, and the receiver only writes it\n", megabytes);
+
+	remove(OLD_PATH);
+	remove(NEW_PATH);
+	delete [] oldData;
+	delete [] newData;
+	return allRebuilt ? 0 : 1;
+}
@@ -0,0 +1,282 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Measures allocations and time per broadcast with a copy per recipient, against one shared copy
+
+
+#include "ReliabilityLayer.h"
+#include "RakPeerInterface.h"
+#include "MessageIdentifiers.h"
+#include "BitStream.h"
+#include "RakMemoryOverride.h"
+#include "GetTime.h"
+#include "RakSleep.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+using namespace RakNet;
+
+static const int MTU_SIZE=1492;
+// Queued messages are thrown away after about this many bytes per recipient, so memory does not grow with the number of broadcasts
+static const unsigned int BYTES_BETWEEN_RESETS=262144;
+
+// Counts both rakMalloc_Ex() and operator new, which RakNet::OP_NEW uses
+static bool countAllocations=false;
+static unsigned int numAllocations=0;
+static void *CountingMalloc_Ex(size_t size, const char *file, unsigned int line)
+{
+	(void) file;
+	(void) line;
+	if (countAllocations)
+		numAllocations++;
+	return malloc(size);
+}
+void *operator new(size_t size)
+{
+	if (countAllocations)
+		numAllocations++;
+	void *p = malloc(size ? size : 1);
+	if (p==0)
+		throw std::bad_alloc();
+	return p;
+}
+void operator delete(void *p) throw()
+{
+	free(p);
+}
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+void operator delete[](void *p) throw()
+{
+	free(p);
+}
+
+struct RunResult
+{
+	double microsecondsPerBroadcast;
+	double allocationsPerBroadcast;
+};
+
+static void ResetLayers(ReliabilityLayer *layers, int numRecipients)
+{
+	for (int i=0; i < numRecipients; i++)
+		layers[i].Reset(true, MTU_SIZE, false);
+}
+
+// The same steps RakPeer::SendImmediate() takes to queue a broadcast, before and after sharing was added
+static void RunBroadcasts(ReliabilityLayer *layers, int numRecipients, char *message, unsigned int messageBytes, int numBroadcasts, bool shared, RunResult *result)
+{
+	RakNet::TimeUS totalTime=0;
+	int broadcastsBetweenResets = messageBytes < BYTES_BETWEEN_RESETS ? BYTES_BETWEEN_RESETS/messageBytes : 1;
+	numAllocations=0;
+	ResetLayers(layers, numRecipients);
+	for (int broadcast=0; broadcast < numBroadcasts; broadcast++)
+	{
+		if (broadcast>0 && broadcast%broadcastsBetweenResets==0)
+			ResetLayers(layers, numRecipients);
+
+		RakNet::TimeUS currentTime=RakNet::GetTimeUS();
+		countAllocations=true;
+		if (shared)
+		{
+			unsigned char *sharedDataBlock = (unsigned char*) rakMalloc_Ex(messageBytes, _FILE_AND_LINE_);
+			memcpy(sharedDataBlock, message, messageBytes);
+			InternalPacketRefCountedData *sharedData=ReliabilityLayer::AllocateSharedData(sharedDataBlock, _FILE_AND_LINE_);
+			for (int i=0; i < numRecipients; i++)
+				layers[i].SendShared(sharedData, BYTES_TO_BITS(messageBytes), HIGH_PRIORITY, RELIABLE_ORDERED, 0, MTU_SIZE, currentTime, 0);
+			ReliabilityLayer::ReleaseSharedData(sharedData, _FILE_AND_LINE_);
+		}
+		else
+		{
+			for (int i=0; i < numRecipients; i++)
+				layers[i].Send(message, BYTES_TO_BITS(messageBytes), HIGH_PRIORITY, RELIABLE_ORDERED, 0, true, MTU_SIZE, currentTime, 0);
+		}
+		countAllocations=false;
+		totalTime+=RakNet::GetTimeUS()-currentTime;
+	}
+	ResetLayers(layers, numRecipients);
+
+	result->microsecondsPerBroadcast=(double) totalTime/numBroadcasts;
+	result->allocationsPerBroadcast=(double) numAllocations/numBroadcasts;
+}
+
+static void WriteTestMessage(RakNet::BitStream *bitStream, uint32_t messageNumber, unsigned int messageBytes)
+{
+	bitStream->Write((MessageID) ID_USER_PACKET_ENUM);
+	bitStream->Write(messageNumber);
+	for (unsigned int i=sizeof(MessageID)+sizeof(uint32_t); i < messageBytes; i++)
+		bitStream->Write((unsigned char) (messageNumber*31+i));
+}
+
+static bool IsTestMessageIntact(Packet *packet, uint32_t *messageNumber, unsigned int messageBytes)
+{
+	if (packet->length!=messageBytes || packet->data[0]!=ID_USER_PACKET_ENUM)
+		return false;
+	RakNet::BitStream bitStream(packet->data, packet->length, false);
+	bitStream.IgnoreBytes(sizeof(MessageID));
+	bitStream.Read(*messageNumber);
+	for (unsigned int i=sizeof(MessageID)+sizeof(uint32_t); i < messageBytes; i++)
+	{
+		if (packet->data[i]!=(unsigned char) (*messageNumber*31+i))
+			return false;
+	}
+	return true;
+}
+
+// Broadcasts over loopback, to check that every client gets every message, including ones that are split
+static bool VerifyOverLoopback(int numClients)
+{
+	static const unsigned short SERVER_PORT=61990;
+	static const int NUM_MESSAGES=20;
+	const unsigned int messageSizes[2]={1000, 20000};
+
+	RakPeerInterface *server=RakPeerInterface::GetInstance();
+	SocketDescriptor serverSocket(SERVER_PORT, 0);
+	if (server->Startup(numClients, &serverSocket, 1)!=RAKNET_STARTED)
+	{
+		printf("Could not start the server on port %i\n", SERVER_PORT);
+		RakPeerInterface::DestroyInstance(server);
+		return false;
+	}
+	server->SetMaximumIncomingConnections((unsigned short) numClients);
+
+	RakPeerInterface **clients = new RakPeerInterface*[numClients];
+	int *messagesReceived = new int[numClients];
+	bool allIntact=true;
+	int i;
+	for (i=0; i < numClients; i++)
+	{
+		clients[i]=RakPeerInterface::GetInstance();
+		SocketDescriptor clientSocket(0, 0);
+		clients[i]->Startup(1, &clientSocket, 1);
+		clients[i]->Connect("127.0.0.1", SERVER_PORT, 0, 0);
+		messagesReceived[i]=0;
+	}
+
+	RakNet::TimeMS timeout=RakNet::GetTimeMS()+5000;
+	while (server->NumberOfConnections() < (unsigned short) numClients && RakNet::GetTimeMS() < timeout)
+	{
+		for (i=0; i < numClients; i++)
+		{
+			Packet *packet;
+			for (packet=clients[i]->Receive(); packet; clients[i]->DeallocatePacket(packet), packet=clients[i]->Receive())
+				;
+		}
+		Packet *packet;
+		for (packet=server->Receive(); packet; server->DeallocatePacket(packet), packet=server->Receive())
+			;
+		RakSleep(10);
+	}
+	if (server->NumberOfConnections() < (unsigned short) numClients)
+	{
+		printf("Only %i of %i clients connected\n", server->NumberOfConnections(), numClients);
+		allIntact=false;
+	}
+
+	for (int messageNumber=0; allIntact && messageNumber < NUM_MESSAGES; messageNumber++)
+	{
+		RakNet::BitStream bitStream;
+		WriteTestMessage(&bitStream, messageNumber, messageSizes[messageNumber%2]);
+		server->Send(&bitStream, HIGH_PRIORITY, RELIABLE_ORDERED, 0, UNASSIGNED_SYSTEM_ADDRESS, true);
+	}
+
+	timeout=RakNet::GetTimeMS()+10000;
+	bool done=allIntact==false;
+	while (done==false && RakNet::GetTimeMS() < timeout)
+	{
+		done=true;
+		for (i=0; i < numClients; i++)
+		{
+			Packet *packet;
+			for (packet=clients[i]->Receive(); packet; clients[i]->DeallocatePacket(packet), packet=clients[i]->Receive())
+			{
+				if (packet->data[0]!=ID_USER_PACKET_ENUM)
+					continue;
+				uint32_t messageNumber;
+				if (IsTestMessageIntact(packet, &messageNumber, messageSizes[messagesReceived[i]%2])==false || messageNumber!=(uint32_t) messagesReceived[i])
+					allIntact=false;
+				messagesReceived[i]++;
+			}
+			if (messagesReceived[i] < NUM_MESSAGES)
+				done=false;
+		}
+		RakSleep(10);
+	}
+	if (done==false)
+		allIntact=false;
+
+	for (i=0; i < numClients; i++)
+		RakPeerInterface::DestroyInstance(clients[i]);
+	RakPeerInterface::DestroyInstance(server);
+	delete [] clients;
+	delete [] messagesReceived;
+	return allIntact;
+}
+
+int main(int argc, char **argv)
+{
+	int maxRecipients=512;
+	int numBroadcasts=200;
+	if (argc>1)
+		maxRecipients=atoi(argv[1]);
+	if (argc>2)
+		numBroadcasts=atoi(argv[2]);
+	if (maxRecipients<1)
+		maxRecipients=1;
+	if (numBroadcasts<1)
+		numBroadcasts=1;
+
+	printf("Measures allocations and time per broadcast with a copy per recipient, against one shared copy\n");
+	printf("Difficulty: Intermediate\n\n");
+
+	SetMalloc_Ex(CountingMalloc_Ex);
+
+	const unsigned int messageSizes[3]={1024, 4096, 65536};
+	char *message = new char[65536];
+	for (unsigned int i=0; i < 65536; i++)
+		message[i]=(char) i;
+	ReliabilityLayer *layers = new ReliabilityLayer[maxRecipients];
+
+	for (int sizeIndex=0; sizeIndex < 3; sizeIndex++)
+	{
+		printf("%u byte broadcast\n", messageSizes[sizeIndex]);
+		printf("  Recipients   Copy per recipient        Shared copy\n");
+		printf("               allocs        us          allocs        us\n");
+		int numRecipients=1;
+		for (;;)
+		{
+			RunResult copied, shared;
+			RunBroadcasts(layers, numRecipients, message, messageSizes[sizeIndex], numBroadcasts, false, &copied);
+			RunBroadcasts(layers, numRecipients, message, messageSizes[sizeIndex], numBroadcasts, true, &shared);
+			printf("  %10i %8.1f %10.1f      %8.1f %10.1f\n", numRecipients,
+				copied.allocationsPerBroadcast, copied.microsecondsPerBroadcast,
+				shared.allocationsPerBroadcast, shared.microsecondsPerBroadcast);
+			if (numRecipients==maxRecipients)
+				break;
+			numRecipients*=4;
+			if (numRecipients>maxRecipients)
+				numRecipients=maxRecipients;
+		}
+		printf("\n");
+	}
+
+	delete [] layers;
+	delete [] message;
+
+	printf("Broadcasting to 8 clients over loopback: ");
+	fflush(stdout);
+	printf("%s\n", VerifyOverLoopback(8) ? "all messages intact" : "FAILED");
+	return 0;
+}
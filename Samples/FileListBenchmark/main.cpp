@@ -0,0 +1,163 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Times FileList hashing a synthetic directory tree, as DirectoryDeltaTransfer and the autopatcher do, on one and more threads and with FileListHashCache
+
+
+#include "FileList.h"
+#include "FileOperations.h"
+#include "SuperFastHash.h"
+#include "BitStream.h"
+#include "GetTime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <direct.h>
+#define rmdir _rmdir
+#else
+#include <unistd.h>
+#endif
+
+using namespace RakNet;
+
+static const int FILES_PER_DIRECTORY=100;
+
+static unsigned int randomSeed=12345;
+static unsigned int NextRandom(void)
+{
+	randomSeed=randomSeed*1103515245+12345;
+	return randomSeed>>8;
+}
+
+// Hashes and lengths of every file in the list, to compare runs
+static unsigned int Checksum(FileList *fileList)
+{
+	unsigned int checksum=fileList->fileList.Size();
+	for (unsigned int i=0; i < fileList->fileList.Size(); i++)
+	{
+		unsigned int hash;
+		memcpy(&hash, fileList->fileList[i].data, sizeof(hash));
+		checksum=checksum*31+hash+fileList->fileList[i].fileLengthBytes;
+	}
+	return checksum;
+}
+
+// Hashes every file, as DirectoryDeltaTransfer::AddUploadsFromSubdirectory() does
+static double HashTree(const char *root, int threadCount, FileListHashCache *hashCache, unsigned int *checksum)
+{
+	FileList fileList;
+	fileList.SetThreadCount(threadCount);
+	fileList.SetHashCache(hashCache);
+	RakNet::TimeUS startTime=RakNet::GetTimeUS();
+	fileList.AddFilesFromDirectory(root, "", true, false, true, FileListNodeContext(0,0,0,0));
+	RakNet::TimeUS elapsed=RakNet::GetTimeUS()-startTime;
+	*checksum=Checksum(&fileList);
+	return elapsed/1000000.0;
+}
+
+int main(int argc, char **argv)
+{
+	int numFiles=20000;
+	int maxFileSize=32768;
+	const char *root="FileListBenchmarkTree/";
+	if (argc>1)
+		numFiles=atoi(argv[1]);
+	if (argc>2)
+		maxFileSize=atoi(argv[2]);
+	if (argc>3)
+		root=argv[3];
+	if (numFiles<1)
+		numFiles=1;
+	if (maxFileSize<1)
+		maxFileSize=1;
+
+	printf("Times FileList hashing a synthetic directory tree, as DirectoryDeltaTransfer\nand the autopatcher do, on one and more threads and with FileListHashCache\n");
+	printf("Difficulty: Intermediate\n\n");
+
+	char path[512];
+	char *data=new char[maxFileSize];
+	int numDirectories=(numFiles+FILES_PER_DIRECTORY-1)/FILES_PER_DIRECTORY;
+	unsigned int totalBytes=0;
+	int i;
+	RakNet::TimeUS startTime=RakNet::GetTimeUS();
+	for (i=0; i < numFiles; i++)
+	{
+		unsigned int size=NextRandom()%maxFileSize;
+		for (unsigned int j=0; j < size; j++)
+			data[j]=(char) NextRandom();
+		sprintf(path, "%sdir%i/file%i.dat", root, i/FILES_PER_DIRECTORY, i);
+		if (WriteFileWithDirectories(path, data, size)==false)
+		{
+			printf("Could not write %s\n", path);
+			return 1;
+		}
+		totalBytes+=size;
+	}
+	printf("Wrote %i files, %.1f MB, in %i directories of %s in %.1f seconds\n", numFiles, totalBytes/1048576.0, numDirectories, root, (RakNet::GetTimeUS()-startTime)/1000000.0);
+	printf("The tree was just written, so it is likely read from the cache of the operating system rather than from the disk\n\n");
+
+	// Same hashes as SuperFastHashFile(), which clients of older versions use
+	FileList fileList;
+	fileList.AddFilesFromDirectory(root, "", true, false, true, FileListNodeContext(0,0,0,0));
+	int mismatches=0;
+	for (i=0; i < (int) fileList.fileList.Size(); i++)
+	{
+		unsigned int hash=SuperFastHashFile(fileList.fileList[i].fullPathToFile.C_String());
+		if (RakNet::BitStream::DoEndianSwap())
+			RakNet::BitStream::ReverseBytesInPlace((unsigned char*) &hash, sizeof(hash));
+		if (memcmp(&hash, fileList.fileList[i].data, sizeof(hash))!=0)
+			mismatches++;
+	}
+	unsigned int expectedChecksum=Checksum(&fileList);
+	printf("%i files listed, %i hashes different from SuperFastHashFile()\n\n", fileList.fileList.Size(), mismatches);
+
+	unsigned int checksum;
+	printf("AddFilesFromDirectory(), hashing\n");
+	printf("  Threads   Seconds   Files per second\n");
+	const int threadCounts[3]={1, 4, 8};
+	double seconds;
+	for (i=0; i < 3; i++)
+	{
+		seconds=HashTree(root, threadCounts[i], 0, &checksum);
+		printf("  %7i   %7.2f   %16.0f%s\n", threadCounts[i], seconds, numFiles/seconds, checksum==expectedChecksum ? "" : "   DIFFERENT HASHES");
+	}
+
+	// Hashes of unchanged files are not read again, including on the next run once the cache is saved and loaded
+	FileListHashCache hashCache;
+	seconds=HashTree(root, 1, &hashCache, &checksum);
+	printf("\nWith FileListHashCache, first run   %7.2f seconds%s\n", seconds, checksum==expectedChecksum ? "" : "   DIFFERENT HASHES");
+	sprintf(path, "%shashCache.bin", root);
+	hashCache.Save(path);
+	FileListHashCache loadedHashCache;
+	loadedHashCache.Load(path);
+	remove(path);
+	seconds=HashTree(root, 1, &loadedHashCache, &checksum);
+	printf("Saved, loaded, and run again        %7.2f seconds, %u hashes loaded%s\n", seconds, loadedHashCache.Size(), checksum==expectedChecksum ? "" : "   DIFFERENT HASHES");
+
+	// As AutopatcherClient does, comparing with the list of the server
+	FileList missingOrChanged;
+	fileList.SetThreadCount(4);
+	fileList.SetHashCache(&loadedHashCache);
+	startTime=RakNet::GetTimeUS();
+	fileList.ListMissingOrChangedFiles(root, &missingOrChanged, true, false);
+	printf("ListMissingOrChangedFiles()         %7.2f seconds, %i of %i files changed\n", (RakNet::GetTimeUS()-startTime)/1000000.0, missingOrChanged.fileList.Size(), fileList.fileList.Size());
+
+	fileList.DeleteFiles(root);
+	for (i=0; i < numDirectories; i++)
+	{
+		sprintf(path, "%sdir%i", root, i);
+		rmdir(path);
+	}
+	rmdir(root);
+	delete [] data;
+	return mismatches==0 ? 0 : 1;
+}
@@ -0,0 +1,281 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Measures rakMalloc_Ex and rakFree_Ex under the allocation churn of RakPeer, with the default allocator and with UseRaknetFixedHeap(), with and without thread caches
+
+
+#include "RakMemoryOverride.h"
+#include "RakNetTypes.h"
+#include "InternalPacket.h"
+#include "DS_Queue.h"
+#include "SimpleMutex.h"
+#include "RakThread.h"
+#include "RakSleep.h"
+#include "LocklessTypes.h"
+#include "GetTime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace RakNet;
+
+// Sent messages are held until acknowledged
+static const unsigned int RESEND_WINDOW=256;
+
+// Passes blocks from one thread to the next
+class BlockQueue
+{
+public:
+	// Bounds the memory in flight, as the congestion window of RakPeer does. 0 for no bound
+	BlockQueue(unsigned int _maxSize) : maxSize(_maxSize) {}
+	void Push(void *block)
+	{
+		for (;;)
+		{
+			mutex.Lock();
+			if (maxSize==0 || queue.Size() < maxSize)
+				break;
+			mutex.Unlock();
+			RakSleep(0);
+		}
+		queue.Push(block, _FILE_AND_LINE_);
+		mutex.Unlock();
+	}
+	void *Pop(void)
+	{
+		void *block=0;
+		mutex.Lock();
+		if (queue.Size())
+			block=queue.Pop();
+		mutex.Unlock();
+		return block;
+	}
+	void Clear(void)
+	{
+		queue.Clear(_FILE_AND_LINE_);
+	}
+protected:
+	unsigned int maxSize;
+	SimpleMutex mutex;
+	DataStructures::Queue<void*> queue;
+};
+
+// Sends are not bounded, so the user thread never waits on the update thread while it waits on the user thread
+static BlockQueue datagrams(1024), packets(1024), commands(0);
+static unsigned int numDatagrams;
+static volatile bool recvDone, splitDone, userDone, mayExit;
+static RakNet::LocklessUint32_t threadsDone;
+
+static unsigned int NextRandom(unsigned int *seed)
+{
+	*seed=*seed*1103515245+12345;
+	return *seed>>8;
+}
+// Message lengths are mostly small, as game traffic is
+static unsigned int MessageLength(unsigned int *seed)
+{
+	unsigned int r=NextRandom(seed)%100;
+	if (r<70)
+		return 8+NextRandom(seed)%56;
+	if (r<95)
+		return 64+NextRandom(seed)%192;
+	return 256+NextRandom(seed)%1000;
+}
+
+// Threads wait once done, so the statistics of their caches can be read before they exit
+static void WaitToExit(void)
+{
+	threadsDone.Increment();
+	while (mayExit==false)
+		RakSleep(1);
+	threadsDone.Decrement();
+}
+
+// Copies datagrams off the socket, as the recv thread does
+RAK_THREAD_DECLARATION(RecvThread)
+{
+	(void) arguments;
+	unsigned int seed=1;
+	for (unsigned int i=0; i < numDatagrams; i++)
+	{
+		unsigned int length=200+NextRandom(&seed)%1200;
+		unsigned char *datagram=(unsigned char*) rakMalloc_Ex(length, _FILE_AND_LINE_);
+		// Messages in the datagram
+		datagram[0]=(unsigned char) (1+NextRandom(&seed)%4);
+		datagrams.Push(datagram);
+	}
+	recvDone=true;
+	WaitToExit();
+	return 0;
+}
+
+// Splits datagrams into messages and packets, and sends what the user thread sends, as the update thread does
+RAK_THREAD_DECLARATION(UpdateThread)
+{
+	(void) arguments;
+	unsigned int seed=2;
+	DataStructures::Queue<void*> resendList;
+	for (;;)
+	{
+		bool idle=true;
+		bool lastDatagram=recvDone;
+		unsigned char *datagram=(unsigned char*) datagrams.Pop();
+		if (datagram)
+		{
+			idle=false;
+			for (int m=0; m < datagram[0]; m++)
+			{
+				// The message as ReliabilityLayer holds it, then the Packet returned by Receive()
+				unsigned int length=MessageLength(&seed);
+				void *internalPacket=rakMalloc_Ex(sizeof(InternalPacket), _FILE_AND_LINE_);
+				void *messageData=rakMalloc_Ex(length, _FILE_AND_LINE_);
+				Packet *packet=(Packet*) rakMalloc_Ex(sizeof(Packet), _FILE_AND_LINE_);
+				packet->length=length;
+				packet->data=(unsigned char*) rakMalloc_Ex(length, _FILE_AND_LINE_);
+				rakFree_Ex(messageData, _FILE_AND_LINE_);
+				rakFree_Ex(internalPacket, _FILE_AND_LINE_);
+				packets.Push(packet);
+			}
+			rakFree_Ex(datagram, _FILE_AND_LINE_);
+		}
+		else if (lastDatagram)
+			splitDone=true;
+		bool lastCommand=userDone;
+		unsigned char *command=(unsigned char*) commands.Pop();
+		if (command)
+		{
+			// Copied into a message held until acknowledged
+			idle=false;
+			void *internalPacket=rakMalloc_Ex(sizeof(InternalPacket), _FILE_AND_LINE_);
+			void *messageData=rakMalloc_Ex(command[0]+8, _FILE_AND_LINE_);
+			rakFree_Ex(command, _FILE_AND_LINE_);
+			resendList.Push(internalPacket, _FILE_AND_LINE_);
+			resendList.Push(messageData, _FILE_AND_LINE_);
+			while (resendList.Size() > RESEND_WINDOW*2)
+				rakFree_Ex(resendList.Pop(), _FILE_AND_LINE_);
+		}
+		if (idle)
+		{
+			if (lastCommand)
+				break;
+			RakSleep(0);
+		}
+	}
+	while (resendList.Size())
+		rakFree_Ex(resendList.Pop(), _FILE_AND_LINE_);
+	resendList.Clear(_FILE_AND_LINE_);
+	WaitToExit();
+	return 0;
+}
+
+// Deallocates packets, answering some, as a game does
+RAK_THREAD_DECLARATION(UserThread)
+{
+	(void) arguments;
+	unsigned int seed=3;
+	for (;;)
+	{
+		// Nothing more arrives once the update thread has split every datagram
+		bool lastPacket=splitDone;
+		Packet *packet=(Packet*) packets.Pop();
+		if (packet==0)
+		{
+			if (lastPacket)
+				break;
+			RakSleep(0);
+			continue;
+		}
+		rakFree_Ex(packet->data, _FILE_AND_LINE_);
+		rakFree_Ex(packet, _FILE_AND_LINE_);
+		if (NextRandom(&seed)%2==0)
+		{
+			unsigned int length=MessageLength(&seed);
+			unsigned char *command=(unsigned char*) rakMalloc_Ex(length, _FILE_AND_LINE_);
+			command[0]=(unsigned char) (length & 255);
+			commands.Push(command);
+		}
+	}
+	userDone=true;
+	WaitToExit();
+	return 0;
+}
+
+static void PrintStatistics(void)
+{
+	RakNetFixedHeapThreadStatistics statistics[16];
+	unsigned int count=GetRakNetFixedHeapThreadStatistics(statistics, 16);
+	printf("\nThread caches, in the order threads first allocated\n");
+	printf("  Cached allocs   Cached frees    Refills    Returns   Heap allocs   Heap frees   Cached bytes\n");
+	for (unsigned int i=0; i < count; i++)
+	{
+		printf("  %13.0f %14.0f %10.0f %10.0f %13.0f %12.0f %14.0f%s\n",
+			(double) statistics[i].cachedAllocations, (double) statistics[i].cachedFrees, (double) statistics[i].refills,
+			(double) statistics[i].returns, (double) statistics[i].heapAllocations, (double) statistics[i].heapFrees,
+			(double) statistics[i].cachedBytes, statistics[i].exited ? "   (threads that exited)" : "");
+	}
+}
+
+static double Run(bool printStatistics)
+{
+	recvDone=false;
+	splitDone=false;
+	userDone=false;
+	mayExit=false;
+	RakNet::TimeUS startTime=RakNet::GetTimeUS();
+	RakNet::RakThread::Create(&RecvThread, 0);
+	RakNet::RakThread::Create(&UpdateThread, 0);
+	RakNet::RakThread::Create(&UserThread, 0);
+	while (threadsDone.GetValue() < 3)
+		RakSleep(1);
+	double seconds=(RakNet::GetTimeUS()-startTime)/1000000.0;
+	if (printStatistics)
+		PrintStatistics();
+	mayExit=true;
+	while (threadsDone.GetValue() > 0)
+		RakSleep(1);
+	// Caches are flushed as the threads exit, just after
+	RakSleep(10);
+	datagrams.Clear();
+	packets.Clear();
+	commands.Clear();
+	return seconds;
+}
+
+int main(int argc, char **argv)
+{
+	numDatagrams=200000;
+	if (argc>1)
+		numDatagrams=atoi(argv[1]);
+	if (numDatagrams<100)
+		numDatagrams=100;
+
+	printf("Measures rakMalloc_Ex and rakFree_Ex under the allocation churn of RakPeer, with\nthe default allocator and with UseRaknetFixedHeap(), with and without thread\ncaches\n");
+	printf("Difficulty: Intermediate\n\n");
+	printf("A recv thread copies %u datagrams. An update thread splits them into messages\nand packets, and holds sent messages until acknowledged. A user thread frees\npackets and sends replies. About 14 allocations per datagram, some freed by\nanother thread.\n\n", numDatagrams);
+
+	printf("  Allocator                          Seconds   Datagrams per second\n");
+	double seconds=Run(false);
+	printf("  Default                            %7.2f   %20.0f\n", seconds, numDatagrams/seconds);
+
+	UseRaknetFixedHeap(16*1024*1024);
+	SetRakNetFixedHeapThreadCache(false);
+	seconds=Run(false);
+	printf("  Fixed heap                         %7.2f   %20.0f\n", seconds, numDatagrams/seconds);
+	FreeRakNetFixedHeap();
+
+	UseRaknetFixedHeap(16*1024*1024);
+	SetRakNetFixedHeapThreadCache(true);
+	seconds=Run(true);
+	printf("  Fixed heap with thread caches      %7.2f   %20.0f\n", seconds, numDatagrams/seconds);
+	PrintStatistics();
+	FreeRakNetFixedHeap();
+	return 0;
+}
@@ -0,0 +1,221 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Measures what GetTimeUS() costs with each time source, how often RakPeer calls it per update, and how far the time stamp counter drifts from the system clock
+
+
+#include "RakPeerInterface.h"
+#include "MessageIdentifiers.h"
+#include "BitStream.h"
+#include "GetTime.h"
+#include "RakSleep.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WIN32)
+#include "WindowsIncludes.h"
+#else
+#include <sys/time.h>
+#endif
+
+using namespace RakNet;
+
+static const char *timeSourceNames[3]={"System", "TSC", "Cached"};
+
+// Read directly, to compare the time stamp counter against without switching time source, which calibrates it again
+static int64_t SystemTimeUS(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (int64_t) (counter.QuadPart/frequency.QuadPart)*1000000 + (int64_t) (counter.QuadPart%frequency.QuadPart)*1000000/frequency.QuadPart;
+#else
+	timeval tp;
+	gettimeofday(&tp, 0);
+	return (int64_t) tp.tv_sec*1000000 + tp.tv_usec;
+#endif
+}
+
+static double NanosecondsPerCall(int numCalls)
+{
+	TimeUS sum=0;
+	TimeUS startTime=GetTimeUS();
+	for (int i=0; i < numCalls; i++)
+		sum+=GetTimeUS();
+	TimeUS elapsed=GetTimeUS()-startTime;
+	// Use the sum so the calls are not removed
+	if (sum==1)
+		printf(" ");
+	return (double) elapsed*1000.0/numCalls;
+}
+
+// Counts updates of every peer, from RakPeer's update thread
+static volatile unsigned int numUpdates=0;
+static void CountUpdate(RakPeerInterface *peer, void *data)
+{
+	(void) peer;
+	(void) data;
+	numUpdates++;
+}
+
+static void ReceiveAll(RakPeerInterface *peer)
+{
+	Packet *packet;
+	for (packet=peer->Receive(); packet; peer->DeallocatePacket(packet), packet=peer->Receive())
+		;
+}
+
+// Runs a server and clients over loopback, with each client sending messagesPerUpdate messages every 10 milliseconds, and counts GetTimeUS() calls for each update
+static double CallsPerUpdate(int numClients, int messagesPerUpdate, int numMilliseconds)
+{
+	static const unsigned short SERVER_PORT=61991;
+	RakPeerInterface *server=RakPeerInterface::GetInstance();
+	SocketDescriptor serverSocket(SERVER_PORT, 0);
+	if (server->Startup(numClients, &serverSocket, 1)!=RAKNET_STARTED)
+	{
+		printf("Could not start the server on port %i\n", SERVER_PORT);
+		RakPeerInterface::DestroyInstance(server);
+		return 0.0;
+	}
+	server->SetMaximumIncomingConnections((unsigned short) numClients);
+
+	RakPeerInterface **clients = new RakPeerInterface*[numClients];
+	int i;
+	for (i=0; i < numClients; i++)
+	{
+		clients[i]=RakPeerInterface::GetInstance();
+		SocketDescriptor clientSocket(0, 0);
+		clients[i]->Startup(1, &clientSocket, 1);
+		clients[i]->Connect("127.0.0.1", SERVER_PORT, 0, 0);
+	}
+	TimeMS timeout=GetTimeMS()+5000;
+	while (server->NumberOfConnections() < (unsigned short) numClients && GetTimeMS() < timeout)
+	{
+		for (i=0; i < numClients; i++)
+			ReceiveAll(clients[i]);
+		ReceiveAll(server);
+		RakSleep(10);
+	}
+
+	server->SetUserUpdateThread(CountUpdate, 0);
+	for (i=0; i < numClients; i++)
+		clients[i]->SetUserUpdateThread(CountUpdate, 0);
+	RakSleep(100);
+	numUpdates=0;
+	uint64_t callsBefore=GetTimeCallCount();
+	SetCountTimeCalls(true);
+	// Not GetTimeMS(), so only RakNet's calls are counted
+	int64_t endTime=SystemTimeUS()+(int64_t) numMilliseconds*1000;
+	while (SystemTimeUS() < endTime)
+	{
+		for (i=0; i < numClients; i++)
+		{
+			for (int j=0; j < messagesPerUpdate; j++)
+			{
+				BitStream bitStream;
+				bitStream.Write((MessageID) ID_USER_PACKET_ENUM);
+				bitStream.Write(j);
+				clients[i]->Send(&bitStream, HIGH_PRIORITY, RELIABLE_ORDERED, 0, UNASSIGNED_SYSTEM_ADDRESS, true);
+			}
+			ReceiveAll(clients[i]);
+		}
+		ReceiveAll(server);
+		RakSleep(10);
+	}
+	SetCountTimeCalls(false);
+	uint64_t numCalls=GetTimeCallCount()-callsBefore;
+	unsigned int updates=numUpdates;
+
+	for (i=0; i < numClients; i++)
+		RakPeerInterface::DestroyInstance(clients[i]);
+	RakPeerInterface::DestroyInstance(server);
+	delete [] clients;
+	return updates>0 ? (double) numCalls/updates : 0.0;
+}
+
+int main(int argc, char **argv)
+{
+	int numCalls=10000000;
+	int numSeconds=3;
+	if (argc>1)
+		numCalls=atoi(argv[1]);
+	if (argc>2)
+		numSeconds=atoi(argv[2]);
+	if (numCalls<1)
+		numCalls=1;
+	if (numSeconds<1)
+		numSeconds=1;
+
+	printf("Measures what GetTimeUS() costs with each time source, how often RakPeer calls it\nper update, and how far the time stamp counter drifts from the system clock\n");
+	printf("Difficulty: Intermediate\n\n");
+
+	double nanoseconds[3];
+	bool available[3];
+	printf("  Time source     ns/call\n");
+	for (int source=TIME_SOURCE_SYSTEM; source <= TIME_SOURCE_CACHED; source++)
+	{
+		available[source]=SetTimeSource((TimeSource) source);
+		if (available[source]==false)
+		{
+			printf("  %-12s   not available\n", timeSourceNames[source]);
+			continue;
+		}
+		nanoseconds[source]=NanosecondsPerCall(numCalls);
+		printf("  %-12s   %7.2f\n", timeSourceNames[source], nanoseconds[source]);
+	}
+	SetTimeSource(TIME_SOURCE_SYSTEM);
+
+	printf("\nGetTimeUS() calls per update, with 4 clients and a server over loopback\n");
+	printf("  Messages sent per client per 10ms   Calls/update");
+	for (int source=TIME_SOURCE_TSC; source <= TIME_SOURCE_CACHED; source++)
+	{
+		if (available[source])
+			printf("   %s ns saved/update", timeSourceNames[source]);
+	}
+	printf("\n");
+	const int messageCounts[3]={0, 10, 100};
+	for (int i=0; i < 3; i++)
+	{
+		double callsPerUpdate=CallsPerUpdate(4, messageCounts[i], 2000);
+		printf("  %33i   %12.1f", messageCounts[i], callsPerUpdate);
+		for (int source=TIME_SOURCE_TSC; source <= TIME_SOURCE_CACHED; source++)
+		{
+			if (available[source])
+				printf("   %*.0f", (int) strlen(timeSourceNames[source])+16, callsPerUpdate*(nanoseconds[TIME_SOURCE_SYSTEM]-nanoseconds[source]));
+		}
+		printf("\n");
+	}
+
+	if (available[TIME_SOURCE_TSC])
+	{
+		printf("\nTSC time minus system time, checked every 100ms for %i seconds\n", numSeconds);
+		SetTimeSource(TIME_SOURCE_TSC);
+		int64_t offset=SystemTimeUS()-(int64_t) GetTimeUS();
+		int64_t largestDifference=0;
+		TimeUS endTime=GetTimeUS()+(TimeUS) numSeconds*1000000;
+		while (GetTimeUS() < endTime)
+		{
+			RakSleep(100);
+			// RakPeer's update thread would normally do this
+			UpdateTimeSource();
+			int64_t difference=(int64_t) GetTimeUS()+offset-SystemTimeUS();
+			if (difference<0)
+				difference=-difference;
+			if (difference>largestDifference)
+				largestDifference=difference;
+		}
+		printf("  Largest difference: %i us\n", (int) largestDifference);
+		printf("  Time source afterwards: %s\n", timeSourceNames[GetTimeSource()]);
+		SetTimeSource(TIME_SOURCE_SYSTEM);
+	}
+	return 0;
+}
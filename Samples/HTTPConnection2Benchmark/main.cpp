@@ -0,0 +1,298 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Measures how many REST calls per second HTTPConnection2 makes to a stub web server on the loopback interface, with a connection per request, with keep-alive, and with pipelining
+
+
+#include "HTTPConnection2.h"
+#include "TCPInterface.h"
+#include "RakString.h"
+#include "DS_List.h"
+#include "GetTime.h"
+#include "RakSleep.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace RakNet;
+
+static const unsigned short FIRST_SERVER_PORT=60080;
+// Bytes of the body of /large, sent in chunks
+static const unsigned int LARGE_BODY_LENGTH=2*1024*1024;
+static const unsigned int LARGE_CHUNK_LENGTH=16384;
+
+// What a REST service typically returns
+static const char *smallBody="{\"servers\":[{\"id\":\"4c8a7b6e\",\"name\":\"game-01\",\"status\":\"ACTIVE\",\"players\":12},{\"id\":\"9f2e4d1a\",\"name\":\"game-02\",\"status\":\"ACTIVE\",\"players\":30},{\"id\":\"17b3c0e5\",\"name\":\"game-03\",\"status\":\"BUILD\",\"players\":0}]}";
+
+// Requests received from one client, not yet answered
+struct ServerClient
+{
+	SystemAddress systemAddress;
+	RakString received;
+};
+static DataStructures::List<ServerClient*> serverClients;
+
+static ServerClient *GetServerClient(const SystemAddress &systemAddress)
+{
+	for (unsigned int i=0; i < serverClients.Size(); i++)
+	{
+		if (serverClients[i]->systemAddress==systemAddress)
+			return serverClients[i];
+	}
+	ServerClient *serverClient = new ServerClient;
+	serverClient->systemAddress=systemAddress;
+	serverClients.Push(serverClient, _FILE_AND_LINE_);
+	return serverClient;
+}
+static void RemoveServerClient(const SystemAddress &systemAddress)
+{
+	for (unsigned int i=0; i < serverClients.Size(); i++)
+	{
+		if (serverClients[i]->systemAddress==systemAddress)
+		{
+			delete serverClients[i];
+			serverClients.RemoveAtIndexFast(i);
+			return;
+		}
+	}
+}
+
+static void Respond(TCPInterface *server, const SystemAddress &systemAddress, const char *request)
+{
+	const char *connectionClose = strstr(request, "Connection: close") ? "Connection: close\r\n" : "";
+	RakString response;
+	if (strncmp(request, "GET /small ", 11)==0)
+	{
+		response.Set("HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %u\r\n%s\r\n%s", (unsigned int) strlen(smallBody), connectionClose, smallBody);
+		server->Send(response.C_String(), (unsigned int) response.GetLength(), systemAddress, false);
+	}
+	else if (strncmp(request, "GET /chunked ", 13)==0)
+	{
+		// The same body in three chunks
+		size_t length=strlen(smallBody);
+		response.Set("HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nTransfer-Encoding: chunked\r\n%s\r\n", connectionClose);
+		size_t offset=0;
+		for (int i=0; i < 3; i++)
+		{
+			size_t chunkLength = i < 2 ? length/3 : length-offset;
+			RakString chunk;
+			chunk.Set("%x\r\n", (unsigned int) chunkLength);
+			response+=chunk;
+			response.AppendBytes(smallBody+offset, (unsigned int) chunkLength);
+			response+="\r\n";
+			offset+=chunkLength;
+		}
+		response+="0\r\n\r\n";
+		server->Send(response.C_String(), (unsigned int) response.GetLength(), systemAddress, false);
+	}
+	else if (strncmp(request, "GET /large ", 11)==0)
+	{
+		response.Set("HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nTransfer-Encoding: chunked\r\n%s\r\n", connectionClose);
+		server->Send(response.C_String(), (unsigned int) response.GetLength(), systemAddress, false);
+		char *chunk = new char[LARGE_CHUNK_LENGTH+16];
+		int headerLength = sprintf(chunk, "%x\r\n", LARGE_CHUNK_LENGTH);
+		for (unsigned int i=0; i < LARGE_CHUNK_LENGTH; i++)
+			chunk[headerLength+i]=(char) ('a'+i%26);
+		memcpy(chunk+headerLength+LARGE_CHUNK_LENGTH, "\r\n", 2);
+		for (unsigned int sent=0; sent < LARGE_BODY_LENGTH; sent+=LARGE_CHUNK_LENGTH)
+			server->Send(chunk, headerLength+LARGE_CHUNK_LENGTH+2, systemAddress, false);
+		server->Send("0\r\n\r\n", 5, systemAddress, false);
+		delete [] chunk;
+	}
+	else
+	{
+		response.Set("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n%s\r\n", connectionClose);
+		server->Send(response.C_String(), (unsigned int) response.GetLength(), systemAddress, false);
+	}
+}
+
+// Answers each request once all of it has arrived. Requests have no body
+static void UpdateServer(TCPInterface *server)
+{
+	SystemAddress systemAddress;
+	while ((systemAddress=server->HasNewIncomingConnection())!=UNASSIGNED_SYSTEM_ADDRESS)
+		GetServerClient(systemAddress);
+	Packet *packet;
+	for (packet=server->Receive(); packet; server->DeallocatePacket(packet), packet=server->Receive())
+	{
+		ServerClient *serverClient = GetServerClient(packet->systemAddress);
+		serverClient->received.AppendBytes((const char*) packet->data, packet->length);
+		const char *request = serverClient->received.C_String();
+		const char *requestEnd;
+		while ((requestEnd=strstr(request, "\r\n\r\n"))!=0)
+		{
+			Respond(server, packet->systemAddress, request);
+			request=requestEnd+4;
+		}
+		serverClient->received=RakString(request);
+	}
+	while ((systemAddress=server->HasLostConnection())!=UNASSIGNED_SYSTEM_ADDRESS)
+		RemoveServerClient(systemAddress);
+}
+
+static void UpdateClient(TCPInterface *client)
+{
+	client->HasCompletedConnectionAttempt();
+	Packet *packet;
+	for (packet=client->Receive(); packet; client->DeallocatePacket(packet), packet=client->Receive())
+		;
+	client->HasFailedConnectionAttempt();
+	client->HasLostConnection();
+}
+
+// Counts the body of /large as it arrives
+class CountingBodyCallback : public HTTPConnection2::BodyCallback
+{
+public:
+	unsigned int bytes;
+	bool correct;
+	virtual void OnBodyData(const char *data, unsigned int length, void *userData)
+	{
+		(void) userData;
+		for (unsigned int i=0; i < length; i++)
+		{
+			if (data[i]!=(char) ('a'+(bytes+i)%LARGE_CHUNK_LENGTH%26))
+				correct=false;
+		}
+		bytes+=length;
+	}
+};
+
+// Makes numRequests requests, keeping up to maxOutstanding transmitted. Returns requests per second, or 0 if any response was wrong
+static double Run(TCPInterface *server, TCPInterface *client, HTTPConnection2 *httpConnection2, unsigned short port, unsigned int numRequests, unsigned int maxOutstanding, bool connectionClose)
+{
+	RakString requests[2];
+	requests[0].Set("GET /small HTTP/1.1\r\nHost: 127.0.0.1\r\n%s\r\n", connectionClose ? "Connection: close\r\n" : "");
+	requests[1].Set("GET /chunked HTTP/1.1\r\nHost: 127.0.0.1\r\n%s\r\n", connectionClose ? "Connection: close\r\n" : "");
+	size_t bodyLength=strlen(smallBody);
+
+	unsigned int transmitted=0, received=0, wrong=0;
+	RakNet::TimeUS startTime=RakNet::GetTimeUS();
+	while (received < numRequests)
+	{
+		while (transmitted < numRequests && transmitted-received < maxOutstanding)
+		{
+			httpConnection2->TransmitRequest(requests[transmitted%2], "127.0.0.1", port);
+			transmitted++;
+		}
+		UpdateServer(server);
+		UpdateClient(client);
+
+		RakString stringTransmitted, hostTransmitted, responseReceived;
+		SystemAddress hostReceived;
+		int contentOffset;
+		bool any=false;
+		while (httpConnection2->GetResponse(stringTransmitted, hostTransmitted, responseReceived, hostReceived, contentOffset))
+		{
+			any=true;
+			if (contentOffset<0 || responseReceived.GetLength()-contentOffset!=bodyLength || strcmp(responseReceived.C_String()+contentOffset, smallBody)!=0)
+				wrong++;
+			received++;
+		}
+		if (any==false)
+			RakSleep(0);
+	}
+	RakNet::TimeUS elapsed=RakNet::GetTimeUS()-startTime;
+	if (wrong>0)
+	{
+		printf("  %u responses were wrong\n", wrong);
+		return 0;
+	}
+	return numRequests*1000000.0/(elapsed ? elapsed : 1);
+}
+
+// Downloads /large, returning MB per second, or 0 if it was wrong
+static double RunLarge(TCPInterface *server, TCPInterface *client, HTTPConnection2 *httpConnection2, unsigned short port, bool stream)
+{
+	CountingBodyCallback bodyCallback;
+	bodyCallback.bytes=0;
+	bodyCallback.correct=true;
+	RakNet::TimeUS startTime=RakNet::GetTimeUS();
+	httpConnection2->TransmitRequest("GET /large HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n", "127.0.0.1", port, false, 4, UNASSIGNED_SYSTEM_ADDRESS, 0, stream ? &bodyCallback : 0);
+	RakString stringTransmitted, hostTransmitted, responseReceived;
+	SystemAddress hostReceived;
+	int contentOffset;
+	for (;;)
+	{
+		UpdateServer(server);
+		UpdateClient(client);
+		if (httpConnection2->GetResponse(stringTransmitted, hostTransmitted, responseReceived, hostReceived, contentOffset))
+			break;
+		RakSleep(0);
+	}
+	RakNet::TimeUS elapsed=RakNet::GetTimeUS()-startTime;
+	bool correct;
+	if (stream)
+		correct = bodyCallback.correct && bodyCallback.bytes==LARGE_BODY_LENGTH && contentOffset==-1;
+	else
+		correct = contentOffset>=0 && responseReceived.GetLength()-contentOffset==LARGE_BODY_LENGTH;
+	if (correct==false)
+		return 0;
+	return LARGE_BODY_LENGTH/(elapsed ? (double) elapsed : 1.0);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int numRequests=200;
+	if (argc>1)
+		numRequests=atoi(argv[1]);
+	if (numRequests<10)
+		numRequests=10;
+
+	printf("Measures how many REST calls per second HTTPConnection2 makes to a stub web\nserver on the loopback interface, with a connection per request, with\nkeep-alive, and with pipelining\n");
+	printf("Difficulty: Intermediate\n\n");
+
+	TCPInterface *server = RakNet::OP_NEW<TCPInterface>(_FILE_AND_LINE_);
+	unsigned short port;
+	for (port=FIRST_SERVER_PORT; port < FIRST_SERVER_PORT+20; port++)
+	{
+		if (server->Start(port, 64))
+			break;
+	}
+	if (port==FIRST_SERVER_PORT+20)
+	{
+		printf("Could not start the server\n");
+		return 1;
+	}
+	TCPInterface *client = RakNet::OP_NEW<TCPInterface>(_FILE_AND_LINE_);
+	client->Start(0, 0, 64);
+	HTTPConnection2 *httpConnection2 = HTTPConnection2::GetInstance();
+	client->AttachPlugin(httpConnection2);
+
+	printf("%u GET requests each, half with a Content-Length, half chunked. Up to 64\nrequests are given to HTTPConnection2 at a time\n\n", numRequests);
+	printf("  Connections                                  Requests per second\n");
+	double rate=Run(server, client, httpConnection2, port, numRequests/4, 64, true);
+	printf("  New connection per request                   %19.0f\n", rate);
+	rate=Run(server, client, httpConnection2, port, numRequests, 64, false);
+	printf("  Keep-alive                                   %19.0f\n", rate);
+	httpConnection2->SetMaxPipelinedRequests(16);
+	rate=Run(server, client, httpConnection2, port, numRequests, 64, false);
+	printf("  Keep-alive, 16 requests pipelined            %19.0f\n", rate);
+	httpConnection2->SetMaxPipelinedRequests(1);
+
+	printf("\n%u MB response, chunked\n", LARGE_BODY_LENGTH/1048576);
+	printf("  Body                                         MB per second\n");
+	rate=RunLarge(server, client, httpConnection2, port, false);
+	printf("  Returned by GetResponse()                    %13.1f\n", rate);
+	rate=RunLarge(server, client, httpConnection2, port, true);
+	printf("  Passed to a BodyCallback as it arrives       %13.1f\n", rate);
+
+	client->DetachPlugin(httpConnection2);
+	HTTPConnection2::DestroyInstance(httpConnection2);
+	client->Stop();
+	server->Stop();
+	RakNet::OP_DELETE(client, _FILE_AND_LINE_);
+	RakNet::OP_DELETE(server, _FILE_AND_LINE_);
+	for (unsigned int i=0; i < serverClients.Size(); i++)
+		delete serverClients[i];
+	serverClients.Clear(false, _FILE_AND_LINE_);
+	return 0;
+}
@@ -0,0 +1,222 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Measures what RakNetMetrics costs to record and to read, compared with a counter behind a mutex and with GetStatisticsList(), then scrapes it through MetricsExporter
+
+
+#include "RakPeerInterface.h"
+#include "RakNetMetrics.h"
+#include "RakNetStatistics.h"
+#include "MetricsExporter.h"
+#include "TCPInterface.h"
+#include "VirtualNetwork.h"
+#include "SimpleMutex.h"
+#include "LocklessTypes.h"
+#include "RakThread.h"
+#include "RakSleep.h"
+#include "GetTime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace RakNet;
+
+static const unsigned short SERVER_PORT=61992;
+static const unsigned short EXPORTER_PORT=61993;
+
+// Threads record as fast as they can, into RakNetMetrics or a counter behind a mutex
+static RakNetMetrics *metrics;
+static SimpleMutex counterMutex;
+static uint64_t mutexCounter;
+static bool useMutex;
+static volatile bool startThreads;
+static LocklessUint32_t threadsDone;
+static int iterationsPerThread;
+RAK_THREAD_DECLARATION(RecordThread)
+{
+	(void) arguments;
+	while (startThreads==false)
+		RakSleep(0);
+	for (int i=0; i < iterationsPerThread; i++)
+	{
+		if (useMutex)
+		{
+			counterMutex.Lock();
+			mutexCounter+=100;
+			counterMutex.Unlock();
+		}
+		else
+			metrics->Add(METRICS_BYTES_SENT, 100);
+	}
+	threadsDone.Increment();
+	return 0;
+}
+
+// Nanoseconds per recording, over all threads
+static double RecordNanoseconds(bool _useMutex, int numThreads, int iterations)
+{
+	useMutex=_useMutex;
+	iterationsPerThread=iterations/numThreads;
+	startThreads=false;
+	uint32_t doneBefore=threadsDone.GetValue();
+	for (int i=0; i < numThreads; i++)
+		RakNet::RakThread::Create(&RecordThread, 0);
+	RakSleep(50);
+	TimeUS startTime=GetTimeUS();
+	startThreads=true;
+	while (threadsDone.GetValue()-doneBefore < (uint32_t) numThreads)
+		RakSleep(0);
+	TimeUS elapsed=GetTimeUS()-startTime;
+	return (double) elapsed*1000.0/(iterationsPerThread*numThreads);
+}
+
+int main(int argc, char **argv)
+{
+	int numConnections=32;
+	int iterations=4000000;
+	if (argc>1)
+		numConnections=atoi(argv[1]);
+	if (argc>2)
+		iterations=atoi(argv[2]);
+	if (numConnections<1)
+		numConnections=1;
+	if (iterations<1000)
+		iterations=1000;
+
+	printf("Measures what RakNetMetrics costs to record and to read, compared with a\ncounter behind a mutex and with GetStatisticsList(), then scrapes it through\nMetricsExporter\n");
+	printf("Difficulty: Intermediate\n\n");
+
+	metrics=new RakNetMetrics;
+	printf("Recording a counter, ns per call over all threads\n");
+	printf("  Threads   RakNetMetrics   SimpleMutex\n");
+	const int threadCounts[3]={1, 4, 16};
+	for (int t=0; t < 3; t++)
+		printf("  %7i   %13.1f   %11.1f\n", threadCounts[t], RecordNanoseconds(false, threadCounts[t], iterations), RecordNanoseconds(true, threadCounts[t], iterations));
+	delete metrics;
+
+	// A server with connections, over a VirtualNetwork so no UDP ports are needed
+	VirtualNetwork network;
+	network.StartUpdateThread(1);
+	RakPeerInterface *server=RakPeerInterface::GetInstance();
+	SocketDescriptor serverSocket(SERVER_PORT, 0);
+	serverSocket.virtualNetwork=&network;
+	if (server->Startup(numConnections, &serverSocket, 1)!=RAKNET_STARTED)
+	{
+		printf("Could not start the server\n");
+		return 1;
+	}
+	server->SetMaximumIncomingConnections((unsigned short) numConnections);
+	RakPeerInterface **clients=new RakPeerInterface*[numConnections];
+	int i;
+	for (i=0; i < numConnections; i++)
+	{
+		clients[i]=RakPeerInterface::GetInstance();
+		SocketDescriptor clientSocket(0, 0);
+		clientSocket.virtualNetwork=&network;
+		clients[i]->Startup(1, &clientSocket, 1);
+		clients[i]->Connect("127.0.0.1", SERVER_PORT, 0, 0);
+	}
+	TimeMS timeout=GetTimeMS()+10000;
+	while (server->NumberOfConnections() < (unsigned short) numConnections && GetTimeMS() < timeout)
+		RakSleep(10);
+	RakNetMetricsSnapshot snapshot, firstSnapshot;
+	server->GetMetrics(&firstSnapshot);
+	// Some traffic, so there is something to report
+	char message[100];
+	memset(message, 0, sizeof(message));
+	message[0]=(char) 200;
+	for (i=0; i < 100; i++)
+	{
+		server->Send(message, sizeof(message), HIGH_PRIORITY, RELIABLE_ORDERED, 0, UNASSIGNED_SYSTEM_ADDRESS, true);
+		RakSleep(1);
+	}
+	RakSleep(200);
+
+	const int numReads=2000;
+	TimeUS startTime=GetTimeUS();
+	for (i=0; i < numReads; i++)
+		server->GetMetrics(&snapshot);
+	TimeUS metricsTime=GetTimeUS()-startTime;
+	DataStructures::List<SystemAddress> addresses;
+	DataStructures::List<RakNetGUID> guids;
+	DataStructures::List<RakNetStatistics> statistics;
+	startTime=GetTimeUS();
+	for (i=0; i < numReads; i++)
+		server->GetStatisticsList(addresses, guids, statistics);
+	TimeUS statisticsTime=GetTimeUS()-startTime;
+	printf("\nReading totals for %i connections, us per call\n", server->NumberOfConnections());
+	printf("  GetMetrics()          %8.2f\n", (double) metricsTime/numReads);
+	printf("  GetStatisticsList()   %8.2f\n", (double) statisticsTime/numReads);
+	printf("\nWhile sending: %.0f bytes sent per second, resend ratio %.3f, update cycle 99th percentile %u us\n",
+		snapshot.GetRatePerSecond(firstSnapshot, METRICS_BYTES_SENT), snapshot.GetResendRatio(firstSnapshot),
+		(unsigned int) snapshot.GetPercentileUS(METRICS_UPDATE_CYCLE_US, .99));
+
+	// Scrape the server as a monitoring system would
+	MetricsExporter exporter;
+	exporter.AddRakPeer(server, "peer=\"server\"");
+	if (exporter.Start(EXPORTER_PORT, 4, "127.0.0.1")==false)
+		printf("\nCould not listen on port %i\n", EXPORTER_PORT);
+	else
+	{
+		TCPInterface scraper;
+		scraper.Start(0, 0, 1);
+		// Connect() fails until the thread of the TCPInterface is running
+		SystemAddress exporterAddress=UNASSIGNED_SYSTEM_ADDRESS;
+		timeout=GetTimeMS()+1000;
+		while (exporterAddress==UNASSIGNED_SYSTEM_ADDRESS && GetTimeMS() < timeout)
+		{
+			RakSleep(10);
+			exporterAddress=scraper.Connect("127.0.0.1", EXPORTER_PORT, true);
+		}
+		const char *request="GET /metrics HTTP/1.0\r\n\r\n";
+		scraper.Send(request, (unsigned int) strlen(request), exporterAddress, false);
+		RakString response;
+		timeout=GetTimeMS()+5000;
+		bool closed=false;
+		while (GetTimeMS() < timeout)
+		{
+			exporter.Update();
+			Packet *packet;
+			while ((packet=scraper.Receive())!=0)
+			{
+				response.AppendBytes((const char*) packet->data, packet->length);
+				scraper.DeallocatePacket(packet);
+			}
+			// Everything received before the close is read first
+			if (closed)
+				break;
+			closed=scraper.HasLostConnection()!=UNASSIGNED_SYSTEM_ADDRESS;
+			RakSleep(1);
+		}
+		int numLines=0;
+		for (const char *c=response.C_String(); *c; c++)
+		{
+			if (*c=='\n')
+				numLines++;
+		}
+		printf("\nScraped %i lines, %i bytes, from port %i. For example:\n", numLines, (int) response.GetLength(), EXPORTER_PORT);
+		const char *examples[3]={"raknet_connections{", "raknet_bytes_sent_total{", "raknet_update_cycle_microseconds_count{"};
+		for (i=0; i < 3; i++)
+		{
+			const char *line=strstr(response.C_String(), examples[i]);
+			if (line)
+				printf("  %.*s\n", (int) strcspn(line, "\n"), line);
+		}
+		scraper.Stop();
+		exporter.Stop();
+	}
+
+	for (i=0; i < numConnections; i++)
+		RakPeerInterface::DestroyInstance(clients[i]);
+	delete [] clients;
+	RakPeerInterface::DestroyInstance(server);
+	return 0;
+}
@@ -0,0 +1,200 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Measures how many punchthrough requests NatPunchthroughServer coordinates per second with many connected users, without a network
+
+
+#include "RakPeer.h"
+#include "NatPunchthroughServer.h"
+#include "BitStream.h"
+#include "MessageIdentifiers.h"
+#include "DS_Queue.h"
+#include "GetTime.h"
+#include "Rand.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace RakNet;
+
+// What the server sent that the simulated clients answer
+struct SentMessage
+{
+	unsigned int user;
+	MessageID messageId;
+	uint16_t sessionId;
+};
+static DataStructures::Queue<SentMessage> sentMessages;
+static unsigned int messagesSent;
+
+static SystemAddress UserAddress(unsigned int user)
+{
+	SystemAddress systemAddress;
+	systemAddress.SetBinaryAddress("10.0.0.0");
+	systemAddress.address.addr4.sin_addr.s_addr=htonl(0x0A000000+user);
+	systemAddress.SetPortHostOrder(60000);
+	return systemAddress;
+}
+static unsigned int AddressUser(const SystemAddress &systemAddress)
+{
+	return ntohl(systemAddress.address.addr4.sin_addr.s_addr)-0x0A000000;
+}
+// Scattered like real guids, but unique
+static RakNetGUID UserGuid(unsigned int user)
+{
+	return RakNetGUID(((uint64_t) user+1)*0x9E3779B97F4A7C15ULL);
+}
+
+// Never started, so the cost measured is that of the plugin. Sends are parsed and answered by the clients simulated in main()
+class CapturingPeer : public RakPeer
+{
+public:
+	uint32_t Send( const RakNet::BitStream * bitStream, PacketPriority priority, PacketReliability reliability, char orderingChannel, const AddressOrGUID systemIdentifier, bool broadcast, uint32_t forceReceiptNumber )
+	{
+		(void) priority; (void) reliability; (void) orderingChannel; (void) broadcast; (void) forceReceiptNumber;
+		messagesSent++;
+		RakNet::BitStream bs(bitStream->GetData(), bitStream->GetNumberOfBytesUsed(), false);
+		SentMessage sentMessage;
+		sentMessage.user=AddressUser(systemIdentifier.systemAddress);
+		bs.Read(sentMessage.messageId);
+		if (sentMessage.messageId==ID_TIMESTAMP)
+		{
+			bs.IgnoreBytes(sizeof(RakNet::Time));
+			bs.Read(sentMessage.messageId);
+		}
+		if (sentMessage.messageId==ID_NAT_GET_MOST_RECENT_PORT || sentMessage.messageId==ID_NAT_CONNECT_AT_TIME)
+		{
+			bs.Read(sentMessage.sessionId);
+			sentMessages.Push(sentMessage, _FILE_AND_LINE_);
+		}
+		return 1;
+	}
+};
+
+static void Deliver(NatPunchthroughServer *server, unsigned int user, RakNet::BitStream *bs)
+{
+	Packet packet;
+	memset(&packet, 0, sizeof(packet));
+	packet.systemAddress=UserAddress(user);
+	packet.guid=UserGuid(user);
+	packet.data=bs->GetData();
+	packet.length=bs->GetNumberOfBytesUsed();
+	packet.bitSize=bs->GetNumberOfBitsUsed();
+	server->OnReceive(&packet);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int numUsers=200000;
+	unsigned int numRequests=200000;
+	unsigned int numServers=1;
+	if (argc>1)
+		numUsers=atoi(argv[1]);
+	if (argc>2)
+		numRequests=atoi(argv[2]);
+	if (argc>3)
+		numServers=atoi(argv[3]);
+	if (numUsers<2)
+		numUsers=2;
+	if (numServers<1)
+		numServers=1;
+
+	printf("Measures how many punchthrough requests NatPunchthroughServer coordinates per\nsecond with many connected users, without a network\n");
+	printf("Difficulty: Intermediate\n\n");
+	printf("%u users, %u requests, %u linked servers. 1 in 50 users never answers.\n\n", numUsers, numRequests, numServers);
+
+	CapturingPeer **peers = new CapturingPeer*[numServers];
+	NatPunchthroughServer **servers = new NatPunchthroughServer*[numServers];
+	unsigned int i;
+	for (i=0; i < numServers; i++)
+	{
+		peers[i]=new CapturingPeer;
+		servers[i]=new NatPunchthroughServer;
+		peers[i]->AttachPlugin(servers[i]);
+		if (i>0)
+			servers[0]->AddLinkedServer(servers[i]);
+	}
+
+	RakNet::TimeUS startTime=RakNet::GetTimeUS();
+	for (i=0; i < numUsers; i++)
+		servers[i%numServers]->OnNewConnection(UserAddress(i), UserGuid(i), true);
+	RakNet::TimeUS elapsed=RakNet::GetTimeUS()-startTime;
+	printf("Connect:      %10.0f users per second\n", numUsers*1000000.0/(elapsed ? elapsed : 1));
+
+	// Each request goes from a random user to another. Clients answer at once, except those that never do
+	seedMT(0);
+	unsigned int connectsAtTime=0;
+	messagesSent=0;
+	startTime=RakNet::GetTimeUS();
+	for (unsigned int r=0; r < numRequests; r++)
+	{
+		unsigned int sender=randomMT()%numUsers;
+		unsigned int recipient=randomMT()%numUsers;
+		RakNet::BitStream bs;
+		bs.Write((MessageID)ID_NAT_PUNCHTHROUGH_REQUEST);
+		bs.Write(UserGuid(recipient));
+		Deliver(servers[sender%numServers], sender, &bs);
+
+		while (sentMessages.Size())
+		{
+			SentMessage sentMessage=sentMessages.Pop();
+			if (sentMessage.user%50==0)
+				continue;
+			bs.Reset();
+			if (sentMessage.messageId==ID_NAT_GET_MOST_RECENT_PORT)
+			{
+				bs.Write((MessageID)ID_NAT_GET_MOST_RECENT_PORT);
+				bs.Write(sentMessage.sessionId);
+				bs.Write((unsigned short) 60001);
+			}
+			else
+			{
+				// Punched, and ready for the next attempt
+				connectsAtTime++;
+				bs.Write((MessageID)ID_NAT_CLIENT_READY);
+			}
+			Deliver(servers[sentMessage.user%numServers], sentMessage.user, &bs);
+		}
+	}
+	elapsed=RakNet::GetTimeUS()-startTime;
+	printf("Requests:     %10.0f per second, %u messages sent, %u punches started\n", numRequests*1000000.0/(elapsed ? elapsed : 1), messagesSent, connectsAtTime/2);
+
+	// Users who never answered hold up attempts, which Update() times out
+	const int numUpdates=100;
+	startTime=RakNet::GetTimeUS();
+	for (int u=0; u < numUpdates; u++)
+	{
+		for (i=0; i < numServers; i++)
+		{
+			servers[i]->lastUpdate=0;
+			servers[i]->Update();
+		}
+	}
+	elapsed=RakNet::GetTimeUS()-startTime;
+	printf("Update():     %10.1f us per call, before any attempt times out\n", (double) elapsed/numUpdates);
+
+	startTime=RakNet::GetTimeUS();
+	for (i=0; i < numUsers; i++)
+		servers[i%numServers]->OnClosedConnection(UserAddress(i), UserGuid(i), LCR_DISCONNECTION_NOTIFICATION);
+	elapsed=RakNet::GetTimeUS()-startTime;
+	printf("Disconnect:   %10.0f users per second\n", numUsers*1000000.0/(elapsed ? elapsed : 1));
+	sentMessages.Clear(_FILE_AND_LINE_);
+
+	for (i=0; i < numServers; i++)
+	{
+		peers[i]->DetachPlugin(servers[i]);
+		delete servers[i];
+		delete peers[i];
+	}
+	delete [] servers;
+	delete [] peers;
+	return 0;
+}
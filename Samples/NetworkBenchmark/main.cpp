@@ -0,0 +1,657 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Repeatable end to end benchmark over loopback: throughput, one-way latency percentiles and CPU per message for each reliability, message size and number of connections, written as CSV so builds can be compared
+
+
+#include "RakPeerInterface.h"
+#include "MessageIdentifiers.h"
+#include "BitStream.h"
+#include "GetTime.h"
+#include "RakSleep.h"
+#include "VirtualNetwork.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WIN32)
+#include "WindowsIncludes.h"
+#else
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+using namespace RakNet;
+
+static const unsigned short SERVER_PORT=61992;
+static const int MAX_LIST=32;
+
+struct ReliabilityName
+{
+	PacketReliability reliability;
+	const char *name;
+};
+static const ReliabilityName reliabilityNames[]=
+{
+	{UNRELIABLE, "UNRELIABLE"},
+	{UNRELIABLE_SEQUENCED, "UNRELIABLE_SEQUENCED"},
+	{RELIABLE, "RELIABLE"},
+	{RELIABLE_ORDERED, "RELIABLE_ORDERED"},
+	{RELIABLE_SEQUENCED, "RELIABLE_SEQUENCED"},
+	{UNRELIABLE_WITH_ACK_RECEIPT, "UNRELIABLE_WITH_ACK_RECEIPT"},
+	{RELIABLE_WITH_ACK_RECEIPT, "RELIABLE_WITH_ACK_RECEIPT"},
+	{RELIABLE_ORDERED_WITH_ACK_RECEIPT, "RELIABLE_ORDERED_WITH_ACK_RECEIPT"},
+};
+static const int NUM_RELIABILITIES=sizeof(reliabilityNames)/sizeof(reliabilityNames[0]);
+
+// User plus system time of this process, which runs both ends of every connection
+static double ProcessCPUSeconds(void)
+{
+#if defined(_WIN32)
+	FILETIME creationTime, exitTime, kernelTime, userTime;
+	GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime);
+	ULARGE_INTEGER kernel, user;
+	kernel.LowPart=kernelTime.dwLowDateTime;
+	kernel.HighPart=kernelTime.dwHighDateTime;
+	user.LowPart=userTime.dwLowDateTime;
+	user.HighPart=userTime.dwHighDateTime;
+	return (double) (kernel.QuadPart+user.QuadPart)/10000000.0;
+#else
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (double) usage.ru_utime.tv_sec+usage.ru_utime.tv_usec/1000000.0+
+		(double) usage.ru_stime.tv_sec+usage.ru_stime.tv_usec/1000000.0;
+#endif
+}
+
+// Counts latencies in buckets 1/32 of a power of two wide, so percentiles are within about 3% of the real value using a few kilobytes
+class LatencyHistogram
+{
+public:
+	LatencyHistogram() {Clear();}
+	void Clear(void)
+	{
+		memset(counts, 0, sizeof(counts));
+		total=0;
+		largest=0;
+	}
+	void Add(TimeUS microseconds)
+	{
+		counts[GetBucket(microseconds)]++;
+		total++;
+		if (microseconds>largest)
+			largest=microseconds;
+	}
+	/// \param[in] fraction 0.5 for the median, 0.99 for the 99th percentile
+	/// \return The upper bound of the bucket that contains the percentile, in microseconds
+	TimeUS GetPercentile(double fraction) const
+	{
+		if (total==0)
+			return 0;
+		uint64_t rank=(uint64_t) (fraction*(double) total);
+		if (rank>=total)
+			rank=total-1;
+		uint64_t seen=0;
+		for (int bucket=0; bucket < NUM_BUCKETS; bucket++)
+		{
+			seen+=counts[bucket];
+			if (seen>rank)
+			{
+				TimeUS upperBound=GetBucketUpperBound(bucket);
+				return upperBound < largest ? upperBound : largest;
+			}
+		}
+		return largest;
+	}
+	TimeUS GetLargest(void) const {return largest;}
+	uint64_t GetTotal(void) const {return total;}
+
+protected:
+	enum
+	{
+		SUB_BUCKET_BITS=5,
+		SUB_BUCKETS=1<<SUB_BUCKET_BITS,
+		// Values below SUB_BUCKETS*2 get a bucket each, then SUB_BUCKETS buckets per power of two up to 2^40 microseconds
+		NUM_BUCKETS=SUB_BUCKETS*2+(40-SUB_BUCKET_BITS-1)*SUB_BUCKETS
+	};
+	static int GetBucket(TimeUS value)
+	{
+		if (value < (TimeUS) SUB_BUCKETS*2)
+			return (int) value;
+		int highestBit=0;
+		for (TimeUS v=value; v>1; v>>=1)
+			highestBit++;
+		int bucket=SUB_BUCKETS*2+(highestBit-SUB_BUCKET_BITS-1)*SUB_BUCKETS+(int) ((value>>(highestBit-SUB_BUCKET_BITS))&(SUB_BUCKETS-1));
+		return bucket < NUM_BUCKETS ? bucket : NUM_BUCKETS-1;
+	}
+	static TimeUS GetBucketUpperBound(int bucket)
+	{
+		if (bucket < SUB_BUCKETS*2)
+			return (TimeUS) bucket;
+		int highestBit=(bucket-SUB_BUCKETS*2)/SUB_BUCKETS+SUB_BUCKET_BITS+1;
+		TimeUS subBucket=(TimeUS) ((bucket-SUB_BUCKETS*2)%SUB_BUCKETS);
+		return (((TimeUS) SUB_BUCKETS+subBucket+1)<<(highestBit-SUB_BUCKET_BITS))-1;
+	}
+
+	uint64_t counts[NUM_BUCKETS];
+	uint64_t total;
+	TimeUS largest;
+};
+
+struct RunSettings
+{
+	int reliabilityIndex;
+	int messageBytes;
+	int numConnections;
+	double lossPercent;
+	// Over a VirtualNetwork instead of UDP, with this much latency each way
+	bool virtualTransport;
+	TimeUS latency;
+	int milliseconds;
+	double messagesPerSecond;
+	double bytesPerSecond;
+};
+
+struct RunResult
+{
+	bool connected;
+	bool simulatorActive;
+	uint64_t messagesSent;
+	uint64_t messagesReceived;
+	double seconds;
+	double messagesPerSecond;
+	double bytesPerSecond;
+	TimeUS p50, p99, p999, largest;
+	double cpuMicrosecondsPerMessage;
+};
+
+static void ReceiveAll(RakPeerInterface *peer)
+{
+	Packet *packet;
+	for (packet=peer->Receive(); packet; peer->DeallocatePacket(packet), packet=peer->Receive())
+		;
+}
+
+// Reads the send time from every benchmark message the server got
+static void ReceiveMessages(RakPeerInterface *server, unsigned int runId, LatencyHistogram *histogram, uint64_t *messagesReceived, uint64_t *bytesReceived)
+{
+	Packet *packet;
+	for (packet=server->Receive(); packet; server->DeallocatePacket(packet), packet=server->Receive())
+	{
+		if (packet->data[0]!=ID_USER_PACKET_ENUM)
+			continue;
+		BitStream bitStream(packet->data, packet->length, false);
+		bitStream.IgnoreBytes(sizeof(MessageID));
+		unsigned int messageRunId;
+		TimeUS sendTime;
+		bitStream.Read(messageRunId);
+		bitStream.Read(sendTime);
+		if (messageRunId!=runId)
+			continue;
+		TimeUS now=GetTimeUS();
+		histogram->Add(now > sendTime ? now-sendTime : 0);
+		(*messagesReceived)++;
+		(*bytesReceived)+=packet->length;
+	}
+}
+
+static bool Connect(RakPeerInterface *server, RakPeerInterface **clients, int numConnections)
+{
+	int i;
+	for (i=0; i < numConnections; i++)
+		clients[i]->Connect("127.0.0.1", SERVER_PORT, 0, 0);
+	// Connecting thousands of peers from one process takes a while
+	TimeMS timeout=GetTimeMS()+10000+numConnections*4;
+	while (server->NumberOfConnections() < (unsigned short) numConnections && GetTimeMS() < timeout)
+	{
+		for (i=0; i < numConnections; i++)
+			ReceiveAll(clients[i]);
+		ReceiveAll(server);
+		RakSleep(10);
+	}
+	return server->NumberOfConnections()==(unsigned short) numConnections;
+}
+
+// Every client sends to the server at an even total rate for the run, then the server gets what is still in flight
+static void Run(const RunSettings &settings, RunResult *result)
+{
+	static unsigned int runId=0;
+	runId++;
+	memset(result, 0, sizeof(*result));
+
+	// Destroyed after the peers
+	VirtualNetwork network;
+	if (settings.virtualTransport)
+	{
+		VirtualLinkSettings linkSettings;
+		linkSettings.latency=settings.latency;
+		linkSettings.lossChance=(float) (settings.lossPercent/100.0);
+		network.SetDefaultLinkSettings(linkSettings);
+		network.StartUpdateThread(1);
+	}
+
+	RakPeerInterface *server=RakPeerInterface::GetInstance();
+	SocketDescriptor serverSocket(SERVER_PORT, 0);
+	if (settings.virtualTransport)
+		serverSocket.virtualNetwork=&network;
+	if (server->Startup(settings.numConnections, &serverSocket, 1)!=RAKNET_STARTED)
+	{
+		printf("Could not start the server on port %i\n", SERVER_PORT);
+		RakPeerInterface::DestroyInstance(server);
+		return;
+	}
+	server->SetMaximumIncomingConnections((unsigned short) settings.numConnections);
+	RakPeerInterface **clients = new RakPeerInterface*[settings.numConnections];
+	int i;
+	for (i=0; i < settings.numConnections; i++)
+	{
+		clients[i]=RakPeerInterface::GetInstance();
+		SocketDescriptor clientSocket(0, 0);
+		if (settings.virtualTransport)
+			clientSocket.virtualNetwork=&network;
+		clients[i]->Startup(1, &clientSocket, 1);
+	}
+
+	result->connected=Connect(server, clients, settings.numConnections);
+	if (result->connected)
+	{
+		if (settings.virtualTransport)
+		{
+			result->simulatorActive=true;
+		}
+		else
+		{
+			// Loss applies in both directions, so acknowledgements are lost as well as data
+			float loss=(float) (settings.lossPercent/100.0);
+			server->ApplyNetworkSimulator(loss, 0, 0);
+			for (i=0; i < settings.numConnections; i++)
+				clients[i]->ApplyNetworkSimulator(loss, 0, 0);
+			result->simulatorActive=server->IsNetworkSimulatorActive();
+		}
+
+		double messagesPerSecond=settings.messagesPerSecond;
+		if (messagesPerSecond*settings.messageBytes > settings.bytesPerSecond)
+			messagesPerSecond=settings.bytesPerSecond/settings.messageBytes;
+
+		BitStream bitStream;
+		char *padding = new char[settings.messageBytes];
+		memset(padding, 0, settings.messageBytes);
+		int headerBytes=(int) (sizeof(MessageID)+sizeof(unsigned int)+sizeof(TimeUS));
+		int paddingBytes=settings.messageBytes > headerBytes ? settings.messageBytes-headerBytes : 0;
+		PacketReliability reliability=reliabilityNames[settings.reliabilityIndex].reliability;
+
+		LatencyHistogram histogram;
+		uint64_t bytesReceived=0;
+		int nextClient=0;
+		double cpuStart=ProcessCPUSeconds();
+		TimeUS startTime=GetTimeUS();
+		TimeUS sendEndTime=startTime+(TimeUS) settings.milliseconds*1000;
+		TimeUS now=startTime;
+		while (now < sendEndTime)
+		{
+			uint64_t messagesDue=(uint64_t) ((double) (now-startTime)*messagesPerSecond/1000000.0);
+			while (result->messagesSent < messagesDue)
+			{
+				bitStream.Reset();
+				bitStream.Write((MessageID) ID_USER_PACKET_ENUM);
+				bitStream.Write(runId);
+				bitStream.Write(GetTimeUS());
+				bitStream.WriteAlignedBytes((const unsigned char*) padding, paddingBytes);
+				clients[nextClient]->Send(&bitStream, HIGH_PRIORITY, reliability, 0, UNASSIGNED_SYSTEM_ADDRESS, true);
+				if (++nextClient==settings.numConnections)
+					nextClient=0;
+				result->messagesSent++;
+			}
+			ReceiveMessages(server, runId, &histogram, &result->messagesReceived, &bytesReceived);
+			for (i=0; i < settings.numConnections; i++)
+				ReceiveAll(clients[i]);
+			RakSleep(1);
+			now=GetTimeUS();
+		}
+
+		// Wait for what is still in flight. Unreliable messages that were lost never arrive, so do not wait long for those
+		bool reliable=reliability==RELIABLE || reliability==RELIABLE_ORDERED || reliability==RELIABLE_SEQUENCED ||
+			reliability==RELIABLE_WITH_ACK_RECEIPT || reliability==RELIABLE_ORDERED_WITH_ACK_RECEIPT;
+		TimeUS drainEndTime=now+(reliable ? 5000000 : 500000);
+		TimeUS lastReceiveTime=now;
+		while (result->messagesReceived < result->messagesSent && now < drainEndTime && now-lastReceiveTime < 1000000)
+		{
+			uint64_t receivedBefore=result->messagesReceived;
+			ReceiveMessages(server, runId, &histogram, &result->messagesReceived, &bytesReceived);
+			for (i=0; i < settings.numConnections; i++)
+				ReceiveAll(clients[i]);
+			RakSleep(1);
+			now=GetTimeUS();
+			if (result->messagesReceived!=receivedBefore)
+				lastReceiveTime=now;
+		}
+		double cpuSeconds=ProcessCPUSeconds()-cpuStart;
+		delete [] padding;
+
+		result->seconds=(double) (lastReceiveTime-startTime)/1000000.0;
+		if (result->seconds>0)
+		{
+			result->messagesPerSecond=(double) result->messagesReceived/result->seconds;
+			result->bytesPerSecond=(double) bytesReceived/result->seconds;
+		}
+		result->p50=histogram.GetPercentile(0.5);
+		result->p99=histogram.GetPercentile(0.99);
+		result->p999=histogram.GetPercentile(0.999);
+		result->largest=histogram.GetLargest();
+		if (result->messagesReceived>0)
+			result->cpuMicrosecondsPerMessage=cpuSeconds*1000000.0/(double) result->messagesReceived;
+	}
+
+	for (i=0; i < settings.numConnections; i++)
+		RakPeerInterface::DestroyInstance(clients[i]);
+	RakPeerInterface::DestroyInstance(server);
+	delete [] clients;
+}
+
+static const char *CSV_HEADER="transport,reliability,bytes,connections,loss_percent,simulator_active,sent,received,seconds,messages_per_second,bytes_per_second,p50_us,p99_us,p999_us,max_us,cpu_us_per_message";
+
+static void WriteCSVRow(FILE *fp, const RunSettings &settings, const RunResult &result)
+{
+	fprintf(fp, "%s,%s,%i,%i,%.2f,%i,%llu,%llu,%.3f,%.1f,%.1f,%llu,%llu,%llu,%llu,%.3f\n",
+		settings.virtualTransport ? "virtual" : "udp", reliabilityNames[settings.reliabilityIndex].name, settings.messageBytes, settings.numConnections, settings.lossPercent,
+		result.simulatorActive ? 1 : 0, (unsigned long long) result.messagesSent, (unsigned long long) result.messagesReceived, result.seconds,
+		result.messagesPerSecond, result.bytesPerSecond,
+		(unsigned long long) result.p50, (unsigned long long) result.p99, (unsigned long long) result.p999, (unsigned long long) result.largest,
+		result.cpuMicrosecondsPerMessage);
+}
+
+// A row from a CSV file written by an earlier build
+struct BaselineRow
+{
+	char transport[16];
+	char reliability[64];
+	int messageBytes;
+	int numConnections;
+	double lossPercent;
+	double messagesPerSecond;
+	unsigned long long p99;
+	double cpuMicrosecondsPerMessage;
+};
+
+static int LoadBaseline(const char *path, BaselineRow *rows, int maxRows)
+{
+	FILE *fp=fopen(path, "r");
+	if (fp==0)
+	{
+		printf("Could not open %s to compare against\n", path);
+		return 0;
+	}
+	char line[512];
+	int numRows=0;
+	while (numRows < maxRows && fgets(line, sizeof(line), fp))
+	{
+		BaselineRow *row=rows+numRows;
+		int simulatorActive;
+		unsigned long long sent, received, p50;
+		double seconds, bytesPerSecond;
+		if (sscanf(line, "%15[^,],%63[^,],%i,%i,%lf,%i,%llu,%llu,%lf,%lf,%lf,%llu,%llu",
+			row->transport, row->reliability, &row->messageBytes, &row->numConnections, &row->lossPercent, &simulatorActive,
+			&sent, &received, &seconds, &row->messagesPerSecond, &bytesPerSecond, &p50, &row->p99)!=13)
+			continue;
+		// The last column
+		const char *lastComma=strrchr(line, ',');
+		row->cpuMicrosecondsPerMessage=atof(lastComma+1);
+		numRows++;
+	}
+	fclose(fp);
+	return numRows;
+}
+
+static const BaselineRow *FindBaseline(const BaselineRow *rows, int numRows, const RunSettings &settings)
+{
+	for (int i=0; i < numRows; i++)
+	{
+		if (strcmp(rows[i].transport, settings.virtualTransport ? "virtual" : "udp")==0 &&
+			strcmp(rows[i].reliability, reliabilityNames[settings.reliabilityIndex].name)==0 &&
+			rows[i].messageBytes==settings.messageBytes &&
+			rows[i].numConnections==settings.numConnections &&
+			rows[i].lossPercent > settings.lossPercent-0.005 && rows[i].lossPercent < settings.lossPercent+0.005)
+			return rows+i;
+	}
+	return 0;
+}
+
+static double PercentChange(double before, double after)
+{
+	return before!=0 ? (after-before)*100.0/before : 0.0;
+}
+
+// Reads "1,10,100" into values, returning how many were read
+static int ParseIntList(const char *str, int values[MAX_LIST])
+{
+	int count=0;
+	while (*str && count < MAX_LIST)
+	{
+		values[count++]=atoi(str);
+		while (*str && *str!=',')
+			str++;
+		if (*str==',')
+			str++;
+	}
+	return count;
+}
+
+static int ParseDoubleList(const char *str, double values[MAX_LIST])
+{
+	int count=0;
+	while (*str && count < MAX_LIST)
+	{
+		values[count++]=atof(str);
+		while (*str && *str!=',')
+			str++;
+		if (*str==',')
+			str++;
+	}
+	return count;
+}
+
+static int ParseReliabilities(const char *str, int indices[MAX_LIST])
+{
+	int count=0;
+	if (strcmp(str, "all")==0)
+	{
+		for (count=0; count < NUM_RELIABILITIES; count++)
+			indices[count]=count;
+		return count;
+	}
+	while (*str && count < MAX_LIST)
+	{
+		const char *end=strchr(str, ',');
+		size_t length=end ? (size_t) (end-str) : strlen(str);
+		for (int i=0; i < NUM_RELIABILITIES; i++)
+		{
+			if (strlen(reliabilityNames[i].name)==length && strncmp(reliabilityNames[i].name, str, length)==0)
+				indices[count++]=i;
+		}
+		str+=length;
+		if (*str==',')
+			str++;
+	}
+	return count;
+}
+
+static void PrintUsage(void)
+{
+	printf("Usage: NetworkBenchmark [options]\n");
+	printf("  -reliabilities all|UNRELIABLE,RELIABLE_ORDERED,...   Default UNRELIABLE,UNRELIABLE_SEQUENCED,RELIABLE,RELIABLE_ORDERED,RELIABLE_SEQUENCED\n");
+	printf("  -bytes 16,1400,16384     Message sizes\n");
+	printf("  -connections 1,10,100    Numbers of connections, 1 to 10000\n");
+	printf("  -loss 0,5                Simulated loss in percent, which needs a debug build over UDP\n");
+	printf("  -transport udp|virtual   Loopback UDP, or a VirtualNetwork in this process\n");
+	printf("  -latency 0               Milliseconds of latency each way, for -transport virtual\n");
+	printf("  -milliseconds 2000       Time sending for each run\n");
+	printf("  -rate 10000              Messages per second sent, over all connections\n");
+	printf("  -bandwidth 20000000      Bytes per second sent, over all connections, which lowers the rate for large messages\n");
+	printf("  -csv results.csv         Write results to a file as well as the console\n");
+	printf("  -compare baseline.csv    Print the change against results written by an earlier build\n");
+}
+
+int main(int argc, char **argv)
+{
+	int reliabilityIndices[MAX_LIST]={0,1,2,3,4};
+	int numReliabilities=5;
+	int messageBytes[MAX_LIST]={16,1400,16384};
+	int numMessageBytes=3;
+	int connectionCounts[MAX_LIST]={1,10,100};
+	int numConnectionCounts=3;
+	double lossPercents[MAX_LIST]={0};
+	int numLossPercents=1;
+	int milliseconds=2000;
+	bool virtualTransport=false;
+	int latencyMS=0;
+	double messagesPerSecond=10000;
+	double bytesPerSecond=20000000;
+	const char *csvPath=0;
+	const char *comparePath=0;
+
+	for (int arg=1; arg < argc; arg++)
+	{
+		if (arg+1 >= argc)
+		{
+			PrintUsage();
+			return 1;
+		}
+		const char *value=argv[arg+1];
+		if (strcmp(argv[arg], "-reliabilities")==0)
+			numReliabilities=ParseReliabilities(value, reliabilityIndices);
+		else if (strcmp(argv[arg], "-bytes")==0)
+			numMessageBytes=ParseIntList(value, messageBytes);
+		else if (strcmp(argv[arg], "-connections")==0)
+			numConnectionCounts=ParseIntList(value, connectionCounts);
+		else if (strcmp(argv[arg], "-loss")==0)
+			numLossPercents=ParseDoubleList(value, lossPercents);
+		else if (strcmp(argv[arg], "-milliseconds")==0)
+			milliseconds=atoi(value);
+		else if (strcmp(argv[arg], "-rate")==0)
+			messagesPerSecond=atof(value);
+		else if (strcmp(argv[arg], "-transport")==0)
+			virtualTransport=strcmp(value, "virtual")==0;
+		else if (strcmp(argv[arg], "-latency")==0)
+			latencyMS=atoi(value);
+		else if (strcmp(argv[arg], "-bandwidth")==0)
+			bytesPerSecond=atof(value);
+		else if (strcmp(argv[arg], "-csv")==0)
+			csvPath=value;
+		else if (strcmp(argv[arg], "-compare")==0)
+			comparePath=value;
+		else
+		{
+			PrintUsage();
+			return 1;
+		}
+		arg++;
+	}
+	int i;
+	for (i=0; i < numMessageBytes; i++)
+	{
+		// Room for the message identifier, run and send time
+		if (messageBytes[i] < 13)
+			messageBytes[i]=13;
+	}
+	for (i=0; i < numConnectionCounts; i++)
+	{
+		if (connectionCounts[i] < 1)
+			connectionCounts[i]=1;
+		if (connectionCounts[i] > 10000)
+			connectionCounts[i]=10000;
+	}
+	if (milliseconds < 100)
+		milliseconds=100;
+	if (messagesPerSecond < 1)
+		messagesPerSecond=1;
+	if (bytesPerSecond < 1)
+		bytesPerSecond=1;
+
+	printf("Repeatable end to end benchmark over loopback: throughput, one-way latency\npercentiles and CPU per message for each reliability, message size and number\nof connections, written as CSV so builds can be compared\n");
+	printf("Difficulty: Intermediate\n\n");
+
+	static const int MAX_BASELINE_ROWS=4096;
+	BaselineRow *baseline=0;
+	int numBaselineRows=0;
+	if (comparePath)
+	{
+		baseline = new BaselineRow[MAX_BASELINE_ROWS];
+		numBaselineRows=LoadBaseline(comparePath, baseline, MAX_BASELINE_ROWS);
+	}
+	FILE *csvFile=0;
+	if (csvPath)
+	{
+		csvFile=fopen(csvPath, "w");
+		if (csvFile==0)
+			printf("Could not open %s to write\n", csvPath);
+		else
+			fprintf(csvFile, "%s\n", CSV_HEADER);
+	}
+
+	printf("%s\n", CSV_HEADER);
+	bool warnedSimulator=false;
+	for (int lossIndex=0; lossIndex < numLossPercents; lossIndex++)
+	{
+		for (int connectionIndex=0; connectionIndex < numConnectionCounts; connectionIndex++)
+		{
+			for (int bytesIndex=0; bytesIndex < numMessageBytes; bytesIndex++)
+			{
+				for (int reliabilityIndex=0; reliabilityIndex < numReliabilities; reliabilityIndex++)
+				{
+					RunSettings settings;
+					settings.reliabilityIndex=reliabilityIndices[reliabilityIndex];
+					settings.messageBytes=messageBytes[bytesIndex];
+					settings.numConnections=connectionCounts[connectionIndex];
+					settings.lossPercent=lossPercents[lossIndex];
+					settings.virtualTransport=virtualTransport;
+					settings.latency=(TimeUS) (latencyMS > 0 ? latencyMS : 0)*1000;
+					settings.milliseconds=milliseconds;
+					settings.messagesPerSecond=messagesPerSecond;
+					settings.bytesPerSecond=bytesPerSecond;
+					RunResult result;
+					Run(settings, &result);
+					if (result.connected==false)
+					{
+						printf("# %s, %i bytes, %i connections: could not connect\n", reliabilityNames[settings.reliabilityIndex].name, settings.messageBytes, settings.numConnections);
+						continue;
+					}
+					if (settings.lossPercent>0 && result.simulatorActive==false && warnedSimulator==false)
+					{
+						printf("# ApplyNetworkSimulator() only works in debug builds, so there is no simulated loss in this run\n");
+						warnedSimulator=true;
+					}
+					WriteCSVRow(stdout, settings, result);
+					if (csvFile)
+					{
+						WriteCSVRow(csvFile, settings, result);
+						fflush(csvFile);
+					}
+					if (baseline)
+					{
+						const BaselineRow *row=FindBaseline(baseline, numBaselineRows, settings);
+						if (row)
+						{
+							printf("#   against baseline: messages/s %+.1f%%, p99 %+.1f%%, CPU/message %+.1f%%\n",
+								PercentChange(row->messagesPerSecond, result.messagesPerSecond),
+								PercentChange((double) row->p99, (double) result.p99),
+								PercentChange(row->cpuMicrosecondsPerMessage, result.cpuMicrosecondsPerMessage));
+						}
+					}
+					fflush(stdout);
+				}
+			}
+		}
+	}
+
+	if (csvFile)
+		fclose(csvFile);
+	delete [] baseline;
+	return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Measures how fast PacketizedTCP streams messages of different sizes over the loopback interface, and how many request / reply round trips it makes per second
+
+
+#include "PacketizedTCP.h"
+#include "MessageIdentifiers.h"
+#include "GetTime.h"
+#include "RakSleep.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace RakNet;
+
+static const unsigned short SERVER_PORT=60090;
+// Bytes the client lets wait in its send buffer before it waits for them to go out, as a server bridge would
+static const unsigned int SEND_WINDOW=4*1024*1024;
+
+static PacketizedTCP *server, *client;
+static SystemAddress serverAddress;
+static unsigned int errors;
+
+static void FillMessage(unsigned char *message, unsigned int length, unsigned int index)
+{
+	message[0]=(unsigned char) index;
+	message[length-1]=(unsigned char) (index*7);
+}
+static void CheckMessage(Packet *packet, unsigned int length, unsigned int index)
+{
+	if (packet->length!=length || packet->data[0]!=(unsigned char) index || packet->data[length-1]!=(unsigned char) (index*7))
+		errors++;
+}
+
+// Sends count messages from the client to the server as fast as they go, and returns the seconds taken
+static double Stream(unsigned int length, unsigned int count)
+{
+	unsigned char *message = (unsigned char*) malloc(length);
+	memset(message, 0, length);
+	unsigned int sent=0, received=0;
+	RakNet::TimeUS startTime=RakNet::GetTimeUS();
+	while (received < count)
+	{
+		bool idle=true;
+		while (sent < count && client->GetOutgoingDataBufferSize(serverAddress) < SEND_WINDOW)
+		{
+			FillMessage(message, length, sent);
+			client->Send((const char*) message, length, serverAddress, false);
+			sent++;
+			idle=false;
+		}
+		Packet *packet;
+		for (packet=server->Receive(); packet; server->DeallocatePacket(packet), packet=server->Receive())
+		{
+			// Large messages are preceded by ID_DOWNLOAD_PROGRESS
+			if (packet->length==length)
+			{
+				CheckMessage(packet, length, received);
+				received++;
+			}
+			idle=false;
+		}
+		if (idle)
+			RakSleep(0);
+	}
+	double seconds=(RakNet::GetTimeUS()-startTime)/1000000.0;
+	free(message);
+	return seconds;
+}
+
+// The client sends a request and waits for the server to echo it, count times
+static double RoundTrips(unsigned int count)
+{
+	unsigned char message[64];
+	memset(message, 0, sizeof(message));
+	RakNet::TimeUS startTime=RakNet::GetTimeUS();
+	for (unsigned int i=0; i < count; i++)
+	{
+		FillMessage(message, sizeof(message), i);
+		client->Send((const char*) message, sizeof(message), serverAddress, false);
+		bool replied=false;
+		while (replied==false)
+		{
+			Packet *packet=server->Receive();
+			if (packet)
+			{
+				CheckMessage(packet, sizeof(message), i);
+				server->Send((const char*) packet->data, packet->length, packet->systemAddress, false);
+				server->DeallocatePacket(packet);
+			}
+			packet=client->Receive();
+			if (packet)
+			{
+				CheckMessage(packet, sizeof(message), i);
+				client->DeallocatePacket(packet);
+				replied=true;
+			}
+			else
+				RakSleep(0);
+		}
+	}
+	return (RakNet::GetTimeUS()-startTime)/1000000.0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int megabytes=64;
+	if (argc>1)
+		megabytes=atoi(argv[1]);
+	if (megabytes<1)
+		megabytes=1;
+	unsigned int roundTrips=200;
+	if (argc>2)
+		roundTrips=atoi(argv[2]);
+
+	printf("Measures how fast PacketizedTCP streams messages of different sizes over the\nloopback interface, and how many request / reply round trips it makes per\nsecond\n");
+	printf("Difficulty: Intermediate\n\n");
+
+	server=PacketizedTCP::GetInstance();
+	client=PacketizedTCP::GetInstance();
+	if (server->Start(SERVER_PORT, 1)==false || client->Start(0, 0, 1)==false)
+	{
+		printf("Failed to start on port %i\n", SERVER_PORT);
+		return 1;
+	}
+	serverAddress=client->Connect("127.0.0.1", SERVER_PORT, true);
+	if (serverAddress==UNASSIGNED_SYSTEM_ADDRESS)
+	{
+		printf("Failed to connect\n");
+		return 1;
+	}
+	// Wait for the server to get the connection
+	while (server->HasNewIncomingConnection()==UNASSIGNED_SYSTEM_ADDRESS)
+		RakSleep(10);
+
+	printf("%u MB streamed from client to server for each size\n", megabytes);
+	printf("  Message bytes     Messages per second     MB per second\n");
+	static const unsigned int lengths[]={32, 512, 8192, 262144, 4194304};
+	for (unsigned int i=0; i < sizeof(lengths)/sizeof(lengths[0]); i++)
+	{
+		unsigned int count=(unsigned int) (((double) megabytes*1048576.0)/lengths[i]);
+		if (count<4)
+			count=4;
+		double seconds=Stream(lengths[i], count);
+		printf("  %13u %23.0f %17.1f\n", lengths[i], count/seconds, count*(double)lengths[i]/1048576.0/seconds);
+	}
+
+	double seconds=RoundTrips(roundTrips);
+	printf("\n%u round trips of 64 bytes\n  Round trips per second: %.0f\n", roundTrips, roundTrips/seconds);
+
+	if (errors)
+		printf("\n%u messages arrived corrupted\n", errors);
+
+	client->Stop();
+	server->Stop();
+	PacketizedTCP::DestroyInstance(client);
+	PacketizedTCP::DestroyInstance(server);
+	return errors==0 ? 0 : 1;
+}
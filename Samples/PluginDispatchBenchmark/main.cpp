@@ -0,0 +1,175 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Measures what RakPeer::Receive() costs per message as more plugins are attached, with and without plugins adding the message IDs they use
+
+
+#include "RakPeerInterface.h"
+#include "PluginInterface2.h"
+#include "MessageIdentifiers.h"
+#include "GetTime.h"
+#include "RakNetTime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace RakNet;
+
+static const int MESSAGES_PER_BATCH=1000;
+static const int MAX_PLUGINS=64;
+
+// Handles one message ID, the way most plugins check the first byte in OnReceive()
+class CountingPlugin : public PluginInterface2
+{
+public:
+	CountingPlugin(MessageID _messageId, bool addMessageID)
+	{
+		messageId=_messageId;
+		numHandled=0;
+		numCalls=0;
+		if (addMessageID)
+			AddReceiveMessageID(messageId);
+	}
+	virtual PluginReceiveResult OnReceive(Packet *packet)
+	{
+		numCalls++;
+		if (packet->data[0]==messageId)
+			numHandled++;
+		else if (packet->data[0]==ID_TIMESTAMP && packet->length > sizeof(MessageID)+sizeof(RakNet::Time) && packet->data[sizeof(MessageID)+sizeof(RakNet::Time)]==messageId)
+			numHandled++;
+		return RR_CONTINUE_PROCESSING;
+	}
+
+	MessageID messageId;
+	unsigned int numHandled;
+	unsigned int numCalls;
+};
+
+static unsigned int randomSeed=12345;
+static unsigned int NextRandom(void)
+{
+	randomSeed=randomSeed*1103515245+12345;
+	return randomSeed>>8;
+}
+
+struct RunResult
+{
+	double nanosecondsPerMessage;
+	double onReceiveCallsPerMessage;
+	// Every plugin handled every message meant for it
+	bool allHandled;
+};
+
+static void PushMessage(RakPeerInterface *rakPeer, MessageID messageId, bool timestamped)
+{
+	Packet *packet;
+	if (timestamped)
+	{
+		packet=rakPeer->AllocatePacket(sizeof(MessageID)+sizeof(RakNet::Time)+sizeof(MessageID)+4);
+		packet->data[0]=ID_TIMESTAMP;
+		memset(packet->data+sizeof(MessageID), 0, sizeof(RakNet::Time));
+		packet->data[sizeof(MessageID)+sizeof(RakNet::Time)]=messageId;
+	}
+	else
+	{
+		packet=rakPeer->AllocatePacket(sizeof(MessageID)+4);
+		packet->data[0]=messageId;
+	}
+	packet->systemAddress=UNASSIGNED_SYSTEM_ADDRESS;
+	packet->guid=UNASSIGNED_RAKNET_GUID;
+	rakPeer->PushBackPacket(packet, false);
+}
+
+static void RunDispatch(RakPeerInterface *rakPeer, int numPlugins, bool addMessageIDs, int numBatches, RunResult *result)
+{
+	CountingPlugin *plugins[MAX_PLUGINS];
+	unsigned int numSent[MAX_PLUGINS];
+	int i;
+	for (i=0; i < numPlugins; i++)
+	{
+		plugins[i]=new CountingPlugin((MessageID) (ID_USER_PACKET_ENUM+i), addMessageIDs);
+		numSent[i]=0;
+		rakPeer->AttachPlugin(plugins[i]);
+	}
+
+	RakNet::TimeUS totalTime=0;
+	unsigned int numMessages=0;
+	for (int batch=0; batch < numBatches; batch++)
+	{
+		for (i=0; i < MESSAGES_PER_BATCH; i++)
+		{
+			int pluginIndex=(int) (NextRandom()%numPlugins);
+			numSent[pluginIndex]++;
+			// One message in 50 has a timestamp
+			PushMessage(rakPeer, (MessageID) (ID_USER_PACKET_ENUM+pluginIndex), i%50==0);
+		}
+
+		RakNet::TimeUS startTime=RakNet::GetTimeUS();
+		Packet *packet;
+		for (packet=rakPeer->Receive(); packet; rakPeer->DeallocatePacket(packet), packet=rakPeer->Receive())
+			numMessages++;
+		totalTime+=RakNet::GetTimeUS()-startTime;
+	}
+
+	unsigned int numCalls=0;
+	result->allHandled=numMessages==(unsigned int) (numBatches*MESSAGES_PER_BATCH);
+	for (i=0; i < numPlugins; i++)
+	{
+		if (plugins[i]->numHandled!=numSent[i])
+			result->allHandled=false;
+		numCalls+=plugins[i]->numCalls;
+		rakPeer->DetachPlugin(plugins[i]);
+		delete plugins[i];
+	}
+	result->nanosecondsPerMessage=(double) totalTime*1000.0/numMessages;
+	result->onReceiveCallsPerMessage=(double) numCalls/numMessages;
+}
+
+int main(int argc, char **argv)
+{
+	int numBatches=200;
+	if (argc>1)
+		numBatches=atoi(argv[1]);
+	if (numBatches<1)
+		numBatches=1;
+
+	printf("Measures what RakPeer::Receive() costs per message as more plugins are attached,\nwith and without plugins adding the message IDs they use\n");
+	printf("Difficulty: Intermediate\n\n");
+
+	RakPeerInterface *rakPeer=RakPeerInterface::GetInstance();
+	SocketDescriptor socketDescriptor(0, 0);
+	if (rakPeer->Startup(1, &socketDescriptor, 1)!=RAKNET_STARTED)
+	{
+		printf("Could not start RakPeer\n");
+		RakPeerInterface::DestroyInstance(rakPeer);
+		return 1;
+	}
+
+	printf("  Plugins   Every plugin gets every message     Plugins add their IDs\n");
+	printf("            ns/message   OnReceive()/message    ns/message   OnReceive()/message\n");
+	bool allHandled=true;
+	for (int numPlugins=1; numPlugins <= MAX_PLUGINS; numPlugins*=2)
+	{
+		RunResult everyMessage, addedIDs;
+		RunDispatch(rakPeer, numPlugins, false, numBatches, &everyMessage);
+		RunDispatch(rakPeer, numPlugins, true, numBatches, &addedIDs);
+		printf("  %7i   %10.1f   %19.2f    %10.1f   %19.2f\n", numPlugins,
+			everyMessage.nanosecondsPerMessage, everyMessage.onReceiveCallsPerMessage,
+			addedIDs.nanosecondsPerMessage, addedIDs.onReceiveCallsPerMessage);
+		if (everyMessage.allHandled==false || addedIDs.allHandled==false)
+			allHandled=false;
+	}
+
+	printf("\nEvery plugin got every message meant for it: %s\n", allHandled ? "yes" : "NO");
+
+	RakPeerInterface::DestroyInstance(rakPeer);
+	return 0;
+}
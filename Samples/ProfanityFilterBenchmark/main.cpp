@@ -0,0 +1,175 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Measures how many chat messages per second ProfanityFilter checks and filters with a large word list, and compares its results with comparing each word of a message against each word of the list
+
+#include "ProfanityFilter.h"
+#include "RakString.h"
+#include "DS_List.h"
+#include "GetTime.h"
+#include "Rand.h"
+#include "LinuxStrings.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+using namespace RakNet;
+
+static const char *WORDCHARS="abcdefghijklmnopqrstuvwxyz0123456789";
+
+// Each word of the input against each word of the list, which is what ProfanityFilter did before. Positions filtered are set in filtered
+static int LinearFilter(const DataStructures::List<RakString> &words, const char *input, char *filtered)
+{
+	int count=0;
+	size_t inputLength=strlen(input);
+	char *b=new char[inputLength+1];
+	strcpy(b, input);
+	_strlwr(b);
+	memset(filtered, 0, inputLength);
+	char *start=strpbrk(b, WORDCHARS);
+	while (start!=0)
+	{
+		size_t len=strspn(start, WORDCHARS);
+		char saveChar=start[len];
+		start[len]=0;
+		for (unsigned int i=0; i < words.Size(); i++)
+		{
+			if (_stricmp(start, words[i].C_String())==0)
+			{
+				count++;
+				memset(filtered+(start-b), 1, len);
+				break;
+			}
+		}
+		start[len]=saveChar;
+		start=strpbrk(start+len, WORDCHARS);
+	}
+	delete [] b;
+	return count;
+}
+
+static void RandomWord(char *word, int minLength, int maxLength)
+{
+	int length=minLength+randomMT()%(maxLength-minLength+1);
+	for (int i=0; i < length; i++)
+		word[i]=WORDCHARS[randomMT()%26];
+	word[length]=0;
+}
+
+int main(int argc, char **argv)
+{
+	int numWords=4000;
+	int numMessages=20000;
+	if (argc>1)
+		numWords=atoi(argv[1]);
+	if (argc>2)
+		numMessages=atoi(argv[2]);
+	if (numWords<1)
+		numWords=1;
+	if (numMessages<1)
+		numMessages=1;
+
+	printf("Measures how many chat messages per second ProfanityFilter checks and filters\nwith a large word list, and compares its results with comparing each word of a\nmessage against each word of the list\n");
+	printf("Difficulty: Intermediate\n\n");
+
+	seedMT(0);
+	ProfanityFilter profanityFilter;
+	DataStructures::List<RakString> words;
+	char word[64];
+	int i;
+	for (i=0; i < numWords; i++)
+	{
+		RandomWord(word, 3, 10);
+		// Some listed in upper case, or with characters that never start or end a word of the input
+		if (i%10==0)
+			word[0]=(char) toupper(word[0]);
+		if (i%100==1)
+			strcat(word, "-x");
+		words.Insert(word, _FILE_AND_LINE_);
+	}
+	RakNet::TimeUS startTime=RakNet::GetTimeUS();
+	for (i=0; i < numWords; i++)
+		profanityFilter.AddWord(words[i]);
+	RakNet::TimeUS elapsed=RakNet::GetTimeUS()-startTime;
+	printf("%i words added in %.2f ms\n", numWords, elapsed/1000.0);
+
+	// Chat messages of up to 20 words, mixed case and punctuation, about one in ten of them listed
+	DataStructures::List<RakString> messages;
+	char message[512];
+	for (i=0; i < numMessages; i++)
+	{
+		message[0]=0;
+		int messageWords=1+randomMT()%20;
+		for (int w=0; w < messageWords; w++)
+		{
+			if (randomMT()%10==0)
+				strcpy(word, words[randomMT()%words.Size()].C_String());
+			else
+				RandomWord(word, 1, 8);
+			if (randomMT()%4==0)
+				word[0]=(char) toupper(word[0]);
+			strcat(message, word);
+			strcat(message, randomMT()%5==0 ? ", " : " ");
+		}
+		messages.Insert(message, _FILE_AND_LINE_);
+	}
+
+	char filtered[512];
+	int count=0;
+	startTime=RakNet::GetTimeUS();
+	for (i=0; i < numMessages; i++)
+		count+=profanityFilter.HasProfanity(messages[i].C_String()) ? 1 : 0;
+	elapsed=RakNet::GetTimeUS()-startTime;
+	printf("HasProfanity():          %10.0f messages per second, %i with profanity\n", numMessages*1000000.0/(elapsed ? elapsed : 1), count);
+
+	count=0;
+	startTime=RakNet::GetTimeUS();
+	for (i=0; i < numMessages; i++)
+	{
+		strcpy(message, messages[i].C_String());
+		count+=profanityFilter.FilterProfanity(message, message, true);
+	}
+	elapsed=RakNet::GetTimeUS()-startTime;
+	printf("FilterProfanity():       %10.0f messages per second, %i words filtered\n", numMessages*1000000.0/(elapsed ? elapsed : 1), count);
+
+	int linearCount=0;
+	startTime=RakNet::GetTimeUS();
+	for (i=0; i < numMessages; i++)
+		linearCount+=LinearFilter(words, messages[i].C_String(), filtered);
+	elapsed=RakNet::GetTimeUS()-startTime;
+	printf("Each word against list:  %10.0f messages per second, %i words filtered\n", numMessages*1000000.0/(elapsed ? elapsed : 1), linearCount);
+
+	// The same words are filtered, character for character
+	int mismatches=0;
+	for (i=0; i < numMessages; i++)
+	{
+		const char *original=messages[i].C_String();
+		strcpy(message, original);
+		int filterCount=profanityFilter.FilterProfanity(message, message, true);
+		if (filterCount!=LinearFilter(words, original, filtered))
+			mismatches++;
+		else
+		{
+			for (size_t c=0; original[c]; c++)
+			{
+				// Ban characters are never word characters, so every one filtered changes
+				if ((message[c]!=original[c])!=(filtered[c]!=0))
+				{
+					mismatches++;
+					break;
+				}
+			}
+		}
+	}
+	printf("\n%i of %i messages filtered differently\n", mismatches, numMessages);
+	return mismatches==0 ? 0 : 1;
+}
@@ -0,0 +1,330 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Times RakPeer's remote system and ban list lookups, before and after they were moved to hash tables
+
+
+#include "RakNetTypes.h"
+#include "DS_FlatHashIndex.h"
+#include "DS_List.h"
+#include "BanList.h"
+#include "GetTime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace RakNet;
+
+static unsigned int randomSeed=12345;
+static unsigned int NextRandom(void)
+{
+	randomSeed=randomSeed*1103515245+12345;
+	return randomSeed>>8;
+}
+static unsigned int NextRandom32(void)
+{
+	return (NextRandom()<<16) ^ NextRandom();
+}
+
+// Laid out like RakPeer::RemoteSystemStruct, where the reliability layer puts each entry several cache lines from the next
+struct SimulatedRemoteSystem
+{
+	bool isActive;
+	SystemAddress systemAddress;
+	RakNetGUID guid;
+	char reliabilityLayer[2048];
+};
+
+// What RakPeer used before FlatHashIndex: chains of indices, in a table eight times the number of systems
+struct ChainedIndex
+{
+	unsigned index;
+	ChainedIndex *next;
+};
+
+// Only here so the compiler keeps the lookups
+static volatile unsigned int sink;
+
+static void MakeAddress(unsigned int ip, unsigned short port, SystemAddress *systemAddress, char *str)
+{
+	sprintf(str, "%u.%u.%u.%u", ip>>24, (ip>>16)&255, (ip>>8)&255, ip&255);
+	systemAddress->FromStringExplicitPort(str, port);
+}
+
+static double NanosecondsPerLookup(RakNet::TimeUS startTime, unsigned int numLookups)
+{
+	return (double) (RakNet::GetTimeUS()-startTime) * 1000.0 / numLookups;
+}
+
+static void BenchmarkRemoteSystems(unsigned int numSystems, unsigned int numLookups)
+{
+	unsigned int i;
+	char str[32];
+	SimulatedRemoteSystem *remoteSystemList = new SimulatedRemoteSystem[numSystems];
+	for (i=0; i < numSystems; i++)
+	{
+		remoteSystemList[i].isActive=true;
+		MakeAddress(0x0A000000 | (NextRandom32() & 0xFFFFFF), (unsigned short) (1024+NextRandom()%60000), &remoteSystemList[i].systemAddress, str);
+		remoteSystemList[i].guid.g=((uint64_t) NextRandom32() << 32) | NextRandom32();
+	}
+
+	DataStructures::FlatHashIndex<RakNetGUID, RakNetGUID::ToUint32> guidLookup;
+	DataStructures::FlatHashIndex<SystemAddress, SystemAddress::ToInteger> addressLookup;
+	guidLookup.Reserve(numSystems, _FILE_AND_LINE_);
+	addressLookup.Reserve(numSystems, _FILE_AND_LINE_);
+	unsigned int numChains=numSystems*8;
+	ChainedIndex **chains = new ChainedIndex*[numChains];
+	ChainedIndex *chainedIndices = new ChainedIndex[numSystems];
+	memset(chains, 0, sizeof(ChainedIndex*)*numChains);
+	for (i=0; i < numSystems; i++)
+	{
+		guidLookup.Set(remoteSystemList[i].guid, i);
+		addressLookup.Set(remoteSystemList[i].systemAddress, i);
+		unsigned int chain = SystemAddress::ToInteger(remoteSystemList[i].systemAddress) % numChains;
+		chainedIndices[i].index=i;
+		chainedIndices[i].next=chains[chain];
+		chains[chain]=chainedIndices+i;
+	}
+
+	// Half the lookups are for systems that are connected. The rest are for new guids, as when checking a connection request.
+	RakNetGUID *guids = new RakNetGUID[numLookups];
+	SystemAddress *addresses = new SystemAddress[numLookups];
+	for (i=0; i < numLookups; i++)
+	{
+		unsigned int index=NextRandom()%numSystems;
+		addresses[i]=remoteSystemList[index].systemAddress;
+		if (i&1)
+			guids[i]=remoteSystemList[index].guid;
+		else
+			guids[i].g=((uint64_t) NextRandom32() << 32) | NextRandom32();
+	}
+	// A linear walk is too slow to do every lookup
+	unsigned int numLinearLookups = numLookups/100 > 100 ? numLookups/100 : 100;
+	if (numLinearLookups > numLookups)
+		numLinearLookups=numLookups;
+
+	unsigned int found=0, linearFound=0, j;
+	RakNet::TimeUS startTime=RakNet::GetTimeUS();
+	for (i=0; i < numLinearLookups; i++)
+	{
+		for (j=0; j < numSystems; j++)
+		{
+			if (remoteSystemList[j].guid==guids[i] && remoteSystemList[j].isActive)
+			{
+				linearFound++;
+				break;
+			}
+		}
+	}
+	double linearTime=NanosecondsPerLookup(startTime, numLinearLookups);
+
+	startTime=RakNet::GetTimeUS();
+	for (i=0; i < numLookups; i++)
+	{
+		unsigned int index=guidLookup.GetIndex(guids[i]);
+		if (index!=guidLookup.NOT_FOUND && remoteSystemList[index].isActive)
+			found++;
+	}
+	double flatTime=NanosecondsPerLookup(startTime, numLookups);
+	sink=found+linearFound;
+
+	unsigned int flatFoundInLinearRange=0;
+	for (i=0; i < numLinearLookups; i++)
+		if (guidLookup.GetIndex(guids[i])!=guidLookup.NOT_FOUND)
+			flatFoundInLinearRange++;
+	printf("GUID to system, %u systems, half not connected\n", numSystems);
+	printf("  Linear walk:    %10.1f ns per lookup\n", linearTime);
+	printf("  FlatHashIndex:  %10.1f ns per lookup (%.0fx)%s\n", flatTime, linearTime/flatTime, flatFoundInLinearRange==linearFound ? "" : " RESULTS DIFFER");
+
+	found=0;
+	unsigned int chainedFound=0;
+	startTime=RakNet::GetTimeUS();
+	for (i=0; i < numLookups; i++)
+	{
+		ChainedIndex *cur = chains[SystemAddress::ToInteger(addresses[i]) % numChains];
+		while (cur!=0)
+		{
+			if (remoteSystemList[cur->index].systemAddress==addresses[i])
+			{
+				chainedFound++;
+				break;
+			}
+			cur=cur->next;
+		}
+	}
+	double chainedTime=NanosecondsPerLookup(startTime, numLookups);
+
+	startTime=RakNet::GetTimeUS();
+	for (i=0; i < numLookups; i++)
+	{
+		if (addressLookup.GetIndex(addresses[i])!=addressLookup.NOT_FOUND)
+			found++;
+	}
+	flatTime=NanosecondsPerLookup(startTime, numLookups);
+	sink=found+chainedFound;
+	printf("SystemAddress to system, %u systems\n", numSystems);
+	printf("  Chained hash:   %10.1f ns per lookup\n", chainedTime);
+	printf("  FlatHashIndex:  %10.1f ns per lookup (%.1fx)%s\n", flatTime, chainedTime/flatTime, found==chainedFound ? "" : " RESULTS DIFFER");
+
+	// Connections come and go. Check nothing is lost when entries move back on removal.
+	bool lookupsValid=true;
+	for (i=0; i < numSystems; i+=2)
+		addressLookup.Remove(remoteSystemList[i].systemAddress);
+	for (i=0; i < numSystems; i++)
+	{
+		unsigned int index=addressLookup.GetIndex(remoteSystemList[i].systemAddress);
+		if (index!=((i&1) ? i : addressLookup.NOT_FOUND))
+			lookupsValid=false;
+	}
+	printf("  After removing half the systems, FlatHashIndex is %s\n\n", lookupsValid ? "correct" : "WRONG");
+
+	delete [] guids;
+	delete [] addresses;
+	delete [] chains;
+	delete [] chainedIndices;
+	delete [] remoteSystemList;
+}
+
+// RakPeer::IsBanned before BanList, minus timeouts, which are not timed here
+static bool OldIsBanned(DataStructures::List<char*> &banList, const char *IP)
+{
+	unsigned banListIndex, characterIndex;
+	for (banListIndex=0; banListIndex < banList.Size(); banListIndex++)
+	{
+		const char *banIP=banList[banListIndex];
+		characterIndex=0;
+		for (;;)
+		{
+			if (banIP[characterIndex]==IP[characterIndex])
+			{
+				if (IP[characterIndex]==0)
+					return true;
+				characterIndex++;
+			}
+			else
+			{
+				if (banIP[characterIndex]==0 || IP[characterIndex]==0)
+					break;
+				if (banIP[characterIndex]=='*')
+					return true;
+				break;
+			}
+		}
+	}
+	return false;
+}
+
+static void BenchmarkBanList(unsigned int numBans, unsigned int numLookups)
+{
+	unsigned int i;
+	char str[32];
+	DataStructures::List<char*> oldBanList;
+	BanList banList;
+	unsigned int *bannedIPs = new unsigned int[numBans];
+
+	// Mostly single addresses, then some /24 and /16 ranges, and a few patterns that only match as strings
+	for (i=0; i < numBans; i++)
+	{
+		unsigned int ip=NextRandom32();
+		unsigned int kind=NextRandom()%100;
+		bannedIPs[i]=ip;
+		if (kind < 90)
+			sprintf(str, "%u.%u.%u.%u", ip>>24, (ip>>16)&255, (ip>>8)&255, ip&255);
+		else if (kind < 98)
+			sprintf(str, "%u.%u.%u.*", ip>>24, (ip>>16)&255, (ip>>8)&255);
+		else if (kind < 99 || i%64!=0)
+			sprintf(str, "%u.%u.*", ip>>24, (ip>>16)&255);
+		else
+			sprintf(str, "%u.%u.%u.%u*", ip>>24, (ip>>16)&255, (ip>>8)&255, (ip&255)%25);
+		char *IP = new char[strlen(str)+1];
+		strcpy(IP, str);
+		oldBanList.Insert(IP, _FILE_AND_LINE_);
+		banList.Add(IP, 0);
+	}
+
+	// Half the lookups are for addresses near a ban
+	SystemAddress *addresses = new SystemAddress[numLookups];
+	char (*strings)[16] = new char[numLookups][16];
+	for (i=0; i < numLookups; i++)
+	{
+		unsigned int ip = (i&1) ? bannedIPs[NextRandom()%numBans] ^ (NextRandom()%4) : NextRandom32();
+		MakeAddress(ip, 1234, addresses+i, strings[i]);
+	}
+	unsigned int numOldLookups = numLookups/100 > 100 ? numLookups/100 : 100;
+	if (numOldLookups > numLookups)
+		numOldLookups=numLookups;
+
+	// The old ban list was given the address as a string, so include the conversion
+	unsigned int oldBanned=0, newBanned=0;
+	RakNet::TimeMS now=RakNet::GetTimeMS();
+	RakNet::TimeUS startTime=RakNet::GetTimeUS();
+	for (i=0; i < numOldLookups; i++)
+	{
+		addresses[i].ToString(false, str);
+		if (OldIsBanned(oldBanList, str))
+			oldBanned++;
+	}
+	double oldTime=NanosecondsPerLookup(startTime, numOldLookups);
+
+	startTime=RakNet::GetTimeUS();
+	for (i=0; i < numLookups; i++)
+	{
+		if (banList.IsBanned(addresses[i], now))
+			newBanned++;
+	}
+	double newTime=NanosecondsPerLookup(startTime, numLookups);
+	sink=oldBanned+newBanned;
+
+	unsigned int numDifferent=0;
+	for (i=0; i < numOldLookups; i++)
+	{
+		bool oldResult=OldIsBanned(oldBanList, strings[i]);
+		if (oldResult!=banList.IsBanned(strings[i], now) || oldResult!=banList.IsBanned(addresses[i], now))
+			numDifferent++;
+	}
+
+	printf("Ban list, %u bans, %u matched of %u lookups\n", banList.Size(), newBanned, numLookups);
+	printf("  List of strings:%10.1f ns per lookup\n", oldTime);
+	printf("  BanList:        %10.1f ns per lookup (%.0fx)\n", newTime, oldTime/newTime);
+	printf("  %u of %u lookups gave a different answer\n", numDifferent, numOldLookups);
+
+	for (i=0; i < oldBanList.Size(); i++)
+		delete [] oldBanList[i];
+	delete [] bannedIPs;
+	delete [] addresses;
+	delete [] strings;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int numSystems=4096;
+	unsigned int numBans=50000;
+	unsigned int numLookups=1000000;
+	if (argc>1)
+		numSystems=atoi(argv[1]);
+	if (argc>2)
+		numBans=atoi(argv[2]);
+	if (argc>3)
+		numLookups=atoi(argv[3]);
+	if (numSystems<1)
+		numSystems=1;
+	if (numBans<1)
+		numBans=1;
+	if (numLookups<1)
+		numLookups=1;
+
+	printf("Times RakPeer's remote system and ban list lookups, before and after they were moved to hash tables\n");
+	printf("Difficulty: Intermediate\n\n");
+
+	BenchmarkRemoteSystems(numSystems, numLookups);
+	BenchmarkBanList(numBans, numLookups);
+	return 0;
+}
@@ -0,0 +1,292 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Measures time and allocations for the RakString operations games do most: building, copying, storing in lists and sending names and chat
+
+
+#include "RakString.h"
+#include "BitStream.h"
+#include "StringCompressor.h"
+#include "RakMemoryOverride.h"
+#include "LocklessTypes.h"
+#include "RakThread.h"
+#include "RakSleep.h"
+#include "DS_List.h"
+#include "GetTime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace RakNet;
+
+// Player names and chat are short. Longer strings are URLs, file paths and descriptions
+static const char *SHORT_STRING="PlayerName1234";
+static const char *LONG_STRING="This is a longer string, of the kind used for file paths, URLs and chat lines that will not fit inline";
+
+// Counts rakMalloc_Ex() and rakRealloc_Ex(), which RakString allocates with
+static bool countAllocations=false;
+static unsigned int numAllocations=0;
+static void *CountingMalloc_Ex(size_t size, const char *file, unsigned int line)
+{
+	(void) file;
+	(void) line;
+	if (countAllocations)
+		numAllocations++;
+	return malloc(size);
+}
+static void *CountingRealloc_Ex(void *p, size_t size, const char *file, unsigned int line)
+{
+	(void) file;
+	(void) line;
+	if (countAllocations)
+		numAllocations++;
+	return realloc(p, size);
+}
+
+struct RunResult
+{
+	double nanosecondsPerOperation;
+	double allocationsPerOperation;
+};
+
+static RakNet::TimeUS startTime;
+static void StartRun(void)
+{
+	numAllocations=0;
+	countAllocations=true;
+	startTime=RakNet::GetTimeUS();
+}
+static void EndRun(int numOperations, RunResult *result)
+{
+	RakNet::TimeUS elapsed=RakNet::GetTimeUS()-startTime;
+	countAllocations=false;
+	result->nanosecondsPerOperation=(double) elapsed*1000.0/numOperations;
+	result->allocationsPerOperation=(double) numAllocations/numOperations;
+}
+
+// Defeats the optimizer removing the work
+static size_t checksum=0;
+
+static void RunAssign(const char *str, int numOperations, RunResult *result)
+{
+	StartRun();
+	for (int i=0; i < numOperations; i++)
+	{
+		RakString s;
+		s=str;
+		checksum+=s.GetLength();
+	}
+	EndRun(numOperations, result);
+}
+
+static void RunCopy(const char *str, int numOperations, RunResult *result)
+{
+	RakString original=str;
+	StartRun();
+	for (int i=0; i < numOperations; i++)
+	{
+		RakString copy(original);
+		checksum+=copy.C_String()[0];
+	}
+	EndRun(numOperations, result);
+}
+
+static void RunConcatenate(const char *str, int numOperations, RunResult *result)
+{
+	RakString lhs=str, rhs=": hi";
+	StartRun();
+	for (int i=0; i < numOperations; i++)
+	{
+		RakString joined=lhs+rhs;
+		checksum+=joined.GetLength();
+	}
+	EndRun(numOperations, result);
+}
+
+// Fills a list then removes from the front, which moves every string behind the one removed
+static void RunList(const char *str, int numOperations, RunResult *result)
+{
+	static const int LIST_SIZE=256;
+	DataStructures::List<RakString> list;
+	RakString s=str;
+	int numDone=0;
+	StartRun();
+	while (numDone < numOperations)
+	{
+		int i;
+		for (i=0; i < LIST_SIZE; i++)
+			list.Insert(s, _FILE_AND_LINE_);
+		for (i=0; i < LIST_SIZE; i++)
+			list.RemoveAtIndex(0);
+		numDone+=LIST_SIZE;
+	}
+	EndRun(numDone, result);
+	list.Clear(false, _FILE_AND_LINE_);
+}
+
+static void RunSerialize(const char *str, int numOperations, RunResult *result)
+{
+	RakString original=str, received;
+	RakNet::BitStream bitStream;
+	StartRun();
+	for (int i=0; i < numOperations; i++)
+	{
+		bitStream.Reset();
+		original.Serialize(&bitStream);
+		received.Deserialize(&bitStream);
+		checksum+=received.GetLength();
+	}
+	EndRun(numOperations, result);
+	if (received!=original)
+		printf("Serialize() did not round trip\n");
+}
+
+static void RunSerializeCompressed(const char *str, int numOperations, RunResult *result)
+{
+	RakString original=str, received;
+	RakNet::BitStream bitStream;
+	StartRun();
+	for (int i=0; i < numOperations; i++)
+	{
+		bitStream.Reset();
+		original.SerializeCompressed(&bitStream);
+		received.DeserializeCompressed(&bitStream);
+		checksum+=received.GetLength();
+	}
+	EndRun(numOperations, result);
+	if (received!=original)
+		printf("SerializeCompressed() did not round trip\n");
+}
+
+#ifdef RAKSTRING_HAS_MOVE
+static void RunMove(const char *str, int numOperations, RunResult *result)
+{
+	RakString a=str, b;
+	StartRun();
+	for (int i=0; i < numOperations; i++)
+	{
+		b=static_cast<RakString&&>(a);
+		a=static_cast<RakString&&>(b);
+	}
+	EndRun(numOperations*2, result);
+	checksum+=a.GetLength();
+}
+#endif
+
+// Threads copying the same string, as when several threads read a shared name or address
+static RakString *sharedString;
+static volatile bool startThreads, stopThreads;
+static LocklessUint32_t threadsDone;
+static unsigned int copiesPerThread[64];
+RAK_THREAD_DECLARATION(CopyThread)
+{
+	unsigned int *numCopies=(unsigned int *) arguments;
+	while (startThreads==false)
+		RakSleep(0);
+	unsigned int count=0;
+	while (stopThreads==false)
+	{
+		for (int i=0; i < 1000; i++)
+		{
+			RakString copy(*sharedString);
+			RakString another=copy;
+		}
+		count+=2000;
+	}
+	*numCopies=count;
+	threadsDone.Increment();
+	return 0;
+}
+
+static double CopiesPerMicrosecond(const char *str, int numThreads)
+{
+	sharedString=new RakString(str);
+	startThreads=false;
+	stopThreads=false;
+	uint32_t doneBefore=threadsDone.GetValue();
+	int i;
+	for (i=0; i < numThreads; i++)
+	{
+		copiesPerThread[i]=0;
+		RakNet::RakThread::Create(&CopyThread, copiesPerThread+i);
+	}
+	RakSleep(50);
+	RakNet::TimeUS runStart=RakNet::GetTimeUS();
+	startThreads=true;
+	RakSleep(500);
+	stopThreads=true;
+	RakNet::TimeUS elapsed=RakNet::GetTimeUS()-runStart;
+	while (threadsDone.GetValue()-doneBefore < (uint32_t) numThreads)
+		RakSleep(1);
+	delete sharedString;
+
+	double totalCopies=0;
+	for (i=0; i < numThreads; i++)
+		totalCopies+=copiesPerThread[i];
+	return totalCopies/elapsed;
+}
+
+typedef void (*RunFunction)(const char *str, int numOperations, RunResult *result);
+
+static void PrintRow(const char *name, RunFunction run, int numOperations)
+{
+	RunResult shortResult, longResult;
+	run(SHORT_STRING, numOperations, &shortResult);
+	run(LONG_STRING, numOperations, &longResult);
+	printf("  %-22s %8.1f %8.2f      %8.1f %8.2f\n", name,
+		shortResult.nanosecondsPerOperation, shortResult.allocationsPerOperation,
+		longResult.nanosecondsPerOperation, longResult.allocationsPerOperation);
+}
+
+int main(int argc, char **argv)
+{
+	int numOperations=1000000;
+	int maxThreads=8;
+	if (argc>1)
+		numOperations=atoi(argv[1]);
+	if (argc>2)
+		maxThreads=atoi(argv[2]);
+	if (numOperations<1)
+		numOperations=1;
+	if (maxThreads<1)
+		maxThreads=1;
+	if (maxThreads>64)
+		maxThreads=64;
+
+	printf("Measures time and allocations for the RakString operations games do most:\nbuilding, copying, storing in lists and sending names and chat\n");
+	printf("Difficulty: Intermediate\n\n");
+
+	SetMalloc_Ex(CountingMalloc_Ex);
+	SetRealloc_Ex(CountingRealloc_Ex);
+	StringCompressor::AddReference();
+
+	printf("Short string is %i characters, long string is %i characters\n", (int) strlen(SHORT_STRING), (int) strlen(LONG_STRING));
+	printf("                           Short string          Long string\n");
+	printf("                           ns     allocs         ns     allocs\n");
+	PrintRow("Assign", RunAssign, numOperations);
+	PrintRow("Copy", RunCopy, numOperations);
+	PrintRow("Concatenate", RunConcatenate, numOperations);
+	PrintRow("List insert and remove", RunList, numOperations);
+	PrintRow("Serialize", RunSerialize, numOperations);
+	PrintRow("SerializeCompressed", RunSerializeCompressed, numOperations/10);
+#ifdef RAKSTRING_HAS_MOVE
+	PrintRow("Move", RunMove, numOperations);
+#endif
+
+	printf("\nThreads copying the same string\n");
+	printf("  Threads   Short copies/us   Long copies/us\n");
+	for (int numThreads=1; numThreads <= maxThreads; numThreads*=2)
+		printf("  %7i   %15.1f   %14.1f\n", numThreads, CopiesPerMicrosecond(SHORT_STRING, numThreads), CopiesPerMicrosecond(LONG_STRING, numThreads));
+
+	StringCompressor::RemoveReference();
+	printf("\n(checksum %u)\n", (unsigned int) checksum);
+	return 0;
+}
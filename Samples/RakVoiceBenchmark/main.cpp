@@ -0,0 +1,263 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Times RakVoice with many voice channels open, with and without worker threads, without a network connection
+
+
+#include "RakVoice.h"
+#include "speex/speex.h"
+#include "BitStream.h"
+#include "MessageIdentifiers.h"
+#include "DS_List.h"
+#include "GetTime.h"
+#include "RakSleep.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+using namespace RakNet;
+
+// 16000 samples a second, 320 samples a frame
+static const int SAMPLE_RATE=16000;
+static const int FRAME_SAMPLES=320;
+static const int BUFFER_SIZE_BYTES=FRAME_SAMPLES*2;
+static const int TICK_MS=20;
+// How many different frames of synthetic PCM to loop through
+static const int NUM_SOURCE_FRAMES=50;
+// Incoming packets are delayed by up to this much, and this percentage of them are lost
+static const int MAX_NETWORK_JITTER_MS=60;
+static const int PACKET_LOSS_PERCENT=2;
+
+static unsigned int randomSeed=12345;
+static unsigned int NextRandom(void)
+{
+	randomSeed=randomSeed*1103515245+12345;
+	return randomSeed>>8;
+}
+
+struct EncodedFrame
+{
+	unsigned char data[256];
+	unsigned int length;
+};
+
+struct InFlightMessage
+{
+	unsigned short messageNumber;
+	RakNet::TimeMS arrivalTime;
+};
+
+struct BenchmarkResult
+{
+	double averageTickMS, worstTickMS, percentOfRealTime;
+	RakVoiceJitterStats totals;
+	unsigned largestTargetDepth;
+};
+
+// A sweep between two tones with some noise, so the encoder has something like speech to work on
+static void GenerateSourcePCM(short *pcm, int numSamples)
+{
+	double phase=0.0;
+	for (int i=0; i < numSamples; i++)
+	{
+		double frequency = 300.0 + 200.0 * sin(i * 2.0 * 3.14159265 / SAMPLE_RATE);
+		phase += frequency * 2.0 * 3.14159265 / SAMPLE_RATE;
+		pcm[i] = (short) (8000.0 * sin(phase)) + (short) (NextRandom()%1000) - 500;
+	}
+}
+
+// What a remote system would send, encoded once up front so that only RakVoice's own work is timed
+static void EncodeSourceFrames(short *pcm, EncodedFrame *frames)
+{
+	void *encoder = speex_encoder_init(&speex_wb_mode);
+	int complexity=2;
+	speex_encoder_ctl(encoder, SPEEX_SET_COMPLEXITY, &complexity);
+	SpeexBits bits;
+	speex_bits_init(&bits);
+	for (int i=0; i < NUM_SOURCE_FRAMES; i++)
+	{
+		speex_bits_reset(&bits);
+		speex_encode_int(encoder, pcm+i*FRAME_SAMPLES, &bits);
+		frames[i].length=speex_bits_write(&bits, (char*) frames[i].data, sizeof(frames[i].data));
+	}
+	speex_bits_destroy(&bits);
+	speex_encoder_destroy(encoder);
+}
+
+static RakNetGUID ChannelGuid(int channelIndex)
+{
+	return RakNetGUID(channelIndex+1);
+}
+
+static void RunBenchmark(int numChannels, int seconds, int numWorkerThreads, short *sourcePCM, EncodedFrame *sourceFrames, BenchmarkResult *result)
+{
+	RakVoice rakVoice;
+	rakVoice.Init(SAMPLE_RATE, BUFFER_SIZE_BYTES);
+	// Encode every frame, rather than only those the preprocessor thinks are speech
+	rakVoice.SetVAD(false);
+	rakVoice.SetNumWorkerThreads(numWorkerThreads);
+
+	int channelIndex;
+	Packet packet;
+	packet.systemAddress=UNASSIGNED_SYSTEM_ADDRESS;
+	packet.deleteData=false;
+	packet.wasGeneratedLocally=true;
+	for (channelIndex=0; channelIndex < numChannels; channelIndex++)
+	{
+		RakNet::BitStream reply;
+		reply.Write((MessageID)ID_RAKVOICE_OPEN_CHANNEL_REPLY);
+		reply.Write((int32_t)SAMPLE_RATE);
+		packet.guid=ChannelGuid(channelIndex);
+		packet.data=reply.GetData();
+		packet.length=reply.GetNumberOfBytesUsed();
+		packet.bitSize=reply.GetNumberOfBitsUsed();
+		rakVoice.OnReceive(&packet);
+	}
+
+	DataStructures::List<InFlightMessage> *inFlight = new DataStructures::List<InFlightMessage>[numChannels];
+	unsigned char message[512];
+	short output[FRAME_SAMPLES];
+	int numTicks=seconds*1000/TICK_MS;
+	RakNet::TimeUS totalTime=0, worstTime=0;
+	RakNet::TimeUS startTime=RakNet::GetTimeUS();
+
+	for (int tick=0; tick < numTicks; tick++)
+	{
+		RakNet::TimeMS simulatedTime=(RakNet::TimeMS) tick*TICK_MS;
+
+		// Each remote system sends one message per tick, which arrives after a random delay, if at all
+		for (channelIndex=0; channelIndex < numChannels; channelIndex++)
+		{
+			if ((int) (NextRandom()%100) < PACKET_LOSS_PERCENT)
+				continue;
+			InFlightMessage inFlightMessage;
+			inFlightMessage.messageNumber=(unsigned short) tick;
+			inFlightMessage.arrivalTime=simulatedTime+NextRandom()%(MAX_NETWORK_JITTER_MS+1);
+			inFlight[channelIndex].Push(inFlightMessage, _FILE_AND_LINE_);
+		}
+
+		RakNet::TimeUS tickStart=RakNet::GetTimeUS();
+
+		for (channelIndex=0; channelIndex < numChannels; channelIndex++)
+		{
+			// Voice of the local player going out to this channel
+			rakVoice.SendFrame(ChannelGuid(channelIndex), sourcePCM+((tick+channelIndex)%NUM_SOURCE_FRAMES)*FRAME_SAMPLES);
+
+			// Deliver whatever has arrived, which may be out of order
+			DataStructures::List<InFlightMessage> &messages = inFlight[channelIndex];
+			unsigned i=0;
+			while (i < messages.Size())
+			{
+				if (messages[i].arrivalTime > simulatedTime)
+				{
+					i++;
+					continue;
+				}
+				EncodedFrame &frame = sourceFrames[(messages[i].messageNumber+channelIndex)%NUM_SOURCE_FRAMES];
+				message[0]=ID_RAKVOICE_DATA;
+				memcpy(message+1, &messages[i].messageNumber, sizeof(unsigned short));
+				memcpy(message+3, frame.data, frame.length);
+				packet.guid=ChannelGuid(channelIndex);
+				packet.data=message;
+				packet.length=frame.length+3;
+				packet.bitSize=packet.length*8;
+				rakVoice.OnReceive(&packet);
+				messages.RemoveAtIndex(i);
+			}
+		}
+
+		rakVoice.Update();
+		rakVoice.ReceiveFrame(output);
+
+		RakNet::TimeUS tickTime=RakNet::GetTimeUS()-tickStart;
+		totalTime+=tickTime;
+		if (tickTime > worstTime)
+			worstTime=tickTime;
+
+		// Pace to real time, so the send throttle in Update() behaves as it would in a game
+		RakNet::TimeUS nextTick=startTime+(RakNet::TimeUS) (tick+1)*TICK_MS*1000;
+		RakNet::TimeUS now=RakNet::GetTimeUS();
+		if (now < nextTick)
+			RakSleep((unsigned int) ((nextTick-now)/1000));
+	}
+	RakNet::TimeUS elapsedTime=RakNet::GetTimeUS()-startTime;
+
+	result->averageTickMS=totalTime/1000.0/numTicks;
+	result->worstTickMS=worstTime/1000.0;
+	result->percentOfRealTime=100.0*totalTime/elapsedTime;
+	memset(&result->totals, 0, sizeof(result->totals));
+	result->largestTargetDepth=0;
+	for (channelIndex=0; channelIndex < numChannels; channelIndex++)
+	{
+		RakVoiceJitterStats stats;
+		rakVoice.GetJitterBufferStats(ChannelGuid(channelIndex), &stats);
+		result->totals.targetDepthFrames+=stats.targetDepthFrames;
+		result->totals.bufferedFrames+=stats.bufferedFrames;
+		result->totals.framesPlayed+=stats.framesPlayed;
+		result->totals.underflowCount+=stats.underflowCount;
+		result->totals.framesDropped+=stats.framesDropped;
+		result->totals.packetsLost+=stats.packetsLost;
+		result->totals.packetsLate+=stats.packetsLate;
+		if (stats.targetDepthFrames > result->largestTargetDepth)
+			result->largestTargetDepth=stats.targetDepthFrames;
+	}
+
+	delete [] inFlight;
+	rakVoice.Deinit();
+}
+
+static void PrintResult(const char *description, int numChannels, BenchmarkResult *result)
+{
+	printf("%s: %.3f ms per tick, worst %.3f ms, %.1f%% of real time\n", description, result->averageTickMS, result->worstTickMS, result->percentOfRealTime);
+	printf("  Jitter buffer: average target %.2f frames, largest %u, %u frames played, %u underflows, %u frames dropped, %u packets lost, %u late\n",
+		(double) result->totals.targetDepthFrames/numChannels, result->largestTargetDepth, result->totals.framesPlayed,
+		result->totals.underflowCount, result->totals.framesDropped, result->totals.packetsLost, result->totals.packetsLate);
+}
+
+int main(int argc, char **argv)
+{
+	int numChannels=64;
+	int seconds=5;
+	int numWorkerThreads=4;
+	if (argc>1)
+		numChannels=atoi(argv[1]);
+	if (argc>2)
+		seconds=atoi(argv[2]);
+	if (argc>3)
+		numWorkerThreads=atoi(argv[3]);
+
+	printf("Times RakVoice::Update() with many voice channels, with and without worker threads\n");
+	printf("Difficulty: Intermediate\n\n");
+	printf("%i channels, %i seconds each run, %i ms ticks, up to %i ms network jitter, %i%% packet loss\n\n",
+		numChannels, seconds, TICK_MS, MAX_NETWORK_JITTER_MS, PACKET_LOSS_PERCENT);
+
+	short *sourcePCM = new short[NUM_SOURCE_FRAMES*FRAME_SAMPLES];
+	EncodedFrame *sourceFrames = new EncodedFrame[NUM_SOURCE_FRAMES];
+	GenerateSourcePCM(sourcePCM, NUM_SOURCE_FRAMES*FRAME_SAMPLES);
+	EncodeSourceFrames(sourcePCM, sourceFrames);
+
+	BenchmarkResult result;
+	RunBenchmark(numChannels, seconds, 0, sourcePCM, sourceFrames, &result);
+	PrintResult("No worker threads", numChannels, &result);
+
+	if (numWorkerThreads>0)
+	{
+		char description[64];
+		sprintf(description, "%i worker threads", numWorkerThreads);
+		RunBenchmark(numChannels, seconds, numWorkerThreads, sourcePCM, sourceFrames, &result);
+		PrintResult(description, numChannels, &result);
+	}
+
+	delete [] sourcePCM;
+	delete [] sourceFrames;
+	return 0;
+}
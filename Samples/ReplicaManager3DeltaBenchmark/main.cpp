@@ -0,0 +1,336 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Compares ReplicaManager3 sending changes reliably, sending everything unreliably, and RM3SR_SERIALIZED_DELTA, for a server sending moving objects to clients over a lossy link
+
+
+#include "RakPeerInterface.h"
+#include "ReplicaManager3.h"
+#include "NetworkIDManager.h"
+#include "RakNetStatistics.h"
+#include "VirtualNetwork.h"
+#include "GetTime.h"
+#include "RakSleep.h"
+#include "Rand.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace RakNet;
+
+static const unsigned short SERVER_PORT=61992;
+static const int TICK_MS=33;
+
+enum Mode
+{
+	MODE_RELIABLE_CHANGES,
+	MODE_UNRELIABLE_ALWAYS,
+	MODE_DELTA,
+	NUM_MODES
+};
+static const char *modeNames[NUM_MODES]={"Changes, reliable", "All, unreliable", "Delta"};
+static Mode mode;
+
+// An object in a game, most of which moves every tick
+class Unit : public Replica3
+{
+public:
+	Unit(bool _isServer) : isServer(_isServer) {memset(&state, 0, sizeof(state));}
+
+	struct State
+	{
+		float position[3];
+		float velocity[3];
+		float orientation[4];
+		int32_t health;
+		int32_t ammo;
+		uint32_t animation;
+		uint32_t flags;
+	} state;
+	bool isServer;
+
+	void Tick(RakNetRandom *random, int movePercent)
+	{
+		if ((int) (random->RandomMT()%100) >= movePercent)
+			return;
+		for (int i=0; i < 3; i++)
+		{
+			state.velocity[i]+=random->FrandomMT()-.5f;
+			state.position[i]+=state.velocity[i]*TICK_MS/1000.0f;
+		}
+		state.orientation[0]+=random->FrandomMT()*.1f;
+		if (random->RandomMT()%20==0)
+			state.health--;
+		if (random->RandomMT()%10==0)
+			state.animation=random->RandomMT()%8;
+	}
+
+	virtual void WriteAllocationID(Connection_RM3 *destinationConnection, BitStream *allocationIdBitstream) const {(void) destinationConnection; allocationIdBitstream->Write((unsigned char) 0);}
+	virtual RM3ConstructionState QueryConstruction(Connection_RM3 *destinationConnection, ReplicaManager3 *replicaManager3) {(void) replicaManager3; return QueryConstruction_ServerConstruction(destinationConnection, isServer);}
+	virtual bool QueryRemoteConstruction(Connection_RM3 *sourceConnection) {return QueryRemoteConstruction_ServerConstruction(sourceConnection, isServer);}
+	virtual void SerializeConstruction(BitStream *constructionBitstream, Connection_RM3 *destinationConnection) {(void) destinationConnection; constructionBitstream->WriteAlignedBytes((const unsigned char*) &state, sizeof(state));}
+	virtual bool DeserializeConstruction(BitStream *constructionBitstream, Connection_RM3 *sourceConnection) {(void) sourceConnection; return constructionBitstream->ReadAlignedBytes((unsigned char*) &state, sizeof(state));}
+	virtual void SerializeDestruction(BitStream *destructionBitstream, Connection_RM3 *destinationConnection) {(void) destructionBitstream; (void) destinationConnection;}
+	virtual bool DeserializeDestruction(BitStream *destructionBitstream, Connection_RM3 *sourceConnection) {(void) destructionBitstream; (void) sourceConnection; return true;}
+	virtual RM3ActionOnPopConnection QueryActionOnPopConnection(Connection_RM3 *droppedConnection) const {return isServer ? QueryActionOnPopConnection_Server(droppedConnection) : QueryActionOnPopConnection_Client(droppedConnection);}
+	virtual void DeallocReplica(Connection_RM3 *sourceConnection) {(void) sourceConnection; delete this;}
+	virtual RM3QuerySerializationResult QuerySerialization(Connection_RM3 *destinationConnection) {return QuerySerialization_ServerSerializable(destinationConnection, isServer);}
+	virtual RM3SerializationResult Serialize(SerializeParameters *serializeParameters)
+	{
+		// The whole object every time, which RM3SR_SERIALIZED_DELTA requires
+		serializeParameters->outputBitstream[0].WriteAlignedBytes((const unsigned char*) &state, sizeof(state));
+		if (mode==MODE_UNRELIABLE_ALWAYS)
+		{
+			serializeParameters->pro[0].reliability=UNRELIABLE_SEQUENCED;
+			return RM3SR_SERIALIZED_ALWAYS;
+		}
+		serializeParameters->pro[0].reliability=RELIABLE_ORDERED;
+		if (mode==MODE_DELTA)
+			return RM3SR_SERIALIZED_DELTA;
+		return RM3SR_BROADCAST_IDENTICALLY;
+	}
+	virtual void Deserialize(DeserializeParameters *deserializeParameters)
+	{
+		if (deserializeParameters->bitstreamWrittenTo[0])
+			deserializeParameters->serializationBitstream[0].ReadAlignedBytes((unsigned char*) &state, sizeof(state));
+	}
+};
+
+class BenchmarkConnection : public Connection_RM3
+{
+public:
+	BenchmarkConnection(const SystemAddress &_systemAddress, RakNetGUID _guid) : Connection_RM3(_systemAddress, _guid) {}
+	virtual Replica3 *AllocReplica(BitStream *allocationIdBitstream, ReplicaManager3 *replicaManager3) {(void) allocationIdBitstream; (void) replicaManager3; return new Unit(false);}
+};
+
+class BenchmarkReplicaManager : public ReplicaManager3
+{
+public:
+	virtual Connection_RM3* AllocConnection(const SystemAddress &systemAddress, RakNetGUID rakNetGUID) const {return new BenchmarkConnection(systemAddress, rakNetGUID);}
+	virtual void DeallocConnection(Connection_RM3 *connection) const {delete connection;}
+};
+
+struct Peer
+{
+	RakPeerInterface *rakPeer;
+	NetworkIDManager networkIDManager;
+	BenchmarkReplicaManager replicaManager;
+};
+
+static void ReceiveAll(Peer *peer)
+{
+	Packet *packet;
+	for (packet=peer->rakPeer->Receive(); packet; peer->rakPeer->DeallocatePacket(packet), packet=peer->rakPeer->Receive())
+		;
+}
+
+static void ReceiveAll(Peer *server, Peer *clients, int numClients)
+{
+	for (int i=0; i < numClients; i++)
+		ReceiveAll(&clients[i]);
+	ReceiveAll(server);
+}
+
+// Sums a statistic over every connection of the server
+static uint64_t ServerTotal(Peer *server, RNSPerSecondMetrics metric)
+{
+	SystemAddress addresses[256];
+	unsigned short numAddresses=256;
+	server->rakPeer->GetConnectionList(addresses, &numAddresses);
+	uint64_t sum=0;
+	for (unsigned short i=0; i < numAddresses; i++)
+	{
+		RakNetStatistics rns;
+		if (server->rakPeer->GetStatistics(addresses[i], &rns))
+			sum+=rns.runningTotal[metric];
+	}
+	return sum;
+}
+
+struct RunResult
+{
+	bool started;
+	double kilobytesPerClientPerSecond;
+	double resentPercent;
+	int numMismatches;
+};
+
+// The server moves numObjects objects for numSeconds, then stops and gives clients a second to catch up, and every client's copy is compared with the server's
+static void Run(int numClients, int numObjects, int numSeconds, int movePercent, int lossPercent, int latencyMS, RunResult *result)
+{
+	memset(result, 0, sizeof(*result));
+	RakNetRandom random;
+	random.SeedMT(1234);
+
+	// Destroyed after the peers
+	VirtualNetwork network;
+	VirtualLinkSettings linkSettings;
+	linkSettings.latency=(TimeUS) latencyMS*1000;
+	linkSettings.lossChance=(float) (lossPercent/100.0);
+	network.SetDefaultLinkSettings(linkSettings);
+	network.SetRandomSeed(5678);
+	network.StartUpdateThread(1);
+
+	Peer server;
+	Peer *clients=new Peer[numClients];
+	int i;
+	server.rakPeer=RakPeerInterface::GetInstance();
+	SocketDescriptor serverSocket(SERVER_PORT, 0);
+	serverSocket.virtualNetwork=&network;
+	server.rakPeer->AttachPlugin(&server.replicaManager);
+	server.replicaManager.SetNetworkIDManager(&server.networkIDManager);
+	server.replicaManager.SetAutoSerializeInterval(TICK_MS);
+	if (server.rakPeer->Startup(numClients, &serverSocket, 1)!=RAKNET_STARTED)
+	{
+		printf("Could not start the server on port %i\n", SERVER_PORT);
+		RakPeerInterface::DestroyInstance(server.rakPeer);
+		delete [] clients;
+		return;
+	}
+	server.rakPeer->SetMaximumIncomingConnections((unsigned short) numClients);
+	for (i=0; i < numClients; i++)
+	{
+		clients[i].rakPeer=RakPeerInterface::GetInstance();
+		clients[i].rakPeer->AttachPlugin(&clients[i].replicaManager);
+		clients[i].replicaManager.SetNetworkIDManager(&clients[i].networkIDManager);
+		clients[i].replicaManager.SetAutoSerializeInterval(TICK_MS);
+		SocketDescriptor clientSocket(0, 0);
+		clientSocket.virtualNetwork=&network;
+		clients[i].rakPeer->Startup(1, &clientSocket, 1);
+		clients[i].rakPeer->Connect("127.0.0.1", SERVER_PORT, 0, 0);
+	}
+
+	Unit **units=new Unit*[numObjects];
+	for (i=0; i < numObjects; i++)
+	{
+		units[i]=new Unit(true);
+		server.replicaManager.Reference(units[i]);
+	}
+
+	// Wait for every client to have every object
+	TimeMS timeout=GetTimeMS()+10000;
+	bool downloaded=false;
+	while (downloaded==false && GetTimeMS() < timeout)
+	{
+		ReceiveAll(&server, clients, numClients);
+		downloaded=server.rakPeer->NumberOfConnections()==(unsigned short) numClients;
+		for (i=0; i < numClients && downloaded; i++)
+			downloaded=clients[i].replicaManager.GetReplicaCount()==(unsigned int) numObjects;
+		RakSleep(1);
+	}
+	result->started=downloaded;
+
+	if (downloaded)
+	{
+		uint64_t bytesSentBefore=ServerTotal(&server, ACTUAL_BYTES_SENT);
+		uint64_t userBytesBefore=ServerTotal(&server, USER_MESSAGE_BYTES_SENT);
+		uint64_t userBytesResentBefore=ServerTotal(&server, USER_MESSAGE_BYTES_RESENT);
+		TimeMS startTime=GetTimeMS();
+		TimeMS nextTick=startTime;
+		TimeMS endTime=startTime+numSeconds*1000;
+		while (GetTimeMS() < endTime)
+		{
+			if (GetTimeMS() >= nextTick)
+			{
+				for (i=0; i < numObjects; i++)
+					units[i]->Tick(&random, movePercent);
+				nextTick+=TICK_MS;
+			}
+			ReceiveAll(&server, clients, numClients);
+			RakSleep(1);
+		}
+		double seconds=(GetTimeMS()-startTime)/1000.0;
+		uint64_t bytesSent=ServerTotal(&server, ACTUAL_BYTES_SENT)-bytesSentBefore;
+		uint64_t userBytes=ServerTotal(&server, USER_MESSAGE_BYTES_SENT)-userBytesBefore;
+		uint64_t userBytesResent=ServerTotal(&server, USER_MESSAGE_BYTES_RESENT)-userBytesResentBefore;
+		result->kilobytesPerClientPerSecond=bytesSent/1024.0/numClients/seconds;
+		result->resentPercent=userBytes>0 ? userBytesResent*100.0/userBytes : 0.0;
+
+		endTime=GetTimeMS()+1000+latencyMS*4;
+		while (GetTimeMS() < endTime)
+		{
+			ReceiveAll(&server, clients, numClients);
+			RakSleep(1);
+		}
+
+		for (i=0; i < numClients; i++)
+		{
+			int numMatched=0;
+			for (unsigned int j=0; j < clients[i].replicaManager.GetReplicaCount(); j++)
+			{
+				Unit *clientUnit=(Unit*) clients[i].replicaManager.GetReplicaAtIndex(j);
+				Unit *serverUnit=server.networkIDManager.GET_OBJECT_FROM_ID<Unit*>(clientUnit->GetNetworkID());
+				if (serverUnit && memcmp(&serverUnit->state, &clientUnit->state, sizeof(Unit::State))==0)
+					numMatched++;
+			}
+			result->numMismatches+=numObjects-numMatched;
+		}
+	}
+
+	for (i=0; i < numClients; i++)
+	{
+		clients[i].rakPeer->Shutdown(0);
+		clients[i].replicaManager.Clear(true);
+		RakPeerInterface::DestroyInstance(clients[i].rakPeer);
+	}
+	server.rakPeer->Shutdown(0);
+	for (i=0; i < numObjects; i++)
+		delete units[i];
+	RakPeerInterface::DestroyInstance(server.rakPeer);
+	delete [] units;
+	delete [] clients;
+}
+
+int main(int argc, char **argv)
+{
+	int numSeconds=5;
+	int lossPercent=5;
+	int numClients=8;
+	int numObjects=200;
+	int movePercent=50;
+	int latencyMS=50;
+	if (argc>1)
+		numSeconds=atoi(argv[1]);
+	if (argc>2)
+		lossPercent=atoi(argv[2]);
+	if (argc>3)
+		numClients=atoi(argv[3]);
+	if (argc>4)
+		numObjects=atoi(argv[4]);
+	if (numSeconds<1)
+		numSeconds=1;
+	if (numClients<1)
+		numClients=1;
+	if (numClients>256)
+		numClients=256;
+	if (numObjects<1)
+		numObjects=1;
+
+	printf("Compares ReplicaManager3 sending changes reliably, sending everything unreliably,\nand RM3SR_SERIALIZED_DELTA, for a server sending moving objects to clients\nover a lossy link\n");
+	printf("Difficulty: Intermediate\n\n");
+
+	printf("%i clients, %i objects of %i bytes, %i%% moving per %ims tick, %i%% loss, %ims latency, %i seconds\n\n",
+		numClients, numObjects, (int) sizeof(Unit::State), movePercent, TICK_MS, lossPercent, latencyMS, numSeconds);
+	printf("  Mode                 KB/s per client   Resent %%   Mismatches\n");
+	for (int m=0; m < NUM_MODES; m++)
+	{
+		mode=(Mode) m;
+		RunResult result;
+		Run(numClients, numObjects, numSeconds, movePercent, lossPercent, latencyMS, &result);
+		if (result.started==false)
+		{
+			printf("  %-20s did not finish downloading the objects\n", modeNames[m]);
+			continue;
+		}
+		printf("  %-20s %15.1f   %8.1f   %10i\n", modeNames[m], result.kilobytesPerClientPerSecond, result.resentPercent, result.numMismatches);
+	}
+	return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Measures room searches and quick join of the Lobby2 rooms system with many rooms and many members waiting to quick join
+
+
+#include "RoomsContainer.h"
+#include "RoomTypes.h"
+#include "GetTime.h"
+#include "Rand.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace RakNet;
+
+static const int NUM_GAME_MODES=4;
+static const char *gameModes[NUM_GAME_MODES]={"Deathmatch", "CaptureTheFlag", "KingOfTheHill", "Assault"};
+static const int NUM_MAPS=25;
+static const int NUM_REGIONS=8;
+
+// A query on GameMode, Region, and optionally Map, with its own storage
+struct BenchmarkQuery
+{
+	DataStructures::Table::FilterQuery filterQueries[3];
+	DataStructures::Table::Cell cells[3];
+	RoomQuery roomQuery;
+
+	void Set(int gameMode, int region, int map)
+	{
+		strcpy(filterQueries[0].columnName, "GameMode");
+		cells[0].Set(gameModes[gameMode]);
+		strcpy(filterQueries[1].columnName, "Region");
+		cells[1].Set(region);
+		strcpy(filterQueries[2].columnName, "Map");
+		cells[2].Set(map);
+		for (int i=0; i < 3; i++)
+		{
+			filterQueries[i].operation=DataStructures::Table::QF_EQUAL;
+			filterQueries[i].cellValue=&cells[i];
+		}
+		roomQuery.queries=filterQueries;
+		roomQuery.numQueries=map>=0 ? 3 : 2;
+	}
+};
+
+static void SetRoomProperties(AllGamesRoomsContainer *agrc, RoomsParticipant *moderator, int gameMode, int region, int map)
+{
+	DataStructures::Table properties;
+	properties.AddColumn("GameMode", DataStructures::Table::STRING);
+	properties.AddColumn("Region", DataStructures::Table::NUMERIC);
+	properties.AddColumn("Map", DataStructures::Table::NUMERIC);
+	DataStructures::Table::Row *row = properties.AddRow(0);
+	row->cells[0]->Set(gameModes[gameMode]);
+	row->cells[1]->Set(region);
+	row->cells[2]->Set(map);
+	agrc->SetCustomRoomProperties(moderator, &properties);
+}
+
+int main(int argc, char **argv)
+{
+	int numRooms=10000;
+	int numMembers=4000;
+	int numSearches=5000;
+	if (argc>1)
+		numRooms=atoi(argv[1]);
+	if (argc>2)
+		numMembers=atoi(argv[2]);
+	if (argc>3)
+		numSearches=atoi(argv[3]);
+	if (numRooms<1)
+		numRooms=1;
+	if (numSearches<1)
+		numSearches=1;
+
+	printf("Measures room searches and quick join of the Lobby2 rooms system with many\nrooms and many members waiting to quick join\n");
+	printf("Difficulty: Intermediate\n\n");
+	printf("%i rooms, %i quick join members, %i searches\n\n", numRooms, numMembers, numSearches);
+
+	seedMT(0);
+	AllGamesRoomsContainer agrc;
+	GameIdentifier gameIdentifier="RoomsBenchmark";
+	agrc.AddTitle(gameIdentifier);
+
+	RoomsParticipant *moderators = new RoomsParticipant[numRooms];
+	char name[64];
+	int i;
+	TimeUS startTime=GetTimeUS();
+	for (i=0; i < numRooms; i++)
+	{
+		sprintf(name, "Moderator%i", i);
+		moderators[i].SetName(name);
+		RoomCreationParameters roomCreationParameters;
+		roomCreationParameters.networkedRoomCreationParameters.slots.publicSlots=8;
+		sprintf(name, "Room%i", i);
+		roomCreationParameters.networkedRoomCreationParameters.roomName=name;
+		roomCreationParameters.firstUser=&moderators[i];
+		roomCreationParameters.gameIdentifier=gameIdentifier;
+		agrc.CreateRoom(&roomCreationParameters, 0);
+		SetRoomProperties(&agrc, &moderators[i], randomMT()%NUM_GAME_MODES, randomMT()%NUM_REGIONS, randomMT()%NUM_MAPS);
+	}
+	TimeUS elapsed=GetTimeUS()-startTime;
+	printf("Create:               %10.1f us per room, most of it checking the name is not in use\n", (double) elapsed/numRooms);
+
+	// Searches by a player not in any room
+	RoomsParticipant searcher;
+	searcher.SetName("Searcher");
+	BenchmarkQuery query;
+	DataStructures::OrderedList<Room*, Room*, AllGamesRoomsContainer::RoomsSortByName> roomsOutput;
+	unsigned int roomsFound=0, idChecksum=0, r;
+	startTime=GetTimeUS();
+	for (i=0; i < numSearches; i++)
+	{
+		query.Set(randomMT()%NUM_GAME_MODES, randomMT()%NUM_REGIONS, randomMT()%NUM_MAPS);
+		agrc.SearchByFilter(gameIdentifier, &searcher, &query.roomQuery, roomsOutput, true);
+		roomsFound+=roomsOutput.Size();
+		for (r=0; r < roomsOutput.Size(); r++)
+			idChecksum=idChecksum*31+roomsOutput[r]->GetID();
+	}
+	elapsed=GetTimeUS()-startTime;
+	printf("Search:               %10.1f us per search, %u rooms found, checksum %08x\n", (double) elapsed/numSearches, roomsFound, idChecksum);
+
+	// Rooms change their map between searches, so the rooms they are indexed under change
+	roomsFound=0;
+	idChecksum=0;
+	startTime=GetTimeUS();
+	for (i=0; i < numSearches; i++)
+	{
+		int changed=randomMT()%numRooms;
+		SetRoomProperties(&agrc, &moderators[changed], changed%NUM_GAME_MODES, changed%NUM_REGIONS, randomMT()%NUM_MAPS);
+		query.Set(randomMT()%NUM_GAME_MODES, randomMT()%NUM_REGIONS, randomMT()%NUM_MAPS);
+		agrc.SearchByFilter(gameIdentifier, &searcher, &query.roomQuery, roomsOutput, true);
+		roomsFound+=roomsOutput.Size();
+		for (r=0; r < roomsOutput.Size(); r++)
+			idChecksum=idChecksum*31+roomsOutput[r]->GetID();
+	}
+	elapsed=GetTimeUS()-startTime;
+	printf("Change, then search:  %10.1f us per search, %u rooms found, checksum %08x\n", (double) elapsed/numSearches, roomsFound, idChecksum);
+
+	// Members wait for a game mode and region, some for a map too. Fills existing rooms, then creates rooms for those left
+	RoomsParticipant *members = new RoomsParticipant[numMembers];
+	QuickJoinUser *quickJoinUsers = new QuickJoinUser[numMembers];
+	BenchmarkQuery *memberQueries = new BenchmarkQuery[numMembers];
+	for (i=0; i < numMembers; i++)
+	{
+		sprintf(name, "Member%i", i);
+		members[i].SetName(name);
+		memberQueries[i].Set(randomMT()%NUM_GAME_MODES, randomMT()%NUM_REGIONS, randomMT()%4==0 ? (int) (randomMT()%NUM_MAPS) : -1);
+		quickJoinUsers[i].roomsParticipant=&members[i];
+		quickJoinUsers[i].networkedQuickJoinUser.query=memberQueries[i].roomQuery;
+		quickJoinUsers[i].networkedQuickJoinUser.minimumPlayers=2+randomMT()%3;
+		quickJoinUsers[i].networkedQuickJoinUser.timeout=60000;
+		agrc.AddUserToQuickJoin(gameIdentifier, &quickJoinUsers[i]);
+	}
+	DataStructures::List<QuickJoinUser*> timeoutExpired, dereferencedPointers;
+	DataStructures::List<JoinedRoomResult> joinedRoomMembers;
+	startTime=GetTimeUS();
+	agrc.ProcessQuickJoins(timeoutExpired, joinedRoomMembers, dereferencedPointers, 1000);
+	elapsed=GetTimeUS()-startTime;
+	unsigned int joinedNewRooms=0, wrongRooms=0;
+	for (r=0; r < joinedRoomMembers.Size(); r++)
+	{
+		Room *room = joinedRoomMembers[r].roomOutput;
+		if (room->GetID() > (RoomID) numRooms)
+			joinedNewRooms++;
+		// Each member has to be in one room, which passes its query
+		int member = (int) (joinedRoomMembers[r].joiningMember-members);
+		if (room->GetID() > (RoomID) numRooms)
+			continue;
+		const DataStructures::Table::FilterQuery *filterQueries = memberQueries[member].filterQueries;
+		if (members[member].GetRoom()!=room ||
+			strcmp(room->GetStringProperty(agrc.GetPropertyIndex(room->GetID(), "GameMode")), filterQueries[0].cellValue->c)!=0 ||
+			room->GetNumericProperty(agrc.GetPropertyIndex(room->GetID(), "Region"))!=filterQueries[1].cellValue->i ||
+			(memberQueries[member].roomQuery.numQueries==3 && room->GetNumericProperty(agrc.GetPropertyIndex(room->GetID(), "Map"))!=filterQueries[2].cellValue->i))
+			wrongRooms++;
+	}
+	printf("Quick join:           %10.1f ms, %u members joined existing rooms, %u joined rooms created for them, %u in rooms not passing their query\n", (double) elapsed/1000.0, joinedRoomMembers.Size()-joinedNewRooms, joinedNewRooms, wrongRooms);
+
+	// Members are not deleted by ProcessQuickJoins(), as they are not allocated one at a time
+	delete [] memberQueries;
+	delete [] quickJoinUsers;
+	delete [] members;
+	delete [] moderators;
+	return 0;
+}
@@ -0,0 +1,240 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Compares the per-priority queues ReliabilityLayer uses to pick the next message to send against the heap they replaced
+
+
+#include "ReliabilityLayer.h"
+#include "DS_Heap.h"
+#include "GetTime.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace RakNet;
+
+static const int MESSAGE_BYTES=100;
+
+// The heap ReliabilityLayer used before, with the same weights
+class HeapScheduler
+{
+public:
+	HeapScheduler() {InitWeights();}
+	void Push(InternalPacket *internalPacket)
+	{
+		heap.Push(GetNextWeight(internalPacket->priority), internalPacket, _FILE_AND_LINE_);
+	}
+	InternalPacket *Pop(void) {return heap.Pop(0);}
+	unsigned int Size(void) const {return heap.Size();}
+
+protected:
+	void InitWeights(void)
+	{
+		for (int priorityLevel=0; priorityLevel < NUMBER_OF_PRIORITIES; priorityLevel++)
+			nextWeights[priorityLevel]=(1<<priorityLevel)*priorityLevel+priorityLevel;
+	}
+	reliabilityHeapWeightType GetNextWeight(int priorityLevel)
+	{
+		uint64_t next = nextWeights[priorityLevel];
+		if (heap.Size()>0)
+		{
+			int peekPL = heap.Peek()->priority;
+			reliabilityHeapWeightType weight = heap.PeekWeight();
+			reliabilityHeapWeightType min = weight - (1<<peekPL)*peekPL+peekPL;
+			if (next<min)
+				next=min + (1<<priorityLevel)*priorityLevel+priorityLevel;
+			nextWeights[priorityLevel]=next+(1<<priorityLevel)*(priorityLevel+1)+priorityLevel;
+		}
+		else
+			InitWeights();
+		return next;
+	}
+
+	DataStructures::Heap<reliabilityHeapWeightType, InternalPacket*, false> heap;
+	reliabilityHeapWeightType nextWeights[NUMBER_OF_PRIORITIES];
+};
+
+static unsigned int randomSeed=12345;
+static unsigned int NextRandom(void)
+{
+	randomSeed=randomSeed*1103515245+12345;
+	return randomSeed>>8;
+}
+
+static InternalPacket *CreateMessages(int numMessages)
+{
+	InternalPacket *messages = new InternalPacket[numMessages];
+	for (int i=0; i < numMessages; i++)
+	{
+		messages[i].priority=(PacketPriority) (NextRandom()%NUMBER_OF_PRIORITIES);
+		messages[i].orderingChannel=0;
+		messages[i].dataBitLength=BYTES_TO_BITS(MESSAGE_BYTES);
+		messages[i].data=0;
+	}
+	return messages;
+}
+
+// With queueDepth messages waiting, sends one message and queues another, as a busy connection does in Update()
+template <class Scheduler>
+static double NanosecondsPerSendAndQueue(Scheduler &scheduler, InternalPacket *messages, int queueDepth, int numOperations)
+{
+	int i;
+	for (i=0; i < queueDepth; i++)
+		scheduler.Push(messages+i);
+	RakNet::TimeUS startTime=RakNet::GetTimeUS();
+	for (i=0; i < numOperations; i++)
+		scheduler.Push(scheduler.Pop());
+	RakNet::TimeUS elapsed=RakNet::GetTimeUS()-startTime;
+	while (scheduler.Size())
+		scheduler.Pop();
+	return (double) elapsed*1000.0/numOperations;
+}
+
+// Share of sends for each priority, with every priority always having messages waiting
+template <class Scheduler>
+static void MeasureShares(Scheduler &scheduler, InternalPacket *messages, int numSends, double shares[NUMBER_OF_PRIORITIES])
+{
+	int i, counts[NUMBER_OF_PRIORITIES];
+	for (i=0; i < NUMBER_OF_PRIORITIES; i++)
+	{
+		messages[i].priority=(PacketPriority) i;
+		counts[i]=0;
+		scheduler.Push(messages+i);
+	}
+	for (i=0; i < numSends; i++)
+	{
+		InternalPacket *internalPacket=scheduler.Pop();
+		counts[internalPacket->priority]++;
+		scheduler.Push(internalPacket);
+	}
+	while (scheduler.Size())
+		scheduler.Pop();
+	for (i=0; i < NUMBER_OF_PRIORITIES; i++)
+		shares[i]=100.0*counts[i]/numSends;
+}
+
+// Sends from a bulk channel and a game channel, both always with messages waiting, for a number of 10 millisecond updates
+static void MeasureQuota(unsigned int bulkQuota, unsigned int bytesPerUpdate, int numUpdates, double *bulkBytesPerSecond, double *gameBytesPerSecond)
+{
+	static const int MESSAGES_PER_CHANNEL=64;
+	OutgoingPacketScheduler scheduler;
+	scheduler.SetChannelQuota(1, bulkQuota);
+	InternalPacket *messages = new InternalPacket[MESSAGES_PER_CHANNEL*2];
+	int i;
+	for (i=0; i < MESSAGES_PER_CHANNEL*2; i++)
+	{
+		messages[i].priority=HIGH_PRIORITY;
+		messages[i].orderingChannel=(unsigned char) (i%2);
+		messages[i].dataBitLength=BYTES_TO_BITS(MESSAGE_BYTES*10);
+		messages[i].data=0;
+		scheduler.Push(messages+i, _FILE_AND_LINE_);
+	}
+
+	double bytesSent[2]={0,0};
+	for (int update=0; update < numUpdates; update++)
+	{
+#if CC_TIME_TYPE_BYTES==4
+		scheduler.UpdateQuotas(10);
+#else
+		scheduler.UpdateQuotas(10000);
+#endif
+		unsigned int bytesThisUpdate=0;
+		InternalPacket *internalPacket;
+		while (bytesThisUpdate < bytesPerUpdate && (internalPacket=scheduler.Pop())!=0)
+		{
+			bytesThisUpdate+=BITS_TO_BYTES(internalPacket->dataBitLength);
+			bytesSent[internalPacket->orderingChannel]+=BITS_TO_BYTES(internalPacket->dataBitLength);
+			scheduler.Push(internalPacket, _FILE_AND_LINE_);
+		}
+	}
+	scheduler.Clear(_FILE_AND_LINE_);
+	delete [] messages;
+
+	double seconds=numUpdates/100.0;
+	*gameBytesPerSecond=bytesSent[0]/seconds;
+	*bulkBytesPerSecond=bytesSent[1]/seconds;
+}
+
+// Adapts OutgoingPacketScheduler to the calls the templates above make
+class SchedulerAdapter
+{
+public:
+	void Push(InternalPacket *internalPacket) {scheduler.Push(internalPacket, _FILE_AND_LINE_);}
+	InternalPacket *Pop(void) {return scheduler.Pop();}
+	unsigned int Size(void) const {return scheduler.Size();}
+	OutgoingPacketScheduler scheduler;
+};
+
+int main(int argc, char **argv)
+{
+	int maxQueueDepth=100000;
+	int numOperations=1000000;
+	if (argc>1)
+		maxQueueDepth=atoi(argv[1]);
+	if (argc>2)
+		numOperations=atoi(argv[2]);
+	if (maxQueueDepth<1)
+		maxQueueDepth=1;
+	if (numOperations<1)
+		numOperations=1;
+
+	printf("Compares the per-priority queues ReliabilityLayer uses to pick the next message\nto send against the heap they replaced\n");
+	printf("Difficulty: Intermediate\n\n");
+
+	InternalPacket *messages=CreateMessages(maxQueueDepth);
+
+	printf("Send one message and queue another, with messages of random priority waiting\n");
+	printf("  Waiting      Heap ns    Queues ns\n");
+	for (int queueDepth=10; ; queueDepth*=10)
+	{
+		if (queueDepth>maxQueueDepth)
+			queueDepth=maxQueueDepth;
+		HeapScheduler heapScheduler;
+		SchedulerAdapter queueScheduler;
+		double heapNS=NanosecondsPerSendAndQueue(heapScheduler, messages, queueDepth, numOperations);
+		double queueNS=NanosecondsPerSendAndQueue(queueScheduler, messages, queueDepth, numOperations);
+		printf("  %7i   %10.1f   %10.1f\n", queueDepth, heapNS, queueNS);
+		if (queueDepth==maxQueueDepth)
+			break;
+	}
+
+	printf("\nShare of sends for each priority, with all priorities waiting\n");
+	printf("              IMMEDIATE      HIGH    MEDIUM       LOW\n");
+	double heapShares[NUMBER_OF_PRIORITIES], queueShares[NUMBER_OF_PRIORITIES];
+	{
+		HeapScheduler heapScheduler;
+		SchedulerAdapter queueScheduler;
+		MeasureShares(heapScheduler, messages, 100000, heapShares);
+		MeasureShares(queueScheduler, messages, 100000, queueShares);
+	}
+	printf("  Heap     ");
+	for (int i=0; i < NUMBER_OF_PRIORITIES; i++)
+		printf("  %7.2f%%", heapShares[i]);
+	printf("\n  Queues   ");
+	for (int i=0; i < NUMBER_OF_PRIORITIES; i++)
+		printf("  %7.2f%%", queueShares[i]);
+	printf("\n");
+	delete [] messages;
+
+	printf("\nBulk and game channels at the same priority, 100000 bytes per second available\n");
+	printf("  Bulk quota   Bulk sent   Game sent   (bytes per second)\n");
+	const unsigned int quotas[3]={0, 50000, 10000};
+	for (int i=0; i < 3; i++)
+	{
+		double bulkBytesPerSecond, gameBytesPerSecond;
+		MeasureQuota(quotas[i], 1000, 1000, &bulkBytesPerSecond, &gameBytesPerSecond);
+		if (quotas[i]==0)
+			printf("  %10s", "none");
+		else
+			printf("  %10u", quotas[i]);
+		printf("  %10.0f  %10.0f\n", bulkBytesPerSecond, gameBytesPerSecond);
+	}
+	return 0;
+}
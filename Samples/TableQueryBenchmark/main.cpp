@@ -0,0 +1,178 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Times Table::QueryTable() against ColumnarTable::QueryTable() over a large table
+
+
+#include "DS_Table.h"
+#include "DS_ColumnarTable.h"
+#include "GetTime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace DataStructures;
+
+static unsigned int randomSeed=12345;
+static unsigned int NextRandom(void)
+{
+	randomSeed=randomSeed*1103515245+12345;
+	return randomSeed>>8;
+}
+
+struct BenchmarkQuery
+{
+	BenchmarkQuery() {numFilters=0; numColumnSubset=0;}
+	const char *description;
+	Table::FilterQuery filters[2];
+	unsigned numFilters;
+	unsigned columnSubset[2];
+	unsigned numColumnSubset;
+};
+
+static bool SameRows(Table &a, Table &b)
+{
+	if (a.GetRowCount()!=b.GetRowCount() || a.GetColumnCount()!=b.GetColumnCount())
+		return false;
+	DataStructures::Page<unsigned, Table::Row*, _TABLE_BPLUS_TREE_ORDER> *curA = a.GetListHead();
+	DataStructures::Page<unsigned, Table::Row*, _TABLE_BPLUS_TREE_ORDER> *curB = b.GetListHead();
+	while (curA && curB)
+	{
+		if (curA->size!=curB->size)
+			return false;
+		for (int i=0; i < curA->size; i++)
+		{
+			if (curA->keys[i]!=curB->keys[i])
+				return false;
+			for (unsigned j=0; j < a.GetColumnCount(); j++)
+			{
+				Table::Cell *cellA = curA->data[i]->cells[j];
+				Table::Cell *cellB = curB->data[i]->cells[j];
+				if (cellA->isEmpty!=cellB->isEmpty || cellA->i!=cellB->i)
+					return false;
+				if ((cellA->c==0)!=(cellB->c==0) || (cellA->c && strcmp(cellA->c, cellB->c)!=0))
+					return false;
+			}
+		}
+		curA=curA->next;
+		curB=curB->next;
+	}
+	return curA==0 && curB==0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned numRows=1000000;
+	unsigned numQueries=5;
+	if (argc>1)
+		numRows=atoi(argv[1]);
+	if (argc>2)
+		numQueries=atoi(argv[2]);
+
+	printf("Compares Table::QueryTable() with ColumnarTable::QueryTable()\n");
+	printf("Difficulty: Beginner\n\n");
+
+	Table table;
+	unsigned scoreColumn = table.AddColumn("score", Table::NUMERIC);
+	unsigned levelColumn = table.AddColumn("level", Table::NUMERIC);
+	unsigned nameColumn = table.AddColumn("name", Table::STRING);
+	unsigned guildColumn = table.AddColumn("guild", Table::STRING);
+
+	printf("Filling table with %u rows... ", numRows);
+	RakNet::TimeUS startTime = RakNet::GetTimeUS();
+	char name[64];
+	for (unsigned rowId=0; rowId < numRows; rowId++)
+	{
+		Table::Row *row = table.AddRow(rowId);
+		row->UpdateCell(scoreColumn, (double) (NextRandom()%100000));
+		row->UpdateCell(levelColumn, (double) (NextRandom()%50));
+		sprintf(name, "player_%u", rowId);
+		row->UpdateCell(nameColumn, name);
+		// Most players are not in a guild
+		if (NextRandom()%4==0)
+		{
+			sprintf(name, "guild_%u", NextRandom()%1000);
+			row->UpdateCell(guildColumn, name);
+		}
+	}
+	printf("%.1f ms\n", (RakNet::GetTimeUS()-startTime)/1000.0);
+
+	ColumnarTable columnarTable;
+	startTime = RakNet::GetTimeUS();
+	columnarTable.Build(table);
+	printf("ColumnarTable::Build() %.1f ms\n\n", (RakNet::GetTimeUS()-startTime)/1000.0);
+
+	Table::Cell highScore, level, playerName, guildName;
+	highScore.Set(95000);
+	level.Set(7);
+	sprintf(name, "player_%u", numRows/2);
+	playerName.Set(name);
+	guildName.Set("guild_500");
+
+	BenchmarkQuery queries[5];
+	queries[0].description="score > 95000";
+	queries[0].filters[0]=Table::FilterQuery(scoreColumn, &highScore, Table::QF_GREATER_THAN);
+	queries[0].numFilters=1;
+	queries[1].description="level == 7 && score >= 95000, 2 columns";
+	queries[1].filters[0]=Table::FilterQuery(levelColumn, &level, Table::QF_EQUAL);
+	queries[1].filters[1]=Table::FilterQuery(scoreColumn, &highScore, Table::QF_GREATER_THAN_EQ);
+	queries[1].numFilters=2;
+	queries[1].columnSubset[0]=nameColumn;
+	queries[1].columnSubset[1]=scoreColumn;
+	queries[1].numColumnSubset=2;
+	queries[2].description="name == one player";
+	queries[2].filters[0]=Table::FilterQuery(nameColumn, &playerName, Table::QF_EQUAL);
+	queries[2].numFilters=1;
+	queries[3].description="guild == guild_500";
+	queries[3].filters[0]=Table::FilterQuery(guildColumn, &guildName, Table::QF_EQUAL);
+	queries[3].numFilters=1;
+	queries[4].description="guild empty && level < 7, 1 column";
+	queries[4].filters[0]=Table::FilterQuery(guildColumn, &guildName, Table::QF_IS_EMPTY);
+	queries[4].filters[1]=Table::FilterQuery(levelColumn, &level, Table::QF_LESS_THAN);
+	queries[4].numFilters=2;
+	queries[4].columnSubset[0]=nameColumn;
+	queries[4].numColumnSubset=1;
+
+	bool allMatched=true;
+	for (unsigned q=0; q < sizeof(queries)/sizeof(queries[0]); q++)
+	{
+		BenchmarkQuery &query = queries[q];
+		unsigned *columnSubset = query.numColumnSubset ? query.columnSubset : 0;
+		Table rowResult, columnarResult;
+
+		startTime = RakNet::GetTimeUS();
+		for (unsigned i=0; i < numQueries; i++)
+			table.QueryTable(columnSubset, query.numColumnSubset, query.filters, query.numFilters, 0, 0, &rowResult);
+		RakNet::TimeUS rowTime = (RakNet::GetTimeUS()-startTime)/numQueries;
+
+		startTime = RakNet::GetTimeUS();
+		for (unsigned i=0; i < numQueries; i++)
+			columnarTable.QueryTable(columnSubset, query.numColumnSubset, query.filters, query.numFilters, 0, 0, &columnarResult);
+		RakNet::TimeUS columnarTime = (RakNet::GetTimeUS()-startTime)/numQueries;
+
+		// Filtering alone, without copying the rows into a Table
+		DataStructures::List<unsigned> rowIndices;
+		startTime = RakNet::GetTimeUS();
+		for (unsigned i=0; i < numQueries; i++)
+			columnarTable.QueryRowIndices(query.filters, query.numFilters, 0, 0, rowIndices);
+		RakNet::TimeUS filterTime = (RakNet::GetTimeUS()-startTime)/numQueries;
+
+		bool matched = SameRows(rowResult, columnarResult) && rowIndices.Size()==rowResult.GetRowCount();
+		allMatched = allMatched && matched;
+		printf("%s: %u rows\n", query.description, rowResult.GetRowCount());
+		printf("  Table %.2f ms, ColumnarTable %.2f ms (%.1fx), filter only %.2f ms %s\n",
+			rowTime/1000.0, columnarTime/1000.0, columnarTime ? (double) rowTime/columnarTime : 0.0, filterTime/1000.0,
+			matched ? "" : "RESULTS DIFFER");
+	}
+
+	printf("\n%s\n", allMatched ? "All results matched." : "Results did not match.");
+	return allMatched ? 0 : 1;
+}
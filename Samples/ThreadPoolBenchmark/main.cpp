@@ -0,0 +1,125 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Measures how many tasks per second ThreadPool runs and returns, with tasks of equal and of uneven cost, and how long one task takes to come back when the threads are idle
+
+
+#include "ThreadPool.h"
+#include "GetTime.h"
+#include "RakSleep.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace RakNet;
+
+struct Task
+{
+	unsigned int index;
+	// Iterations of busy work
+	unsigned int cost;
+};
+
+static Task RunTask(Task task, bool *returnOutput, void* perThreadData)
+{
+	(void) perThreadData;
+	volatile unsigned int sum=0;
+	for (unsigned int i=0; i < task.cost; i++)
+		sum+=i;
+	*returnOutput=true;
+	return task;
+}
+
+// Adds numTasks tasks at once and waits for all the output. Every unevenEvery'th task costs unevenCost rather than cost. Returns tasks per second, or 0 if output was missing or repeated
+static double Throughput(ThreadPool<Task,Task> *threadPool, unsigned int numTasks, unsigned int cost, unsigned int unevenEvery, unsigned int unevenCost)
+{
+	unsigned char *seen = (unsigned char*) calloc(numTasks, 1);
+	RakNet::TimeUS startTime=RakNet::GetTimeUS();
+	for (unsigned int i=0; i < numTasks; i++)
+	{
+		Task task;
+		task.index=i;
+		task.cost = unevenEvery!=0 && (i%unevenEvery)==0 ? unevenCost : cost;
+		threadPool->AddInput(RunTask, task);
+	}
+	unsigned int received=0;
+	bool valid=true;
+	while (received < numTasks)
+	{
+		if (threadPool->HasOutputFast() && threadPool->HasOutput())
+		{
+			Task task=threadPool->GetOutput();
+			if (task.index>=numTasks || seen[task.index])
+				valid=false;
+			else
+				seen[task.index]=1;
+			received++;
+		}
+		else
+			RakSleep(0);
+	}
+	double seconds=(RakNet::GetTimeUS()-startTime)/1000000.0;
+	free(seen);
+	return valid ? numTasks/seconds : 0.0;
+}
+
+// Adds one task at a time and waits for it, so each finds the threads waiting for input. Returns microseconds per task
+static double RoundTrip(ThreadPool<Task,Task> *threadPool, unsigned int numTasks)
+{
+	RakNet::TimeUS startTime=RakNet::GetTimeUS();
+	for (unsigned int i=0; i < numTasks; i++)
+	{
+		Task task;
+		task.index=i;
+		task.cost=0;
+		threadPool->AddInput(RunTask, task);
+		while ((threadPool->HasOutputFast() && threadPool->HasOutput())==false)
+			RakSleep(0);
+		threadPool->GetOutput();
+	}
+	return (double) (RakNet::GetTimeUS()-startTime)/numTasks;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int numTasks=200000;
+	if (argc>1)
+		numTasks=atoi(argv[1]);
+	if (numTasks<1)
+		numTasks=1;
+	int maxThreads=8;
+	if (argc>2)
+		maxThreads=atoi(argv[2]);
+	if (maxThreads<1)
+		maxThreads=1;
+
+	printf("Measures how many tasks per second ThreadPool runs and returns, with tasks of\nequal and of uneven cost, and how long one task takes to come back when the\nthreads are idle\n");
+	printf("Difficulty: Intermediate\n\n");
+
+	printf("%u tasks added at once for each run, in tasks per second\n", numTasks);
+	printf("  Threads        Empty     100 iterations     Uneven (1 in 16 costs 100x)     Round trip\n");
+	for (int numThreads=1; numThreads <= maxThreads; numThreads*=2)
+	{
+		ThreadPool<Task,Task> threadPool;
+		threadPool.StartThreads(numThreads, 0);
+		double empty=Throughput(&threadPool, numTasks, 0, 0, 0);
+		double even=Throughput(&threadPool, numTasks, 100, 0, 0);
+		double uneven=Throughput(&threadPool, numTasks/10, 100, 16, 10000);
+		double roundTrip=RoundTrip(&threadPool, numTasks < 10000 ? numTasks : 10000);
+		threadPool.StopThreads();
+		if (empty==0.0 || even==0.0 || uneven==0.0)
+		{
+			printf("Output was missing or repeated with %i threads\n", numThreads);
+			return 1;
+		}
+		printf("  %7i %12.0f %18.0f %31.0f %11.1f us\n", numThreads, empty, even, uneven, roundTrip);
+	}
+	return 0;
+}
@@ -0,0 +1,275 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file
+/// \brief Compares VariableDeltaSerializer per variable against bulk mode, for replicas with many variables sent to many systems
+
+
+#include "VariableDeltaSerializer.h"
+#include "RakMemoryOverride.h"
+#include "Rand.h"
+#include "GetTime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace RakNet;
+
+// Tracks bytes held through rakMalloc_Ex(), which holds the copies of what was last sent
+static size_t bytesHeld=0;
+static void *CountingMalloc_Ex(size_t size, const char *file, unsigned int line)
+{
+	(void) file;
+	(void) line;
+	size_t *p=(size_t*) malloc(size+sizeof(size_t)*2);
+	p[0]=size;
+	bytesHeld+=size;
+	return p+2;
+}
+static void *CountingRealloc_Ex(void *p, size_t size, const char *file, unsigned int line)
+{
+	(void) file;
+	(void) line;
+	if (p==0)
+		return CountingMalloc_Ex(size, file, line);
+	size_t *header=((size_t*) p)-2;
+	bytesHeld-=header[0];
+	header=(size_t*) realloc(header, size+sizeof(size_t)*2);
+	header[0]=size;
+	bytesHeld+=size;
+	return header+2;
+}
+static void CountingFree_Ex(void *p, const char *file, unsigned int line)
+{
+	(void) file;
+	(void) line;
+	if (p==0)
+		return;
+	size_t *header=((size_t*) p)-2;
+	bytesHeld-=header[0];
+	free(header);
+}
+
+// A replica with numVariables variables, alternating floats and integers
+struct Replica
+{
+	float *floats;
+	uint32_t *integers;
+	int numVariables;
+
+	void Init(int _numVariables)
+	{
+		numVariables=_numVariables;
+		floats=new float[numVariables/2+1];
+		integers=new uint32_t[numVariables/2+1];
+		memset(floats, 0, sizeof(float)*(numVariables/2+1));
+		memset(integers, 0, sizeof(uint32_t)*(numVariables/2+1));
+	}
+	void Deinit(void)
+	{
+		delete [] floats;
+		delete [] integers;
+	}
+	void Change(RakNetRandom *random, int changePercent)
+	{
+		for (int i=0; i < numVariables; i++)
+		{
+			if ((int) (random->RandomMT()%100) >= changePercent)
+				continue;
+			if (i&1)
+				integers[i/2]++;
+			else
+				floats[i/2]+=1.0f;
+		}
+	}
+	void SerializeVariables(VariableDeltaSerializer *serializer, VariableDeltaSerializer::SerializationContext *context)
+	{
+		for (int i=0; i < numVariables; i++)
+		{
+			if (i&1)
+				serializer->SerializeVariable(context, integers[i/2]);
+			else
+				serializer->SerializeVariable(context, floats[i/2]);
+		}
+	}
+	void DeserializeVariables(VariableDeltaSerializer *serializer, VariableDeltaSerializer::DeserializationContext *context)
+	{
+		for (int i=0; i < numVariables; i++)
+		{
+			if (i&1)
+				serializer->DeserializeVariable(context, integers[i/2]);
+			else
+				serializer->DeserializeVariable(context, floats[i/2]);
+		}
+	}
+	void WriteSnapshot(BitStream *snapshot)
+	{
+		snapshot->Reset();
+		for (int i=0; i < numVariables; i++)
+		{
+			if (i&1)
+				snapshot->Write(integers[i/2]);
+			else
+				snapshot->Write(floats[i/2]);
+		}
+	}
+	void ReadSnapshot(BitStream *snapshot)
+	{
+		snapshot->ResetReadPointer();
+		for (int i=0; i < numVariables; i++)
+		{
+			if (i&1)
+				snapshot->Read(integers[i/2]);
+			else
+				snapshot->Read(floats[i/2]);
+		}
+	}
+	bool Equals(const Replica &other) const
+	{
+		return memcmp(floats, other.floats, sizeof(float)*(numVariables/2+1))==0 &&
+			memcmp(integers, other.integers, sizeof(uint32_t)*(numVariables/2+1))==0;
+	}
+};
+
+struct RunResult
+{
+	double microsecondsPerTick;
+	double bytesPerSend;
+	size_t bytesHeld;
+	int numMismatches;
+};
+
+// Sends one replica to numReceivers systems with BeginUnreliableAckedSerialize() for numTicks ticks, then one more tick without loss, and checks every receiver ended up with the same values
+static void Run(bool bulkMode, int numVariables, int numReceivers, int numTicks, int changePercent, int lossPercent, RunResult *result)
+{
+	RakNetRandom random;
+	random.SeedMT(numVariables*31+numReceivers);
+	size_t bytesHeldBefore=bytesHeld;
+	VariableDeltaSerializer *serializer=new VariableDeltaSerializer;
+	Replica sender;
+	sender.Init(numVariables);
+	Replica *receivers=new Replica[numReceivers];
+	BitStream *receiverSnapshots=new BitStream[numReceivers];
+	BitStream *sends=new BitStream[numReceivers];
+	int i;
+	for (i=0; i < numReceivers; i++)
+		receivers[i].Init(numVariables);
+	BitStream snapshot;
+	uint32_t sendReceipt=0;
+	TimeUS serializeTime=0;
+	double bytesSent=0;
+	int numSends=0;
+
+	for (int tick=0; tick <= numTicks; tick++)
+	{
+		bool lastTick = tick==numTicks;
+		if (lastTick==false)
+			sender.Change(&random, changePercent);
+
+		TimeUS startTime=GetTimeUS();
+		serializer->OnPreSerializeTick();
+		if (bulkMode)
+			sender.WriteSnapshot(&snapshot);
+		for (i=0; i < numReceivers; i++)
+		{
+			VariableDeltaSerializer::SerializationContext context;
+			sends[i].Reset();
+			serializer->BeginUnreliableAckedSerialize(&context, RakNetGUID(i+1), &sends[i], sendReceipt+i);
+			if (bulkMode)
+				serializer->SerializeSnapshot(&context, &snapshot);
+			else
+				sender.SerializeVariables(serializer, &context);
+			serializer->EndSerialize(&context);
+		}
+		serializeTime+=GetTimeUS()-startTime;
+
+		for (i=0; i < numReceivers; i++)
+		{
+			bytesSent+=sends[i].GetNumberOfBytesUsed();
+			numSends++;
+			bool lost = lastTick==false && (int) (random.RandomMT()%100) < lossPercent;
+			serializer->OnMessageReceipt(RakNetGUID(i+1), sendReceipt+i, lost==false);
+			if (lost || sends[i].GetNumberOfBitsUsed()==0)
+				continue;
+			VariableDeltaSerializer::DeserializationContext context;
+			serializer->BeginDeserialize(&context, &sends[i]);
+			if (bulkMode)
+			{
+				if (serializer->DeserializeSnapshot(&context, &receiverSnapshots[i]))
+					receivers[i].ReadSnapshot(&receiverSnapshots[i]);
+			}
+			else
+				receivers[i].DeserializeVariables(serializer, &context);
+			serializer->EndDeserialize(&context);
+		}
+		sendReceipt+=numReceivers;
+	}
+
+	// Only what the serializer holds
+	delete [] receiverSnapshots;
+	delete [] sends;
+	result->bytesHeld=bytesHeld-bytesHeldBefore;
+	result->microsecondsPerTick=(double) serializeTime/(numTicks+1);
+	result->bytesPerSend=bytesSent/numSends;
+	result->numMismatches=0;
+	for (i=0; i < numReceivers; i++)
+	{
+		if (receivers[i].Equals(sender)==false)
+			result->numMismatches++;
+		receivers[i].Deinit();
+	}
+	sender.Deinit();
+	delete [] receivers;
+	delete serializer;
+}
+
+int main(int argc, char **argv)
+{
+	int numTicks=200;
+	int changePercent=5;
+	int lossPercent=2;
+	if (argc>1)
+		numTicks=atoi(argv[1]);
+	if (argc>2)
+		changePercent=atoi(argv[2]);
+	if (argc>3)
+		lossPercent=atoi(argv[3]);
+	if (numTicks<1)
+		numTicks=1;
+
+	printf("Compares VariableDeltaSerializer per variable against bulk mode, for replicas\nwith many variables sent to many systems\n");
+	printf("Difficulty: Intermediate\n\n");
+
+	SetMalloc_Ex(CountingMalloc_Ex);
+	SetRealloc_Ex(CountingRealloc_Ex);
+	SetFree_Ex(CountingFree_Ex);
+
+	printf("%i ticks, %i%% of variables changed per tick, %i%% of sends lost\n", numTicks, changePercent, lossPercent);
+	printf("Per variable sends at most 448 variables with BeginUnreliableAckedSerialize()\n\n");
+	printf("  Variables  Receivers  Mode           us/tick   bytes/send   bytes held   Mismatches\n");
+	const int variableCounts[4]={64, 256, 448, 4096};
+	const int receiverCounts[3]={1, 16, 64};
+	for (int v=0; v < 4; v++)
+	{
+		for (int r=0; r < 3; r++)
+		{
+			for (int bulkMode=0; bulkMode < 2; bulkMode++)
+			{
+				if (bulkMode==0 && variableCounts[v]>448)
+					continue;
+				RunResult result;
+				Run(bulkMode==1, variableCounts[v], receiverCounts[r], numTicks, changePercent, lossPercent, &result);
+				printf("  %9i  %9i  %-12s %9.1f   %10.1f   %10u   %10i\n", variableCounts[v], receiverCounts[r], bulkMode ? "Bulk" : "Per variable",
+					result.microsecondsPerTick, result.bytesPerSend, (unsigned int) result.bytesHeld, result.numMismatches);
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,471 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "BanList.h"
+#include "RakMemoryOverride.h"
+#include "RakAssert.h"
+#include "RakSleep.h"
+#include "WindowsIncludes.h"
+#include <string.h>
+
+using namespace RakNet;
+
+// Slots in a new table
+static const uint32_t INITIAL_TABLE_SIZE=64;
+
+// Orders the writes before this call before any reads or writes after it, on this thread
+static inline void FullMemoryBarrier(void)
+{
+#if defined(_WIN32)
+	MemoryBarrier();
+#elif defined(__GNUC__)
+	__sync_synchronize();
+#endif
+}
+
+static inline uint32_t HashRange(uint32_t prefix, uint32_t prefixLength)
+{
+	uint32_t x = prefix * 2654435761u ^ prefixLength * 0x27d4eb2du;
+	x ^= x >> 15;
+	x *= 0x2c1b3c6du;
+	x ^= x >> 12;
+	return x;
+}
+
+BanList::BanList()
+{
+	rangeTable=AllocateTable(INITIAL_TABLE_SIZE);
+	readEpoch=0;
+	numPatternBans=0;
+}
+BanList::~BanList()
+{
+	Clear();
+	FreeTable(rangeTable);
+}
+void BanList::Add(const char *IP, RakNet::TimeMS timeout)
+{
+	uint32_t prefix, prefixLength;
+
+	if ( IP == 0 || IP[ 0 ] == 0 )
+		return;
+
+	if (ParseRange(IP, &prefix, &prefixLength))
+	{
+		mutex.Lock();
+		RangeBan *rangeBan = FindRange(rangeTable, prefix, prefixLength);
+		if (rangeBan)
+		{
+			// Already in the ban list.  Just update the time
+			rangeBan->timeout=timeout;
+		}
+		else
+		{
+			// Keep the table at most three quarters full, counting removed entries, so lookups always reach an empty slot quickly
+			if ((rangeTable->numUsedOrRemoved+1)*4 > (rangeTable->mask+1)*3)
+			{
+				uint32_t numSlots=rangeTable->mask+1;
+				if ((rangeTable->numBans+1)*2 > numSlots)
+					numSlots*=2;
+				RangeTable *newTable = AllocateTable(numSlots);
+				for (uint32_t i=0; i <= rangeTable->mask; i++)
+				{
+					if (rangeTable->bans[i].state==RangeBan::USED)
+						InsertRange(newTable, rangeTable->bans[i].prefix, rangeTable->bans[i].prefixLength, rangeTable->bans[i].timeout);
+				}
+				ReplaceTable(newTable);
+			}
+			InsertRange(rangeTable, prefix, prefixLength, timeout);
+		}
+		mutex.Unlock();
+		return;
+	}
+
+	if ( strlen( IP ) > 15 )
+		return;
+
+	mutex.Lock();
+	unsigned index;
+	for (index=0; index < patternBans.Size(); index++)
+	{
+		if ( strcmp( IP, patternBans[ index ].IP ) == 0 )
+		{
+			// Already in the ban list.  Just update the time
+			patternBans[ index ].timeout=timeout;
+			mutex.Unlock();
+			return;
+		}
+	}
+	PatternBan patternBan;
+	patternBan.IP = (char*) rakMalloc_Ex( 16, _FILE_AND_LINE_ );
+	strcpy( patternBan.IP, IP );
+	patternBan.timeout=timeout;
+	patternBans.Insert( patternBan, _FILE_AND_LINE_ );
+	numPatternBans=patternBans.Size();
+	mutex.Unlock();
+}
+void BanList::Remove(const char *IP)
+{
+	uint32_t prefix, prefixLength;
+
+	if ( IP == 0 || IP[ 0 ] == 0 )
+		return;
+
+	mutex.Lock();
+	if (ParseRange(IP, &prefix, &prefixLength))
+	{
+		RangeBan *rangeBan = FindRange(rangeTable, prefix, prefixLength);
+		if (rangeBan)
+		{
+			rangeBan->state=RangeBan::REMOVED;
+			rangeTable->numBans--;
+		}
+	}
+	else
+	{
+		unsigned index;
+		for (index=0; index < patternBans.Size(); index++)
+		{
+			if ( strcmp( IP, patternBans[ index ].IP ) == 0 )
+			{
+				rakFree_Ex(patternBans[ index ].IP, _FILE_AND_LINE_ );
+				patternBans.RemoveAtIndexFast(index);
+				numPatternBans=patternBans.Size();
+				break;
+			}
+		}
+	}
+	mutex.Unlock();
+}
+void BanList::Clear(void)
+{
+	mutex.Lock();
+	ReplaceTable(AllocateTable(INITIAL_TABLE_SIZE));
+	for (unsigned index=0; index < patternBans.Size(); index++)
+		rakFree_Ex(patternBans[ index ].IP, _FILE_AND_LINE_ );
+	patternBans.Clear(false, _FILE_AND_LINE_);
+	numPatternBans=0;
+	mutex.Unlock();
+}
+bool BanList::IsBanned(const char *IP, RakNet::TimeMS time)
+{
+	uint32_t address, prefixLength;
+
+	if ( IP == 0 || IP[ 0 ] == 0 || strlen( IP ) > 15 )
+		return false;
+
+	if (ParseRange(IP, &address, &prefixLength) && prefixLength==32 && IsRangeBanned(address, time))
+		return true;
+
+	return IsPatternBanned(IP, time);
+}
+bool BanList::IsBanned(const SystemAddress &systemAddress, RakNet::TimeMS time)
+{
+	if (systemAddress.GetIPVersion()==4)
+	{
+		const unsigned char *bytes = (const unsigned char *) &systemAddress.address.addr4.sin_addr.s_addr;
+		uint32_t address = ((uint32_t) bytes[0] << 24) | ((uint32_t) bytes[1] << 16) | ((uint32_t) bytes[2] << 8) | (uint32_t) bytes[3];
+		if (IsRangeBanned(address, time))
+			return true;
+	}
+
+	// Skip formatting the address if possible
+	if (numPatternBans==0)
+		return false;
+
+	char str[64];
+	systemAddress.ToString(false, str);
+	if ( strlen( str ) > 15 )
+		return false;
+	return IsPatternBanned(str, time);
+}
+unsigned int BanList::Size(void) const
+{
+	return rangeTable->numBans + numPatternBans;
+}
+bool BanList::ParseRange(const char *IP, uint32_t *prefix, uint32_t *prefixLength)
+{
+	// Accepts a.b.c.d, a.b.c.d/n, and a, a.b, or a.b.c followed by .*, as well as * alone.
+	// Octets must be written the way SystemAddress::ToString writes them, since anything else never matched an address as a string either.
+	uint32_t value=0, numOctets=0;
+	const char *c = IP;
+	for (;;)
+	{
+		if (c[0]=='*' && c[1]==0)
+		{
+			if (numOctets==4)
+				return false;
+			*prefixLength=numOctets*8;
+			*prefix=numOctets==0 ? 0 : value << (32-numOctets*8);
+			return true;
+		}
+
+		if (c[0]<'0' || c[0]>'9' || (c[0]=='0' && c[1]>='0' && c[1]<='9'))
+			return false;
+		uint32_t octet=0;
+		int numDigits=0;
+		while (c[0]>='0' && c[0]<='9' && numDigits < 4)
+		{
+			octet=octet*10+(c[0]-'0');
+			c++;
+			numDigits++;
+		}
+		if (octet>255 || numDigits>3)
+			return false;
+		value=(value<<8)|octet;
+		numOctets++;
+
+		if (c[0]=='.')
+		{
+			if (numOctets==4)
+				return false;
+			c++;
+		}
+		else if (c[0]==0)
+		{
+			if (numOctets!=4)
+				return false;
+			*prefix=value;
+			*prefixLength=32;
+			return true;
+		}
+		else if (c[0]=='/')
+		{
+			c++;
+			if (numOctets!=4 || c[0]<'0' || c[0]>'9' || (c[0]=='0' && c[1]!=0))
+				return false;
+			uint32_t bits=0;
+			while (c[0]>='0' && c[0]<='9' && bits<=32)
+			{
+				bits=bits*10+(c[0]-'0');
+				c++;
+			}
+			if (c[0]!=0 || bits>32)
+				return false;
+			*prefixLength=bits;
+			*prefix=bits==0 ? 0 : value & (0xFFFFFFFFu << (32-bits));
+			return true;
+		}
+		else
+			return false;
+	}
+}
+BanList::RangeTable *BanList::AllocateTable(uint32_t numSlots)
+{
+	RangeTable *table = RakNet::OP_NEW<RangeTable>(_FILE_AND_LINE_);
+	table->bans = RakNet::OP_NEW_ARRAY<RangeBan>(numSlots, _FILE_AND_LINE_);
+	for (uint32_t i=0; i < numSlots; i++)
+		table->bans[i].state=RangeBan::EMPTY;
+	table->mask=numSlots-1;
+	table->numUsedOrRemoved=0;
+	table->numBans=0;
+	table->prefixLengths=0;
+	table->prefixLength32=false;
+	return table;
+}
+void BanList::FreeTable(RangeTable *table)
+{
+	RakNet::OP_DELETE_ARRAY(table->bans, _FILE_AND_LINE_);
+	RakNet::OP_DELETE(table, _FILE_AND_LINE_);
+}
+BanList::RangeBan *BanList::FindRange(RangeTable *table, uint32_t prefix, uint32_t prefixLength)
+{
+	uint32_t slot=HashRange(prefix, prefixLength) & table->mask;
+	for (;;)
+	{
+		RangeBan *rangeBan = table->bans+slot;
+		uint32_t state = rangeBan->state;
+		if (state==RangeBan::EMPTY)
+			return 0;
+		if (state==RangeBan::USED && rangeBan->prefix==prefix && rangeBan->prefixLength==prefixLength)
+			return rangeBan;
+		slot=(slot+1) & table->mask;
+	}
+}
+void BanList::InsertRange(RangeTable *table, uint32_t prefix, uint32_t prefixLength, RakNet::TimeMS timeout)
+{
+	uint32_t slot=HashRange(prefix, prefixLength) & table->mask;
+	while (table->bans[slot].state==RangeBan::USED)
+		slot=(slot+1) & table->mask;
+
+	RangeBan *rangeBan = table->bans+slot;
+	if (rangeBan->state==RangeBan::EMPTY)
+		table->numUsedOrRemoved++;
+	rangeBan->prefix=prefix;
+	rangeBan->prefixLength=prefixLength;
+	rangeBan->timeout=timeout;
+	if (prefixLength==32)
+		table->prefixLength32=true;
+	else
+		table->prefixLengths|=1u<<prefixLength;
+	// Publish the entry only once it is complete
+	FullMemoryBarrier();
+	rangeBan->state=RangeBan::USED;
+	table->numBans++;
+}
+void BanList::ReplaceTable(RangeTable *newTable)
+{
+	RangeTable *oldTable = rangeTable;
+	rangeTable=newTable;
+	FullMemoryBarrier();
+
+	// Lookups from here on are counted against the new epoch, and read the new table.
+	// Lookups from before the previous epoch finished before the last replacement returned, so only those counted against the previous epoch can still be reading the old table.
+	// No new lookups join that count, so this wait ends even while lookups never stop
+	uint32_t previousEpoch=readEpoch;
+	readEpoch=previousEpoch+1;
+	FullMemoryBarrier();
+	while (activeReaders[previousEpoch&1].GetValue()!=0)
+		RakSleep(0);
+	FreeTable(oldTable);
+}
+bool BanList::IsRangeBanned(uint32_t address, RakNet::TimeMS time)
+{
+	bool banned=false, hasExpiredBan=false;
+	RangeBan *rangeBan;
+
+	// Count this lookup against the current epoch. If the epoch changed meanwhile, ReplaceTable() may not be waiting for that count, so count it again
+	uint32_t epoch;
+	for (;;)
+	{
+		epoch=readEpoch;
+		activeReaders[epoch&1].Increment();
+		if (readEpoch==epoch)
+			break;
+		activeReaders[epoch&1].Decrement();
+	}
+	RangeTable *table = rangeTable;
+	if (table->numBans>0)
+	{
+		if (table->prefixLength32)
+		{
+			rangeBan=FindRange(table, address, 32);
+			if (rangeBan)
+			{
+				if (rangeBan->timeout>0 && rangeBan->timeout<time)
+					hasExpiredBan=true;
+				else
+					banned=true;
+			}
+		}
+
+		uint32_t prefixLengths=table->prefixLengths;
+		for (int prefixLength=31; banned==false && prefixLengths!=0 && prefixLength >= 0; prefixLength--)
+		{
+			if ((prefixLengths & (1u<<prefixLength))==0)
+				continue;
+			prefixLengths&=~(1u<<prefixLength);
+			uint32_t prefix = prefixLength==0 ? 0 : address & (0xFFFFFFFFu << (32-prefixLength));
+			rangeBan=FindRange(table, prefix, prefixLength);
+			if (rangeBan)
+			{
+				if (rangeBan->timeout>0 && rangeBan->timeout<time)
+					hasExpiredBan=true;
+				else
+					banned=true;
+			}
+		}
+	}
+	activeReaders[epoch&1].Decrement();
+
+	if (hasExpiredBan)
+		RemoveExpiredRanges(time);
+	return banned;
+}
+bool BanList::IsPatternBanned(const char *IP, RakNet::TimeMS time)
+{
+	unsigned banListIndex, characterIndex;
+
+	if ( numPatternBans == 0 )
+		return false; // Skip the mutex if possible
+
+	banListIndex = 0;
+
+	mutex.Lock();
+
+	while ( banListIndex < patternBans.Size() )
+	{
+		if (patternBans[ banListIndex ].timeout>0 && patternBans[ banListIndex ].timeout<time)
+		{
+			// Delete expired ban
+			rakFree_Ex(patternBans[ banListIndex ].IP, _FILE_AND_LINE_ );
+			patternBans.RemoveAtIndexFast( banListIndex );
+			numPatternBans=patternBans.Size();
+		}
+		else
+		{
+			const char *banIP = patternBans[ banListIndex ].IP;
+			characterIndex = 0;
+
+#ifdef _MSC_VER
+#pragma warning( disable : 4127 ) // warning C4127: conditional expression is constant
+#endif
+			while ( true )
+			{
+				if ( banIP[ characterIndex ] == IP[ characterIndex ] )
+				{
+					// Equal characters
+
+					if ( IP[ characterIndex ] == 0 )
+					{
+						mutex.Unlock();
+						// End of the string and the strings match
+
+						return true;
+					}
+
+					characterIndex++;
+				}
+
+				else
+				{
+					if ( banIP[ characterIndex ] == 0 || IP[ characterIndex ] == 0 )
+					{
+						// End of one of the strings
+						break;
+					}
+
+					// Characters do not match
+					if ( banIP[ characterIndex ] == '*' )
+					{
+						mutex.Unlock();
+
+						// Domain is banned.
+						return true;
+					}
+
+					// Characters do not match and it is not a *
+					break;
+				}
+			}
+
+			banListIndex++;
+		}
+	}
+
+	mutex.Unlock();
+
+	// No match found.
+	return false;
+}
+void BanList::RemoveExpiredRanges(RakNet::TimeMS time)
+{
+	mutex.Lock();
+	for (uint32_t i=0; i <= rangeTable->mask; i++)
+	{
+		RangeBan *rangeBan = rangeTable->bans+i;
+		if (rangeBan->state==RangeBan::USED && rangeBan->timeout>0 && rangeBan->timeout<time)
+		{
+			rangeBan->state=RangeBan::REMOVED;
+			rangeTable->numBans--;
+		}
+	}
+	mutex.Unlock();
+}
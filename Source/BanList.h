@@ -0,0 +1,117 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file BanList.h
+/// \internal
+/// \brief IP ban list used by RakPeer
+///
+
+
+#ifndef __BAN_LIST_H
+#define __BAN_LIST_H
+
+#include "Export.h"
+#include "NativeTypes.h"
+#include "RakNetTime.h"
+#include "RakNetTypes.h"
+#include "SimpleMutex.h"
+#include "LocklessTypes.h"
+#include "DS_List.h"
+
+namespace RakNet
+{
+/// \internal
+/// \brief IP ban list with lookups that do not lock
+/// \details IPv4 bans that cover whole octets, such as 128.0.0.5, 128.0.0.*, or 10.0.0.0/8 in CIDR notation, are kept in one open addressing hash table keyed by prefix and prefix length.<BR>
+/// A lookup probes once for each prefix length in use, so the cost does not depend on how many IPs are banned.<BR>
+/// IsBanned() does not lock. Changes are written in place, and the table is only replaced when it has to grow. Each lookup is counted against the epoch it started in. Replacing the table starts a new epoch, and the old table is freed once the lookups counted against the previous epoch have finished, which later lookups cannot delay.<BR>
+/// Patterns with * inside an octet, such as 12*, and addresses that are not IPv4, are checked one at a time under a mutex, the same as RakPeer always did. Lookups only take the mutex if there are such patterns.
+class RAK_DLL_EXPORT BanList
+{
+public:
+	BanList();
+	~BanList();
+
+	/// \brief Adds a ban, or changes the timeout of an existing ban
+	/// \param[in] IP Dotted IP address. Can end in * as a wildcard, such as 128.0.0.*, or be in CIDR notation, such as 128.0.0.0/24
+	/// \param[in] timeout Time at which the ban ends, or 0 for a permanent ban
+	void Add(const char *IP, RakNet::TimeMS timeout);
+
+	/// \brief Removes a ban
+	/// \param[in] IP The same string passed to Add(), or another string for the same range
+	void Remove(const char *IP);
+
+	/// Removes all bans
+	void Clear(void);
+
+	/// \param[in] IP Complete dotted IP address
+	/// \param[in] time The current time. Bans with a timeout before this are removed.
+	/// \return true if any ban matches \a IP
+	bool IsBanned(const char *IP, RakNet::TimeMS time);
+
+	/// \brief Same as IsBanned(const char*, RakNet::TimeMS), without converting IPv4 addresses to a string
+	bool IsBanned(const SystemAddress &systemAddress, RakNet::TimeMS time);
+
+	/// \return How many bans have been added
+	unsigned int Size(void) const;
+
+protected:
+	struct RangeBan
+	{
+		enum {EMPTY, USED, REMOVED};
+		// Written last when adding, so a lookup in progress either sees the whole entry or none of it
+		volatile uint32_t state;
+		uint32_t prefix;
+		uint32_t prefixLength;
+		RakNet::TimeMS timeout;
+	};
+	struct RangeTable
+	{
+		RangeBan *bans;
+		uint32_t mask;
+		// Entries not EMPTY, including REMOVED ones, which still lengthen probe sequences
+		uint32_t numUsedOrRemoved;
+		uint32_t numBans;
+		// Bit n set if a ban with prefix length n was added. Bit 32 is in prefixLength32.
+		uint32_t prefixLengths;
+		bool prefixLength32;
+	};
+	struct PatternBan
+	{
+		char *IP;
+		RakNet::TimeMS timeout;
+	};
+
+	static bool ParseRange(const char *IP, uint32_t *prefix, uint32_t *prefixLength);
+	static RangeTable *AllocateTable(uint32_t numSlots);
+	static void FreeTable(RangeTable *table);
+	static RangeBan *FindRange(RangeTable *table, uint32_t prefix, uint32_t prefixLength);
+	static void InsertRange(RangeTable *table, uint32_t prefix, uint32_t prefixLength, RakNet::TimeMS timeout);
+	void ReplaceTable(RangeTable *newTable);
+	bool IsRangeBanned(uint32_t address, RakNet::TimeMS time);
+	bool IsPatternBanned(const char *IP, RakNet::TimeMS time);
+	void RemoveExpiredRanges(RakNet::TimeMS time);
+
+	// Read without locking by IsBanned
+	RangeTable * volatile rangeTable;
+	// Incremented each time rangeTable is replaced
+	volatile uint32_t readEpoch;
+	// Number of IsBanned calls reading rangeTable that started in an even or odd readEpoch
+	LocklessUint32_t activeReaders[2];
+	DataStructures::List<PatternBan> patternBans;
+	// patternBans.Size(), readable without locking
+	volatile unsigned int numPatternBans;
+	// Held to change rangeTable or patternBans
+	SimpleMutex mutex;
+};
+
+} // namespace RakNet
+
+#endif
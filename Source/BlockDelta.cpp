@@ -0,0 +1,428 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "NativeFeatureIncludes.h"
+#if _RAKNET_SUPPORT_FileOperations==1
+
+#include "BlockDelta.h"
+#include "BitStream.h"
+#include "FileOperations.h"
+#include "DR_SHA1.h"
+#include "RakAssert.h"
+#include <stdio.h>
+#include <string.h>
+#if !defined(_WIN32)
+#include <sys/types.h>
+#endif
+
+using namespace RakNet;
+
+static const uint32_t MIN_BLOCK_LENGTH=2048;
+static const uint32_t MAX_BLOCK_LENGTH=65536;
+// Files are read this much at a time. A multiple of every block length
+static const uint32_t READ_LENGTH=1048576;
+
+enum BlockDeltaOp
+{
+	// Followed by nothing
+	BLOCK_DELTA_END,
+	// Followed by the length and the bytes
+	BLOCK_DELTA_LITERAL,
+	// Followed by the first block and how many blocks follow it in the old file
+	BLOCK_DELTA_COPY
+};
+
+// fseek() takes a long, which is 32 bits on Windows, so files over 2 GB need the 64 bit versions
+static bool SeekFile(FILE *fp, uint64_t offset)
+{
+#if defined(_WIN32)
+	return _fseeki64(fp, (__int64) offset, SEEK_SET)==0;
+#else
+	// off_t is only 32 bits on 32 bit systems built without _FILE_OFFSET_BITS=64
+	if ((uint64_t) (off_t) offset!=offset)
+		return false;
+	return fseeko(fp, (off_t) offset, SEEK_SET)==0;
+#endif
+}
+
+// Two 16 bit sums as rsync uses, where the second weighs bytes by their distance from the end so it can be rolled
+static inline uint32_t GetWeakChecksum(const unsigned char *data, uint32_t length, uint32_t *a, uint32_t *b)
+{
+	uint32_t s1=0, s2=0;
+	for (uint32_t i=0; i < length; i++)
+	{
+		s1+=data[i];
+		s2+=s1;
+	}
+	*a=s1;
+	*b=s2;
+	return (s1 & 0xFFFF) | (s2 << 16);
+}
+// First 8 bytes of the SHA1, so it is the same on either endian
+static uint64_t GetStrongChecksum(const unsigned char *data, uint32_t length)
+{
+	CSHA1 sha1;
+	sha1.Update((const UINT_8 *) data, length);
+	sha1.Final();
+	unsigned char digest[SHA1_LENGTH];
+	sha1.GetHash(digest);
+	uint64_t checksum=0;
+	for (int i=0; i < 8; i++)
+		checksum=(checksum << 8) | digest[i];
+	return checksum;
+}
+static inline uint32_t GetTableIndex(uint32_t weakChecksum, int tableBits)
+{
+	return (weakChecksum * 0x9E3779B1u) >> (32-tableBits);
+}
+
+void BlockSignatures::Serialize(RakNet::BitStream *outBitStream) const
+{
+	RakAssert(weakChecksums.Size()==strongChecksums.Size());
+	outBitStream->Write(fileLength);
+	outBitStream->Write(blockLength);
+	outBitStream->WriteCompressed(weakChecksums.Size());
+	for (unsigned int i=0; i < weakChecksums.Size(); i++)
+	{
+		outBitStream->Write(weakChecksums[i]);
+		outBitStream->Write(strongChecksums[i]);
+	}
+}
+bool BlockSignatures::Deserialize(RakNet::BitStream *inBitStream)
+{
+	weakChecksums.Clear(false, _FILE_AND_LINE_);
+	strongChecksums.Clear(false, _FILE_AND_LINE_);
+	unsigned int count;
+	if (inBitStream->Read(fileLength)==false ||
+		inBitStream->Read(blockLength)==false ||
+		inBitStream->ReadCompressed(count)==false)
+		return false;
+	// Checked before allocating, as the count comes from another system
+	if (blockLength==0 || blockLength > MAX_BLOCK_LENGTH ||
+		count!=fileLength/blockLength ||
+		(uint64_t) count * (sizeof(uint32_t)+sizeof(uint64_t)) * 8 > (uint64_t) inBitStream->GetNumberOfUnreadBits())
+		return false;
+	weakChecksums.Preallocate(count, _FILE_AND_LINE_);
+	strongChecksums.Preallocate(count, _FILE_AND_LINE_);
+	uint32_t weakChecksum;
+	uint64_t strongChecksum;
+	for (unsigned int i=0; i < count; i++)
+	{
+		inBitStream->Read(weakChecksum);
+		inBitStream->Read(strongChecksum);
+		weakChecksums.Push(weakChecksum, _FILE_AND_LINE_);
+		strongChecksums.Push(strongChecksum, _FILE_AND_LINE_);
+	}
+	return true;
+}
+
+uint32_t BlockDelta::GetBlockLength(uint32_t fileLength)
+{
+	uint32_t blockLength=MIN_BLOCK_LENGTH;
+	while (blockLength < MAX_BLOCK_LENGTH && (uint64_t) blockLength * blockLength < fileLength)
+		blockLength*=2;
+	return blockLength;
+}
+bool BlockDelta::GetSignatures(const char *path, BlockSignatures *signatures)
+{
+	signatures->weakChecksums.Clear(false, _FILE_AND_LINE_);
+	signatures->strongChecksums.Clear(false, _FILE_AND_LINE_);
+	signatures->fileLength=0;
+	FILE *fp = fopen(path, "rb");
+	if (fp==0)
+		return false;
+	setvbuf(fp, 0, _IONBF, 0);
+	signatures->blockLength=GetBlockLength(GetFileLength(path));
+	unsigned char *buffer = (unsigned char *) rakMalloc_Ex(READ_LENGTH, _FILE_AND_LINE_);
+	uint32_t a,b;
+	size_t bytesRead;
+	do
+	{
+		bytesRead=fread(buffer, 1, READ_LENGTH, fp);
+		signatures->fileLength+=(uint32_t) bytesRead;
+		// Reads are a multiple of the block length, so only the last can end with a partial block
+		for (uint32_t offset=0; offset+signatures->blockLength <= bytesRead; offset+=signatures->blockLength)
+		{
+			signatures->weakChecksums.Push(GetWeakChecksum(buffer+offset, signatures->blockLength, &a, &b), _FILE_AND_LINE_);
+			signatures->strongChecksums.Push(GetStrongChecksum(buffer+offset, signatures->blockLength), _FILE_AND_LINE_);
+		}
+	} while (bytesRead==READ_LENGTH);
+	rakFree_Ex(buffer, _FILE_AND_LINE_);
+	fclose(fp);
+	return true;
+}
+
+// Sends a run of blocks to copy, if there is one
+static void WriteCopy(RakNet::BitStream *ops, uint32_t *copyBlock, uint32_t *copyCount)
+{
+	if (*copyCount==0)
+		return;
+	ops->Write((unsigned char) BLOCK_DELTA_COPY);
+	ops->Write(*copyBlock);
+	ops->Write(*copyCount);
+	*copyCount=0;
+}
+static void WriteLiteral(RakNet::BitStream *ops, const unsigned char *data, uint32_t length, uint32_t *copyBlock, uint32_t *copyCount)
+{
+	if (length==0)
+		return;
+	// Copies found before these bytes go first
+	WriteCopy(ops, copyBlock, copyCount);
+	ops->Write((unsigned char) BLOCK_DELTA_LITERAL);
+	ops->Write(length);
+	ops->WriteAlignedBytes(data, length);
+}
+
+bool BlockDelta::GetDelta(const BlockSignatures &signatures, const char *path, RakNet::BitStream *delta, uint32_t maxDeltaLength)
+{
+	const uint32_t blockLength=signatures.blockLength;
+	const unsigned int numBlocks=signatures.weakChecksums.Size();
+	if (blockLength==0 || signatures.strongChecksums.Size()!=numBlocks)
+		return false;
+	FILE *fp = fopen(path, "rb");
+	if (fp==0)
+		return false;
+	setvbuf(fp, 0, _IONBF, 0);
+
+	// Blocks by weak checksum, chained through next in the order of the old file
+	int tableBits=4;
+	while (((unsigned int) 1 << tableBits) < numBlocks*2 && tableBits < 22)
+		tableBits++;
+	int *heads = (int *) rakMalloc_Ex(sizeof(int) << tableBits, _FILE_AND_LINE_);
+	int *next = (int *) rakMalloc_Ex(sizeof(int) * (numBlocks+1), _FILE_AND_LINE_);
+	memset(heads, 0xFF, sizeof(int) << tableBits);
+	unsigned int i;
+	for (i=numBlocks; i-- > 0;)
+	{
+		uint32_t index = GetTableIndex(signatures.weakChecksums[i], tableBits);
+		next[i]=heads[index];
+		heads[index]=(int) i;
+	}
+
+	uint32_t bufferLength = READ_LENGTH;
+	if (bufferLength < blockLength*4)
+		bufferLength=blockLength*4;
+	unsigned char *buffer = (unsigned char *) rakMalloc_Ex(bufferLength, _FILE_AND_LINE_);
+	CSHA1 fileSha1;
+	RakNet::BitStream ops;
+	// The window being matched is [pos, pos+blockLength). Bytes from literalStart to pos matched nothing
+	uint32_t used=0, pos=0, literalStart=0, fileLength=0;
+	uint32_t a=0, b=0;
+	bool weakValid=false, endOfFile=false, tooLong=false;
+	uint32_t copyBlock=0, copyCount=0;
+	for (;;)
+	{
+		if (pos+blockLength > used)
+		{
+			if (endOfFile)
+				break;
+			WriteLiteral(&ops, buffer+literalStart, pos-literalStart, &copyBlock, &copyCount);
+			if (ops.GetNumberOfBytesUsed() > maxDeltaLength)
+			{
+				tooLong=true;
+				break;
+			}
+			memmove(buffer, buffer+pos, used-pos);
+			used-=pos;
+			pos=0;
+			literalStart=0;
+			size_t bytesRead = fread(buffer+used, 1, bufferLength-used, fp);
+			fileSha1.Update(buffer+used, (UINT_32) bytesRead);
+			fileLength+=(uint32_t) bytesRead;
+			used+=(uint32_t) bytesRead;
+			endOfFile=used < bufferLength;
+			continue;
+		}
+
+		if (weakValid==false)
+		{
+			GetWeakChecksum(buffer+pos, blockLength, &a, &b);
+			weakValid=true;
+		}
+		uint32_t weakChecksum = (a & 0xFFFF) | (b << 16);
+		int match=-1;
+		int candidate=heads[GetTableIndex(weakChecksum, tableBits)];
+		if (candidate>=0)
+		{
+			// The strong checksum is only worked out when a weak one matches
+			bool haveStrongChecksum=false;
+			uint64_t strongChecksum=0;
+			for (; candidate>=0; candidate=next[candidate])
+			{
+				if (signatures.weakChecksums[candidate]!=weakChecksum)
+					continue;
+				if (haveStrongChecksum==false)
+				{
+					strongChecksum=GetStrongChecksum(buffer+pos, blockLength);
+					haveStrongChecksum=true;
+				}
+				if (signatures.strongChecksums[candidate]!=strongChecksum)
+					continue;
+				// Of blocks that are the same, prefer the one that continues the run being copied
+				if (copyCount>0 && (uint32_t) candidate==copyBlock+copyCount)
+				{
+					match=candidate;
+					break;
+				}
+				if (match<0)
+					match=candidate;
+			}
+		}
+
+		if (match>=0)
+		{
+			WriteLiteral(&ops, buffer+literalStart, pos-literalStart, &copyBlock, &copyCount);
+			if (copyCount>0 && (uint32_t) match==copyBlock+copyCount)
+				copyCount++;
+			else
+			{
+				WriteCopy(&ops, &copyBlock, &copyCount);
+				copyBlock=(uint32_t) match;
+				copyCount=1;
+			}
+			pos+=blockLength;
+			literalStart=pos;
+			weakValid=false;
+		}
+		else
+		{
+			// Roll the window forward a byte, unless the next byte has not been read yet
+			if (pos+blockLength < used)
+			{
+				uint32_t out=buffer[pos];
+				a+=buffer[pos+blockLength]-out;
+				b+=a-blockLength*out;
+			}
+			else
+				weakValid=false;
+			pos++;
+		}
+	}
+
+	if (tooLong==false)
+	{
+		WriteLiteral(&ops, buffer+literalStart, used-literalStart, &copyBlock, &copyCount);
+		WriteCopy(&ops, &copyBlock, &copyCount);
+		ops.Write((unsigned char) BLOCK_DELTA_END);
+		tooLong=ops.GetNumberOfBytesUsed() > maxDeltaLength;
+	}
+	fclose(fp);
+	rakFree_Ex(buffer, _FILE_AND_LINE_);
+	rakFree_Ex(next, _FILE_AND_LINE_);
+	rakFree_Ex(heads, _FILE_AND_LINE_);
+	if (tooLong)
+		return false;
+
+	fileSha1.Final();
+	unsigned char digest[SHA1_LENGTH];
+	fileSha1.GetHash(digest);
+	delta->Write(fileLength);
+	delta->Write(blockLength);
+	delta->WriteAlignedBytes(digest, SHA1_LENGTH);
+	delta->WriteAlignedBytes(ops.GetData(), ops.GetNumberOfBytesUsed());
+	return true;
+}
+
+bool BlockDelta::ApplyDelta(const char *oldPath, const char *delta, uint32_t deltaLength, const char *newPath)
+{
+	RakNet::BitStream inBitStream((unsigned char *) delta, deltaLength, false);
+	uint32_t fileLength, blockLength;
+	unsigned char expectedDigest[SHA1_LENGTH];
+	if (inBitStream.Read(fileLength)==false ||
+		inBitStream.Read(blockLength)==false ||
+		inBitStream.ReadAlignedBytes(expectedDigest, SHA1_LENGTH)==false)
+		return false;
+	FILE *oldFile = fopen(oldPath, "rb");
+	if (oldFile==0)
+		return false;
+	FILE *newFile = fopen(newPath, "wb");
+	if (newFile==0)
+	{
+		fclose(oldFile);
+		return false;
+	}
+	setvbuf(oldFile, 0, _IONBF, 0);
+
+	unsigned char *buffer = (unsigned char *) rakMalloc_Ex(READ_LENGTH, _FILE_AND_LINE_);
+	CSHA1 fileSha1;
+	uint32_t written=0;
+	uint64_t oldFilePosition=0;
+	bool success=false, valid=true;
+	while (valid)
+	{
+		unsigned char op;
+		if (inBitStream.Read(op)==false)
+			break;
+		if (op==BLOCK_DELTA_END)
+		{
+			if (written==fileLength)
+			{
+				unsigned char digest[SHA1_LENGTH];
+				fileSha1.Final();
+				fileSha1.GetHash(digest);
+				success=memcmp(digest, expectedDigest, SHA1_LENGTH)==0;
+			}
+			break;
+		}
+		else if (op==BLOCK_DELTA_LITERAL)
+		{
+			uint32_t length;
+			if (inBitStream.Read(length)==false || length > fileLength-written || length > BITS_TO_BYTES(inBitStream.GetNumberOfUnreadBits()))
+				break;
+			inBitStream.AlignReadToByteBoundary();
+			const unsigned char *data = inBitStream.GetData()+BITS_TO_BYTES(inBitStream.GetReadOffset());
+			inBitStream.IgnoreBytes(length);
+			if (fwrite(data, 1, length, newFile)!=length)
+				break;
+			fileSha1.Update(data, length);
+			written+=length;
+		}
+		else if (op==BLOCK_DELTA_COPY)
+		{
+			uint32_t firstBlock, blockCount;
+			if (inBitStream.Read(firstBlock)==false || inBitStream.Read(blockCount)==false ||
+				(uint64_t) blockCount * blockLength > fileLength-written)
+				break;
+			// Runs usually follow each other in the old file, so there is nothing to seek
+			uint64_t offset = (uint64_t) firstBlock * blockLength;
+			if (offset!=oldFilePosition)
+			{
+				if (SeekFile(oldFile, offset)==false)
+					break;
+				oldFilePosition=offset;
+			}
+			uint32_t remaining = blockCount * blockLength;
+			while (remaining > 0)
+			{
+				uint32_t length = remaining < READ_LENGTH ? remaining : READ_LENGTH;
+				if (fread(buffer, 1, length, oldFile)!=length || fwrite(buffer, 1, length, newFile)!=length)
+				{
+					valid=false;
+					break;
+				}
+				fileSha1.Update(buffer, length);
+				oldFilePosition+=length;
+				written+=length;
+				remaining-=length;
+			}
+		}
+		else
+			break;
+	}
+	rakFree_Ex(buffer, _FILE_AND_LINE_);
+	fclose(oldFile);
+	if (fclose(newFile)!=0)
+		success=false;
+	if (success==false)
+		remove(newPath);
+	return success;
+}
+
+#endif // _RAKNET_SUPPORT_*
@@ -0,0 +1,75 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file BlockDelta.h
+/// \brief Rolling checksum deltas between two versions of a file, where only one side has each version
+///
+
+
+#include "NativeFeatureIncludes.h"
+#if _RAKNET_SUPPORT_FileOperations==1
+
+#ifndef __BLOCK_DELTA_H
+#define __BLOCK_DELTA_H
+
+#include "Export.h"
+#include "DS_List.h"
+#include "RakMemoryOverride.h"
+#include "NativeTypes.h"
+
+namespace RakNet
+{
+/// Forward declarations
+class BitStream;
+
+/// \brief Checksums of each block of a file, made by the system that has the old version of it
+struct RAK_DLL_EXPORT BlockSignatures
+{
+	uint32_t fileLength;
+	uint32_t blockLength;
+	/// One of each per whole block. A partial block at the end of the file has none, and is never matched
+	DataStructures::List<uint32_t> weakChecksums;
+	DataStructures::List<uint64_t> strongChecksums;
+
+	void Serialize(RakNet::BitStream *outBitStream) const;
+	/// \return false if the data is not signatures, in which case the signatures are empty
+	bool Deserialize(RakNet::BitStream *inBitStream);
+};
+
+/// \brief Sends only what changed in a file, without either system having both versions, in the manner of rsync
+/// \details The system with the old file sends BlockSignatures of it. The system with the new file finds the blocks that are still there at any offset, using a checksum that rolls one byte at a time, and sends the rest of the file as literal data.
+/// The old file is then rebuilt into a new one, which is checked against a SHA1 of the file sent.
+/// Used by DirectoryDeltaTransfer::SetBlockDeltaMinimumFileLength()
+class RAK_DLL_EXPORT BlockDelta
+{
+public:
+	/// \return Block length used for a file this long. About the square root of the length, which keeps both the signatures and the literal data around changes small
+	static uint32_t GetBlockLength(uint32_t fileLength);
+
+	/// \brief Reads the old version of a file and makes its signatures
+	/// \return false if the file cannot be read
+	static bool GetSignatures(const char *path, BlockSignatures *signatures);
+
+	/// \brief Reads the new version of a file, writing what rebuilds it from the file \a signatures were made from
+	/// \param[in] maxDeltaLength Give up once the delta is longer than this, as sending the file would cost about as much
+	/// \return false if the file cannot be read, or the delta is too long. \a delta is then incomplete
+	static bool GetDelta(const BlockSignatures &signatures, const char *path, RakNet::BitStream *delta, uint32_t maxDeltaLength);
+
+	/// \brief Rebuilds the new version of a file from the old one and a delta from GetDelta()
+	/// \details The old file is not changed. On success, replace it with \a newPath
+	/// \return false if the old file is missing or not the one the signatures were made from, or the delta is not valid. \a newPath is then deleted
+	static bool ApplyDelta(const char *oldPath, const char *delta, uint32_t deltaLength, const char *newPath);
+};
+
+} // namespace RakNet
+
+#endif
+
+#endif // _RAKNET_SUPPORT_*
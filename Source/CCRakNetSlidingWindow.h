@@ -174,6 +174,8 @@ class CCRakNetSlidingWindow
 
 	bool GetIsInSlowStart(void) const {return IsInSlowStart();}
 	uint32_t GetCWNDLimit(void) const {return (uint32_t) 0;}
+	/// Bytes allowed on the wire at once
+	uint32_t GetCongestionWindowBytes(void) const {return (uint32_t) cwnd;}
 
 
 	/// Is a > b, accounting for variable overflow?
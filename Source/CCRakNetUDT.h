@@ -179,6 +179,8 @@ class CCRakNetUDT
 
 	bool GetIsInSlowStart(void) const {return isInSlowStart;}
 	uint32_t GetCWNDLimit(void) const {return (uint32_t) (CWND*MAXIMUM_MTU_INCLUDING_UDP_HEADER);}
+	/// Bytes allowed on the wire at once
+	uint32_t GetCongestionWindowBytes(void) const {return GetCWNDLimit();}
 
 
 	/// Is a > b, accounting for variable overflow?
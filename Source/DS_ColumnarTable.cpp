@@ -0,0 +1,506 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "DS_ColumnarTable.h"
+#include <string.h>
+#include "RakAssert.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define _COLUMNAR_TABLE_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+using namespace DataStructures;
+
+// Number of 32 bit words in a bitmask with one bit per row
+static unsigned int NumWords(unsigned int numRows)
+{
+	return (numRows+31)>>5;
+}
+// Bits of word w that map to rows that exist
+static unsigned int ValidBits(unsigned int numRows, unsigned int w)
+{
+	unsigned int rowsInWord = numRows - (w<<5);
+	if (rowsInWord>=32)
+		return 0xFFFFFFFF;
+	return (1u<<rowsInWord)-1;
+}
+static bool CompareNumber(double value, Table::FilterQueryType operation, double filterValue)
+{
+	switch (operation)
+	{
+	case Table::QF_EQUAL:
+		return value==filterValue;
+	case Table::QF_NOT_EQUAL:
+		return value!=filterValue;
+	case Table::QF_GREATER_THAN:
+		return value>filterValue;
+	case Table::QF_GREATER_THAN_EQ:
+		return value>=filterValue;
+	case Table::QF_LESS_THAN:
+		return value<filterValue;
+	case Table::QF_LESS_THAN_EQ:
+		return value<=filterValue;
+	default:
+		RakAssert(0);
+		return false;
+	}
+}
+// Compares up to 32 values, returning a bit per value that passed
+static unsigned int CompareNumbers(const double *values, unsigned int count, Table::FilterQueryType operation, double filterValue)
+{
+	unsigned int bits=0;
+	unsigned int k=0;
+#ifdef _COLUMNAR_TABLE_USE_SSE2
+	__m128d filterValues = _mm_set1_pd(filterValue);
+#define _COLUMNAR_TABLE_SSE2_COMPARE(compare) \
+	for (; k+2<=count; k+=2) \
+		bits |= (unsigned int) _mm_movemask_pd(compare(_mm_loadu_pd(values+k), filterValues)) << k;
+
+	switch (operation)
+	{
+	case Table::QF_EQUAL:
+		_COLUMNAR_TABLE_SSE2_COMPARE(_mm_cmpeq_pd)
+		break;
+	case Table::QF_NOT_EQUAL:
+		_COLUMNAR_TABLE_SSE2_COMPARE(_mm_cmpneq_pd)
+		break;
+	case Table::QF_GREATER_THAN:
+		_COLUMNAR_TABLE_SSE2_COMPARE(_mm_cmpgt_pd)
+		break;
+	case Table::QF_GREATER_THAN_EQ:
+		_COLUMNAR_TABLE_SSE2_COMPARE(_mm_cmpge_pd)
+		break;
+	case Table::QF_LESS_THAN:
+		_COLUMNAR_TABLE_SSE2_COMPARE(_mm_cmplt_pd)
+		break;
+	case Table::QF_LESS_THAN_EQ:
+		_COLUMNAR_TABLE_SSE2_COMPARE(_mm_cmple_pd)
+		break;
+	default:
+		break;
+	}
+#undef _COLUMNAR_TABLE_SSE2_COMPARE
+#endif
+	for (; k < count; k++)
+	{
+		if (CompareNumber(values[k], operation, filterValue))
+			bits |= 1u<<k;
+	}
+	return bits;
+}
+// Returns 1 if the non-empty cell passes, 0 if it fails, -1 if the filter does not apply to it,
+// and -2 if it passes only when an earlier filter applied to the row
+// Matches the per cell checks in Table::QueryRow
+static int CompareCell(const char *data, int dataLength, void *ptr, Table::ColumnType columnType, const Table::FilterQuery *filter)
+{
+	const Table::Cell *filterValue = filter->cellValue;
+	if (columnType==Table::STRING && (data==0 || filterValue->c==0))
+		return -1;
+	if (filter->operation==Table::QF_IS_EMPTY)
+		return 0;
+	if (filter->operation==Table::QF_NOT_EMPTY)
+		return 1;
+
+	if (columnType==Table::STRING)
+	{
+		int res = strcmp(data, filterValue->c);
+		switch (filter->operation)
+		{
+		case Table::QF_EQUAL:
+			return res==0;
+		case Table::QF_NOT_EQUAL:
+			return res!=0;
+		case Table::QF_GREATER_THAN:
+			return res>0;
+		case Table::QF_GREATER_THAN_EQ:
+			return res>=0;
+		case Table::QF_LESS_THAN:
+			return res<0;
+		case Table::QF_LESS_THAN_EQ:
+			return res<=0;
+		default:
+			RakAssert(0);
+			return 0;
+		}
+	}
+	else if (columnType==Table::BINARY)
+	{
+		// Table::QueryRow only compares binary cells for (in)equality, and treats both as equality
+		if (filter->operation!=Table::QF_EQUAL && filter->operation!=Table::QF_NOT_EQUAL)
+			return -2;
+		if (dataLength<0)
+			dataLength=0;
+		if (dataLength!=(int) filterValue->i)
+			return 0;
+		return dataLength==0 || memcmp(data, filterValue->c, dataLength)==0;
+	}
+	else
+	{
+		switch (filter->operation)
+		{
+		case Table::QF_EQUAL:
+			return ptr==filterValue->ptr;
+		case Table::QF_NOT_EQUAL:
+			return ptr!=filterValue->ptr;
+		case Table::QF_GREATER_THAN:
+			return ptr>filterValue->ptr;
+		case Table::QF_GREATER_THAN_EQ:
+			return ptr>=filterValue->ptr;
+		case Table::QF_LESS_THAN:
+			return ptr<filterValue->ptr;
+		case Table::QF_LESS_THAN_EQ:
+			return ptr<=filterValue->ptr;
+		default:
+			RakAssert(0);
+			return 0;
+		}
+	}
+}
+
+ColumnarTable::Column::Column()
+{
+	data=0;
+	dataUsed=0;
+	dataAllocated=0;
+}
+ColumnarTable::Column::~Column()
+{
+	if (data)
+		rakFree_Ex(data, _FILE_AND_LINE_);
+}
+void ColumnarTable::Column::AddEmpty(unsigned rowIndex)
+{
+	Add(rowIndex, 0);
+}
+void ColumnarTable::Column::Add(unsigned rowIndex, const Table::Cell *cell)
+{
+	if ((rowIndex&31)==0)
+		emptyBits.Push(0, _FILE_AND_LINE_);
+
+	bool isEmpty = cell==0 || cell->isEmpty;
+	if (isEmpty)
+		emptyBits[rowIndex>>5] |= 1u<<(rowIndex&31);
+
+	// Every row gets an entry, so row indices line up with array indices
+	switch (descriptor.columnType)
+	{
+	case Table::NUMERIC:
+		numbers.Push(isEmpty ? 0.0 : cell->i, _FILE_AND_LINE_);
+		break;
+	case Table::POINTER:
+		pointers.Push(isEmpty ? 0 : cell->ptr, _FILE_AND_LINE_);
+		break;
+	case Table::STRING:
+	case Table::BINARY:
+		{
+			int length=-1;
+			if (isEmpty==false && cell->c)
+			{
+				if (descriptor.columnType==Table::STRING)
+					length=(int) strlen(cell->c)+1;
+				else
+					length=(int) cell->i;
+				if (dataUsed+length>dataAllocated)
+				{
+					dataAllocated=dataAllocated*2+length+256;
+					data=(char*) rakRealloc_Ex(data, dataAllocated, _FILE_AND_LINE_);
+				}
+				memcpy(data+dataUsed, cell->c, length);
+			}
+			dataOffsets.Push(dataUsed, _FILE_AND_LINE_);
+			dataLengths.Push(length, _FILE_AND_LINE_);
+			if (length>0)
+				dataUsed+=length;
+		}
+		break;
+	}
+}
+void ColumnarTable::Column::CopyCell(unsigned rowIndex, Table::Cell *cell) const
+{
+	if (IsEmpty(rowIndex))
+		return;
+	switch (descriptor.columnType)
+	{
+	case Table::NUMERIC:
+		cell->Set(numbers[rowIndex]);
+		break;
+	case Table::STRING:
+		cell->Set(GetData(rowIndex));
+		break;
+	case Table::BINARY:
+		cell->Set(GetData(rowIndex), dataLengths[rowIndex] < 0 ? 0 : dataLengths[rowIndex]);
+		break;
+	case Table::POINTER:
+		cell->SetPtr(pointers[rowIndex]);
+		break;
+	}
+}
+ColumnarTable::ColumnarTable()
+{
+}
+ColumnarTable::~ColumnarTable()
+{
+	Clear();
+}
+void ColumnarTable::Build(const Table &table)
+{
+	Clear();
+
+	unsigned i;
+	for (i=0; i < table.GetColumnCount(); i++)
+		AddColumn(table.ColumnName(i), table.GetColumnType(i));
+
+	unsigned numRows = table.GetRowCount();
+	rowIds.Preallocate(numRows, _FILE_AND_LINE_);
+	for (i=0; i < columns.Size(); i++)
+	{
+		columns[i]->emptyBits.Preallocate(NumWords(numRows), _FILE_AND_LINE_);
+		if (columns[i]->descriptor.columnType==Table::NUMERIC)
+			columns[i]->numbers.Preallocate(numRows, _FILE_AND_LINE_);
+		else if (columns[i]->descriptor.columnType==Table::POINTER)
+			columns[i]->pointers.Preallocate(numRows, _FILE_AND_LINE_);
+		else
+		{
+			columns[i]->dataOffsets.Preallocate(numRows, _FILE_AND_LINE_);
+			columns[i]->dataLengths.Preallocate(numRows, _FILE_AND_LINE_);
+		}
+	}
+
+	DataStructures::Page<unsigned, Table::Row*, _TABLE_BPLUS_TREE_ORDER> *cur = table.GetRows().GetListHead();
+	while (cur)
+	{
+		for (i=0; i < (unsigned) cur->size; i++)
+			AddRow(cur->keys[i], cur->data[i]->cells);
+		cur=cur->next;
+	}
+}
+unsigned ColumnarTable::AddColumn(const char *columnName, Table::ColumnType columnType)
+{
+	if (columnName[0]==0)
+		return (unsigned) -1;
+
+	Column *column = RakNet::OP_NEW<Column>(_FILE_AND_LINE_);
+	column->descriptor=Table::ColumnDescriptor(columnName, columnType);
+	for (unsigned rowIndex=0; rowIndex < rowIds.Size(); rowIndex++)
+		column->AddEmpty(rowIndex);
+	columns.Push(column, _FILE_AND_LINE_);
+	return columns.Size()-1;
+}
+bool ColumnarTable::AddRow(unsigned rowId, const DataStructures::List<Table::Cell*> &cells)
+{
+	if (rowIds.Size() > 0 && rowId <= rowIds[rowIds.Size()-1])
+		return false;
+
+	unsigned rowIndex = rowIds.Size();
+	for (unsigned columnIndex=0; columnIndex < columns.Size(); columnIndex++)
+	{
+		if (columnIndex < cells.Size())
+			columns[columnIndex]->Add(rowIndex, cells[columnIndex]);
+		else
+			columns[columnIndex]->AddEmpty(rowIndex);
+	}
+	rowIds.Push(rowId, _FILE_AND_LINE_);
+	return true;
+}
+unsigned ColumnarTable::ColumnIndex(const char *columnName) const
+{
+	unsigned columnIndex;
+	for (columnIndex=0; columnIndex<columns.Size(); columnIndex++)
+		if (strcmp(columnName, columns[columnIndex]->descriptor.columnName)==0)
+			return columnIndex;
+	return (unsigned)-1;
+}
+unsigned ColumnarTable::GetColumnCount(void) const
+{
+	return columns.Size();
+}
+unsigned ColumnarTable::GetRowCount(void) const
+{
+	return rowIds.Size();
+}
+unsigned ColumnarTable::GetRowId(unsigned rowIndex) const
+{
+	return rowIds[rowIndex];
+}
+void ColumnarTable::EvaluateFilter(Table::FilterQuery *filter, unsigned int *evaluatedBits, unsigned int *failedBits) const
+{
+	unsigned int numRows = rowIds.Size();
+	unsigned int numWords = NumWords(numRows);
+	unsigned int w;
+
+	if (filter->columnName[0])
+		filter->columnIndex=ColumnIndex(filter->columnName);
+
+	if (filter->columnIndex>=columns.Size())
+	{
+		// Same as Table::QueryRow, an unknown column is treated as an empty cell
+		for (w=0; w < numWords; w++)
+		{
+			evaluatedBits[w] |= ValidBits(numRows, w);
+			if (filter->operation!=Table::QF_IS_EMPTY)
+				failedBits[w] |= ValidBits(numRows, w);
+		}
+		return;
+	}
+
+	const Column *column = columns[filter->columnIndex];
+	if (column->descriptor.columnType==Table::NUMERIC)
+	{
+		// Numeric filters always apply, so 32 rows are decided at once
+		const double *numbers = numRows ? &column->numbers[0] : 0;
+		for (w=0; w < numWords; w++)
+		{
+			unsigned int validBits = ValidBits(numRows, w);
+			unsigned int emptyBits = column->emptyBits[w];
+			unsigned int passBits;
+			if (filter->operation==Table::QF_IS_EMPTY)
+				passBits = emptyBits;
+			else if (filter->operation==Table::QF_NOT_EMPTY)
+				passBits = ~emptyBits;
+			else
+			{
+				unsigned int count = numRows-(w<<5) < 32 ? numRows-(w<<5) : 32;
+				passBits = CompareNumbers(numbers+(w<<5), count, filter->operation, filter->cellValue->i) & ~emptyBits;
+			}
+			evaluatedBits[w] |= validBits;
+			failedBits[w] |= ~passBits & validBits;
+		}
+		return;
+	}
+
+	for (unsigned int rowIndex=0; rowIndex < numRows; rowIndex++)
+	{
+		unsigned int bit = 1u<<(rowIndex&31);
+		int res;
+		if (column->IsEmpty(rowIndex))
+			res = filter->operation==Table::QF_IS_EMPTY ? 1 : 0;
+		else if (column->descriptor.columnType==Table::POINTER)
+			res = CompareCell(0, 0, column->pointers[rowIndex], Table::POINTER, filter);
+		else
+			res = CompareCell(column->GetData(rowIndex), column->dataLengths[rowIndex], 0, column->descriptor.columnType, filter);
+
+		if (res==-2)
+			res = (evaluatedBits[rowIndex>>5] & bit) ? 1 : 0;
+		if (res>=0)
+		{
+			evaluatedBits[rowIndex>>5] |= bit;
+			if (res==0)
+				failedBits[rowIndex>>5] |= bit;
+		}
+	}
+}
+void ColumnarTable::QueryRowIndices(Table::FilterQuery *inclusionFilters, unsigned numInclusionFilters, unsigned *rowIdsSubset, unsigned numRowIDs, DataStructures::List<unsigned> &rowIndices)
+{
+	rowIndices.Clear(true, _FILE_AND_LINE_);
+
+	unsigned int numRows = rowIds.Size();
+	unsigned int numWords = NumWords(numRows);
+	if (numWords==0)
+		return;
+
+	unsigned int w, i;
+	unsigned int *passBits = RakNet::OP_NEW_ARRAY<unsigned int>(numWords, _FILE_AND_LINE_);
+	if (rowIdsSubset && numRowIDs>0)
+	{
+		// Rows are sorted by rowId, so look each one up
+		memset(passBits, 0, numWords*sizeof(unsigned int));
+		for (i=0; i < numRowIDs; i++)
+		{
+			unsigned int lower=0, upper=numRows;
+			while (lower < upper)
+			{
+				unsigned int middle = lower+(upper-lower)/2;
+				if (rowIds[middle] < rowIdsSubset[i])
+					lower=middle+1;
+				else
+					upper=middle;
+			}
+			if (lower < numRows && rowIds[lower]==rowIdsSubset[i])
+				passBits[lower>>5] |= 1u<<(lower&31);
+		}
+	}
+	else
+	{
+		for (w=0; w < numWords; w++)
+			passBits[w]=ValidBits(numRows, w);
+	}
+
+	if (inclusionFilters && numInclusionFilters>0)
+	{
+		// A row passes if no filter failed it, and at least one filter applied to it
+		unsigned int *evaluatedBits = RakNet::OP_NEW_ARRAY<unsigned int>(numWords, _FILE_AND_LINE_);
+		unsigned int *failedBits = RakNet::OP_NEW_ARRAY<unsigned int>(numWords, _FILE_AND_LINE_);
+		memset(evaluatedBits, 0, numWords*sizeof(unsigned int));
+		memset(failedBits, 0, numWords*sizeof(unsigned int));
+		for (i=0; i < numInclusionFilters; i++)
+			EvaluateFilter(inclusionFilters+i, evaluatedBits, failedBits);
+		for (w=0; w < numWords; w++)
+			passBits[w] &= evaluatedBits[w] & ~failedBits[w];
+		RakNet::OP_DELETE_ARRAY(evaluatedBits, _FILE_AND_LINE_);
+		RakNet::OP_DELETE_ARRAY(failedBits, _FILE_AND_LINE_);
+	}
+
+	for (w=0; w < numWords; w++)
+	{
+		unsigned int bits = passBits[w];
+		for (i=w<<5; bits; i++, bits>>=1)
+		{
+			if (bits & 1)
+				rowIndices.Push(i, _FILE_AND_LINE_);
+		}
+	}
+	RakNet::OP_DELETE_ARRAY(passBits, _FILE_AND_LINE_);
+}
+void ColumnarTable::QueryTable(unsigned *columnIndicesSubset, unsigned numColumnSubset, Table::FilterQuery *inclusionFilters, unsigned numInclusionFilters, unsigned *rowIdsSubset, unsigned numRowIDs, Table *result)
+{
+	unsigned i, j;
+	DataStructures::List<unsigned> columnIndicesToReturn;
+
+	// Clear the result table.
+	result->Clear();
+
+	if (columnIndicesSubset && numColumnSubset>0)
+	{
+		for (i=0; i < numColumnSubset; i++)
+		{
+			if (columnIndicesSubset[i]<columns.Size())
+				columnIndicesToReturn.Insert(columnIndicesSubset[i], _FILE_AND_LINE_);
+		}
+	}
+	else
+	{
+		for (i=0; i < columns.Size(); i++)
+			columnIndicesToReturn.Insert(i, _FILE_AND_LINE_);
+	}
+
+	if (columnIndicesToReturn.Size()==0)
+		return; // No valid columns specified
+
+	for (i=0; i < columnIndicesToReturn.Size(); i++)
+		result->AddColumn(columns[columnIndicesToReturn[i]]->descriptor.columnName, columns[columnIndicesToReturn[i]]->descriptor.columnType);
+
+	// Only rows that passed every filter are copied out
+	DataStructures::List<unsigned> rowIndices;
+	QueryRowIndices(inclusionFilters, numInclusionFilters, rowIdsSubset, numRowIDs, rowIndices);
+	for (i=0; i < rowIndices.Size(); i++)
+	{
+		Table::Row *row = result->AddRow(rowIds[rowIndices[i]]);
+		for (j=0; j < columnIndicesToReturn.Size(); j++)
+			columns[columnIndicesToReturn[j]]->CopyCell(rowIndices[i], row->cells[j]);
+	}
+}
+void ColumnarTable::Clear(void)
+{
+	for (unsigned i=0; i < columns.Size(); i++)
+		RakNet::OP_DELETE(columns[i], _FILE_AND_LINE_);
+	columns.Clear(false, _FILE_AND_LINE_);
+	rowIds.Clear(false, _FILE_AND_LINE_);
+}
@@ -0,0 +1,128 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file DS_ColumnarTable.h
+///
+
+
+#ifndef __COLUMNAR_TABLE_H
+#define __COLUMNAR_TABLE_H
+
+#include "DS_Table.h"
+#include "DS_List.h"
+#include "RakMemoryOverride.h"
+#include "Export.h"
+
+/// The namespace DataStructures was only added to avoid compiler errors for commonly named data structures
+/// As these data structures are stand-alone, you can use them outside of RakNet for your own projects if you wish.
+namespace DataStructures
+{
+	/// \brief Read optimized copy of a Table, stored one column at a time
+	/// \details Table stores each row as a list of separately allocated cells, so a query touches every cell through a pointer.<BR>
+	/// ColumnarTable stores each column in one contiguous array instead, with a bit per row marking empty cells.<BR>
+	/// Filters are run over a whole column at a time, producing a bitmask of the rows that pass. Numeric comparisons use SSE2 where available.<BR>
+	/// Only the rows that pass every filter are copied to the result, and only the columns asked for.<BR>
+	/// QueryTable() returns the same rows as Table::QueryTable() given the same arguments.<BR>
+	/// Rows are only appended, in increasing rowId order. To pick up changes to the source Table, call Build() again.
+	class RAK_DLL_EXPORT ColumnarTable
+	{
+	public:
+		// Constructor
+		ColumnarTable();
+
+		// Destructor
+		~ColumnarTable();
+
+		/// \brief Replaces the contents of this table with a copy of \a table
+		/// \param[in] table Table to copy the columns and rows of
+		void Build(const Table &table);
+
+		/// \brief Adds a column to the table. Rows already in the table get an empty cell.
+		/// \param[in] columnName The name of the column
+		/// \param[in] columnType What type of data this column will hold
+		/// \return The index of the new column
+		unsigned AddColumn(const char *columnName, Table::ColumnType columnType);
+
+		/// \brief Appends a row to the table
+		/// \param[in] rowId The UNIQUE primary key for the row. Must be greater than the rowId of every row already added.
+		/// \param[in] cells Values of the row, by column index. Missing or 0 entries are empty cells.
+		/// \return false if \a rowId was not greater than the last rowId added
+		bool AddRow(unsigned rowId, const DataStructures::List<Table::Cell*> &cells);
+
+		/// \brief Gets the index of a column by name
+		/// \return The index of the column, or (unsigned)-1 if no such column
+		unsigned ColumnIndex(const char *columnName) const;
+
+		/// Returns the number of columns
+		unsigned GetColumnCount(void) const;
+
+		/// Returns the number of rows
+		unsigned GetRowCount(void) const;
+
+		/// Returns the rowId of the row at \a rowIndex
+		unsigned GetRowId(unsigned rowIndex) const;
+
+		/// \brief Runs the filters, without copying any rows out
+		/// \param[in] inclusionFilters An array of FilterQuery.  All filters must pass for the row to be returned.
+		/// \param[in] numInclusionFilters The number of elements in \a inclusionFilters
+		/// \param[in] rowIds An arrow of row IDs.  Only these rows with these IDs are returned.  Pass 0 for all rows.
+		/// \param[in] numRowIDs The number of elements in \a rowIds
+		/// \param[out] rowIndices Indices of the rows that passed, in increasing order. Use GetRowId() to get the rowId.
+		void QueryRowIndices(Table::FilterQuery *inclusionFilters, unsigned numInclusionFilters, unsigned *rowIds, unsigned numRowIDs, DataStructures::List<unsigned> &rowIndices);
+
+		/// \brief Queries the table, optionally returning only a subset of columns and rows.
+		/// \details Same parameters and result as Table::QueryTable()
+		/// \param[in] columnSubset An array of column indices.  Only columns in this array are returned.  Pass 0 for all columns
+		/// \param[in] numColumnSubset The number of elements in \a columnSubset
+		/// \param[in] inclusionFilters An array of FilterQuery.  All filters must pass for the row to be returned.
+		/// \param[in] numInclusionFilters The number of elements in \a inclusionFilters
+		/// \param[in] rowIds An arrow of row IDs.  Only these rows with these IDs are returned.  Pass 0 for all rows.
+		/// \param[in] numRowIDs The number of elements in \a rowIds
+		/// \param[out] result The result of the query.  If no rows are returned, the table will only have columns.
+		void QueryTable(unsigned *columnIndicesSubset, unsigned numColumnSubset, Table::FilterQuery *inclusionFilters, unsigned numInclusionFilters, unsigned *rowIds, unsigned numRowIDs, Table *result);
+
+		/// \brief Frees all memory in the table.
+		void Clear(void);
+
+	protected:
+		/// \internal
+		struct Column
+		{
+			Column();
+			~Column();
+			void AddEmpty(unsigned rowIndex);
+			void Add(unsigned rowIndex, const Table::Cell *cell);
+			bool IsEmpty(unsigned rowIndex) const {return (emptyBits[rowIndex>>5] & (1u<<(rowIndex&31)))!=0;}
+			const char *GetData(unsigned rowIndex) const {return dataLengths[rowIndex]<0 ? 0 : data+dataOffsets[rowIndex];}
+			void CopyCell(unsigned rowIndex, Table::Cell *cell) const;
+
+			Table::ColumnDescriptor descriptor;
+			// One bit per row, set if the cell is empty
+			DataStructures::List<unsigned int> emptyBits;
+			// NUMERIC
+			DataStructures::List<double> numbers;
+			// POINTER
+			DataStructures::List<void*> pointers;
+			// STRING and BINARY. Length is -1 for cells with no data.
+			DataStructures::List<unsigned int> dataOffsets;
+			DataStructures::List<int> dataLengths;
+			char *data;
+			unsigned int dataUsed, dataAllocated;
+		};
+
+		// Applies one filter to every row, setting bits in evaluatedBits for rows the filter applied to and in failedBits for rows that failed it
+		void EvaluateFilter(Table::FilterQuery *filter, unsigned int *evaluatedBits, unsigned int *failedBits) const;
+
+		DataStructures::List<Column*> columns;
+		DataStructures::List<unsigned> rowIds;
+	};
+}
+
+#endif
@@ -0,0 +1,228 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file DS_FlatHashIndex.h
+/// \internal
+/// \brief Open addressing hash table from a key to an index
+///
+
+
+#ifndef __FLAT_HASH_INDEX_H
+#define __FLAT_HASH_INDEX_H
+
+#include "RakAssert.h"
+#include "Export.h"
+#include "RakMemoryOverride.h"
+
+/// The namespace DataStructures was only added to avoid compiler errors for commonly named data structures
+/// As these data structures are stand-alone, you can use them outside of RakNet for your own projects if you wish.
+namespace DataStructures
+{
+	/// \brief Maps a key to an unsigned int, such as an index into a preallocated array
+	/// \details All entries are stored in one array, using linear probing, so a lookup usually touches one cache line and nothing is allocated after Reserve().<BR>
+	/// Removal moves later entries in the same probe sequence back, rather than leaving a marker, so lookups do not get slower as entries come and go.<BR>
+	/// Keys are unique. \a hashFunction does not need to be well distributed, as it is mixed before use.<BR>
+	/// Reading while another thread writes does not crash, since the array is only replaced by Reserve() and Clear(), but can return a wrong or missing result. Readers on other threads should check the result against the real data.
+	template <class key_type, unsigned long (*hashFunction)(const key_type &) >
+	class RAK_DLL_EXPORT FlatHashIndex
+	{
+	public:
+		/// Returned by GetIndex() for keys that are not in the table
+		static const unsigned int NOT_FOUND=(unsigned int) -1;
+
+		FlatHashIndex();
+		~FlatHashIndex();
+
+		/// \brief Allocates room for \a maxElements entries, and removes all entries
+		void Reserve(unsigned int maxElements, const char *file, unsigned int line);
+
+		/// \brief Adds \a key, or changes the index of \a key if already added
+		/// \param[in] index Any value other than NOT_FOUND
+		/// \return false if the table already has as many entries as were reserved
+		bool Set(const key_type &key, unsigned int index);
+
+		/// \return The index for \a key, or NOT_FOUND
+		unsigned int GetIndex(const key_type &key) const;
+
+		/// \return true if \a key was in the table
+		bool Remove(const key_type &key);
+
+		/// Removes all entries, keeping the memory
+		void RemoveAll(void);
+
+		/// Removes all entries, freeing the memory
+		void Clear(const char *file, unsigned int line);
+
+		/// \return How many entries are in the table
+		unsigned int Size(void) const {return numEntries;}
+
+	protected:
+		struct Slot
+		{
+			key_type key;
+			// NOT_FOUND for empty slots
+			unsigned int index;
+		};
+
+		unsigned int HomeSlot(const key_type &key) const
+		{
+			// Fibonacci hashing, so the high bits of the product, which depend on every bit of the hash, pick the slot
+			return (unsigned int) (((unsigned int) hashFunction(key) * 2654435769u) >> shift);
+		}
+
+		Slot *slots;
+		unsigned int mask;
+		unsigned int shift;
+		unsigned int numEntries;
+		unsigned int maxEntries;
+	};
+
+	template <class key_type, unsigned long (*hashFunction)(const key_type &) >
+	FlatHashIndex<key_type, hashFunction>::FlatHashIndex()
+	{
+		slots=0;
+		mask=0;
+		shift=0;
+		numEntries=0;
+		maxEntries=0;
+	}
+
+	template <class key_type, unsigned long (*hashFunction)(const key_type &) >
+	FlatHashIndex<key_type, hashFunction>::~FlatHashIndex()
+	{
+		Clear(_FILE_AND_LINE_);
+	}
+
+	template <class key_type, unsigned long (*hashFunction)(const key_type &) >
+	void FlatHashIndex<key_type, hashFunction>::Reserve(unsigned int maxElements, const char *file, unsigned int line)
+	{
+		Clear(file, line);
+
+		// At most half full, so probe sequences stay short
+		unsigned int numSlots=16;
+		shift=28;
+		while (numSlots < maxElements*2)
+		{
+			numSlots<<=1;
+			shift--;
+		}
+		slots=RakNet::OP_NEW_ARRAY<Slot>(numSlots, file, line);
+		mask=numSlots-1;
+		maxEntries=maxElements;
+		RemoveAll();
+	}
+
+	template <class key_type, unsigned long (*hashFunction)(const key_type &) >
+	bool FlatHashIndex<key_type, hashFunction>::Set(const key_type &key, unsigned int index)
+	{
+		RakAssert(index!=NOT_FOUND);
+		if (slots==0)
+			return false;
+
+		unsigned int slotIndex=HomeSlot(key);
+		while (slots[slotIndex].index!=NOT_FOUND)
+		{
+			if (slots[slotIndex].key==key)
+			{
+				slots[slotIndex].index=index;
+				return true;
+			}
+			slotIndex=(slotIndex+1)&mask;
+		}
+
+		if (numEntries==maxEntries)
+			return false;
+		// Write the key before the index, which is what marks the slot as used
+		slots[slotIndex].key=key;
+		slots[slotIndex].index=index;
+		numEntries++;
+		return true;
+	}
+
+	template <class key_type, unsigned long (*hashFunction)(const key_type &) >
+	unsigned int FlatHashIndex<key_type, hashFunction>::GetIndex(const key_type &key) const
+	{
+		if (slots==0)
+			return NOT_FOUND;
+
+		unsigned int slotIndex=HomeSlot(key);
+		unsigned int index;
+		while ((index=slots[slotIndex].index)!=NOT_FOUND)
+		{
+			if (slots[slotIndex].key==key)
+				return index;
+			slotIndex=(slotIndex+1)&mask;
+		}
+		return NOT_FOUND;
+	}
+
+	template <class key_type, unsigned long (*hashFunction)(const key_type &) >
+	bool FlatHashIndex<key_type, hashFunction>::Remove(const key_type &key)
+	{
+		if (slots==0)
+			return false;
+
+		unsigned int slotIndex=HomeSlot(key);
+		while (slots[slotIndex].key!=key)
+		{
+			if (slots[slotIndex].index==NOT_FOUND)
+				return false;
+			slotIndex=(slotIndex+1)&mask;
+		}
+		if (slots[slotIndex].index==NOT_FOUND)
+			return false;
+
+		// Move back any later entry that could not be placed in its home slot because this slot was in use, so probing still reaches it
+		unsigned int emptySlot=slotIndex;
+		unsigned int nextSlot=slotIndex;
+		for (;;)
+		{
+			nextSlot=(nextSlot+1)&mask;
+			if (slots[nextSlot].index==NOT_FOUND)
+				break;
+			unsigned int homeSlot=HomeSlot(slots[nextSlot].key);
+			// Distance from home to where it is now, against distance from home to the empty slot. Move it if the empty slot is on the way.
+			if (((nextSlot-homeSlot)&mask) >= ((nextSlot-emptySlot)&mask))
+			{
+				slots[emptySlot].key=slots[nextSlot].key;
+				slots[emptySlot].index=slots[nextSlot].index;
+				emptySlot=nextSlot;
+			}
+		}
+		slots[emptySlot].index=NOT_FOUND;
+		numEntries--;
+		return true;
+	}
+
+	template <class key_type, unsigned long (*hashFunction)(const key_type &) >
+	void FlatHashIndex<key_type, hashFunction>::RemoveAll(void)
+	{
+		if (slots)
+		{
+			for (unsigned int i=0; i <= mask; i++)
+				slots[i].index=NOT_FOUND;
+		}
+		numEntries=0;
+	}
+
+	template <class key_type, unsigned long (*hashFunction)(const key_type &) >
+	void FlatHashIndex<key_type, hashFunction>::Clear(const char *file, unsigned int line)
+	{
+		if (slots)
+			RakNet::OP_DELETE_ARRAY(slots, file, line);
+		slots=0;
+		mask=0;
+		shift=0;
+		numEntries=0;
+		maxEntries=0;
+	}
+}
+
+#endif
@@ -560,6 +560,7 @@ Table::FilterQuery::~FilterQuery()
 }
 Table::FilterQuery::FilterQuery(unsigned column, Cell *cell, FilterQueryType op)
 {
+	columnName[0]=0;
 	columnIndex=column;
 	cellValue=cell;
 	operation=op;
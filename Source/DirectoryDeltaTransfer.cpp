@@ -21,6 +21,9 @@
 #include "MessageIdentifiers.h"
 #include "FileOperations.h"
 #include "IncrementalReadInterface.h"
+#include "BlockDelta.h"
+#include "LinuxStrings.h"
+#include <stdio.h>
 
 using namespace RakNet;
 
@@ -46,7 +49,10 @@ public:
 		{
 			strcpy(fullPathToDir, outputSubdir);
 			strcat(fullPathToDir, onFileStruct->fileName+subdirLen);
-			WriteFileWithDirectories(fullPathToDir, (char*)onFileStruct->fileData, (unsigned int ) onFileStruct->byteLengthOfThisFile);
+			if (onFileStruct->context.op==DDT_BLOCK_DELTA)
+				ApplyBlockDelta(fullPathToDir, onFileStruct);
+			else
+				WriteFileWithDirectories(fullPathToDir, (char*)onFileStruct->fileData, (unsigned int ) onFileStruct->byteLengthOfThisFile);
 		}
 		else
 			fullPathToDir[0]=0;
@@ -72,6 +78,25 @@ public:
 	{
 		return onFileCallback->OnDownloadComplete(dcs);
 	}
+
+	void ApplyBlockDelta(const char *fullPathToFile, OnFileStruct *onFileStruct)
+	{
+		// Rebuilt beside the old file, which is only replaced once the result is known to be right
+		char tempPath[1024];
+		strcpy(tempPath, fullPathToFile);
+		strcat(tempPath, ".ddtpart");
+		if (BlockDelta::ApplyDelta(fullPathToFile, onFileStruct->fileData, (uint32_t) onFileStruct->byteLengthOfThisFile, tempPath))
+		{
+#ifdef _WIN32
+			// rename() does not replace files here
+			remove(fullPathToFile);
+#endif
+			if (rename(tempPath, fullPathToFile)==0)
+				return;
+			remove(tempPath);
+		}
+		onFileStruct->context.op=DDT_BLOCK_DELTA_FAILED;
+	}
 };
 
 STATIC_FACTORY_DEFINITIONS(DirectoryDeltaTransfer,DirectoryDeltaTransfer);
@@ -84,6 +109,9 @@ DirectoryDeltaTransfer::DirectoryDeltaTransfer()
 	priority=HIGH_PRIORITY;
 	orderingChannel=0;
 	incrementalReadInterface=0;
+	hashThreadCount=1;
+	hashCache=0;
+	blockDeltaMinimumFileLength=0;
 }
 DirectoryDeltaTransfer::~DirectoryDeltaTransfer()
 {
@@ -174,6 +202,7 @@ unsigned short DirectoryDeltaTransfer::DownloadFromSubdirectory(FileList &localF
 	StringCompressor::Instance()->EncodeString(subdir, 256, &outBitstream);
 	StringCompressor::Instance()->EncodeString(outputSubdir, 256, &outBitstream);
 	localFiles.Serialize(&outBitstream);
+	WriteBlockSignatures(localFiles, &outBitstream);
 	SendUnified(&outBitstream, _priority, RELIABLE_ORDERED, _orderingChannel, host, false);
 
 	return setId;
@@ -181,14 +210,32 @@ unsigned short DirectoryDeltaTransfer::DownloadFromSubdirectory(FileList &localF
 unsigned short DirectoryDeltaTransfer::DownloadFromSubdirectory(const char *subdir, const char *outputSubdir, bool prependAppDirToOutputSubdir, SystemAddress host, FileListTransferCBInterface *onFileCallback, PacketPriority _priority, char _orderingChannel, FileListProgress *cb)
 {
 	FileList localFiles;
+	localFiles.SetThreadCount(hashThreadCount);
+	localFiles.SetHashCache(hashCache);
 	// Get a hash of all the files that we already have (if any)
 	localFiles.AddFilesFromDirectory(prependAppDirToOutputSubdir ? applicationDirectory : 0, outputSubdir, true, false, true, FileListNodeContext(0,0,0,0));
 	return DownloadFromSubdirectory(localFiles, subdir, outputSubdir, prependAppDirToOutputSubdir, host, onFileCallback, _priority, _orderingChannel, cb);
 }
 void DirectoryDeltaTransfer::GenerateHashes(FileList &localFiles, const char *outputSubdir, bool prependAppDirToOutputSubdir)
 {
+	localFiles.SetThreadCount(hashThreadCount);
+	localFiles.SetHashCache(hashCache);
 	localFiles.AddFilesFromDirectory(prependAppDirToOutputSubdir ? applicationDirectory : 0, outputSubdir, true, false, true, FileListNodeContext(0,0,0,0));
 }
+void DirectoryDeltaTransfer::SetHashThreadCount(int count)
+{
+	hashThreadCount=count;
+	availableUploads->SetThreadCount(count);
+}
+void DirectoryDeltaTransfer::SetHashCache(FileListHashCache *cache)
+{
+	hashCache=cache;
+	availableUploads->SetHashCache(cache);
+}
+void DirectoryDeltaTransfer::SetBlockDeltaMinimumFileLength(unsigned int minimumFileLength)
+{
+	blockDeltaMinimumFileLength=minimumFileLength;
+}
 void DirectoryDeltaTransfer::ClearUploads(void)
 {
 	availableUploads->Clear();
@@ -213,15 +260,120 @@ void DirectoryDeltaTransfer::OnDownloadRequest(Packet *packet)
 		return;
 	}
 
+	// Sent after the file list by systems that use SetBlockDeltaMinimumFileLength()
+	DataStructures::List<RakString> signatureFilenames;
+	DataStructures::List<BlockSignatures*> signatures;
+	bool hasSignatures=false;
+	unsigned int signatureCount=0, i;
+	if (inBitstream.Read(hasSignatures) && hasSignatures && inBitstream.ReadCompressed(signatureCount))
+	{
+		char filename[512];
+		for (i=0; i < signatureCount; i++)
+		{
+			BlockSignatures *blockSignatures = RakNet::OP_NEW<BlockSignatures>(_FILE_AND_LINE_);
+			if (StringCompressor::Instance()->DecodeString(filename, 512, &inBitstream)==false ||
+				blockSignatures->Deserialize(&inBitstream)==false)
+			{
+				RakNet::OP_DELETE(blockSignatures, _FILE_AND_LINE_);
+				break;
+			}
+			signatureFilenames.Push(RakString(filename), _FILE_AND_LINE_);
+			signatures.Push(blockSignatures, _FILE_AND_LINE_);
+		}
+	}
+
 	availableUploads->GetDeltaToCurrent(&remoteFileHash, &delta, subdir, remoteSubdir);
+	FileList blockDeltas;
+	if (signatures.Size()>0)
+		GetBlockDeltas(&delta, &blockDeltas, subdir, remoteSubdir, signatureFilenames, signatures);
+	for (i=0; i < signatures.Size(); i++)
+		RakNet::OP_DELETE(signatures[i], _FILE_AND_LINE_);
+
 	if (incrementalReadInterface==0)
 		delta.PopulateDataFromDisk(applicationDirectory, true, false, true);
 	else
 		delta.FlagFilesAsReferences();
+	// Deltas are sent from memory, so are only added now
+	for (i=0; i < blockDeltas.fileList.Size(); i++)
+		delta.fileList.Push(blockDeltas.fileList[i], _FILE_AND_LINE_);
+	blockDeltas.fileList.Clear(false, _FILE_AND_LINE_);
 
 	// This will call the ddtCallback interface that was passed to FileListTransfer::SetupReceive on the remote system
 	fileListTransfer->Send(&delta, rakPeerInterface, packet->systemAddress, setId, priority, orderingChannel, incrementalReadInterface, chunkSize);
 }
+void DirectoryDeltaTransfer::WriteBlockSignatures(FileList &localFiles, RakNet::BitStream *outBitstream)
+{
+	outBitstream->Write(blockDeltaMinimumFileLength>0);
+	if (blockDeltaMinimumFileLength==0)
+		return;
+
+	RakNet::BitStream signaturesBitstream;
+	BlockSignatures blockSignatures;
+	unsigned int signatureCount=0;
+	for (unsigned int i=0; i < localFiles.fileList.Size(); i++)
+	{
+		const FileListNode &node = localFiles.fileList[i];
+		if (node.fileLengthBytes < blockDeltaMinimumFileLength ||
+			BlockDelta::GetSignatures(node.fullPathToFile.C_String(), &blockSignatures)==false ||
+			blockSignatures.weakChecksums.Size()==0)
+			continue;
+		StringCompressor::Instance()->EncodeString(node.filename.C_String(), 512, &signaturesBitstream);
+		blockSignatures.Serialize(&signaturesBitstream);
+		signatureCount++;
+	}
+	outBitstream->WriteCompressed(signatureCount);
+	outBitstream->Write(&signaturesBitstream);
+}
+void DirectoryDeltaTransfer::GetBlockDeltas(FileList *delta, FileList *blockDeltas, const char *subdir, const char *remoteSubdir, const DataStructures::List<RakString> &signatureFilenames, const DataStructures::List<BlockSignatures*> &signatures)
+{
+	// Remote filenames are matched to local ones as in FileList::GetDeltaToCurrent()
+	unsigned int dirSubsetLen, remoteSubdirLen;
+	if (subdir)
+		dirSubsetLen = (unsigned int) strlen(subdir);
+	else
+		dirSubsetLen = 0;
+	if (remoteSubdir && remoteSubdir[0])
+	{
+		remoteSubdirLen=(unsigned int) strlen(remoteSubdir);
+		if (remoteSubdir[remoteSubdirLen-1]=='/' || remoteSubdir[remoteSubdirLen-1]=='\\')
+			remoteSubdirLen--;
+	}
+	else
+		remoteSubdirLen=0;
+
+	char fullPath[1024];
+	unsigned int deltaIndex=0, signatureIndex;
+	while (deltaIndex < delta->fileList.Size())
+	{
+		const FileListNode &node = delta->fileList[deltaIndex];
+		for (signatureIndex=0; signatureIndex < signatures.Size(); signatureIndex++)
+		{
+			if (signatureFilenames[signatureIndex].GetLength() >= remoteSubdirLen &&
+				node.filename.GetLength() >= dirSubsetLen &&
+				_stricmp(signatureFilenames[signatureIndex].C_String()+remoteSubdirLen, node.filename.C_String()+dirSubsetLen)==0)
+				break;
+		}
+		if (signatureIndex==signatures.Size())
+		{
+			deltaIndex++;
+			continue;
+		}
+
+		// Not worth rebuilding the file from a delta nearly as long
+		strcpy(fullPath, applicationDirectory);
+		strcat(fullPath, node.filename.C_String());
+		RakNet::BitStream blockDelta;
+		if (BlockDelta::GetDelta(*signatures[signatureIndex], fullPath, &blockDelta, node.fileLengthBytes - node.fileLengthBytes/4)==false)
+		{
+			deltaIndex++;
+			continue;
+		}
+		unsigned char *data;
+		unsigned int dataLength = blockDelta.CopyData(&data) >> 3;
+		blockDeltas->AddFile(node.filename.C_String(), node.fullPathToFile.C_String(), (const char *) data, dataLength, dataLength, FileListNodeContext(DDT_BLOCK_DELTA, node.fileLengthBytes, 0, 0), false, true);
+		delta->fileList.RemoveAtIndex(deltaIndex);
+	}
+}
 PluginReceiveResult DirectoryDeltaTransfer::OnReceive(Packet *packet)
 {
 	switch (packet->data[0]) 
@@ -26,6 +26,8 @@
 #include "PluginInterface2.h"
 #include "DS_Map.h"
 #include "PacketPriority.h"
+#include "DS_List.h"
+#include "RakString.h"
 
 /// \defgroup DIRECTORY_DELTA_TRANSFER_GROUP DirectoryDeltaTransfer
 /// \brief Simple class to send changes between directories
@@ -59,7 +61,21 @@ struct DownloadRequest;
 class FileListTransfer;
 class FileListTransferCBInterface;
 class FileListProgress;
+class FileListHashCache;
 class IncrementalReadInterface;
+class BitStream;
+struct BlockSignatures;
+
+/// Set as FileListNodeContext::op of the files DirectoryDeltaTransfer sends
+enum DirectoryDeltaTransferFileOp
+{
+	/// The whole file
+	DDT_WHOLE_FILE,
+	/// What changed from the local file. See DirectoryDeltaTransfer::SetBlockDeltaMinimumFileLength()
+	DDT_BLOCK_DELTA,
+	/// What changed from the local file, which did not rebuild the file sent. The local file was left as it was
+	DDT_BLOCK_DELTA_FAILED
+};
 
 class RAK_DLL_EXPORT DirectoryDeltaTransfer : public PluginInterface2
 {
@@ -150,11 +166,29 @@ public:
 	/// \param[in] _incrementalReadInterface If a file in \a fileList has no data, filePullInterface will be used to read the file in chunks of size \a chunkSize
 	/// \param[in] _chunkSize How large of a block of a file to send at once
 	void SetDownloadRequestIncrementalReadInterface(IncrementalReadInterface *_incrementalReadInterface, unsigned int _chunkSize);
+
+	/// \brief Read and hash files on this many threads, in AddUploadsFromSubdirectory(), GenerateHashes() and DownloadFromSubdirectory()
+	/// \details See FileList::SetThreadCount(). Defaults to 1
+	void SetHashThreadCount(int count);
+
+	/// \brief Look up hashes of files in \a cache before reading them, in AddUploadsFromSubdirectory(), GenerateHashes() and DownloadFromSubdirectory()
+	/// \details See FileList::SetHashCache(). Save the cache before exiting, and load it when starting, so files unchanged since are not read again
+	/// \param[in] cache Held internally, so should remain valid as long as this class uses it. 0 to not use one, which is the default
+	void SetHashCache(FileListHashCache *cache);
+
+	/// \brief Only download what changed in local files at least this long, rather than the whole file, in DownloadFromSubdirectory()
+	/// \details Signatures of each block of these files go with the download request. The remote system finds which blocks are still in its version of each file, and sends the rest, if that is shorter than the file. See BlockDelta.
+	/// Making the signatures reads the local files, so this is worth it for large files that change a little, such as asset packs. Remote systems that do not support it send whole files.
+	/// For files sent this way, OnFileStruct::context.op is DDT_BLOCK_DELTA and OnFileStruct::fileData holds the delta, not the file, which was already rebuilt on disk. If the rebuilt file is not the one sent, the local file is left as it was and context.op is DDT_BLOCK_DELTA_FAILED
+	/// \param[in] minimumFileLength 0 to always download whole files, which is the default
+	void SetBlockDeltaMinimumFileLength(unsigned int minimumFileLength);
 	
 	/// \internal For plugin handling
 	virtual PluginReceiveResult OnReceive(Packet *packet);
 protected:
 	void OnDownloadRequest(Packet *packet);
+	void WriteBlockSignatures(FileList &localFiles, RakNet::BitStream *outBitstream);
+	void GetBlockDeltas(FileList *delta, FileList *blockDeltas, const char *subdir, const char *remoteSubdir, const DataStructures::List<RakString> &signatureFilenames, const DataStructures::List<BlockSignatures*> &signatures);
 
 	char applicationDirectory[512];
 	FileListTransfer *fileListTransfer;
@@ -163,6 +197,9 @@ protected:
 	char orderingChannel;
 	IncrementalReadInterface *incrementalReadInterface;
 	unsigned int chunkSize;
+	int hashThreadCount;
+	FileListHashCache *hashCache;
+	unsigned int blockDeltaMinimumFileLength;
 };
 
 } // namespace RakNet
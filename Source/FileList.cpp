@@ -29,6 +29,9 @@
 #ifdef _WIN32 
 // For mkdir
 #include <direct.h>
+// For stat
+#include <sys/types.h>
+#include <sys/stat.h>
 
 
 #else
@@ -43,9 +46,23 @@
 #include "SuperFastHash.h"
 #include "RakAssert.h"
 #include "LinuxStrings.h"
+#include "ThreadPool.h"
+#include "RakSleep.h"
 
 #define MAX_FILENAME_LENGTH 512
 static const unsigned HASH_LENGTH=4;
+// SuperFastHash() and SuperFastHashFile() hash files in blocks of this length
+static const unsigned int HASH_BLOCK_LENGTH=65536;
+// Files only hashed are read this much at a time, straight into our buffer rather than through that of stdio
+static const unsigned int HASH_READ_LENGTH=HASH_BLOCK_LENGTH*16;
+// Bytes of file data read ahead of the first file not yet taken, which bounds the memory used for it. A larger file is still read when it is taken
+static const uint64_t MAX_BYTES_READ_AHEAD=64*1024*1024;
+// Files queued ahead of the first not yet taken, which bounds how far TakeInput() searches
+static const unsigned int MAX_FILES_READ_AHEAD=256;
+// Starting and stopping threads takes longer than reading fewer files
+static const unsigned int MIN_FILES_FOR_THREADS=256;
+// First in what FileListHashCache::Save() writes
+static const unsigned int HASH_CACHE_VERSION=0x52484331;
 
 using namespace RakNet;
 
@@ -77,11 +94,311 @@ using namespace RakNet;
 STATIC_FACTORY_DEFINITIONS(FileListProgress,FileListProgress)
 STATIC_FACTORY_DEFINITIONS(FLP_Printf,FLP_Printf)
 STATIC_FACTORY_DEFINITIONS(FileList,FileList)
+STATIC_FACTORY_DEFINITIONS(FileListHashCache,FileListHashCache)
 
 #ifdef _MSC_VER
 #pragma warning( push )
 #endif
 
+// A file to read, hash, or both, on the calling thread or on one of a ThreadPool
+struct FileReadJob
+{
+	RakString fullPath;
+	// Index of the file in the list compared with
+	unsigned int index;
+	unsigned int fileLength;
+	uint64_t modifiedTime;
+	bool readData;
+	bool writeHash;
+	// data and hash are set, by reading the file or from FileListHashCache
+	bool done;
+	bool readFailed;
+	// Prefixed with HASH_LENGTH bytes for the hash if writeHash is also true
+	char *data;
+	unsigned int hash;
+};
+
+static void ReadFile(FileReadJob *job)
+{
+	FILE *fp = fopen(job->fullPath.C_String(), "rb");
+	if (fp==0)
+	{
+		// As returned by SuperFastHashFile()
+		job->hash=0;
+		job->readFailed=true;
+		return;
+	}
+	// Reads are large, so copying through the buffer of stdio would only cost time
+	setvbuf(fp, 0, _IONBF, 0);
+
+	if (job->readData)
+	{
+		unsigned int offset = job->writeHash ? HASH_LENGTH : 0;
+		job->data = (char*) rakMalloc_Ex( job->fileLength+offset, _FILE_AND_LINE_ );
+		RakAssert(job->data);
+		fread(job->data+offset, job->fileLength, 1, fp);
+		if (job->writeHash)
+			job->hash = SuperFastHash(job->data+offset, job->fileLength);
+	}
+	else if (job->writeHash)
+	{
+		// Same as SuperFastHashFilePtr(), with fewer and larger reads
+		fseek(fp, 0, SEEK_END);
+		unsigned int bytesRemaining = (unsigned int) ftell(fp);
+		fseek(fp, 0, SEEK_SET);
+		job->hash = bytesRemaining;
+		if (bytesRemaining>0)
+		{
+			char *buffer = (char*) rakMalloc_Ex( bytesRemaining < HASH_READ_LENGTH ? bytesRemaining : HASH_READ_LENGTH, _FILE_AND_LINE_ );
+			RakAssert(buffer);
+			while (bytesRemaining>0)
+			{
+				unsigned int readLength = bytesRemaining < HASH_READ_LENGTH ? bytesRemaining : HASH_READ_LENGTH;
+				fread(buffer, readLength, 1, fp);
+				for (unsigned int offset=0; offset < readLength; offset+=HASH_BLOCK_LENGTH)
+					job->hash = SuperFastHashIncremental(buffer+offset, readLength-offset < HASH_BLOCK_LENGTH ? readLength-offset : HASH_BLOCK_LENGTH, job->hash);
+				bytesRemaining-=readLength;
+			}
+			rakFree_Ex(buffer, _FILE_AND_LINE_ );
+		}
+	}
+	fclose(fp);
+}
+
+static FileReadJob* ReadFileCB(FileReadJob *job, bool *returnOutput, void* perThreadData)
+{
+	(void) perThreadData;
+	ReadFile(job);
+	*returnOutput=true;
+	return job;
+}
+
+// Reads files on the threads of a ThreadPool ahead of the calling thread, which takes them in the order listed
+class FileReader
+{
+public:
+	FileReader(DataStructures::List<FileReadJob*> &_jobs, int threadCount, FileListHashCache *_hashCache) : jobs(_jobs)
+	{
+		hashCache=_hashCache;
+		nextToRead=0;
+		nextToTake=0;
+		bytesReadAhead=0;
+		unsigned int numToRead=0;
+		for (unsigned int i=0; i < jobs.Size(); i++)
+		{
+			FileReadJob *job = jobs[i];
+			if (hashCache && job->done==false && job->writeHash && job->readData==false &&
+				hashCache->GetHash(job->fullPath.C_String(), job->fileLength, job->modifiedTime, &job->hash))
+				job->done=true;
+			if (job->done==false)
+				numToRead++;
+		}
+		useThreads = threadCount > 1 && numToRead >= MIN_FILES_FOR_THREADS;
+		if (useThreads)
+			threadPool.StartThreads(threadCount < (int) numToRead ? threadCount : (int) numToRead, 0);
+	}
+	~FileReader()
+	{
+		threadPool.StopThreads();
+	}
+	// Blocks until the next file is read. 0 once all were taken
+	FileReadJob *TakeNext(void)
+	{
+		if (nextToTake==jobs.Size())
+			return 0;
+		FileReadJob *job = jobs[nextToTake++];
+		if (useThreads)
+		{
+			if (job->readData && nextToTake <= nextToRead)
+				bytesReadAhead-=job->fileLength;
+			while (nextToRead < jobs.Size() && nextToRead < nextToTake+MAX_FILES_READ_AHEAD)
+			{
+				FileReadJob *readJob = jobs[nextToRead];
+				// Only files whose data is kept count. The one being taken is not ahead of anything
+				if (readJob->readData && nextToRead >= nextToTake)
+				{
+					if (bytesReadAhead+readJob->fileLength > MAX_BYTES_READ_AHEAD)
+						break;
+					bytesReadAhead+=readJob->fileLength;
+				}
+				if (readJob->done==false)
+					threadPool.AddInput(ReadFileCB, readJob);
+				nextToRead++;
+			}
+			while (job->done==false)
+			{
+				if (threadPool.HasOutput())
+				{
+					threadPool.GetOutput()->done=true;
+					continue;
+				}
+				// Read here rather than wait
+				FileReadJob *queuedJob = TakeInput(job);
+				if (queuedJob)
+				{
+					ReadFile(queuedJob);
+					queuedJob->done=true;
+				}
+				else
+					RakSleep(1);
+			}
+		}
+		else if (job->done==false)
+		{
+			ReadFile(job);
+			job->done=true;
+		}
+		if (hashCache && job->writeHash && job->readData==false && job->readFailed==false)
+			hashCache->SetHash(job->fullPath.C_String(), job->fileLength, job->modifiedTime, job->hash);
+		return job;
+	}
+
+protected:
+	// Removes \a job from the input of the threads if none started on it yet, otherwise the last one added. 0 if none are left
+	FileReadJob *TakeInput(FileReadJob *job)
+	{
+		FileReadJob *queuedJob=0;
+		threadPool.LockInput();
+		unsigned int i, inputSize=threadPool.InputSize();
+		for (i=0; i < inputSize; i++)
+		{
+			if (threadPool.GetInputAtIndex(i)==job)
+				break;
+		}
+		if (i==inputSize && inputSize>0)
+			i=inputSize-1;
+		if (i < inputSize)
+		{
+			queuedJob=threadPool.GetInputAtIndex(i);
+			threadPool.RemoveInputAtIndex(i);
+		}
+		threadPool.UnlockInput();
+		return queuedJob;
+	}
+
+	DataStructures::List<FileReadJob*> &jobs;
+	FileListHashCache *hashCache;
+	ThreadPool<FileReadJob*, FileReadJob*> threadPool;
+	bool useThreads;
+	unsigned int nextToRead, nextToTake;
+	// fileLength of the files between nextToTake and nextToRead whose data is kept
+	uint64_t bytesReadAhead;
+};
+
+// Names added from one list or directory are unique, so AddFile() only needs to look for a file to replace if the name was already there
+typedef DataStructures::Hash<RakString, bool, 4096, RakString::ToInteger> FilenameSet;
+static void GetFilenames(const FileList *fileList, FilenameSet *filenames)
+{
+	for (unsigned int i=0; i < fileList->fileList.Size(); i++)
+		filenames->Push(fileList->fileList[i].filename, true, _FILE_AND_LINE_);
+}
+
+static bool GetFileLengthAndTime(const char *path, unsigned int *fileLength, uint64_t *modifiedTime)
+{
+	struct stat fileStat;
+	if (stat(path, &fileStat)!=0)
+		return false;
+	*fileLength=(unsigned int) fileStat.st_size;
+	*modifiedTime=(uint64_t) fileStat.st_mtime;
+	return true;
+}
+
+FileListHashCache::FileListHashCache()
+{
+}
+FileListHashCache::~FileListHashCache()
+{
+	Clear();
+}
+bool FileListHashCache::Load(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (fp==0)
+		return false;
+	fseek(fp, 0, SEEK_END);
+	long length = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if (length<=0)
+	{
+		fclose(fp);
+		return false;
+	}
+	unsigned char *data = (unsigned char*) rakMalloc_Ex( length, _FILE_AND_LINE_ );
+	RakAssert(data);
+	bool success = fread(data, length, 1, fp)==1;
+	fclose(fp);
+
+	RakNet::BitStream bs(data, (unsigned int) length, false);
+	unsigned int version=0, count=0;
+	success = success && bs.Read(version) && version==HASH_CACHE_VERSION && bs.Read(count);
+	RakString fullPath;
+	Entry entry;
+	for (unsigned int i=0; success && i < count; i++)
+	{
+		success = fullPath.Deserialize(&bs) && bs.Read(entry.fileLength) && bs.Read(entry.modifiedTime) && bs.Read(entry.hash);
+		if (success)
+			SetHash(fullPath.C_String(), entry.fileLength, entry.modifiedTime, entry.hash);
+	}
+	rakFree_Ex(data, _FILE_AND_LINE_ );
+	return success;
+}
+bool FileListHashCache::Save(const char *path)
+{
+	DataStructures::List<Entry> itemList;
+	DataStructures::List<RakString> keyList;
+	entries.GetAsList(itemList, keyList, _FILE_AND_LINE_);
+	RakNet::BitStream bs;
+	bs.Write(HASH_CACHE_VERSION);
+	bs.Write(itemList.Size());
+	for (unsigned int i=0; i < itemList.Size(); i++)
+	{
+		keyList[i].Serialize(&bs);
+		bs.Write(itemList[i].fileLength);
+		bs.Write(itemList[i].modifiedTime);
+		bs.Write(itemList[i].hash);
+	}
+
+	FILE *fp = fopen(path, "wb");
+	if (fp==0)
+		return false;
+	bool success = fwrite(bs.GetData(), bs.GetNumberOfBytesUsed(), 1, fp)==1;
+	return fclose(fp)==0 && success;
+}
+bool FileListHashCache::GetHash(const char *fullPath, unsigned int fileLength, uint64_t modifiedTime, unsigned int *hash)
+{
+	Entry *entry = entries.Peek(fullPath);
+	if (entry==0 || entry->fileLength!=fileLength || entry->modifiedTime!=modifiedTime)
+		return false;
+	*hash=entry->hash;
+	return true;
+}
+void FileListHashCache::SetHash(const char *fullPath, unsigned int fileLength, uint64_t modifiedTime, unsigned int hash)
+{
+	Entry *entry = entries.Peek(fullPath);
+	if (entry==0)
+	{
+		Entry newEntry;
+		newEntry.fileLength=fileLength;
+		newEntry.modifiedTime=modifiedTime;
+		newEntry.hash=hash;
+		entries.Push(fullPath, newEntry, _FILE_AND_LINE_);
+	}
+	else
+	{
+		entry->fileLength=fileLength;
+		entry->modifiedTime=modifiedTime;
+		entry->hash=hash;
+	}
+}
+void FileListHashCache::Clear(void)
+{
+	entries.Clear(_FILE_AND_LINE_);
+}
+unsigned int FileListHashCache::Size(void) const
+{
+	return entries.Size();
+}
+
 /// First callback called when FileList::AddFilesFromDirectory() starts
 void FLP_Printf::OnAddFilesFromDirectoryStarted(FileList *fileList, char *dir) {
 	(void) fileList;
@@ -107,6 +424,8 @@ void FLP_Printf::OnSendAborted( SystemAddress systemAddress )
 }
 FileList::FileList()
 {
+	threadCount=1;
+	hashCache=0;
 }
 FileList::~FileList()
 {
@@ -193,6 +512,10 @@ void FileList::AddFile(const char *filename, const char *fullPathToFile, const c
 		}
 	}
 
+	InsertFile(filename, fullPathToFile, data, dataLength, fileLength, context, isAReference, takeDataPointer);
+}
+void FileList::InsertFile(const char *filename, const char *fullPathToFile, const char *data, const unsigned dataLength, const unsigned fileLength, FileListNodeContext context, bool isAReference, bool takeDataPointer)
+{
 	FileListNode n;
 //	size_t fileNameLen = strlen(filename);
 	if (dataLength && data)
@@ -229,12 +552,12 @@ void FileList::AddFilesFromDirectory(const char *applicationDirectory, const cha
 
 
 	DataStructures::Queue<char*> dirList;
+	DataStructures::List<FileReadJob*> jobs;
 	char root[260];
 	char fullPath[520];
 	_finddata_t fileInfo;
 	intptr_t dir;
-	FILE *fp;
-	char *dirSoFar, *fileData;
+	char *dirSoFar;
 	dirSoFar=(char*) rakMalloc_Ex( 520, _FILE_AND_LINE_ );
 	RakAssert(dirSoFar);
 
@@ -278,7 +601,9 @@ void FileList::AddFilesFromDirectory(const char *applicationDirectory, const cha
 			unsigned i;
 			for (i=0; i < dirList.Size(); i++)
 				rakFree_Ex(dirList[i], _FILE_AND_LINE_ );
-			return;
+			// Still add the files found so far
+			dirList.Clear(_FILE_AND_LINE_);
+			break;
 		}
 
 //		RAKNET_DEBUG_PRINTF("Adding %s. %i remaining.\n", fullPath, dirList.Size());
@@ -298,67 +623,24 @@ void FileList::AddFilesFromDirectory(const char *applicationDirectory, const cha
 			{
 				strcpy(fullPath, dirSoFar);
 				strcat(fullPath, fileInfo.name);
-				fileData=0;
 
 				for (unsigned int flpcIndex=0; flpcIndex < fileListProgressCallbacks.Size(); flpcIndex++)
 					fileListProgressCallbacks[flpcIndex]->OnFile(this, dirSoFar, fileInfo.name, fileInfo.size);
 
-				if (writeData && writeHash)
-				{
-					fp = fopen(fullPath, "rb");
-					if (fp)
-					{
-						fileData= (char*) rakMalloc_Ex( fileInfo.size+HASH_LENGTH, _FILE_AND_LINE_ );
-						RakAssert(fileData);
-						fread(fileData+HASH_LENGTH, fileInfo.size, 1, fp);
-						fclose(fp);
-
-						unsigned int hash = SuperFastHash(fileData+HASH_LENGTH, fileInfo.size);
-						if (RakNet::BitStream::DoEndianSwap())
-							RakNet::BitStream::ReverseBytesInPlace((unsigned char*) &hash, sizeof(hash));
-						memcpy(fileData, &hash, HASH_LENGTH);
-
-						//					sha1.Reset();
-						//					sha1.Update( ( unsigned char* ) fileData+HASH_LENGTH, fileInfo.size );
-						//					sha1.Final();
-						//					memcpy(fileData, sha1.GetHash(), HASH_LENGTH);
-						// File data and hash
-						AddFile((const char*)fullPath+rootLen, fullPath, fileData, fileInfo.size+HASH_LENGTH, fileInfo.size, context);
-					}					
-				}
-				else if (writeHash)
-				{
-//					sha1.Reset();
-//					DR_SHA1.hashFile((char*)fullPath);
-//					sha1.Final();
-
-					unsigned int hash = SuperFastHashFile(fullPath);
-					if (RakNet::BitStream::DoEndianSwap())
-						RakNet::BitStream::ReverseBytesInPlace((unsigned char*) &hash, sizeof(hash));
-
-					// Hash only
-				//	AddFile((const char*)fullPath+rootLen, (const char*)sha1.GetHash(), HASH_LENGTH, fileInfo.size, context);
-					AddFile((const char*)fullPath+rootLen, fullPath, (const char*)&hash, HASH_LENGTH, fileInfo.size, context);
-				}
-				else if (writeData)
-				{
-					fileData= (char*) rakMalloc_Ex( fileInfo.size, _FILE_AND_LINE_ );
-					RakAssert(fileData);
-					fp = fopen(fullPath, "rb");
-					fread(fileData, fileInfo.size, 1, fp);
-					fclose(fp);
-
-					// File data only
-					AddFile(fullPath+rootLen, fullPath, fileData, fileInfo.size, fileInfo.size, context);
-				}
-				else
-				{
-					// Just the filename
-					AddFile(fullPath+rootLen, fullPath, 0, 0, fileInfo.size, context);
-				}
-
-				if (fileData)
-					rakFree_Ex(fileData, _FILE_AND_LINE_ );
+				// Read once all directories are listed, so files can be read on other threads
+				FileReadJob *job = RakNet::OP_NEW<FileReadJob>( _FILE_AND_LINE_ );
+				job->fullPath=fullPath;
+				job->index=jobs.Size();
+				job->fileLength=fileInfo.size;
+				job->modifiedTime=(uint64_t) fileInfo.time_write;
+				job->readData=writeData;
+				job->writeHash=writeHash;
+				// Just the filename otherwise
+				job->done=writeData==false && writeHash==false;
+				job->readFailed=false;
+				job->data=0;
+				job->hash=0;
+				jobs.Insert(job, _FILE_AND_LINE_ );
 			}
 			else if ((fileInfo.attrib & _A_SUBDIR) && (fileInfo.attrib & (_A_HIDDEN | _A_SYSTEM))==0 && recursive)
 			{
@@ -376,6 +658,57 @@ void FileList::AddFilesFromDirectory(const char *applicationDirectory, const cha
 		rakFree_Ex(dirSoFar, _FILE_AND_LINE_ );
 	}
 
+	FilenameSet existingFilenames;
+	GetFilenames(this, &existingFilenames);
+	FileReader fileReader(jobs, threadCount, hashCache);
+	FileReadJob *job;
+	while ((job=fileReader.TakeNext())!=0)
+	{
+		const char *filename = job->fullPath.C_String()+rootLen;
+		bool checkDuplicates = existingFilenames.Size()>0 && existingFilenames.HasData(filename);
+		unsigned int hash = job->hash;
+		if (RakNet::BitStream::DoEndianSwap())
+			RakNet::BitStream::ReverseBytesInPlace((unsigned char*) &hash, sizeof(hash));
+
+		if (writeData)
+		{
+			// Not there anymore
+			if (job->readFailed==false)
+			{
+				unsigned int dataLength = job->fileLength;
+				if (writeHash)
+				{
+					// File data and hash
+					memcpy(job->data, &hash, HASH_LENGTH);
+					dataLength+=HASH_LENGTH;
+				}
+				if (checkDuplicates || dataLength==0 || strlen(filename)>MAX_FILENAME_LENGTH)
+				{
+					AddFile(filename, job->fullPath.C_String(), job->data, dataLength, job->fileLength, context);
+					rakFree_Ex(job->data, _FILE_AND_LINE_ );
+				}
+				else
+					InsertFile(filename, job->fullPath.C_String(), job->data, dataLength, job->fileLength, context, false, true);
+			}
+		}
+		else if (writeHash)
+		{
+			// Hash only
+			if (checkDuplicates)
+				AddFile(filename, job->fullPath.C_String(), (const char*)&hash, HASH_LENGTH, job->fileLength, context);
+			else
+				InsertFile(filename, job->fullPath.C_String(), (const char*)&hash, HASH_LENGTH, job->fileLength, context, false, false);
+		}
+		else
+		{
+			// Just the filename
+			if (checkDuplicates)
+				AddFile(filename, job->fullPath.C_String(), 0, 0, job->fileLength, context);
+			else
+				InsertFile(filename, job->fullPath.C_String(), 0, 0, job->fileLength, context, false, false);
+		}
+		RakNet::OP_DELETE(job, _FILE_AND_LINE_);
+	}
 }
 void FileList::Clear(void)
 {
@@ -544,61 +877,73 @@ void FileList::GetDeltaToCurrent(FileList *input, FileList *output, const char *
 }
 void FileList::ListMissingOrChangedFiles(const char *applicationDirectory, FileList *missingOrChangedFiles, bool alwaysWriteHash, bool neverWriteHash)
 {
-	unsigned fileLength;
-//	CSHA1 sha1;
-	FILE *fp;
 	char fullPath[512];
 	unsigned i;
-//	char *fileData;
+	DataStructures::List<FileReadJob*> jobs;
 
 	for (i=0; i < fileList.Size(); i++)
 	{
 		strcpy(fullPath, applicationDirectory);
 		FixEndingSlash(fullPath);
 		strcat(fullPath,fileList[i].filename);
-		fp=fopen(fullPath, "rb");
-		if (fp==0)
+		FileReadJob *job = RakNet::OP_NEW<FileReadJob>( _FILE_AND_LINE_ );
+		job->fullPath=fullPath;
+		job->index=i;
+		job->fileLength=0;
+		job->modifiedTime=0;
+		job->readData=false;
+		job->readFailed=false;
+		job->data=0;
+		job->hash=0;
+		if (GetFileLengthAndTime(fullPath, &job->fileLength, &job->modifiedTime)==false)
 		{
-			missingOrChangedFiles->AddFile(fileList[i].filename, fileList[i].fullPathToFile, 0, 0, 0, FileListNodeContext(0,0,0,0), false);
+			job->readFailed=true;
+			job->writeHash=false;
 		}
 		else
 		{
-			fseek(fp, 0, SEEK_END);
-			fileLength = ftell(fp);
-			fseek(fp, 0, SEEK_SET);
+			// Only hash if the length does not already tell the file changed
+			job->writeHash = job->fileLength == fileList[i].fileLengthBytes || alwaysWriteHash;
+		}
+		job->done=job->writeHash==false;
+		jobs.Insert(job, _FILE_AND_LINE_ );
+	}
 
-			if (fileLength != fileList[i].fileLengthBytes && alwaysWriteHash==false)
-			{
-				missingOrChangedFiles->AddFile(fileList[i].filename, fileList[i].fullPathToFile, 0, 0, fileLength, FileListNodeContext(0,0,0,0), false);
-			}
-			else
+	FilenameSet existingFilenames;
+	GetFilenames(missingOrChangedFiles, &existingFilenames);
+	FileReader fileReader(jobs, threadCount, hashCache);
+	FileReadJob *job;
+	while ((job=fileReader.TakeNext())!=0)
+	{
+		FileListNode *node = &fileList[job->index];
+		const char *data=0;
+		unsigned int dataLength=0, fileLength=0;
+		unsigned int hash = job->hash;
+		bool add=true;
+		if (job->readFailed==false)
+		{
+			fileLength=job->fileLength;
+			if (job->writeHash)
 			{
-
-//				fileData= (char*) rakMalloc_Ex( fileLength, _FILE_AND_LINE_ );
-//				fread(fileData, fileLength, 1, fp);
-
-//				sha1.Reset();
-//				sha1.Update( ( unsigned char* ) fileData, fileLength );
-//				sha1.Final();
-
-//				rakFree_Ex(fileData, _FILE_AND_LINE_ );
-
-				unsigned int hash = SuperFastHashFilePtr(fp);
 				if (RakNet::BitStream::DoEndianSwap())
 					RakNet::BitStream::ReverseBytesInPlace((unsigned char*) &hash, sizeof(hash));
-
-				//if (fileLength != fileList[i].fileLength || memcmp( sha1.GetHash(), fileList[i].data, HASH_LENGTH)!=0)
-				if (fileLength != fileList[i].fileLengthBytes || memcmp( &hash, fileList[i].data, HASH_LENGTH)!=0)
+				add = fileLength != node->fileLengthBytes || memcmp( &hash, node->data, HASH_LENGTH)!=0;
+				if (neverWriteHash==false)
 				{
-					if (neverWriteHash==false)
-					//	missingOrChangedFiles->AddFile((const char*)fileList[i].filename, (const char*)sha1.GetHash(), HASH_LENGTH, fileLength, 0);
-						missingOrChangedFiles->AddFile((const char*)fileList[i].filename, (const char*)fileList[i].fullPathToFile, (const char *) &hash, HASH_LENGTH, fileLength, FileListNodeContext(0,0,0,0), false);
-					else
-						missingOrChangedFiles->AddFile((const char*)fileList[i].filename, (const char*)fileList[i].fullPathToFile, 0, 0, fileLength, FileListNodeContext(0,0,0,0), false);
+					data=(const char *) &hash;
+					dataLength=HASH_LENGTH;
 				}
 			}
-			fclose(fp);
 		}
+
+		if (add)
+		{
+			if (existingFilenames.Size()>0 && existingFilenames.HasData(node->filename))
+				missingOrChangedFiles->AddFile(node->filename, node->fullPathToFile, data, dataLength, fileLength, FileListNodeContext(0,0,0,0), false);
+			else
+				missingOrChangedFiles->InsertFile(node->filename, node->fullPathToFile, data, dataLength, fileLength, FileListNodeContext(0,0,0,0), false, false);
+		}
+		RakNet::OP_DELETE(job, _FILE_AND_LINE_);
 	}
 }
 void FileList::PopulateDataFromDisk(const char *applicationDirectory, bool writeFileData, bool writeFileHash, bool removeUnknownFiles)
@@ -793,6 +1138,16 @@ void FileList::GetCallbacks(DataStructures::List<FileListProgress*> &callbacks)
 }
 
 
+void FileList::SetThreadCount(int count)
+{
+	if (count < 1)
+		count=1;
+	threadCount=count;
+}
+void FileList::SetHashCache(FileListHashCache *cache)
+{
+	hashCache=cache;
+}
 bool FileList::FixEndingSlash(char *str)
 {
 #ifdef _WIN32
@@ -20,6 +20,7 @@
 
 #include "Export.h"
 #include "DS_List.h"
+#include "DS_Hash.h"
 #include "RakMemoryOverride.h"
 #include "RakNetTypes.h"
 #include "FileListNodeContext.h"
@@ -152,6 +153,48 @@ public:
 	virtual void OnSendAborted( SystemAddress systemAddress );
 };
 
+/// \brief Remembers the hashes of files by path, length and modification time, so FileList does not read files again that did not change
+/// \details Set with FileList::SetHashCache(). Used when only the hash of a file is needed, by FileList::AddFilesFromDirectory() with \a writeData false and by FileList::ListMissingOrChangedFiles()
+class RAK_DLL_EXPORT FileListHashCache
+{
+public:
+	// GetInstance() and DestroyInstance(instance*)
+	STATIC_FACTORY_DECLARATIONS(FileListHashCache)
+
+	FileListHashCache();
+	virtual ~FileListHashCache();
+
+	/// \brief Adds the hashes written by Save(), for example on the previous run
+	/// \return false if \a path could not be read, or is not a hash cache
+	bool Load(const char *path);
+
+	/// \brief Writes all hashes to \a path
+	/// \return false if \a path could not be written
+	bool Save(const char *path);
+
+	/// \param[out] hash Hash of the file, as returned by SuperFastHashFile()
+	/// \return true if the hash of the file at \a fullPath is known, for this length and modification time
+	bool GetHash(const char *fullPath, unsigned int fileLength, uint64_t modifiedTime, unsigned int *hash);
+
+	/// Remembers the hash of the file at \a fullPath, replacing that of an earlier length or modification time
+	void SetHash(const char *fullPath, unsigned int fileLength, uint64_t modifiedTime, unsigned int hash);
+
+	/// Forget all hashes, for example of files since deleted
+	void Clear(void);
+
+	/// \return How many files hashes are known for
+	unsigned int Size(void) const;
+
+protected:
+	struct Entry
+	{
+		unsigned int fileLength;
+		uint64_t modifiedTime;
+		unsigned int hash;
+	};
+	DataStructures::Hash<RakNet::RakString, Entry, 65536, RakNet::RakString::ToInteger> entries;
+};
+
 class RAK_DLL_EXPORT FileList
 {
 public:
@@ -247,12 +290,26 @@ public:
 	/// \param[out] callbacks The list is set to the list of callbacks
 	void GetCallbacks(DataStructures::List<FileListProgress*> &callbacks);
 
+	/// \brief Read and hash files on this many threads, in AddFilesFromDirectory() and ListMissingOrChangedFiles()
+	/// \details Defaults to 1, which reads on the calling thread. Those functions still return when all files are read, and call FileListProgress on the calling thread
+	/// \param[in] count How many files are read at once. Disks that seek, or directories on the network, are usually fastest with 2 to 8
+	void SetThreadCount(int count);
+
+	/// \brief Look up hashes of files in \a cache before reading them, and add those read to it
+	/// \param[in] cache Held internally, so should remain valid as long as this class uses it. 0 to not use one, which is the default
+	void SetHashCache(FileListHashCache *cache);
+
 	// Here so you can read it, but don't modify it
 	DataStructures::List<FileListNode> fileList;
 
 	static bool FixEndingSlash(char *str);
 protected:
+	/// Same as AddFile(), without looking for a file of the same name to replace
+	void InsertFile(const char *filename, const char *fullPathToFile, const char *data, const unsigned dataLength, const unsigned fileLength, FileListNodeContext context, bool isAReference, bool takeDataPointer);
+
 	DataStructures::List<FileListProgress*> fileListProgressCallbacks;
+	int threadCount;
+	FileListHashCache *hashCache;
 };
 
 } // namespace RakNet
@@ -24,6 +24,17 @@
 #endif
 
 #include "GetTime.h"
+#include "SimpleMutex.h"
+
+#if (defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)) && !defined(_WIN32_WCE) && !defined(WINDOWS_PHONE_8) && !defined(WINDOWS_STORE_RT)
+#define GET_TIME_HAS_TSC 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+#endif
 
 
 
@@ -203,20 +214,303 @@ RakNet::TimeUS GetTimeUS_Linux( void )
 }
 #endif
 
-RakNet::TimeUS RakNet::GetTimeUS( void )
+static RakNet::TimeSource timeSource=RakNet::TIME_SOURCE_SYSTEM;
+// Added to the system time, so time does not go backwards when the time stamp counter ran ahead of the system clock and is abandoned
+static RakNet::TimeUS systemTimeOffset=0;
+static bool countTimeCalls=false;
+static uint64_t timeCallCount=0;
+
+static RakNet::SimpleMutex& GetTimeSourceMutex(void)
 {
+	static RakNet::SimpleMutex timeSourceMutex;
+	return timeSourceMutex;
+}
 
+static RakNet::TimeUS GetTimeUS_System( void )
+{
+#if   defined(_WIN32)
+	return GetTimeUS_Windows()+systemTimeOffset;
+#else
+	return GetTimeUS_Linux()+systemTimeOffset;
+#endif
+}
 
+// The time for TIME_SOURCE_CACHED. Written to the slot readers are not using, then made current, so readers never see half of a 64 bit write
+static volatile RakNet::TimeUS cachedTimes[2]={0,0};
+static volatile int cachedTimeIndex=0;
+static unsigned int cachedTimeReads=0;
 
+static void UpdateCachedTime( void )
+{
+	RakNet::TimeUS time=GetTimeUS_System();
+	GetTimeSourceMutex().Lock();
+	if (time > cachedTimes[cachedTimeIndex])
+	{
+		cachedTimes[cachedTimeIndex^1]=time;
+		cachedTimeIndex^=1;
+	}
+	GetTimeSourceMutex().Unlock();
+}
 
+static RakNet::TimeUS GetTimeUS_Cached( void )
+{
+	// Not thread safe, but a lost count only delays a refresh
+	if ((++cachedTimeReads & 255)==0)
+		UpdateCachedTime();
+	return cachedTimes[cachedTimeIndex];
+}
 
+// The clock for TIME_SOURCE_VIRTUAL. Written to the slot readers are not using, then made current
+struct VirtualClock
+{
+	RakNet::TimeUS baseVirtualTime;
+	RakNet::TimeUS baseSystemTime;
+	double scale;
+};
+static VirtualClock virtualClocks[2];
+static volatile int virtualClockIndex=0;
+
+static RakNet::TimeUS GetTimeUS_Virtual( void )
+{
+	const VirtualClock &clock=virtualClocks[virtualClockIndex];
+	if (clock.scale==0.0)
+		return clock.baseVirtualTime;
+	RakNet::TimeUS systemTime=GetTimeUS_System();
+	if (systemTime <= clock.baseSystemTime)
+		return clock.baseVirtualTime;
+	return clock.baseVirtualTime + (RakNet::TimeUS) ((double) (systemTime-clock.baseSystemTime) * clock.scale);
+}
 
-#if   defined(_WIN32)
-	return GetTimeUS_Windows();
+// Restarts the virtual clock from now, so changing the scale or jumping ahead does not move time backwards
+static void SetVirtualClock(RakNet::TimeUS virtualTime, double scale)
+{
+	VirtualClock &next=virtualClocks[virtualClockIndex^1];
+	next.baseVirtualTime=virtualTime;
+	next.baseSystemTime=GetTimeUS_System();
+	next.scale=scale;
+	virtualClockIndex^=1;
+}
+
+#if defined(GET_TIME_HAS_TSC)
+// Compare the time stamp counter to the system clock this often
+static const RakNet::TimeUS TSC_CHECK_INTERVAL_US=1000000;
+// Give up on the time stamp counter if it is this far from the system clock
+static const int64_t TSC_MAX_ERROR_US=50000;
+
+struct TSCCalibration
+{
+	uint64_t baseTicks;
+	RakNet::TimeUS baseTime;
+	double microsecondsPerTick;
+};
+// Written to the slot readers are not using, then made current
+static TSCCalibration tscCalibrations[2];
+static volatile int tscCalibrationIndex=0;
+// Where calibration started. The rate is measured over all the time since
+static uint64_t tscFirstTicks;
+static RakNet::TimeUS tscFirstTime;
+// Ticks in TSC_CHECK_INTERVAL_US
+static int64_t tscCheckTicks;
+
+static uint64_t ReadTSC( void )
+{
+	return __rdtsc();
+}
+
+// Without an invariant counter, the rate changes with power states, and the counter can stop
+static bool HasInvariantTSC( void )
+{
+#if defined(_MSC_VER)
+	int registers[4];
+	__cpuid(registers, 0x80000000);
+	if ((unsigned int) registers[0] < 0x80000007)
+		return false;
+	__cpuid(registers, 0x80000007);
+	return (registers[3] & (1<<8))!=0;
 #else
-	return GetTimeUS_Linux();
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx)==0 || eax < 0x80000007)
+		return false;
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)==0)
+		return false;
+	return (edx & (1<<8))!=0;
 #endif
 }
+
+static RakNet::TimeUS TicksToTime(const TSCCalibration &calibration, uint64_t ticks)
+{
+	// Another core's counter can be slightly behind the one the calibration was read on
+	int64_t elapsedTicks=(int64_t) (ticks-calibration.baseTicks);
+	if (elapsedTicks<0)
+		elapsedTicks=0;
+	return calibration.baseTime + (RakNet::TimeUS) ((double) elapsedTicks * calibration.microsecondsPerTick);
+}
+
+// Measures the counter's rate against the system clock. Takes 10 milliseconds
+static bool CalibrateTSC( void )
+{
+	if (HasInvariantTSC()==false)
+		return false;
+
+	RakNet::TimeUS startTime=GetTimeUS_System(), endTime;
+	uint64_t startTicks=ReadTSC(), endTicks;
+	do
+	{
+		endTime=GetTimeUS_System();
+		endTicks=ReadTSC();
+	} while (endTime-startTime < 10000);
+	if (endTicks<=startTicks)
+		return false;
+
+	tscFirstTicks=startTicks;
+	tscFirstTime=startTime;
+	TSCCalibration &calibration=tscCalibrations[tscCalibrationIndex^1];
+	calibration.microsecondsPerTick=(double) (endTime-startTime) / (double) (endTicks-startTicks);
+	calibration.baseTicks=endTicks;
+	calibration.baseTime=endTime;
+	tscCheckTicks=(int64_t) ((double) TSC_CHECK_INTERVAL_US / calibration.microsecondsPerTick);
+	tscCalibrationIndex^=1;
+	return true;
+}
+
+// Compares the counter to the system clock, and corrects the rate so the error is gone by the next check
+static void CheckTSC( void )
+{
+	GetTimeSourceMutex().Lock();
+	const TSCCalibration &current=tscCalibrations[tscCalibrationIndex];
+	uint64_t ticks=ReadTSC();
+	if (timeSource!=RakNet::TIME_SOURCE_TSC || (int64_t) (ticks-current.baseTicks) < tscCheckTicks)
+	{
+		// Another thread got here first
+		GetTimeSourceMutex().Unlock();
+		return;
+	}
+
+	RakNet::TimeUS tscTime=TicksToTime(current, ticks);
+	RakNet::TimeUS systemTime=GetTimeUS_System();
+	int64_t error=(int64_t) (systemTime-tscTime);
+	if (error > TSC_MAX_ERROR_US || error < -TSC_MAX_ERROR_US || ticks<=tscFirstTicks)
+	{
+		if (tscTime > systemTime)
+			systemTimeOffset+=tscTime-systemTime;
+		timeSource=RakNet::TIME_SOURCE_SYSTEM;
+		GetTimeSourceMutex().Unlock();
+		return;
+	}
+
+	// The rate over all the time since calibration, adjusted to close the error over the next interval without going backwards
+	double microsecondsPerTick=(double) (systemTime-tscFirstTime) / (double) (ticks-tscFirstTicks);
+	double correction=1.0 + (double) error / (double) TSC_CHECK_INTERVAL_US;
+	TSCCalibration &next=tscCalibrations[tscCalibrationIndex^1];
+	next.microsecondsPerTick=microsecondsPerTick*correction;
+	next.baseTicks=ticks;
+	next.baseTime=tscTime;
+	tscCalibrationIndex^=1;
+	GetTimeSourceMutex().Unlock();
+}
+
+static RakNet::TimeUS GetTimeUS_TSC( void )
+{
+	const TSCCalibration &calibration=tscCalibrations[tscCalibrationIndex];
+	uint64_t ticks=ReadTSC();
+	// UpdateTimeSource() normally does the check. This is in case nothing calls it
+	if ((int64_t) (ticks-calibration.baseTicks) > tscCheckTicks*2)
+	{
+		CheckTSC();
+		return RakNet::GetTimeUS();
+	}
+	return TicksToTime(calibration, ticks);
+}
+#endif // #if defined(GET_TIME_HAS_TSC)
+
+RakNet::TimeUS RakNet::GetTimeUS( void )
+{
+	if (countTimeCalls)
+		timeCallCount++;
+
+#if defined(GET_TIME_HAS_TSC)
+	if (timeSource==TIME_SOURCE_TSC)
+		return GetTimeUS_TSC();
+#endif
+	if (timeSource==TIME_SOURCE_CACHED)
+		return GetTimeUS_Cached();
+	if (timeSource==TIME_SOURCE_VIRTUAL)
+		return GetTimeUS_Virtual();
+	return GetTimeUS_System();
+}
+bool RakNet::SetTimeSource(TimeSource newTimeSource)
+{
+	if (newTimeSource==timeSource)
+		return true;
+
+	// Whatever the new source starts at, time must not go backwards
+	RakNet::TimeUS timeBefore=GetTimeUS();
+	RakNet::TimeUS systemTime=GetTimeUS_System();
+	if (timeBefore > systemTime)
+		systemTimeOffset+=timeBefore-systemTime;
+
+	if (newTimeSource==TIME_SOURCE_TSC)
+	{
+#if defined(GET_TIME_HAS_TSC)
+		if (CalibrateTSC()==false)
+			return false;
+#else
+		return false;
+#endif
+	}
+	else if (newTimeSource==TIME_SOURCE_CACHED)
+	{
+		UpdateCachedTime();
+	}
+	else if (newTimeSource==TIME_SOURCE_VIRTUAL)
+	{
+		GetTimeSourceMutex().Lock();
+		SetVirtualClock(timeBefore, 1.0);
+		GetTimeSourceMutex().Unlock();
+	}
+	timeSource=newTimeSource;
+	return true;
+}
+RakNet::TimeSource RakNet::GetTimeSource(void)
+{
+	return timeSource;
+}
+void RakNet::UpdateTimeSource(void)
+{
+	if (timeSource==TIME_SOURCE_CACHED)
+	{
+		UpdateCachedTime();
+	}
+#if defined(GET_TIME_HAS_TSC)
+	else if (timeSource==TIME_SOURCE_TSC)
+	{
+		if ((int64_t) (ReadTSC()-tscCalibrations[tscCalibrationIndex].baseTicks) >= tscCheckTicks)
+			CheckTSC();
+	}
+#endif
+}
+void RakNet::SetVirtualTimeScale(double scale)
+{
+	if (scale < 0.0)
+		scale=0.0;
+	GetTimeSourceMutex().Lock();
+	SetVirtualClock(GetTimeUS_Virtual(), scale);
+	GetTimeSourceMutex().Unlock();
+}
+void RakNet::AdvanceVirtualTime(TimeUS elapsed)
+{
+	GetTimeSourceMutex().Lock();
+	SetVirtualClock(GetTimeUS_Virtual()+elapsed, virtualClocks[virtualClockIndex].scale);
+	GetTimeSourceMutex().Unlock();
+}
+void RakNet::SetCountTimeCalls(bool enabled)
+{
+	countTimeCalls=enabled;
+}
+uint64_t RakNet::GetTimeCallCount(void)
+{
+	return timeCallCount;
+}
 bool RakNet::GreaterThan(RakNet::Time a, RakNet::Time b)
 {
 	// a > b?
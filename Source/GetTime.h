@@ -33,6 +33,55 @@ namespace RakNet
 	/// \note The maximum delta between returned calls is 1 second - however, RakNet calls this constantly anyway. See NormalizeTime() in the cpp.
 	RakNet::TimeUS RAK_DLL_EXPORT GetTimeUS( void );
 
+	/// Where GetTimeUS(), GetTimeMS() and GetTime() get the time from. See SetTimeSource()
+	enum TimeSource
+	{
+		/// QueryPerformanceCounter() on Windows, gettimeofday() elsewhere. The default.
+		TIME_SOURCE_SYSTEM,
+
+		/// The processor's time stamp counter, calibrated against the system clock. Much cheaper to read, with the same precision.
+		/// Only available on x86 and x64 processors whose counter runs at a constant rate.
+		/// The counter is compared to the system clock about once a second and corrected. If the two are ever more than 50 milliseconds apart, for example after the machine was suspended, RakNet goes back to TIME_SOURCE_SYSTEM for good.
+		TIME_SOURCE_TSC,
+
+		/// The time as of the last call to UpdateTimeSource(), which RakPeer's update thread makes every time it runs.
+		/// Cheapest to read, but only as precise as the update thread is frequent, which is every 10 milliseconds when there is no traffic.
+		/// The time is also refreshed every 256 reads, so it still moves if nothing calls UpdateTimeSource()
+		TIME_SOURCE_CACHED,
+
+		/// A clock the program controls, for simulations such as VirtualNetwork. Starts at the time of the previous source and runs at the rate given to SetVirtualTimeScale(), 1 by default.
+		/// With a rate of 0, time only moves when AdvanceVirtualTime() is called, which makes timeouts and resends repeatable.
+		/// The clock is for the whole process, so every RakPeer sees the same virtual time.
+		TIME_SOURCE_VIRTUAL
+	};
+
+	/// Sets where the time comes from. Call before RakPeer::Startup(), as it affects round trip time measurement
+	/// Time never goes backwards when switching.
+	/// \param[in] timeSource See TimeSource
+	/// \return false if \a timeSource is not available on this platform or processor, in which case the time source is unchanged
+	bool RAK_DLL_EXPORT SetTimeSource(TimeSource timeSource);
+
+	/// \return The time source in use. TIME_SOURCE_TSC can change to TIME_SOURCE_SYSTEM by itself.
+	TimeSource RAK_DLL_EXPORT GetTimeSource(void);
+
+	/// Refreshes the time for TIME_SOURCE_CACHED, and compares TIME_SOURCE_TSC to the system clock when due. Does nothing for TIME_SOURCE_SYSTEM
+	/// RakPeer's update thread calls this once per update. Call it from your own loop if you use TIME_SOURCE_CACHED without RakPeer
+	void RAK_DLL_EXPORT UpdateTimeSource(void);
+
+	/// For TIME_SOURCE_VIRTUAL, sets how fast virtual time runs compared to real time. 10 runs ten times faster. 0 stops it, so it only moves with AdvanceVirtualTime()
+	/// \param[in] scale Virtual microseconds per real microsecond
+	void RAK_DLL_EXPORT SetVirtualTimeScale(double scale);
+
+	/// For TIME_SOURCE_VIRTUAL, moves virtual time forward at once
+	/// \param[in] elapsed Microseconds to add
+	void RAK_DLL_EXPORT AdvanceVirtualTime(TimeUS elapsed);
+
+	/// \internal
+	/// For benchmarks. While enabled, counts calls to GetTimeUS(), which GetTimeMS() and GetTime() also call. The count is approximate if several threads read the time
+	void RAK_DLL_EXPORT SetCountTimeCalls(bool enabled);
+	/// \internal
+	uint64_t RAK_DLL_EXPORT GetTimeCallCount(void);
+
 	/// a > b?
 	extern RAK_DLL_EXPORT bool GreaterThan(RakNet::Time a, RakNet::Time b);
 	/// a < b?
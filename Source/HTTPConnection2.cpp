@@ -3,7 +3,7 @@
  *  All rights reserved.
  *
  *  This source code is licensed under the BSD-style license found in the
- *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  LICENSE file in the root directory of this source tree. An additional grant
  *  of patent rights can be found in the PATENTS file in the same directory.
  *
  */
@@ -13,19 +13,39 @@
 
 #include "HTTPConnection2.h"
 #include "TCPInterface.h"
+#include "LinuxStrings.h"
+#include <stdlib.h>
+#include <string.h>
 
 using namespace RakNet;
 
+// Responses with longer headers are not HTTP
+static const unsigned int MAX_HEADER_LENGTH=65536;
+// Buffers larger than this are freed after each response rather than kept for the next
+static const unsigned int MAX_KEPT_RESPONSE_CAPACITY=65536;
+// Requests with longer responses fail, unless the body goes to a BodyCallback
+static const unsigned int MAX_RESPONSE_LENGTH=0x40000000;
+
 STATIC_FACTORY_DEFINITIONS(HTTPConnection2,HTTPConnection2);
 
 HTTPConnection2::HTTPConnection2()
 {
+	requestsInProgress=0;
+	maxPipelinedRequests=1;
+	keepAliveTimeout=15000;
+	retryUnansweredRequests=false;
 }
 HTTPConnection2::~HTTPConnection2()
 {
-
+	unsigned int i;
+	for (i=0; i < connections.Size(); i++)
+		DeallocateConnection(connections[i]);
+	connections.Clear(false, _FILE_AND_LINE_);
+	for (i=0; i < completedRequests.Size(); i++)
+		RakNet::OP_DELETE(completedRequests[i], _FILE_AND_LINE_);
+	completedRequests.Clear(false, _FILE_AND_LINE_);
 }
-bool HTTPConnection2::TransmitRequest(const char* stringToTransmit, const char* host, unsigned short port, bool useSSL, int ipVersion, SystemAddress useAddress, void *userData)
+bool HTTPConnection2::TransmitRequest(const char* stringToTransmit, const char* host, unsigned short port, bool useSSL, int ipVersion, SystemAddress useAddress, void *userData, BodyCallback *bodyCallback)
 {
 	Request *request = RakNet::OP_NEW<Request>(_FILE_AND_LINE_);
 	request->host=host;
@@ -55,47 +75,44 @@ bool HTTPConnection2::TransmitRequest(const char* stringToTransmit, const char*
 	request->useSSL=useSSL;
 	request->ipVersion=ipVersion;
 	request->userData=userData;
-
-	if (IsConnected(request->hostEstimatedAddress))
+	request->bodyCallback=bodyCallback;
+	request->timesSent=0;
+	request->sentOnReusedConnection=false;
+
+	bool connect=false;
+	connectionsMutex.Lock();
+	Connection *connection = GetConnection(request->hostEstimatedAddress);
+	if (connection==0)
 	{
-		sentRequestsMutex.Lock();
-		if (sentRequests.Size()==0)
-		{
-			request->hostCompletedAddress=request->hostEstimatedAddress;
-			sentRequests.Push(request, _FILE_AND_LINE_);
-			sentRequestsMutex.Unlock();
-
-			SendRequest(request);
-		}
-		else
-		{
-			// Request pending, push it
-			pendingRequestsMutex.Lock();
-			pendingRequests.Push(request, _FILE_AND_LINE_);
-			pendingRequestsMutex.Unlock();
-
-			sentRequestsMutex.Unlock();
-		}
+		connection = RakNet::OP_NEW<Connection>(_FILE_AND_LINE_);
+		connection->address=request->hostEstimatedAddress;
+		connection->connectingAddress=UNASSIGNED_SYSTEM_ADDRESS;
+		connection->host=host;
+		connection->port=port;
+		connection->useSSL=useSSL;
+		connection->ipVersion=ipVersion;
+		connection->connected=IsConnected(request->hostEstimatedAddress);
+		connection->closing=false;
+		connection->reconnect=false;
+		connection->idleSince=RakNet::GetTimeMS();
+		connection->receivingRequest=0;
+		connection->responseState=RS_HEADERS;
+		connection->responseData=0;
+		connection->responseLength=0;
+		connection->responseCapacity=0;
+		connection->chunkLineLength=0;
+		connection->closeAfterResponse=false;
+		connection->responsesReceived=0;
+		connections.Push(connection, _FILE_AND_LINE_);
+		connect=connection->connected==false;
 	}
-	else
-	{
-		pendingRequestsMutex.Lock();
-		pendingRequests.Push(request, _FILE_AND_LINE_);
-		pendingRequestsMutex.Unlock();
+	connection->pendingRequests.Push(request, _FILE_AND_LINE_);
+	requestsInProgress++;
+	SendPendingRequests(connection);
+	connectionsMutex.Unlock();
 
-		if (ipVersion!=6)
-		{
-			tcpInterface->Connect(host, port, false, AF_INET);
-		}
-		else
-		{
-			#if RAKNET_SUPPORT_IPV6
-				tcpInterface->Connect(host, port, false, AF_INET6);
-			#else
-				RakAssert("HTTPConnection2::TransmitRequest needs define  RAKNET_SUPPORT_IPV6" && 0);
-			#endif
-		}
-	}
+	if (connect)
+		Connect(connection);
 	return true;
 }
 bool HTTPConnection2::GetResponse( RakString &stringTransmitted, RakString &hostTransmitted, RakString &responseReceived, SystemAddress &hostReceived, int &contentOffset )
@@ -110,7 +127,7 @@ bool HTTPConnection2::GetResponse( RakString &stringTransmitted, RakString &host
 	if (completedRequests.Size()>0)
 	{
 		Request *completedRequest = completedRequests[0];
-		completedRequests.RemoveAtIndexFast(0);
+		completedRequests.RemoveAtIndex(0);
 		completedRequestsMutex.Unlock();
 
 		responseReceived = completedRequest->stringReceived;
@@ -131,418 +148,478 @@ bool HTTPConnection2::GetResponse( RakString &stringTransmitted, RakString &host
 }
 bool HTTPConnection2::IsBusy(void) const
 {
-	return pendingRequests.Size()>0 || sentRequests.Size()>0;
+	return requestsInProgress>0;
 }
 bool HTTPConnection2::HasResponse(void) const
 {
 	return completedRequests.Size()>0;
 }
-int ReadChunkSize( char *txtStart, char **txtEnd ) 
-{
-// 	char lengthStr[32];
-// 	memset(lengthStr, 0, 32);
-// 	memcpy(lengthStr, txtStart, txtEnd - txtStart);
-	return strtoul(txtStart, txtEnd,16);
-	// return atoi(lengthStr);
-}
-void ReadChunkBlock( size_t &currentChunkSize, size_t &bytesReadSoFar, char *txtIn, RakString &txtOut)
-{
-	size_t bytesToRead;
-	size_t sLen;
-	
-	do 
-	{
-		bytesToRead = currentChunkSize - bytesReadSoFar;
-		sLen = strlen(txtIn);
-		if (sLen < bytesToRead)
-			bytesToRead = sLen;
-		txtOut.AppendBytes(txtIn, bytesToRead);
-		txtIn += bytesToRead;
-		bytesReadSoFar += bytesToRead;
-		if (*txtIn == 0)
+void HTTPConnection2::SetMaxPipelinedRequests(unsigned int maxRequests)
+{
+	if (maxRequests==0)
+		maxRequests=1;
+	maxPipelinedRequests=maxRequests;
+}
+void HTTPConnection2::SetKeepAliveTimeout(RakNet::TimeMS timeout)
+{
+	keepAliveTimeout=timeout;
+}
+void HTTPConnection2::SetRetryUnansweredRequests(bool retry)
+{
+	retryUnansweredRequests=retry;
+}
+// Value of the header with this name, ended by \r\n, or 0 if there is none
+static const char *FindHeaderValue(const char *headers, const char *name)
+{
+	size_t nameLength=strlen(name);
+	// Skip the status line
+	const char *line=strstr(headers, "\r\n");
+	while (line && line[2]!='\r' && line[2]!=0)
+	{
+		line+=2;
+		if (_strnicmp(line, name, nameLength)==0 && line[nameLength]==':')
 		{
-		//	currentChunkSize=0;
-			return;
+			const char *value=line+nameLength+1;
+			while (*value==' ' || *value=='\t')
+				value++;
+			return value;
 		}
-		// char *newLine = strstr(txtIn, "\r\n");
-		if (txtIn[0] && txtIn[0]=='\r' && txtIn[1] && txtIn[1]=='\n' )
-			txtIn += 2; // Newline
-		char *newLine;
-		currentChunkSize = ReadChunkSize(txtIn, &newLine);
-		RakAssert(currentChunkSize < 50000); // Sanity check
-		if (currentChunkSize == 0)
-			return;
-		if (newLine == 0)
-			return;
-		bytesReadSoFar=0;
-		txtIn = newLine + 2;
-	} while (txtIn);
+		line=strstr(line, "\r\n");
+	}
+	return 0;
 }
-PluginReceiveResult HTTPConnection2::OnReceive(Packet *packet)
+static bool HeaderValueHasToken(const char *value, const char *token)
 {
-	unsigned int i;
-
-	bool locked=true;
-	sentRequestsMutex.Lock();
-	for (i=0; i < sentRequests.Size(); i++)
+	size_t tokenLength=strlen(token);
+	for (; *value && *value!='\r'; value++)
 	{
-		Request *sentRequest = sentRequests[i];
-		if (sentRequest->hostCompletedAddress==packet->systemAddress)
+		if (_strnicmp(value, token, tokenLength)==0)
+			return true;
+	}
+	return false;
+}
+// Returns false, without appending, if the data would be longer than MAX_RESPONSE_LENGTH
+static bool AppendResponseData(char **data, unsigned int *length, unsigned int *capacity, const char *bytes, unsigned int count)
+{
+	if (count > MAX_RESPONSE_LENGTH-*length)
+		return false;
+	if (*length+count+1 > *capacity)
+	{
+		unsigned int newCapacity = *capacity > 0 ? *capacity : 1024;
+		while (newCapacity < *length+count+1)
+			newCapacity*=2;
+		*data=(char*) rakRealloc_Ex(*data, newCapacity, _FILE_AND_LINE_);
+		*capacity=newCapacity;
+	}
+	memcpy(*data+*length, bytes, count);
+	*length+=count;
+	(*data)[*length]=0;
+	return true;
+}
+bool HTTPConnection2::ParseResponse(Connection *connection, const char *data, unsigned int length)
+{
+	while (length>0)
+	{
+		switch (connection->responseState)
 		{
-			sentRequests.RemoveAtIndexFast(i);
-			locked=false;
-			sentRequestsMutex.Unlock();
-
-			/*
-			static FILE * pFile = 0;
-			if (pFile==0)
-			{
-				long lSize;
-				char * buffer;
-				size_t result;
-
-				pFile = fopen ( "string_received.txt" , "rb" );
-				if (pFile==NULL) {fputs ("File error",stderr); exit (1);}
-
-				// obtain file size:
-				fseek (pFile , 0 , SEEK_END);
-				lSize = ftell (pFile);
-				rewind (pFile);
-
-				// allocate memory to contain the whole file:
-				buffer = (char*) malloc (sizeof(char)*lSize);
-				if (buffer == NULL) {fputs ("Memory error",stderr); exit (2);}
-
-				// copy the file into the buffer:
-				result = fread (buffer,1,lSize,pFile);
-				if (result != lSize) {fputs ("Reading error",stderr); exit (3);}
-
-				packet->data=(unsigned char*) buffer;
-				packet->length=lSize;
-			}
-			*/
-
-
-			const char *isFirstChunk = strstr((char*) packet->data, "Transfer-Encoding: chunked");
-			if (isFirstChunk)
+		case RS_HEADERS:
 			{
-				//printf((char*) packet->data);
-
-				locked=false;
-				sentRequestsMutex.Unlock();
-
-				sentRequest->chunked = true;
-				char *chunkStrStart = strstr((char*) packet->data, "\r\n\r\n");
-				RakAssert(chunkStrStart);
-
-				chunkStrStart += 4; // strlen("\r\n\r\n");
-				char *body_header; // = strstr(chunkStrStart, "\r\n");
-				sentRequest->thisChunkSize = ReadChunkSize(chunkStrStart, &body_header);
-				sentRequest->bytesReadForThisChunk = 0;
-				sentRequest->contentOffset = 0;
-
-				if (sentRequest->thisChunkSize == 0)
+				if (connection->receivingRequest==0)
 				{
-					// Done
-					completedRequestsMutex.Lock();
-					completedRequests.Push(sentRequest, _FILE_AND_LINE_);
-					completedRequestsMutex.Unlock();
-
-					// If there is another command waiting for this server, send it
-					SendPendingRequestToConnectedSystem(packet->systemAddress);
+					connectionsMutex.Lock();
+					if (connection->sentRequests.Size()>0)
+						connection->receivingRequest=connection->sentRequests.Peek();
+					connectionsMutex.Unlock();
+					// Data nothing was requested for
+					if (connection->receivingRequest==0)
+						return false;
 				}
-				else
-				{
-
-					// char *offset = strstr((char*) packet->data+1, "2000");
-
-					body_header+=2;
-					ReadChunkBlock(sentRequest->thisChunkSize, sentRequest->bytesReadForThisChunk, body_header, sentRequest->stringReceived);
-
-					if (sentRequest->thisChunkSize==0)
-					{
-						// Done
-						completedRequestsMutex.Lock();
-						completedRequests.Push(sentRequest, _FILE_AND_LINE_);
-						completedRequestsMutex.Unlock();
 
-						// If there is another command waiting for this server, send it
-						SendPendingRequestToConnectedSystem(packet->systemAddress);
-					}
-					else
-					{
-						// Not done
-						sentRequestsMutex.Lock();
-						sentRequests.Push(sentRequest, _FILE_AND_LINE_);
-						sentRequestsMutex.Unlock();
-					}
+				// Search only what could end the headers, as a response can arrive a few bytes at a time
+				unsigned int oldLength=connection->responseLength;
+				if (AppendResponseData(&connection->responseData, &connection->responseLength, &connection->responseCapacity, data, length)==false)
+				{
+					FailResponse(connection);
+					return false;
 				}
+				const char *headersEnd = strstr(connection->responseData + (oldLength > 3 ? oldLength-3 : 0), "\r\n\r\n");
+				if (headersEnd==0)
+					return connection->responseLength <= MAX_HEADER_LENGTH;
+
+				// What follows the headers is parsed as the body
+				unsigned int headersLength = (unsigned int) (headersEnd - connection->responseData) + 4;
+				data+=headersLength-oldLength;
+				length-=headersLength-oldLength;
+				connection->responseLength=headersLength;
+				connection->responseData[headersLength]=0;
+				if (OnResponseHeaders(connection)==false)
+					return false;
 			}
-			else if (sentRequest->chunked)
+			break;
+		case RS_BODY:
 			{
-				ReadChunkBlock(sentRequest->thisChunkSize, sentRequest->bytesReadForThisChunk, (char*) packet->data, sentRequest->stringReceived);
-
-				if (sentRequest->thisChunkSize==0)
-				{
-					// Done
-					completedRequestsMutex.Lock();
-					completedRequests.Push(sentRequest, _FILE_AND_LINE_);
-					completedRequestsMutex.Unlock();
-
-					// If there is another command waiting for this server, send it
-					SendPendingRequestToConnectedSystem(packet->systemAddress);
-				}
-				else
-				{
-					// Not done
-					sentRequestsMutex.Lock();
-					sentRequests.Push(sentRequest, _FILE_AND_LINE_);
-					sentRequestsMutex.Unlock();
-				}
-
+				Request *request = connection->receivingRequest;
+				size_t bytesToRead = (size_t) request->contentLength - request->bytesReadForThisChunk;
+				if (bytesToRead > length)
+					bytesToRead = length;
+				if (ReceiveBody(connection, data, (unsigned int) bytesToRead)==false)
+					return false;
+				data+=bytesToRead;
+				length-=(unsigned int) bytesToRead;
+				request->bytesReadForThisChunk+=bytesToRead;
+				if (request->bytesReadForThisChunk==(size_t) request->contentLength)
+					CompleteResponse(connection);
 			}
-			else
+			break;
+		case RS_BODY_UNTIL_CLOSE:
+			if (ReceiveBody(connection, data, length)==false)
+				return false;
+			length=0;
+			break;
+		case RS_CHUNK_SIZE:
 			{
-				sentRequest->stringReceived+=packet->data;
-
-				if (sentRequest->contentLength==-1)
-				{
-					const char *length_header = strstr(sentRequest->stringReceived.C_String(), "Content-Length: ");
-					if(length_header)
-					{
-						length_header += 16; // strlen("Content-Length: ");
-
-						unsigned int clLength;
-						for (clLength=0; length_header[clLength] && length_header[clLength] >= '0' && length_header[clLength] <= '9'; clLength++)
-							;
-						if (clLength>0 && (length_header[clLength]=='\r' || length_header[clLength]=='\n'))
-						{
-							sentRequest->contentLength = RakString::ReadIntFromSubstring(length_header, 0, clLength);
-						}
-					}
-				}
-
-				// If we know the content length, find \r\n\r\n
-				if (sentRequest->contentLength != -1)
+				// Hexadecimal size, possibly followed by extensions, then \r\n
+				const char *newline = (const char*) memchr(data, '\n', length);
+				unsigned int lineBytes = newline ? (unsigned int) (newline-data) : length;
+				for (unsigned int i=0; i < lineBytes && connection->chunkLineLength < sizeof(connection->chunkLine)-1; i++)
+					connection->chunkLine[connection->chunkLineLength++]=data[i];
+				if (newline==0)
+					return true;
+				data+=lineBytes+1;
+				length-=lineBytes+1;
+				connection->chunkLine[connection->chunkLineLength]=0;
+				connection->chunkLineLength=0;
+
+				char *sizeEnd;
+				unsigned long chunkSize = strtoul(connection->chunkLine, &sizeEnd, 16);
+				if (sizeEnd==connection->chunkLine || chunkSize > 0x7FFFFFFF)
+					return false;
+				Request *request = connection->receivingRequest;
+				request->thisChunkSize=chunkSize;
+				request->bytesReadForThisChunk=0;
+				connection->responseState = chunkSize > 0 ? RS_CHUNK_DATA : RS_TRAILERS;
+			}
+			break;
+		case RS_CHUNK_DATA:
+			{
+				Request *request = connection->receivingRequest;
+				size_t bytesToRead = request->thisChunkSize - request->bytesReadForThisChunk;
+				if (bytesToRead > length)
+					bytesToRead = length;
+				if (ReceiveBody(connection, data, (unsigned int) bytesToRead)==false)
+					return false;
+				data+=bytesToRead;
+				length-=(unsigned int) bytesToRead;
+				request->bytesReadForThisChunk+=bytesToRead;
+				if (request->bytesReadForThisChunk==request->thisChunkSize)
+					connection->responseState=RS_CHUNK_END;
+			}
+			break;
+		case RS_CHUNK_END:
+			{
+				// \r\n after the data of a chunk
+				const char *newline = (const char*) memchr(data, '\n', length);
+				if (newline==0)
+					return true;
+				length-=(unsigned int) (newline-data)+1;
+				data=newline+1;
+				connection->responseState=RS_CHUNK_SIZE;
+			}
+			break;
+		case RS_TRAILERS:
+			{
+				// Header lines, which are ignored, ended by an empty line. chunkLineLength counts the bytes of the current line
+				while (length>0)
 				{
-					if (sentRequest->contentLength > 0)
+					char c = *data++;
+					length--;
+					if (c=='\n')
 					{
-						const char *body_header = strstr(sentRequest->stringReceived.C_String(), "\r\n\r\n");
-						if (body_header)
-						{
-							body_header += 4; // strlen("\r\n\r\n");
-							size_t slen = strlen(body_header);
-							//RakAssert(slen <= (size_t) sentRequest->contentLength);
-							if (slen >= (size_t) sentRequest->contentLength)
-							{
-								sentRequest->contentOffset = body_header - sentRequest->stringReceived.C_String();
-								completedRequestsMutex.Lock();
-								completedRequests.Push(sentRequest, _FILE_AND_LINE_);
-								completedRequestsMutex.Unlock();
-
-								// If there is another command waiting for this server, send it
-								SendPendingRequestToConnectedSystem(packet->systemAddress);
-							}
-							else
-							{
-								sentRequestsMutex.Lock();
-								sentRequests.Push(sentRequest, _FILE_AND_LINE_);
-								sentRequestsMutex.Unlock();
-							}
-						}
-
-						else
+						if (connection->chunkLineLength==0)
 						{
-							sentRequestsMutex.Lock();
-							sentRequests.Push(sentRequest, _FILE_AND_LINE_);
-							sentRequestsMutex.Unlock();
+							CompleteResponse(connection);
+							break;
 						}
+						connection->chunkLineLength=0;
 					}
-					else
+					else if (c!='\r')
 					{
-						sentRequest->contentOffset=-1;
-						completedRequestsMutex.Lock();
-						completedRequests.Push(sentRequest, _FILE_AND_LINE_);
-						completedRequestsMutex.Unlock();
-
-						// If there is another command waiting for this server, send it
-						SendPendingRequestToConnectedSystem(packet->systemAddress);
-					}
-				}
-				else
-				{
-					const char *firstNewlineSet = strstr(sentRequest->stringReceived.C_String(), "\r\n\r\n");
-					if (firstNewlineSet!=0)
-					{
-						int offset = firstNewlineSet - sentRequest->stringReceived.C_String();
-						if (sentRequest->stringReceived.C_String()[offset+4]==0)
-							sentRequest->contentOffset=-1;
-						else
-							sentRequest->contentOffset=offset+4;
-						completedRequestsMutex.Lock();
-						completedRequests.Push(sentRequest, _FILE_AND_LINE_);
-						completedRequestsMutex.Unlock();
-
-						// If there is another command waiting for this server, send it
-						SendPendingRequestToConnectedSystem(packet->systemAddress);
-					}
-					else
-					{
-						sentRequestsMutex.Lock();
-						sentRequests.Push(sentRequest, _FILE_AND_LINE_);
-						sentRequestsMutex.Unlock();
+						connection->chunkLineLength++;
 					}
 				}
 			}
-
-			
 			break;
 		}
-	}
 
-	if (locked==true)
-		sentRequestsMutex.Unlock();
+		if (connection->closing)
+			return false;
+	}
 
-	return RR_CONTINUE_PROCESSING;
+	return true;
 }
-
-void HTTPConnection2::OnNewConnection(const SystemAddress &systemAddress, RakNetGUID rakNetGUID, bool isIncoming)
+bool HTTPConnection2::OnResponseHeaders(Connection *connection)
 {
-	(void) rakNetGUID;
-	(void) isIncoming; // unknown
+	Request *request = connection->receivingRequest;
+	const char *headers = connection->responseData;
+	if (strncmp(headers, "HTTP/", 5)!=0)
+		return false;
+	const char *statusCode = strchr(headers, ' ');
+	if (statusCode==0)
+		return false;
+	int status = atoi(statusCode+1);
+	bool http10 = strncmp(headers, "HTTP/1.0", 8)==0;
+
+	// Informational, such as 100 Continue. The response follows
+	if (status>=100 && status<200 && status!=101)
+	{
+		connection->responseLength=0;
+		return true;
+	}
 
-	SendPendingRequestToConnectedSystem(systemAddress);
-}
-void HTTPConnection2::SendPendingRequestToConnectedSystem(SystemAddress sa)
-{
-	if (sa==UNASSIGNED_SYSTEM_ADDRESS)
-		return;
+	const char *connectionHeader = FindHeaderValue(headers, "Connection");
+	if (connectionHeader)
+		connection->closeAfterResponse = HeaderValueHasToken(connectionHeader, "close") || (http10 && HeaderValueHasToken(connectionHeader, "keep-alive")==false);
+	else
+		connection->closeAfterResponse = http10;
 
-	unsigned int requestsSent=0;
+	const char *transferEncoding = FindHeaderValue(headers, "Transfer-Encoding");
+	request->chunked = transferEncoding!=0 && HeaderValueHasToken(transferEncoding, "chunked");
+	request->contentLength=-1;
+	const char *contentLength = FindHeaderValue(headers, "Content-Length");
+	if (contentLength && contentLength[0]>='0' && contentLength[0]<='9')
+	{
+		unsigned long length = strtoul(contentLength, 0, 10);
+		if (length > 0x7FFFFFFF)
+			return false;
+		request->contentLength=(int) length;
+	}
+	request->contentOffset=(int) connection->responseLength;
+	request->bytesReadForThisChunk=0;
 
-	// Search through requests to find a match for this instance of TCPInterface and SystemAddress
-	unsigned int i;
-	i=0;
-	pendingRequestsMutex.Lock();
-	while (i < pendingRequests.Size())
+	if (strncmp(request->stringToTransmit.C_String(), "HEAD ", 5)==0 || status==204 || status==304 || (request->chunked==false && request->contentLength==0))
 	{
-		Request *request = pendingRequests[i];
-		if (request->hostEstimatedAddress==sa)
-		{
-			pendingRequests.RemoveAtIndex(i);
-			// Send this request
-			request->hostCompletedAddress=sa;
+		CompleteResponse(connection);
+	}
+	else if (request->chunked)
+	{
+		connection->chunkLineLength=0;
+		connection->responseState=RS_CHUNK_SIZE;
+	}
+	else if (request->contentLength>0)
+	{
+		connection->responseState=RS_BODY;
+	}
+	else
+	{
+		// Ends when the server closes the connection
+		connection->closeAfterResponse=true;
+		connection->responseState=RS_BODY_UNTIL_CLOSE;
+	}
+	return true;
+}
+bool HTTPConnection2::ReceiveBody(Connection *connection, const char *data, unsigned int length)
+{
+	if (length==0)
+		return true;
+	Request *request = connection->receivingRequest;
+	if (request->bodyCallback)
+		request->bodyCallback->OnBodyData(data, length, request->userData);
+	else if (AppendResponseData(&connection->responseData, &connection->responseLength, &connection->responseCapacity, data, length)==false)
+	{
+		FailResponse(connection);
+		return false;
+	}
+	return true;
+}
+void HTTPConnection2::CompleteResponse(Connection *connection)
+{
+	Request *request = connection->receivingRequest;
+	if (connection->responseState==RS_HEADERS && connection->responseLength>0)
+	{
+		// Lost during the headers
+		const char *headersEnd = strstr(connection->responseData, "\r\n\r\n");
+		request->contentOffset = headersEnd ? (int) (headersEnd-connection->responseData)+4 : 0;
+	}
+	if (request->bodyCallback || request->contentOffset>=(int) connection->responseLength)
+		request->contentOffset=-1;
+	request->stringReceived.Clear();
+	if (connection->responseLength>0)
+		request->stringReceived.AppendBytes(connection->responseData, connection->responseLength);
+	request->hostCompletedAddress=connection->address;
+
+	connection->receivingRequest=0;
+	connection->responseState=RS_HEADERS;
+	connection->responseLength=0;
+	if (connection->responseCapacity > MAX_KEPT_RESPONSE_CAPACITY)
+	{
+		rakFree_Ex(connection->responseData, _FILE_AND_LINE_);
+		connection->responseData=0;
+		connection->responseCapacity=0;
+	}
 
-			sentRequestsMutex.Lock();
-			sentRequests.Push(request, _FILE_AND_LINE_);
-			sentRequestsMutex.Unlock();
+	connectionsMutex.Lock();
+	connection->sentRequests.Pop();
+	connection->responsesReceived++;
+	connection->idleSince=RakNet::GetTimeMS();
+	if (connection->closeAfterResponse)
+		connection->closing=true;
+	else
+		SendPendingRequests(connection);
+	connectionsMutex.Unlock();
 
-			pendingRequestsMutex.Unlock();
+	CompleteRequest(request);
+}
+void HTTPConnection2::FailResponse(Connection *connection)
+{
+	// The connection is closed by the caller, as the rest of the response cannot be told apart from the next
+	Request *request = connection->receivingRequest;
+	connection->receivingRequest=0;
+	connection->responseState=RS_HEADERS;
+	connection->responseLength=0;
+	rakFree_Ex(connection->responseData, _FILE_AND_LINE_);
+	connection->responseData=0;
+	connection->responseCapacity=0;
+
+	connectionsMutex.Lock();
+	connection->sentRequests.Pop();
+	connection->closing=true;
+	connectionsMutex.Unlock();
+
+	FailRequest(request, connection->address);
+}
+void HTTPConnection2::CompleteRequest(Request *request)
+{
+	connectionsMutex.Lock();
+	requestsInProgress--;
+	connectionsMutex.Unlock();
 
-#if OPEN_SSL_CLIENT_SUPPORT==1
-			if (request->useSSL)
-				tcpInterface->StartSSLClient(sa);
-#endif
+	completedRequestsMutex.Lock();
+	completedRequests.Push(request, _FILE_AND_LINE_);
+	completedRequestsMutex.Unlock();
+}
+void HTTPConnection2::FailRequest(Request *request, const SystemAddress &systemAddress)
+{
+	request->stringReceived.Clear();
+	request->contentOffset=-1;
+	request->hostCompletedAddress=systemAddress;
+	CompleteRequest(request);
+}
+bool HTTPConnection2::CanRetry(const Request *request, bool serverSaidClose) const
+{
+	if (request->timesSent >= 2)
+		return false;
+	if (retryUnansweredRequests)
+		return true;
 
-			SendRequest(request);
-			requestsSent++;
-			pendingRequestsMutex.Lock();
-			break;
-		}
-		else
+	// Idempotent methods, from RFC 7231 4.2.2. Others may have been processed even though no response arrived, and must not be repeated without asking (RFC 7230 6.3.1)
+	static const char *methods[] = {"GET ", "HEAD ", "PUT ", "DELETE ", "OPTIONS "};
+	const char *requestLine = request->stringToTransmit.C_String();
+	bool idempotent=false;
+	for (unsigned int i=0; i < sizeof(methods)/sizeof(methods[0]); i++)
+	{
+		if (strncmp(requestLine, methods[i], strlen(methods[i]))==0)
 		{
-			i++;
+			idempotent=true;
+			break;
 		}
 	}
-	pendingRequestsMutex.Unlock();
+	if (idempotent==false)
+		return false;
 
-	if (requestsSent==0)
+	// A new connection that closed without answering is more likely the server failing than closing an idle connection, so only report it
+	return request->sentOnReusedConnection || serverSaidClose;
+}
+void HTTPConnection2::Update(void)
+{
+	DataStructures::List<SystemAddress> idleConnections;
+	DataStructures::List<Connection*> reconnections;
+	RakNet::TimeMS time = RakNet::GetTimeMS();
+	connectionsMutex.Lock();
+	for (unsigned int i=0; i < connections.Size(); i++)
 	{
-		pendingRequestsMutex.Lock();
-		if (pendingRequests.Size() > 0)
+		Connection *connection = connections[i];
+		if (connection->reconnect)
 		{
-			// Just assign
-			Request *request = pendingRequests[0];
-			pendingRequests.RemoveAtIndex(0);
-
-			request->hostCompletedAddress=sa;
-
-			sentRequestsMutex.Lock();
-			sentRequests.Push(request, _FILE_AND_LINE_);
-			sentRequestsMutex.Unlock();
-			pendingRequestsMutex.Unlock();
-
-			// Send
-#if OPEN_SSL_CLIENT_SUPPORT==1
-			if (request->useSSL)
-				tcpInterface->StartSSLClient(sa);
-#endif
-
-
-			SendRequest(request);
+			connection->reconnect=false;
+			reconnections.Push(connection, _FILE_AND_LINE_);
 		}
-		else
+		if (connection->connected && connection->closing==false && connection->sentRequests.Size()==0 && connection->pendingRequests.Size()==0 &&
+			time - connection->idleSince >= keepAliveTimeout)
 		{
-			pendingRequestsMutex.Unlock();
+			connection->closing=true;
+			idleConnections.Push(connection->address, _FILE_AND_LINE_);
 		}
 	}
+	connectionsMutex.Unlock();
+
+	// Calls OnClosedConnection()
+	for (unsigned int i=0; i < idleConnections.Size(); i++)
+		tcpInterface->CloseConnection(idleConnections[i]);
+	// Only this thread removes connections, so they stay valid without the lock
+	for (unsigned int i=0; i < reconnections.Size(); i++)
+		Connect(reconnections[i]);
 }
-void HTTPConnection2::RemovePendingRequest(SystemAddress sa)
+PluginReceiveResult HTTPConnection2::OnReceive(Packet *packet)
 {
-	unsigned int i;
-	i=0;
-	pendingRequestsMutex.Lock();
-	for (i=0; i < pendingRequests.Size(); i++)
+	connectionsMutex.Lock();
+	Connection *connection = GetConnection(packet->systemAddress);
+	connectionsMutex.Unlock();
+	if (connection==0 || connection->connected==false)
+		return RR_CONTINUE_PROCESSING;
+
+	// Only this thread removes connections, so it stays valid without the lock
+	if (ParseResponse(connection, (const char*) packet->data, packet->length)==false)
 	{
-		Request *request = pendingRequests[i];
-		if (request->hostEstimatedAddress==sa)
-		{
-			pendingRequests.RemoveAtIndex(i);
-			RakNet::OP_DELETE(request, _FILE_AND_LINE_);
-		}
-		else
-			i++;
+		connection->closing=true;
+		tcpInterface->CloseConnection(packet->systemAddress);
 	}
 
-	pendingRequestsMutex.Unlock();
+	return RR_CONTINUE_PROCESSING;
 }
-void HTTPConnection2::SendNextPendingRequest(void)
+
+void HTTPConnection2::OnNewConnection(const SystemAddress &systemAddress, RakNetGUID rakNetGUID, bool isIncoming)
 {
-	// Send a pending request
-	pendingRequestsMutex.Lock();
-	if (pendingRequests.Size()>0)
-	{
-		Request *pendingRequest = pendingRequests.Peek();
-		pendingRequestsMutex.Unlock();
+	(void) rakNetGUID;
+	(void) isIncoming; // unknown
 
-		if (pendingRequest->ipVersion!=6)
-		{
-			tcpInterface->Connect(pendingRequest->host.C_String(), pendingRequest->port, false, AF_INET);
-		}
-		else
-		{
-#if RAKNET_SUPPORT_IPV6
-			tcpInterface->Connect(pendingRequest->host.C_String(), pendingRequest->port, false, AF_INET6);
-#else
-			RakAssert("HTTPConnection2::TransmitRequest needs define  RAKNET_SUPPORT_IPV6" && 0);
-#endif
-		}
-	}
-	else
+	if (systemAddress==UNASSIGNED_SYSTEM_ADDRESS)
+		return;
+
+	connectionsMutex.Lock();
+	Connection *connection = GetConnectingConnection(systemAddress);
+	if (connection)
 	{
-		pendingRequestsMutex.Unlock();
+		connection->address=systemAddress;
+		connection->connected=true;
+		connection->idleSince=RakNet::GetTimeMS();
+#if OPEN_SSL_CLIENT_SUPPORT==1
+		if (connection->useSSL)
+			tcpInterface->StartSSLClient(systemAddress);
+#endif
+		SendPendingRequests(connection);
 	}
+	connectionsMutex.Unlock();
 }
-
 void HTTPConnection2::OnFailedConnectionAttempt(Packet *packet, PI2_FailedConnectionAttemptReason failedConnectionAttemptReason)
 {
 	(void) failedConnectionAttemptReason;
 	if (packet->systemAddress==UNASSIGNED_SYSTEM_ADDRESS)
 		return;
 
-	RemovePendingRequest(packet->systemAddress);
+	connectionsMutex.Lock();
+	Connection *connection = GetConnectingConnection(packet->systemAddress);
+	if (connection)
+		RemoveConnection(connection);
+	connectionsMutex.Unlock();
 
-	SendNextPendingRequest();
+	// Requests that could not be sent are dropped
+	if (connection)
+	{
+		connectionsMutex.Lock();
+		requestsInProgress-=connection->pendingRequests.Size();
+		connectionsMutex.Unlock();
+		DeallocateConnection(connection);
+	}
 }
 void HTTPConnection2::OnClosedConnection(const SystemAddress &systemAddress, RakNetGUID rakNetGUID, PI2_LostConnectionReason lostConnectionReason )
 {
@@ -552,52 +629,60 @@ void HTTPConnection2::OnClosedConnection(const SystemAddress &systemAddress, Rak
 	if (systemAddress==UNASSIGNED_SYSTEM_ADDRESS)
 		return;
 
-	// Update sent requests to completed requests
-	unsigned int i;
-	i=0;
-	sentRequestsMutex.Lock();
-	while (i < sentRequests.Size())
+	connectionsMutex.Lock();
+	Connection *connection = GetConnection(systemAddress);
+	if (connection==0 || connection->connected==false)
 	{
-		if (sentRequests[i]->hostCompletedAddress==systemAddress)
-		{
-			Request *sentRequest = sentRequests[i];
-			if (sentRequest->chunked==false && sentRequest->stringReceived.IsEmpty()==false)
-			{
-				if (strstr(sentRequest->stringReceived.C_String(), "Content-Length: "))
-				{
-					char *body_header = strstr((char*) sentRequest->stringReceived.C_String(), "\r\n\r\n");
-					if (body_header)
-					{
-						body_header += 4; // strlen("\r\n\r\n");
-						sentRequest->contentOffset = body_header - sentRequest->stringReceived.C_String();
-					}
-					else
-					{
-						sentRequest->contentOffset = 0;
-					}
-
-				}
-				else
-				{
-					sentRequest->contentOffset = 0;
-				}
-			}
-			
+		connectionsMutex.Unlock();
+		return;
+	}
+	RemoveConnection(connection);
+	connection->connected=false;
+	connectionsMutex.Unlock();
 
-			completedRequestsMutex.Lock();
-			completedRequests.Push(sentRequests[i], _FILE_AND_LINE_);
-			completedRequestsMutex.Unlock();
+	// A response that was being received ends here, which is how a response without a length ends
+	if (connection->receivingRequest)
+	{
+		if (connection->responseState!=RS_HEADERS || connection->responseLength>0)
+			CompleteResponse(connection);
+		else
+			connection->receivingRequest=0;
+	}
+	// Connection: close on a response, so the server did not process the requests after it
+	bool serverSaidClose = connection->closeAfterResponse && connection->responsesReceived>0;
 
-			sentRequests.RemoveAtIndexFast(i);
-		}
+	// Requests the server did not answer are sent again once if that is safe, ahead of those not yet sent, as the server may have closed an idle connection as they were sent
+	DataStructures::Queue<Request*> requestsToSend;
+	while (connection->sentRequests.Size())
+	{
+		Request *request = connection->sentRequests.Pop();
+		if (CanRetry(request, serverSaidClose))
+			requestsToSend.Push(request, _FILE_AND_LINE_);
 		else
-		{
-			i++;
-		}
+			FailRequest(request, systemAddress);
+	}
+	while (connection->pendingRequests.Size())
+		requestsToSend.Push(connection->pendingRequests.Pop(), _FILE_AND_LINE_);
+
+	if (requestsToSend.Size()==0)
+	{
+		DeallocateConnection(connection);
+		return;
 	}
-	sentRequestsMutex.Unlock();
 
-	SendNextPendingRequest();
+	// Reconnect for the rest. Not from here, as TCPInterface::CloseConnection() calls this before it frees the slot of the connection, which TCPInterface::Connect() could take
+	while (requestsToSend.Size())
+		connection->pendingRequests.Push(requestsToSend.Pop(), _FILE_AND_LINE_);
+	connection->closing=false;
+	connection->closeAfterResponse=false;
+	connection->responsesReceived=0;
+	connection->responseState=RS_HEADERS;
+	connection->responseLength=0;
+	connection->connectingAddress=UNASSIGNED_SYSTEM_ADDRESS;
+	connectionsMutex.Lock();
+	connection->reconnect=true;
+	connections.Push(connection, _FILE_AND_LINE_);
+	connectionsMutex.Unlock();
 }
 bool HTTPConnection2::IsConnected(SystemAddress sa)
 {
@@ -613,9 +698,108 @@ bool HTTPConnection2::IsConnected(SystemAddress sa)
 	}
 	return false;
 }
-void HTTPConnection2::SendRequest(Request *request)
+HTTPConnection2::Connection* HTTPConnection2::GetConnection(const SystemAddress &sa) const
+{
+	for (unsigned int i=0; i < connections.Size(); i++)
+	{
+		if (connections[i]->address==sa)
+			return connections[i];
+	}
+	return 0;
+}
+HTTPConnection2::Connection* HTTPConnection2::GetConnectingConnection(const SystemAddress &sa) const
+{
+	Connection *connection = GetConnection(sa);
+	if (connection && connection->connected==false)
+		return connection;
+
+	// TCPInterface may have looked up a different address for the host than TransmitRequest() did
+	Connection *samePort=0;
+	unsigned int numSamePort=0;
+	for (unsigned int i=0; i < connections.Size(); i++)
+	{
+		if (connections[i]->connected)
+			continue;
+		if (connections[i]->connectingAddress==sa)
+			return connections[i];
+		if (connections[i]->port==sa.GetPort())
+		{
+			samePort=connections[i];
+			numSamePort++;
+		}
+	}
+
+	// Only if TCPInterface::Connect() could not say which address it used. With several hosts on the port, the connections could be swapped
+	if (numSamePort==1)
+		return samePort;
+	return 0;
+}
+void HTTPConnection2::Connect(Connection *connection)
+{
+	// Locked until connectingAddress is set, as the attempt may complete on the thread calling TCPInterface::Receive() before Connect() returns
+	connectionsMutex.Lock();
+	if (connection->ipVersion!=6)
+	{
+		connection->connectingAddress=tcpInterface->Connect(connection->host.C_String(), connection->port, false, AF_INET);
+	}
+	else
+	{
+#if RAKNET_SUPPORT_IPV6
+		connection->connectingAddress=tcpInterface->Connect(connection->host.C_String(), connection->port, false, AF_INET6);
+#else
+		RakAssert("HTTPConnection2::TransmitRequest needs define  RAKNET_SUPPORT_IPV6" && 0);
+#endif
+	}
+	connectionsMutex.Unlock();
+}
+void HTTPConnection2::SendPendingRequests(Connection *connection)
+{
+	// Requests are sent together, so a pipeline of small requests can share packets
+	const char *strings[16];
+	unsigned int lengths[16];
+	int numStrings=0;
+	while (connection->connected && connection->closing==false && connection->pendingRequests.Size()>0 &&
+		connection->sentRequests.Size() < maxPipelinedRequests)
+	{
+		Request *request = connection->pendingRequests.Pop();
+		request->hostCompletedAddress=connection->address;
+		request->timesSent++;
+		request->sentOnReusedConnection=connection->responsesReceived>0;
+		connection->sentRequests.Push(request, _FILE_AND_LINE_);
+		strings[numStrings]=request->stringToTransmit.C_String();
+		lengths[numStrings]=(unsigned int) request->stringToTransmit.GetLength();
+		numStrings++;
+		if (numStrings==16)
+		{
+			tcpInterface->SendList(strings, lengths, numStrings, connection->address, false);
+			numStrings=0;
+		}
+	}
+	if (numStrings>0)
+		tcpInterface->SendList(strings, lengths, numStrings, connection->address, false);
+}
+void HTTPConnection2::RemoveConnection(Connection *connection)
+{
+	for (unsigned int i=0; i < connections.Size(); i++)
+	{
+		if (connections[i]==connection)
+		{
+			connections.RemoveAtIndexFast(i);
+			return;
+		}
+	}
+}
+void HTTPConnection2::DeallocateConnection(Connection *connection)
 {
-	tcpInterface->Send(request->stringToTransmit.C_String(), (unsigned int) request->stringToTransmit.GetLength(), request->hostCompletedAddress, false);
+	while (connection->pendingRequests.Size())
+		RakNet::OP_DELETE(connection->pendingRequests.Pop(), _FILE_AND_LINE_);
+	while (connection->sentRequests.Size())
+		RakNet::OP_DELETE(connection->sentRequests.Pop(), _FILE_AND_LINE_);
+	connection->pendingRequests.Clear(_FILE_AND_LINE_);
+	connection->sentRequests.Clear(_FILE_AND_LINE_);
+	if (connection->responseData)
+		rakFree_Ex(connection->responseData, _FILE_AND_LINE_);
+	RakNet::OP_DELETE(connection, _FILE_AND_LINE_);
 }
 
 #endif // #if _RAKNET_SUPPORT_HTTPConnection2==1 && _RAKNET_SUPPORT_TCPInterface==1
@@ -26,6 +26,7 @@
 #include "DS_Queue.h"
 #include "PluginInterface2.h"
 #include "SimpleMutex.h"
+#include "GetTime.h"
 
 namespace RakNet
 {
@@ -35,7 +36,8 @@ struct SystemAddress;
 
 /// \brief Use HTTPConnection2 to communicate with a web server.
 /// \details Start an instance of TCPInterface via the Start() command.
-/// This class will handle connecting to transmit a request
+/// This class will handle connecting to transmit a request.
+/// One connection is kept open per host and reused by later requests to it, until it is idle for SetKeepAliveTimeout(). Requests to different hosts proceed at the same time
 class RAK_DLL_EXPORT HTTPConnection2 : public PluginInterface2
 {
 public:
@@ -45,6 +47,18 @@ public:
     HTTPConnection2();
     virtual ~HTTPConnection2();
 
+	/// \brief Receives the body of a response as it arrives, so large responses are not held in memory
+	class BodyCallback
+	{
+	public:
+		virtual ~BodyCallback() {}
+
+		/// \brief Part of the body of the response to a request passed this callback, in order, with chunked transfer encoding removed
+		/// \details Called from the thread calling TCPInterface::Receive(). Do not call HTTPConnection2 from here
+		/// \param[in] userData The parameter of the same name passed to TransmitRequest()
+		virtual void OnBodyData(const char *data, unsigned int length, void *userData)=0;
+	};
+
 	/// \brief Connect to, then transmit a request to a TCP based server
 	/// \param[in] tcp An instance of TCPInterface that previously had TCPInterface::Start() called
 	/// \param[in] stringToTransmit What string to transmit. See RakString::FormatForPOST(), RakString::FormatForGET(), RakString::FormatForDELETE()
@@ -54,8 +68,9 @@ public:
 	/// \param[in] ipVersion 4 for IPV4, 6 for IPV6
 	/// \param[in] useAddress Assume we are connected to this address and send to it, rather than do a lookup
 	/// \param[in] userData
+	/// \param[in] bodyCallback If not 0, the body of the response is passed to it as it arrives. responseReceived from GetResponse() then holds only the headers, and contentOffset is -1. Without it, a response longer than 1 GB fails and is returned empty
 	/// \return false if host is not a valid IP address or domain name
-	bool TransmitRequest(const char* stringToTransmit, const char* host, unsigned short port=80, bool useSSL=false, int ipVersion=4, SystemAddress useAddress=UNASSIGNED_SYSTEM_ADDRESS, void *userData=0);
+	bool TransmitRequest(const char* stringToTransmit, const char* host, unsigned short port=80, bool useSSL=false, int ipVersion=4, SystemAddress useAddress=UNASSIGNED_SYSTEM_ADDRESS, void *userData=0, BodyCallback *bodyCallback=0);
 
 	/// \brief Check for and return a response from a prior call to TransmitRequest()
 	/// As TCP is stream based, you may get a webserver reply over several calls to TCPInterface::Receive()
@@ -65,7 +80,7 @@ public:
 	/// \param[out] hostTransmitted The parameter of the same name passed to TransmitRequest()
 	/// \param[out] responseReceived The response, if any
 	/// \param[out] hostReceived The SystemAddress from ProcessTCPPacket() or OnLostConnection()
-	/// \param[out] contentOffset The offset from the start of responseReceived to the data body. Equivalent to searching for \r\n\r\n in responseReceived.
+	/// \param[out] contentOffset The offset from the start of responseReceived to the data body, which follows the headers. Chunked transfer encoding is removed from the body. -1 if there is no body
 	/// \param[out] userData Whatever you passed to TransmitRequest
 	/// \return true if there was a response. false if not.
 	bool GetResponse( RakString &stringTransmitted, RakString &hostTransmitted, RakString &responseReceived, SystemAddress &hostReceived, int &contentOffset, void **userData );
@@ -77,6 +92,21 @@ public:
 	/// \brief Return if any requests are waiting to be read by the user
 	bool HasResponse(void) const;
 
+	/// \brief How many requests to send to a host before it has answered the first, as HTTP/1.1 pipelining
+	/// \details Servers answer in the order requests were sent, so a slow response holds up those after it. Not all servers support it.
+	/// Defaults to 1, which sends each request once the one before it was answered
+	void SetMaxPipelinedRequests(unsigned int maxRequests);
+
+	/// \brief Whether to send again requests that a closed connection did not answer, even if that may not be safe
+	/// \details By default a request is only sent once more, on a new connection, if none of its response arrived, its method is GET, HEAD, PUT, DELETE or OPTIONS, and either it was sent on a connection that had already answered a request or the server said it would close the connection after an earlier response.
+	/// This covers a server closing an idle connection as a request was sent, without repeating a POST the server may have processed. Other requests are returned by GetResponse() with an empty response.
+	/// If true, every request without a response is sent once more. Defaults to false
+	void SetRetryUnansweredRequests(bool retry);
+
+	/// \brief How long a connection to a host is kept open without requests, for the next request to that host
+	/// \details Defaults to 15000. 0 closes connections once they have no requests. Servers also close connections, and a response with Connection: close closes it after that response
+	void SetKeepAliveTimeout(RakNet::TimeMS timeout);
+
 	struct Request
 	{
 		RakString stringToTransmit;
@@ -93,8 +123,14 @@ public:
 		bool chunked;
 		size_t thisChunkSize;
 		size_t bytesReadForThisChunk;
+		BodyCallback *bodyCallback;
+		unsigned int timesSent;
+		// Last sent on a connection that had already answered a request
+		bool sentOnReusedConnection;
 	};
 
+	/// \internal
+	virtual void Update(void);
 	/// \internal
 	virtual PluginReceiveResult OnReceive(Packet *packet);
 	virtual void OnClosedConnection(const SystemAddress &systemAddress, RakNetGUID rakNetGUID, PI2_LostConnectionReason lostConnectionReason );
@@ -103,17 +139,75 @@ public:
 
 protected:
 
-	bool IsConnected(SystemAddress sa);
-	void SendRequest(Request *request);
-	void RemovePendingRequest(SystemAddress sa);
-	void SendNextPendingRequest(void);
-	void SendPendingRequestToConnectedSystem(SystemAddress sa);
+	enum ResponseState
+	{
+		RS_HEADERS,
+		RS_BODY,
+		RS_BODY_UNTIL_CLOSE,
+		RS_CHUNK_SIZE,
+		RS_CHUNK_DATA,
+		RS_CHUNK_END,
+		RS_TRAILERS,
+	};
 
-	DataStructures::Queue<Request*> pendingRequests;
-	DataStructures::List<Request*> sentRequests;
+	/// A connection to one host, kept open for the next request to it
+	struct Connection
+	{
+		SystemAddress address;
+		// What TCPInterface::Connect() looked up for host, which the connection is reported with. May differ from address before connecting
+		SystemAddress connectingAddress;
+		RakString host;
+		unsigned short port;
+		bool useSSL;
+		int ipVersion;
+		bool connected;
+		// Set once the connection is to be closed, after which no more requests are sent on it
+		bool closing;
+		// Closed with requests left, to be connected again by Update()
+		bool reconnect;
+		RakNet::TimeMS idleSince;
+		// Waiting for the connection, or for room in the pipeline
+		DataStructures::Queue<Request*> pendingRequests;
+		// Answered in the order sent
+		DataStructures::Queue<Request*> sentRequests;
+
+		// The response being received. Only used from the thread calling TCPInterface::Receive()
+		Request *receivingRequest;
+		ResponseState responseState;
+		// Headers and body received so far, null terminated
+		char *responseData;
+		unsigned int responseLength, responseCapacity;
+		char chunkLine[32];
+		unsigned int chunkLineLength;
+		bool closeAfterResponse;
+		// Responses completed since connecting
+		unsigned int responsesReceived;
+	};
+
+	bool IsConnected(SystemAddress sa);
+	Connection* GetConnection(const SystemAddress &sa) const;
+	Connection* GetConnectingConnection(const SystemAddress &sa) const;
+	void Connect(Connection *connection);
+	void SendPendingRequests(Connection *connection);
+	void RemoveConnection(Connection *connection);
+	void DeallocateConnection(Connection *connection);
+	bool ParseResponse(Connection *connection, const char *data, unsigned int length);
+	bool OnResponseHeaders(Connection *connection);
+	bool ReceiveBody(Connection *connection, const char *data, unsigned int length);
+	void CompleteResponse(Connection *connection);
+	void FailResponse(Connection *connection);
+	void CompleteRequest(Request *request);
+	void FailRequest(Request *request, const SystemAddress &systemAddress);
+	bool CanRetry(const Request *request, bool serverSaidClose) const;
+
+	DataStructures::List<Connection*> connections;
 	DataStructures::List<Request*> completedRequests;
+	unsigned int requestsInProgress;
+	unsigned int maxPipelinedRequests;
+	RakNet::TimeMS keepAliveTimeout;
+	bool retryUnansweredRequests;
 
-	SimpleMutex pendingRequestsMutex, sentRequestsMutex, completedRequestsMutex;
+	SimpleMutex connectionsMutex, completedRequestsMutex;
 
 };
 
@@ -67,11 +67,16 @@ struct InternalPacketFixedSizeTransmissionHeader
 	// unsigned char reliability : 5;
 };
 
+/// Messages up to this size are copied into InternalPacket::stackData, rather than allocated
+#define INTERNAL_PACKET_STACK_DATA_BYTES 128
+
 /// Used in InternalPacket when pointing to sharedDataBlock, rather than allocating itself
 struct InternalPacketRefCountedData
 {
 	unsigned char *sharedDataBlock;
 	unsigned int refCount;
+	/// From ReliabilityLayer::AllocateSharedData(), rather than the pool of one ReliabilityLayer, because it is referenced by more than one
+	bool isShared;
 };
 
 /// Holds a user message, and related information
@@ -121,7 +126,7 @@ struct InternalPacket : public InternalPacketFixedSizeTransmissionHeader
 	// Linked list implementation so I can remove from the list via a pointer, without finding it in the list
 	InternalPacket *resendPrev, *resendNext,*unreliablePrev,*unreliableNext;
 
-	unsigned char stackData[128];
+	unsigned char stackData[INTERNAL_PACKET_STACK_DATA_BYTES];
 };
 
 } // namespace RakNet
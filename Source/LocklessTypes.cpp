@@ -32,7 +32,7 @@ uint32_t LocklessUint32_t::Increment(void)
 	mutex.Unlock();
 	return v;
 #else
-	return __sync_fetch_and_add (&value, (uint32_t) 1);
+	return __sync_add_and_fetch (&value, (uint32_t) 1);
 #endif
 }
 uint32_t LocklessUint32_t::Decrement(void)
@@ -47,6 +47,54 @@ uint32_t LocklessUint32_t::Decrement(void)
 	mutex.Unlock();
 	return v;
 #else
-	return __sync_fetch_and_add (&value, (uint32_t) -1);
+	return __sync_sub_and_fetch (&value, (uint32_t) 1);
+#endif
+}
+#if defined(ANDROID) || defined(__S3E__) || defined(__APPLE__)
+// Same platforms LocklessUint32_t uses a mutex on
+static SimpleMutex pointerMutex;
+#endif
+
+void* RakNet::LocklessExchangePointer(void * volatile *destination, void *value)
+{
+#ifdef _WIN32
+	return InterlockedExchangePointer((PVOID volatile *) destination, value);
+#elif defined(ANDROID) || defined(__S3E__) || defined(__APPLE__)
+	pointerMutex.Lock();
+	void *previous=*destination;
+	*destination=value;
+	pointerMutex.Unlock();
+	return previous;
+#else
+	// __sync_lock_test_and_set() is only an acquire barrier
+	__sync_synchronize();
+	return __sync_lock_test_and_set(destination, value);
+#endif
+}
+void* RakNet::LocklessCompareExchangePointer(void * volatile *destination, void *expected, void *value)
+{
+#ifdef _WIN32
+	return InterlockedCompareExchangePointer((PVOID volatile *) destination, value, expected);
+#elif defined(ANDROID) || defined(__S3E__) || defined(__APPLE__)
+	pointerMutex.Lock();
+	void *previous=*destination;
+	if (previous==expected)
+		*destination=value;
+	pointerMutex.Unlock();
+	return previous;
+#else
+	return __sync_val_compare_and_swap(destination, expected, value);
+#endif
+}
+void RakNet::LocklessMemoryBarrier(void)
+{
+#ifdef _WIN32
+	MemoryBarrier();
+#elif defined(ANDROID) || defined(__S3E__) || defined(__APPLE__)
+	// Locking a mutex is a barrier
+	pointerMutex.Lock();
+	pointerMutex.Unlock();
+#else
+	__sync_synchronize();
 #endif
 }
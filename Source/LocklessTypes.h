@@ -45,6 +45,13 @@ protected:
 #endif
 };
 
+// Pointer operations for lists threads share without a lock. Each is a full memory barrier
+// Sets *destination to value, and returns what it was
+RAK_DLL_EXPORT void* LocklessExchangePointer(void * volatile *destination, void *value);
+// Sets *destination to value if it was expected, and returns what it was
+RAK_DLL_EXPORT void* LocklessCompareExchangePointer(void * volatile *destination, void *expected, void *value);
+RAK_DLL_EXPORT void LocklessMemoryBarrier(void);
+
 }
 
 #endif
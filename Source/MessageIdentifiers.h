@@ -418,7 +418,8 @@ enum DefaultMessageIDTypes
 	ID_NAT_REQUEST_BOUND_ADDRESSES,
 	ID_NAT_RESPOND_BOUND_ADDRESSES,
 	ID_FCM2_UPDATE_USER_CONTEXT,
-	ID_RESERVED_3,
+	/// ReplicaManager3 plugin - Serialized data of an object, as a delta against a state acknowledged before. See RM3SR_SERIALIZED_DELTA
+	ID_REPLICA_MANAGER_SERIALIZE_DELTA,
 	ID_RESERVED_4,
 	ID_RESERVED_5,
 	ID_RESERVED_6,
@@ -0,0 +1,172 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "NativeFeatureIncludes.h"
+#if _RAKNET_SUPPORT_MetricsExporter==1 && _RAKNET_SUPPORT_TCPInterface==1
+
+#include "MetricsExporter.h"
+#include "TCPInterface.h"
+#include "RakPeerInterface.h"
+#include "RakNetMetrics.h"
+#include <string.h>
+#include <stdio.h>
+
+using namespace RakNet;
+
+STATIC_FACTORY_DEFINITIONS(MetricsExporter,MetricsExporter);
+
+// Requests longer than this are not HTTP requests for metrics
+static const unsigned int MAX_REQUEST_LENGTH=8192;
+
+MetricsExporter::MetricsExporter()
+{
+	tcpInterface=0;
+}
+MetricsExporter::~MetricsExporter()
+{
+	Stop();
+}
+bool MetricsExporter::Start(unsigned short port, unsigned short maxConnections, const char *bindAddress)
+{
+	Stop();
+	tcpInterface=RakNet::OP_NEW<TCPInterface>(_FILE_AND_LINE_);
+	if (tcpInterface->Start(port, maxConnections, maxConnections, -99999, AF_INET, bindAddress)==false)
+	{
+		RakNet::OP_DELETE(tcpInterface, _FILE_AND_LINE_);
+		tcpInterface=0;
+		return false;
+	}
+	return true;
+}
+void MetricsExporter::Stop(void)
+{
+	if (tcpInterface)
+	{
+		tcpInterface->Stop();
+		RakNet::OP_DELETE(tcpInterface, _FILE_AND_LINE_);
+		tcpInterface=0;
+	}
+	requests.Clear(false, _FILE_AND_LINE_);
+}
+void MetricsExporter::AddRakPeer(RakPeerInterface *rakPeer, const char *labels)
+{
+	Target target;
+	target.rakPeer=rakPeer;
+	target.labels=labels ? labels : "";
+	targets.Push(target, _FILE_AND_LINE_);
+}
+void MetricsExporter::RemoveRakPeer(RakPeerInterface *rakPeer)
+{
+	for (unsigned int i=0; i < targets.Size(); i++)
+	{
+		if (targets[i].rakPeer==rakPeer)
+		{
+			targets.RemoveAtIndex(i);
+			return;
+		}
+	}
+}
+unsigned int MetricsExporter::GetRequestIndex(const SystemAddress &systemAddress) const
+{
+	for (unsigned int i=0; i < requests.Size(); i++)
+	{
+		if (requests[i].systemAddress==systemAddress)
+			return i;
+	}
+	return (unsigned int) -1;
+}
+void MetricsExporter::Update(void)
+{
+	if (tcpInterface==0)
+		return;
+
+	SystemAddress systemAddress;
+	unsigned int index;
+	while ((systemAddress=tcpInterface->HasNewIncomingConnection())!=UNASSIGNED_SYSTEM_ADDRESS)
+	{
+		Request request;
+		request.systemAddress=systemAddress;
+		request.answered=false;
+		requests.Push(request, _FILE_AND_LINE_);
+	}
+	while ((systemAddress=tcpInterface->HasLostConnection())!=UNASSIGNED_SYSTEM_ADDRESS)
+	{
+		index=GetRequestIndex(systemAddress);
+		if (index!=(unsigned int) -1)
+			requests.RemoveAtIndexFast(index);
+	}
+
+	Packet *packet;
+	while ((packet=tcpInterface->Receive())!=0)
+	{
+		index=GetRequestIndex(packet->systemAddress);
+		if (index!=(unsigned int) -1 && requests[index].answered==false)
+		{
+			Request *request = &requests[index];
+			request->received.AppendBytes((const char*) packet->data, packet->length);
+			if (strstr(request->received.C_String(), "\r\n\r\n") || strstr(request->received.C_String(), "\n\n"))
+				Answer(request);
+			else if (request->received.GetLength() > MAX_REQUEST_LENGTH)
+			{
+				tcpInterface->CloseConnection(request->systemAddress);
+				requests.RemoveAtIndexFast(index);
+			}
+		}
+		tcpInterface->DeallocatePacket(packet);
+	}
+
+	// Closing drops what is not sent yet, so wait for it
+	index=0;
+	while (index < requests.Size())
+	{
+		if (requests[index].answered && tcpInterface->GetOutgoingDataBufferSize(requests[index].systemAddress)==0)
+		{
+			tcpInterface->CloseConnection(requests[index].systemAddress);
+			requests.RemoveAtIndexFast(index);
+		}
+		else
+			index++;
+	}
+}
+void MetricsExporter::Answer(Request *request)
+{
+	RakString body;
+	const char *status;
+	if (strncmp(request->received.C_String(), "GET ", 4)==0)
+	{
+		status="200 OK";
+		DataStructures::List<RakNetMetricsSnapshot> snapshots;
+		DataStructures::List<const char*> labels;
+		RakNetMetricsSnapshot snapshot;
+		for (unsigned int i=0; i < targets.Size(); i++)
+		{
+			targets[i].rakPeer->GetMetrics(&snapshot);
+			snapshots.Push(snapshot, _FILE_AND_LINE_);
+			labels.Push(targets[i].labels.C_String(), _FILE_AND_LINE_);
+		}
+		if (snapshots.Size())
+			RakNetMetrics::SnapshotsToText(&snapshots[0], &labels[0], snapshots.Size(), &body);
+	}
+	else
+	{
+		status="405 Method Not Allowed";
+		body="Only GET is supported\n";
+	}
+
+	char header[256];
+	sprintf(header, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %u\r\nConnection: close\r\n\r\n", status, (unsigned int) body.GetLength());
+	const char *data[2]={header, body.C_String()};
+	unsigned int lengths[2]={(unsigned int) strlen(header), (unsigned int) body.GetLength()};
+	tcpInterface->SendList(data, lengths, 2, request->systemAddress, false);
+	request->answered=true;
+	request->received.Clear();
+}
+
+#endif // _RAKNET_SUPPORT_*
@@ -0,0 +1,89 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file MetricsExporter.h
+/// \brief Serves RakNetMetrics of one or more RakPeer instances over HTTP, for monitoring systems that scrape text
+///
+
+
+#include "NativeFeatureIncludes.h"
+#if _RAKNET_SUPPORT_MetricsExporter==1 && _RAKNET_SUPPORT_TCPInterface==1
+
+#ifndef __METRICS_EXPORTER_H
+#define __METRICS_EXPORTER_H
+
+#include "Export.h"
+#include "RakNetTypes.h"
+#include "RakString.h"
+#include "DS_List.h"
+
+namespace RakNet
+{
+/// Forward declarations
+class TCPInterface;
+class RakPeerInterface;
+
+/// \brief Answers every HTTP GET with RakPeerInterface::GetMetrics() of the peers added, in the Prometheus text exposition format
+/// \details Sockets are handled by the thread of its own TCPInterface. Update() only takes snapshots when a request is complete, and never locks RakPeer, so scrapes do not hold up the network thread
+class RAK_DLL_EXPORT MetricsExporter
+{
+public:
+	// GetInstance() and DestroyInstance(instance*)
+	STATIC_FACTORY_DECLARATIONS(MetricsExporter)
+
+	MetricsExporter();
+	virtual ~MetricsExporter();
+
+	/// Starts listening for HTTP requests
+	/// \param[in] port TCP port to listen on
+	/// \param[in] maxConnections How many scrapes can be answered at once
+	/// \param[in] bindAddress Address to listen on, for example 127.0.0.1 to only serve this computer. 0 for every address
+	/// \return false if the port could not be bound
+	bool Start(unsigned short port, unsigned short maxConnections=4, const char *bindAddress=0);
+
+	/// Stops listening and closes connections
+	void Stop(void);
+
+	/// Serves the metrics of \a rakPeer
+	/// \param[in] labels Added to each of its lines, to tell peers apart. For example peer="lobby". 0 for none
+	void AddRakPeer(RakPeerInterface *rakPeer, const char *labels=0);
+
+	/// Stops serving the metrics of \a rakPeer. Call before deleting it
+	void RemoveRakPeer(RakPeerInterface *rakPeer);
+
+	/// Reads requests and answers those that are complete. Call regularly from one thread, which does not have to be the one calling RakPeer::Receive()
+	void Update(void);
+
+protected:
+	struct Target
+	{
+		RakPeerInterface *rakPeer;
+		RakString labels;
+	};
+	struct Request
+	{
+		SystemAddress systemAddress;
+		RakString received;
+		// Closed once the response is sent
+		bool answered;
+	};
+	unsigned int GetRequestIndex(const SystemAddress &systemAddress) const;
+	void Answer(Request *request);
+
+	TCPInterface *tcpInterface;
+	DataStructures::List<Target> targets;
+	DataStructures::List<Request> requests;
+};
+
+} // namespace RakNet
+
+#endif
+
+#endif // _RAKNET_SUPPORT_*
@@ -64,6 +64,16 @@ bool NatPunchthroughServer::User::HasConnectionAttemptToUser(User *user)
 	}
 	return false;
 }
+NatPunchthroughServer::ConnectionAttempt *NatPunchthroughServer::User::GetConnectionAttempt(uint16_t sessionId)
+{
+	unsigned int index;
+	for (index=0; index < connectionAttempts.Size(); index++)
+	{
+		if (connectionAttempts[index]->sessionId==sessionId)
+			return connectionAttempts[index];
+	}
+	return 0;
+}
 void NatPunchthroughServer::User::LogConnectionAttempts(RakNet::RakString &rs)
 {
 	rs.Clear();
@@ -125,12 +135,17 @@ NatPunchthroughServer::NatPunchthroughServer()
 }
 NatPunchthroughServer::~NatPunchthroughServer()
 {
+	RemoveLinkedAttempts(false);
+
 	User *user, *otherUser;
 	ConnectionAttempt *connectionAttempt;
-	unsigned int j;
-	while(users.Size())
+	unsigned int i,j;
+	DataStructures::List<User*> userList;
+	DataStructures::List<RakNetGUID> guidList;
+	users.GetAsList(userList, guidList, _FILE_AND_LINE_);
+	for (i=0; i < userList.Size(); i++)
 	{
-		user = users[0];
+		user = userList[i];
 		for (j=0; j < user->connectionAttempts.Size(); j++)
 		{
 			connectionAttempt=user->connectionAttempts[j];
@@ -141,83 +156,195 @@ NatPunchthroughServer::~NatPunchthroughServer()
 			otherUser->DeleteConnectionAttempt(connectionAttempt);
 		}
 		RakNet::OP_DELETE(user,_FILE_AND_LINE_);
-		users[0]=users[users.Size()-1];
-		users.RemoveAtIndex(users.Size()-1);
 	}
+	users.Clear(_FILE_AND_LINE_);
 }
 void NatPunchthroughServer::SetDebugInterface(NatPunchthroughServerDebugInterface *i)
 {
 	natPunchthroughServerDebugInterface=i;
 }
+void NatPunchthroughServer::AddLinkedServer(NatPunchthroughServer *server)
+{
+	if (server==this || linkedServers.GetIndexOf(server)!=(unsigned int)-1)
+		return;
+
+	// Linked servers are groups where each server knows every other
+	DataStructures::List<NatPunchthroughServer*> group, otherGroup;
+	group=linkedServers;
+	group.Push(this, _FILE_AND_LINE_);
+	otherGroup=server->linkedServers;
+	otherGroup.Push(server, _FILE_AND_LINE_);
+	unsigned int i,j;
+	for (i=0; i < group.Size(); i++)
+	{
+		for (j=0; j < otherGroup.Size(); j++)
+		{
+			group[i]->linkedServers.Push(otherGroup[j], _FILE_AND_LINE_);
+			otherGroup[j]->linkedServers.Push(group[i], _FILE_AND_LINE_);
+		}
+	}
+}
+void NatPunchthroughServer::RemoveLinkedServers(void)
+{
+	RemoveLinkedAttempts(true);
+}
+void NatPunchthroughServer::RemoveLinkedAttempts(bool notify)
+{
+	if (linkedServers.Size()==0)
+		return;
+
+	DataStructures::List<User*> userList;
+	DataStructures::List<RakNetGUID> guidList;
+	DataStructures::List<User *> freedUpInProgressUsers;
+	User *user, *otherUser;
+	ConnectionAttempt *connectionAttempt;
+	unsigned int i,j;
+	users.GetAsList(userList, guidList, _FILE_AND_LINE_);
+	for (i=0; i < userList.Size(); i++)
+	{
+		user=userList[i];
+		j=0;
+		while (j < user->connectionAttempts.Size())
+		{
+			connectionAttempt=user->connectionAttempts[j];
+			if (connectionAttempt->sender==user)
+				otherUser=connectionAttempt->recipient;
+			else
+				otherUser=connectionAttempt->sender;
+			if (otherUser->server==this)
+			{
+				j++;
+				continue;
+			}
+
+			RakNet::BitStream outgoingBs;
+			outgoingBs.Write((MessageID)ID_NAT_CONNECTION_TO_TARGET_LOST);
+			outgoingBs.Write(user->guid);
+			outgoingBs.Write(connectionAttempt->sessionId);
+			otherUser->server->rakPeerInterface->Send(&outgoingBs,HIGH_PRIORITY,RELIABLE_ORDERED,0,otherUser->systemAddress,false);
+			if (notify)
+			{
+				outgoingBs.Reset();
+				outgoingBs.Write((MessageID)ID_NAT_CONNECTION_TO_TARGET_LOST);
+				outgoingBs.Write(otherUser->guid);
+				outgoingBs.Write(connectionAttempt->sessionId);
+				rakPeerInterface->Send(&outgoingBs,HIGH_PRIORITY,RELIABLE_ORDERED,0,user->systemAddress,false);
+			}
+
+			if (connectionAttempt->attemptPhase==ConnectionAttempt::NAT_ATTEMPT_PHASE_GETTING_RECENT_PORTS)
+			{
+				otherUser->isReady=true;
+				user->isReady=true;
+				freedUpInProgressUsers.Insert(otherUser, _FILE_AND_LINE_ );
+				if (notify)
+					freedUpInProgressUsers.Insert(user, _FILE_AND_LINE_ );
+			}
+
+			// Removes index j
+			otherUser->DerefConnectionAttempt(connectionAttempt);
+			user->DeleteConnectionAttempt(connectionAttempt);
+		}
+	}
+
+	for (i=0; i < linkedServers.Size(); i++)
+		linkedServers[i]->linkedServers.RemoveAtIndex(linkedServers[i]->linkedServers.GetIndexOf(this));
+	linkedServers.Clear(false, _FILE_AND_LINE_);
+
+	for (i=0; i < freedUpInProgressUsers.Size(); i++)
+		StartPunchthroughForUser(freedUpInProgressUsers[i]);
+}
+NatPunchthroughServer::User *NatPunchthroughServer::GetUser(RakNetGUID guid)
+{
+	User **user = users.Peek(guid);
+	if (user)
+		return *user;
+	for (unsigned int i=0; i < linkedServers.Size(); i++)
+	{
+		user = linkedServers[i]->users.Peek(guid);
+		if (user)
+			return *user;
+	}
+	return 0;
+}
+uint16_t NatPunchthroughServer::GetSessionId(User *sender, User *recipient)
+{
+	// Clients tell attempts apart by session id. Skip ids in use, as they wrap around, and linked servers count their own
+	uint16_t id;
+	do
+	{
+		id=sessionId++;
+	} while (sender->GetConnectionAttempt(id) || recipient->GetConnectionAttempt(id));
+	return id;
+}
 void NatPunchthroughServer::Update(void)
 {
 	ConnectionAttempt *connectionAttempt;
 	User *user, *recipient;
-	unsigned int i,j;
 	RakNet::Time time = RakNet::GetTime();
 	if (time > lastUpdate+250)
 	{
 		lastUpdate=time;
 
-		for (i=0; i < users.Size(); i++)
+		while (attemptTimeouts.Size() &&
+			time > attemptTimeouts.Peek().startTime &&
+			time > 10000 + attemptTimeouts.Peek().startTime ) // Formerly 5000, but sometimes false positives
 		{
-			user=users[i];
-			for (j=0; j < user->connectionAttempts.Size(); j++)
+			AttemptTimeout attemptTimeout = attemptTimeouts.Pop();
+
+			// Skip attempts that finished, or that started again later
+			User **sender = users.Peek(attemptTimeout.senderGuid);
+			if (sender==0)
+				continue;
+			user=*sender;
+			connectionAttempt=user->GetConnectionAttempt(attemptTimeout.sessionId);
+			if (connectionAttempt==0 ||
+				connectionAttempt->sender!=user ||
+				connectionAttempt->attemptPhase==ConnectionAttempt::NAT_ATTEMPT_PHASE_NOT_STARTED ||
+				connectionAttempt->startTime!=attemptTimeout.startTime)
+				continue;
+
+			RakNet::BitStream outgoingBs;
+
+			// that other system might not be running the plugin
+			outgoingBs.Write((MessageID)ID_NAT_TARGET_UNRESPONSIVE);
+			outgoingBs.Write(connectionAttempt->recipient->guid);
+			outgoingBs.Write(connectionAttempt->sessionId);
+			rakPeerInterface->Send(&outgoingBs,HIGH_PRIORITY,RELIABLE_ORDERED,0,connectionAttempt->sender->systemAddress,false);
+
+			// 05/28/09 Previously only told sender about ID_NAT_CONNECTION_TO_TARGET_LOST
+			// However, recipient may be expecting it due to external code
+			// In that case, recipient would never get any response if the sender dropped
+			outgoingBs.Reset();
+			outgoingBs.Write((MessageID)ID_NAT_TARGET_UNRESPONSIVE);
+			outgoingBs.Write(connectionAttempt->sender->guid);
+			outgoingBs.Write(connectionAttempt->sessionId);
+			connectionAttempt->recipient->server->rakPeerInterface->Send(&outgoingBs,HIGH_PRIORITY,RELIABLE_ORDERED,0,connectionAttempt->recipient->systemAddress,false);
+
+			connectionAttempt->sender->isReady=true;
+			connectionAttempt->recipient->isReady=true;
+			recipient=connectionAttempt->recipient;
+
+
+			if (natPunchthroughServerDebugInterface)
 			{
-				connectionAttempt=user->connectionAttempts[j];
-				if (connectionAttempt->sender==user)
-				{
-					if (connectionAttempt->attemptPhase!=ConnectionAttempt::NAT_ATTEMPT_PHASE_NOT_STARTED &&
-						time > connectionAttempt->startTime &&
-						time > 10000 + connectionAttempt->startTime ) // Formerly 5000, but sometimes false positives
-					{
-						RakNet::BitStream outgoingBs;
-						
-						// that other system might not be running the plugin
-						outgoingBs.Write((MessageID)ID_NAT_TARGET_UNRESPONSIVE);
-						outgoingBs.Write(connectionAttempt->recipient->guid);
-						outgoingBs.Write(connectionAttempt->sessionId);
-						rakPeerInterface->Send(&outgoingBs,HIGH_PRIORITY,RELIABLE_ORDERED,0,connectionAttempt->sender->systemAddress,false);
-
-						// 05/28/09 Previously only told sender about ID_NAT_CONNECTION_TO_TARGET_LOST
-						// However, recipient may be expecting it due to external code
-						// In that case, recipient would never get any response if the sender dropped
-						outgoingBs.Reset();
-						outgoingBs.Write((MessageID)ID_NAT_TARGET_UNRESPONSIVE);
-						outgoingBs.Write(connectionAttempt->sender->guid);
-						outgoingBs.Write(connectionAttempt->sessionId);
-						rakPeerInterface->Send(&outgoingBs,HIGH_PRIORITY,RELIABLE_ORDERED,0,connectionAttempt->recipient->systemAddress,false);
-
-						connectionAttempt->sender->isReady=true;
-						connectionAttempt->recipient->isReady=true;
-						recipient=connectionAttempt->recipient;
-
-
-						if (natPunchthroughServerDebugInterface)
-						{
-							char str[1024];
-							char addr1[128], addr2[128];
-							// 8/01/09 Fixed bug where this was after DeleteConnectionAttempt()
-							connectionAttempt->sender->systemAddress.ToString(true,addr1);
-							connectionAttempt->recipient->systemAddress.ToString(true,addr2);
-							sprintf(str, "Sending ID_NAT_TARGET_UNRESPONSIVE to sender %s and recipient %s.", addr1, addr2);
-							natPunchthroughServerDebugInterface->OnServerMessage(str);
-							RakNet::RakString log;
-							connectionAttempt->sender->LogConnectionAttempts(log);
-							connectionAttempt->recipient->LogConnectionAttempts(log);
-						}
-
-
-						connectionAttempt->sender->DerefConnectionAttempt(connectionAttempt);
-						connectionAttempt->recipient->DeleteConnectionAttempt(connectionAttempt);
-
-						StartPunchthroughForUser(user);
-						StartPunchthroughForUser(recipient);
-
-						break;
-					}
-				}
+				char str[1024];
+				char addr1[128], addr2[128];
+				// 8/01/09 Fixed bug where this was after DeleteConnectionAttempt()
+				connectionAttempt->sender->systemAddress.ToString(true,addr1);
+				connectionAttempt->recipient->systemAddress.ToString(true,addr2);
+				sprintf(str, "Sending ID_NAT_TARGET_UNRESPONSIVE to sender %s and recipient %s.", addr1, addr2);
+				natPunchthroughServerDebugInterface->OnServerMessage(str);
+				RakNet::RakString log;
+				connectionAttempt->sender->LogConnectionAttempts(log);
+				connectionAttempt->recipient->LogConnectionAttempts(log);
 			}
+
+
+			connectionAttempt->sender->DerefConnectionAttempt(connectionAttempt);
+			connectionAttempt->recipient->DeleteConnectionAttempt(connectionAttempt);
+
+			StartPunchthroughForUser(user);
+			StartPunchthroughForUser(recipient);
 		}
 	}
 }
@@ -289,13 +416,12 @@ void NatPunchthroughServer::OnClosedConnection(const SystemAddress &systemAddres
 	(void) systemAddress;
 
 	unsigned int i=0;
-	bool objectExists;
-	i = users.GetIndexFromKey(rakNetGUID, &objectExists);
-	if (objectExists)
+	User **userPtr = users.Peek(rakNetGUID);
+	if (userPtr)
 	{
 		RakNet::BitStream outgoingBs;
 		DataStructures::List<User *> freedUpInProgressUsers;
-		User *user = users[i];
+		User *user = *userPtr;
 		User *otherUser;
 		unsigned int connectionAttemptIndex;
 		ConnectionAttempt *connectionAttempt;
@@ -318,7 +444,7 @@ void NatPunchthroughServer::OnClosedConnection(const SystemAddress &systemAddres
 			outgoingBs.Write((MessageID)ID_NAT_CONNECTION_TO_TARGET_LOST);
 			outgoingBs.Write(rakNetGUID);
 			outgoingBs.Write(connectionAttempt->sessionId);
-			rakPeerInterface->Send(&outgoingBs,HIGH_PRIORITY,RELIABLE_ORDERED,0,otherUser->systemAddress,false);
+			otherUser->server->rakPeerInterface->Send(&outgoingBs,HIGH_PRIORITY,RELIABLE_ORDERED,0,otherUser->systemAddress,false);
 
 			// 4/22/09 - Bug: was checking inProgress, legacy variable not used elsewhere
 			if (connectionAttempt->attemptPhase==ConnectionAttempt::NAT_ATTEMPT_PHASE_GETTING_RECENT_PORTS)
@@ -330,8 +456,8 @@ void NatPunchthroughServer::OnClosedConnection(const SystemAddress &systemAddres
 			otherUser->DeleteConnectionAttempt(connectionAttempt);
 		}
 
-		RakNet::OP_DELETE(users[i], _FILE_AND_LINE_);
-		users.RemoveAtIndex(i);
+		users.Remove(rakNetGUID, _FILE_AND_LINE_);
+		RakNet::OP_DELETE(user, _FILE_AND_LINE_);
 
 		for (i=0; i < freedUpInProgressUsers.Size(); i++)
 		{
@@ -367,11 +493,13 @@ void NatPunchthroughServer::OnNewConnection(const SystemAddress &systemAddress,
 	(void) isIncoming;
 
 	User *user = RakNet::OP_NEW<User>(_FILE_AND_LINE_);
+	user->server=this;
 	user->guid=rakNetGUID;
 	user->mostRecentPort=0;
 	user->systemAddress=systemAddress;
 	user->isReady=true;
-	users.Insert(rakNetGUID, user, true, _FILE_AND_LINE_);
+	RakAssert(users.HasData(rakNetGUID)==false);
+	users.Push(rakNetGUID, user, _FILE_AND_LINE_);
 
 //	printf("Adding to users %s\n", rakNetGUID.ToString());
 //	printf("DEBUG users[0] guid=%s\n", users[0]->guid.ToString());
@@ -384,16 +512,16 @@ void NatPunchthroughServer::OnNATPunchthroughRequest(Packet *packet)
 	RakNetGUID recipientGuid, senderGuid;
 	incomingBs.Read(recipientGuid);
 	senderGuid=packet->guid;
-	unsigned int i;
-	bool objectExists;
-	i = users.GetIndexFromKey(senderGuid, &objectExists);
-	RakAssert(objectExists);
+	User **sender = users.Peek(senderGuid);
+	RakAssert(sender);
+	if (sender==0)
+		return;
 
 	ConnectionAttempt *ca = RakNet::OP_NEW<ConnectionAttempt>(_FILE_AND_LINE_);
-	ca->sender=users[i];
-	ca->sessionId=sessionId++;
-	i = users.GetIndexFromKey(recipientGuid, &objectExists);
-	if (objectExists==false || ca->sender == ca->recipient)
+	ca->sender=*sender;
+	// The recipient may be connected to a linked server
+	ca->recipient=GetUser(recipientGuid);
+	if (ca->recipient==0 || ca->sender == ca->recipient)
 	{
 // 		printf("DEBUG %i\n", __LINE__);
 // 		printf("DEBUG recipientGuid=%s\n", recipientGuid.ToString());
@@ -405,7 +533,6 @@ void NatPunchthroughServer::OnNATPunchthroughRequest(Packet *packet)
 		RakNet::OP_DELETE(ca,_FILE_AND_LINE_);
 		return;
 	}
-	ca->recipient=users[i];
 	if (ca->recipient->HasConnectionAttemptToUser(ca->sender))
 	{
 		outgoingBs.Write((MessageID)ID_NAT_ALREADY_IN_PROGRESS);
@@ -415,6 +542,7 @@ void NatPunchthroughServer::OnNATPunchthroughRequest(Packet *packet)
 		return;
 	}
 
+	ca->sessionId=GetSessionId(ca->sender, ca->recipient);
 	ca->sender->connectionAttempts.Insert(ca, _FILE_AND_LINE_ );
 	ca->recipient->connectionAttempts.Insert(ca, _FILE_AND_LINE_ );
 
@@ -422,13 +550,11 @@ void NatPunchthroughServer::OnNATPunchthroughRequest(Packet *packet)
 }
 void NatPunchthroughServer::OnClientReady(Packet *packet)
 {
-	unsigned int i;
-	bool objectExists;
-	i = users.GetIndexFromKey(packet->guid, &objectExists);
-	if (objectExists)
+	User **user = users.Peek(packet->guid);
+	if (user)
 	{
-		users[i]->isReady=true;
-		StartPunchthroughForUser(users[i]);
+		(*user)->isReady=true;
+		StartPunchthroughForUser(*user);
 	}
 }
 void NatPunchthroughServer::OnGetMostRecentPort(Packet *packet)
@@ -440,11 +566,11 @@ void NatPunchthroughServer::OnGetMostRecentPort(Packet *packet)
 	bsIn.Read(sessionId);
 	bsIn.Read(mostRecentPort);
 
-	unsigned int i,j;
+	unsigned int j;
 	User *user;
 	ConnectionAttempt *connectionAttempt;
-	bool objectExists;
-	i = users.GetIndexFromKey(packet->guid, &objectExists);
+	User **userPtr = users.Peek(packet->guid);
+	bool objectExists = userPtr!=0;
 
 	if (natPunchthroughServerDebugInterface)
 	{
@@ -458,7 +584,7 @@ void NatPunchthroughServer::OnGetMostRecentPort(Packet *packet)
 
 	if (objectExists)
 	{
-		user=users[i];
+		user=*userPtr;
 		user->mostRecentPort=mostRecentPort;
 		RakNet::Time time = RakNet::GetTime();
 
@@ -479,8 +605,11 @@ void NatPunchthroughServer::OnGetMostRecentPort(Packet *packet)
 				senderTargetAddress.SetPortHostOrder(connectionAttempt->sender->mostRecentPort);
 
 				// Pick a time far enough in the future that both systems will have gotten the message
-				int targetPing = rakPeerInterface->GetAveragePing(recipientTargetAddress);
-				int senderPing = rakPeerInterface->GetAveragePing(senderSystemAddress);
+				// Either may be connected to a linked server
+				RakPeerInterface *recipientPeer = connectionAttempt->recipient->server->rakPeerInterface;
+				RakPeerInterface *senderPeer = connectionAttempt->sender->server->rakPeerInterface;
+				int targetPing = recipientPeer->GetAveragePing(recipientTargetAddress);
+				int senderPing = senderPeer->GetAveragePing(senderSystemAddress);
 				RakNet::Time simultaneousAttemptTime;
 				if (targetPing==-1 || senderPing==-1)
 					simultaneousAttemptTime = time + 1500;
@@ -511,10 +640,10 @@ void NatPunchthroughServer::OnGetMostRecentPort(Packet *packet)
 				bsOut.Write(connectionAttempt->sessionId);
 				bsOut.Write(senderTargetAddress); // Public IP, using most recent port
 				for (j=0; j < MAXIMUM_NUMBER_OF_INTERNAL_IDS; j++) // Internal IP
-					bsOut.Write(rakPeerInterface->GetInternalID(senderSystemAddress,j));
+					bsOut.Write(senderPeer->GetInternalID(senderSystemAddress,j));
 				bsOut.Write(connectionAttempt->sender->guid);
 				bsOut.Write(false);
-				rakPeerInterface->Send(&bsOut,HIGH_PRIORITY,RELIABLE_ORDERED,0,recipientSystemAddress,false);
+				recipientPeer->Send(&bsOut,HIGH_PRIORITY,RELIABLE_ORDERED,0,recipientSystemAddress,false);
 
 
 				if (natPunchthroughServerDebugInterface)
@@ -536,10 +665,10 @@ void NatPunchthroughServer::OnGetMostRecentPort(Packet *packet)
 				bsOut.Write(connectionAttempt->sessionId);
 				bsOut.Write(recipientTargetAddress); // Public IP, using most recent port
 				for (j=0; j < MAXIMUM_NUMBER_OF_INTERNAL_IDS; j++) // Internal IP
-					bsOut.Write(rakPeerInterface->GetInternalID(recipientSystemAddress,j));						
+					bsOut.Write(recipientPeer->GetInternalID(recipientSystemAddress,j));						
 				bsOut.Write(connectionAttempt->recipient->guid);
 				bsOut.Write(true);
-				rakPeerInterface->Send(&bsOut,HIGH_PRIORITY,RELIABLE_ORDERED,0,senderSystemAddress,false);
+				senderPeer->Send(&bsOut,HIGH_PRIORITY,RELIABLE_ORDERED,0,senderSystemAddress,false);
 
 				connectionAttempt->recipient->DerefConnectionAttempt(connectionAttempt);
 				connectionAttempt->sender->DeleteConnectionAttempt(connectionAttempt);
@@ -604,6 +733,12 @@ void NatPunchthroughServer::StartPunchthroughForUser(User *user)
 			recipient->isReady=false;
 			connectionAttempt->attemptPhase=ConnectionAttempt::NAT_ATTEMPT_PHASE_GETTING_RECENT_PORTS;
 			connectionAttempt->startTime=RakNet::GetTime();
+			// Timed out by the server of the sender
+			AttemptTimeout attemptTimeout;
+			attemptTimeout.senderGuid=sender->guid;
+			attemptTimeout.sessionId=connectionAttempt->sessionId;
+			attemptTimeout.startTime=connectionAttempt->startTime;
+			sender->server->attemptTimeouts.Push(attemptTimeout, _FILE_AND_LINE_);
 
 			sender->mostRecentPort=0;
 			recipient->mostRecentPort=0;
@@ -612,8 +747,8 @@ void NatPunchthroughServer::StartPunchthroughForUser(User *user)
 			outgoingBs.Write((MessageID)ID_NAT_GET_MOST_RECENT_PORT);
 			// 4/29/09 Write sessionID so we don't use returned port for a system we don't want
 			outgoingBs.Write(connectionAttempt->sessionId);
-			rakPeerInterface->Send(&outgoingBs,HIGH_PRIORITY,RELIABLE_ORDERED,0,sender->systemAddress,false);
-			rakPeerInterface->Send(&outgoingBs,HIGH_PRIORITY,RELIABLE_ORDERED,0,recipient->systemAddress,false);
+			sender->server->rakPeerInterface->Send(&outgoingBs,HIGH_PRIORITY,RELIABLE_ORDERED,0,sender->systemAddress,false);
+			recipient->server->rakPeerInterface->Send(&outgoingBs,HIGH_PRIORITY,RELIABLE_ORDERED,0,recipient->systemAddress,false);
 
 			// 4/22/09 - BUG: missing break statement here
 			break;
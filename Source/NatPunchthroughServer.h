@@ -25,6 +25,8 @@
 #include "PacketPriority.h"
 #include "SocketIncludes.h"
 #include "DS_OrderedList.h"
+#include "DS_Hash.h"
+#include "DS_Queue.h"
 #include "RakString.h"
 
 namespace RakNet
@@ -71,7 +73,8 @@ struct RAK_DLL_EXPORT NatPunchthroughServerDebugInterface_PacketLogger : public
 /// \brief Server code for NATPunchthrough
 /// \details Maintain connection to NatPunchthroughServer to process incoming connection attempts through NatPunchthroughClient<BR>
 /// Server maintains two sockets clients can connect to so as to estimate the next port choice<BR>
-/// Server tells other client about port estimate, current public port to the server, and a time to start connection attempts
+/// Server tells other client about port estimate, current public port to the server, and a time to start connection attempts<BR>
+/// To serve more clients than one RakPeer can, run several instances of RakPeer, each with a NatPunchthroughServer, and link them with AddLinkedServer()
 /// \sa NatTypeDetectionClient
 /// See also http://www.jenkinssoftware.com/raknet/manual/natpunchthrough.html
 /// \ingroup NAT_PUNCHTHROUGH_GROUP
@@ -91,6 +94,14 @@ public:
 	/// \param[in] i Pointer to an interface. The pointer is stored, so don't delete it while in progress. Pass 0 to clear.
 	void SetDebugInterface(NatPunchthroughServerDebugInterface *i);
 
+	/// Lets users connected to \a server and users connected to this server punch through to each other, as if they were connected to the same server
+	/// \details Servers linked to either server are linked as well. Each RakPeer has its own network thread, but Receive() of all linked servers must be called from the same thread
+	/// \param[in] server Another instance, attached to another RakPeer
+	void AddLinkedServer(NatPunchthroughServer *server);
+
+	/// Leaves the group of servers joined with AddLinkedServer(). Attempts between users of this server and users of the others fail with ID_NAT_CONNECTION_TO_TARGET_LOST
+	void RemoveLinkedServers(void);
+
 	/// \internal For plugin handling
 	virtual void Update(void);
 
@@ -117,6 +128,8 @@ public:
 	};
 	struct User
 	{
+		// The server this user is connected to, which may be a linked server
+		NatPunchthroughServer *server;
 		RakNetGUID guid;
 		SystemAddress systemAddress;
 		unsigned short mostRecentPort;
@@ -125,6 +138,7 @@ public:
 
 		DataStructures::List<ConnectionAttempt *> connectionAttempts;
 		bool HasConnectionAttemptToUser(User *user);
+		ConnectionAttempt *GetConnectionAttempt(uint16_t sessionId);
 		void DerefConnectionAttempt(ConnectionAttempt *ca);
 		void DeleteConnectionAttempt(ConnectionAttempt *ca);
 		void LogConnectionAttempts(RakNet::RakString &rs);
@@ -133,7 +147,21 @@ public:
 	static int NatPunchthroughUserComp( const RakNetGUID &key, User * const &data );
 protected:
 	void OnNATPunchthroughRequest(Packet *packet);
-	DataStructures::OrderedList<RakNetGUID, User*, NatPunchthroughServer::NatPunchthroughUserComp> users;
+	DataStructures::Hash<RakNetGUID, User*, 65536, RakNetGUID::ToUint32> users;
+	// Users of this server, then of linked servers
+	User *GetUser(RakNetGUID guid);
+	uint16_t GetSessionId(User *sender, User *recipient);
+	void RemoveLinkedAttempts(bool notify);
+
+	// Attempts getting recent ports, in the order they started, so Update() only looks at those that may have timed out
+	struct AttemptTimeout
+	{
+		RakNetGUID senderGuid;
+		uint16_t sessionId;
+		RakNet::Time startTime;
+	};
+	DataStructures::Queue<AttemptTimeout> attemptTimeouts;
+	DataStructures::List<NatPunchthroughServer*> linkedServers;
 
 	void OnGetMostRecentPort(Packet *packet);
 	void OnClientReady(Packet *packet);
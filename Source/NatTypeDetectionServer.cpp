@@ -30,6 +30,7 @@ STATIC_FACTORY_DEFINITIONS(NatTypeDetectionServer,NatTypeDetectionServer);
 NatTypeDetectionServer::NatTypeDetectionServer()
 {
 	s1p2=s2p3=s3p4=s4p5=0;
+	AddReceiveMessageID(ID_NAT_TYPE_DETECTION_REQUEST);
 }
 NatTypeDetectionServer::~NatTypeDetectionServer()
 {
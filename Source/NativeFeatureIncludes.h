@@ -41,6 +41,7 @@
 // #define _RAKNET_SUPPORT_RakNetTransport 0
 // #define _RAKNET_SUPPORT_TelnetTransport 0
 // #define _RAKNET_SUPPORT_TCPInterface 0
+// #define _RAKNET_SUPPORT_MetricsExporter 0
 // #define _RAKNET_SUPPORT_LogCommandParser 0
 // #define _RAKNET_SUPPORT_RakNetCommandParser 0
 // #define _RAKNET_SUPPORT_EmailSender 0
@@ -125,6 +126,9 @@
 #ifndef _RAKNET_SUPPORT_TCPInterface
 #define _RAKNET_SUPPORT_TCPInterface 1
 #endif
+#ifndef _RAKNET_SUPPORT_MetricsExporter
+#define _RAKNET_SUPPORT_MetricsExporter 1
+#endif
 #ifndef _RAKNET_SUPPORT_LogCommandParser
 #define _RAKNET_SUPPORT_LogCommandParser 1
 #endif
@@ -187,7 +191,7 @@
 #undef _RAKNET_SUPPORT_PacketizedTCP
 #define _RAKNET_SUPPORT_PacketizedTCP 1
 #endif
-#if _RAKNET_SUPPORT_PacketizedTCP==1 || _RAKNET_SUPPORT_EmailSender==1 || _RAKNET_SUPPORT_HTTPConnection==1
+#if _RAKNET_SUPPORT_PacketizedTCP==1 || _RAKNET_SUPPORT_EmailSender==1 || _RAKNET_SUPPORT_HTTPConnection==1 || _RAKNET_SUPPORT_MetricsExporter==1
 #undef _RAKNET_SUPPORT_TCPInterface
 #define _RAKNET_SUPPORT_TCPInterface 1
 #endif
@@ -398,7 +398,7 @@ const char* PacketLogger::BaseIDTOString(unsigned char Id)
 		"ID_NAT_REQUEST_BOUND_ADDRESSES",
 		"ID_NAT_RESPOND_BOUND_ADDRESSES",
 		"ID_FCM2_UPDATE_USER_CONTEXT",
-		"ID_RESERVED_3",
+		"ID_REPLICA_MANAGER_SERIALIZE_DELTA",
 		"ID_RESERVED_4",
 		"ID_RESERVED_5",
 		"ID_RESERVED_6",
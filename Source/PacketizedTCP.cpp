@@ -21,15 +21,27 @@ using namespace RakNet;
 
 typedef uint32_t PTCPHeader;
 
+// Messages that fit are read into segments of this size, which are pooled
+static const unsigned int SEGMENT_SIZE=65536;
+static const unsigned int MAX_POOLED_SEGMENTS=64;
+// A segment with less room than this is replaced, rather than read into a little at a time
+static const unsigned int MIN_SEGMENT_ROOM=4096;
+// Larger messages get a segment of their own. Past this size it grows as the message arrives, so a corrupt length cannot reserve much memory
+static const unsigned int MAX_PREALLOCATED_MESSAGE=4194304;
+// ID_DOWNLOAD_PROGRESS is returned each time a message being read passes a multiple of this many bytes
+static const unsigned int DOWNLOAD_PROGRESS_INTERVAL=65536;
+
 STATIC_FACTORY_DEFINITIONS(PacketizedTCP,PacketizedTCP);
 
 PacketizedTCP::PacketizedTCP()
 {
-
+	framing=0;
+	framingLength=0;
 }
 PacketizedTCP::~PacketizedTCP()
 {
-	ClearAllConnections();
+	// Before TCPInterface deallocates queued packets, which only this class can do
+	Stop();
 }
 
 void PacketizedTCP::Stop(void)
@@ -38,7 +50,8 @@ void PacketizedTCP::Stop(void)
 	TCPInterface::Stop();
 	for (i=0; i < waitingPackets.Size(); i++)
 		DeallocatePacket(waitingPackets[i]);
-	ClearAllConnections();
+	waitingPackets.Clear(_FILE_AND_LINE_);
+	ClearFraming();
 }
 
 void PacketizedTCP::Send( const char *data, unsigned length, const SystemAddress &systemAddress, bool broadcast )
@@ -103,30 +116,19 @@ void PacketizedTCP::PushNotificationsToQueues(void)
 	SystemAddress sa;
 	sa = TCPInterface::HasNewIncomingConnection();
 	if (sa!=UNASSIGNED_SYSTEM_ADDRESS)
-	{
 		_newIncomingConnections.Push(sa, _FILE_AND_LINE_ );
-		AddToConnectionList(sa);
-	}
 
 	sa = TCPInterface::HasFailedConnectionAttempt();
 	if (sa!=UNASSIGNED_SYSTEM_ADDRESS)
-	{
 		_failedConnectionAttempts.Push(sa, _FILE_AND_LINE_ );
-	}
 
 	sa = TCPInterface::HasLostConnection();
 	if (sa!=UNASSIGNED_SYSTEM_ADDRESS)
-	{
 		_lostConnections.Push(sa, _FILE_AND_LINE_ );
-		RemoveFromConnectionList(sa);
-	}
 
 	sa = TCPInterface::HasCompletedConnectionAttempt();
 	if (sa!=UNASSIGNED_SYSTEM_ADDRESS)
-	{
 		_completedConnectionAttempts.Push(sa, _FILE_AND_LINE_ );
-		AddToConnectionList(sa);
-	}
 }
 Packet* PacketizedTCP::Receive( void )
 {
@@ -140,126 +142,290 @@ Packet* PacketizedTCP::Receive( void )
 	if (outgoingPacket)
 		return outgoingPacket;
 
+	// Messages were already split out by the update thread
 	Packet *incomingPacket;
-	incomingPacket = TCPInterface::ReceiveInt();
-	unsigned int index;
+	while ((incomingPacket = TCPInterface::ReceiveInt())!=0)
+	{
+		waitingPackets.Push(incomingPacket, _FILE_AND_LINE_ );
+		outgoingPacket=ReturnOutgoingPacket();
+		if (outgoingPacket)
+			return outgoingPacket;
+	}
+	return 0;
+}
+void PacketizedTCP::DeallocatePacket( Packet *packet )
+{
+	if (packet==0)
+		return;
+	if (packet->deleteData)
+	{
+		// Came from the update thread. The length before the data was replaced by the offset of the data from its segment
+		PTCPHeader offset;
+		memcpy(&offset, packet->data-sizeof(PTCPHeader), sizeof(PTCPHeader));
+		ReleaseSegment((ReceiveSegment*) (packet->data-offset));
+		incomingMessages.Deallocate(packet, _FILE_AND_LINE_);
+	}
+	else
+		TCPInterface::DeallocatePacket(packet);
+}
+int PacketizedTCP::ReadRemoteClient(RemoteClient *remoteClient, char *buffer, unsigned int bufferSize)
+{
+	// Reads into segments instead
+	(void) buffer;
+	(void) bufferSize;
 
-	while (incomingPacket)
+	if (framing==0)
 	{
-		if (connections.Has(incomingPacket->systemAddress))
-			index = connections.GetIndexAtKey(incomingPacket->systemAddress);
-		else
-			index=(unsigned int) -1;
-		if ((unsigned int)index==(unsigned int)-1)
+		framingLength=remoteClientsLength;
+		framing=RakNet::OP_NEW_ARRAY<Framing>(framingLength,_FILE_AND_LINE_);
+		for (int i=0; i < framingLength; i++)
 		{
-			DeallocatePacket(incomingPacket);
-			incomingPacket = TCPInterface::ReceiveInt();
-			continue;
+			framing[i].segment=0;
+			framing[i].readOffset=framing[i].writeOffset=0;
+			framing[i].activationCount=remoteClients[i].activationCount;
 		}
+	}
+
+	Framing *f = &framing[remoteClient-remoteClients];
+	if (f->activationCount!=remoteClient->activationCount)
+	{
+		// A new connection in this slot. What is left was from the old one
+		if (f->segment)
+			ReleaseSegment(f->segment);
+		f->segment=0;
+		f->activationCount=remoteClient->activationCount;
+	}
 
+	if (f->segment==0)
+	{
+		f->segment=AllocateSegment(SEGMENT_SIZE);
+		if (f->segment==0)
+			return -1;
+		f->readOffset=f->writeOffset=0;
+	}
 
-		if (incomingPacket->deleteData==true)
+	// Make room for the message being read, so it ends up in one piece
+	unsigned int pending=f->writeOffset-f->readOffset;
+	if (pending==0)
+	{
+		if (f->segment->refCount.GetValue()==1 && f->segment->capacity==SEGMENT_SIZE)
+		{
+			// No packets point into the segment, so read from the start again
+			f->readOffset=f->writeOffset=0;
+		}
+		else if (f->segment->capacity-f->writeOffset < MIN_SEGMENT_ROOM || f->segment->capacity!=SEGMENT_SIZE)
+		{
+			ReleaseSegment(f->segment);
+			f->segment=AllocateSegment(SEGMENT_SIZE);
+			if (f->segment==0)
+				return -1;
+			f->readOffset=f->writeOffset=0;
+		}
+	}
+	else if (pending < sizeof(PTCPHeader))
+	{
+		if (f->readOffset+sizeof(PTCPHeader) > f->segment->capacity && MoveMessageToNewSegment(f, SEGMENT_SIZE)==false)
+			return -1;
+	}
+	else
+	{
+		PTCPHeader dataLength;
+		memcpy(&dataLength, GetSegmentData(f->segment)+f->readOffset, sizeof(PTCPHeader));
+		if (RakNet::BitStream::DoEndianSwap())
+			RakNet::BitStream::ReverseBytesInPlace((unsigned char*) &dataLength,sizeof(dataLength));
+		if (dataLength > (PTCPHeader) -1 - sizeof(PTCPHeader) - sizeof(ReceiveSegment))
+			return -1;
+		unsigned int messageLength=sizeof(PTCPHeader)+dataLength;
+		if (f->readOffset+messageLength > f->segment->capacity)
 		{
-			// Came from network
-			SystemAddress systemAddressFromPacket;
-			if (index < connections.Size())
+			// Move it to a segment that holds all of it, or as much as is reserved up front
+			unsigned int capacity = messageLength < MAX_PREALLOCATED_MESSAGE ? messageLength : MAX_PREALLOCATED_MESSAGE;
+			if (capacity <= f->segment->capacity)
 			{
-				DataStructures::ByteQueue *bq = connections[index];
-				// Buffer data
-				bq->WriteBytes((const char*) incomingPacket->data,incomingPacket->length, _FILE_AND_LINE_);
-				systemAddressFromPacket=incomingPacket->systemAddress;
-				PTCPHeader dataLength;
-
-				// Peek the header to see if a full message is waiting
-				bq->ReadBytes((char*) &dataLength,sizeof(PTCPHeader),true);
-				if (RakNet::BitStream::DoEndianSwap())
-					RakNet::BitStream::ReverseBytesInPlace((unsigned char*) &dataLength,sizeof(dataLength));
-				// Header indicates packet length. If enough data is available, read out and return one packet
-				if (bq->GetBytesWritten()>=dataLength+sizeof(PTCPHeader))
-				{
-					do 
-					{
-						bq->IncrementReadOffset(sizeof(PTCPHeader));
-						outgoingPacket = RakNet::OP_NEW<Packet>(_FILE_AND_LINE_);
-						outgoingPacket->length=dataLength;
-						outgoingPacket->bitSize=BYTES_TO_BITS(dataLength);
-						outgoingPacket->guid=UNASSIGNED_RAKNET_GUID;
-						outgoingPacket->systemAddress=systemAddressFromPacket;
-						outgoingPacket->deleteData=false; // Did not come from the network
-						outgoingPacket->data=(unsigned char*) rakMalloc_Ex(dataLength, _FILE_AND_LINE_);
-						if (outgoingPacket->data==0)
-						{
-							notifyOutOfMemory(_FILE_AND_LINE_);
-							RakNet::OP_DELETE(outgoingPacket,_FILE_AND_LINE_);
-							return 0;
-						}
-						bq->ReadBytes((char*) outgoingPacket->data,dataLength,false);
-
-						waitingPackets.Push(outgoingPacket, _FILE_AND_LINE_ );
-
-						// Peek the header to see if a full message is waiting
-						if (bq->ReadBytes((char*) &dataLength,sizeof(PTCPHeader),true))
-						{
-							if (RakNet::BitStream::DoEndianSwap())
-								RakNet::BitStream::ReverseBytesInPlace((unsigned char*) &dataLength,sizeof(dataLength));
-						}
-						else
-							break;
-					} while (bq->GetBytesWritten()>=dataLength+sizeof(PTCPHeader));
-				}
+				// Larger than is reserved up front, so grows as it arrives
+				if (f->readOffset==0 && f->writeOffset < f->segment->capacity)
+					capacity=0;
 				else
-				{
-
-					unsigned int oldWritten = bq->GetBytesWritten()-incomingPacket->length;
-					unsigned int newWritten = bq->GetBytesWritten();
-
-					// Return ID_DOWNLOAD_PROGRESS
-					if (newWritten/65536!=oldWritten/65536)
-					{
-						outgoingPacket = RakNet::OP_NEW<Packet>(_FILE_AND_LINE_);
-						outgoingPacket->length=sizeof(MessageID) +
-							sizeof(unsigned int)*2 +
-							sizeof(unsigned int) +
-							65536;
-						outgoingPacket->bitSize=BYTES_TO_BITS(incomingPacket->length);
-						outgoingPacket->guid=UNASSIGNED_RAKNET_GUID;
-						outgoingPacket->systemAddress=incomingPacket->systemAddress;
-						outgoingPacket->deleteData=false;
-						outgoingPacket->data=(unsigned char*) rakMalloc_Ex(outgoingPacket->length, _FILE_AND_LINE_);
-						if (outgoingPacket->data==0)
-						{
-							notifyOutOfMemory(_FILE_AND_LINE_);
-							RakNet::OP_DELETE(outgoingPacket,_FILE_AND_LINE_);
-							return 0;
-						}
-
-						outgoingPacket->data[0]=(MessageID)ID_DOWNLOAD_PROGRESS;
-						unsigned int totalParts=dataLength/65536;
-						unsigned int partIndex=newWritten/65536;
-						unsigned int oneChunkSize=65536;
-						memcpy(outgoingPacket->data+sizeof(MessageID), &partIndex, sizeof(unsigned int));
-						memcpy(outgoingPacket->data+sizeof(MessageID)+sizeof(unsigned int)*1, &totalParts, sizeof(unsigned int));
-						memcpy(outgoingPacket->data+sizeof(MessageID)+sizeof(unsigned int)*2, &oneChunkSize, sizeof(unsigned int));
-						bq->IncrementReadOffset(sizeof(PTCPHeader));
-						bq->ReadBytes((char*) outgoingPacket->data+sizeof(MessageID)+sizeof(unsigned int)*3,oneChunkSize,true);
-						bq->DecrementReadOffset(sizeof(PTCPHeader));
-
-						waitingPackets.Push(outgoingPacket, _FILE_AND_LINE_ );
-					}
-				}
-
+					capacity = f->segment->capacity < messageLength/2 ? f->segment->capacity*2 : messageLength;
 			}
-
-			DeallocatePacket(incomingPacket);
-			incomingPacket=0;
+			if (capacity && MoveMessageToNewSegment(f, capacity < SEGMENT_SIZE ? SEGMENT_SIZE : capacity)==false)
+				return -1;
 		}
-		else
-			waitingPackets.Push(incomingPacket, _FILE_AND_LINE_ );
+	}
+
+	int len = remoteClient->Recv(GetSegmentData(f->segment)+f->writeOffset, f->segment->capacity-f->writeOffset);
+	if (len<=0)
+	{
+		ReleaseSegment(f->segment);
+		f->segment=0;
+		return len;
+	}
+	f->writeOffset+=len;
+
+	ReturnMessages(remoteClient, f);
 
-		incomingPacket = TCPInterface::ReceiveInt();
+	// Tell the user how far along a large message is
+	pending=f->writeOffset-f->readOffset;
+	if (pending>=DOWNLOAD_PROGRESS_INTERVAL)
+	{
+		unsigned int previouslyPending = pending > (unsigned int) len ? pending-len : 0;
+		if (pending/DOWNLOAD_PROGRESS_INTERVAL!=previouslyPending/DOWNLOAD_PROGRESS_INTERVAL)
+			ReturnDownloadProgress(remoteClient, f, pending);
 	}
 
-	return ReturnOutgoingPacket();
+	return len;
+}
+void PacketizedTCP::ReturnMessages(RemoteClient *remoteClient, Framing *framing)
+{
+	char *segmentData = GetSegmentData(framing->segment);
+	while (framing->writeOffset-framing->readOffset>=sizeof(PTCPHeader))
+	{
+		PTCPHeader dataLength;
+		memcpy(&dataLength, segmentData+framing->readOffset, sizeof(PTCPHeader));
+		if (RakNet::BitStream::DoEndianSwap())
+			RakNet::BitStream::ReverseBytesInPlace((unsigned char*) &dataLength,sizeof(dataLength));
+		if (framing->writeOffset-framing->readOffset-sizeof(PTCPHeader) < dataLength)
+			break;
+
+		// The length is no longer needed. Replace it with the offset from the segment, so DeallocatePacket() finds the segment
+		unsigned char *data = (unsigned char*) segmentData+framing->readOffset+sizeof(PTCPHeader);
+		PTCPHeader offset = (PTCPHeader) (data-(unsigned char*) framing->segment);
+		memcpy(data-sizeof(PTCPHeader), &offset, sizeof(PTCPHeader));
+
+		Packet *outgoingPacket=incomingMessages.Allocate( _FILE_AND_LINE_ );
+		outgoingPacket->data=data;
+		outgoingPacket->length=dataLength;
+		outgoingPacket->bitSize=BYTES_TO_BITS(dataLength);
+		outgoingPacket->guid=UNASSIGNED_RAKNET_GUID;
+		outgoingPacket->systemAddress=remoteClient->systemAddress;
+		outgoingPacket->deleteData=true; // Points into a segment
+		outgoingPacket->wasGeneratedLocally=false;
+		framing->segment->refCount.Increment();
+		incomingMessages.Push(outgoingPacket);
+
+		framing->readOffset+=sizeof(PTCPHeader)+dataLength;
+	}
+}
+void PacketizedTCP::ReturnDownloadProgress(RemoteClient *remoteClient, Framing *framing, unsigned int bytesRead)
+{
+	// The message is preceded by the progress, and the start of the message
+	const unsigned int progressLength=sizeof(MessageID)+sizeof(unsigned int)*3+DOWNLOAD_PROGRESS_INTERVAL;
+	ReceiveSegment *segment = AllocateSegment(sizeof(PTCPHeader)+progressLength);
+	if (segment==0)
+		return;
+	unsigned char *data = (unsigned char*) GetSegmentData(segment)+sizeof(PTCPHeader);
+	PTCPHeader offset = (PTCPHeader) (data-(unsigned char*) segment);
+	memcpy(data-sizeof(PTCPHeader), &offset, sizeof(PTCPHeader));
+
+	const char *message = GetSegmentData(framing->segment)+framing->readOffset;
+	PTCPHeader dataLength;
+	memcpy(&dataLength, message, sizeof(PTCPHeader));
+	if (RakNet::BitStream::DoEndianSwap())
+		RakNet::BitStream::ReverseBytesInPlace((unsigned char*) &dataLength,sizeof(dataLength));
+	unsigned int totalParts=dataLength/DOWNLOAD_PROGRESS_INTERVAL;
+	unsigned int partIndex=bytesRead/DOWNLOAD_PROGRESS_INTERVAL;
+	unsigned int oneChunkSize=DOWNLOAD_PROGRESS_INTERVAL;
+	data[0]=(MessageID)ID_DOWNLOAD_PROGRESS;
+	memcpy(data+sizeof(MessageID), &partIndex, sizeof(unsigned int));
+	memcpy(data+sizeof(MessageID)+sizeof(unsigned int)*1, &totalParts, sizeof(unsigned int));
+	memcpy(data+sizeof(MessageID)+sizeof(unsigned int)*2, &oneChunkSize, sizeof(unsigned int));
+	unsigned int startLength = bytesRead-sizeof(PTCPHeader) < oneChunkSize ? bytesRead-sizeof(PTCPHeader) : oneChunkSize;
+	memcpy(data+sizeof(MessageID)+sizeof(unsigned int)*3, message+sizeof(PTCPHeader), startLength);
+	memset(data+sizeof(MessageID)+sizeof(unsigned int)*3+startLength, 0, oneChunkSize-startLength);
+
+	Packet *outgoingPacket=incomingMessages.Allocate( _FILE_AND_LINE_ );
+	outgoingPacket->data=data;
+	outgoingPacket->length=progressLength;
+	outgoingPacket->bitSize=BYTES_TO_BITS(progressLength);
+	outgoingPacket->guid=UNASSIGNED_RAKNET_GUID;
+	outgoingPacket->systemAddress=remoteClient->systemAddress;
+	outgoingPacket->deleteData=true; // Points into a segment
+	outgoingPacket->wasGeneratedLocally=false;
+	incomingMessages.Push(outgoingPacket);
+}
+bool PacketizedTCP::MoveMessageToNewSegment(Framing *framing, unsigned int capacity)
+{
+	ReceiveSegment *segment = AllocateSegment(capacity);
+	if (segment==0)
+		return false;
+	unsigned int pending=framing->writeOffset-framing->readOffset;
+	memcpy(GetSegmentData(segment), GetSegmentData(framing->segment)+framing->readOffset, pending);
+	ReleaseSegment(framing->segment);
+	framing->segment=segment;
+	framing->readOffset=0;
+	framing->writeOffset=pending;
+	return true;
+}
+PacketizedTCP::ReceiveSegment *PacketizedTCP::AllocateSegment(unsigned int capacity)
+{
+	ReceiveSegment *segment=0;
+	if (capacity==SEGMENT_SIZE)
+	{
+		segmentPoolMutex.Lock();
+		if (segmentPool.Size())
+		{
+			segment=segmentPool[segmentPool.Size()-1];
+			segmentPool.RemoveFromEnd();
+		}
+		segmentPoolMutex.Unlock();
+	}
+	if (segment==0)
+	{
+		segment = (ReceiveSegment*) rakMalloc_Ex(sizeof(ReceiveSegment)+capacity, _FILE_AND_LINE_);
+		if (segment==0)
+		{
+			notifyOutOfMemory(_FILE_AND_LINE_);
+			return 0;
+		}
+		segment = new ((void*)segment) ReceiveSegment;
+		segment->capacity=capacity;
+	}
+	segment->refCount.Increment();
+	return segment;
+}
+void PacketizedTCP::ReleaseSegment(ReceiveSegment *segment)
+{
+	if (segment->refCount.Decrement()!=0)
+		return;
+	if (segment->capacity==SEGMENT_SIZE)
+	{
+		segmentPoolMutex.Lock();
+		if (segmentPool.Size() < MAX_POOLED_SEGMENTS)
+		{
+			segmentPool.Push(segment, _FILE_AND_LINE_);
+			segment=0;
+		}
+		segmentPoolMutex.Unlock();
+		if (segment==0)
+			return;
+	}
+	segment->~ReceiveSegment();
+	rakFree_Ex(segment, _FILE_AND_LINE_);
+}
+void PacketizedTCP::ClearFraming(void)
+{
+	int i;
+	for (i=0; i < framingLength; i++)
+	{
+		if (framing[i].segment)
+			ReleaseSegment(framing[i].segment);
+	}
+	RakNet::OP_DELETE_ARRAY(framing,_FILE_AND_LINE_);
+	framing=0;
+	framingLength=0;
+
+	segmentPoolMutex.Lock();
+	for (unsigned int j=0; j < segmentPool.Size(); j++)
+	{
+		segmentPool[j]->~ReceiveSegment();
+		rakFree_Ex(segmentPool[j], _FILE_AND_LINE_);
+	}
+	segmentPool.Clear(false, _FILE_AND_LINE_);
+	segmentPoolMutex.Unlock();
+}
+char *PacketizedTCP::GetSegmentData(ReceiveSegment *segment)
+{
+	return (char*) segment+sizeof(ReceiveSegment);
 }
 Packet *PacketizedTCP::ReturnOutgoingPacket(void)
 {
@@ -271,6 +437,8 @@ Packet *PacketizedTCP::ReturnOutgoingPacket(void)
 		PluginReceiveResult pluginResult;
 		for (i=0; i < messageHandlerList.Size(); i++)
 		{
+			if (messageHandlerList[i]->ReceivesPacket(outgoingPacket)==false)
+				continue;
 			pluginResult=messageHandlerList[i]->OnReceive(outgoingPacket);
 			if (pluginResult==RR_STOP_PROCESSING_AND_DEALLOCATE)
 			{
@@ -290,36 +458,8 @@ Packet *PacketizedTCP::ReturnOutgoingPacket(void)
 }
 void PacketizedTCP::CloseConnection( SystemAddress systemAddress )
 {
-	RemoveFromConnectionList(systemAddress);
 	TCPInterface::CloseConnection(systemAddress);
 }
-void PacketizedTCP::RemoveFromConnectionList(const SystemAddress &sa)
-{
-	if (sa==UNASSIGNED_SYSTEM_ADDRESS)
-		return;
-	if (connections.Has(sa))
-	{
-		unsigned int index = connections.GetIndexAtKey(sa);
-		if (index!=(unsigned int)-1)
-		{
-			RakNet::OP_DELETE(connections[index],_FILE_AND_LINE_);
-			connections.RemoveAtIndex(index);
-		}
-	}
-}
-void PacketizedTCP::AddToConnectionList(const SystemAddress &sa)
-{
-	if (sa==UNASSIGNED_SYSTEM_ADDRESS)
-		return;
-	connections.SetNew(sa, RakNet::OP_NEW<DataStructures::ByteQueue>(_FILE_AND_LINE_));
-}
-void PacketizedTCP::ClearAllConnections(void)
-{
-	unsigned int i;
-	for (i=0; i < connections.Size(); i++)
-		RakNet::OP_DELETE(connections[i],_FILE_AND_LINE_);
-	connections.Clear();
-}
 SystemAddress PacketizedTCP::HasCompletedConnectionAttempt(void)
 {
 	PushNotificationsToQueues();
@@ -20,12 +20,15 @@
 #define __PACKETIZED_TCP
 
 #include "TCPInterface.h"
-#include "DS_ByteQueue.h"
-#include "DS_Map.h"
+#include "DS_List.h"
+#include "SimpleMutex.h"
+#include "LocklessTypes.h"
 
 namespace RakNet
 {
 
+/// Sends and receives whole messages over TCP, each preceded by its length
+/// Messages are split out on the update thread as they are read, directly into pooled segments. Packets returned by Receive() point into a segment, which is reused once every packet in it is deallocated
 class RAK_DLL_EXPORT PacketizedTCP : public TCPInterface
 {
 public:
@@ -47,6 +50,9 @@ public:
 	/// Returns data received
 	Packet* Receive( void );
 
+	/// Deallocates a packet returned by Receive
+	void DeallocatePacket( Packet *packet );
+
 	/// Disconnects a player/address
 	void CloseConnection( SystemAddress systemAddress );
 
@@ -65,15 +71,45 @@ public:
 	SystemAddress HasLostConnection(void);
 
 protected:
-	void ClearAllConnections(void);
-	void RemoveFromConnectionList(const SystemAddress &sa);
-	void AddToConnectionList(const SystemAddress &sa);
+	/// Starts a block of received bytes, which follow it in memory. Packets point into the bytes
+	struct ReceiveSegment
+	{
+		// One for each packet, and one while messages are still read into it
+		RakNet::LocklessUint32_t refCount;
+		unsigned int capacity;
+	};
+
+	/// The segment a connection reads into. Only used by the update thread
+	struct Framing
+	{
+		ReceiveSegment *segment;
+		// Bytes before readOffset were returned as messages. Bytes from there to writeOffset are part of the next message
+		unsigned int readOffset, writeOffset;
+		// RemoteClient::activationCount when this was last used, to drop what is left of a previous connection
+		unsigned int activationCount;
+	};
+
+	int ReadRemoteClient(RemoteClient *remoteClient, char *buffer, unsigned int bufferSize);
 	void PushNotificationsToQueues(void);
 	Packet *ReturnOutgoingPacket(void);
-
-	// A single TCP recieve may generate multiple split packets. They are stored in the waitingPackets list until Receive is called
+	void ReturnMessages(RemoteClient *remoteClient, Framing *framing);
+	void ReturnDownloadProgress(RemoteClient *remoteClient, Framing *framing, unsigned int bytesRead);
+	bool MoveMessageToNewSegment(Framing *framing, unsigned int capacity);
+	ReceiveSegment *AllocateSegment(unsigned int capacity);
+	void ReleaseSegment(ReceiveSegment *segment);
+	void ClearFraming(void);
+	static char *GetSegmentData(ReceiveSegment *segment);
+
+	// Packets that plugins have not yet seen
 	DataStructures::Queue<Packet*> waitingPackets;
-	DataStructures::Map<SystemAddress, DataStructures::ByteQueue *> connections;
+
+	// Indexed like remoteClients. Allocated by the update thread when it first reads
+	Framing *framing;
+	int framingLength;
+
+	// Segments not in use, of the default size
+	DataStructures::List<ReceiveSegment*> segmentPool;
+	SimpleMutex segmentPoolMutex;
 
 	// Mirrors single producer / consumer, but processes them in Receive() before returning to user
 	DataStructures::Queue<SystemAddress> _newIncomingConnections, _lostConnections, _failedConnectionAttempts, _completedConnectionAttempts;
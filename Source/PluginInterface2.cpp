@@ -13,6 +13,9 @@
 #include "PacketizedTCP.h"
 #include "RakPeerInterface.h"
 #include "BitStream.h"
+#include "MessageIdentifiers.h"
+#include "RakAssert.h"
+#include <string.h>
 
 using namespace RakNet;
 
@@ -22,10 +25,35 @@ PluginInterface2::PluginInterface2()
 #if _RAKNET_SUPPORT_PacketizedTCP==1 && _RAKNET_SUPPORT_TCPInterface==1
 	tcpInterface=0;
 #endif
+	memset(receiveMessageIDs, 0, sizeof(receiveMessageIDs));
+	receivesAllMessageIDs=true;
 }
 PluginInterface2::~PluginInterface2()
 {
 
+}
+bool PluginInterface2::ReceivesPacket(const Packet *packet) const
+{
+	if (receivesAllMessageIDs)
+		return true;
+	if (ReceivesMessageID(packet->data[0]))
+		return true;
+	if (packet->data[0]==ID_TIMESTAMP && packet->length > sizeof(MessageID) + sizeof(RakNet::Time))
+		return ReceivesMessageID(packet->data[sizeof(MessageID) + sizeof(RakNet::Time)]);
+	return false;
+}
+void PluginInterface2::AddReceiveMessageIDRange(MessageID first, MessageID last)
+{
+	// Read by RakPeer::AttachPlugin()
+	RakAssert(rakPeerInterface==0);
+	RakAssert(first<=last);
+	receivesAllMessageIDs=false;
+	for (unsigned int messageId=first; messageId<=last; messageId++)
+		receiveMessageIDs[messageId>>5] |= 1u << (messageId&31);
+}
+void PluginInterface2::AddReceiveMessageID(MessageID messageId)
+{
+	AddReceiveMessageIDRange(messageId, messageId);
 }
 void PluginInterface2::SendUnified( const RakNet::BitStream * bitStream, PacketPriority priority, PacketReliability reliability, char orderingChannel, const AddressOrGUID systemIdentifier, bool broadcast )
 {
@@ -134,6 +134,15 @@ public:
 	/// If true, then you cannot call RakPeer::AttachPlugin() or RakPeer::DetachPlugin() for this plugin, while RakPeer is active
 	virtual bool UsesReliabilityLayer(void) const {return false;}
 
+	/// \brief Whether OnReceive() will be called for messages with this ID
+	/// \details Plugins that never call AddReceiveMessageIDRange() or AddReceiveMessageID() receive every message.
+	/// \param[in] messageId The first byte of a message
+	bool ReceivesMessageID(MessageID messageId) const {return receivesAllMessageIDs || (receiveMessageIDs[messageId>>5] & (1u << (messageId&31)))!=0;}
+
+	/// \brief Whether OnReceive() will be called for \a packet
+	/// \details Messages that start with ID_TIMESTAMP are received if either ID_TIMESTAMP or the ID after the timestamp was added.
+	bool ReceivesPacket(const Packet *packet) const;
+
 	/// Called on a send to the socket, per datagram, that does not go through the reliability layer
 	/// \pre To be called, UsesReliabilityLayer() must return true
 	/// \param[in] data The data being sent
@@ -198,11 +207,24 @@ protected:
 	void PushBackPacketUnified(Packet *packet, bool pushAtHead);
 	void DeallocPacketUnified(Packet *packet);
 
+	/// \brief Only call OnReceive() for messages with IDs from \a first to \a last, including both, and for any other IDs added
+	/// \details RakPeer and PacketizedTCP skip this plugin for other messages, rather than calling OnReceive() for each one.<BR>
+	/// Call this before the plugin is attached, such as in the constructor. IDs added while attached are not seen until the plugin is attached again.<BR>
+	/// OnNewConnection(), OnClosedConnection(), and OnFailedConnectionAttempt() are still called for every plugin.
+	void AddReceiveMessageIDRange(MessageID first, MessageID last);
+
+	/// Same as AddReceiveMessageIDRange(messageId, messageId)
+	void AddReceiveMessageID(MessageID messageId);
+
 	// Filled automatically in when attached
 	RakPeerInterface *rakPeerInterface;
 #if _RAKNET_SUPPORT_TCPInterface==1
 	TCPInterface *tcpInterface;
 #endif
+
+	// One bit per MessageID, used unless receivesAllMessageIDs is true
+	uint32_t receiveMessageIDs[8];
+	bool receivesAllMessageIDs;
 };
 
 } // namespace RakNet
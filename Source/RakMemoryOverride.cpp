@@ -10,10 +10,18 @@
 
 #include "RakMemoryOverride.h"
 #include "RakAssert.h"
+#include "RakNetMetrics.h"
 #include <stdlib.h>
 
 #ifdef _RAKNET_SUPPORT_DL_MALLOC
 #include "rdlmalloc.h"
+#include <string.h>
+#if defined(_WIN32)
+#include "WindowsIncludes.h"
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
 #endif
 
 
@@ -158,6 +166,8 @@ void* RakNet::_RakMalloc_Ex (size_t size, const char *file, unsigned int line)
 	(void) file;
 	(void) line;
 
+	RakNetMetrics::AddProcess(METRICS_ALLOCATIONS, 1);
+	RakNetMetrics::AddProcess(METRICS_ALLOCATION_BYTES, size);
 	return malloc(size);
 }
 
@@ -166,6 +176,9 @@ void* RakNet::_RakRealloc_Ex (void *p, size_t size, const char *file, unsigned i
 	(void) file;
 	(void) line;
 
+	if (p==0)
+		RakNetMetrics::AddProcess(METRICS_ALLOCATIONS, 1);
+	RakNetMetrics::AddProcess(METRICS_ALLOCATION_BYTES, size);
 	return realloc(p,size);
 }
 
@@ -174,6 +187,8 @@ void RakNet::_RakFree_Ex (void *p, const char *file, unsigned int line)
 	(void) file;
 	(void) line;
 
+	if (p)
+		RakNetMetrics::AddProcess(METRICS_FREES, 1);
 	free(p);
 }
 #ifdef _RAKNET_SUPPORT_DL_MALLOC
@@ -192,10 +207,276 @@ int RakNet::_DLMallocMUnmap (void *p, size_t size)
 
 static mspace rakNetFixedHeapMSpace=0;
 
-void* _DLMalloc(size_t size)
+#if defined(_MSC_VER)
+#define RAK_MEMORY_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define RAK_MEMORY_THREAD_LOCAL __thread
+#endif
+
+#ifdef RAK_MEMORY_THREAD_LOCAL
+// Small allocations are served from a cache of the thread making them, which takes blocks from the heap and gives them back in batches.
+// So the lock of the heap is taken once per batch rather than on every call, by the recv thread, the update thread and user threads alike
+// Sizes are 16 bytes apart up to 256, then 4 to each power of two up to 2048
+static const int THREAD_CACHE_CLASSES=28;
+static const size_t THREAD_CACHE_MAX_SIZE=2048;
+// Each class caches about this many bytes, within the block counts below
+static const size_t THREAD_CACHE_CLASS_BYTES=16384;
+static const unsigned int THREAD_CACHE_MIN_BLOCKS=8;
+static const unsigned int THREAD_CACHE_MAX_BLOCKS=128;
+
+struct ThreadCache
+{
+	// Free blocks of each class, linked through their first word
+	void *blocks[THREAD_CACHE_CLASSES];
+	unsigned int blockCounts[THREAD_CACHE_CLASSES];
+	RakNetFixedHeapThreadStatistics statistics;
+#if defined(_WIN32)
+	DWORD owner;
+#else
+	pthread_t owner;
+#endif
+	ThreadCache *next;
+};
+
+static bool threadCacheEnabled=true;
+// Changes with each heap, so caches in the memory of an earlier heap are not used
+static volatile unsigned int heapGeneration=0;
+static RAK_MEMORY_THREAD_LOCAL ThreadCache *threadCache;
+static RAK_MEMORY_THREAD_LOCAL unsigned int threadCacheGeneration;
+
+// Every cache, in the order their threads first allocated, for statistics and for flushing when threads exit
+static ThreadCache *threadCaches=0;
+static RakNetFixedHeapThreadStatistics exitedThreadStatistics;
+static bool anyThreadExited=false;
+static volatile long threadCachesLock=0;
+
+#if defined(_WIN32)
+static DWORD threadCacheFlsIndex=FLS_OUT_OF_INDEXES;
+#else
+static pthread_key_t threadCacheKey;
+static bool threadCacheKeyCreated=false;
+#endif
+
+static void LockThreadCaches(void)
+{
+#if defined(_WIN32)
+	while (InterlockedExchange(&threadCachesLock, 1)!=0)
+		SwitchToThread();
+#else
+	while (__sync_lock_test_and_set(&threadCachesLock, 1)!=0)
+		sched_yield();
+#endif
+}
+static void UnlockThreadCaches(void)
+{
+#if defined(_WIN32)
+	InterlockedExchange(&threadCachesLock, 0);
+#else
+	__sync_lock_release(&threadCachesLock);
+#endif
+}
+static bool IsThreadCacheOwner(ThreadCache *cache)
+{
+#if defined(_WIN32)
+	return cache->owner==GetCurrentThreadId();
+#else
+	return pthread_equal(cache->owner, pthread_self())!=0;
+#endif
+}
+
+static inline int GetSizeClass(size_t size)
+{
+	if (size<=256)
+		return size==0 ? 0 : (int) ((size-1)>>4);
+	size_t s=size-1;
+	int log2=8;
+	while ((s>>(log2+1))!=0)
+		log2++;
+	return 16 + (log2-8)*4 + (int) (s>>(log2-2)) - 4;
+}
+static inline size_t GetClassSize(int sizeClass)
+{
+	if (sizeClass<16)
+		return (size_t) (sizeClass+1)*16;
+	return (size_t) (5+(sizeClass-16)%4) << (6+(sizeClass-16)/4);
+}
+static inline unsigned int GetClassMaxBlocks(int sizeClass)
+{
+	size_t blocks=THREAD_CACHE_CLASS_BYTES/GetClassSize(sizeClass);
+	if (blocks<THREAD_CACHE_MIN_BLOCKS)
+		return THREAD_CACHE_MIN_BLOCKS;
+	if (blocks>THREAD_CACHE_MAX_BLOCKS)
+		return THREAD_CACHE_MAX_BLOCKS;
+	return (unsigned int) blocks;
+}
+
+// Gives back the first count blocks of a class to the heap
+static void ReturnBlocks(ThreadCache *cache, int sizeClass, unsigned int count)
+{
+	void *batch[THREAD_CACHE_MAX_BLOCKS];
+	while (count>0)
+	{
+		unsigned int batchCount=0;
+		while (batchCount<count && batchCount<THREAD_CACHE_MAX_BLOCKS)
+		{
+			batch[batchCount]=cache->blocks[sizeClass];
+			cache->blocks[sizeClass]=*(void**) batch[batchCount];
+			batchCount++;
+		}
+		rak_mspace_bulk_free(rakNetFixedHeapMSpace, batch, batchCount);
+		cache->blockCounts[sizeClass]-=batchCount;
+		cache->statistics.returns++;
+		count-=batchCount;
+	}
+}
+static void FlushThreadCache(ThreadCache *cache)
+{
+	for (int sizeClass=0; sizeClass<THREAD_CACHE_CLASSES; sizeClass++)
+		ReturnBlocks(cache, sizeClass, cache->blockCounts[sizeClass]);
+}
+static void AddThreadStatistics(RakNetFixedHeapThreadStatistics *total, const RakNetFixedHeapThreadStatistics &statistics)
+{
+	total->cachedAllocations+=statistics.cachedAllocations;
+	total->cachedFrees+=statistics.cachedFrees;
+	total->refills+=statistics.refills;
+	total->returns+=statistics.returns;
+	total->heapAllocations+=statistics.heapAllocations;
+	total->heapFrees+=statistics.heapFrees;
+}
+
+#if defined(_WIN32)
+static VOID WINAPI OnThreadExit(PVOID value)
+#else
+static void OnThreadExit(void *value)
+#endif
+{
+	// A cache of an earlier heap is no longer listed, and its memory may since be the cache of another thread
+	ThreadCache *cache=(ThreadCache*) value;
+	LockThreadCaches();
+	ThreadCache **link=&threadCaches;
+	while (*link && *link!=cache)
+		link=&(*link)->next;
+	if (*link && IsThreadCacheOwner(cache))
+	{
+		*link=cache->next;
+		FlushThreadCache(cache);
+		AddThreadStatistics(&exitedThreadStatistics, cache->statistics);
+		anyThreadExited=true;
+		rak_mspace_free(rakNetFixedHeapMSpace, cache);
+		// Destructors that run later on this thread can still allocate, which starts another cache
+		threadCache=0;
+	}
+	UnlockThreadCaches();
+}
+
+static ThreadCache* GetThreadCache(void)
+{
+	if (threadCache!=0 && threadCacheGeneration==heapGeneration)
+		return threadCache;
+	ThreadCache *cache=(ThreadCache*) rak_mspace_malloc(rakNetFixedHeapMSpace, sizeof(ThreadCache));
+	if (cache==0)
+		return 0;
+	memset(cache, 0, sizeof(ThreadCache));
+#if defined(_WIN32)
+	cache->owner=GetCurrentThreadId();
+#else
+	cache->owner=pthread_self();
+#endif
+	LockThreadCaches();
+	ThreadCache **link=&threadCaches;
+	while (*link)
+		link=&(*link)->next;
+	*link=cache;
+	UnlockThreadCaches();
+	threadCache=cache;
+	threadCacheGeneration=heapGeneration;
+#if defined(_WIN32)
+	if (threadCacheFlsIndex!=FLS_OUT_OF_INDEXES)
+		FlsSetValue(threadCacheFlsIndex, cache);
+#else
+	if (threadCacheKeyCreated)
+		pthread_setspecific(threadCacheKey, cache);
+#endif
+	return cache;
+}
+
+static void* FixedHeapMalloc(size_t size)
+{
+	ThreadCache *cache;
+	if (threadCacheEnabled==false || size>THREAD_CACHE_MAX_SIZE || (cache=GetThreadCache())==0)
+	{
+		if (threadCacheEnabled && threadCache && threadCacheGeneration==heapGeneration)
+			threadCache->statistics.heapAllocations++;
+		return rak_mspace_malloc(rakNetFixedHeapMSpace,size);
+	}
+	int sizeClass=GetSizeClass(size);
+	void *block=cache->blocks[sizeClass];
+	if (block)
+	{
+		cache->blocks[sizeClass]=*(void**) block;
+		cache->blockCounts[sizeClass]--;
+		cache->statistics.cachedAllocations++;
+		return block;
+	}
+
+	// One call to the heap takes a batch of blocks. The first is returned and the rest cached
+	unsigned int batchCount=GetClassMaxBlocks(sizeClass)/2;
+	size_t sizes[THREAD_CACHE_MAX_BLOCKS/2];
+	void *batch[THREAD_CACHE_MAX_BLOCKS/2];
+	for (unsigned int i=0; i < batchCount; i++)
+		sizes[i]=GetClassSize(sizeClass);
+	if (rak_mspace_independent_comalloc(rakNetFixedHeapMSpace, batchCount, sizes, batch)==0)
+		return 0;
+	for (unsigned int i=batchCount-1; i > 0; i--)
+	{
+		*(void**) batch[i]=cache->blocks[sizeClass];
+		cache->blocks[sizeClass]=batch[i];
+	}
+	cache->blockCounts[sizeClass]+=batchCount-1;
+	cache->statistics.refills++;
+	cache->statistics.cachedAllocations++;
+	return batch[0];
+}
+static void FixedHeapFree(void *p)
+{
+	if (p==0)
+		return;
+	// Blocks are cached by the largest class they can hold, which is the class they were allocated for unless they came from the heap directly
+	size_t usableSize=rak_mspace_usable_size(p);
+	ThreadCache *cache;
+	if (threadCacheEnabled==false || usableSize<GetClassSize(0) || usableSize>=THREAD_CACHE_MAX_SIZE+64 || (cache=GetThreadCache())==0)
+	{
+		if (threadCacheEnabled && threadCache && threadCacheGeneration==heapGeneration)
+			threadCache->statistics.heapFrees++;
+		rak_mspace_free(rakNetFixedHeapMSpace,p);
+		return;
+	}
+	int sizeClass=usableSize>THREAD_CACHE_MAX_SIZE ? THREAD_CACHE_CLASSES-1 : GetSizeClass(usableSize);
+	if (GetClassSize(sizeClass)>usableSize)
+		sizeClass--;
+	*(void**) p=cache->blocks[sizeClass];
+	cache->blocks[sizeClass]=p;
+	cache->statistics.cachedFrees++;
+	unsigned int maxBlocks=GetClassMaxBlocks(sizeClass);
+	if (++cache->blockCounts[sizeClass]>maxBlocks)
+		ReturnBlocks(cache, sizeClass, maxBlocks/2);
+}
+#else
+static void* FixedHeapMalloc(size_t size)
 {
 	return rak_mspace_malloc(rakNetFixedHeapMSpace,size);
 }
+static void FixedHeapFree(void *p)
+{
+	if (p)
+		rak_mspace_free(rakNetFixedHeapMSpace,p);
+}
+#endif
+
+void* _DLMalloc(size_t size)
+{
+	return FixedHeapMalloc(size);
+}
 
 void* _DLRealloc(void *p, size_t size)
 {
@@ -204,15 +485,14 @@ void* _DLRealloc(void *p, size_t size)
 
 void _DLFree(void *p)
 {
-	if (p)
-		rak_mspace_free(rakNetFixedHeapMSpace,p);
+	FixedHeapFree(p);
 }
 void* _DLMalloc_Ex (size_t size, const char *file, unsigned int line)
 {
 	(void) file;
 	(void) line;
 
-	return rak_mspace_malloc(rakNetFixedHeapMSpace,size);
+	return FixedHeapMalloc(size);
 }
 
 void* _DLRealloc_Ex (void *p, size_t size, const char *file, unsigned int line)
@@ -228,8 +508,7 @@ void _DLFree_Ex (void *p, const char *file, unsigned int line)
 	(void) file;
 	(void) line;
 
-	if (p)
-		rak_mspace_free(rakNetFixedHeapMSpace,p);
+	FixedHeapFree(p);
 }
 
 void UseRaknetFixedHeap(size_t initialCapacity,
@@ -247,12 +526,32 @@ void UseRaknetFixedHeap(size_t initialCapacity,
 	SetRealloc_Ex(_DLRealloc_Ex);
 	SetFree_Ex(_DLFree_Ex);
 
-	rakNetFixedHeapMSpace=rak_create_mspace(initialCapacity, 0);
+#ifdef RAK_MEMORY_THREAD_LOCAL
+#if defined(_WIN32)
+	if (threadCacheFlsIndex==FLS_OUT_OF_INDEXES)
+		threadCacheFlsIndex=FlsAlloc(OnThreadExit);
+#else
+	if (threadCacheKeyCreated==false)
+		threadCacheKeyCreated=pthread_key_create(&threadCacheKey, OnThreadExit)==0;
+#endif
+	heapGeneration++;
+#endif
+	// Locked, as every thread of RakNet allocates from it
+	rakNetFixedHeapMSpace=rak_create_mspace(initialCapacity, 1);
 }
 void FreeRakNetFixedHeap(void)
 {
 	if (rakNetFixedHeapMSpace)
 	{
+#ifdef RAK_MEMORY_THREAD_LOCAL
+		// Caches are in the heap, so go with it
+		LockThreadCaches();
+		threadCaches=0;
+		memset(&exitedThreadStatistics, 0, sizeof(exitedThreadStatistics));
+		anyThreadExited=false;
+		UnlockThreadCaches();
+		heapGeneration++;
+#endif
 		rak_destroy_mspace(rakNetFixedHeapMSpace);
 		rakNetFixedHeapMSpace=0;
 	}
@@ -264,6 +563,49 @@ void FreeRakNetFixedHeap(void)
 	SetRealloc_Ex(_RakRealloc_Ex);
 	SetFree_Ex(_RakFree_Ex);
 }
+void SetRakNetFixedHeapThreadCache(bool enabled)
+{
+#ifdef RAK_MEMORY_THREAD_LOCAL
+	threadCacheEnabled=enabled;
+#else
+	(void) enabled;
+#endif
+}
+void FlushRakNetFixedHeapThreadCache(void)
+{
+#ifdef RAK_MEMORY_THREAD_LOCAL
+	if (rakNetFixedHeapMSpace && threadCache && threadCacheGeneration==heapGeneration)
+		FlushThreadCache(threadCache);
+#endif
+}
+unsigned int GetRakNetFixedHeapThreadStatistics(RakNetFixedHeapThreadStatistics *statistics, unsigned int maxThreads)
+{
+	unsigned int count=0;
+#ifdef RAK_MEMORY_THREAD_LOCAL
+	LockThreadCaches();
+	for (ThreadCache *cache=threadCaches; cache && count<maxThreads; cache=cache->next)
+	{
+		statistics[count]=cache->statistics;
+		statistics[count].cachedBytes=0;
+		for (int sizeClass=0; sizeClass<THREAD_CACHE_CLASSES; sizeClass++)
+			statistics[count].cachedBytes+=cache->blockCounts[sizeClass]*GetClassSize(sizeClass);
+		statistics[count].exited=false;
+		count++;
+	}
+	if (anyThreadExited && count<maxThreads)
+	{
+		statistics[count]=exitedThreadStatistics;
+		statistics[count].cachedBytes=0;
+		statistics[count].exited=true;
+		count++;
+	}
+	UnlockThreadCaches();
+#else
+	(void) statistics;
+	(void) maxThreads;
+#endif
+	return count;
+}
 #else
 void * RakNet::_DLMallocMMap (size_t size) {(void) size; return 0;}
 void * RakNet::_DLMallocDirectMMap (size_t size) {(void) size; return 0;}
@@ -286,6 +628,9 @@ void UseRaknetFixedHeap(size_t initialCapacity,
 	(void) yourMUnmapFunction;
 }
 void FreeRakNetFixedHeap(void) {}
+void SetRakNetFixedHeapThreadCache(bool enabled) {(void) enabled;}
+void FlushRakNetFixedHeapThreadCache(void) {}
+unsigned int GetRakNetFixedHeapThreadStatistics(RakNetFixedHeapThreadStatistics *statistics, unsigned int maxThreads) {(void) statistics; (void) maxThreads; return 0;}
 #endif
 
 #if _USE_RAK_MEMORY_OVERRIDE==1
@@ -19,6 +19,7 @@
 
 #include "Export.h"
 #include "RakNetDefines.h"
+#include "NativeTypes.h"
 #include <new>
 
 
@@ -234,6 +235,34 @@ void UseRaknetFixedHeap(size_t initialCapacity,
 // Free memory allocated from UseRaknetFixedHeap
 void FreeRakNetFixedHeap(void);
 
+// Allocations from UseRaknetFixedHeap of up to 2048 bytes are served from a cache of the thread making them, which takes blocks from the heap and gives them back in batches, so threads rarely wait on the lock of the heap.
+// On by default. When disabled, blocks already cached stay there until FlushRakNetFixedHeapThreadCache()
+void SetRakNetFixedHeapThreadCache(bool enabled);
+
+// Gives the blocks cached by the calling thread back to the heap. Done for each thread as it exits
+void FlushRakNetFixedHeapThreadCache(void);
+
+struct RakNetFixedHeapThreadStatistics
+{
+	// Allocations and frees served by the cache of the thread
+	uint64_t cachedAllocations;
+	uint64_t cachedFrees;
+	// Batches taken from the heap, and given back to it
+	uint64_t refills;
+	uint64_t returns;
+	// Allocations and frees of blocks too large for the cache, which went to the heap
+	uint64_t heapAllocations;
+	uint64_t heapFrees;
+	// Bytes of blocks in the cache now
+	uint64_t cachedBytes;
+	// If true, summed over threads that exited
+	bool exited;
+};
+
+// Statistics of the cache of each thread that allocated from UseRaknetFixedHeap, in the order they first did, followed by one for threads that exited
+// Returns how many were written, up to maxThreads
+unsigned int GetRakNetFixedHeapThreadStatistics(RakNetFixedHeapThreadStatistics *statistics, unsigned int maxThreads);
+
 // #if _USE_RAK_MEMORY_OVERRIDE==1
 // 	#if defined(RMO_NEW_UNDEF)
 // 	#pragma pop_macro("new")
@@ -190,6 +190,14 @@
 
 
 
+// If defined, each socket has a thread that sends the datagrams RakPeer's update thread queues for it, in batches with sendmmsg() and UDP segmentation offload on Linux
+// Costs less CPU per message for large messages, which are split into many datagrams, but more for many connections sending small messages, as the thread wakes more often
 //#define USE_THREADED_SEND
 
+// Bulk mode snapshots (VariableDeltaSerializer::SerializeSnapshot(), RM3SR_SERIALIZED_DELTA) longer than this many bytes are rejected when read
+// The length is sent by the remote system, so this caps what one message can make the receiver allocate
+#ifndef MAX_SNAPSHOT_BYTE_LENGTH
+#define MAX_SNAPSHOT_BYTE_LENGTH 65536
+#endif
+
 #endif // __RAKNET_DEFINES_H
@@ -0,0 +1,288 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "RakNetMetrics.h"
+#include "RakNetTypes.h"
+#include "RakString.h"
+#include "GetTime.h"
+#include "WindowsIncludes.h"
+#include <string.h>
+#include <stdio.h>
+
+using namespace RakNet;
+
+#if defined(_MSC_VER)
+#define RAKNET_METRICS_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define RAKNET_METRICS_THREAD_LOCAL __thread
+#endif
+
+static inline void AtomicAdd(volatile uint64_t *p, uint64_t value)
+{
+#if defined(_WIN32)
+	InterlockedExchangeAdd64((volatile LONGLONG *) p, (LONGLONG) value);
+#elif defined(__GNUC__)
+	__sync_fetch_and_add(p, value);
+#else
+	*p+=value;
+#endif
+}
+
+// 64 bit reads are only atomic by themselves on 64 bit platforms
+static inline uint64_t AtomicRead(const volatile uint64_t *p)
+{
+#if defined(_WIN64) || defined(__x86_64__) || defined(__aarch64__) || defined(__LP64__)
+	return *p;
+#elif defined(_WIN32)
+	return (uint64_t) InterlockedCompareExchange64((volatile LONGLONG *) p, 0, 0);
+#elif defined(__GNUC__)
+	return __sync_fetch_and_add((volatile uint64_t *) p, 0);
+#else
+	return *p;
+#endif
+}
+
+// Only zero initialized, as allocations are counted before static constructors run
+static RakNetMetrics::Stripe processStripes[RAKNET_METRICS_STRIPES];
+
+#ifdef RAKNET_METRICS_THREAD_LOCAL
+static volatile uint32_t threadsSeen;
+// Stripe plus one, 0 until the thread first records
+static RAKNET_METRICS_THREAD_LOCAL unsigned int threadStripe;
+#endif
+
+static inline unsigned int GetThreadStripe(void)
+{
+#ifdef RAKNET_METRICS_THREAD_LOCAL
+	if (threadStripe==0)
+	{
+#if defined(_WIN32)
+		uint32_t threadNumber=(uint32_t) InterlockedIncrement((volatile LONG *) &threadsSeen);
+#else
+		uint32_t threadNumber=__sync_add_and_fetch(&threadsSeen, (uint32_t) 1);
+#endif
+		threadStripe=threadNumber%RAKNET_METRICS_STRIPES+1;
+	}
+	return threadStripe-1;
+#else
+	return 0;
+#endif
+}
+
+static inline int GetHistogramBucket(uint64_t microseconds)
+{
+	int bucket=0;
+	while (microseconds!=0 && bucket < RAKNET_METRICS_HISTOGRAM_BUCKETS-1)
+	{
+		microseconds>>=1;
+		bucket++;
+	}
+	return bucket;
+}
+
+double RakNetMetricsSnapshot::GetRatePerSecond(const RakNetMetricsSnapshot &older, RakNetMetricsCounter counter) const
+{
+	if (time<=older.time)
+		return 0.0;
+	return (double) (counters[counter]-older.counters[counter]) * 1000000.0 / (double) (time-older.time);
+}
+double RakNetMetricsSnapshot::GetResendRatio(const RakNetMetricsSnapshot &older) const
+{
+	uint64_t sent=counters[METRICS_USER_MESSAGE_BYTES_SENT]-older.counters[METRICS_USER_MESSAGE_BYTES_SENT];
+	if (sent==0)
+		return 0.0;
+	return (double) (counters[METRICS_USER_MESSAGE_BYTES_RESENT]-older.counters[METRICS_USER_MESSAGE_BYTES_RESENT]) / (double) sent;
+}
+uint64_t RakNetMetricsSnapshot::GetPercentileUS(RakNetMetricsHistogram histogram, double fraction) const
+{
+	const Histogram &h = histograms[histogram];
+	uint64_t target = (uint64_t) (fraction * (double) h.count);
+	uint64_t seen=0;
+	for (int i=0; i < RAKNET_METRICS_HISTOGRAM_BUCKETS; i++)
+	{
+		seen+=h.buckets[i];
+		if (seen > target || (seen==h.count && seen!=0))
+			return ((uint64_t) 1 << i)-1;
+	}
+	return 0;
+}
+
+RakNetMetrics::RakNetMetrics()
+{
+	Reset();
+}
+void RakNetMetrics::Add(RakNetMetricsCounter counter, uint64_t value)
+{
+	AtomicAdd(&stripes[GetThreadStripe()].counters[counter], value);
+}
+void RakNetMetrics::Set(RakNetMetricsGauge gauge, uint64_t value)
+{
+#if defined(_WIN32)
+	InterlockedExchange64((volatile LONGLONG *) &gauges[gauge], (LONGLONG) value);
+#elif defined(__GNUC__)
+	// So the store is not torn on 32 bit platforms
+	uint64_t old=gauges[gauge];
+	while (__sync_bool_compare_and_swap(&gauges[gauge], old, value)==false)
+		old=gauges[gauge];
+#else
+	gauges[gauge]=value;
+#endif
+}
+void RakNetMetrics::Record(RakNetMetricsHistogram histogram, uint64_t microseconds)
+{
+	Stripe *stripe = &stripes[GetThreadStripe()];
+	AtomicAdd(&stripe->histogramBuckets[histogram][GetHistogramBucket(microseconds)], 1);
+	AtomicAdd(&stripe->histogramSums[histogram], microseconds);
+}
+void RakNetMetrics::GetSnapshot(RakNetMetricsSnapshot *snapshot) const
+{
+	memset(snapshot, 0, sizeof(RakNetMetricsSnapshot));
+	snapshot->time=RakNet::GetTimeUS();
+	int i,j;
+	for (int s=0; s < RAKNET_METRICS_STRIPES; s++)
+	{
+		for (i=0; i < METRICS_COUNTER_COUNT; i++)
+		{
+			if (i==METRICS_ALLOCATIONS || i==METRICS_ALLOCATION_BYTES || i==METRICS_FREES)
+				snapshot->counters[i]+=AtomicRead(&processStripes[s].counters[i]);
+			else
+				snapshot->counters[i]+=AtomicRead(&stripes[s].counters[i]);
+		}
+		for (i=0; i < METRICS_HISTOGRAM_COUNT; i++)
+		{
+			for (j=0; j < RAKNET_METRICS_HISTOGRAM_BUCKETS; j++)
+				snapshot->histograms[i].buckets[j]+=AtomicRead(&stripes[s].histogramBuckets[i][j]);
+			snapshot->histograms[i].sumUS+=AtomicRead(&stripes[s].histogramSums[i]);
+		}
+	}
+	for (i=0; i < METRICS_HISTOGRAM_COUNT; i++)
+	{
+		for (j=0; j < RAKNET_METRICS_HISTOGRAM_BUCKETS; j++)
+			snapshot->histograms[i].count+=snapshot->histograms[i].buckets[j];
+	}
+	for (i=0; i < METRICS_GAUGE_COUNT; i++)
+		snapshot->gauges[i]=AtomicRead(&gauges[i]);
+}
+void RakNetMetrics::Reset(void)
+{
+	memset(stripes, 0, sizeof(stripes));
+	memset(gauges, 0, sizeof(gauges));
+}
+void RakNetMetrics::AddProcess(RakNetMetricsCounter counter, uint64_t value)
+{
+	AtomicAdd(&processStripes[GetThreadStripe()].counters[counter], value);
+}
+
+static const char *counterNames[METRICS_COUNTER_COUNT][2]=
+{
+	{"raknet_bytes_sent_total", "Bytes sent on sockets, including overhead and acks"},
+	{"raknet_bytes_received_total", "Bytes received on sockets from connected systems"},
+	{"raknet_datagrams_sent_total", "Datagrams sent"},
+	{"raknet_datagrams_received_total", "Datagrams received from connected systems"},
+	{"raknet_user_message_bytes_pushed_total", "Bytes of messages passed to Send()"},
+	{"raknet_user_message_bytes_sent_total", "Bytes of messages sent the first time"},
+	{"raknet_user_message_bytes_resent_total", "Bytes of reliable messages sent again"},
+	{"raknet_packets_received_total", "Packets returned by Receive() or consumed by plugins"},
+	{"raknet_allocations_total", "Blocks allocated by the default allocator, process wide"},
+	{"raknet_allocation_bytes_total", "Bytes asked of the default allocator, process wide"},
+	{"raknet_frees_total", "Blocks freed by the default allocator, process wide"},
+};
+static const char *gaugeNames[METRICS_GAUGE_COUNT][2]=
+{
+	{"raknet_connections", "Connections, including those being made"},
+	{"raknet_send_queue_bytes", "Bytes of messages waiting to be sent the first time"},
+	{"raknet_resend_queue_bytes", "Bytes of reliable messages not yet acknowledged"},
+	{"raknet_congestion_window_bytes", "Bytes congestion control allows on the wire at once, summed over connections"},
+	{"raknet_receive_queue_packets", "Packets waiting for Receive()"},
+};
+static const char *histogramNames[METRICS_HISTOGRAM_COUNT][2]=
+{
+	{"raknet_update_cycle_microseconds", "Time spent in each update cycle of the network thread"},
+	{"raknet_plugin_receive_microseconds", "Time plugins spent in OnReceive() for each packet"},
+};
+
+// Labels come from the caller and have no length limit, so the pieces are appended instead of formatted into a fixed buffer
+static void WriteHelp(const char *name, const char *help, const char *type, RakNet::RakString *output)
+{
+	*output+="# HELP ";
+	*output+=name;
+	*output+=" ";
+	*output+=help;
+	*output+="\n# TYPE ";
+	*output+=name;
+	*output+=" ";
+	*output+=type;
+	*output+="\n";
+}
+static void WriteValue(const char *name, const char *suffix, const char *labels, const char *le, uint64_t value, RakNet::RakString *output)
+{
+	char number[32];
+	*output+=name;
+	*output+=suffix;
+	if (le || (labels && labels[0]))
+	{
+		*output+="{";
+		if (labels && labels[0])
+		{
+			*output+=labels;
+			if (le)
+				*output+=",";
+		}
+		if (le)
+		{
+			*output+="le=\"";
+			*output+=le;
+			*output+="\"";
+		}
+		*output+="}";
+	}
+	sprintf(number, " %" PRINTF_64_BIT_MODIFIER "u\n", (unsigned long long) value);
+	*output+=number;
+}
+
+void RakNetMetrics::SnapshotsToText(const RakNetMetricsSnapshot *snapshots, const char * const *labels, unsigned int count, RakNet::RakString *output)
+{
+	int i;
+	unsigned int k;
+	for (i=0; i < METRICS_COUNTER_COUNT; i++)
+	{
+		WriteHelp(counterNames[i][0], counterNames[i][1], "counter", output);
+		for (k=0; k < count; k++)
+			WriteValue(counterNames[i][0], "", labels ? labels[k] : 0, 0, snapshots[k].counters[i], output);
+	}
+	for (i=0; i < METRICS_GAUGE_COUNT; i++)
+	{
+		WriteHelp(gaugeNames[i][0], gaugeNames[i][1], "gauge", output);
+		for (k=0; k < count; k++)
+			WriteValue(gaugeNames[i][0], "", labels ? labels[k] : 0, 0, snapshots[k].gauges[i], output);
+	}
+	char le[32];
+	for (i=0; i < METRICS_HISTOGRAM_COUNT; i++)
+	{
+		WriteHelp(histogramNames[i][0], histogramNames[i][1], "histogram", output);
+		for (k=0; k < count; k++)
+		{
+			// Buckets are cumulative in this format
+			const RakNetMetricsSnapshot::Histogram &histogram = snapshots[k].histograms[i];
+			uint64_t cumulative=0;
+			for (int j=0; j < RAKNET_METRICS_HISTOGRAM_BUCKETS; j++)
+			{
+				cumulative+=histogram.buckets[j];
+				if (j==RAKNET_METRICS_HISTOGRAM_BUCKETS-1)
+					strcpy(le, "+Inf");
+				else
+					sprintf(le, "%" PRINTF_64_BIT_MODIFIER "u", (unsigned long long) (((uint64_t) 1 << j)-1));
+				WriteValue(histogramNames[i][0], "_bucket", labels ? labels[k] : 0, le, cumulative, output);
+			}
+			WriteValue(histogramNames[i][0], "_sum", labels ? labels[k] : 0, 0, histogram.sumUS, output);
+			WriteValue(histogramNames[i][0], "_count", labels ? labels[k] : 0, 0, histogram.count, output);
+		}
+	}
+}
@@ -0,0 +1,159 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file RakNetMetrics.h
+/// \brief Counters, gauges and histograms RakPeer always keeps, for monitoring
+///
+/// Unlike RakNetStatistics, these are totals over every connection, and reading them takes no locks.
+/// Get a copy with RakPeerInterface::GetMetrics(). Rates are the difference between two snapshots, divided by the time between them.
+/// For a text format monitoring systems can scrape, see RakNetMetrics::SnapshotsToText() and MetricsExporter
+///
+
+
+#ifndef __RAK_NET_METRICS_H
+#define __RAK_NET_METRICS_H
+
+#include "Export.h"
+#include "NativeTypes.h"
+#include "RakNetTime.h"
+
+namespace RakNet
+{
+/// Forward declarations
+class RakString;
+
+/// Totals that only go up
+enum RakNetMetricsCounter
+{
+	/// Bytes sent on sockets, including per-message and per-datagram overhead and acks
+	METRICS_BYTES_SENT,
+	/// Bytes received on sockets from connected systems
+	METRICS_BYTES_RECEIVED,
+	METRICS_DATAGRAMS_SENT,
+	METRICS_DATAGRAMS_RECEIVED,
+	/// Bytes of messages passed to RakPeerInterface::Send()
+	METRICS_USER_MESSAGE_BYTES_PUSHED,
+	/// Bytes of messages sent the first time. Less than METRICS_USER_MESSAGE_BYTES_PUSHED while congestion control holds messages back
+	METRICS_USER_MESSAGE_BYTES_SENT,
+	/// Bytes of reliable messages sent again, because they or their acks were lost
+	METRICS_USER_MESSAGE_BYTES_RESENT,
+	/// Packets returned by RakPeerInterface::Receive() or consumed by plugins
+	METRICS_PACKETS_RECEIVED,
+	/// Calls to the default rakMalloc_Ex() and rakRealloc_Ex() that allocated a new block, in the whole process
+	METRICS_ALLOCATIONS,
+	/// Bytes asked of the default rakMalloc_Ex() and rakRealloc_Ex(), in the whole process
+	METRICS_ALLOCATION_BYTES,
+	/// Calls to the default rakFree_Ex(), in the whole process
+	METRICS_FREES,
+	/// \internal
+	METRICS_COUNTER_COUNT
+};
+
+/// Values as of the end of the last update cycle, summed over connections
+enum RakNetMetricsGauge
+{
+	METRICS_CONNECTIONS,
+	/// Bytes of messages waiting to be sent the first time
+	METRICS_SEND_QUEUE_BYTES,
+	/// Bytes of reliable messages sent and not yet acknowledged
+	METRICS_RESEND_QUEUE_BYTES,
+	/// Bytes congestion control allows on the wire at once
+	METRICS_CONGESTION_WINDOW_BYTES,
+	/// Packets waiting for RakPeerInterface::Receive()
+	METRICS_RECEIVE_QUEUE_PACKETS,
+	/// \internal
+	METRICS_GAUGE_COUNT
+};
+
+/// Durations, in microseconds
+enum RakNetMetricsHistogram
+{
+	/// Time spent in each update cycle of the network thread
+	METRICS_UPDATE_CYCLE_US,
+	/// Time plugins spent in OnReceive() for each packet, in RakPeerInterface::Receive()
+	METRICS_PLUGIN_RECEIVE_US,
+	/// \internal
+	METRICS_HISTOGRAM_COUNT
+};
+
+/// Bucket 0 counts durations of 0. Bucket i counts durations from 2^(i-1) to 2^i-1 microseconds, and the last bucket everything longer
+#define RAKNET_METRICS_HISTOGRAM_BUCKETS 24
+
+/// Threads record into their own stripe, so threads do not share cache lines. More threads than stripes share them
+#define RAKNET_METRICS_STRIPES 8
+
+/// \brief A copy of RakNetMetrics at one time
+struct RAK_DLL_EXPORT RakNetMetricsSnapshot
+{
+	/// RakNet::GetTimeUS() when taken
+	RakNet::TimeUS time;
+	uint64_t counters[METRICS_COUNTER_COUNT];
+	uint64_t gauges[METRICS_GAUGE_COUNT];
+	struct Histogram
+	{
+		uint64_t buckets[RAKNET_METRICS_HISTOGRAM_BUCKETS];
+		uint64_t count;
+		uint64_t sumUS;
+	} histograms[METRICS_HISTOGRAM_COUNT];
+
+	/// How much \a counter went up per second between \a older and this
+	double GetRatePerSecond(const RakNetMetricsSnapshot &older, RakNetMetricsCounter counter) const;
+	/// METRICS_USER_MESSAGE_BYTES_RESENT over METRICS_USER_MESSAGE_BYTES_SENT, between \a older and this. 0 if nothing was sent
+	double GetResendRatio(const RakNetMetricsSnapshot &older) const;
+	/// The duration below which \a fraction of the durations in \a histogram were, to the resolution of the buckets
+	uint64_t GetPercentileUS(RakNetMetricsHistogram histogram, double fraction) const;
+};
+
+/// \brief Records counters, gauges and histograms without locks. Any thread can record, and any thread can take a snapshot
+/// \details RakPeer keeps one, which also reports the process wide allocator counters
+class RAK_DLL_EXPORT RakNetMetrics
+{
+public:
+	RakNetMetrics();
+
+	/// Adds \a value to \a counter, in the stripe of the calling thread
+	void Add(RakNetMetricsCounter counter, uint64_t value);
+	/// Sets \a gauge. Meant for one thread, as the last value set is what is reported
+	void Set(RakNetMetricsGauge gauge, uint64_t value);
+	/// Records a duration of \a microseconds in \a histogram
+	void Record(RakNetMetricsHistogram histogram, uint64_t microseconds);
+
+	/// Sums the stripes into \a snapshot. Counters of different stripes are read at slightly different times
+	void GetSnapshot(RakNetMetricsSnapshot *snapshot) const;
+
+	/// Zeros everything, except the process wide counters
+	void Reset(void);
+
+	/// Adds to the process wide counters, METRICS_ALLOCATIONS, METRICS_ALLOCATION_BYTES and METRICS_FREES
+	static void AddProcess(RakNetMetricsCounter counter, uint64_t value);
+
+	/// Appends \a snapshots to \a output in the Prometheus text exposition format, with the lines of each metric together
+	/// \param[in] labels For each snapshot, written inside the braces of its lines, for example peer="game". 0 for no labels at all
+	/// \param[in] count How many snapshots and labels there are
+	static void SnapshotsToText(const RakNetMetricsSnapshot *snapshots, const char * const *labels, unsigned int count, RakNet::RakString *output);
+
+	/// \internal
+	struct Stripe
+	{
+		uint64_t counters[METRICS_COUNTER_COUNT];
+		uint64_t histogramBuckets[METRICS_HISTOGRAM_COUNT][RAKNET_METRICS_HISTOGRAM_BUCKETS];
+		uint64_t histogramSums[METRICS_HISTOGRAM_COUNT];
+		// Ends the stripe on its own cache line
+		char padding[64];
+	};
+
+protected:
+	Stripe stripes[RAKNET_METRICS_STRIPES];
+	uint64_t gauges[METRICS_GAUGE_COUNT];
+};
+
+} // namespace RakNet
+
+#endif
@@ -14,6 +14,7 @@
 #include "RakSleep.h"
 #include "SocketDefines.h"
 #include "GetTime.h"
+#include "SendToThread.h"
 #include <stdio.h>
 #include <string.h> // memcpy
 
@@ -63,9 +64,10 @@ void RakNetSocket2::SetRecvEventHandler(RNS2EventHandler *_eventHandler) {eventH
 RNS2Type RakNetSocket2::GetSocketType(void) const {return socketType;}
 void RakNetSocket2::SetSocketType(RNS2Type t) {socketType=t;}
 bool RakNetSocket2::IsBerkleySocket(void) const {
-	return socketType!=RNS2T_CHROME && socketType!=RNS2T_WINDOWS_STORE_8;
+	return socketType!=RNS2T_CHROME && socketType!=RNS2T_WINDOWS_STORE_8 && socketType!=RNS2T_VIRTUAL;
 }
 SystemAddress RakNetSocket2::GetBoundAddress(void) const {return boundAddress;}
+bool RakNetSocket2::IsSendSaturated(void) const {return false;}
 
 RakNetSocket2* RakNetSocket2Allocator::AllocRNS2(void)
 {
@@ -380,9 +382,12 @@ RNS2_Berkley::RNS2_Berkley()
 {
 	rns2Socket=(RNS2Socket)INVALID_SOCKET;
 	slo = 0;
+	sendToThread = 0;
 }
 RNS2_Berkley::~RNS2_Berkley()
 {
+	BlockOnStopSendThread();
+
 	if (rns2Socket!=INVALID_SOCKET)
 	{
 		/*
@@ -433,6 +438,54 @@ void RNS2_Berkley::BlockOnStopRecvPollingThread(void)
 		RakSleep(30);
 	}
 }
+int RNS2_Berkley::CreateSendThread(int threadPriority)
+{
+#ifdef USE_THREADED_SEND
+	RakAssert(sendToThread==0);
+	SendToThread *s = RakNet::OP_NEW<SendToThread>(_FILE_AND_LINE_);
+	int errorCode = s->Start(rns2Socket, threadPriority);
+	if (errorCode!=0)
+	{
+		RakNet::OP_DELETE(s, _FILE_AND_LINE_);
+		return errorCode;
+	}
+	sendToThread = s;
+	return 0;
+#else
+	(void) threadPriority;
+	return 0;
+#endif
+}
+void RNS2_Berkley::BlockOnStopSendThread(void)
+{
+#ifdef USE_THREADED_SEND
+	if (sendToThread)
+	{
+		SendToThread *s = sendToThread;
+		sendToThread = 0;
+		s->Stop();
+		RakNet::OP_DELETE(s, _FILE_AND_LINE_);
+	}
+#endif
+}
+bool RNS2_Berkley::IsSendSaturated(void) const
+{
+#ifdef USE_THREADED_SEND
+	return sendToThread!=0 && sendToThread->IsSaturated();
+#else
+	return false;
+#endif
+}
+bool RNS2_Berkley::PushToSendThread(RNS2_SendParameters *sendParameters)
+{
+#ifdef USE_THREADED_SEND
+	// Changing the TTL affects every datagram on the socket, so those are sent now
+	return sendToThread!=0 && sendParameters->ttl==0 && sendToThread->Push(sendParameters);
+#else
+	(void) sendParameters;
+	return false;
+#endif
+}
 const RNS2_BerkleyBindParameters *RNS2_Berkley::GetBindings(void) const {return &binding;}
 RNS2Socket RNS2_Berkley::GetSocket(void) const {return rns2Socket;}
 
@@ -504,6 +557,8 @@ RNS2SendResult RNS2_Windows::Send( RNS2_SendParameters *sendParameters, const ch
 		if (len>=0)
 			return len;
 	} 
+	if (PushToSendThread(sendParameters))
+		return sendParameters->length;
 	return Send_Windows_Linux_360NoVDP(rns2Socket,sendParameters, file, line);
 }
 void RNS2_Windows::GetMyIP( SystemAddress addresses[MAXIMUM_NUMBER_OF_INTERNAL_IDS] ) {return GetMyIP_Windows_Linux(addresses);}
@@ -517,6 +572,8 @@ RNS2SendResult RNS2_Linux::Send( RNS2_SendParameters *sendParameters, const char
 		if (len>=0)
 			return len;
 	}
+	if (PushToSendThread(sendParameters))
+		return sendParameters->length;
 	return Send_Windows_Linux_360NoVDP(rns2Socket,sendParameters, file, line);
 }
 void RNS2_Linux::GetMyIP( SystemAddress addresses[MAXIMUM_NUMBER_OF_INTERNAL_IDS] ) {return GetMyIP_Windows_Linux(addresses);}
@@ -38,6 +38,7 @@ namespace RakNet
 {
 
 class RakNetSocket2;
+class SendToThread;
 struct RNS2_BerkleyBindParameters;
 struct RNS2_SendParameters;
 typedef int RNS2Socket;
@@ -62,7 +63,8 @@ enum RNS2Type
 	RNS2T_XBOX_360,
 	RNS2T_XBOX_720,
 	RNS2T_WINDOWS,
-	RNS2T_LINUX
+	RNS2T_LINUX,
+	RNS2T_VIRTUAL
 };
 
 struct RNS2_SendParameters
@@ -127,6 +129,9 @@ public:
 	void SetUserConnectionSocketIndex(unsigned int i);
 	RNS2EventHandler * GetEventHandler(void) const;
 
+	// True if datagrams passed to Send() are waiting for the socket, so ReliabilityLayer should hold back new data
+	virtual bool IsSendSaturated(void) const;
+
 	// ----------- STATICS ------------
 	static void GetMyIP( SystemAddress addresses[MAXIMUM_NUMBER_OF_INTERNAL_IDS] );
 	static void DomainNameToIP( const char *domainName, char ip[65] );
@@ -307,6 +312,11 @@ public:
 	int CreateRecvPollingThread(int threadPriority);
 	void SignalStopRecvPollingThread(void);
 	void BlockOnStopRecvPollingThread(void);
+	// With USE_THREADED_SEND, Send() hands datagrams to a thread that sends them in batches. Returns 0 on success
+	int CreateSendThread(int threadPriority);
+	// Sends what the thread has waiting, then stops it
+	void BlockOnStopSendThread(void);
+	bool IsSendSaturated(void) const;
 	const RNS2_BerkleyBindParameters *GetBindings(void) const;
 	RNS2Socket GetSocket(void) const;
 	void SetDoNotFragment( int opt );
@@ -346,6 +356,9 @@ protected:
 #endif
 
 	SocketLayerOverride *slo;
+	SendToThread *sendToThread;
+	// Returns true if the send thread took the datagram
+	bool PushToSendThread(RNS2_SendParameters *sendParameters);
 	static RAK_THREAD_DECLARATION(RecvFromLoop);
 };
 
@@ -80,6 +80,10 @@ struct RAK_DLL_EXPORT RakNetStatistics
 	/// If \a isLimitedByOutgoingBandwidthLimit is true, what is the limit, in bytes per second?
 	uint64_t BPSLimitByOutgoingBandwidthLimit;
 
+	/// Is new data held back because datagrams already sent are still waiting for the socket?
+	/// Only happens with USE_THREADED_SEND, when the send thread falls behind
+	bool isLimitedBySendBacklog;
+
 	/// For each priority level, how many messages are waiting to be sent out?
 	unsigned int messageInSendBuffer[NUMBER_OF_PRIORITIES];
 
@@ -37,6 +37,7 @@ namespace RakNet {
 class RakPeerInterface;
 class BitStream;
 struct Packet;
+class VirtualNetwork;
 
 enum StartupResult
 {
@@ -182,6 +183,10 @@ struct RAK_DLL_EXPORT SocketDescriptor
 
 	/// XBOX only: set IPPROTO_VDP if you want to use VDP. If enabled, this socket does not support broadcast to 255.255.255.255
 	unsigned int extraSocketOptions;
+
+	/// Set to bind to a VirtualNetwork in this process instead of a UDP socket. \a port and \a hostAddress are then addresses on that network. Defaults to 0
+	/// \sa VirtualNetwork.h
+	VirtualNetwork *virtualNetwork;
 };
 
 extern bool NonNumericHostString( const char *host );
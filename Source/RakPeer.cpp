@@ -54,10 +54,7 @@
 #include "RakAlloca.h"
 #include "WSAStartupSingleton.h"
 #include "PacketLogger.h"
-
-#ifdef USE_THREADED_SEND
-#include "SendToThread.h"
-#endif
+#include "VirtualNetwork.h"
 
 #ifdef CAT_AUDIT
 #define CAT_AUDIT_PRINTF(...) printf(__VA_ARGS__)
@@ -71,7 +68,6 @@ RAK_THREAD_DECLARATION(UpdateNetworkLoop);
 RAK_THREAD_DECLARATION(RecvFromLoop);
 RAK_THREAD_DECLARATION(UDTConnect);
 }
-#define REMOTE_SYSTEM_LOOKUP_HASH_MULTIPLE 8
 
 #if !defined ( __APPLE__ ) && !defined ( __APPLE_CC__ )
 #include <stdlib.h> // malloc
@@ -214,9 +210,10 @@ RakPeer::RakPeer()
 	maximumNumberOfPeers = 0;
 	//remoteSystemListSize=0;
 	remoteSystemList = 0;
+	memset(pluginsByMessageIDStart, 0, sizeof(pluginsByMessageIDStart));
 	activeSystemList = 0;
 	activeSystemListSize=0;
-	remoteSystemLookup=0;
+	guidLookupCollisions=0;
 	bytesSentPerSecond = bytesReceivedPerSecond = 0;
 	endThreads = true;
 	isMainLoopThreadActive = false;
@@ -242,6 +239,7 @@ RakPeer::RakPeer()
 	//unreliableTimeout=0;
 	unreliableTimeout=1000;
 	maxOutgoingBPS=0;
+	memset(channelOutgoingByteQuotas, 0, sizeof(channelOutgoingByteQuotas));
 	firstExternalID=UNASSIGNED_SYSTEM_ADDRESS;
 	myGuid=UNASSIGNED_RAKNET_GUID;
 	userUpdateThreadPtr=0;
@@ -267,7 +265,6 @@ RakPeer::RakPeer()
 	packetAllocationPool.SetPageSize(sizeof(DataStructures::MemoryPool<Packet>::MemoryWithPage)*32);
 	packetAllocationPoolMutex.Unlock();
 
-	remoteSystemIndexPool.SetPageSize(sizeof(DataStructures::MemoryPool<RemoteSystemIndex>::MemoryWithPage)*32);
 
 
 
@@ -476,6 +473,21 @@ StartupResult RakPeer::Startup( unsigned int maxConnections, SocketDescriptor *s
 		}
 		*/
 
+		if (socketDescriptors[i].virtualNetwork)
+		{
+			RNS2_Virtual *virtualSocket = RakNet::OP_NEW<RNS2_Virtual>(_FILE_AND_LINE_);
+			virtualSocket->SetSocketType(RNS2T_VIRTUAL);
+			virtualSocket->SetUserConnectionSocketIndex(i);
+			if (virtualSocket->Bind(socketDescriptors[i].virtualNetwork, socketDescriptors[i].port, socketDescriptors[i].hostAddress, this)!=BR_SUCCESS)
+			{
+				RakNetSocket2Allocator::DeallocRNS2(virtualSocket);
+				DerefAllSockets();
+				return SOCKET_PORT_ALREADY_IN_USE;
+			}
+			socketList.Push(virtualSocket, _FILE_AND_LINE_ );
+			continue;
+		}
+
 		RakNetSocket2 *r2 = RakNetSocket2Allocator::AllocRNS2();
 		r2->SetUserConnectionSocketIndex(i);
 		#if defined(__native_client__)
@@ -582,7 +594,12 @@ StartupResult RakPeer::Startup( unsigned int maxConnections, SocketDescriptor *s
 	for (i=0; i<socketDescriptorCount; i++)
 	{
 		if (socketList[i]->IsBerkleySocket())
+		{
 			((RNS2_Berkley*) socketList[i])->CreateRecvPollingThread(threadPriority);
+#ifdef USE_THREADED_SEND
+			((RNS2_Berkley*) socketList[i])->CreateSendThread(threadPriority);
+#endif
+		}
 	}
 #endif
 
@@ -599,6 +616,8 @@ StartupResult RakPeer::Startup( unsigned int maxConnections, SocketDescriptor *s
 
 		}
 #endif
+		if (socketList[0]->GetSocketType()==RNS2T_VIRTUAL)
+			ipList[i].SetPortHostOrder(socketList[0]->GetBoundAddress().GetPort());
 // 		ipList[i].SetPort(((RNS2_360_720*)socketList[0])->GetBoundAddress().GetPort());
 	}
 // #endif
@@ -620,7 +639,9 @@ StartupResult RakPeer::Startup( unsigned int maxConnections, SocketDescriptor *s
 		//remoteSystemList = RakNet::OP_NEW<RemoteSystemStruct[ remoteSystemListSize ]>( _FILE_AND_LINE_ );
 		remoteSystemList = RakNet::OP_NEW_ARRAY<RemoteSystemStruct>(maximumNumberOfPeers, _FILE_AND_LINE_ );
 
-		remoteSystemLookup = RakNet::OP_NEW_ARRAY<RemoteSystemIndex*>((unsigned int) maximumNumberOfPeers * REMOTE_SYSTEM_LOOKUP_HASH_MULTIPLE, _FILE_AND_LINE_ );
+		remoteSystemLookup.Reserve(maximumNumberOfPeers, _FILE_AND_LINE_);
+		remoteSystemGuidLookup.Reserve(maximumNumberOfPeers, _FILE_AND_LINE_);
+		guidLookupCollisions=0;
 
 		activeSystemList = RakNet::OP_NEW_ARRAY<RemoteSystemStruct*>(maximumNumberOfPeers, _FILE_AND_LINE_ );
 
@@ -643,10 +664,6 @@ StartupResult RakPeer::Startup( unsigned int maxConnections, SocketDescriptor *s
 			activeSystemList[ i ] = &remoteSystemList[ i ];
 		}
 
-		for (unsigned int i=0; i < (unsigned int) maximumNumberOfPeers*REMOTE_SYSTEM_LOOKUP_HASH_MULTIPLE; i++)
-		{
-			remoteSystemLookup[i]=0;
-		}
 	}
 
 	// For histogram statistics
@@ -740,10 +757,6 @@ StartupResult RakPeer::Startup( unsigned int maxConnections, SocketDescriptor *s
 		pluginListNTS[i]->OnRakPeerStartup();
 	}
 
-#ifdef USE_THREADED_SEND
-	RakNet::SendToThread::AddRef();
-#endif
-
 	return RAKNET_STARTED;
 }
 
@@ -1151,6 +1164,7 @@ void RakPeer::Shutdown( unsigned int blockDuration, unsigned char orderingChanne
 		if (socketList[i]->IsBerkleySocket())
 		{
 			((RNS2_Berkley *)socketList[i])->BlockOnStopRecvPollingThread();
+			((RNS2_Berkley *)socketList[i])->BlockOnStopSendThread();
 		}
 	}
 #endif
@@ -1218,10 +1232,6 @@ void RakPeer::Shutdown( unsigned int blockDuration, unsigned char orderingChanne
 
 	ClearRemoteSystemLookup();
 
-#ifdef USE_THREADED_SEND
-	RakNet::SendToThread::Deref();
-#endif
-
 	ResetSendReceipt();
 }
 
@@ -1549,6 +1559,8 @@ Packet* RakPeer::Receive( void )
 		packetReturnMutex.Unlock();
 		if (packet==0)
 			return 0;
+		metrics.Add(METRICS_PACKETS_RECEIVED, 1);
+		RakNet::TimeUS pluginStart=RakNet::GetTimeUS();
 
 //		unsigned char msgId;
 		if ( ( packet->length >= sizeof(unsigned char) + sizeof( RakNet::Time ) ) &&
@@ -1570,25 +1582,25 @@ Packet* RakPeer::Receive( void )
 		CallPluginCallbacks(pluginListTS, packet);
 		CallPluginCallbacks(pluginListNTS, packet);
 
-		for (i=0; i < pluginListTS.Size(); i++)
+		// Only plugins that want this MessageID. Timestamped messages are rare, so check every plugin for those.
+		unsigned int firstPlugin, lastPlugin;
+		bool checkEachPlugin = packet->data[0]==ID_TIMESTAMP;
+		if (checkEachPlugin)
 		{
- 			pluginResult=pluginListTS[i]->OnReceive(packet);
-			if (pluginResult==RR_STOP_PROCESSING_AND_DEALLOCATE)
-			{
-				DeallocatePacket( packet );
-				packet=0; // Will do the loop again and get another packet
-				break; // break out of the enclosing for
-			}
-			else if (pluginResult==RR_STOP_PROCESSING)
-			{
-				packet=0;
-				break;
-			}
+			firstPlugin=pluginsByMessageIDStart[256];
+			lastPlugin=pluginsByMessageIDStart[257];
 		}
-
-		for (i=0; i < pluginListNTS.Size(); i++)
+		else
 		{
-			pluginResult=pluginListNTS[i]->OnReceive(packet);
+			firstPlugin=pluginsByMessageIDStart[packet->data[0]];
+			lastPlugin=pluginsByMessageIDStart[packet->data[0]+1];
+		}
+		// Size() too, in case OnReceive() attached or detached a plugin
+		for (i=firstPlugin; i < lastPlugin && i < pluginsByMessageID.Size(); i++)
+		{
+			if (checkEachPlugin && pluginsByMessageID[i]->ReceivesPacket(packet)==false)
+				continue;
+			pluginResult=pluginsByMessageID[i]->OnReceive(packet);
 			if (pluginResult==RR_STOP_PROCESSING_AND_DEALLOCATE)
 			{
 				DeallocatePacket( packet );
@@ -1601,6 +1613,7 @@ Packet* RakPeer::Receive( void )
 				break;
 			}
 		}
+		metrics.Record(METRICS_PLUGIN_RECEIVE_US, RakNet::GetTimeUS()-pluginStart);
 	
 	} while(packet==0);
 
@@ -1873,48 +1886,15 @@ void RakPeer::GetSystemList(DataStructures::List<SystemAddress> &addresses, Data
 //
 // Parameters
 // IP - Dotted IP address.  Can use * as a wildcard, such as 128.0.0.* will ban
-// All IP addresses starting with 128.0.0
+// All IP addresses starting with 128.0.0, or CIDR notation, such as 128.0.0.0/24
 // milliseconds - how many ms for a temporary ban.  Use 0 for a permanent ban
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 void RakPeer::AddToBanList( const char *IP, RakNet::TimeMS milliseconds )
 {
-	unsigned index;
-	RakNet::TimeMS time = RakNet::GetTimeMS();
-
-	if ( IP == 0 || IP[ 0 ] == 0 || strlen( IP ) > 15 )
-		return ;
-
-	// If this guy is already in the ban list, do nothing
-	index = 0;
-
-	banListMutex.Lock();
-
-	for ( ; index < banList.Size(); index++ )
-	{
-		if ( strcmp( IP, banList[ index ]->IP ) == 0 )
-		{
-			// Already in the ban list.  Just update the time
-			if (milliseconds==0)
-				banList[ index ]->timeout=0; // Infinite
-			else
-				banList[ index ]->timeout=time+milliseconds;
-			banListMutex.Unlock();
-			return;
-		}
-	}
-
-	banListMutex.Unlock();
-
-	BanStruct *banStruct = RakNet::OP_NEW<BanStruct>( _FILE_AND_LINE_ );
-	banStruct->IP = (char*) rakMalloc_Ex( 16, _FILE_AND_LINE_ );
 	if (milliseconds==0)
-		banStruct->timeout=0; // Infinite
+		banList.Add(IP, 0); // Infinite
 	else
-		banStruct->timeout=time+milliseconds;
-	strcpy( banStruct->IP, IP );
-	banListMutex.Lock();
-	banList.Insert( banStruct, _FILE_AND_LINE_ );
-	banListMutex.Unlock();
+		banList.Add(IP, RakNet::GetTimeMS()+milliseconds);
 }
 
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
@@ -1927,36 +1907,7 @@ void RakPeer::AddToBanList( const char *IP, RakNet::TimeMS milliseconds )
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 void RakPeer::RemoveFromBanList( const char *IP )
 {
-	unsigned index;
-	BanStruct *temp;
-
-	if ( IP == 0 || IP[ 0 ] == 0 || strlen( IP ) > 15 )
-		return ;
-
-	index = 0;
-	temp=0;
-
-	banListMutex.Lock();
-
-	for ( ; index < banList.Size(); index++ )
-	{
-		if ( strcmp( IP, banList[ index ]->IP ) == 0 )
-		{
-			temp = banList[ index ];
-			banList[ index ] = banList[ banList.Size() - 1 ];
-			banList.RemoveAtIndex( banList.Size() - 1 );
-			break;
-		}
-	}
-
-	banListMutex.Unlock();
-
-	if (temp)
-	{
-		rakFree_Ex(temp->IP, _FILE_AND_LINE_ );
-		RakNet::OP_DELETE(temp, _FILE_AND_LINE_);
-	}
-
+	banList.Remove(IP);
 }
 
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
@@ -1965,19 +1916,7 @@ void RakPeer::RemoveFromBanList( const char *IP )
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 void RakPeer::ClearBanList( void )
 {
-	unsigned index;
-	index = 0;
-	banListMutex.Lock();
-
-	for ( ; index < banList.Size(); index++ )
-	{
-		rakFree_Ex(banList[ index ]->IP, _FILE_AND_LINE_ );
-		RakNet::OP_DELETE(banList[ index ], _FILE_AND_LINE_);
-	}
-
-	banList.Clear(false, _FILE_AND_LINE_);
-
-	banListMutex.Unlock();
+	banList.Clear();
 }
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 void RakPeer::SetLimitIPConnectionFrequency(bool b)
@@ -1998,87 +1937,7 @@ void RakPeer::SetLimitIPConnectionFrequency(bool b)
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 bool RakPeer::IsBanned( const char *IP )
 {
-	unsigned banListIndex, characterIndex;
-	RakNet::TimeMS time;
-	BanStruct *temp;
-
-	if ( IP == 0 || IP[ 0 ] == 0 || strlen( IP ) > 15 )
-		return false;
-
-	banListIndex = 0;
-
-	if ( banList.Size() == 0 )
-		return false; // Skip the mutex if possible
-
-	time = RakNet::GetTimeMS();
-
-	banListMutex.Lock();
-
-	while ( banListIndex < banList.Size() )
-	{
-		if (banList[ banListIndex ]->timeout>0 && banList[ banListIndex ]->timeout<time)
-		{
-			// Delete expired ban
-			temp = banList[ banListIndex ];
-			banList[ banListIndex ] = banList[ banList.Size() - 1 ];
-			banList.RemoveAtIndex( banList.Size() - 1 );
-			rakFree_Ex(temp->IP, _FILE_AND_LINE_ );
-			RakNet::OP_DELETE(temp, _FILE_AND_LINE_);
-		}
-		else
-		{
-			characterIndex = 0;
-
-#ifdef _MSC_VER
-#pragma warning( disable : 4127 ) // warning C4127: conditional expression is constant
-#endif
-			while ( true )
-			{
-				if ( banList[ banListIndex ]->IP[ characterIndex ] == IP[ characterIndex ] )
-				{
-					// Equal characters
-
-					if ( IP[ characterIndex ] == 0 )
-					{
-						banListMutex.Unlock();
-						// End of the string and the strings match
-
-						return true;
-					}
-
-					characterIndex++;
-				}
-
-				else
-				{
-					if ( banList[ banListIndex ]->IP[ characterIndex ] == 0 || IP[ characterIndex ] == 0 )
-					{
-						// End of one of the strings
-						break;
-					}
-
-					// Characters do not match
-					if ( banList[ banListIndex ]->IP[ characterIndex ] == '*' )
-					{
-						banListMutex.Unlock();
-
-						// Domain is banned.
-						return true;
-					}
-
-					// Characters do not match and it is not a *
-					break;
-				}
-			}
-
-			banListIndex++;
-		}
-	}
-
-	banListMutex.Unlock();
-
-	// No match found.
-	return false;
+	return banList.IsBanned(IP, RakNet::GetTimeMS());
 }
 
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
@@ -2473,6 +2332,10 @@ SystemAddress RakPeer::GetSystemAddressFromGuid( const RakNetGUID input ) const
 	if (input.systemIndex!=(SystemIndex)-1 && input.systemIndex<maximumNumberOfPeers && remoteSystemList[ input.systemIndex ].guid == input)
 		return remoteSystemList[ input.systemIndex ].systemAddress;
 
+	unsigned int index = remoteSystemGuidLookup.GetIndex(input);
+	if (index < maximumNumberOfPeers && remoteSystemList[ index ].guid == input)
+		return remoteSystemList[ index ].systemAddress;
+
 	unsigned int i;
 	for ( i = 0; i < maximumNumberOfPeers; i++ )
 	{
@@ -2785,6 +2648,7 @@ void RakPeer::AttachPlugin( PluginInterface2 *plugin )
 			plugin->SetRakPeerInterface(this);
 			plugin->OnAttach();
 			pluginListNTS.Insert(plugin, _FILE_AND_LINE_);
+			UpdatePluginsByMessageID();
 		}
 	}
 	else
@@ -2794,6 +2658,7 @@ void RakPeer::AttachPlugin( PluginInterface2 *plugin )
 			plugin->SetRakPeerInterface(this);
 			plugin->OnAttach();
 			pluginListTS.Insert(plugin, _FILE_AND_LINE_);
+			UpdatePluginsByMessageID();
 		}
 	}
 }
@@ -2819,6 +2684,7 @@ void RakPeer::DetachPlugin( PluginInterface2 *plugin )
 			// Unordered list so delete from end for speed
 			pluginListNTS[index]=pluginListNTS[pluginListNTS.Size()-1];
 			pluginListNTS.RemoveFromEnd();
+			UpdatePluginsByMessageID();
 		}
 	}
 	else
@@ -2829,6 +2695,7 @@ void RakPeer::DetachPlugin( PluginInterface2 *plugin )
 			// Unordered list so delete from end for speed
 			pluginListTS[index]=pluginListTS[pluginListTS.Size()-1];
 			pluginListTS.RemoveFromEnd();
+			UpdatePluginsByMessageID();
 		}
 	}
 	plugin->OnDetach();
@@ -2981,6 +2848,17 @@ void RakPeer::SetPerConnectionOutgoingBandwidthLimit( unsigned maxBitsPerSecond
 	maxOutgoingBPS=maxBitsPerSecond;
 }
 
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+void RakPeer::SetPerChannelOutgoingByteQuota( unsigned char orderingChannel, unsigned maxBytesPerSecond )
+{
+	RakAssert(orderingChannel < NUMBER_OF_ORDERED_STREAMS);
+	channelOutgoingByteQuotas[orderingChannel]=maxBytesPerSecond;
+	unsigned short i;
+	for ( i = 0; remoteSystemList && i < maximumNumberOfPeers; i++ )
+		remoteSystemList[ i ].reliabilityLayer.SetChannelOutgoingByteQuota(orderingChannel, maxBytesPerSecond);
+}
+
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 // Returns if you previously called ApplyNetworkSimulator
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
@@ -3145,6 +3023,11 @@ bool RakPeer::GetStatistics( const unsigned int index, RakNetStatistics *rns )
 	return false;
 }
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+void RakPeer::GetMetrics( RakNetMetricsSnapshot *snapshot )
+{
+	metrics.GetSnapshot(snapshot);
+}
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 unsigned int RakPeer::GetReceiveBufferSize(void)
 {
 	unsigned int size;
@@ -3194,6 +3077,10 @@ int RakPeer::GetIndexFromGuid( const RakNetGUID guid )
 	if (guid.systemIndex!=(SystemIndex)-1 && guid.systemIndex < maximumNumberOfPeers && remoteSystemList[guid.systemIndex].guid==guid && remoteSystemList[ guid.systemIndex ].isActive)
 		return guid.systemIndex;
 
+	unsigned int index = remoteSystemGuidLookup.GetIndex(guid);
+	if (index < maximumNumberOfPeers && remoteSystemList[ index ].guid == guid && remoteSystemList[ index ].isActive)
+		return index;
+
 	// remoteSystemList in user and network thread
 	for ( i = 0; i < maximumNumberOfPeers; i++ )
 		if ( remoteSystemList[ i ].isActive && remoteSystemList[ i ].guid == guid )
@@ -3399,7 +3286,7 @@ void RakPeer::ValidateRemoteSystemLookup(void) const
 RakPeer::RemoteSystemStruct *RakPeer::GetRemoteSystem( const AddressOrGUID systemIdentifier, bool calledFromNetworkThread, bool onlyActive ) const
 {
 	if (systemIdentifier.rakNetGuid!=UNASSIGNED_RAKNET_GUID)
-		return GetRemoteSystemFromGUID(systemIdentifier.rakNetGuid, onlyActive);
+		return GetRemoteSystemFromGUID(systemIdentifier.rakNetGuid, calledFromNetworkThread, onlyActive);
 	else
 		return GetRemoteSystemFromSystemAddress(systemIdentifier.systemAddress, calledFromNetworkThread, onlyActive);
 }
@@ -3425,6 +3312,11 @@ RakPeer::RemoteSystemStruct *RakPeer::GetRemoteSystemFromSystemAddress( const Sy
 	}
 	else
 	{
+		// The lookup can be changing while we read it, so only trust a result that checks out
+		unsigned int index = GetRemoteSystemIndex(systemAddress);
+		if (index < maximumNumberOfPeers && remoteSystemList[ index ].isActive && remoteSystemList[ index ].systemAddress == systemAddress)
+			return remoteSystemList + index;
+
 		int deadConnectionIndex=-1;
 
 		// Active connections take priority.  But if there are no active connections, return the first systemAddress match found
@@ -3446,11 +3338,18 @@ RakPeer::RemoteSystemStruct *RakPeer::GetRemoteSystemFromSystemAddress( const Sy
 	return 0;
 }
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
-RakPeer::RemoteSystemStruct *RakPeer::GetRemoteSystemFromGUID( const RakNetGUID guid, bool onlyActive ) const
+RakPeer::RemoteSystemStruct *RakPeer::GetRemoteSystemFromGUID( const RakNetGUID guid, bool calledFromNetworkThread, bool onlyActive ) const
 {
 	if (guid==UNASSIGNED_RAKNET_GUID)
 		return 0;
 
+	// Every system with a guid is in remoteSystemGuidLookup, unless two systems had the same guid. Off the network thread, the lookup can be changing while we read it.
+	unsigned int index = remoteSystemGuidLookup.GetIndex(guid);
+	if (index < maximumNumberOfPeers && remoteSystemList[ index ].guid == guid && (onlyActive==false || remoteSystemList[ index ].isActive))
+		return remoteSystemList + index;
+	if (calledFromNetworkThread && guidLookupCollisions==0)
+		return 0;
+
 	unsigned i;
 	for ( i = 0; i < maximumNumberOfPeers; i++ )
 	{
@@ -3654,7 +3553,16 @@ RakPeer::RemoteSystemStruct * RakPeer::AssignSystemAddressToRemoteSystemList( co
 			remoteSystem=remoteSystemList+assignedIndex;
 			ReferenceRemoteSystem(systemAddress, assignedIndex);
 			remoteSystem->MTUSize=defaultMTUSize;
+			RemoveFromGuidLookup(assignedIndex);
 			remoteSystem->guid=guid;
+			if (guid!=UNASSIGNED_RAKNET_GUID)
+			{
+				unsigned int guidIndex = remoteSystemGuidLookup.GetIndex(guid);
+				if (guidIndex!=remoteSystemGuidLookup.NOT_FOUND && remoteSystemList[guidIndex].guid==guid)
+					guidLookupCollisions++;
+				else
+					remoteSystemGuidLookup.Set(guid, assignedIndex);
+			}
 			remoteSystem->isActive = true; // This one line causes future incoming packets to go through the reliability layer
 			// Reserve this reliability layer for ourselves.
 			if (incomingMTU > remoteSystem->MTUSize)
@@ -3662,6 +3570,9 @@ RakPeer::RemoteSystemStruct * RakPeer::AssignSystemAddressToRemoteSystemList( co
 			RakAssert(remoteSystem->MTUSize <= MAXIMUM_MTU_SIZE);
 			remoteSystem->reliabilityLayer.Reset(true, remoteSystem->MTUSize, useSecurity);
 			remoteSystem->reliabilityLayer.SetSplitMessageProgressInterval(splitMessageProgressInterval);
+			remoteSystem->reliabilityLayer.SetMetrics(&metrics);
+			for (unsigned char orderingChannel=0; orderingChannel < NUMBER_OF_ORDERED_STREAMS; orderingChannel++)
+				remoteSystem->reliabilityLayer.SetChannelOutgoingByteQuota(orderingChannel, channelOutgoingByteQuotas[orderingChannel]);
 			remoteSystem->reliabilityLayer.SetUnreliableTimeout(unreliableTimeout);
 			remoteSystem->reliabilityLayer.SetTimeoutTime(defaultTimeoutTime);
 			AddToActiveSystemList(assignedIndex);
@@ -3817,11 +3728,6 @@ RakNet::Time RakPeer::GetBestClockDifferential( const SystemAddress systemAddres
 	return GetClockDifferentialInt(remoteSystem);
 }
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
-unsigned int RakPeer::RemoteSystemLookupHashIndex(const SystemAddress &sa) const
-{
-	return SystemAddress::ToInteger(sa) % ((unsigned int) maximumNumberOfPeers * REMOTE_SYSTEM_LOOKUP_HASH_MULTIPLE);
-}
-// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 void RakPeer::ReferenceRemoteSystem(const SystemAddress &sa, unsigned int remoteSystemListIndex)
 {
 // #ifdef _DEBUG
@@ -3865,28 +3771,10 @@ void RakPeer::ReferenceRemoteSystem(const SystemAddress &sa, unsigned int remote
 
 	remoteSystemList[remoteSystemListIndex].systemAddress=sa;
 
-	unsigned int hashIndex = RemoteSystemLookupHashIndex(sa);
-	RemoteSystemIndex *rsi;
-	rsi = remoteSystemIndexPool.Allocate(_FILE_AND_LINE_);
-	if (remoteSystemLookup[hashIndex]==0)
-	{
-		rsi->next=0;
-		rsi->index=remoteSystemListIndex;
-		remoteSystemLookup[hashIndex]=rsi;
-	}
-	else
-	{
-		RemoteSystemIndex *cur = remoteSystemLookup[hashIndex];
-		while (cur->next!=0)
-		{
-			cur=cur->next;
-		}
-
-		rsi = remoteSystemIndexPool.Allocate(_FILE_AND_LINE_);
-		rsi->next=0;
-		rsi->index=remoteSystemListIndex;
-		cur->next=rsi;
-	}
+	// Each systemAddress is in at most one slot of remoteSystemList, so this cannot run out of room
+	bool added = remoteSystemLookup.Set(sa, remoteSystemListIndex);
+	RakAssert(added);
+	(void) added;
 
 // #ifdef _DEBUG
 // 	for ( int remoteSystemIndex = 0; remoteSystemIndex < maximumNumberOfPeers; ++remoteSystemIndex )
@@ -3905,40 +3793,12 @@ void RakPeer::ReferenceRemoteSystem(const SystemAddress &sa, unsigned int remote
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 void RakPeer::DereferenceRemoteSystem(const SystemAddress &sa)
 {
-	unsigned int hashIndex = RemoteSystemLookupHashIndex(sa);
-	RemoteSystemIndex *cur = remoteSystemLookup[hashIndex];
-	RemoteSystemIndex *last = 0;
-	while (cur!=0)
-	{
-		if (remoteSystemList[cur->index].systemAddress==sa)
-		{
-			if (last==0)
-			{
-				remoteSystemLookup[hashIndex]=cur->next;
-			}
-			else
-			{
-				last->next=cur->next;
-			}
-			remoteSystemIndexPool.Release(cur,_FILE_AND_LINE_);
-			break;
-		}
-		last=cur;
-		cur=cur->next;
-	}
+	remoteSystemLookup.Remove(sa);
 }
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 unsigned int RakPeer::GetRemoteSystemIndex(const SystemAddress &sa) const
 {
-	unsigned int hashIndex = RemoteSystemLookupHashIndex(sa);
-	RemoteSystemIndex *cur = remoteSystemLookup[hashIndex];
-	while (cur!=0)
-	{
-		if (remoteSystemList[cur->index].systemAddress==sa)
-			return cur->index;
-		cur=cur->next;
-	}
-	return (unsigned int) -1;
+	return remoteSystemLookup.GetIndex(sa);
 }
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 RakPeer::RemoteSystemStruct* RakPeer::GetRemoteSystem(const SystemAddress &sa) const
@@ -3951,9 +3811,30 @@ RakPeer::RemoteSystemStruct* RakPeer::GetRemoteSystem(const SystemAddress &sa) c
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 void RakPeer::ClearRemoteSystemLookup(void)
 {
-	remoteSystemIndexPool.Clear(_FILE_AND_LINE_);
-	RakNet::OP_DELETE_ARRAY(remoteSystemLookup,_FILE_AND_LINE_);
-	remoteSystemLookup=0;
+	remoteSystemLookup.Clear(_FILE_AND_LINE_);
+	remoteSystemGuidLookup.Clear(_FILE_AND_LINE_);
+	guidLookupCollisions=0;
+}
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+void RakPeer::RemoveFromGuidLookup(unsigned int remoteSystemListIndex)
+{
+	RakNetGUID guid = remoteSystemList[remoteSystemListIndex].guid;
+	if (guid==UNASSIGNED_RAKNET_GUID || remoteSystemGuidLookup.GetIndex(guid)!=remoteSystemListIndex)
+		return;
+	remoteSystemGuidLookup.Remove(guid);
+
+	if (guidLookupCollisions>0)
+	{
+		// Another system may have the same guid, but was left out of the lookup
+		for (unsigned int i=0; i < maximumNumberOfPeers; i++)
+		{
+			if (i!=remoteSystemListIndex && remoteSystemList[i].guid==guid)
+			{
+				remoteSystemGuidLookup.Set(guid, i);
+				break;
+			}
+		}
+	}
 }
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 void RakPeer::AddToActiveSystemList(unsigned int remoteSystemListIndex)
@@ -4177,6 +4058,7 @@ void RakPeer::CloseConnectionInternal( const AddressOrGUID& systemIdentifier, bo
 					// printf("--- Address %s has become inactive\n", remoteSystemList[index].systemAddress.ToString());
 					remoteSystemList[index].isActive = false;
 
+					RemoveFromGuidLookup(index);
 					remoteSystemList[index].guid=UNASSIGNED_RAKNET_GUID;
 
 					// Reserve this reliability layer for ourselves
@@ -4375,13 +4257,39 @@ bool RakPeer::SendImmediate( char *data, BitSize_t numberOfBitsToSend, PacketPri
 		return false;
 	}
 
-	for (sendListIndex=0; sendListIndex < sendListSize; sendListIndex++)
+	// Rather than each system copying a large message, and splitting it separately, queue one copy for all of them
+	// Small messages are copied into each InternalPacket without allocating, so are not worth sharing
+	InternalPacketRefCountedData *sharedData=0;
+	if (sendListSize>1 && BITS_TO_BYTES(numberOfBitsToSend) > INTERNAL_PACKET_STACK_DATA_BYTES)
 	{
-		// Send may split the packet and thus deallocate data.  Don't assume data is valid if we use the callerAllocationData
-		bool useData = useCallerDataAllocation && callerDataAllocationUsed==false && sendListIndex+1==sendListSize;
-		remoteSystemList[sendList[sendListIndex]].reliabilityLayer.Send( data, numberOfBitsToSend, priority, reliability, orderingChannel, useData==false, remoteSystemList[sendList[sendListIndex]].MTUSize, currentTime, receipt );
-		if (useData)
+		unsigned char *sharedDataBlock;
+		if (useCallerDataAllocation)
+		{
+			sharedDataBlock=(unsigned char*) data;
 			callerDataAllocationUsed=true;
+		}
+		else
+		{
+			sharedDataBlock=(unsigned char*) rakMalloc_Ex((size_t) BITS_TO_BYTES(numberOfBitsToSend), _FILE_AND_LINE_);
+			memcpy(sharedDataBlock, data, (size_t) BITS_TO_BYTES(numberOfBitsToSend));
+		}
+		sharedData=ReliabilityLayer::AllocateSharedData(sharedDataBlock, _FILE_AND_LINE_);
+	}
+
+	for (sendListIndex=0; sendListIndex < sendListSize; sendListIndex++)
+	{
+		if (sharedData)
+		{
+			remoteSystemList[sendList[sendListIndex]].reliabilityLayer.SendShared( sharedData, numberOfBitsToSend, priority, reliability, orderingChannel, remoteSystemList[sendList[sendListIndex]].MTUSize, currentTime, receipt );
+		}
+		else
+		{
+			// Send may split the packet and thus deallocate data.  Don't assume data is valid if we use the callerAllocationData
+			bool useData = useCallerDataAllocation && callerDataAllocationUsed==false && sendListIndex+1==sendListSize;
+			remoteSystemList[sendList[sendListIndex]].reliabilityLayer.Send( data, numberOfBitsToSend, priority, reliability, orderingChannel, useData==false, remoteSystemList[sendList[sendListIndex]].MTUSize, currentTime, receipt );
+			if (useData)
+				callerDataAllocationUsed=true;
+		}
 
 		if (reliability==RELIABLE ||
 			reliability==RELIABLE_ORDERED ||
@@ -4394,6 +4302,10 @@ bool RakPeer::SendImmediate( char *data, BitSize_t numberOfBitsToSend, PacketPri
 			remoteSystemList[sendList[sendListIndex]].lastReliableSend=(RakNet::TimeMS)(currentTime/(RakNet::TimeUS)1000);
 	}
 
+	// Each ReliabilityLayer holds its own reference now
+	if (sharedData)
+		ReliabilityLayer::ReleaseSharedData(sharedData, _FILE_AND_LINE_);
+
 #if !defined(USE_ALLOCA)
 	rakFree_Ex(sendList, _FILE_AND_LINE_ );
 #endif
@@ -4571,9 +4483,7 @@ bool ProcessOfflineNetworkPacket( SystemAddress systemAddress, const char *data,
 	unsigned i;
 
 
-	char str1[64];
-	systemAddress.ToString(false, str1);
-	if (rakPeer->IsBanned( str1 ))
+	if (rakPeer->banList.IsBanned( systemAddress, RakNet::GetTimeMS() ))
 	{
 		for (i=0; i < rakPeer->pluginListNTS.Size(); i++)
 			rakPeer->pluginListNTS[i]->OnDirectSocketReceive(data, length*8, systemAddress);
@@ -5288,7 +5198,7 @@ bool ProcessOfflineNetworkPacket( SystemAddress systemAddress, const char *data,
 
 			RakPeer::RemoteSystemStruct *rssFromSA = rakPeer->GetRemoteSystemFromSystemAddress( systemAddress, true, true );
 			bool IPAddrInUse = rssFromSA != 0 && rssFromSA->isActive;
-			RakPeer::RemoteSystemStruct *rssFromGuid = rakPeer->GetRemoteSystemFromGUID(guid, true);
+			RakPeer::RemoteSystemStruct *rssFromGuid = rakPeer->GetRemoteSystemFromGUID(guid, true, true);
 			bool GUIDInUse = rssFromGuid != 0 && rssFromGuid->isActive;
 
 			// IPAddrInUse, GuidInUse, outcome
@@ -5616,6 +5526,7 @@ bool RakPeer::RunUpdateCycle(BitStream &updateBitStream )
 	RakNetStatistics *rnss;
 	RakNet::TimeUS timeNS=0;
 	RakNet::Time timeMS=0;
+	uint64_t sendQueueBytes=0, resendQueueBytes=0, congestionWindowBytes=0;
 
 	// This is here so RecvFromBlocking actually gets data from the same thread
 
@@ -5904,6 +5815,7 @@ bool RakPeer::RunUpdateCycle(BitStream &updateBitStream )
 			}
 
 			remoteSystem->reliabilityLayer.Update( remoteSystem->rakNetSocket, systemAddress, remoteSystem->MTUSize, timeNS, maxOutgoingBPS, pluginListNTS, &rnr, updateBitStream ); // systemAddress only used for the internet simulator test
+			remoteSystem->reliabilityLayer.AddQueueMetrics(&sendQueueBytes, &resendQueueBytes, &congestionWindowBytes);
 
 			// Check for failure conditions
 			if ( remoteSystem->reliabilityLayer.IsDeadConnection() ||
@@ -6312,6 +6224,14 @@ bool RakPeer::RunUpdateCycle(BitStream &updateBitStream )
 		
 	}
 
+	metrics.Set(METRICS_CONNECTIONS, activeSystemListSize);
+	metrics.Set(METRICS_SEND_QUEUE_BYTES, sendQueueBytes);
+	metrics.Set(METRICS_RESEND_QUEUE_BYTES, resendQueueBytes);
+	metrics.Set(METRICS_CONGESTION_WINDOW_BYTES, congestionWindowBytes);
+	packetReturnMutex.Lock();
+	metrics.Set(METRICS_RECEIVE_QUEUE_PACKETS, packetReturnQueue.Size());
+	packetReturnMutex.Unlock();
+
 	return true;
 }
 
@@ -6415,7 +6335,11 @@ RAK_THREAD_DECLARATION(RakNet::UpdateNetworkLoop)
 		if (rakPeer->userUpdateThreadPtr)
 			rakPeer->userUpdateThreadPtr(rakPeer, rakPeer->userUpdateThreadData);
 
+		// Refreshes TIME_SOURCE_CACHED for this update
+		RakNet::UpdateTimeSource();
+		RakNet::TimeUS updateStart=RakNet::GetTimeUS();
 		rakPeer->RunUpdateCycle(updateBitStream);
+		rakPeer->metrics.Record(METRICS_UPDATE_CYCLE_US, RakNet::GetTimeUS()-updateStart);
 
 		// Pending sends go out this often, unless quitAndDataEvents is set
 		rakPeer->quitAndDataEvents.WaitOnEvent(10);
@@ -6473,54 +6397,89 @@ RAK_THREAD_DECLARATION(RakNet::UpdateNetworkLoop)
 
 void RakPeer::CallPluginCallbacks(DataStructures::List<PluginInterface2*> &pluginList, Packet *packet)
 {
-	for (unsigned int i=0; i < pluginList.Size(); i++)
+	// Look at the message once rather than once per plugin. Most messages are not connection events.
+	unsigned int i;
+	PI2_FailedConnectionAttemptReason failedConnectionAttemptReason;
+	switch (packet->data[0])
 	{
-		switch (packet->data[0])
-		{
-		case ID_DISCONNECTION_NOTIFICATION:
+	case ID_DISCONNECTION_NOTIFICATION:
+		for (i=0; i < pluginList.Size(); i++)
 			pluginList[i]->OnClosedConnection(packet->systemAddress, packet->guid, LCR_DISCONNECTION_NOTIFICATION);
-			break;
-		case ID_CONNECTION_LOST:
+		return;
+	case ID_CONNECTION_LOST:
+		for (i=0; i < pluginList.Size(); i++)
 			pluginList[i]->OnClosedConnection(packet->systemAddress, packet->guid, LCR_CONNECTION_LOST);
-			break;
-		case ID_NEW_INCOMING_CONNECTION:
+		return;
+	case ID_NEW_INCOMING_CONNECTION:
+		for (i=0; i < pluginList.Size(); i++)
 			pluginList[i]->OnNewConnection(packet->systemAddress, packet->guid, true);
-			break;
-		case ID_CONNECTION_REQUEST_ACCEPTED:
+		return;
+	case ID_CONNECTION_REQUEST_ACCEPTED:
+		for (i=0; i < pluginList.Size(); i++)
 			pluginList[i]->OnNewConnection(packet->systemAddress, packet->guid, false);
-			break;
-		case ID_CONNECTION_ATTEMPT_FAILED:
-			pluginList[i]->OnFailedConnectionAttempt(packet, FCAR_CONNECTION_ATTEMPT_FAILED);
-			break;
-		case ID_REMOTE_SYSTEM_REQUIRES_PUBLIC_KEY:
-			pluginList[i]->OnFailedConnectionAttempt(packet, FCAR_REMOTE_SYSTEM_REQUIRES_PUBLIC_KEY);
-			break;
-		case ID_OUR_SYSTEM_REQUIRES_SECURITY:
-			pluginList[i]->OnFailedConnectionAttempt(packet, FCAR_OUR_SYSTEM_REQUIRES_SECURITY);
-			break;
-		case ID_PUBLIC_KEY_MISMATCH:
-			pluginList[i]->OnFailedConnectionAttempt(packet, FCAR_PUBLIC_KEY_MISMATCH);
-			break;
-		case ID_ALREADY_CONNECTED:
-			pluginList[i]->OnFailedConnectionAttempt(packet, FCAR_ALREADY_CONNECTED);
-			break;
-		case ID_NO_FREE_INCOMING_CONNECTIONS:
-			pluginList[i]->OnFailedConnectionAttempt(packet, FCAR_NO_FREE_INCOMING_CONNECTIONS);
-			break;
-		case ID_CONNECTION_BANNED:
-			pluginList[i]->OnFailedConnectionAttempt(packet, FCAR_CONNECTION_BANNED);
-			break;
-		case ID_INVALID_PASSWORD:
-			pluginList[i]->OnFailedConnectionAttempt(packet, FCAR_INVALID_PASSWORD);
-			break;
-		case ID_INCOMPATIBLE_PROTOCOL_VERSION:
-			pluginList[i]->OnFailedConnectionAttempt(packet, FCAR_INCOMPATIBLE_PROTOCOL);
-			break;
-		case ID_IP_RECENTLY_CONNECTED:
-			pluginList[i]->OnFailedConnectionAttempt(packet, FCAR_IP_RECENTLY_CONNECTED);
-			break;
+		return;
+	case ID_CONNECTION_ATTEMPT_FAILED:
+		failedConnectionAttemptReason=FCAR_CONNECTION_ATTEMPT_FAILED;
+		break;
+	case ID_REMOTE_SYSTEM_REQUIRES_PUBLIC_KEY:
+		failedConnectionAttemptReason=FCAR_REMOTE_SYSTEM_REQUIRES_PUBLIC_KEY;
+		break;
+	case ID_OUR_SYSTEM_REQUIRES_SECURITY:
+		failedConnectionAttemptReason=FCAR_OUR_SYSTEM_REQUIRES_SECURITY;
+		break;
+	case ID_PUBLIC_KEY_MISMATCH:
+		failedConnectionAttemptReason=FCAR_PUBLIC_KEY_MISMATCH;
+		break;
+	case ID_ALREADY_CONNECTED:
+		failedConnectionAttemptReason=FCAR_ALREADY_CONNECTED;
+		break;
+	case ID_NO_FREE_INCOMING_CONNECTIONS:
+		failedConnectionAttemptReason=FCAR_NO_FREE_INCOMING_CONNECTIONS;
+		break;
+	case ID_CONNECTION_BANNED:
+		failedConnectionAttemptReason=FCAR_CONNECTION_BANNED;
+		break;
+	case ID_INVALID_PASSWORD:
+		failedConnectionAttemptReason=FCAR_INVALID_PASSWORD;
+		break;
+	case ID_INCOMPATIBLE_PROTOCOL_VERSION:
+		failedConnectionAttemptReason=FCAR_INCOMPATIBLE_PROTOCOL;
+		break;
+	case ID_IP_RECENTLY_CONNECTED:
+		failedConnectionAttemptReason=FCAR_IP_RECENTLY_CONNECTED;
+		break;
+	default:
+		return;
+	}
+
+	for (i=0; i < pluginList.Size(); i++)
+		pluginList[i]->OnFailedConnectionAttempt(packet, failedConnectionAttemptReason);
+}
+
+void RakPeer::UpdatePluginsByMessageID(void)
+{
+	unsigned int i, messageId;
+	pluginsByMessageID.Clear(true, _FILE_AND_LINE_);
+	for (messageId=0; messageId < 256; messageId++)
+	{
+		pluginsByMessageIDStart[messageId]=pluginsByMessageID.Size();
+		for (i=0; i < pluginListTS.Size(); i++)
+		{
+			if (pluginListTS[i]->ReceivesMessageID((MessageID) messageId))
+				pluginsByMessageID.Insert(pluginListTS[i], _FILE_AND_LINE_);
+		}
+		for (i=0; i < pluginListNTS.Size(); i++)
+		{
+			if (pluginListNTS[i]->ReceivesMessageID((MessageID) messageId))
+				pluginsByMessageID.Insert(pluginListNTS[i], _FILE_AND_LINE_);
 		}
 	}
+	pluginsByMessageIDStart[256]=pluginsByMessageID.Size();
+	for (i=0; i < pluginListTS.Size(); i++)
+		pluginsByMessageID.Insert(pluginListTS[i], _FILE_AND_LINE_);
+	for (i=0; i < pluginListNTS.Size(); i++)
+		pluginsByMessageID.Insert(pluginListNTS[i], _FILE_AND_LINE_);
+	pluginsByMessageIDStart[257]=pluginsByMessageID.Size();
 }
 
 void RakPeer::FillIPList(void)
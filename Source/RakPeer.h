@@ -20,6 +20,7 @@
 #define __RAK_PEER_H
 
 #include "ReliabilityLayer.h"
+#include "RakNetMetrics.h"
 #include "RakPeerInterface.h"
 #include "BitStream.h"
 #include "SingleProducerConsumer.h"
@@ -36,17 +37,14 @@
 #include "SecureHandshake.h"
 #include "LocklessTypes.h"
 #include "DS_Queue.h"
+#include "DS_FlatHashIndex.h"
+#include "BanList.h"
 
 namespace RakNet {
 /// Forward declarations
 class HuffmanEncodingTree;
 class PluginInterface2;
 
-// Sucks but this struct has to be outside the class.  Inside and DevCPP won't let you refer to the struct as RakPeer::RemoteSystemIndex while GCC
-// forces you to do RakPeer::RemoteSystemIndex
-struct RemoteSystemIndex{unsigned index; RemoteSystemIndex *next;};
-//int RAK_DLL_EXPORT SystemAddressAndIndexComp( const SystemAddress &key, const RemoteSystemIndex &data ); // GCC requires RakPeer::RemoteSystemIndex or it won't compile
-
 ///\brief Main interface for network communications.
 /// \details It implements most of RakNet's functionality and is the primary interface for RakNet.
 ///
@@ -600,6 +598,12 @@ public:
 	/// \param[in] maxBitsPerSecond Maximum bits per second to send.  Use 0 for unlimited (default). Once set, it takes effect immedately and persists until called again.
 	virtual void SetPerConnectionOutgoingBandwidthLimit( unsigned maxBitsPerSecond );
 
+	/// Limits how many bytes per second of messages can be sent on one ordering channel, per connection.
+	/// Messages on other channels are not held up by a channel over its limit, even at the same priority. For example, a large download on its own channel can be kept from crowding out game traffic.
+	/// \param[in] orderingChannel The ordering channel passed to Send(), from 0 to 31. Applies to every reliability type sent with that channel.
+	/// \param[in] maxBytesPerSecond Maximum bytes per second of message data, not counting headers and resends. Use 0 for unlimited (default). Once set, it takes effect immedately and persists until called again.
+	virtual void SetPerChannelOutgoingByteQuota( unsigned char orderingChannel, unsigned maxBytesPerSecond );
+
 	/// Returns if you previously called ApplyNetworkSimulator
 	/// \return If you previously called ApplyNetworkSimulator
 	virtual bool IsNetworkSimulatorActive( void );
@@ -623,6 +627,11 @@ public:
 	/// \param[out] statistics Calculated RakNetStatistics for each connected system
 	virtual void GetStatisticsList(DataStructures::List<SystemAddress> &addresses, DataStructures::List<RakNetGUID> &guids, DataStructures::List<RakNetStatistics> &statistics);
 
+	/// \brief Copies counters, gauges and histograms kept over all connections since this instance was created
+	/// \details Takes no locks and does not touch the connections, so it is cheap to call often, from any thread
+	/// \sa RakNetMetrics.h
+	virtual void GetMetrics( RakNetMetricsSnapshot *snapshot );
+
 	/// \Returns how many messages are waiting when you call Receive()
 	virtual unsigned int GetReceiveBufferSize(void);
 
@@ -720,7 +729,7 @@ protected:
 	RemoteSystemStruct *GetRemoteSystemFromSystemAddress( const SystemAddress systemAddress, bool calledFromNetworkThread, bool onlyActive ) const;
 	RakPeer::RemoteSystemStruct *GetRemoteSystem( const AddressOrGUID systemIdentifier, bool calledFromNetworkThread, bool onlyActive ) const;
 	void ValidateRemoteSystemLookup(void) const;
-	RemoteSystemStruct *GetRemoteSystemFromGUID( const RakNetGUID guid, bool onlyActive ) const;
+	RemoteSystemStruct *GetRemoteSystemFromGUID( const RakNetGUID guid, bool calledFromNetworkThread, bool onlyActive ) const;
 	///Parse out a connection request packet
 	void ParseConnectionRequestPacket( RakPeer::RemoteSystemStruct *remoteSystem, const SystemAddress &systemAddress, const char *data, int byteSize);
 	void OnConnectionRequest( RakPeer::RemoteSystemStruct *remoteSystem, RakNet::Time incomingTimestamp );
@@ -782,15 +791,18 @@ protected:
 	RemoteSystemStruct** activeSystemList;
 	unsigned int activeSystemListSize;
 
-	// Use a hash, with binaryAddress plus port mod length as the index
-	RemoteSystemIndex **remoteSystemLookup;
-	unsigned int RemoteSystemLookupHashIndex(const SystemAddress &sa) const;
+	// Index into remoteSystemList for each systemAddress in use. Only written by the network thread.
+	DataStructures::FlatHashIndex<SystemAddress, SystemAddress::ToInteger> remoteSystemLookup;
+	// Index into remoteSystemList for each active system, by guid. Only written by the network thread.
+	DataStructures::FlatHashIndex<RakNetGUID, RakNetGUID::ToUint32> remoteSystemGuidLookup;
 	void ReferenceRemoteSystem(const SystemAddress &sa, unsigned int remoteSystemListIndex);
 	void DereferenceRemoteSystem(const SystemAddress &sa);
 	RemoteSystemStruct* GetRemoteSystem(const SystemAddress &sa) const;
 	unsigned int GetRemoteSystemIndex(const SystemAddress &sa) const;
 	void ClearRemoteSystemLookup(void);
-	DataStructures::MemoryPool<RemoteSystemIndex> remoteSystemIndexPool;
+	void RemoveFromGuidLookup(unsigned int remoteSystemListIndex);
+	// How many times a system was left out of remoteSystemGuidLookup because another system had the same guid
+	unsigned int guidLookupCollisions;
 
 	void AddToActiveSystemList(unsigned int remoteSystemListIndex);
 	void RemoveFromActiveSystemList(const SystemAddress &sa);
@@ -819,16 +831,10 @@ protected:
 	// bool isSocketLayerBlocking;
 	// bool continualPing,isRecvfromThreadActive,isMainLoopThreadActive, endThreads, isSocketLayerBlocking;
 	unsigned int validationInteger;
-	SimpleMutex incomingQueueMutex, banListMutex; //,synchronizedMemoryQueueMutex, automaticVariableSynchronizationMutex;
+	SimpleMutex incomingQueueMutex; //,synchronizedMemoryQueueMutex, automaticVariableSynchronizationMutex;
 	//DataStructures::Queue<Packet *> incomingpacketSingleProducerConsumer; //, synchronizedMemorypacketSingleProducerConsumer;
 	// BitStream enumerationData;
 
-	struct BanStruct
-	{
-		char *IP;
-		RakNet::TimeMS timeout; // 0 for none
-	};
-
 	struct RequestedConnectionStruct
 	{
 		SystemAddress systemAddress;
@@ -860,9 +866,14 @@ protected:
 #endif
 
 	//DataStructures::List<DataStructures::List<MemoryBlock>* > automaticVariableSynchronizationList;
-	DataStructures::List<BanStruct*> banList;
+	BanList banList;
 	// Threadsafe, and not thread safe
 	DataStructures::List<PluginInterface2*> pluginListTS, pluginListNTS;
+	// Plugins to call OnReceive() for, by the first byte of the message, in the same order as pluginListTS followed by pluginListNTS.
+	// Plugins for MessageID i go from pluginsByMessageIDStart[i] up to pluginsByMessageIDStart[i+1]. Slot 256 holds all plugins, for messages that start with ID_TIMESTAMP.
+	DataStructures::List<PluginInterface2*> pluginsByMessageID;
+	unsigned int pluginsByMessageIDStart[258];
+	void UpdatePluginsByMessageID(void);
 
 	DataStructures::Queue<RequestedConnectionStruct*> requestedConnectionQueue;
 	DataStructures::Queue<SystemAddress> requestedConnectionCancelQueue;
@@ -961,6 +972,7 @@ protected:
 	RakNetGUID myGuid;
 
 	unsigned maxOutgoingBPS;
+	unsigned channelOutgoingByteQuotas[NUMBER_OF_ORDERED_STREAMS];
 
 	// Nobody would use the internet simulator in a final build.
 #ifdef _DEBUG
@@ -998,6 +1010,7 @@ protected:
 
 	SimpleMutex packetReturnMutex;
 	DataStructures::Queue<Packet*> packetReturnQueue;
+	RakNetMetrics metrics;
 	Packet *AllocPacket(unsigned dataSize, const char *file, unsigned int line);
 	Packet *AllocPacket(unsigned dataSize, unsigned char *data, const char *file, unsigned int line);
 
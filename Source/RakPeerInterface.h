@@ -32,6 +32,7 @@ class BitStream;
 class PluginInterface2;
 struct RPCMap;
 struct RakNetStatistics;
+struct RakNetMetricsSnapshot;
 struct RakNetBandwidth;
 class RouterInterface;
 class NetworkIDManager;
@@ -295,7 +296,7 @@ public:
 	virtual void GetSystemList(DataStructures::List<SystemAddress> &addresses, DataStructures::List<RakNetGUID> &guids) const=0;
 
 	/// Bans an IP from connecting.  Banned IPs persist between connections but are not saved on shutdown nor loaded on startup.
-	/// param[in] IP Dotted IP address. Can use * as a wildcard, such as 128.0.0.* will ban all IP addresses starting with 128.0.0
+	/// param[in] IP Dotted IP address. Can use * as a wildcard, such as 128.0.0.* will ban all IP addresses starting with 128.0.0, or CIDR notation, such as 128.0.0.0/24
 	/// \param[in] milliseconds how many ms for a temporary ban.  Use 0 for a permanent ban
 	virtual void AddToBanList( const char *IP, RakNet::TimeMS milliseconds=0 )=0;
 
@@ -564,6 +565,12 @@ public:
 	/// \param[in] maxBitsPerSecond Maximum bits per second to send.  Use 0 for unlimited (default). Once set, it takes effect immedately and persists until called again.
 	virtual void SetPerConnectionOutgoingBandwidthLimit( unsigned maxBitsPerSecond )=0;
 
+	/// Limits how many bytes per second of messages can be sent on one ordering channel, per connection.
+	/// Messages on other channels are not held up by a channel over its limit, even at the same priority. For example, a large download on its own channel can be kept from crowding out game traffic.
+	/// \param[in] orderingChannel The ordering channel passed to Send(), from 0 to 31. Applies to every reliability type sent with that channel.
+	/// \param[in] maxBytesPerSecond Maximum bytes per second of message data, not counting headers and resends. Use 0 for unlimited (default). Once set, it takes effect immedately and persists until called again.
+	virtual void SetPerChannelOutgoingByteQuota( unsigned char orderingChannel, unsigned maxBytesPerSecond )=0;
+
 	/// Returns if you previously called ApplyNetworkSimulator
 	/// \return If you previously called ApplyNetworkSimulator
 	virtual bool IsNetworkSimulatorActive( void )=0;
@@ -587,6 +594,11 @@ public:
 	/// \param[out] statistics Calculated RakNetStatistics for each connected system
 	virtual void GetStatisticsList(DataStructures::List<SystemAddress> &addresses, DataStructures::List<RakNetGUID> &guids, DataStructures::List<RakNetStatistics> &statistics)=0;
 
+	/// \brief Copies counters, gauges and histograms kept over all connections since this instance was created
+	/// \details Takes no locks and does not touch the connections, so it is cheap to call often, from any thread
+	/// \sa RakNetMetrics.h
+	virtual void GetMetrics( RakNetMetricsSnapshot *snapshot )=0;
+
 	/// \Returns how many messages are waiting when you call Receive()
 	virtual unsigned int GetReceiveBufferSize(void)=0;
 
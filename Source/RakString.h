@@ -15,6 +15,7 @@
 #include "Export.h"
 #include "DS_List.h"
 #include "RakNetTypes.h" // int64_t
+#include "LocklessTypes.h"
 #include "stdarg.h"
 
 
@@ -25,6 +26,11 @@
 #include "WindowsIncludes.h"
 #endif
 
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1600)
+/// Compiler supports rvalue references, so RakString gets a move constructor and move assignment
+#define RAKSTRING_HAS_MOVE 1
+#endif
+
 namespace RakNet
 {
 /// Forward declarations
@@ -34,6 +40,7 @@ class BitStream;
 /// \brief String class
 /// \details Has the following improvements over std::string
 /// -Reference counting: Suitable to store in lists
+/// -Short strings are stored in the object itself, without allocating
 /// -Variadic assignment operator
 /// -Doesn't cause linker errors
 class RAK_DLL_EXPORT RakString
@@ -47,16 +54,20 @@ public:
 	RakString(const char *format, ...);
 	~RakString();
 	RakString( const RakString & rhs);
+#ifdef RAKSTRING_HAS_MOVE
+	/// Takes the contents of \a rhs without copying or touching the reference count. \a rhs is left empty
+	RakString( RakString && rhs );
+#endif
 
 	/// Implicit return of const char*
-	operator const char* () const {return sharedString->c_str;}
+	operator const char* () const {return GetBuffer();}
 
 	/// Same as std::string::c_str
-	const char *C_String(void) const {return sharedString->c_str;}
+	const char *C_String(void) const {return GetBuffer();}
 
 	// Lets you modify the string. Do not make the string longer - however, you can make it shorter, or change the contents.
 	// Pointer is only valid in the scope of RakString itself
-	char *C_StringUnsafe(void) {Clone(); return sharedString->c_str;}
+	char *C_StringUnsafe(void) {Clone(); return GetBuffer();}
 
 	/// Assigment operators
 	RakString& operator = ( const RakString& rhs );
@@ -65,6 +76,9 @@ public:
 	RakString& operator = ( const unsigned char *str );
 	RakString& operator = ( char unsigned *str );
 	RakString& operator = ( const char c );
+#ifdef RAKSTRING_HAS_MOVE
+	RakString& operator = ( RakString&& rhs );
+#endif
 
 	/// Concatenation
 	RakString& operator +=( const RakString& rhs);
@@ -246,8 +260,8 @@ public:
 	/// Fix to be a file path, ending with /
 	RakNet::RakString& MakeFilePath(void);
 
-	/// RakString uses a freeList of old no-longer used strings
-	/// Call this function to clear this memory on shutdown
+	/// RakString used to keep a freeList of old no-longer used strings, which this function cleared
+	/// Strings are now freed as soon as they are no longer used, so this does nothing
 	static void FreeMemory(void);
 	/// \internal
 	static void FreeMemoryNoMutex(void);
@@ -290,49 +304,39 @@ public:
 	static const char *ToString(int64_t i);
 	static const char *ToString(uint64_t i);
 
+	/// \internal
+	/// Strings this long or shorter, counting the terminator, are stored in inlineString
+	enum {INLINE_STRING_BYTES=24};
+
 	/// \internal
 	static size_t GetSizeToAllocate(size_t bytes)
 	{
-		const size_t smallStringSize = 128-sizeof(unsigned int)-sizeof(size_t)-sizeof(char*)*2;
-		if (bytes<=smallStringSize)
-			return smallStringSize;
+		if (bytes<=INLINE_STRING_BYTES)
+			return INLINE_STRING_BYTES;
 		else
 			return bytes*2;
 	}
 
 	/// \internal
+	/// Header for strings too long for inlineString. The characters follow it in the same allocation.
+	/// Copies of the RakString share it until one of them is changed
 	struct SharedString
 	{
-		SimpleMutex *refCountMutex;
-		unsigned int refCount;
+		SharedString() : refCount(1) {}
+		LocklessUint32_t refCount;
+		/// Bytes available for characters after the header
 		size_t bytesUsed;
-		char *bigString;
-		char *c_str;
-		char smallString[128-sizeof(unsigned int)-sizeof(size_t)-sizeof(char*)*2];		
 	};
 
 	/// \internal
-	RakString( SharedString *_sharedString );
-
-	/// \internal
+	/// 0 when the string is stored in inlineString
 	SharedString *sharedString;
 
-//	static SimpleMutex poolMutex;
-//	static DataStructures::MemoryPool<SharedString> pool;
 	/// \internal
-	static SharedString emptyString;
-
-	//static SharedString *sharedStringFreeList;
-	//static unsigned int sharedStringFreeListAllocationCount;
-	/// \internal
-	/// List of free objects to reduce memory reallocations
-	static DataStructures::List<SharedString*> freeList;
+	char inlineString[INLINE_STRING_BYTES];
 
 	static int RakStringComp( RakString const &key, RakString const &data );
 
-	static void LockMutex(void);
-	static void UnlockMutex(void);
-
 protected:
 	static RakNet::RakString FormatForPUTOrPost(const char* type, const char* uri, const char* contentType, const char* body, const char* extraHeaders);
 	void Allocate(size_t len);
@@ -343,7 +347,9 @@ protected:
 	void Free(void);
 	unsigned char ToLower(unsigned char c);
 	unsigned char ToUpper(unsigned char c);
-	void Realloc(SharedString *sharedString, size_t bytes);
+	/// Makes sure no other RakString shares this one's characters, and that there is room for \a bytes bytes
+	void Realloc(size_t bytes);
+	char *GetBuffer(void) const {return sharedString ? (char*) (sharedString+1) : (char*) inlineString;}
 };
 
 }
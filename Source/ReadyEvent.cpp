@@ -48,6 +48,8 @@ STATIC_FACTORY_DEFINITIONS(ReadyEvent,ReadyEvent);
 ReadyEvent::ReadyEvent()
 {
 	channel=0;
+	AddReceiveMessageIDRange(ID_READY_EVENT_SET, ID_READY_EVENT_QUERY);
+	AddReceiveMessageID(ID_READY_EVENT_FORCE_ALL_SET);
 }
 
 ReadyEvent::~ReadyEvent()
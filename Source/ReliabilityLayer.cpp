@@ -20,9 +20,6 @@
 #include "RakAssert.h"
 #include "Rand.h"
 #include "MessageIdentifiers.h"
-#ifdef USE_THREADED_SEND
-#include "SendToThread.h"
-#endif
 #include <math.h>
 
 using namespace RakNet;
@@ -107,6 +104,191 @@ void BPSTracker::ClearExpired1(RakNet::TimeUS time)
 	}
 }
 
+OutgoingPacketScheduler::OutgoingPacketScheduler()
+{
+	heldChannels=0;
+	peekedQueue=0;
+	numPackets=0;
+	InitWeights();
+	for (int i=0; i < NUMBER_OF_ORDERED_STREAMS; i++)
+	{
+		quotas[i]=0;
+		quotaCredit[i]=0;
+	}
+}
+OutgoingPacketScheduler::~OutgoingPacketScheduler()
+{
+}
+void OutgoingPacketScheduler::Push(InternalPacket *internalPacket, const char *file, unsigned int line)
+{
+	RakAssert(internalPacket->orderingChannel < NUMBER_OF_ORDERED_STREAMS);
+	WeightedPacket weightedPacket;
+	weightedPacket.weight=GetNextWeight(internalPacket->priority);
+	weightedPacket.internalPacket=internalPacket;
+	priorityQueues[internalPacket->priority].Push(weightedPacket, file, line);
+	numPackets++;
+	// The new message may have a lower weight than the one Peek() chose
+	peekedQueue=0;
+}
+InternalPacket *OutgoingPacketScheduler::Peek(void)
+{
+	if (peekedQueue)
+		return peekedQueue->Peek().internalPacket;
+
+	for (;;)
+	{
+		DataStructures::Queue<WeightedPacket> *queue=GetLowestWeightQueue(true);
+		if (queue==0)
+			return 0;
+		InternalPacket *internalPacket=queue->Peek().internalPacket;
+		bool isHeld = queue >= heldQueues && queue < heldQueues+NUMBER_OF_ORDERED_STREAMS;
+		if (isHeld==false && IsOverQuota(internalPacket->orderingChannel))
+		{
+			// Move it aside so the rest of this priority can go. Each message is moved at most once.
+			heldQueues[internalPacket->orderingChannel].Push(queue->Pop(), _FILE_AND_LINE_);
+			heldChannels|=1u << internalPacket->orderingChannel;
+			continue;
+		}
+		peekedQueue=queue;
+		return internalPacket;
+	}
+}
+InternalPacket *OutgoingPacketScheduler::Pop(void)
+{
+	if (Peek()==0)
+		return 0;
+	InternalPacket *internalPacket=peekedQueue->Pop().internalPacket;
+	if (peekedQueue->IsEmpty() && peekedQueue >= heldQueues && peekedQueue < heldQueues+NUMBER_OF_ORDERED_STREAMS)
+		heldChannels&=~(1u << (unsigned int) (peekedQueue-heldQueues));
+	peekedQueue=0;
+	numPackets--;
+	if (quotas[internalPacket->orderingChannel]!=0)
+		quotaCredit[internalPacket->orderingChannel]-=(int64_t) BITS_TO_BYTES(internalPacket->dataBitLength)*1000000;
+	return internalPacket;
+}
+InternalPacket *OutgoingPacketScheduler::RemoveAny(void)
+{
+	int i;
+	peekedQueue=0;
+	for (i=0; i < NUMBER_OF_PRIORITIES; i++)
+	{
+		if (priorityQueues[i].IsEmpty()==false)
+		{
+			numPackets--;
+			return priorityQueues[i].Pop().internalPacket;
+		}
+	}
+	for (i=0; i < NUMBER_OF_ORDERED_STREAMS; i++)
+	{
+		if (heldQueues[i].IsEmpty()==false)
+		{
+			numPackets--;
+			InternalPacket *internalPacket=heldQueues[i].Pop().internalPacket;
+			if (heldQueues[i].IsEmpty())
+				heldChannels&=~(1u << i);
+			return internalPacket;
+		}
+	}
+	return 0;
+}
+void OutgoingPacketScheduler::Clear(const char *file, unsigned int line)
+{
+	int i;
+	for (i=0; i < NUMBER_OF_PRIORITIES; i++)
+		priorityQueues[i].Clear(file, line);
+	for (i=0; i < NUMBER_OF_ORDERED_STREAMS; i++)
+	{
+		heldQueues[i].Clear(file, line);
+		quotaCredit[i]=0;
+	}
+	heldChannels=0;
+	peekedQueue=0;
+	numPackets=0;
+	InitWeights();
+}
+void OutgoingPacketScheduler::SetChannelQuota(unsigned char orderingChannel, unsigned int bytesPerSecond)
+{
+	RakAssert(orderingChannel < NUMBER_OF_ORDERED_STREAMS);
+	quotas[orderingChannel]=bytesPerSecond;
+}
+unsigned int OutgoingPacketScheduler::GetChannelQuota(unsigned char orderingChannel) const
+{
+	RakAssert(orderingChannel < NUMBER_OF_ORDERED_STREAMS);
+	return quotas[orderingChannel];
+}
+void OutgoingPacketScheduler::UpdateQuotas(CCTimeType elapsed)
+{
+#if CC_TIME_TYPE_BYTES==4
+	int64_t elapsedUS = (int64_t) elapsed * 1000;
+#else
+	int64_t elapsedUS = (int64_t) elapsed;
+#endif
+	for (int i=0; i < NUMBER_OF_ORDERED_STREAMS; i++)
+	{
+		if (quotas[i]==0)
+			continue;
+		quotaCredit[i]+=(int64_t) quotas[i]*elapsedUS;
+		// Unused quota carries over for at most a tenth of a second, so an idle channel cannot burst
+		int64_t maxCredit=(int64_t) quotas[i]*100000;
+		if (quotaCredit[i] > maxCredit)
+			quotaCredit[i]=maxCredit;
+	}
+	// A held message may be allowed now
+	if (heldChannels)
+		peekedQueue=0;
+}
+void OutgoingPacketScheduler::InitWeights(void)
+{
+	for (int priorityLevel=0; priorityLevel < NUMBER_OF_PRIORITIES; priorityLevel++)
+		nextWeights[priorityLevel]=(1<<priorityLevel)*priorityLevel+priorityLevel;
+}
+reliabilityHeapWeightType OutgoingPacketScheduler::GetNextWeight(int priorityLevel)
+{
+	uint64_t next = nextWeights[priorityLevel];
+	DataStructures::Queue<WeightedPacket> *lowest=GetLowestWeightQueue(false);
+	if (lowest)
+	{
+		// Do not let a priority that had nothing to send build up credit over the others
+		int peekPL = lowest->Peek().internalPacket->priority;
+		reliabilityHeapWeightType weight = lowest->Peek().weight;
+		reliabilityHeapWeightType min = weight - (1<<peekPL)*peekPL+peekPL;
+		if (next<min)
+			next=min + (1<<priorityLevel)*priorityLevel+priorityLevel;
+		nextWeights[priorityLevel]=next+(1<<priorityLevel)*(priorityLevel+1)+priorityLevel;
+	}
+	else
+	{
+		InitWeights();
+	}
+	return next;
+}
+DataStructures::Queue<OutgoingPacketScheduler::WeightedPacket> *OutgoingPacketScheduler::GetLowestWeightQueue(bool onlyWithinQuota)
+{
+	DataStructures::Queue<WeightedPacket> *lowest=0;
+	reliabilityHeapWeightType lowestWeight=0;
+	uint32_t channels=heldChannels;
+	for (unsigned int orderingChannel=0; channels!=0; orderingChannel++, channels>>=1)
+	{
+		if ((channels&1)==0 || (onlyWithinQuota && IsOverQuota((unsigned char) orderingChannel)))
+			continue;
+		if (lowest==0 || heldQueues[orderingChannel].Peek().weight < lowestWeight)
+		{
+			lowest=&heldQueues[orderingChannel];
+			lowestWeight=lowest->Peek().weight;
+		}
+	}
+	// Ties go to the lower priority. The heap mostly did the same, and lower priorities get a slightly smaller share otherwise.
+	for (int priorityLevel=0; priorityLevel < NUMBER_OF_PRIORITIES; priorityLevel++)
+	{
+		if (priorityQueues[priorityLevel].IsEmpty()==false && (lowest==0 || priorityQueues[priorityLevel].Peek().weight <= lowestWeight))
+		{
+			lowest=&priorityQueues[priorityLevel];
+			lowestWeight=lowest->Peek().weight;
+		}
+	}
+	return lowest;
+}
+
 struct DatagramHeaderFormat
 {
 #if INCLUDE_TIMESTAMP_WITH_DATAGRAMS==1
@@ -327,6 +509,7 @@ ReliabilityLayer::ReliabilityLayer()
 	}
 #endif
 
+	metrics=0;
 	InitializeVariables();
 //int i = sizeof(InternalPacket);
 	datagramHistoryMessagePool.SetPageSize(sizeof(MessageNumberNode)*128);
@@ -445,7 +628,6 @@ void ReliabilityLayer::InitializeVariables( void )
 
 	datagramHistoryPopCount=0;
 
-	InitHeapWeights();
 	for (int i=0; i < NUMBER_OF_PRIORITIES; i++)
 	{
 		statistics.messageInSendBuffer[i]=0;
@@ -572,14 +754,15 @@ void ReliabilityLayer::FreeThreadSafeMemory( void )
 
 	//	acknowlegements.Clear(_FILE_AND_LINE_);
 
-	for ( j=0 ; j < outgoingPacketBuffer.Size(); j++ )
+	while ( outgoingPacketBuffer.Size() )
 	{
-		if ( outgoingPacketBuffer[ j ]->data)
-			FreeInternalPacketData( outgoingPacketBuffer[ j ], _FILE_AND_LINE_ );
-		ReleaseToInternalPacketPool( outgoingPacketBuffer[ j ] );
+		InternalPacket *outgoingPacket = outgoingPacketBuffer.RemoveAny();
+		if ( outgoingPacket->data)
+			FreeInternalPacketData( outgoingPacket, _FILE_AND_LINE_ );
+		ReleaseToInternalPacketPool( outgoingPacket );
 	}
 
-	outgoingPacketBuffer.Clear(true, _FILE_AND_LINE_);
+	outgoingPacketBuffer.Clear(_FILE_AND_LINE_);
 
 #ifdef _DEBUG
 	for (unsigned i = 0; i < delayList.Size(); i++ )
@@ -653,6 +836,11 @@ bool ReliabilityLayer::HandleSocketReceiveFromConnectedPlayer(
 
 
 	bpsMetrics[(int) ACTUAL_BYTES_RECEIVED].Push1(timeRead,length);
+	if (metrics)
+	{
+		metrics->Add(METRICS_BYTES_RECEIVED, length);
+		metrics->Add(METRICS_DATAGRAMS_RECEIVED, 1);
+	}
 
 	(void) MTUSize;
 
@@ -1543,6 +1731,40 @@ BitSize_t ReliabilityLayer::Receive( unsigned char **data )
 // ordering channel is from 0 to 255 and specifies what stream to use
 //-------------------------------------------------------------------------------------------------------
 bool ReliabilityLayer::Send( char *data, BitSize_t numberOfBitsToSend, PacketPriority priority, PacketReliability reliability, unsigned char orderingChannel, bool makeDataCopy, int MTUSize, CCTimeType currentTime, uint32_t receipt )
+{
+	(void) MTUSize;
+
+	return QueueOutgoingMessage(data, 0, numberOfBitsToSend, priority, reliability, orderingChannel, makeDataCopy, currentTime, receipt);
+}
+//-------------------------------------------------------------------------------------------------------
+bool ReliabilityLayer::SendShared( InternalPacketRefCountedData *sharedData, BitSize_t numberOfBitsToSend, PacketPriority priority, PacketReliability reliability, unsigned char orderingChannel, int MTUSize, CCTimeType currentTime, uint32_t receipt )
+{
+	(void) MTUSize;
+
+	RakAssert(sharedData && sharedData->isShared);
+	return QueueOutgoingMessage(0, sharedData, numberOfBitsToSend, priority, reliability, orderingChannel, false, currentTime, receipt);
+}
+//-------------------------------------------------------------------------------------------------------
+InternalPacketRefCountedData *ReliabilityLayer::AllocateSharedData( unsigned char *data, const char *file, unsigned int line )
+{
+	InternalPacketRefCountedData *sharedData = RakNet::OP_NEW<InternalPacketRefCountedData>(file, line);
+	sharedData->sharedDataBlock=data;
+	sharedData->refCount=1;
+	sharedData->isShared=true;
+	return sharedData;
+}
+//-------------------------------------------------------------------------------------------------------
+void ReliabilityLayer::ReleaseSharedData( InternalPacketRefCountedData *sharedData, const char *file, unsigned int line )
+{
+	RakAssert(sharedData->isShared && sharedData->refCount>0);
+	if (--sharedData->refCount==0)
+	{
+		rakFree_Ex(sharedData->sharedDataBlock, file, line );
+		RakNet::OP_DELETE(sharedData, file, line);
+	}
+}
+//-------------------------------------------------------------------------------------------------------
+bool ReliabilityLayer::QueueOutgoingMessage( char *data, InternalPacketRefCountedData *sharedData, BitSize_t numberOfBitsToSend, PacketPriority priority, PacketReliability reliability, unsigned char orderingChannel, bool makeDataCopy, CCTimeType currentTime, uint32_t receipt )
 {
 #ifdef _DEBUG
 	RakAssert( !( reliability >= NUMBER_OF_RELIABILITIES || reliability < 0 ) );
@@ -1555,8 +1777,6 @@ bool ReliabilityLayer::Send( char *data, BitSize_t numberOfBitsToSend, PacketPri
 	currentTime/=1000;
 #endif
 
-	(void) MTUSize;
-
 	//	int a = BITS_TO_BYTES(numberOfBitsToSend);
 
 	// Fix any bad parameters
@@ -1582,10 +1802,17 @@ bool ReliabilityLayer::Send( char *data, BitSize_t numberOfBitsToSend, PacketPri
 	}
 
 	bpsMetrics[(int) USER_MESSAGE_BYTES_PUSHED].Push1(currentTime,numberOfBytesToSend);
+	if (metrics)
+		metrics->Add(METRICS_USER_MESSAGE_BYTES_PUSHED, numberOfBytesToSend);
 
 	internalPacket->creationTime = currentTime;
 
-	if ( makeDataCopy )
+	if ( sharedData )
+	{
+		// Points to the same data as the messages queued for other systems
+		AllocInternalPacketData(internalPacket, &sharedData, sharedData->sharedDataBlock, sharedData->sharedDataBlock);
+	}
+	else if ( makeDataCopy )
 	{
 		AllocInternalPacketData(internalPacket, numberOfBytesToSend, true, _FILE_AND_LINE_ );
 		//internalPacket->data = (unsigned char*) rakMalloc_Ex( numberOfBytesToSend, _FILE_AND_LINE_ );
@@ -1626,6 +1853,9 @@ bool ReliabilityLayer::Send( char *data, BitSize_t numberOfBitsToSend, PacketPri
 //			internalPacket->reliability=RELIABLE_SEQUENCED_WITH_ACK_RECEIPT;
 	}
 
+	// OutgoingPacketScheduler looks up channel quotas for every message, not only ordered and sequenced ones
+	internalPacket->orderingChannel = orderingChannel;
+
 	//	++sendMessageNumberIndex;
 
 	if ( internalPacket->reliability == RELIABLE_SEQUENCED ||
@@ -1679,8 +1909,7 @@ bool ReliabilityLayer::Send( char *data, BitSize_t numberOfBitsToSend, PacketPri
 
 	RakAssert(internalPacket->dataBitLength<BYTES_TO_BITS(MAXIMUM_MTU_SIZE));
 	RakAssert(internalPacket->messageNumberAssigned==false);
-	outgoingPacketBuffer.Push( GetNextWeight(internalPacket->priority), internalPacket, _FILE_AND_LINE_  );
-	RakAssert(outgoingPacketBuffer.Size()==0 || outgoingPacketBuffer.Peek()->dataBitLength<BYTES_TO_BITS(MAXIMUM_MTU_SIZE));
+	outgoingPacketBuffer.Push( internalPacket, _FILE_AND_LINE_  );
 	statistics.messageInSendBuffer[(int)internalPacket->priority]++;
 	statistics.bytesInSendBuffer[(int)internalPacket->priority]+=(double) BITS_TO_BYTES(internalPacket->dataBitLength);
 
@@ -1748,6 +1977,8 @@ void ReliabilityLayer::Update( RakNetSocket2 *s, SystemAddress &systemAddress, i
 		timeSinceLastTick=100000;
 #endif
 
+	outgoingPacketBuffer.UpdateQuotas(timeSinceLastTick);
+
 	if (unreliableTimeout>0)
 	{
 		if (timeSinceLastTick>=timeToNextUnreliableCull)
@@ -1932,6 +2163,8 @@ void ReliabilityLayer::Update( RakNetSocket2 *s, SystemAddress &systemAddress, i
 						CC_DEBUG_PRINTF_2("Rs %i ", internalPacket->reliableMessageNumber.val);
 
 						bpsMetrics[(int) USER_MESSAGE_BYTES_RESENT].Push1(time,BITS_TO_BYTES(internalPacket->dataBitLength));
+						if (metrics)
+							metrics->Add(METRICS_USER_MESSAGE_BYTES_RESENT, BITS_TO_BYTES(internalPacket->dataBitLength));
 
 						// Testing1
 // 						if (internalPacket->reliability==RELIABLE_ORDERED || internalPacket->reliability==RELIABLE_ORDERED_WITH_ACK_RECEIPT)
@@ -1979,7 +2212,9 @@ void ReliabilityLayer::Update( RakNetSocket2 *s, SystemAddress &systemAddress, i
 			statistics.isLimitedByCongestionControl=true;
 		}
 
-		if ((int)BITS_TO_BYTES(allDatagramSizesSoFar)<transmissionBandwidth)
+		// Resends go out regardless, but new data waits while the socket is behind, rather than growing its backlog
+		statistics.isLimitedBySendBacklog=s->IsSendSaturated();
+		if ((int)BITS_TO_BYTES(allDatagramSizesSoFar)<transmissionBandwidth && statistics.isLimitedBySendBacklog==false)
 		{
 			//	printf("S+ ");
 			allDatagramSizesSoFar=0;
@@ -2006,15 +2241,17 @@ void ReliabilityLayer::Update( RakNetSocket2 *s, SystemAddress &systemAddress, i
 					//while ( sendPacketSet[ i ].Size() )
 				{
 					internalPacket=outgoingPacketBuffer.Peek();
+					// Everything left is on channels over their quota
+					if (internalPacket==0)
+						break;
 					RakAssert(internalPacket->messageNumberAssigned==false);
-					RakAssert(outgoingPacketBuffer.Size()==0 || outgoingPacketBuffer.Peek()->dataBitLength<BYTES_TO_BITS(MAXIMUM_MTU_SIZE));
+					RakAssert(internalPacket->dataBitLength<BYTES_TO_BITS(MAXIMUM_MTU_SIZE));
 
 					// internalPacket = sendPacketSet[ i ].Peek();
 					if (internalPacket->data==0)
 					{
 						//sendPacketSet[ i ].Pop();
-						outgoingPacketBuffer.Pop(0);
-						RakAssert(outgoingPacketBuffer.Size()==0 || outgoingPacketBuffer.Peek()->dataBitLength<BYTES_TO_BITS(MAXIMUM_MTU_SIZE));
+						outgoingPacketBuffer.Pop();
 						statistics.messageInSendBuffer[(int)internalPacket->priority]--;
 						statistics.bytesInSendBuffer[(int)internalPacket->priority]-=(double) BITS_TO_BYTES(internalPacket->dataBitLength);
 						ReleaseToInternalPacketPool( internalPacket );
@@ -2044,8 +2281,7 @@ void ReliabilityLayer::Update( RakNetSocket2 *s, SystemAddress &systemAddress, i
 						isReliable = false;
 
 					//sendPacketSet[ i ].Pop();
-					outgoingPacketBuffer.Pop(0);
-					RakAssert(outgoingPacketBuffer.Size()==0 || outgoingPacketBuffer.Peek()->dataBitLength<BYTES_TO_BITS(MAXIMUM_MTU_SIZE));
+					outgoingPacketBuffer.Pop();
 					RakAssert(internalPacket->messageNumberAssigned==false);
 					statistics.messageInSendBuffer[(int)internalPacket->priority]--;
 					statistics.bytesInSendBuffer[(int)internalPacket->priority]-=(double) BITS_TO_BYTES(internalPacket->dataBitLength);
@@ -2107,6 +2343,8 @@ void ReliabilityLayer::Update( RakNetSocket2 *s, SystemAddress &systemAddress, i
 					// If isReliable is false, the packet and its contents will be added to a list to be freed in ClearPacketsAndDatagrams
 					// However, the internalPacket structure will remain allocated and be in the resendBuffer list if it requires a receipt
 					bpsMetrics[(int) USER_MESSAGE_BYTES_SENT].Push1(time,BITS_TO_BYTES(internalPacket->dataBitLength));
+					if (metrics)
+						metrics->Add(METRICS_USER_MESSAGE_BYTES_SENT, BITS_TO_BYTES(internalPacket->dataBitLength));
 
 					// Testing1
 // 					if (internalPacket->reliability==RELIABLE_ORDERED || internalPacket->reliability==RELIABLE_ORDERED_WITH_ACK_RECEIPT)
@@ -2323,27 +2561,22 @@ void ReliabilityLayer::SendBitStream( RakNetSocket2 *s, SystemAddress &systemAdd
 #endif
 
 	bpsMetrics[(int) ACTUAL_BYTES_SENT].Push1(currentTime,length);
+	if (metrics)
+	{
+		metrics->Add(METRICS_BYTES_SENT, length);
+		metrics->Add(METRICS_DATAGRAMS_SENT, 1);
+	}
 
 	RakAssert(length <= congestionManager.GetMTU());
 
-#ifdef USE_THREADED_SEND
-	SendToThread::SendToThreadBlock *block =  SendToThread::AllocateBlock();
-	memcpy(block->data, bitStream->GetData(), length);
-	block->dataWriteOffset=length;
-	block->extraSocketOptions=extraSocketOptions;
-	block->remotePortRakNetWasStartedOn_PS3=remotePortRakNetWasStartedOn_PS3;
-	block->s=s;
-	block->systemAddress=systemAddress;
-	SendToThread::ProcessBlock(block);
-#else
 	// SocketLayer::SendTo( s, ( char* ) bitStream->GetData(), length, systemAddress, __FILE__, __LINE__  );
 
+	// With USE_THREADED_SEND, this copies the datagram for the socket's send thread
 	RNS2_SendParameters bsp;
 	bsp.data = (char*) bitStream->GetData();
 	bsp.length = length;
 	bsp.systemAddress = systemAddress;
 	s->Send(&bsp, _FILE_AND_LINE_);
-#endif
 }
 
 //-------------------------------------------------------------------------------------------------------
@@ -2387,6 +2620,24 @@ void ReliabilityLayer::SetSplitMessageProgressInterval(int interval)
 	splitMessageProgressInterval=interval;
 }
 //-------------------------------------------------------------------------------------------------------
+void ReliabilityLayer::SetMetrics(RakNetMetrics *_metrics)
+{
+	metrics=_metrics;
+}
+//-------------------------------------------------------------------------------------------------------
+void ReliabilityLayer::AddQueueMetrics(uint64_t *bytesInSendBuffer, uint64_t *bytesInResendBuffer, uint64_t *congestionWindowBytes) const
+{
+	for (int i=0; i < NUMBER_OF_PRIORITIES; i++)
+		*bytesInSendBuffer+=(uint64_t) statistics.bytesInSendBuffer[i];
+	*bytesInResendBuffer+=statistics.bytesInResendBuffer;
+	*congestionWindowBytes+=congestionManager.GetCongestionWindowBytes();
+}
+//-------------------------------------------------------------------------------------------------------
+void ReliabilityLayer::SetChannelOutgoingByteQuota(unsigned char orderingChannel, unsigned int bytesPerSecond)
+{
+	outgoingPacketBuffer.SetChannelQuota(orderingChannel, bytesPerSecond);
+}
+//-------------------------------------------------------------------------------------------------------
 void ReliabilityLayer::SetUnreliableTimeout(RakNet::TimeMS timeoutMS)
 {
 #if CC_TIME_TYPE_BYTES==4
@@ -2977,7 +3228,8 @@ void ReliabilityLayer::SplitPacket( InternalPacket *internalPacket )
 	// This identifies which packet this is in the set
 	splitPacketIndex = 0;
 
-	InternalPacketRefCountedData *refCounter=0;
+	// If the message is already shared with other systems, the pieces reference that, rather than starting another reference count
+	InternalPacketRefCountedData *refCounter = internalPacket->allocationScheme==InternalPacket::REF_COUNTED ? internalPacket->refCountedData : 0;
 
 	// Do a loop to send out all the packets
 	do
@@ -3009,10 +3261,6 @@ void ReliabilityLayer::SplitPacket( InternalPacket *internalPacket )
 
 	//	InternalPacket *workingPacket;
 
-	// Tell the heap we are going to push a list of elements where each element in the list follows the heap order
-	RakAssert(outgoingPacketBuffer.Size()==0 || outgoingPacketBuffer.Peek()->dataBitLength<BYTES_TO_BITS(MAXIMUM_MTU_SIZE));
-	outgoingPacketBuffer.StartSeries();
-
 	// Copy all the new packets into the split packet list
 	for ( i = 0; i < ( int ) internalPacket->splitPacketCount; i++ )
 	{
@@ -3022,8 +3270,7 @@ void ReliabilityLayer::SplitPacket( InternalPacket *internalPacket )
 		//		sendPacketSet[ internalPacket->priority ].Push( internalPacketArray[ i ], _FILE_AND_LINE_  );
 		RakAssert(internalPacketArray[ i ]->dataBitLength<BYTES_TO_BITS(MAXIMUM_MTU_SIZE));
 		RakAssert(internalPacketArray[ i ]->messageNumberAssigned==false);
-		outgoingPacketBuffer.PushSeries(GetNextWeight(internalPacketArray[ i ]->priority), internalPacketArray[ i ], _FILE_AND_LINE_);
-		RakAssert(outgoingPacketBuffer.Size()==0 || outgoingPacketBuffer.Peek()->dataBitLength<BYTES_TO_BITS(MAXIMUM_MTU_SIZE));
+		outgoingPacketBuffer.Push(internalPacketArray[ i ], _FILE_AND_LINE_);
 		statistics.messageInSendBuffer[(int)internalPacketArray[ i ]->priority]++;
 		statistics.bytesInSendBuffer[(int)(int)internalPacketArray[ i ]->priority]+=(double) BITS_TO_BYTES(internalPacketArray[ i ]->dataBitLength);
 		//		workingPacket=sendPacketSet[internalPacket->priority].WriteLock();
@@ -3033,6 +3280,9 @@ void ReliabilityLayer::SplitPacket( InternalPacket *internalPacket )
 
 	// Do not delete, original is referenced by all split packets to avoid numerous allocations. See AllocInternalPacketData above
 	//	FreeInternalPacketData(internalPacket, _FILE_AND_LINE_ );
+	// Shared data was referenced by the original as well as the pieces, so release the original's reference
+	if (internalPacket->allocationScheme==InternalPacket::REF_COUNTED)
+		FreeInternalPacketData(internalPacket, _FILE_AND_LINE_ );
 	ReleaseToInternalPacketPool( internalPacket );
 
 	if (usedAlloca==false)
@@ -3424,6 +3674,7 @@ RakNetStatistics * ReliabilityLayer::GetStatistics( RakNetStatistics *rns )
 	rns->BPSLimitByCongestionControl=statistics.BPSLimitByCongestionControl;
 	rns->isLimitedByOutgoingBandwidthLimit=statistics.isLimitedByOutgoingBandwidthLimit;
 	rns->BPSLimitByOutgoingBandwidthLimit=statistics.BPSLimitByOutgoingBandwidthLimit;
+	rns->isLimitedBySendBacklog=statistics.isLimitedBySendBacklog;
 
 	return rns;
 }
@@ -3859,6 +4110,7 @@ void ReliabilityLayer::AllocInternalPacketData(InternalPacket *internalPacket, I
 		// *refCounter = RakNet::OP_NEW<InternalPacketRefCountedData>(_FILE_AND_LINE_);
 		(*refCounter)->refCount=1;
 		(*refCounter)->sharedDataBlock=externallyAllocatedPtr;
+		(*refCounter)->isShared=false;
 	}
 	else
 		(*refCounter)->refCount++;
@@ -3895,6 +4147,13 @@ void ReliabilityLayer::FreeInternalPacketData(InternalPacket *internalPacket, co
 		if (internalPacket->refCountedData==0)
 			return;
 
+		if (internalPacket->refCountedData->isShared)
+		{
+			ReleaseSharedData(internalPacket->refCountedData, file, line);
+			internalPacket->refCountedData=0;
+			return;
+		}
+
 		internalPacket->refCountedData->refCount--;
 		if (internalPacket->refCountedData->refCount==0)
 		{
@@ -3936,31 +4195,6 @@ BitSize_t ReliabilityLayer::GetMaxDatagramSizeExcludingMessageHeaderBits(void)
 {
 	return BYTES_TO_BITS(GetMaxDatagramSizeExcludingMessageHeaderBytes());
 }
-//-------------------------------------------------------------------------------------------------------
-void ReliabilityLayer::InitHeapWeights(void)
-{
-	for (int priorityLevel=0; priorityLevel < NUMBER_OF_PRIORITIES; priorityLevel++)
-		outgoingPacketBufferNextWeights[priorityLevel]=(1<<priorityLevel)*priorityLevel+priorityLevel;
-}
-//-------------------------------------------------------------------------------------------------------
-reliabilityHeapWeightType ReliabilityLayer::GetNextWeight(int priorityLevel)
-{
-	uint64_t next = outgoingPacketBufferNextWeights[priorityLevel];
-	if (outgoingPacketBuffer.Size()>0)
-	{
-		int peekPL = outgoingPacketBuffer.Peek()->priority;
-		reliabilityHeapWeightType weight = outgoingPacketBuffer.PeekWeight();
-		reliabilityHeapWeightType min = weight - (1<<peekPL)*peekPL+peekPL;
-		if (next<min)
-			next=min + (1<<priorityLevel)*priorityLevel+priorityLevel;
-		outgoingPacketBufferNextWeights[priorityLevel]=next+(1<<priorityLevel)*(priorityLevel+1)+priorityLevel;
-	}
-	else
-	{
-		InitHeapWeights();
-	}
-	return next;
-}
 
 //-------------------------------------------------------------------------------------------------------
 // #if defined(RELIABILITY_LAYER_NEW_UNDEF_ALLOCATING_QUEUE)
@@ -26,6 +26,7 @@
 #include "BitStream.h"
 #include "InternalPacket.h"
 #include "RakNetStatistics.h"
+#include "RakNetMetrics.h"
 #include "DR_SHA1.h"
 #include "DS_OrderedList.h"
 #include "DS_RangeList.h"
@@ -187,6 +188,76 @@ struct BPSTracker
 //	void ClearExpired2(RakNet::TimeUS time);
 };
 
+/// \internal
+/// \brief Picks which queued message to send next, in constant time
+/// \details Each priority has its own FIFO queue. A message gets a weight when pushed, and the queue whose first message has the lowest weight goes next.<BR>
+/// Weights grow faster for lower priorities, so when every priority has messages waiting, each gets a fixed share rather than the lower ones starving. The shares are the same as with the heap this replaced.<BR>
+/// Each ordering channel can optionally be limited to a number of bytes per second. A message on a channel over its quota is held aside, so other channels at the same priority are not blocked behind it.
+class OutgoingPacketScheduler
+{
+public:
+	OutgoingPacketScheduler();
+	~OutgoingPacketScheduler();
+
+	/// Queues a message to send
+	void Push(InternalPacket *internalPacket, const char *file, unsigned int line);
+
+	/// \return The message to send next, or 0 if every message waiting is on a channel over its quota
+	InternalPacket *Peek(void);
+
+	/// \brief Removes the message Peek() returns, and counts it against the quota of its channel
+	/// \return The message removed, or 0 if Peek() would have returned 0
+	InternalPacket *Pop(void);
+
+	/// Removes any message, ignoring priorities and quotas. Used when freeing everything.
+	InternalPacket *RemoveAny(void);
+
+	/// \return How many messages are waiting, including ones held by quotas
+	unsigned int Size(void) const {return numPackets;}
+
+	/// Removes all messages without freeing them. Quotas are kept.
+	void Clear(const char *file, unsigned int line);
+
+	/// \param[in] orderingChannel Which ordering channel to limit. Applies to all reliability types sent on that channel.
+	/// \param[in] bytesPerSecond Most bytes of messages per second, not counting headers and resends. 0 for no limit.
+	void SetChannelQuota(unsigned char orderingChannel, unsigned int bytesPerSecond);
+
+	/// \return What was passed to SetChannelQuota()
+	unsigned int GetChannelQuota(unsigned char orderingChannel) const;
+
+	/// Adds to the bytes each channel with a quota may send. Call once per update.
+	/// \param[in] elapsed Time since the last call
+	void UpdateQuotas(CCTimeType elapsed);
+
+protected:
+	struct WeightedPacket
+	{
+		reliabilityHeapWeightType weight;
+		InternalPacket *internalPacket;
+	};
+
+	void InitWeights(void);
+	reliabilityHeapWeightType GetNextWeight(int priorityLevel);
+	// Queue whose first message has the lowest weight. If onlyWithinQuota, held messages are skipped for channels still over quota.
+	DataStructures::Queue<WeightedPacket> *GetLowestWeightQueue(bool onlyWithinQuota);
+	bool IsOverQuota(unsigned char orderingChannel) const {return quotas[orderingChannel]!=0 && quotaCredit[orderingChannel]<=0;}
+
+	DataStructures::Queue<WeightedPacket> priorityQueues[NUMBER_OF_PRIORITIES];
+	// Messages taken from priorityQueues while their channel was over quota, by channel
+	DataStructures::Queue<WeightedPacket> heldQueues[NUMBER_OF_ORDERED_STREAMS];
+	// Bit n set if heldQueues[n] is not empty
+	uint32_t heldChannels;
+	// Weight for the next message pushed at each priority
+	reliabilityHeapWeightType nextWeights[NUMBER_OF_PRIORITIES];
+	// Queue Peek() chose, or 0 if a message was pushed or popped since
+	DataStructures::Queue<WeightedPacket> *peekedQueue;
+	unsigned int numPackets;
+
+	unsigned int quotas[NUMBER_OF_ORDERED_STREAMS];
+	// Bytes each channel may still send, times one million, so small quotas are not rounded away between updates
+	int64_t quotaCredit[NUMBER_OF_ORDERED_STREAMS];
+};
+
 /// Datagram reliable, ordered, unordered and sequenced sends.  Flow control.  Message splitting, reassembly, and coalescence.
 class ReliabilityLayer//<ReliabilityLayer>
 {
@@ -241,6 +312,20 @@ public:
 	/// \return True or false for success or failure.
 	bool Send( char *data, BitSize_t numberOfBitsToSend, PacketPriority priority, PacketReliability reliability, unsigned char orderingChannel, bool makeDataCopy, int MTUSize, CCTimeType currentTime, uint32_t receipt );
 
+	/// Same as Send(), but adds a reference to \a sharedData rather than copying the data, so one copy of a message can be queued for many systems
+	/// If the message has to be split, the pieces point into the shared data as well
+	/// \param[in] sharedData From AllocateSharedData()
+	bool SendShared( InternalPacketRefCountedData *sharedData, BitSize_t numberOfBitsToSend, PacketPriority priority, PacketReliability reliability, unsigned char orderingChannel, int MTUSize, CCTimeType currentTime, uint32_t receipt );
+
+	/// Wraps \a data so it can be passed to SendShared() for more than one system
+	/// The caller holds the first reference, and must release it with ReleaseSharedData(). \a data is freed with the last reference.
+	/// Reference counts are not locked, so every ReliabilityLayer sharing \a data must be used from the same thread.
+	/// \param[in] data Allocated with rakMalloc_Ex
+	static InternalPacketRefCountedData *AllocateSharedData( unsigned char *data, const char *file, unsigned int line );
+
+	/// Releases a reference to data from AllocateSharedData()
+	static void ReleaseSharedData( InternalPacketRefCountedData *sharedData, const char *file, unsigned int line );
+
 	/// Call once per game cycle.  Handles internal lists and actually does the send.
 	/// \param[in] s the communication  end point
 	/// \param[in] systemAddress The Unique Player Identifier who shouldhave sent some packets
@@ -276,6 +361,16 @@ public:
 	bool IsNetworkSimulatorActive( void );
 
 	void SetSplitMessageProgressInterval(int interval);
+
+	/// Bytes and datagrams sent and received are also added to \a _metrics, which is shared by every connection. 0 to stop. Kept through Reset()
+	void SetMetrics(RakNetMetrics *_metrics);
+
+	/// Adds the bytes queued on this connection and its congestion window to the totals passed in
+	void AddQueueMetrics(uint64_t *bytesInSendBuffer, uint64_t *bytesInResendBuffer, uint64_t *congestionWindowBytes) const;
+
+	/// Limits how many bytes per second of messages are sent on one ordering channel. 0 for no limit.
+	void SetChannelOutgoingByteQuota(unsigned char orderingChannel, unsigned int bytesPerSecond);
+
 	void SetUnreliableTimeout(RakNet::TimeMS timeoutMS);
 	/// Has a lot of time passed since the last ack
 	bool AckTimeout(RakNet::Time curTime);
@@ -344,6 +439,9 @@ private:
 	/// Split the passed packet into chunks under MTU_SIZE bytes (including headers) and save those new chunks
 	void SplitPacket( InternalPacket *internalPacket );
 
+	/// Send() and SendShared(). Takes a reference to \a sharedData if it is not 0, otherwise uses \a data as Send() does.
+	bool QueueOutgoingMessage( char *data, InternalPacketRefCountedData *sharedData, BitSize_t numberOfBitsToSend, PacketPriority priority, PacketReliability reliability, unsigned char orderingChannel, bool makeDataCopy, CCTimeType currentTime, uint32_t receipt );
+
 	/// Insert a packet into the split packet list
 	void InsertIntoSplitPacketList( InternalPacket * internalPacket, CCTimeType time );
 
@@ -472,10 +570,7 @@ private:
 //	CCTimeType lastPacketlossTime;
 
 	//DataStructures::Queue<InternalPacket*> sendPacketSet[ NUMBER_OF_PRIORITIES ];
-	DataStructures::Heap<reliabilityHeapWeightType, InternalPacket*, false> outgoingPacketBuffer;
-	reliabilityHeapWeightType outgoingPacketBufferNextWeights[NUMBER_OF_PRIORITIES];
-	void InitHeapWeights(void);
-	reliabilityHeapWeightType GetNextWeight(int priorityLevel);
+	OutgoingPacketScheduler outgoingPacketBuffer;
 //	unsigned int messageInSendBuffer[NUMBER_OF_PRIORITIES];
 //	double bytesInSendBuffer[NUMBER_OF_PRIORITIES];
 
@@ -654,6 +749,7 @@ private:
 
 	BPSTracker bpsMetrics[RNS_PER_SECOND_METRICS_COUNT];
 	CCTimeType lastBpsClear;
+	RakNetMetrics *metrics;
 
 #if LIBCAT_SECURITY==1
 public:
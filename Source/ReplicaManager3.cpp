@@ -59,12 +59,20 @@ LastSerializationResult::LastSerializationResult()
 {
 	replica=0;
 	lastSerializationResultBS=0;
+	snapshotDeltaSent=0;
 	whenLastSerialized = RakNet::GetTime();
 }
 LastSerializationResult::~LastSerializationResult()
 {
 	if (lastSerializationResultBS)
 		RakNet::OP_DELETE(lastSerializationResultBS,_FILE_AND_LINE_);
+	if (snapshotDeltaSent)
+		RakNet::OP_DELETE(snapshotDeltaSent,_FILE_AND_LINE_);
+}
+void LastSerializationResult::ClearSnapshotDelta(void)
+{
+	if (snapshotDeltaSent)
+		snapshotDeltaSent->Clear();
 }
 void LastSerializationResult::AllocBS(void)
 {
@@ -73,6 +81,54 @@ void LastSerializationResult::AllocBS(void)
 		lastSerializationResultBS=RakNet::OP_NEW<LastSerializationResultBS>(_FILE_AND_LINE_);
 	}
 }
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+SnapshotDeltaHistory::SnapshotDeltaHistory(Connection_RM3 *_connection)
+{
+	connection=_connection;
+	memset(entries,0,sizeof(entries));
+	nextSequence=0;
+	newestSequence=0;
+	hasNewest=false;
+}
+SnapshotDeltaHistory::~SnapshotDeltaHistory()
+{
+	Clear();
+}
+void SnapshotDeltaHistory::Clear(void)
+{
+	for (int i=0; i < RM3_SNAPSHOT_DELTA_HISTORY_LENGTH; i++)
+	{
+		if (entries[i].receiptPending)
+			connection->RemoveSnapshotDeltaReceipt(entries[i].sendReceipt);
+		if (entries[i].state)
+			VariableListDeltaTracker::ReleaseSnapshotBuffer(entries[i].state);
+	}
+	memset(entries,0,sizeof(entries));
+	hasNewest=false;
+}
+SnapshotDeltaHistory::Entry *SnapshotDeltaHistory::GetEntry(uint16_t sequence)
+{
+	Entry *entry = &entries[sequence%RM3_SNAPSHOT_DELTA_HISTORY_LENGTH];
+	if (entry->state==0 || entry->sequence!=sequence)
+		return 0;
+	return entry;
+}
+SnapshotDeltaHistory::Entry *SnapshotDeltaHistory::Store(uint16_t sequence, VariableListDeltaTracker::SnapshotBuffer *state)
+{
+	Entry *entry = &entries[sequence%RM3_SNAPSHOT_DELTA_HISTORY_LENGTH];
+	if (entry->receiptPending)
+		connection->RemoveSnapshotDeltaReceipt(entry->sendReceipt);
+	if (entry->state)
+		VariableListDeltaTracker::ReleaseSnapshotBuffer(entry->state);
+	entry->state=state;
+	entry->sequence=sequence;
+	entry->sendReceipt=0;
+	entry->receiptPending=false;
+	entry->acked=false;
+	return entry;
+}
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 
 ReplicaManager3::ReplicaManager3()
@@ -651,6 +707,9 @@ PluginReceiveResult ReplicaManager3::OnReceive(Packet *packet)
 	if (packet->length<2)
 		return RR_CONTINUE_PROCESSING;
 
+	if (packet->data[0]==ID_SND_RECEIPT_ACKED || packet->data[0]==ID_SND_RECEIPT_LOSS)
+		return OnSendReceipt(packet);
+
 	WorldId incomingWorldId;
 
 	RakNet::Time timestamp=0;
@@ -689,6 +748,8 @@ PluginReceiveResult ReplicaManager3::OnReceive(Packet *packet)
 		return OnConstruction(packet, packet->data, packet->length, packet->guid, packetDataOffset, incomingWorldId);
 	case ID_REPLICA_MANAGER_SERIALIZE:
 		return OnSerialize(packet, packet->data, packet->length, packet->guid, timestamp, packetDataOffset, incomingWorldId);
+	case ID_REPLICA_MANAGER_SERIALIZE_DELTA:
+		return OnSerializeDelta(packet, packet->data, packet->length, packet->guid, timestamp, packetDataOffset, incomingWorldId);
 	case ID_REPLICA_MANAGER_DOWNLOAD_STARTED:
 		if (packet->wasGeneratedLocally==false)
 		{
@@ -1187,6 +1248,21 @@ PluginReceiveResult ReplicaManager3::OnConstruction(Packet *packet, unsigned cha
 	}
 	bsIn.AlignReadToByteBoundary();
 
+	// States sent with RM3SR_SERIALIZED_DELTA are unreliable, so can arrive before the construction
+	for (index=0; index < constructionObjectListSize; index++)
+	{
+		if (constructionTickStack[index]!=0 && actuallyCreateObjectList[index])
+		{
+			SnapshotDeltaHistory **history = connection->snapshotDeltaReceived.Peek(constructionTickStack[index]->GetNetworkID());
+			SnapshotDeltaHistory::Entry *entry = history && (*history)->hasNewest ? (*history)->GetEntry((*history)->newestSequence) : 0;
+			if (entry)
+			{
+				RakNet::BitStream state(entry->state->data, entry->state->byteLength, false);
+				DeserializeSnapshotDeltaState(constructionTickStack[index], &state, connection, 0);
+			}
+		}
+	}
+
 	for (index=0; index < constructionObjectListSize; index++)
 	{
 		if (constructionTickStack[index]!=0)
@@ -1290,6 +1366,111 @@ PluginReceiveResult ReplicaManager3::OnSerialize(Packet *packet, unsigned char *
 	}
 	return RR_CONTINUE_PROCESSING;
 }
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+void ReplicaManager3::DeserializeSnapshotDeltaState(Replica3 *replica, RakNet::BitStream *state, Connection_RM3 *connection, RakNet::Time timestamp)
+{
+	struct DeserializeParameters ds;
+	ds.timeStamp=timestamp;
+	ds.sourceConnection=connection;
+	BitSize_t bitsUsed;
+	for (int z=0; z < RM3_NUM_OUTPUT_BITSTREAM_CHANNELS; z++)
+	{
+		state->Read(ds.bitstreamWrittenTo[z]);
+		if (ds.bitstreamWrittenTo[z])
+		{
+			state->ReadCompressed(bitsUsed);
+			state->AlignReadToByteBoundary();
+			state->Read(ds.serializationBitstream[z], bitsUsed);
+		}
+	}
+	replica->Deserialize(&ds);
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+PluginReceiveResult ReplicaManager3::OnSerializeDelta(Packet *packet, unsigned char *packetData, int packetDataLength, RakNetGUID senderGuid, RakNet::Time timestamp, unsigned char packetDataOffset, WorldId worldId)
+{
+	Connection_RM3 *connection = GetConnectionByGUID(senderGuid, worldId);
+	if (connection==0)
+		return RR_CONTINUE_PROCESSING;
+	if (connection->groupConstructionAndSerialize)
+	{
+		connection->downloadGroup.Push(packet, __FILE__, __LINE__);
+		return RR_STOP_PROCESSING;
+	}
+
+	RM3World *world = worldsArray[worldId];
+	RakAssert(world->networkIDManager);
+	RakNet::BitStream bsIn(packetData,packetDataLength,false);
+	bsIn.IgnoreBytes(packetDataOffset);
+
+	NetworkID networkId;
+	uint16_t sequence, baselineSequence=0;
+	bool hasBaseline=false;
+	bsIn.Read(networkId);
+	bsIn.Read(sequence);
+	if (bsIn.Read(hasBaseline)==false)
+		return RR_CONTINUE_PROCESSING;
+	if (hasBaseline && bsIn.Read(baselineSequence)==false)
+		return RR_CONTINUE_PROCESSING;
+
+	// Blocks not sent are the same as in the baseline, which the sender only uses once it arrived here.
+	// States are sent unreliably, so arriving means it was processed before this
+	SnapshotDeltaHistory **historyPtr = connection->snapshotDeltaReceived.Peek(networkId);
+	SnapshotDeltaHistory *history = historyPtr ? *historyPtr : 0;
+	RakNet::BitStream state;
+	if (hasBaseline)
+	{
+		SnapshotDeltaHistory::Entry *baseline = history ? history->GetEntry(baselineSequence) : 0;
+		if (baseline==0)
+			return RR_CONTINUE_PROCESSING;
+		state.WriteAlignedBytes(baseline->state->data, baseline->state->byteLength);
+	}
+	if (VariableListDeltaTracker::ReadSnapshotBlocks(&bsIn, &state)==false)
+		return RR_CONTINUE_PROCESSING;
+	if (history==0)
+	{
+		history=RakNet::OP_NEW_1<SnapshotDeltaHistory>(_FILE_AND_LINE_, connection);
+		connection->snapshotDeltaReceived.Push(networkId, history, _FILE_AND_LINE_);
+	}
+
+	// States that arrive late are still kept, as later deltas can be against them, unless that would overwrite a newer one
+	SnapshotDeltaHistory::Entry *entry = &history->entries[sequence%RM3_SNAPSHOT_DELTA_HISTORY_LENGTH];
+	if (entry->state==0 || SnapshotDeltaHistory::IsNewer(sequence, entry->sequence))
+		history->Store(sequence, VariableListDeltaTracker::AllocSnapshotBuffer(state.GetData(), state.GetNumberOfBytesUsed()));
+
+	if (history->hasNewest && SnapshotDeltaHistory::IsNewer(sequence, history->newestSequence)==false)
+		return RR_CONTINUE_PROCESSING;
+	history->newestSequence=sequence;
+	history->hasNewest=true;
+
+	// If not constructed yet, OnConstruction() passes the newest state on
+	Replica3 *replica = world->networkIDManager->GET_OBJECT_FROM_ID<Replica3*>(networkId);
+	if (replica)
+		DeserializeSnapshotDeltaState(replica, &state, connection, timestamp);
+	return RR_CONTINUE_PROCESSING;
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+PluginReceiveResult ReplicaManager3::OnSendReceipt(Packet *packet)
+{
+	if (packet->length < sizeof(MessageID)+sizeof(uint32_t))
+		return RR_CONTINUE_PROCESSING;
+
+	uint32_t sendReceipt;
+	memcpy(&sendReceipt, packet->data+sizeof(MessageID), sizeof(sendReceipt));
+	for (unsigned int index=0; index < worldsList.Size(); index++)
+	{
+		Connection_RM3 *connection = GetConnectionByGUID(packet->guid, worldsList[index]->worldId);
+		// Receipts for anything else are left for the application
+		if (connection && connection->OnSnapshotDeltaReceipt(sendReceipt, packet->data[0]==ID_SND_RECEIPT_ACKED))
+			return RR_STOP_PROCESSING_AND_DEALLOCATE;
+	}
+	return RR_CONTINUE_PROCESSING;
+}
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 
 PluginReceiveResult ReplicaManager3::OnDownloadStarted(Packet *packet, unsigned char *packetData, int packetDataLength, RakNetGUID senderGuid, unsigned char packetDataOffset, WorldId worldId)
@@ -1472,6 +1653,11 @@ Connection_RM3::~Connection_RM3()
 		RakNet::OP_DELETE(constructedReplicaList[i], _FILE_AND_LINE_);
 	for (i=0; i < queryToConstructReplicaList.Size(); i++)
 		RakNet::OP_DELETE(queryToConstructReplicaList[i], _FILE_AND_LINE_);
+	DataStructures::List<SnapshotDeltaHistory*> histories;
+	DataStructures::List<NetworkID> networkIds;
+	snapshotDeltaReceived.GetAsList(histories, networkIds, _FILE_AND_LINE_);
+	for (i=0; i < histories.Size(); i++)
+		RakNet::OP_DELETE(histories[i], _FILE_AND_LINE_);
 }
 
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
@@ -1678,6 +1864,9 @@ SendSerializeIfChangedResult Connection_RM3::SendSerializeIfChanged(LastSerializ
 		return SSICR_DID_NOT_SEND_DATA;
 	}
 
+	if (serializationResult==RM3SR_SERIALIZED_DELTA)
+		return SendSerializeDelta(lsr, sp, rakPeer, worldId, curTime);
+
 	if (serializationResult==RM3SR_SERIALIZED_ALWAYS)
 	{
 		bool allIndices[RM3_NUM_OUTPUT_BITSTREAM_CHANNELS];
@@ -1766,6 +1955,127 @@ SendSerializeIfChangedResult Connection_RM3::SendSerializeIfChanged(LastSerializ
 	return SendSerialize(replica, indicesToSend, sp->outputBitstream, sp->messageTimestamp, sp->pro, rakPeer, worldId, curTime);
 }
 
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+SendSerializeIfChangedResult Connection_RM3::SendSerializeDelta(LastSerializationResult *lsr, SerializeParameters *sp, RakNet::RakPeerInterface *rakPeer, unsigned char worldId, RakNet::Time curTime)
+{
+	RakNet::Replica3 *replica = lsr->replica;
+	if (lsr->snapshotDeltaSent==0)
+		lsr->snapshotDeltaSent=RakNet::OP_NEW_1<SnapshotDeltaHistory>(_FILE_AND_LINE_, this);
+	SnapshotDeltaHistory *history = lsr->snapshotDeltaSent;
+
+	// The state is every channel, written as SendSerialize() would
+	RakNet::BitStream state;
+	BitSize_t bitsPerChannel[RM3_NUM_OUTPUT_BITSTREAM_CHANNELS];
+	BitSize_t sum=0;
+	for (int z=0; z < RM3_NUM_OUTPUT_BITSTREAM_CHANNELS; z++)
+	{
+		bitsPerChannel[z]=sp->outputBitstream[z].GetNumberOfBitsUsed();
+		sum+=bitsPerChannel[z];
+		state.Write(bitsPerChannel[z]>0);
+		if (bitsPerChannel[z]>0)
+		{
+			state.WriteCompressed(bitsPerChannel[z]);
+			state.AlignWriteToByteBoundary();
+			state.Write(&sp->outputBitstream[z]);
+			sp->outputBitstream[z].ResetReadPointer();
+		}
+	}
+	unsigned int byteLength = state.GetNumberOfBytesUsed();
+
+	// Without one, the whole state is sent
+	SnapshotDeltaHistory::Entry *baseline=0;
+	if (history->hasNewest)
+		baseline=history->GetEntry(history->newestSequence);
+
+	// Unchanged since the newest state sent, which either arrived or may yet. If it is lost, ID_SND_RECEIPT_LOSS clears receiptPending and it is sent again
+	SnapshotDeltaHistory::Entry *newestSent = history->GetEntry((uint16_t)(history->nextSequence-1));
+	if (newestSent && (newestSent->acked || newestSent->receiptPending) &&
+		newestSent->state->byteLength==byteLength &&
+		memcmp(newestSent->state->data, state.GetData(), byteLength)==0)
+		return SSICR_DID_NOT_SEND_DATA;
+
+	// Connections sent the same state this tick share one copy of it
+	VariableListDeltaTracker::SnapshotBuffer *stateBuffer = replica->lastSnapshotDeltaState;
+	if (stateBuffer==0 || stateBuffer->byteLength!=byteLength || memcmp(stateBuffer->data, state.GetData(), byteLength)!=0)
+	{
+		if (stateBuffer)
+			VariableListDeltaTracker::ReleaseSnapshotBuffer(stateBuffer);
+		stateBuffer=VariableListDeltaTracker::AllocSnapshotBuffer(state.GetData(), byteLength);
+		replica->lastSnapshotDeltaState=stateBuffer;
+	}
+
+	uint16_t sequence = history->nextSequence;
+	RakNet::BitStream out;
+	if (sp->messageTimestamp!=0)
+	{
+		out.Write((MessageID)ID_TIMESTAMP);
+		out.Write(sp->messageTimestamp);
+	}
+	out.Write((MessageID)ID_REPLICA_MANAGER_SERIALIZE_DELTA);
+	out.Write(worldId);
+	out.Write(replica->GetNetworkID());
+	out.Write(sequence);
+	out.Write(baseline!=0);
+	if (baseline)
+		out.Write(baseline->sequence);
+	unsigned int numMaskBytes = (VariableListDeltaTracker::GetNumSnapshotBlocks(byteLength)+7)/8;
+	unsigned char *changedBlocks = (unsigned char*) rakMalloc_Ex(numMaskBytes,_FILE_AND_LINE_);
+	VariableListDeltaTracker::GetChangedSnapshotBlocks(baseline ? baseline->state : 0, stateBuffer->data, byteLength, changedBlocks);
+	VariableListDeltaTracker::WriteSnapshotBlocks(stateBuffer->data, byteLength, changedBlocks, &out);
+	rakFree_Ex(changedBlocks,_FILE_AND_LINE_);
+
+	replica->OnSerializeTransmission(&out, this, bitsPerChannel, curTime);
+	// Reliable ordered messages can be acknowledged long before they are processed, held back for earlier ones, which would break the baseline for later deltas
+	uint32_t sendReceipt = rakPeer->Send(&out,sp->pro[0].priority,UNRELIABLE_WITH_ACK_RECEIPT,sp->pro[0].orderingChannel,systemAddress,false);
+	if (sendReceipt==0)
+		return SSICR_DID_NOT_SEND_DATA;
+	sp->bitsWrittenSoFar+=sum;
+
+	VariableListDeltaTracker::AddSnapshotReference(stateBuffer);
+	SnapshotDeltaHistory::Entry *entry = history->Store(sequence, stateBuffer);
+	entry->sendReceipt=sendReceipt;
+	entry->receiptPending=true;
+	SnapshotDeltaReceipt snapshotDeltaReceipt;
+	snapshotDeltaReceipt.history=history;
+	snapshotDeltaReceipt.sequence=sequence;
+	snapshotDeltaReceipts.Push(sendReceipt, snapshotDeltaReceipt, _FILE_AND_LINE_);
+	history->nextSequence++;
+	return SSICR_SENT_DATA;
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+bool Connection_RM3::OnSnapshotDeltaReceipt(uint32_t sendReceipt, bool acked)
+{
+	SnapshotDeltaReceipt snapshotDeltaReceipt;
+	if (snapshotDeltaReceipts.Pop(snapshotDeltaReceipt, sendReceipt, _FILE_AND_LINE_)==false)
+		return false;
+
+	SnapshotDeltaHistory *history = snapshotDeltaReceipt.history;
+	SnapshotDeltaHistory::Entry *entry = history->GetEntry(snapshotDeltaReceipt.sequence);
+	RakAssert(entry && entry->receiptPending && entry->sendReceipt==sendReceipt);
+	entry->receiptPending=false;
+	if (acked)
+	{
+		// Receipts can arrive out of order
+		entry->acked=true;
+		if (history->hasNewest==false || SnapshotDeltaHistory::IsNewer(entry->sequence, history->newestSequence))
+		{
+			history->newestSequence=entry->sequence;
+			history->hasNewest=true;
+		}
+	}
+	return true;
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+void Connection_RM3::RemoveSnapshotDeltaReceipt(uint32_t sendReceipt)
+{
+	snapshotDeltaReceipts.Remove(sendReceipt, _FILE_AND_LINE_);
+}
+
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 void Connection_RM3::OnLocalReference(Replica3* replica3, ReplicaManager3 *replicaManager)
 {
@@ -1804,6 +2114,10 @@ void Connection_RM3::OnDereference(Replica3* replica3, ReplicaManager3 *replicaM
 	if (replica3->GetNetworkIDManager() == 0)
 		return;
 
+	SnapshotDeltaHistory *snapshotDeltaHistory;
+	if (snapshotDeltaReceived.Pop(snapshotDeltaHistory, replica3->GetNetworkID(), _FILE_AND_LINE_))
+		RakNet::OP_DELETE(snapshotDeltaHistory, _FILE_AND_LINE_);
+
 	LastSerializationResult* lsr=0;
 	unsigned int idx;
 
@@ -2048,6 +2362,8 @@ void Connection_RM3::OnSendDestructionFromQuery(unsigned int queryToDestructIdx,
 			break;
 		}
 	}
+	// The remote system no longer has the states sent, so if constructed again the first state is sent whole
+	lsr->ClearSnapshotDelta();
 	//assert(queryToConstructReplicaList.GetIndexOf(lsr->replica)==(unsigned int)-1);
 	queryToConstructReplicaList.Push(lsr,_FILE_AND_LINE_);
 	ValidateLists(replicaManager);
@@ -2387,6 +2703,7 @@ Replica3::Replica3()
 	replicaManager=0;
 	forceSendUntilNextUpdate=false;
 	lsr=0;
+	lastSnapshotDeltaState=0;
 	referenceIndex = (uint32_t)-1;
 }
 
@@ -2398,6 +2715,8 @@ Replica3::~Replica3()
 	{
 		replicaManager->Dereference(this);
 	}
+	if (lastSnapshotDeltaState)
+		VariableListDeltaTracker::ReleaseSnapshotBuffer(lastSnapshotDeltaState);
 }
 
 // --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
@@ -27,6 +27,8 @@
 #include "NetworkIDObject.h"
 #include "DS_OrderedList.h"
 #include "DS_Queue.h"
+#include "DS_Hash.h"
+#include "VariableListDeltaTracker.h"
 
 /// \defgroup REPLICA_MANAGER_GROUP3 ReplicaManager3
 /// \brief Third implementation of object replication
@@ -323,6 +325,9 @@ protected:
 
 	PluginReceiveResult OnConstruction(Packet *packet, unsigned char *packetData, int packetDataLength, RakNetGUID senderGuid, unsigned char packetDataOffset, WorldId worldId);
 	PluginReceiveResult OnSerialize(Packet *packet, unsigned char *packetData, int packetDataLength, RakNetGUID senderGuid, RakNet::Time timestamp, unsigned char packetDataOffset, WorldId worldId);
+	void DeserializeSnapshotDeltaState(Replica3 *replica, RakNet::BitStream *state, Connection_RM3 *connection, RakNet::Time timestamp);
+	PluginReceiveResult OnSerializeDelta(Packet *packet, unsigned char *packetData, int packetDataLength, RakNetGUID senderGuid, RakNet::Time timestamp, unsigned char packetDataOffset, WorldId worldId);
+	PluginReceiveResult OnSendReceipt(Packet *packet);
 	PluginReceiveResult OnDownloadStarted(Packet *packet, unsigned char *packetData, int packetDataLength, RakNetGUID senderGuid, unsigned char packetDataOffset, WorldId worldId);
 	PluginReceiveResult OnDownloadComplete(Packet *packet, unsigned char *packetData, int packetDataLength, RakNetGUID senderGuid, unsigned char packetDataOffset, WorldId worldId);
 
@@ -350,6 +355,45 @@ protected:
 
 static const int RM3_NUM_OUTPUT_BITSTREAM_CHANNELS=16;
 
+/// How many recent states of each replica are kept per connection for RM3SR_SERIALIZED_DELTA
+/// Updates are sent as a delta against the newest state acknowledged, if it is still one of these
+static const int RM3_SNAPSHOT_DELTA_HISTORY_LENGTH=32;
+
+/// \internal
+/// \brief Recent states of one replica sent to or received from one connection, for RM3SR_SERIALIZED_DELTA
+struct SnapshotDeltaHistory
+{
+	SnapshotDeltaHistory(Connection_RM3 *_connection);
+	~SnapshotDeltaHistory();
+
+	struct Entry
+	{
+		VariableListDeltaTracker::SnapshotBuffer *state;
+		uint32_t sendReceipt;
+		uint16_t sequence;
+		// Sent and waiting for ID_SND_RECEIPT_ACKED or ID_SND_RECEIPT_LOSS
+		bool receiptPending;
+		bool acked;
+	};
+
+	/// Returns the entry for \a sequence, or 0 if it was never stored or was overwritten since
+	Entry *GetEntry(uint16_t sequence);
+	/// Stores \a state under \a sequence, taking over the caller's reference to it, and releases whatever was stored in that slot before
+	Entry *Store(uint16_t sequence, VariableListDeltaTracker::SnapshotBuffer *state);
+	/// Releases every state. nextSequence is kept, so states sent afterwards are still newer than any sent before
+	void Clear(void);
+	/// True if \a sequence was sent after \a than, allowing for wrapping
+	static bool IsNewer(uint16_t sequence, uint16_t than) {return sequence!=than && (uint16_t)(sequence-than) < 0x8000;}
+
+	Entry entries[RM3_SNAPSHOT_DELTA_HISTORY_LENGTH];
+	Connection_RM3 *connection;
+	/// Sender: the sequence number of the next state sent
+	uint16_t nextSequence;
+	/// Sender: the newest state acknowledged. Receiver: the newest state received
+	uint16_t newestSequence;
+	bool hasNewest;
+};
+
 /// \ingroup REPLICA_MANAGER_GROUP3
 struct LastSerializationResultBS
 {
@@ -373,6 +417,11 @@ struct LastSerializationResult
 
 	void AllocBS(void);
 	LastSerializationResultBS* lastSerializationResultBS;
+
+	/// For RM3SR_SERIALIZED_DELTA, states sent to this connection
+	SnapshotDeltaHistory *snapshotDeltaSent;
+	/// Forgets the states sent, so the next is sent whole. Used when the remote system destroys its copy of the replica
+	void ClearSnapshotDelta(void);
 };
 
 /// Parameters passed to Replica3::Serialize()
@@ -573,6 +622,24 @@ public:
 	/// \param[in] curTime The current time
 	virtual SendSerializeIfChangedResult SendSerializeIfChanged(LastSerializationResult *lsr, SerializeParameters *sp, RakNet::RakPeerInterface *rakPeer, unsigned char worldId, ReplicaManager3 *replicaManager, RakNet::Time curTime);
 
+	/// \internal
+	/// \details Sends what Replica3::Serialize() wrote to \a sp as a delta against the newest state this connection acknowledged, for RM3SR_SERIALIZED_DELTA<BR>
+	/// Does not send if the newest state sent is the same, unless it was lost
+	/// \param[in] lsr Item in the queryToSerializeReplicaList
+	/// \param[in] sp Controlling parameters over the serialization
+	/// \param[in] rakPeer Instance of RakPeerInterface to send on
+	/// \param[in] worldId Which world, see ReplicaManager3::AddWorld()
+	/// \param[in] curTime The current time
+	virtual SendSerializeIfChangedResult SendSerializeDelta(LastSerializationResult *lsr, SerializeParameters *sp, RakNet::RakPeerInterface *rakPeer, unsigned char worldId, RakNet::Time curTime);
+
+	/// \internal
+	/// \details Called for ID_SND_RECEIPT_ACKED and ID_SND_RECEIPT_LOSS from this connection
+	/// \return true if \a sendReceipt was for a state sent by SendSerializeDelta()
+	bool OnSnapshotDeltaReceipt(uint32_t sendReceipt, bool acked);
+
+	/// \internal
+	void RemoveSnapshotDeltaReceipt(uint32_t sendReceipt);
+
 	/// \internal
 	/// \brief Given a list of objects that were created and destroyed, serialize and send them to another system.
 	/// \param[in] newObjects Objects to serialize construction
@@ -663,6 +730,18 @@ protected:
 	void OnDoNotQueryDestruction(unsigned int queryToDestructIdx, ReplicaManager3 *replicaManager);
 	void ValidateLists(ReplicaManager3 *replicaManager) const;
 	void SendSerializeHeader(RakNet::Replica3 *replica, RakNet::Time timestamp, RakNet::BitStream *bs, WorldId worldId);
+
+	struct SnapshotDeltaReceipt
+	{
+		SnapshotDeltaHistory *history;
+		uint16_t sequence;
+	};
+	static unsigned long SendReceiptToInteger(const uint32_t &sendReceipt) {return sendReceipt;}
+	static unsigned long NetworkIDToInteger(const NetworkID &networkId) {return (unsigned long) (networkId ^ (networkId >> 32));}
+	// States sent by SendSerializeDelta() that are waiting for ID_SND_RECEIPT_ACKED or ID_SND_RECEIPT_LOSS
+	DataStructures::Hash<uint32_t, SnapshotDeltaReceipt, 1024, Connection_RM3::SendReceiptToInteger> snapshotDeltaReceipts;
+	// States received from this connection, by object. Kept by NetworkID rather than with constructedReplicaList, as they can arrive before the construction
+	DataStructures::Hash<NetworkID, SnapshotDeltaHistory*, 1024, Connection_RM3::NetworkIDToInteger> snapshotDeltaReceived;
 	
 	// The list of objects that our local system and this remote system both have
 	// Either we sent this object to them, or they sent this object to us
@@ -785,6 +864,14 @@ enum RM3SerializationResult
 	/// Efficient
 	RM3SR_NEVER_SERIALIZE_FOR_THIS_CONNECTION,
 
+	/// Send the whole object as a delta against the last state this connection acknowledged, unreliably. Quake 3 networking works this way
+	/// Each connection keeps the last RM3_SNAPSHOT_DELTA_HISTORY_LENGTH states sent. Send receipts say which arrived. A lost state is not resent as it was, the next delta covers it
+	/// Until a state is acknowledged, or if none acknowledged is left, the whole state is sent. States that arrive before the construction are applied after it
+	/// Replica3::Deserialize() gets whole states, and only ones newer than the last it got, so Serialize() must write the whole object every time, not just what changed
+	/// Efficient for bandwidth when objects change often. Sends with the priority of SerializeParameters::pro[0], ignoring the reliability
+	/// States longer than MAX_SNAPSHOT_BYTE_LENGTH are discarded by the receiver
+	RM3SR_SERIALIZED_DELTA,
+
 	/// Max enum
 	RM3SR_MAX,
 };
@@ -1086,6 +1173,9 @@ public:
 	ReplicaManager3 *replicaManager;
 
 	LastSerializationResultBS lastSentSerialization;
+	/// \internal
+	/// The state last sent with RM3SR_SERIALIZED_DELTA. Connections sent the same state share it
+	VariableListDeltaTracker::SnapshotBuffer *lastSnapshotDeltaState;
 	bool forceSendUntilNextUpdate;
 	LastSerializationResult *lsr;
 	uint32_t referenceIndex;
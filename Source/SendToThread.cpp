@@ -3,7 +3,7 @@
  *  All rights reserved.
  *
  *  This source code is licensed under the BSD-style license found in the
- *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  LICENSE file in the root directory of this source tree. An additional grant
  *  of patent rights can be found in the PATENTS file in the same directory.
  *
  */
@@ -11,77 +11,303 @@
 #include "SendToThread.h"
 #ifdef USE_THREADED_SEND
 #include "RakThread.h"
-#include "InternalPacket.h"
-#include "GetTime.h"
+#include "RakSleep.h"
+#include "RakMemoryOverride.h"
+#include "SocketIncludes.h"
+#include "SocketDefines.h"
+#include <string.h>
 
-#if USE_SLIDING_WINDOW_CONGESTION_CONTROL!=1
-#include "CCRakNetUDT.h"
-#else
-#include "CCRakNetSlidingWindow.h"
+#ifndef INVALID_SOCKET
+#define INVALID_SOCKET -1
+#endif
+
+#if defined(__linux__) && !defined(ANDROID)
+#define SENDTO_THREAD_SENDMMSG
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <errno.h>
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+// Older C libraries do not define this, though the kernel may support it. Start() asks the kernel
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
 #endif
 
 using namespace RakNet;
 
-int SendToThread::refCount=0;
-DataStructures::ThreadsafeAllocatingQueue<SendToThread::SendToThreadBlock> SendToThread::objectQueue;
-ThreadPool<SendToThread::SendToThreadBlock*,SendToThread::SendToThreadBlock*> SendToThread::threadPool;
+// Datagrams that can wait to be sent. Push() fails when they are all used
+static const unsigned int RING_SIZE=512;
+// Datagrams passed to one sendmmsg()
+static const unsigned int MAX_DATAGRAMS_PER_CALL=64;
+// Limits on datagrams the kernel splits from one buffer
+static const unsigned int MAX_SEGMENTS=64;
+static const unsigned int MAX_SEGMENTED_BYTES=60000;
 
-SendToThread::SendToThreadBlock* SendToWorkerThread(SendToThread::SendToThreadBlock* input, bool *returnOutput, void* perThreadData)
-{
-	(void) perThreadData;
-	*returnOutput=false;
-//	RakNet::TimeUS *mostRecentTime=(RakNet::TimeUS *)input->data;
-//	*mostRecentTime=RakNet::GetTimeUS();
-	SocketLayer::SendTo(input->s, input->data, input->dataWriteOffset, input->systemAddress, _FILE_AND_LINE_);
-	SendToThread::objectQueue.Push(input);
-	return 0;
-}
 SendToThread::SendToThread()
 {
+	rns2Socket=(RNS2Socket) INVALID_SOCKET;
+	ring=0;
+	writeIndex=sendIndex=queuedCount=0;
+	endThread=false;
+	isThreadActive=false;
+	useSegmentationOffload=false;
 }
 SendToThread::~SendToThread()
 {
+	Stop();
+}
+int SendToThread::Start(RNS2Socket s, int threadPriority)
+{
+	RakAssert(ring==0);
+	rns2Socket=s;
+	ring=(Datagram*) rakMalloc_Ex(sizeof(Datagram)*RING_SIZE, _FILE_AND_LINE_);
+	writeIndex=sendIndex=queuedCount=0;
+	endThread=false;
+	isThreadActive=true;
+
+#ifdef SENDTO_THREAD_SENDMMSG
+	// Kernels without segmentation offload do not have the option, and would ignore it when sending
+	int segmentSize=0;
+	socklen_t optionLength=sizeof(segmentSize);
+	useSegmentationOffload=getsockopt(s, SOL_UDP, UDP_SEGMENT, (char*) &segmentSize, &optionLength)==0;
+#else
+	useSegmentationOffload=false;
+#endif
+
+	queuedEvent.InitEvent();
+	int errorCode = RakNet::RakThread::Create(SendLoop, this, threadPriority);
+	if (errorCode!=0)
+	{
+		isThreadActive=false;
+		queuedEvent.CloseEvent();
+		rakFree_Ex(ring, _FILE_AND_LINE_);
+		ring=0;
+	}
+	return errorCode;
+}
+void SendToThread::Stop(void)
+{
+	if (ring==0)
+		return;
+
+	ringMutex.Lock();
+	endThread=true;
+	ringMutex.Unlock();
+	queuedEvent.SetEvent();
+	while (isThreadActive)
+		RakSleep(1);
 
+	queuedEvent.CloseEvent();
+	ringMutex.Lock();
+	rakFree_Ex(ring, _FILE_AND_LINE_);
+	ring=0;
+	ringMutex.Unlock();
 }
-void SendToThread::AddRef(void)
+bool SendToThread::Push(const RNS2_SendParameters *sendParameters)
 {
-	if (++refCount==1)
+	if (sendParameters->length<=0 || sendParameters->length>MAXIMUM_MTU_SIZE)
+		return false;
+
+	ringMutex.Lock();
+	if (ring==0 || endThread || queuedCount==RING_SIZE)
 	{
-		threadPool.StartThreads(1,0);
+		ringMutex.Unlock();
+		return false;
 	}
+	Datagram *datagram=ring+writeIndex;
+	datagram->systemAddress=sendParameters->systemAddress;
+	datagram->length=sendParameters->length;
+	memcpy(datagram->data, sendParameters->data, sendParameters->length);
+	writeIndex=(writeIndex+1)%RING_SIZE;
+	bool wasEmpty=++queuedCount==1;
+	ringMutex.Unlock();
+
+	// The thread only waits when the ring is empty
+	if (wasEmpty)
+		queuedEvent.SetEvent();
+	return true;
+}
+bool SendToThread::IsSaturated(void) const
+{
+	return GetQueuedCount() > RING_SIZE/2;
+}
+unsigned int SendToThread::GetQueuedCount(void) const
+{
+	ringMutex.Lock();
+	unsigned int count=queuedCount;
+	ringMutex.Unlock();
+	return count;
+}
+RAK_THREAD_DECLARATION(SendToThread::SendLoop)
+{
+	SendToThread *sendToThread = (SendToThread*) arguments;
+	sendToThread->SendLoopInt();
+	return 0;
 }
-void SendToThread::Deref(void)
+void SendToThread::SendLoopInt(void)
 {
-	if (refCount>0)
+	for (;;)
 	{
-		if (--refCount==0)
+		ringMutex.Lock();
+		unsigned int first=sendIndex;
+		unsigned int count=queuedCount;
+		bool end=endThread;
+		ringMutex.Unlock();
+
+		if (count==0)
 		{
-			threadPool.StopThreads();
-			RakAssert(threadPool.NumThreadsWorking()==0);
+			if (end)
+				break;
+			queuedEvent.WaitOnEvent(1000);
+			continue;
+		}
+
+		// Send up to the end of the ring, and the rest next time around
+		if (first+count>RING_SIZE)
+			count=RING_SIZE-first;
+		SendDatagrams(first, count);
 
-			unsigned i;
-			SendToThreadBlock* info;
-			for (i=0; i < threadPool.InputSize(); i++)
+		ringMutex.Lock();
+		sendIndex=(sendIndex+count)%RING_SIZE;
+		queuedCount-=count;
+		ringMutex.Unlock();
+	}
+	isThreadActive=false;
+}
+void SendToThread::SendDatagrams(unsigned int first, unsigned int count)
+{
+#ifdef SENDTO_THREAD_SENDMMSG
+	struct mmsghdr messages[MAX_DATAGRAMS_PER_CALL];
+	struct iovec parts[MAX_DATAGRAMS_PER_CALL];
+	char control[MAX_DATAGRAMS_PER_CALL][CMSG_SPACE(sizeof(uint16_t))];
+	// Index in parts of the first datagram of each message
+	unsigned int messageFirstPart[MAX_DATAGRAMS_PER_CALL];
+
+	while (count>0)
+	{
+		unsigned int numParts = count < MAX_DATAGRAMS_PER_CALL ? count : MAX_DATAGRAMS_PER_CALL;
+		unsigned int numMessages=0;
+		unsigned int partIndex=0;
+		while (partIndex<numParts)
+		{
+			Datagram *datagram=ring+first+partIndex;
+
+			// Datagrams to the same address, all the same length but the last, go as one buffer the kernel splits
+			unsigned int numSegments=1;
+			unsigned int segmentedBytes=datagram->length;
+			if (useSegmentationOffload)
+			{
+				while (partIndex+numSegments<numParts && numSegments<MAX_SEGMENTS)
+				{
+					Datagram *next=datagram+numSegments;
+					if (next->length>datagram->length || segmentedBytes+next->length>MAX_SEGMENTED_BYTES || next->systemAddress!=datagram->systemAddress)
+						break;
+					segmentedBytes+=next->length;
+					numSegments++;
+					if (next->length<datagram->length)
+						break;
+				}
+			}
+
+			struct msghdr *header=&messages[numMessages].msg_hdr;
+			memset(header, 0, sizeof(*header));
+			if (datagram->systemAddress.address.addr4.sin_family==AF_INET)
+			{
+				header->msg_name=(void*) &datagram->systemAddress.address.addr4;
+				header->msg_namelen=sizeof(sockaddr_in);
+			}
+#if RAKNET_SUPPORT_IPV6==1
+			else
+			{
+				header->msg_name=(void*) &datagram->systemAddress.address.addr6;
+				header->msg_namelen=sizeof(sockaddr_in6);
+			}
+#endif
+			for (unsigned int i=0; i < numSegments; i++)
+			{
+				parts[partIndex+i].iov_base=datagram[i].data;
+				parts[partIndex+i].iov_len=datagram[i].length;
+			}
+			header->msg_iov=parts+partIndex;
+			header->msg_iovlen=numSegments;
+			if (numSegments>1)
+			{
+				header->msg_control=control[numMessages];
+				header->msg_controllen=sizeof(control[numMessages]);
+				struct cmsghdr *controlHeader=CMSG_FIRSTHDR(header);
+				controlHeader->cmsg_level=SOL_UDP;
+				controlHeader->cmsg_type=UDP_SEGMENT;
+				controlHeader->cmsg_len=CMSG_LEN(sizeof(uint16_t));
+				uint16_t segmentSize=(uint16_t) datagram->length;
+				memcpy(CMSG_DATA(controlHeader), &segmentSize, sizeof(segmentSize));
+			}
+			messageFirstPart[numMessages]=partIndex;
+			numMessages++;
+			partIndex+=numSegments;
+		}
+
+		unsigned int messageIndex=0;
+		while (messageIndex<numMessages)
+		{
+			int result=sendmmsg(rns2Socket, messages+messageIndex, numMessages-messageIndex, 0);
+			if (result>0)
+			{
+				messageIndex+=result;
+				continue;
+			}
+			if (errno==EINTR)
+				continue;
+			if (errno==ENOBUFS && endThread==false)
 			{
-				info = threadPool.GetInputAtIndex(i);
-				objectQueue.Push(info);
+				RakSleep(1);
+				continue;
 			}
-			threadPool.ClearInput();
-			objectQueue.Clear(_FILE_AND_LINE_);
+
+			// The message at messageIndex failed
+			unsigned int numSegments=(unsigned int) messages[messageIndex].msg_hdr.msg_iovlen;
+			if (numSegments>1)
+			{
+				// EIO means the device cannot checksum the segments. Other errors, such as a segment larger than the path MTU, are particular to this message
+				if (errno==EIO)
+					useSegmentationOffload=false;
+				for (unsigned int i=0; i < numSegments; i++)
+					SendOne(ring+first+messageFirstPart[messageIndex]+i);
+			}
+			else
+			{
+				RAKNET_DEBUG_PRINTF("sendmmsg failed with code %i for char %i and length %i.\n", errno, ring[first+messageFirstPart[messageIndex]].data[0], ring[first+messageFirstPart[messageIndex]].length);
+			}
+			messageIndex++;
 		}
+
+		first+=numParts;
+		count-=numParts;
 	}
+#else
+	for (unsigned int i=0; i < count; i++)
+		SendOne(ring+first+i);
+#endif
 }
-SendToThread::SendToThreadBlock* SendToThread::AllocateBlock(void)
-{
-	SendToThread::SendToThreadBlock *b;
-	b=objectQueue.Pop();
-	if (b==0)
-		b=objectQueue.Allocate(_FILE_AND_LINE_);
-	return b;
-}
-void SendToThread::ProcessBlock(SendToThread::SendToThreadBlock* threadedSend)
+void SendToThread::SendOne(Datagram *datagram)
 {
-	RakAssert(threadedSend->dataWriteOffset>0 && threadedSend->dataWriteOffset<=MAXIMUM_MTU_SIZE-UDP_HEADER_SIZE);
-	threadPool.AddInput(SendToWorkerThread,threadedSend);
+	int len=-1;
+	if (datagram->systemAddress.address.addr4.sin_family==AF_INET)
+	{
+		len = sendto__( rns2Socket, datagram->data, datagram->length, 0, ( const sockaddr* ) & datagram->systemAddress.address.addr4, sizeof( sockaddr_in ) );
+	}
+	else
+	{
+#if RAKNET_SUPPORT_IPV6==1
+		len = sendto__( rns2Socket, datagram->data, datagram->length, 0, ( const sockaddr* ) & datagram->systemAddress.address.addr6, sizeof( sockaddr_in6 ) );
+#endif
+	}
+
+	if (len<0)
+	{
+		RAKNET_DEBUG_PRINTF("sendto failed with code %i for char %i and length %i.\n", len, datagram->data[0], datagram->length);
+	}
 }
 #endif
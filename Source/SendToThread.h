@@ -3,7 +3,7 @@
  *  All rights reserved.
  *
  *  This source code is licensed under the BSD-style license found in the
- *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  LICENSE file in the root directory of this source tree. An additional grant
  *  of patent rights can be found in the PATENTS file in the same directory.
  *
  */
@@ -15,43 +15,65 @@
 
 #ifdef USE_THREADED_SEND
 
-#include "InternalPacket.h"
-#include "SocketLayer.h"
-#include "DS_ThreadsafeAllocatingQueue.h"
-#include "ThreadPool.h"
+#include "RakNetSocket2.h"
+#include "SimpleMutex.h"
+#include "SignaledEvent.h"
 
 namespace RakNet
 {
+/// Sends the datagrams of one socket on a thread of its own
+/// Send() copies each datagram into a ring, and the thread sends whatever has built up since it last looked, in as few system calls as it can.
+/// On Linux that is sendmmsg(), with runs of datagrams of one size to one address passed to the kernel as one buffer with UDP generic segmentation offload, where the kernel supports it
 class SendToThread
 {
 public:
 	SendToThread();
 	~SendToThread();
 
-	struct SendToThreadBlock
+	/// Starts the thread sending on \a s
+	/// \return 0 on success, else the error from RakThread::Create()
+	int Start(RNS2Socket s, int threadPriority);
+
+	/// Sends what is waiting in the ring, then ends the thread
+	void Stop(void);
+
+	/// Copies a datagram into the ring
+	/// \return false if the thread is not running or the ring is full, in which case the caller sends the datagram itself
+	bool Push(const RNS2_SendParameters *sendParameters);
+
+	/// True while more than half the ring is waiting to be sent, because the socket takes datagrams slower than they are pushed
+	bool IsSaturated(void) const;
+
+	/// Datagrams pushed but not yet sent
+	unsigned int GetQueuedCount(void) const;
+
+protected:
+	struct Datagram
 	{
-		SOCKET s;
 		SystemAddress systemAddress;
-		unsigned short remotePortRakNetWasStartedOn_PS3;
-		unsigned int extraSocketOptions;
+		int length;
 		char data[MAXIMUM_MTU_SIZE];
-		unsigned short dataWriteOffset;
 	};
 
-	static SendToThreadBlock* AllocateBlock(void);
-	static void ProcessBlock(SendToThreadBlock* threadedSend);
-
-	static void AddRef(void);
-	static void Deref(void);
-	static DataStructures::ThreadsafeAllocatingQueue<SendToThreadBlock> objectQueue;
-protected:
-	static int refCount;
-	static ThreadPool<SendToThreadBlock*,SendToThreadBlock*> threadPool;
+	static RAK_THREAD_DECLARATION(SendLoop);
+	void SendLoopInt(void);
+	// Sends count datagrams starting at ring index first, which do not wrap
+	void SendDatagrams(unsigned int first, unsigned int count);
+	void SendOne(Datagram *datagram);
 
+	RNS2Socket rns2Socket;
+	Datagram *ring;
+	// Slots from sendIndex to writeIndex are waiting to be sent. The thread reads the slots without the mutex, as Push() does not write them until the thread releases them
+	unsigned int writeIndex, sendIndex, queuedCount;
+	mutable SimpleMutex ringMutex;
+	// Set when Push() adds to an empty ring
+	SignaledEvent queuedEvent;
+	volatile bool endThread;
+	volatile bool isThreadActive;
+	bool useSegmentationOffload;
 };
 }
 
-
 #endif
 
 #endif
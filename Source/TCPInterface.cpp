@@ -26,7 +26,9 @@
 
 #else
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <pthread.h>
 #endif
 #include <string.h>
@@ -69,6 +71,7 @@ TCPInterface::TCPInterface()
 #endif
 	remoteClients=0;
 	remoteClientsLength=0;
+	wakeSockets[0]=wakeSockets[1]=0;
 
 	StringCompressor::AddReference();
 	RakNet::StringTable::AddReference();
@@ -123,9 +126,18 @@ bool TCPInterface::CreateListenSocket(unsigned short port, unsigned short maxInc
 	serverAddress.sin_port = htons(port);
 
 	SocketLayer::SetSocketOptions(listenSocket, false, false);
+#if !defined(_WIN32)
+	// So a server can restart while connections it closed are in TIME_WAIT. On Windows this would let other processes take the port
+	int reuseAddress=1;
+	setsockopt__(listenSocket, SOL_SOCKET, SO_REUSEADDR, (char *) &reuseAddress, sizeof(reuseAddress));
+#endif
 
 	if (bind__(listenSocket,(struct sockaddr *) &serverAddress,sizeof(serverAddress)) < 0)
+	{
+		closesocket__(listenSocket);
+		listenSocket=0;
 		return false;
+	}
 
 	listen__(listenSocket, maxIncomingConnections);
 #else
@@ -216,13 +228,32 @@ bool TCPInterface::Start(unsigned short port, unsigned short maxIncomingConnecti
 	if (maxIncomingConnections>0)
 	{
 #if defined(WINDOWS_STORE_RT)
-		CreateListenSocket_WinStore8(port, maxIncomingConnections, socketFamily, bindAddress);
+		bool listening=CreateListenSocket_WinStore8(port, maxIncomingConnections, socketFamily, bindAddress);
 #else
-		CreateListenSocket(port, maxIncomingConnections, socketFamily, bindAddress);
+		bool listening=CreateListenSocket(port, maxIncomingConnections, socketFamily, bindAddress);
 #endif
+		// A server that cannot bind its port should not look started
+		if (listening==false)
+		{
+			RakNet::OP_DELETE_ARRAY(remoteClients,_FILE_AND_LINE_);
+			remoteClients=0;
+			remoteClientsLength=0;
+			isStarted.Decrement();
+			return false;
+		}
 	}
 
 
+#if !defined(_WIN32) && !defined(__native_client__)
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, wakeSockets)==0)
+	{
+		fcntl(wakeSockets[0], F_SETFL, fcntl(wakeSockets[0], F_GETFL, 0) | O_NONBLOCK);
+		fcntl(wakeSockets[1], F_SETFL, fcntl(wakeSockets[1], F_GETFL, 0) | O_NONBLOCK);
+	}
+	else
+		wakeSockets[0]=wakeSockets[1]=0;
+#endif
+
 	// Start the update thread
 	int errorCode;
 
@@ -295,6 +326,12 @@ void TCPInterface::Stop(void)
 	#endif
 
 	// Stuff from here on to the end of the function is not threadsafe
+	if (wakeSockets[0]!=0)
+	{
+		closesocket__(wakeSockets[0]);
+		closesocket__(wakeSockets[1]);
+		wakeSockets[0]=wakeSockets[1]=0;
+	}
 	for (i=0; i < (unsigned int) remoteClientsLength; i++)
 	{
 		closesocket__(remoteClients[i].socket);
@@ -306,6 +343,9 @@ void TCPInterface::Stop(void)
 	RakNet::OP_DELETE_ARRAY(remoteClients,_FILE_AND_LINE_);
 	remoteClients=0;
 
+	Packet *incomingMessage;
+	while ((incomingMessage=incomingMessages.PopInaccurate())!=0)
+		DeallocatePacket(incomingMessage);
 	incomingMessages.Clear(_FILE_AND_LINE_);
 	newIncomingConnections.Clear(_FILE_AND_LINE_);
 	newRemoteClients.Clear(_FILE_AND_LINE_);
@@ -408,12 +448,16 @@ SystemAddress TCPInterface::Connect(const char* host, unsigned short remotePort,
 
 		errorCode = RakNet::RakThread::Create(ConnectionAttemptLoop, s, threadPriority);
 
+		SystemAddress systemAddress=s->systemAddress;
 		if (errorCode!=0)
 		{
 			RakNet::OP_DELETE(s, _FILE_AND_LINE_);
-			failedConnectionAttempts.Push(s->systemAddress, _FILE_AND_LINE_ );
+			failedConnectionAttemptMutex.Lock();
+			failedConnectionAttempts.Push(systemAddress, _FILE_AND_LINE_ );
+			failedConnectionAttemptMutex.Unlock();
+			return UNASSIGNED_SYSTEM_ADDRESS;
 		}
-		return UNASSIGNED_SYSTEM_ADDRESS;
+		return systemAddress;
 	}	
 }
 #if OPEN_SSL_CLIENT_SUPPORT==1
@@ -471,7 +515,8 @@ bool TCPInterface::SendList( const char **data, const unsigned int *lengths, con
 		{
 			if (remoteClients[i].systemAddress!=systemAddress)
 			{
-				remoteClients[i].SendOrBuffer(data, lengths, numParameters);
+				if (remoteClients[i].SendOrBuffer(data, lengths, numParameters))
+					WakeUpdateThread();
 			}
 		}
 	}
@@ -481,7 +526,8 @@ bool TCPInterface::SendList( const char **data, const unsigned int *lengths, con
 		if (systemAddress.systemIndex<remoteClientsLength &&
 			remoteClients[systemAddress.systemIndex].systemAddress==systemAddress)
 		{
-			remoteClients[systemAddress.systemIndex].SendOrBuffer(data, lengths, numParameters);
+			if (remoteClients[systemAddress.systemIndex].SendOrBuffer(data, lengths, numParameters))
+				WakeUpdateThread();
 		}
 		else
 		{
@@ -489,7 +535,8 @@ bool TCPInterface::SendList( const char **data, const unsigned int *lengths, con
 			{
 				if (remoteClients[i].systemAddress==systemAddress )
 				{
-					remoteClients[i].SendOrBuffer(data, lengths, numParameters);
+					if (remoteClients[i].SendOrBuffer(data, lengths, numParameters))
+						WakeUpdateThread();
 				}
 			}
 		}
@@ -498,6 +545,17 @@ bool TCPInterface::SendList( const char **data, const unsigned int *lengths, con
 
 	return true;
 }
+void TCPInterface::WakeUpdateThread(void)
+{
+#if !defined(_WIN32) && !defined(__native_client__)
+	// One wake is enough until the update thread gets it
+	if (wakeSockets[1]!=0 && wakePending.Increment()==1)
+	{
+		char wake=0;
+		send__(wakeSockets[1], &wake, 1, 0);
+	}
+#endif
+}
 bool TCPInterface::ReceiveHasPackets( void )
 {
 	return headPush.IsEmpty()==false || incomingMessages.IsEmpty()==false || tailPush.IsEmpty()==false;
@@ -547,6 +605,22 @@ Packet* TCPInterface::ReceiveInt( void )
 	return 0;
 }
 
+int TCPInterface::ReadRemoteClient(RemoteClient *remoteClient, char *buffer, unsigned int bufferSize)
+{
+	int len = remoteClient->Recv(buffer,bufferSize);
+	if (len>0)
+	{
+		Packet *incomingMessage=incomingMessages.Allocate( _FILE_AND_LINE_ );
+		incomingMessage->data = (unsigned char*) rakMalloc_Ex( len+1, _FILE_AND_LINE_ );
+		memcpy(incomingMessage->data, buffer, len);
+		incomingMessage->data[len]=0; // Null terminate this so we can print it out as regular strings.  This is different from RakNet which does not do this.
+		incomingMessage->length=len;
+		incomingMessage->deleteData=true; // actually means came from SPSC, rather than AllocatePacket
+		incomingMessage->systemAddress=remoteClient->systemAddress;
+		incomingMessages.Push(incomingMessage);
+	}
+	return len;
+}
 
 void TCPInterface::AttachPlugin( PluginInterface2 *plugin )
 {
@@ -899,11 +973,13 @@ RAK_THREAD_DECLARATION(RakNet::ConnectionAttemptLoop)
 	TCPInterface *tcpInterface = s->tcpInterface;
 	int newRemoteClientIndex=systemAddress.systemIndex;
 	unsigned short socketFamily = s->socketFamily;
+	char bindAddress[64];
+	strcpy(bindAddress, s->bindAddress);
 	RakNet::OP_DELETE(s, _FILE_AND_LINE_);
 
 	char str1[64];
 	systemAddress.ToString(false, str1);
-	__TCPSOCKET__ sockfd = tcpInterface->SocketConnect(str1, systemAddress.GetPort(), socketFamily, s->bindAddress);
+	__TCPSOCKET__ sockfd = tcpInterface->SocketConnect(str1, systemAddress.GetPort(), socketFamily, bindAddress);
 	if (sockfd==0)
 	{
 		tcpInterface->remoteClients[newRemoteClientIndex].isActiveMutex.Lock();
@@ -946,7 +1022,6 @@ RAK_THREAD_DECLARATION(RakNet::UpdateTCPInterfaceLoop)
 	const unsigned int BUFF_SIZE=1048576;
 	//char data[ BUFF_SIZE ];
 	char * data = (char*) rakMalloc_Ex(BUFF_SIZE,_FILE_AND_LINE_);
-	Packet *incomingMessage;
 	fd_set readFD, exceptionFD, writeFD;
 	sts->threadRunning.Increment();
 
@@ -1024,6 +1099,12 @@ RAK_THREAD_DECLARATION(RakNet::UpdateTCPInterfaceLoop)
 				FD_SET(sts->listenSocket, &exceptionFD);
 				largestDescriptor = sts->listenSocket; // @see largestDescriptor def
 			}
+			if (sts->wakeSockets[0]!=0)
+			{
+				FD_SET(sts->wakeSockets[0], &readFD);
+				if (sts->wakeSockets[0] > largestDescriptor)
+					largestDescriptor = sts->wakeSockets[0];
+			}
 
 			unsigned i;
 			for (i=0; i < (unsigned int) sts->remoteClientsLength; i++)
@@ -1059,6 +1140,17 @@ RAK_THREAD_DECLARATION(RakNet::UpdateTCPInterfaceLoop)
 			if (selectResult<=0)
 				break;
 
+			if (sts->wakeSockets[0]!=0 && FD_ISSET(sts->wakeSockets[0], &readFD))
+			{
+				// Something was buffered to send, which writeFD includes next time through the loop
+				// Clear wakePending only after reading, so a wake sent meanwhile stays readable
+				char wake[64];
+				while (recv__(sts->wakeSockets[0], wake, sizeof(wake), 0)>0)
+					;
+				while (sts->wakePending.GetValue()>0)
+					sts->wakePending.Decrement();
+			}
+
 			if (sts->listenSocket!=0 && FD_ISSET(sts->listenSocket, &readFD))
 			{
 				newSock = accept__(sts->listenSocket, (sockaddr*)&sockAddr, (socklen_t*)&sockAddrSize);
@@ -1168,37 +1260,8 @@ RAK_THREAD_DECLARATION(RakNet::UpdateTCPInterfaceLoop)
 						if (FD_ISSET(socketCopy, &readFD))
 						{
 							// if recv returns 0 this was a graceful close
-							len = sts->remoteClients[i].Recv(data,BUFF_SIZE);
-
-						
-							// removeme
-// 								data[len]=0;
-// 								printf(data);
-							
-							if (len>0)
-							{
-								incomingMessage=sts->incomingMessages.Allocate( _FILE_AND_LINE_ );
-								incomingMessage->data = (unsigned char*) rakMalloc_Ex( len+1, _FILE_AND_LINE_ );
-								memcpy(incomingMessage->data, data, len);
-								incomingMessage->data[len]=0; // Null terminate this so we can print it out as regular strings.  This is different from RakNet which does not do this.
-								// printf("RECV: %s\n",incomingMessage->data);
-								/*
-								if (1)
-								{
-									static FILE *fp=0;
-									if (fp==0)
-									{
-										fp = fopen("tcpRcv.txt", "wb");
-									}
-									fwrite(data,1,len,fp);
-								}
-								*/
-								incomingMessage->length=len;
-								incomingMessage->deleteData=true; // actually means came from SPSC, rather than AllocatePacket
-								incomingMessage->systemAddress=sts->remoteClients[i].systemAddress;
-								sts->incomingMessages.Push(incomingMessage);
-							}
-							else
+							len = sts->ReadRemoteClient(&sts->remoteClients[i],data,BUFF_SIZE);
+							if (len<=0)
 							{
 								// Connection lost gracefully
 								SystemAddress *lostConnectionSystemAddress=sts->lostConnections.Allocate( _FILE_AND_LINE_ );
@@ -1214,7 +1277,6 @@ RAK_THREAD_DECLARATION(RakNet::UpdateTCPInterfaceLoop)
 						{
 							RemoteClient *rc = &sts->remoteClients[i];
 							unsigned int bytesInBuffer;
-							int bytesAvailable;
 							int bytesSent;
 							rc->outgoingDataMutex.Lock();
 							bytesInBuffer=rc->outgoingData.GetBytesWritten();
@@ -1222,14 +1284,17 @@ RAK_THREAD_DECLARATION(RakNet::UpdateTCPInterfaceLoop)
 							{
 								unsigned int contiguousLength;
 								char* contiguousBytesPointer = rc->outgoingData.PeekContiguousBytes(&contiguousLength);
-								if (contiguousLength < (unsigned int) BUFF_SIZE && contiguousLength<bytesInBuffer)
+								if (contiguousLength<bytesInBuffer)
 								{
-									if (bytesInBuffer > BUFF_SIZE)
-										bytesAvailable=BUFF_SIZE;
-									else
-										bytesAvailable=bytesInBuffer;
-									rc->outgoingData.ReadBytes(data,bytesAvailable,true);
-									bytesSent=rc->Send(data,bytesAvailable);
+									// The buffer wrapped. Write both ends with one call rather than copying them together first
+									const char *parts[2];
+									unsigned int partLengths[2];
+									parts[0]=contiguousBytesPointer;
+									partLengths[0]=contiguousLength;
+									rc->outgoingData.IncrementReadOffset(contiguousLength);
+									parts[1]=rc->outgoingData.PeekContiguousBytes(&partLengths[1]);
+									rc->outgoingData.DecrementReadOffset(contiguousLength);
+									bytesSent=rc->SendList(parts,partLengths,2);
 								}
 								else
 								{
@@ -1249,8 +1314,9 @@ RAK_THREAD_DECLARATION(RakNet::UpdateTCPInterfaceLoop)
 			}
 		}
 
-		// Sleep 0 on Linux monopolizes the CPU
-		RakSleep(30);
+		// A select__() that timed out already waited, and sleeping again delays what arrives or is sent meanwhile. Sleep 0 on Linux monopolizes the CPU
+		if (selectResult<0)
+			RakSleep(30);
 	}
 	sts->threadRunning.Decrement();
 
@@ -1268,6 +1334,8 @@ void RemoteClient::SetActive(bool a)
 	if (isActive != a)
 	{
 		isActive=a;
+		if (isActive)
+			activationCount++;
 		Reset();
 		if (isActive==false && socket!=0)
 		{
@@ -1276,7 +1344,7 @@ void RemoteClient::SetActive(bool a)
 		}
 	}
 }
-void RemoteClient::SendOrBuffer(const char **data, const unsigned int *lengths, const int numParameters)
+bool RemoteClient::SendOrBuffer(const char **data, const unsigned int *lengths, const int numParameters)
 {
 	// True can save memory and buffer copies, but gives worse performance overall
 	// Do not use true for the XBOX, as it just locks up
@@ -1284,11 +1352,14 @@ void RemoteClient::SendOrBuffer(const char **data, const unsigned int *lengths,
 
 	int parameterIndex;
 	if (isActive==false)
-		return;
+		return false;
+	bool wasEmpty=false;
 	parameterIndex=0;
 	for (; parameterIndex < numParameters; parameterIndex++)
 	{
 		outgoingDataMutex.Lock();
+		if (parameterIndex==0)
+			wasEmpty=outgoingData.GetBytesWritten()==0;
 		if (ALLOW_SEND_FROM_USER_THREAD && outgoingData.GetBytesWritten()==0)
 		{
 			outgoingDataMutex.Unlock();
@@ -1307,6 +1378,7 @@ void RemoteClient::SendOrBuffer(const char **data, const unsigned int *lengths,
 			outgoingDataMutex.Unlock();
 		}
 	}
+	return wasEmpty;
 }
 #if OPEN_SSL_CLIENT_SUPPORT==1
 bool RemoteClient::InitSSL(SSL_CTX* ctx, SSL_METHOD *meth)
@@ -1431,6 +1503,36 @@ int RemoteClient::Recv(char *data, const int dataSize)
 #endif
 }
 #endif
+int RemoteClient::SendList(const char **data, const unsigned int *lengths, const int numParameters)
+{
+#if OPEN_SSL_CLIENT_SUPPORT==1
+	// SSL_write() takes one buffer
+	if (ssl)
+		return Send(data[0],lengths[0]);
+#endif
+#if defined(_WIN32) || defined(__native_client__)
+	(void) numParameters;
+	return Send(data[0],lengths[0]);
+#else
+	// Gathers the buffers with one system call, rather than copying them together or sending them one by one
+	const int MAX_PARTS=16;
+	struct iovec parts[MAX_PARTS];
+	int numParts=0;
+	for (int i=0; i < numParameters && numParts < MAX_PARTS; i++)
+	{
+		if (lengths[i]==0)
+			continue;
+		parts[numParts].iov_base=(void*) data[i];
+		parts[numParts].iov_len=lengths[i];
+		numParts++;
+	}
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov=parts;
+	message.msg_iovlen=numParts;
+	return (int) sendmsg(socket, &message, 0);
+#endif
+}
 
 #ifdef _MSC_VER
 #pragma warning( pop )
@@ -70,6 +70,7 @@ public:
 	void Stop(void);
 
 	/// Connect to the specified host on the specified port
+	/// \return If \a block is true, the address connected to, or UNASSIGNED_SYSTEM_ADDRESS on failure. Otherwise the address HasCompletedConnectionAttempt() or HasFailedConnectionAttempt() will later return for this attempt, or UNASSIGNED_SYSTEM_ADDRESS if it could not be started
 	SystemAddress Connect(const char* host, unsigned short remotePort, bool block=true, unsigned short socketFamily=AF_INET, const char *bindAddress=0);
 
 #if OPEN_SSL_CLIENT_SUPPORT==1
@@ -100,7 +101,7 @@ public:
 	void CloseConnection( SystemAddress systemAddress );
 
 	/// Deallocates a packet returned by Receive
-	void DeallocatePacket( Packet *packet );
+	virtual void DeallocatePacket( Packet *packet );
 
 	/// Fills the array remoteSystems with the SystemAddress of all the systems we are connected to
 	/// \param[out] remoteSystems An array of SystemAddress structures to be filled with the SystemAddresss of the systems we are connected to. Pass 0 to remoteSystems to only get the number of systems we are connected to
@@ -139,6 +140,10 @@ protected:
 
 	Packet* ReceiveInt( void );
 
+	/// Called on the update thread when \a remoteClient has data to read. Reads it into \a buffer and queues a copy in incomingMessages
+	/// \return What RemoteClient::Recv() returned. 0 or less loses the connection
+	virtual int ReadRemoteClient(RemoteClient *remoteClient, char *buffer, unsigned int bufferSize);
+
 #if defined(WINDOWS_STORE_RT)
 	bool CreateListenSocket_WinStore8(unsigned short port, unsigned short maxIncomingConnections, unsigned short socketFamily, const char *hostAddress);
 #else
@@ -183,6 +188,11 @@ protected:
 
 	int threadPriority;
 
+	// SendList() writes to wakeSockets[1] so the update thread returns from select__() to send what was buffered, rather than at the timeout. Not used on Windows
+	__TCPSOCKET__ wakeSockets[2];
+	RakNet::LocklessUint32_t wakePending;
+	void WakeUpdateThread(void);
+
 	DataStructures::List<__TCPSOCKET__> blockingSocketList;
 	SimpleMutex blockingSocketListMutex;
 
@@ -223,6 +233,7 @@ struct RemoteClient
 		ssl=0;
 #endif
 		isActive=false;
+		activationCount=0;
 #if !defined(WINDOWS_STORE_RT)
 		socket=0;
 #endif
@@ -231,6 +242,8 @@ struct RemoteClient
 	SystemAddress systemAddress;
 	DataStructures::ByteQueue outgoingData;
 	bool isActive;
+	// Incremented each time this slot is given a new connection
+	unsigned int activationCount;
 	SimpleMutex outgoingDataMutex;
 	SimpleMutex isActiveMutex;
 
@@ -245,6 +258,8 @@ struct RemoteClient
 	int Send(const char *data, unsigned int length);
 	int Recv(char *data, const int dataSize);
 #endif
+	// Writes several buffers with one call where the platform allows, else only the first
+	int SendList(const char **data, const unsigned int *lengths, const int numParameters);
 	void Reset(void)
 	{
 		outgoingDataMutex.Lock();
@@ -252,7 +267,8 @@ struct RemoteClient
 		outgoingDataMutex.Unlock();
 	}
 	void SetActive(bool a);
-	void SendOrBuffer(const char **data, const unsigned int *lengths, const int numParameters);
+	// Returns true if there was nothing buffered before, and now there is
+	bool SendOrBuffer(const char **data, const unsigned int *lengths, const int numParameters);
 };
 
 } // namespace RakNet
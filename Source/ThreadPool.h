@@ -3,7 +3,7 @@
  *  All rights reserved.
  *
  *  This source code is licensed under the BSD-style license found in the
- *  LICENSE file in the root directory of this source tree. An additional grant 
+ *  LICENSE file in the root directory of this source tree. An additional grant
  *  of patent rights can be found in the PATENTS file in the same directory.
  *
  */
@@ -17,6 +17,7 @@
 #include "Export.h"
 #include "RakThread.h"
 #include "SignaledEvent.h"
+#include "LocklessTypes.h"
 
 #ifdef _MSC_VER
 #pragma warning( push )
@@ -35,6 +36,12 @@ public:
 /// This class does not allocate or deallocate memory.  It is up to the user to handle memory management.
 /// InputType and OutputType are stored directly in a queue.  For large structures, if you plan to delete from the middle of the queue,
 /// you might wish to store pointers rather than the structures themselves so the array can shift efficiently.
+///
+/// Each thread has its own queue of input, which AddInput() fills in turn. A thread takes input from the front of its own queue, and when that is empty,
+/// takes half the input from the back of another thread's queue, so threads do not wait on one lock. With one thread, input is processed in the order added.
+/// Output goes on a list without a lock, and is moved to the output queue by the thread that reads it.
+/// A thread with nothing to do waits on an event of its own, which AddInput() sets only if the thread is waiting.
+/// Each thread also keeps the records of finished calls to AddInput() for reuse, under the same lock as its queue, so AddInput() takes one lock.
 template <class InputType, class OutputType>
 struct RAK_DLL_EXPORT ThreadPool
 {
@@ -96,6 +103,7 @@ struct RAK_DLL_EXPORT ThreadPool
 
 	/// Lock the input buffer before calling the functions InputSize, InputAtIndex, and RemoveInputAtIndex
 	/// It is only necessary to lock the input or output while the threads are running
+	/// This locks the queue of every thread, so threads cannot take input until UnlockInput()
 	void LockInput(void);
 
 	/// Unlock the input buffer after you are done with the functions InputSize, GetInputAtIndex, and RemoveInputAtIndex
@@ -105,6 +113,7 @@ struct RAK_DLL_EXPORT ThreadPool
 	unsigned InputSize(void);
 
 	/// Get the input at a specified index
+	/// Input is indexed across the queues of all threads, so the index is not the order in which input will be processed
 	InputType GetInputAtIndex(unsigned index);
 
 	/// Remove input from a specific index.  This does NOT do memory deallocation - it only removes the item from the queue
@@ -113,7 +122,7 @@ struct RAK_DLL_EXPORT ThreadPool
 	/// Lock the output buffer before calling the functions OutputSize, OutputAtIndex, and RemoveOutputAtIndex
 	/// It is only necessary to lock the input or output while the threads are running
 	void LockOutput(void);
-	
+
 	/// Unlock the output buffer after you are done with the functions OutputSize, GetOutputAtIndex, and RemoveOutputAtIndex
 	void UnlockOutput(void);
 
@@ -148,23 +157,77 @@ struct RAK_DLL_EXPORT ThreadPool
 	void Resume(void);
 
 protected:
-	// It is valid to cancel input before it is processed.  To do so, lock the inputQueue with inputQueueMutex,
-	// Scan the list, and remove the item you don't want.
-	RakNet::SimpleMutex inputQueueMutex, outputQueueMutex, workingThreadCountMutex, runThreadsMutex;
+	typedef OutputType (*WorkerThreadCallback)(InputType, bool *, void*);
+
+	/// One call to AddInput()
+	struct Job
+	{
+		WorkerThreadCallback callback;
+		InputType inputData;
+		OutputType outputData;
+		// Next on completedJobs or a list of free jobs
+		Job *next;
+	};
+
+	/// A thread, and the input given to it
+	struct Worker
+	{
+		ThreadPool<InputType, OutputType> *threadPool;
+		unsigned int index;
+		// Locked by this thread, by another thread taking input from it, by AddInput() and by LockInput()
+		RakNet::SimpleMutex jobsMutex;
+		DataStructures::Queue<Job*> jobs;
+		// Jobs AddInput() reuses for this queue. Protected by jobsMutex
+		Job *freeJobs;
+		// Jobs this thread ran that returned no output. Only used by this thread, which moves them to freeJobs when it next locks jobsMutex
+		Job *releasedJobs, *releasedJobsTail;
+		// Set to wake the thread when it is parked
+		RakNet::SignaledEvent wakeEvent;
+		// Protected by parkedMutex
+		bool isParked;
+	};
+
+	// Adds input to the queue of worker
+	void AddJob(Worker *worker, WorkerThreadCallback workerThreadCallback, InputType inputData);
+	// Takes input for worker, from its own queue or another thread's. Returns 0 if there is none, or the threads are paused
+	Job* TakeJob(Worker *worker);
+	// Called with the queue of jobs locked, to count a thread as working before it takes input from the queue
+	bool BeginJob(void);
+	// Waits until there is input, or the threads are stopping
+	void Park(Worker *worker);
+	// Wakes a parked thread, preferring worker
+	void WakeWorker(Worker *worker);
+	void WakeAllWorkers(void);
+	// Adds a job that returned output to completedJobs
+	void PushCompletedJob(Job *job);
+	// Moves output from completedJobs to outputQueue. Call with outputQueueMutex locked, or the threads stopped
+	void MoveCompletedJobsToOutput(void);
+	// Call with worker->jobsMutex locked, or with worker 0 for a job on pendingJobs
+	Job* AllocateJob(Worker *worker);
+	// Allocates JOBS_PER_BLOCK jobs at once, linked by next
+	Job* AllocateJobBlock(void);
+	// Moves the jobs worker released to its free jobs. Call with worker->jobsMutex locked, from the thread of worker
+	void ReuseReleasedJobs(Worker *worker);
+	// Returns a job to freeJobs
+	void DeallocateJob(Job *job);
+	// Finds the queue and the position in it of input index. Returns 0 if out of range
+	DataStructures::Queue<Job*>* FindInput(unsigned index, unsigned *position);
+	// Moves input from the queues of all threads to pendingJobs, and deletes the threads' queues. Call with pendingJobsMutex locked
+	void DeallocateWorkers(void);
+
+	// pendingJobs holds input added before StartThreads() was first called
+	RakNet::SimpleMutex pendingJobsMutex, outputQueueMutex, runThreadsMutex, parkedMutex, freeJobsMutex;
 
 	void* (*perThreadDataFactory)();
 	void (*perThreadDataDestructor)(void*);
 
-	// inputFunctionQueue & inputQueue are paired arrays so if you delete from one at a particular index you must delete from the other
-	// at the same index
-	DataStructures::Queue<OutputType (*)(InputType, bool *, void*)> inputFunctionQueue;
-	DataStructures::Queue<InputType> inputQueue;
+	DataStructures::Queue<Job*> pendingJobs;
 	DataStructures::Queue<OutputType> outputQueue;
 
 	ThreadDataInterface *threadDataInterface;
 	void *tdiContext;
 
-	
+
 	template <class ThreadInputType, class ThreadOutputType>
 	friend RAK_THREAD_DECLARATION(WorkerThread);
 
@@ -177,15 +240,35 @@ protected:
 	*/
 
 	/// \internal
-	bool runThreads;
+	volatile bool runThreads;
 	/// \internal
-	int numThreadsRunning;
+	volatile bool isPaused;
 	/// \internal
-	int numThreadsWorking;
+	int numThreadsRunning;
 	/// \internal
 	RakNet::SimpleMutex numThreadsRunningMutex;
 
-	RakNet::SignaledEvent quitAndIncomingDataEvents;
+	// Changed by StartThreads() with pendingJobsMutex locked. AddInput() reads them without the lock while counted in inputCallers, unless workersChanging is set
+	Worker *workers;
+	unsigned int numWorkers;
+	volatile bool workersChanging;
+	// Calls to AddInput() using workers without a lock
+	RakNet::LocklessUint32_t inputCallers;
+	// Which thread's queue AddInput() uses next
+	RakNet::LocklessUint32_t nextWorker;
+	// Input in all queues
+	RakNet::LocklessUint32_t inputCount;
+	// Threads running a callback, or about to take input
+	RakNet::LocklessUint32_t numThreadsWorking;
+	// Threads waiting on wakeEvent. Changed with parkedMutex locked, read without it
+	volatile unsigned int numParked;
+	// Jobs that returned output, most recent first. Threads push with a compare and swap, and the reader takes the whole list at once
+	Job * volatile completedJobs;
+	// Jobs freed in batches by the thread reading output, and by clearing input. Threads take the whole list when their own runs out
+	Job *freeJobs;
+	// Jobs are allocated in blocks, which are deleted with the pool. Protected by freeJobsMutex
+	DataStructures::Queue<Job*> jobBlocks;
+	enum {JOBS_PER_BLOCK=256};
 
 // #if defined(SN_TARGET_PSP2)
 // 	RakNet::RakThread::UltUlThreadRuntime *runtime;
@@ -218,15 +301,13 @@ void* WorkerThread( void* arguments )
 
 
 
-	ThreadPool<ThreadInputType, ThreadOutputType> *threadPool = (ThreadPool<ThreadInputType, ThreadOutputType>*) arguments;
+	typedef typename ThreadPool<ThreadInputType, ThreadOutputType>::Worker Worker;
+	typedef typename ThreadPool<ThreadInputType, ThreadOutputType>::Job Job;
+	Worker *worker = (Worker*) arguments;
+	ThreadPool<ThreadInputType, ThreadOutputType> *threadPool = worker->threadPool;
 
 
 	bool returnOutput;
-	ThreadOutputType (*userCallback)(ThreadInputType, bool *, void*);
-	ThreadInputType inputData;
-	ThreadOutputType callbackOutput;
-
-	userCallback=0;
 
 	void *perThreadData;
 	if (threadPool->perThreadDataFactory)
@@ -241,65 +322,44 @@ void* WorkerThread( void* arguments )
 	++threadPool->numThreadsRunning;
 	threadPool->numThreadsRunningMutex.Unlock();
 
-	while (1)
+	while (threadPool->runThreads)
 	{
-//#ifdef _WIN32
-		if (userCallback==0)
-		{
-			threadPool->quitAndIncomingDataEvents.WaitOnEvent(1000);
-		}
-// #else
-// 		if (userCallback==0)
-// 			RakSleep(30);
-// #endif
-
-		threadPool->runThreadsMutex.Lock();
-		if (threadPool->runThreads==false)
-		{
-			threadPool->runThreadsMutex.Unlock();
-			break;
-		}
-		threadPool->runThreadsMutex.Unlock();
-
-		threadPool->workingThreadCountMutex.Lock();
-		++threadPool->numThreadsWorking;
-		threadPool->workingThreadCountMutex.Unlock();
-
-		// Read input data
-		userCallback=0;
-		threadPool->inputQueueMutex.Lock();
-		if (threadPool->inputFunctionQueue.Size())
+		Job *job = threadPool->TakeJob(worker);
+		if (job==0)
 		{
-			userCallback=threadPool->inputFunctionQueue.Pop();
-			inputData=threadPool->inputQueue.Pop();
+			threadPool->Park(worker);
+			continue;
 		}
-		threadPool->inputQueueMutex.Unlock();
 
-		if (userCallback)
+		job->outputData=job->callback(job->inputData, &returnOutput,perThreadData);
+		if (returnOutput)
+			threadPool->PushCompletedJob(job);
+		else
 		{
-			callbackOutput=userCallback(inputData, &returnOutput,perThreadData);
-			if (returnOutput)
-			{
-				threadPool->outputQueueMutex.Lock();
-				threadPool->outputQueue.Push(callbackOutput, _FILE_AND_LINE_ );
-				threadPool->outputQueueMutex.Unlock();
-			}			
+			job->next=worker->releasedJobs;
+			if (worker->releasedJobs==0)
+				worker->releasedJobsTail=job;
+			worker->releasedJobs=job;
 		}
 
-		threadPool->workingThreadCountMutex.Lock();
-		--threadPool->numThreadsWorking;
-		threadPool->workingThreadCountMutex.Unlock();
+		// After the output is pushed, so IsWorking() sees one or the other
+		threadPool->numThreadsWorking.Decrement();
 	}
 
+	// StopThreads() returns, and the pool may be deleted, once numThreadsRunning is 0, so copy what is needed first
+	void (*perThreadDataDestructor)(void*) = threadPool->perThreadDataDestructor;
+	ThreadDataInterface *threadDataInterface = threadPool->threadDataInterface;
+	void *tdiContext = threadPool->tdiContext;
+
 	// Decrease numThreadsRunning
 	threadPool->numThreadsRunningMutex.Lock();
 	--threadPool->numThreadsRunning;
 	threadPool->numThreadsRunningMutex.Unlock();
-	
-	if (threadPool->perThreadDataDestructor)
-		threadPool->perThreadDataDestructor(perThreadData);
-	else if (threadPool->threadDataInterface)
-		threadPool->threadDataInterface->PerThreadDestructor(perThreadData, threadPool->tdiContext);
+
+	if (perThreadDataDestructor)
+		perThreadDataDestructor(perThreadData);
+	else if (threadDataInterface)
+		threadDataInterface->PerThreadDestructor(perThreadData, tdiContext);
 
 
 
@@ -311,10 +371,16 @@ template <class InputType, class OutputType>
 ThreadPool<InputType, OutputType>::ThreadPool()
 {
 	runThreads=false;
+	isPaused=false;
 	numThreadsRunning=0;
 	threadDataInterface=0;
 	tdiContext=0;
-	numThreadsWorking=0;
+	workers=0;
+	numWorkers=0;
+	workersChanging=false;
+	numParked=0;
+	completedJobs=0;
+	freeJobs=0;
 
 }
 template <class InputType, class OutputType>
@@ -322,6 +388,12 @@ ThreadPool<InputType, OutputType>::~ThreadPool()
 {
 	StopThreads();
 	Clear();
+	pendingJobsMutex.Lock();
+	DeallocateWorkers();
+	pendingJobsMutex.Unlock();
+	freeJobs=0;
+	while (jobBlocks.Size())
+		RakNet::OP_DELETE_ARRAY(jobBlocks.Pop(), _FILE_AND_LINE_);
 }
 template <class InputType, class OutputType>
 bool ThreadPool<InputType, OutputType>::StartThreads(int numThreads, int stackSize, void* (*_perThreadDataFactory)(), void (*_perThreadDataDestructor)(void *))
@@ -341,16 +413,54 @@ bool ThreadPool<InputType, OutputType>::StartThreads(int numThreads, int stackSi
 	}
 	runThreadsMutex.Unlock();
 
-	quitAndIncomingDataEvents.InitEvent();
-
 	perThreadDataFactory=_perThreadDataFactory;
 	perThreadDataDestructor=_perThreadDataDestructor;
 
+	// Input left from the last time the threads ran stays in their queues, unless the number of threads changed
+	pendingJobsMutex.Lock();
+	if (numWorkers!=(unsigned int) numThreads)
+	{
+		// AddInput() puts input on pendingJobs, which is locked, until this is done. Wait for calls that already read workers
+		workersChanging=true;
+		RakNet::LocklessMemoryBarrier();
+		while (inputCallers.GetValue()!=0)
+			RakSleep(0);
+
+		DeallocateWorkers();
+		if (numThreads>0)
+		{
+			workers=RakNet::OP_NEW_ARRAY<Worker>(numThreads, _FILE_AND_LINE_);
+			for (int i=0; i < numThreads; i++)
+			{
+				workers[i].threadPool=this;
+				workers[i].index=i;
+				workers[i].freeJobs=0;
+				workers[i].releasedJobs=0;
+				workers[i].releasedJobsTail=0;
+				workers[i].isParked=false;
+				workers[i].wakeEvent.InitEvent();
+			}
+			numWorkers=numThreads;
+		}
+		// So AddInput() sees the new workers once it sees workersChanging cleared
+		RakNet::LocklessMemoryBarrier();
+		workersChanging=false;
+	}
+	while (numWorkers>0 && pendingJobs.Size())
+	{
+		// AddInput() may be adding to the same queue
+		Worker *worker=workers+nextWorker.Increment()%numWorkers;
+		worker->jobsMutex.Lock();
+		worker->jobs.Push(pendingJobs.Pop(), _FILE_AND_LINE_ );
+		worker->jobsMutex.Unlock();
+	}
+	pendingJobsMutex.Unlock();
+
+	isPaused=false;
 	runThreadsMutex.Lock();
 	runThreads=true;
 	runThreadsMutex.Unlock();
 
-	numThreadsWorking=0;
 	unsigned threadId = 0;
 	(void) threadId;
 	int i;
@@ -361,7 +471,7 @@ bool ThreadPool<InputType, OutputType>::StartThreads(int numThreads, int stackSi
 
 
 
-		errorCode = RakNet::RakThread::Create(WorkerThread<InputType, OutputType>, this);
+		errorCode = RakNet::RakThread::Create(WorkerThread<InputType, OutputType>, workers+i);
 
 		if (errorCode!=0)
 		{
@@ -405,7 +515,7 @@ void ThreadPool<InputType, OutputType>::StopThreads(void)
 	bool done=false;
 	while (done==false)
 	{
-		quitAndIncomingDataEvents.SetEvent();
+		WakeAllWorkers();
 
 		RakSleep(50);
 		numThreadsRunningMutex.Lock();
@@ -414,8 +524,6 @@ void ThreadPool<InputType, OutputType>::StopThreads(void)
 		numThreadsRunningMutex.Unlock();
 	}
 
-	quitAndIncomingDataEvents.CloseEvent();
-
 // #if defined(SN_TARGET_PSP2)
 // 	RakNet::RakThread::DeallocRuntime(runtime);
 // 	runtime=0;
@@ -425,30 +533,66 @@ void ThreadPool<InputType, OutputType>::StopThreads(void)
 template <class InputType, class OutputType>
 void ThreadPool<InputType, OutputType>::AddInput(OutputType (*workerThreadCallback)(InputType, bool *returnOutput, void* perThreadData), InputType inputData)
 {
-	inputQueueMutex.Lock();
-	inputQueue.Push(inputData, _FILE_AND_LINE_ );
-	inputFunctionQueue.Push(workerThreadCallback, _FILE_AND_LINE_ );
-	inputQueueMutex.Unlock();
+	// Counted before reading workersChanging, and StartThreads() sets it before reading inputCallers, so either this sees it set or StartThreads() waits
+	inputCallers.Increment();
+	if (workersChanging==false && numWorkers>0)
+	{
+		AddJob(workers+nextWorker.Increment()%numWorkers, workerThreadCallback, inputData);
+		inputCallers.Decrement();
+		return;
+	}
+	inputCallers.Decrement();
 
-	quitAndIncomingDataEvents.SetEvent();
+	// No threads, or StartThreads() is changing them. It does so with pendingJobsMutex locked
+	pendingJobsMutex.Lock();
+	if (numWorkers>0)
+	{
+		AddJob(workers+nextWorker.Increment()%numWorkers, workerThreadCallback, inputData);
+	}
+	else
+	{
+		Job *job = AllocateJob(0);
+		job->callback=workerThreadCallback;
+		job->inputData=inputData;
+		pendingJobs.Push(job, _FILE_AND_LINE_ );
+		inputCount.Increment();
+	}
+	pendingJobsMutex.Unlock();
+}
+template <class InputType, class OutputType>
+void ThreadPool<InputType, OutputType>::AddJob(Worker *worker, WorkerThreadCallback workerThreadCallback, InputType inputData)
+{
+	worker->jobsMutex.Lock();
+	Job *job = AllocateJob(worker);
+	job->callback=workerThreadCallback;
+	job->inputData=inputData;
+	worker->jobs.Push(job, _FILE_AND_LINE_ );
+	inputCount.Increment();
+	worker->jobsMutex.Unlock();
+
+	// inputCount.Increment() is a full barrier, and Park() increments numParked before it reads inputCount, so one of the two sees the other
+	if (numParked>0)
+		WakeWorker(worker);
 }
 template <class InputType, class OutputType>
 void ThreadPool<InputType, OutputType>::AddOutput(OutputType outputData)
 {
 	outputQueueMutex.Lock();
+	MoveCompletedJobsToOutput();
 	outputQueue.Push(outputData, _FILE_AND_LINE_ );
 	outputQueueMutex.Unlock();
 }
 template <class InputType, class OutputType>
 bool ThreadPool<InputType, OutputType>::HasOutputFast(void)
 {
-	return outputQueue.IsEmpty()==false;
+	return outputQueue.IsEmpty()==false || completedJobs!=0;
 }
 template <class InputType, class OutputType>
 bool ThreadPool<InputType, OutputType>::HasOutput(void)
 {
 	bool res;
 	outputQueueMutex.Lock();
+	MoveCompletedJobsToOutput();
 	res=outputQueue.IsEmpty()==false;
 	outputQueueMutex.Unlock();
 	return res;
@@ -456,16 +600,12 @@ bool ThreadPool<InputType, OutputType>::HasOutput(void)
 template <class InputType, class OutputType>
 bool ThreadPool<InputType, OutputType>::HasInputFast(void)
 {
-	return inputQueue.IsEmpty()==false;
+	return inputCount.GetValue()>0;
 }
 template <class InputType, class OutputType>
 bool ThreadPool<InputType, OutputType>::HasInput(void)
 {
-	bool res;
-	inputQueueMutex.Lock();
-	res=inputQueue.IsEmpty()==false;
-	inputQueueMutex.Unlock();
-	return res;
+	return inputCount.GetValue()>0;
 }
 template <class InputType, class OutputType>
 OutputType ThreadPool<InputType, OutputType>::GetOutput(void)
@@ -473,6 +613,7 @@ OutputType ThreadPool<InputType, OutputType>::GetOutput(void)
 	// Real output check
 	OutputType output;
 	outputQueueMutex.Lock();
+	MoveCompletedJobsToOutput();
 	output=outputQueue.Pop();
 	outputQueueMutex.Unlock();
 	return output;
@@ -484,52 +625,89 @@ void ThreadPool<InputType, OutputType>::Clear(void)
 	if (runThreads)
 	{
 		runThreadsMutex.Unlock();
-		inputQueueMutex.Lock();
-		inputFunctionQueue.Clear(_FILE_AND_LINE_);
-		inputQueue.Clear(_FILE_AND_LINE_);
-		inputQueueMutex.Unlock();
+		LockInput();
+		ClearInput();
+		UnlockInput();
 
 		outputQueueMutex.Lock();
+		MoveCompletedJobsToOutput();
 		outputQueue.Clear(_FILE_AND_LINE_);
 		outputQueueMutex.Unlock();
 	}
 	else
 	{
-		inputFunctionQueue.Clear(_FILE_AND_LINE_);
-		inputQueue.Clear(_FILE_AND_LINE_);
-		outputQueue.Clear(_FILE_AND_LINE_);
+		runThreadsMutex.Unlock();
+		ClearInput();
+		ClearOutput();
 	}
 }
 template <class InputType, class OutputType>
 void ThreadPool<InputType, OutputType>::LockInput(void)
 {
-	inputQueueMutex.Lock();
+	// Same order as TakeJob() locks two queues in
+	pendingJobsMutex.Lock();
+	for (unsigned int i=0; i < numWorkers; i++)
+		workers[i].jobsMutex.Lock();
 }
 template <class InputType, class OutputType>
 void ThreadPool<InputType, OutputType>::UnlockInput(void)
 {
-	inputQueueMutex.Unlock();
+	for (unsigned int i=numWorkers; i > 0; i--)
+		workers[i-1].jobsMutex.Unlock();
+	pendingJobsMutex.Unlock();
 }
 template <class InputType, class OutputType>
 unsigned ThreadPool<InputType, OutputType>::InputSize(void)
 {
-	return inputQueue.Size();
+	unsigned size=pendingJobs.Size();
+	for (unsigned int i=0; i < numWorkers; i++)
+		size+=workers[i].jobs.Size();
+	return size;
+}
+template <class InputType, class OutputType>
+DataStructures::Queue<typename ThreadPool<InputType, OutputType>::Job*>* ThreadPool<InputType, OutputType>::FindInput(unsigned index, unsigned *position)
+{
+	if (index < pendingJobs.Size())
+	{
+		*position=index;
+		return &pendingJobs;
+	}
+	index-=pendingJobs.Size();
+	for (unsigned int i=0; i < numWorkers; i++)
+	{
+		if (index < workers[i].jobs.Size())
+		{
+			*position=index;
+			return &workers[i].jobs;
+		}
+		index-=workers[i].jobs.Size();
+	}
+	return 0;
 }
 template <class InputType, class OutputType>
 InputType ThreadPool<InputType, OutputType>::GetInputAtIndex(unsigned index)
 {
-	return inputQueue[index];
+	unsigned position;
+	DataStructures::Queue<Job*> *queue=FindInput(index, &position);
+	RakAssert(queue);
+	return (*queue)[position]->inputData;
 }
 template <class InputType, class OutputType>
 void ThreadPool<InputType, OutputType>::RemoveInputAtIndex(unsigned index)
 {
-	inputQueue.RemoveAtIndex(index);
-	inputFunctionQueue.RemoveAtIndex(index);
+	unsigned position;
+	DataStructures::Queue<Job*> *queue=FindInput(index, &position);
+	RakAssert(queue);
+	Job *job=(*queue)[position];
+	queue->RemoveAtIndex(position);
+	inputCount.Decrement();
+	DeallocateJob(job);
 }
 template <class InputType, class OutputType>
 void ThreadPool<InputType, OutputType>::LockOutput(void)
 {
 	outputQueueMutex.Lock();
+	MoveCompletedJobsToOutput();
 }
 template <class InputType, class OutputType>
 void ThreadPool<InputType, OutputType>::UnlockOutput(void)
@@ -539,6 +717,8 @@ void ThreadPool<InputType, OutputType>::UnlockOutput(void)
 template <class InputType, class OutputType>
 unsigned ThreadPool<InputType, OutputType>::OutputSize(void)
 {
+	// Called with the output locked, or the threads stopped
+	MoveCompletedJobsToOutput();
 	return outputQueue.Size();
 }
 template <class InputType, class OutputType>
@@ -554,47 +734,44 @@ void ThreadPool<InputType, OutputType>::RemoveOutputAtIndex(unsigned index)
 template <class InputType, class OutputType>
 void ThreadPool<InputType, OutputType>::ClearInput(void)
 {
-	inputQueue.Clear(_FILE_AND_LINE_);
-	inputFunctionQueue.Clear(_FILE_AND_LINE_);
+	while (pendingJobs.Size())
+	{
+		DeallocateJob(pendingJobs.Pop());
+		inputCount.Decrement();
+	}
+	for (unsigned int i=0; i < numWorkers; i++)
+	{
+		while (workers[i].jobs.Size())
+		{
+			DeallocateJob(workers[i].jobs.Pop());
+			inputCount.Decrement();
+		}
+	}
 }
 
 template <class InputType, class OutputType>
 void ThreadPool<InputType, OutputType>::ClearOutput(void)
 {
+	MoveCompletedJobsToOutput();
 	outputQueue.Clear(_FILE_AND_LINE_);
 }
 template <class InputType, class OutputType>
 bool ThreadPool<InputType, OutputType>::IsWorking(void)
 {
-	bool isWorking;
-//	workingThreadCountMutex.Lock();
-//	isWorking=numThreadsWorking!=0;
-//	workingThreadCountMutex.Unlock();
-
-//	if (isWorking)
-//		return true;
-
-	// Bug fix: Originally the order of these two was reversed.
-	// It's possible with the thread timing that working could have been false, then it picks up the data in the other thread, then it checks
-	// here and sees there is no data.  So it thinks the thread is not working when it was.
-	if (HasOutputFast() && HasOutput())
-		return true;
-
+	// A job goes from input, to working, to output, and is counted in the next before it leaves the last. Checking in the same order cannot miss it
 	if (HasInputFast() && HasInput())
 		return true;
 
-	// Need to check is working again, in case the thread was between the first and second checks
-	workingThreadCountMutex.Lock();
-	isWorking=numThreadsWorking!=0;
-	workingThreadCountMutex.Unlock();
+	if (numThreadsWorking.GetValue()!=0)
+		return true;
 
-	return isWorking;
+	return HasOutputFast() && HasOutput();
 }
 
 template <class InputType, class OutputType>
 int ThreadPool<InputType, OutputType>::NumThreadsWorking(void)
 {
-	return numThreadsWorking;
+	return (int) numThreadsWorking.GetValue();
 }
 
 template <class InputType, class OutputType>
@@ -612,8 +789,10 @@ bool ThreadPool<InputType, OutputType>::Pause(void)
 	if (WasStarted()==false)
 		return false;
 
-	workingThreadCountMutex.Lock();
-	while (numThreadsWorking>0)
+	isPaused=true;
+	// BeginJob() counts itself working before it reads isPaused, so once this sees no threads working, none will start
+	RakNet::LocklessMemoryBarrier();
+	while (numThreadsWorking.GetValue()>0)
 	{
 		RakSleep(30);
 	}
@@ -622,7 +801,266 @@ bool ThreadPool<InputType, OutputType>::Pause(void)
 template <class InputType, class OutputType>
 void ThreadPool<InputType, OutputType>::Resume(void)
 {
-	workingThreadCountMutex.Unlock();
+	isPaused=false;
+	WakeAllWorkers();
+}
+template <class InputType, class OutputType>
+bool ThreadPool<InputType, OutputType>::BeginJob(void)
+{
+	numThreadsWorking.Increment();
+	if (isPaused)
+	{
+		numThreadsWorking.Decrement();
+		return false;
+	}
+	return true;
+}
+template <class InputType, class OutputType>
+typename ThreadPool<InputType, OutputType>::Job* ThreadPool<InputType, OutputType>::TakeJob(Worker *worker)
+{
+	Job *job=0;
+
+	// Own input, oldest first
+	if (worker->jobs.IsEmpty()==false)
+	{
+		worker->jobsMutex.Lock();
+		ReuseReleasedJobs(worker);
+		if (worker->jobs.IsEmpty()==false && BeginJob())
+		{
+			job=worker->jobs.Pop();
+			inputCount.Decrement();
+		}
+		worker->jobsMutex.Unlock();
+		if (job)
+			return job;
+	}
+
+	if (inputCount.GetValue()==0)
+		return 0;
+
+	// Steal half of another thread's input, newest first, starting with the next thread along
+	for (unsigned int i=1; i < numWorkers; i++)
+	{
+		Worker *victim=workers+(worker->index+i)%numWorkers;
+		if (victim->jobs.IsEmpty())
+			continue;
+
+		// Both queues are locked, so input is never outside a queue where LockInput() cannot see it
+		Worker *first = victim->index < worker->index ? victim : worker;
+		Worker *second = victim->index < worker->index ? worker : victim;
+		first->jobsMutex.Lock();
+		second->jobsMutex.Lock();
+		ReuseReleasedJobs(worker);
+		unsigned int victimSize=victim->jobs.Size();
+		if (victimSize>0 && BeginJob())
+		{
+			job=victim->jobs.PopTail();
+			inputCount.Decrement();
+			for (unsigned int count=victimSize/2; count > 0; count--)
+				worker->jobs.Push(victim->jobs.PopTail(), _FILE_AND_LINE_ );
+		}
+		second->jobsMutex.Unlock();
+		first->jobsMutex.Unlock();
+		if (job)
+			return job;
+	}
+	return 0;
+}
+template <class InputType, class OutputType>
+void ThreadPool<InputType, OutputType>::Park(Worker *worker)
+{
+	// AddInput() can only reuse them from freeJobs
+	if (worker->releasedJobs)
+	{
+		worker->jobsMutex.Lock();
+		ReuseReleasedJobs(worker);
+		worker->jobsMutex.Unlock();
+	}
+
+	parkedMutex.Lock();
+	worker->isParked=true;
+	numParked++;
+	parkedMutex.Unlock();
+
+	// Pairs with the barrier in AddInput(), so input added now either wakes this thread or is seen here
+	RakNet::LocklessMemoryBarrier();
+	if (runThreads && (inputCount.GetValue()==0 || isPaused))
+		worker->wakeEvent.WaitOnEvent(1000);
+
+	parkedMutex.Lock();
+	if (worker->isParked)
+	{
+		worker->isParked=false;
+		numParked--;
+	}
+	parkedMutex.Unlock();
+}
+template <class InputType, class OutputType>
+void ThreadPool<InputType, OutputType>::WakeWorker(Worker *worker)
+{
+	parkedMutex.Lock();
+	if (worker->isParked==false)
+	{
+		// The thread given the input is busy, so wake another to take it
+		worker=0;
+		for (unsigned int i=0; i < numWorkers; i++)
+		{
+			if (workers[i].isParked)
+			{
+				worker=workers+i;
+				break;
+			}
+		}
+	}
+	if (worker)
+	{
+		worker->isParked=false;
+		numParked--;
+	}
+	parkedMutex.Unlock();
+
+	if (worker)
+		worker->wakeEvent.SetEvent();
+}
+template <class InputType, class OutputType>
+void ThreadPool<InputType, OutputType>::WakeAllWorkers(void)
+{
+	for (unsigned int i=0; i < numWorkers; i++)
+		workers[i].wakeEvent.SetEvent();
+}
+template <class InputType, class OutputType>
+void ThreadPool<InputType, OutputType>::PushCompletedJob(Job *job)
+{
+	Job *head;
+	do
+	{
+		head=completedJobs;
+		job->next=head;
+	} while (RakNet::LocklessCompareExchangePointer((void * volatile *) &completedJobs, head, job)!=head);
+}
+template <class InputType, class OutputType>
+void ThreadPool<InputType, OutputType>::MoveCompletedJobsToOutput(void)
+{
+	if (completedJobs==0)
+		return;
+
+	Job *job=(Job*) RakNet::LocklessExchangePointer((void * volatile *) &completedJobs, 0);
+
+	// Reverse, so output is in the order it completed
+	Job *reversed=0;
+	while (job)
+	{
+		Job *next=job->next;
+		job->next=reversed;
+		reversed=job;
+		job=next;
+	}
+	Job *last=reversed;
+	for (job=reversed; job; job=job->next)
+	{
+		outputQueue.Push(job->outputData, _FILE_AND_LINE_ );
+		last=job;
+	}
+
+	// Free the jobs with one lock
+	freeJobsMutex.Lock();
+	last->next=freeJobs;
+	freeJobs=reversed;
+	freeJobsMutex.Unlock();
+}
+template <class InputType, class OutputType>
+typename ThreadPool<InputType, OutputType>::Job* ThreadPool<InputType, OutputType>::AllocateJob(Worker *worker)
+{
+	Job *job;
+	if (worker)
+	{
+		if (worker->freeJobs==0)
+		{
+			// Take every job freed since this last ran out, so freeJobsMutex is locked once per batch
+			freeJobsMutex.Lock();
+			worker->freeJobs=freeJobs;
+			freeJobs=0;
+			freeJobsMutex.Unlock();
+		}
+		if (worker->freeJobs==0)
+			worker->freeJobs=AllocateJobBlock();
+		job=worker->freeJobs;
+		worker->freeJobs=job->next;
+	}
+	else
+	{
+		freeJobsMutex.Lock();
+		job=freeJobs;
+		if (job)
+			freeJobs=job->next;
+		freeJobsMutex.Unlock();
+		if (job==0)
+		{
+			// Keep the rest of the block, which ends at its last job
+			job=AllocateJobBlock();
+			freeJobsMutex.Lock();
+			job[JOBS_PER_BLOCK-1].next=freeJobs;
+			freeJobs=job->next;
+			freeJobsMutex.Unlock();
+		}
+	}
+	return job;
+}
+template <class InputType, class OutputType>
+typename ThreadPool<InputType, OutputType>::Job* ThreadPool<InputType, OutputType>::AllocateJobBlock(void)
+{
+	// Allocating one job at a time costs more than running an empty callback
+	Job *block=RakNet::OP_NEW_ARRAY<Job>(JOBS_PER_BLOCK, _FILE_AND_LINE_);
+	for (unsigned int i=0; i < JOBS_PER_BLOCK-1; i++)
+		block[i].next=block+i+1;
+	block[JOBS_PER_BLOCK-1].next=0;
+	freeJobsMutex.Lock();
+	jobBlocks.Push(block, _FILE_AND_LINE_ );
+	freeJobsMutex.Unlock();
+	return block;
+}
+template <class InputType, class OutputType>
+void ThreadPool<InputType, OutputType>::ReuseReleasedJobs(Worker *worker)
+{
+	if (worker->releasedJobs==0)
+		return;
+	worker->releasedJobsTail->next=worker->freeJobs;
+	worker->freeJobs=worker->releasedJobs;
+	worker->releasedJobs=0;
+	worker->releasedJobsTail=0;
+}
+template <class InputType, class OutputType>
+void ThreadPool<InputType, OutputType>::DeallocateJob(Job *job)
+{
+	freeJobsMutex.Lock();
+	job->next=freeJobs;
+	freeJobs=job;
+	freeJobsMutex.Unlock();
+}
+template <class InputType, class OutputType>
+void ThreadPool<InputType, OutputType>::DeallocateWorkers(void)
+{
+	if (workers==0)
+		return;
+
+	for (unsigned int i=0; i < numWorkers; i++)
+	{
+		while (workers[i].jobs.Size())
+			pendingJobs.Push(workers[i].jobs.Pop(), _FILE_AND_LINE_ );
+		ReuseReleasedJobs(workers+i);
+		while (workers[i].freeJobs)
+		{
+			Job *job=workers[i].freeJobs;
+			workers[i].freeJobs=job->next;
+			DeallocateJob(job);
+		}
+		workers[i].wakeEvent.CloseEvent();
+	}
+
+	// AddInput() uses pendingJobs from here on
+	numWorkers=0;
+	RakNet::OP_DELETE_ARRAY(workers, _FILE_AND_LINE_);
+	workers=0;
 }
 
 #ifdef _MSC_VER
@@ -630,4 +1068,3 @@ void ThreadPool<InputType, OutputType>::Resume(void)
 #endif
 
 #endif
-
@@ -12,8 +12,19 @@
 
 using namespace RakNet;
 
-VariableDeltaSerializer::VariableDeltaSerializer() {didComparisonThisTick=false;}
-VariableDeltaSerializer::~VariableDeltaSerializer() {RemoveRemoteSystemVariableHistory();}
+VariableDeltaSerializer::VariableDeltaSerializer()
+{
+	didComparisonThisTick=false;
+	tickSnapshot=0;
+	changedSnapshotBlocks=0;
+	changedSnapshotBlocksLength=0;
+}
+VariableDeltaSerializer::~VariableDeltaSerializer()
+{
+	ClearSnapshotUpdates();
+	rakFree_Ex(changedSnapshotBlocks,_FILE_AND_LINE_);
+	RemoveRemoteSystemVariableHistory();
+}
 
 VariableDeltaSerializer::SerializationContext::SerializationContext() {variableHistoryIdentical=0; variableHistoryUnique=0;}
 VariableDeltaSerializer::SerializationContext::~SerializationContext() {}
@@ -191,7 +202,11 @@ void VariableDeltaSerializer::DirtyAndFreeVarsAssociatedWithReceipt(RakNetGUID g
 	if (objectExists)
 	{
 		// 'Dirty' all variables sent this update, meaning they will be resent the next time Serialize() is called
-		vprs->variableListDeltaTracker.FlagDirtyFromBitArray(vprs->updatedVariablesHistory[idx2]->bitField);
+		VariableListDeltaTracker::SnapshotBuffer *snapshotBlocks = vprs->updatedVariablesHistory[idx2]->snapshotBlocks;
+		if (snapshotBlocks)
+			vprs->variableListDeltaTracker.FlagDirtySnapshotBlocks(snapshotBlocks->data, snapshotBlocks->byteLength*8);
+		else
+			vprs->variableListDeltaTracker.FlagDirtyFromBitArray(vprs->updatedVariablesHistory[idx2]->bitField);
 
 		// Free this history node
 		FreeChangedVariablesList(vprs->updatedVariablesHistory[idx2]);
@@ -234,10 +249,13 @@ VariableDeltaSerializer::ChangedVariablesList *VariableDeltaSerializer::AllocCha
 	VariableDeltaSerializer::ChangedVariablesList *p = updatedVariablesMemoryPool.Allocate(_FILE_AND_LINE_);
 	p->bitWriteIndex=0;
 	p->bitField[0]=0;
+	p->snapshotBlocks=0;
 	return p;
 }
 void VariableDeltaSerializer::FreeChangedVariablesList(ChangedVariablesList *changedVariables)
 {
+	if (changedVariables->snapshotBlocks)
+		VariableListDeltaTracker::ReleaseSnapshotBuffer(changedVariables->snapshotBlocks);
 	updatedVariablesMemoryPool.Release(changedVariables, _FILE_AND_LINE_);
 }
 void VariableDeltaSerializer::StoreChangedVariablesList(RemoteSystemVariableHistory *variableHistory, ChangedVariablesList *changedVariables, uint32_t sendReceipt)
@@ -282,4 +300,179 @@ unsigned int VariableDeltaSerializer::GetRemoteSystemHistoryListIndex(RakNetGUID
 void VariableDeltaSerializer::OnPreSerializeTick(void)
 {
 	didComparisonThisTick=false;
+	ClearSnapshotUpdates();
+}
+
+// Makes the last sent snapshot a copy of this one, reusing its buffer if no other system shares it
+static void RecordSnapshot(VariableListDeltaTracker *variableListDeltaTracker, const unsigned char *snapshot, unsigned int byteLength)
+{
+	VariableListDeltaTracker::SnapshotBuffer *lastSnapshot = variableListDeltaTracker->GetSnapshot();
+	if (lastSnapshot && lastSnapshot->refCount==1 && lastSnapshot->byteLength==byteLength)
+	{
+		memcpy(lastSnapshot->data,snapshot,byteLength);
+		return;
+	}
+	VariableListDeltaTracker::SnapshotBuffer *snapshotBuffer = VariableListDeltaTracker::AllocSnapshotBuffer(snapshot,byteLength);
+	variableListDeltaTracker->SetSnapshot(snapshotBuffer);
+	VariableListDeltaTracker::ReleaseSnapshotBuffer(snapshotBuffer);
+}
+
+void VariableDeltaSerializer::SerializeSnapshot(SerializationContext *context, const BitStream *snapshot)
+{
+	const unsigned char *data = snapshot->GetData();
+	unsigned int byteLength = snapshot->GetNumberOfBytesUsed();
+	unsigned int numBlocks = VariableListDeltaTracker::GetNumSnapshotBlocks(byteLength);
+	VariableListDeltaTracker *variableListDeltaTracker = &context->variableHistory->variableListDeltaTracker;
+	bool anyBlocksChanged;
+
+	if (context->newSystemSend)
+	{
+		if (variableListDeltaTracker->GetSnapshot())
+		{
+			// previously sent data to another system
+			unsigned char *blocks = GetChangedSnapshotBlocks(numBlocks);
+			memset(blocks,0xFF,(numBlocks+7)/8);
+			context->bitStream->Write(true);
+			context->bitStream->AlignWriteToByteBoundary();
+			VariableListDeltaTracker::WriteSnapshotBlocks(data, byteLength, blocks, context->bitStream);
+			context->anyVariablesWritten=true;
+			return;
+		}
+		// never sent data to another system, so record it below
+	}
+	else if (context->serializationMode==UNRELIABLE_WITH_ACK_RECEIPT)
+	{
+		// Every system sent the same snapshot this tick shares one copy of it
+		if (tickSnapshot==0 || tickSnapshot->byteLength!=byteLength || memcmp(tickSnapshot->data,data,byteLength)!=0)
+		{
+			ClearSnapshotUpdates();
+			tickSnapshot=VariableListDeltaTracker::AllocSnapshotBuffer(data,byteLength);
+		}
+
+		VariableListDeltaTracker::SnapshotBuffer *baseline = variableListDeltaTracker->GetSnapshot();
+		VariableListDeltaTracker::SnapshotBuffer *snapshotBlocks;
+		if (variableListDeltaTracker->HasDirtySnapshotBlocks()==false)
+		{
+			// Systems in sync with each other get the same update
+			SnapshotUpdate *snapshotUpdate=0;
+			unsigned int idx;
+			for (idx=0; idx < snapshotUpdates.Size(); idx++)
+			{
+				if (snapshotUpdates[idx]->baseline==baseline)
+				{
+					snapshotUpdate=snapshotUpdates[idx];
+					break;
+				}
+			}
+			if (snapshotUpdate==0)
+			{
+				snapshotUpdate = RakNet::OP_NEW<SnapshotUpdate>(_FILE_AND_LINE_);
+				snapshotUpdate->baseline=baseline;
+				if (baseline)
+					VariableListDeltaTracker::AddSnapshotReference(baseline);
+				snapshotUpdate->anyBlocksChanged=GetSnapshotChanges(variableListDeltaTracker, data, byteLength);
+				if (snapshotUpdate->anyBlocksChanged)
+					VariableListDeltaTracker::WriteSnapshotBlocks(data, byteLength, changedSnapshotBlocks, &snapshotUpdate->bitStream);
+				snapshotUpdate->snapshotBlocks=VariableListDeltaTracker::AllocSnapshotBuffer(changedSnapshotBlocks,(numBlocks+7)/8);
+				snapshotUpdates.Push(snapshotUpdate,_FILE_AND_LINE_);
+			}
+
+			anyBlocksChanged=snapshotUpdate->anyBlocksChanged;
+			context->bitStream->Write(anyBlocksChanged);
+			if (anyBlocksChanged)
+			{
+				context->bitStream->AlignWriteToByteBoundary();
+				context->bitStream->Write(&snapshotUpdate->bitStream);
+				snapshotUpdate->bitStream.ResetReadPointer();
+			}
+			snapshotBlocks=snapshotUpdate->snapshotBlocks;
+			VariableListDeltaTracker::AddSnapshotReference(snapshotBlocks);
+		}
+		else
+		{
+			// Resending lost blocks to this system only
+			anyBlocksChanged=GetSnapshotChanges(variableListDeltaTracker, data, byteLength);
+			context->bitStream->Write(anyBlocksChanged);
+			if (anyBlocksChanged)
+			{
+				context->bitStream->AlignWriteToByteBoundary();
+				VariableListDeltaTracker::WriteSnapshotBlocks(data, byteLength, changedSnapshotBlocks, context->bitStream);
+			}
+			snapshotBlocks=VariableListDeltaTracker::AllocSnapshotBuffer(changedSnapshotBlocks,(numBlocks+7)/8);
+		}
+
+		// So that if this send is lost, the blocks it held are flagged dirty
+		if (context->changedVariables->snapshotBlocks)
+			VariableListDeltaTracker::ReleaseSnapshotBuffer(context->changedVariables->snapshotBlocks);
+		context->changedVariables->snapshotBlocks=snapshotBlocks;
+		variableListDeltaTracker->SetSnapshot(tickSnapshot);
+		context->anyVariablesWritten|=anyBlocksChanged;
+		return;
+	}
+	else if (context->variableHistoryIdentical && didComparisonThisTick)
+	{
+		// Bitstream is written at the end
+		return;
+	}
+
+	anyBlocksChanged=GetSnapshotChanges(variableListDeltaTracker, data, byteLength);
+	context->bitStream->Write(anyBlocksChanged);
+	if (anyBlocksChanged)
+	{
+		context->bitStream->AlignWriteToByteBoundary();
+		VariableListDeltaTracker::WriteSnapshotBlocks(data, byteLength, changedSnapshotBlocks, context->bitStream);
+		RecordSnapshot(variableListDeltaTracker, data, byteLength);
+	}
+	context->anyVariablesWritten|=anyBlocksChanged;
+}
+
+bool VariableDeltaSerializer::DeserializeSnapshot(DeserializationContext *context, BitStream *snapshot)
+{
+	bool anyBlocksChanged;
+	if (context->bitStream->Read(anyBlocksChanged)==false || anyBlocksChanged==false)
+		return false;
+	context->bitStream->AlignReadToByteBoundary();
+	return VariableListDeltaTracker::ReadSnapshotBlocks(context->bitStream, snapshot);
+}
+
+unsigned char *VariableDeltaSerializer::GetChangedSnapshotBlocks(unsigned int numBlocks)
+{
+	unsigned int numBytes = (numBlocks+7)/8;
+	if (numBytes > changedSnapshotBlocksLength)
+	{
+		changedSnapshotBlocks = (unsigned char*) rakRealloc_Ex(changedSnapshotBlocks,numBytes,_FILE_AND_LINE_);
+		changedSnapshotBlocksLength=numBytes;
+	}
+	return changedSnapshotBlocks;
+}
+
+bool VariableDeltaSerializer::GetSnapshotChanges(VariableListDeltaTracker *variableListDeltaTracker, const unsigned char *snapshot, unsigned int byteLength)
+{
+	unsigned int numBlocks = VariableListDeltaTracker::GetNumSnapshotBlocks(byteLength);
+	unsigned char *blocks = GetChangedSnapshotBlocks(numBlocks);
+	bool anyBlocksChanged = VariableListDeltaTracker::GetChangedSnapshotBlocks(variableListDeltaTracker->GetSnapshot(), snapshot, byteLength, blocks);
+	if (variableListDeltaTracker->TakeDirtySnapshotBlocks(blocks, numBlocks))
+		anyBlocksChanged=true;
+	// The first send always goes out, so the receiver learns the length even if it is 0
+	if (variableListDeltaTracker->GetSnapshot()==0)
+		anyBlocksChanged=true;
+	return anyBlocksChanged;
+}
+
+void VariableDeltaSerializer::ClearSnapshotUpdates(void)
+{
+	unsigned int idx;
+	for (idx=0; idx < snapshotUpdates.Size(); idx++)
+	{
+		if (snapshotUpdates[idx]->baseline)
+			VariableListDeltaTracker::ReleaseSnapshotBuffer(snapshotUpdates[idx]->baseline);
+		VariableListDeltaTracker::ReleaseSnapshotBuffer(snapshotUpdates[idx]->snapshotBlocks);
+		RakNet::OP_DELETE(snapshotUpdates[idx],_FILE_AND_LINE_);
+	}
+	snapshotUpdates.Clear(false,_FILE_AND_LINE_);
+	if (tickSnapshot)
+	{
+		VariableListDeltaTracker::ReleaseSnapshotBuffer(tickSnapshot);
+		tickSnapshot=0;
+	}
 }
@@ -36,6 +36,8 @@ namespace RakNet
 /// 1. Call BeginDeserialize(). In the case of Replica3, this would be in the Deserialize() call<BR>
 /// 2. Call DeserializeVariable() for each variable, in the same order as was Serialized()<BR>
 /// 3. Call EndSerialize()<BR>
+///<BR>
+/// For objects with many variables, use bulk mode: write every variable to one BitStream, and call SerializeSnapshot() and DeserializeSnapshot() instead of SerializeVariable() and DeserializeVariable()<BR>
 /// \sa The ReplicaManager3 sample
 class RAK_DLL_EXPORT VariableDeltaSerializer
 {
@@ -210,6 +212,22 @@ public:
 		return VariableListDeltaTracker::ReadVarFromBitstream(variable, context->bitStream);
 	}
 
+	/// \brief Bulk mode. Call once instead of calling SerializeVariable() for each variable
+	/// Write every variable to \a snapshot, in the same order each time. The snapshot is kept as one buffer and compared against the last sent in 4 byte blocks using SSE2 where available, and only the blocks that changed are written.
+	/// Remote systems that were last sent the same data share one copy of it. With BeginUnreliableAckedSerialize(), systems that have not lost any sends also share one written update per object per tick.
+	/// For objects with hundreds of variables this is far faster than SerializeVariable(), and the memory used does not grow with the number of variables per remote system.
+	/// \pre You have called BeginUnreliableAckedSerialize(), BeginUniqueSerialize(), or BeginIdenticalSerialize(). Do not also call SerializeVariable() before EndSerialize()
+	/// \param[in] context Same context pointer passed to BeginUnreliableAckedSerialize(), BeginUniqueSerialize(), or BeginIdenticalSerialize()
+	/// \param[in] snapshot Every variable of the object, written with BitStream::Write(). At most MAX_SNAPSHOT_BYTE_LENGTH bytes, or the receiver discards it
+	void SerializeSnapshot(SerializationContext *context, const BitStream *snapshot);
+
+	/// \brief Bulk mode. Paired with SerializeSnapshot()
+	/// \pre You have called BeginDeserialize()
+	/// \param[in] context Same context pointer passed to BeginDeserialize()
+	/// \param[in,out] snapshot Keep one per object between calls. The blocks that changed are copied into it, and the read pointer reset so the variables can be read in the order written
+	/// \return true if \a snapshot was changed
+	bool DeserializeSnapshot(DeserializationContext *context, BitStream *snapshot);
+
 
 
 protected:
@@ -221,6 +239,8 @@ protected:
 		uint32_t sendReceipt;
 		unsigned short bitWriteIndex;
 		unsigned char bitField[56];
+		// Bulk mode, one bit per block sent. Shared with the other systems sent the same update
+		VariableListDeltaTracker::SnapshotBuffer *snapshotBlocks;
 	};
 
 	// static int Replica2ObjectComp( const uint32_t &key, ChangedVariablesList* const &data );
@@ -246,6 +266,26 @@ protected:
 	bool didComparisonThisTick;
 	RakNet::BitStream identicalSerializationBs;
 
+	// Bulk mode. An update written with BeginUnreliableAckedSerialize() this tick, for every system whose last sent snapshot was baseline and has no dirty blocks
+	struct SnapshotUpdate
+	{
+		VariableListDeltaTracker::SnapshotBuffer *baseline;
+		VariableListDeltaTracker::SnapshotBuffer *snapshotBlocks;
+		bool anyBlocksChanged;
+		// Byte aligned, from VariableListDeltaTracker::WriteSnapshotBlocks()
+		RakNet::BitStream bitStream;
+	};
+	DataStructures::List<SnapshotUpdate*> snapshotUpdates;
+	// Bulk mode. The snapshot sent with BeginUnreliableAckedSerialize() this tick, which every system sent it shares
+	VariableListDeltaTracker::SnapshotBuffer *tickSnapshot;
+	// Bulk mode. Changed block bits, reused between calls
+	unsigned char *changedSnapshotBlocks;
+	unsigned int changedSnapshotBlocksLength;
+
+	unsigned char *GetChangedSnapshotBlocks(unsigned int numBlocks);
+	bool GetSnapshotChanges(VariableListDeltaTracker *variableListDeltaTracker, const unsigned char *snapshot, unsigned int byteLength);
+	void ClearSnapshotUpdates(void);
+
 	void FreeVarsAssociatedWithReceipt(RakNetGUID guid, uint32_t receiptId);
 	void DirtyAndFreeVarsAssociatedWithReceipt(RakNetGUID guid, uint32_t receiptId);
 	unsigned int GetVarsWrittenPerRemoteSystemListIndex(RakNetGUID guid);
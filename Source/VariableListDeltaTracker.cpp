@@ -10,14 +10,29 @@
 
 #include "VariableListDeltaTracker.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define _VARIABLE_LIST_DELTA_TRACKER_USE_SSE2
+#include <emmintrin.h>
+#endif
+
 using namespace RakNet;
 
-VariableListDeltaTracker::VariableListDeltaTracker() {nextWriteIndex=0;}
+VariableListDeltaTracker::VariableListDeltaTracker()
+{
+	nextWriteIndex=0;
+	snapshot=0;
+	dirtySnapshotBlocks=0;
+	dirtySnapshotBlocksLength=0;
+	hasDirtySnapshotBlocks=false;
+}
 VariableListDeltaTracker::~VariableListDeltaTracker()
 {
 	unsigned int i;
 	for (i=0; i < variableList.Size(); i++)
 		rakFree_Ex(variableList[i].lastData,_FILE_AND_LINE_);
+	if (snapshot)
+		ReleaseSnapshotBuffer(snapshot);
+	rakFree_Ex(dirtySnapshotBlocks,_FILE_AND_LINE_);
 }
 
 // Call before using a series of WriteVar
@@ -48,3 +63,220 @@ VariableListDeltaTracker::VariableLastValueNode::VariableLastValueNode(const uns
 VariableListDeltaTracker::VariableLastValueNode::~VariableLastValueNode()
 {
 }
+
+VariableListDeltaTracker::SnapshotBuffer *VariableListDeltaTracker::AllocSnapshotBuffer(const unsigned char *data, unsigned int byteLength)
+{
+	SnapshotBuffer *snapshotBuffer = (SnapshotBuffer*) rakMalloc_Ex(sizeof(SnapshotBuffer)+byteLength,_FILE_AND_LINE_);
+	snapshotBuffer->refCount=1;
+	snapshotBuffer->byteLength=byteLength;
+	snapshotBuffer->data=(unsigned char*) (snapshotBuffer+1);
+	if (byteLength>0)
+		memcpy(snapshotBuffer->data,data,byteLength);
+	return snapshotBuffer;
+}
+void VariableListDeltaTracker::AddSnapshotReference(SnapshotBuffer *snapshotBuffer)
+{
+	snapshotBuffer->refCount++;
+}
+void VariableListDeltaTracker::ReleaseSnapshotBuffer(SnapshotBuffer *snapshotBuffer)
+{
+	if (--snapshotBuffer->refCount==0)
+		rakFree_Ex(snapshotBuffer,_FILE_AND_LINE_);
+}
+bool VariableListDeltaTracker::GetChangedSnapshotBlocks(const SnapshotBuffer *baseline, const unsigned char *snapshot, unsigned int byteLength, unsigned char *changedBlocks)
+{
+	unsigned int numBlocks = GetNumSnapshotBlocks(byteLength);
+	memset(changedBlocks,0,(numBlocks+7)/8);
+
+	// Whole blocks both snapshots have
+	unsigned int numFullBlocks=0;
+	if (baseline)
+		numFullBlocks = (baseline->byteLength < byteLength ? baseline->byteLength : byteLength) / SNAPSHOT_BLOCK_SIZE;
+
+	unsigned int anyChanged=0;
+	unsigned int block=0;
+	const unsigned char *baselineData = baseline ? baseline->data : 0;
+#ifdef _VARIABLE_LIST_DELTA_TRACKER_USE_SSE2
+	// Two compares of four blocks each give one byte of changedBlocks
+	for (; block+8 <= numFullBlocks; block+=8)
+	{
+		const unsigned char *a = snapshot+block*SNAPSHOT_BLOCK_SIZE;
+		const unsigned char *b = baselineData+block*SNAPSHOT_BLOCK_SIZE;
+		__m128i equalLow = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*) a), _mm_loadu_si128((const __m128i*) b));
+		__m128i equalHigh = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*) (a+16)), _mm_loadu_si128((const __m128i*) (b+16)));
+		unsigned int equal = (unsigned int) _mm_movemask_ps(_mm_castsi128_ps(equalLow)) | ((unsigned int) _mm_movemask_ps(_mm_castsi128_ps(equalHigh)) << 4);
+		changedBlocks[block>>3]=(unsigned char) ~equal;
+		anyChanged|=~equal & 0xFF;
+	}
+#else
+	for (; block < numFullBlocks; block++)
+	{
+		uint32_t a, b;
+		memcpy(&a,snapshot+block*SNAPSHOT_BLOCK_SIZE,SNAPSHOT_BLOCK_SIZE);
+		memcpy(&b,baselineData+block*SNAPSHOT_BLOCK_SIZE,SNAPSHOT_BLOCK_SIZE);
+		if (a!=b)
+		{
+			changedBlocks[block>>3] |= 1 << (block&7);
+			anyChanged=1;
+		}
+	}
+#endif
+
+	// Blocks left over, the last block if partial, and anything past the end of the baseline
+	for (; block < numBlocks; block++)
+	{
+		unsigned int offset = block*SNAPSHOT_BLOCK_SIZE;
+		unsigned int length = byteLength-offset < SNAPSHOT_BLOCK_SIZE ? byteLength-offset : SNAPSHOT_BLOCK_SIZE;
+		if (block >= numFullBlocks && (baseline==0 || baseline->byteLength!=byteLength))
+		{
+			changedBlocks[block>>3] |= 1 << (block&7);
+			anyChanged=1;
+		}
+		else if (memcmp(snapshot+offset,baselineData+offset,length)!=0)
+		{
+			changedBlocks[block>>3] |= 1 << (block&7);
+			anyChanged=1;
+		}
+	}
+	return anyChanged!=0;
+}
+void VariableListDeltaTracker::WriteSnapshotBlocks(const unsigned char *snapshot, unsigned int byteLength, const unsigned char *changedBlocks, RakNet::BitStream *bitStream)
+{
+	// ReadSnapshotBlocks() would reject it
+	RakAssert(byteLength <= MAX_SNAPSHOT_BYTE_LENGTH);
+	unsigned int numBlocks = GetNumSnapshotBlocks(byteLength);
+	unsigned int numMaskBytes = (numBlocks+7)/8;
+	unsigned int i;
+
+	// A bit for each byte of changedBlocks that has any set, then those bytes, then the changed blocks
+	bitStream->WriteCompressed(byteLength);
+	for (i=0; i < numMaskBytes; i++)
+		bitStream->Write(changedBlocks[i]!=0);
+	for (i=0; i < numMaskBytes; i++)
+	{
+		if (changedBlocks[i]!=0)
+			bitStream->Write(changedBlocks[i]);
+	}
+	bitStream->AlignWriteToByteBoundary();
+
+	// Adjacent changed blocks are copied together
+	unsigned int block=0;
+	while (block < numBlocks)
+	{
+		if (changedBlocks[block>>3]==0)
+		{
+			block=(block|7)+1;
+			continue;
+		}
+		if ((changedBlocks[block>>3] & (1 << (block&7)))==0)
+		{
+			block++;
+			continue;
+		}
+		unsigned int end=block+1;
+		while (end < numBlocks && (changedBlocks[end>>3] & (1 << (end&7))))
+			end++;
+		unsigned int offset = block*SNAPSHOT_BLOCK_SIZE;
+		unsigned int length = end*SNAPSHOT_BLOCK_SIZE < byteLength ? (end-block)*SNAPSHOT_BLOCK_SIZE : byteLength-offset;
+		bitStream->WriteAlignedBytes(snapshot+offset,length);
+		block=end;
+	}
+}
+bool VariableListDeltaTracker::ReadSnapshotBlocks(RakNet::BitStream *bitStream, RakNet::BitStream *snapshot)
+{
+	unsigned int byteLength;
+	if (bitStream->ReadCompressed(byteLength)==false)
+		return false;
+	// One bit of the message can stand for a mask byte of 8 blocks, so the length is limited before the snapshot is padded to it
+	if (byteLength > MAX_SNAPSHOT_BYTE_LENGTH)
+		return false;
+	unsigned int numBlocks = GetNumSnapshotBlocks(byteLength);
+	unsigned int numMaskBytes = (numBlocks+7)/8;
+	if (bitStream->GetNumberOfUnreadBits() < numMaskBytes)
+		return false;
+
+	if (snapshot->GetNumberOfBytesUsed() < byteLength)
+		snapshot->PadWithZeroToByteLength(byteLength);
+	else
+		snapshot->SetWriteOffset(BYTES_TO_BITS(byteLength));
+	snapshot->ResetReadPointer();
+	if (numMaskBytes==0)
+		return true;
+
+	unsigned char *changedBlocks = (unsigned char*) rakMalloc_Ex(numMaskBytes,_FILE_AND_LINE_);
+	unsigned int i;
+	bool success=true;
+	for (i=0; i < numMaskBytes; i++)
+	{
+		bool maskByteWritten=false;
+		bitStream->Read(maskByteWritten);
+		changedBlocks[i] = maskByteWritten ? 1 : 0;
+	}
+	for (i=0; i < numMaskBytes && success; i++)
+	{
+		if (changedBlocks[i]!=0)
+			success=bitStream->Read(changedBlocks[i]);
+	}
+	bitStream->AlignReadToByteBoundary();
+
+	unsigned int block=0;
+	while (success && block < numBlocks)
+	{
+		if ((changedBlocks[block>>3] & (1 << (block&7)))==0)
+		{
+			block++;
+			continue;
+		}
+		unsigned int end=block+1;
+		while (end < numBlocks && (changedBlocks[end>>3] & (1 << (end&7))))
+			end++;
+		unsigned int offset = block*SNAPSHOT_BLOCK_SIZE;
+		unsigned int length = end*SNAPSHOT_BLOCK_SIZE < byteLength ? (end-block)*SNAPSHOT_BLOCK_SIZE : byteLength-offset;
+		success=bitStream->ReadAlignedBytes(snapshot->GetData()+offset,length);
+		block=end;
+	}
+	rakFree_Ex(changedBlocks,_FILE_AND_LINE_);
+	return success;
+}
+void VariableListDeltaTracker::SetSnapshot(SnapshotBuffer *_snapshot)
+{
+	if (_snapshot)
+		AddSnapshotReference(_snapshot);
+	if (snapshot)
+		ReleaseSnapshotBuffer(snapshot);
+	snapshot=_snapshot;
+}
+void VariableListDeltaTracker::FlagDirtySnapshotBlocks(const unsigned char *blocks, unsigned int numBlocks)
+{
+	unsigned int numBytes = (numBlocks+7)/8;
+	if (numBytes > dirtySnapshotBlocksLength)
+	{
+		dirtySnapshotBlocks = (unsigned char*) rakRealloc_Ex(dirtySnapshotBlocks,numBytes,_FILE_AND_LINE_);
+		memset(dirtySnapshotBlocks+dirtySnapshotBlocksLength,0,numBytes-dirtySnapshotBlocksLength);
+		dirtySnapshotBlocksLength=numBytes;
+	}
+	unsigned int i;
+	for (i=0; i < numBytes; i++)
+	{
+		dirtySnapshotBlocks[i] |= blocks[i];
+		if (blocks[i])
+			hasDirtySnapshotBlocks=true;
+	}
+}
+bool VariableListDeltaTracker::TakeDirtySnapshotBlocks(unsigned char *changedBlocks, unsigned int numBlocks)
+{
+	if (hasDirtySnapshotBlocks==false)
+		return false;
+	unsigned int numBytes = (numBlocks+7)/8;
+	if (numBytes > dirtySnapshotBlocksLength)
+		numBytes = dirtySnapshotBlocksLength;
+	unsigned int i;
+	for (i=0; i < numBytes; i++)
+		changedBlocks[i] |= dirtySnapshotBlocks[i];
+	// Blocks past the end of a shorter snapshot no longer exist
+	if ((numBlocks&7)!=0 && numBytes==(numBlocks+7)/8)
+		changedBlocks[numBytes-1] &= (unsigned char) ((1 << (numBlocks&7))-1);
+	memset(dirtySnapshotBlocks,0,dirtySnapshotBlocksLength);
+	hasDirtySnapshotBlocks=false;
+	return true;
+}
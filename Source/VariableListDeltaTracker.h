@@ -122,6 +122,53 @@ public:
 	/// This updates all the variables in the list, where in each index \a varsWritten is true, so will the variable at the corresponding index be flagged dirty
 	void FlagDirtyFromBitArray(unsigned char *bArray);
 
+	/// \brief Bulk mode: a serialized copy of a whole object in one buffer
+	/// Remote systems sent the same data share one SnapshotBuffer, rather than each holding a copy per variable
+	struct SnapshotBuffer
+	{
+		unsigned int refCount;
+		unsigned int byteLength;
+		unsigned char *data;
+	};
+
+	/// Bulk mode compares and sends snapshots in blocks of this many bytes
+	static const unsigned int SNAPSHOT_BLOCK_SIZE=4;
+	static unsigned int GetNumSnapshotBlocks(unsigned int byteLength) {return (byteLength+SNAPSHOT_BLOCK_SIZE-1)/SNAPSHOT_BLOCK_SIZE;}
+
+	/// Returns a SnapshotBuffer holding a copy of \a data, with a reference count of 1
+	static SnapshotBuffer *AllocSnapshotBuffer(const unsigned char *data, unsigned int byteLength);
+	static void AddSnapshotReference(SnapshotBuffer *snapshotBuffer);
+	/// Frees \a snapshotBuffer when the last reference is released
+	static void ReleaseSnapshotBuffer(SnapshotBuffer *snapshotBuffer);
+
+	/// Sets the bit in \a changedBlocks for each block of \a snapshot that differs from \a baseline, using SSE2 where available
+	/// Blocks past the end of the shorter of the two always differ, as do all blocks if \a baseline is 0
+	/// \param[out] changedBlocks Bit n%8 of byte n/8 is set if block n changed. Must hold (GetNumSnapshotBlocks(byteLength)+7)/8 bytes
+	/// \return true if any block differs
+	static bool GetChangedSnapshotBlocks(const SnapshotBuffer *baseline, const unsigned char *snapshot, unsigned int byteLength, unsigned char *changedBlocks);
+
+	/// Writes the length of \a snapshot, which blocks are set in \a changedBlocks, and those blocks
+	static void WriteSnapshotBlocks(const unsigned char *snapshot, unsigned int byteLength, const unsigned char *changedBlocks, RakNet::BitStream *bitStream);
+
+	/// Paired with WriteSnapshotBlocks(). Copies the blocks read into \a snapshot, resized to the length written
+	/// \return false if \a bitStream ended early, or the length written is more than MAX_SNAPSHOT_BYTE_LENGTH
+	static bool ReadSnapshotBlocks(RakNet::BitStream *bitStream, RakNet::BitStream *snapshot);
+
+	/// The snapshot last recorded with SetSnapshot(), or 0 if there was none
+	SnapshotBuffer *GetSnapshot(void) const {return snapshot;}
+
+	/// Records \a _snapshot as what was last sent, adding a reference to it and releasing the one recorded before
+	void SetSnapshot(SnapshotBuffer *_snapshot);
+
+	/// Blocks flagged dirty are sent again by the next bulk mode write, even if unchanged
+	void FlagDirtySnapshotBlocks(const unsigned char *blocks, unsigned int numBlocks);
+
+	bool HasDirtySnapshotBlocks(void) const {return hasDirtySnapshotBlocks;}
+
+	/// Sets the bits of the dirty blocks in \a changedBlocks, then clears them
+	/// \return true if there were any
+	bool TakeDirtySnapshotBlocks(unsigned char *changedBlocks, unsigned int numBlocks);
+
 	/// \internal
 	struct VariableLastValueNode
 	{
@@ -138,6 +185,12 @@ protected:
 	DataStructures::List<VariableLastValueNode> variableList;
 	/// \internal
 	unsigned int nextWriteIndex;
+	/// \internal Bulk mode
+	SnapshotBuffer *snapshot;
+	/// \internal Bulk mode
+	unsigned char *dirtySnapshotBlocks;
+	unsigned int dirtySnapshotBlocksLength;
+	bool hasDirtySnapshotBlocks;
 };
 
 
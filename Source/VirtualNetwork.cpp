@@ -0,0 +1,356 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "VirtualNetwork.h"
+#include "RakMemoryOverride.h"
+#include "RakAssert.h"
+#include "RakSleep.h"
+#include "GetTime.h"
+#include "LocklessTypes.h"
+#include <string.h>
+
+using namespace RakNet;
+
+// Ports given to sockets bound with port 0 start here, as ephemeral ports do
+static const unsigned short FIRST_AUTOMATIC_PORT=49152;
+
+VirtualLinkSettings::VirtualLinkSettings()
+{
+	bytesPerSecond=0.0;
+	latency=0;
+	jitter=0;
+	reorderChance=0.0f;
+	lossChance=0.0f;
+}
+
+RNS2_Virtual::RNS2_Virtual()
+{
+	network=0;
+}
+RNS2_Virtual::~RNS2_Virtual()
+{
+	if (network)
+		network->UnbindSocket(this);
+}
+RNS2BindResult RNS2_Virtual::Bind( VirtualNetwork *_network, unsigned short port, const char *hostAddress, RNS2EventHandler *_eventHandler )
+{
+	RakAssert(network==0);
+	SystemAddress address;
+	if (hostAddress==0 || hostAddress[0]==0)
+		hostAddress="127.0.0.1";
+	if (address.FromStringExplicitPort(hostAddress, port, 4)==false)
+		return BR_FAILED_TO_BIND_SOCKET;
+	// Set before binding, as datagrams can be delivered as soon as the socket is on the network
+	eventHandler=_eventHandler;
+	if (_network->BindSocket(this, &address)==false)
+		return BR_FAILED_TO_BIND_SOCKET;
+	network=_network;
+	return BR_SUCCESS;
+}
+RNS2SendResult RNS2_Virtual::Send( RNS2_SendParameters *sendParameters, const char *file, unsigned int line )
+{
+	if (network==0 || sendParameters->length < 0 || sendParameters->length > MAXIMUM_MTU_SIZE)
+		return -1;
+	VirtualNetwork::Datagram *datagram = network->AllocateDatagram(sendParameters->length, file, line);
+	datagram->from=boundAddress;
+	datagram->to=sendParameters->systemAddress;
+	datagram->sendTime=RakNet::GetTimeUS();
+	datagram->length=sendParameters->length;
+	memcpy(datagram->data, sendParameters->data, sendParameters->length);
+	network->PushDatagram(datagram);
+	return sendParameters->length;
+}
+VirtualNetwork *RNS2_Virtual::GetNetwork(void) const
+{
+	return network;
+}
+
+unsigned long VirtualNetwork::LinkKey::ToInteger(const LinkKey &key)
+{
+	return SystemAddress::ToInteger(key.from)*31+SystemAddress::ToInteger(key.to);
+}
+
+VirtualNetwork::VirtualNetwork()
+{
+	sentStub.next=0;
+	sentHead=&sentStub;
+	sentTail=&sentStub;
+	memset(&statistics, 0, sizeof(statistics));
+	nextSequence=0;
+	nextPort=FIRST_AUTOMATIC_PORT;
+	random.SeedMT(0);
+	endUpdateThread=false;
+	updateThreadActive=false;
+	updateIntervalMS=0;
+}
+VirtualNetwork::~VirtualNetwork()
+{
+	StopUpdateThread();
+
+	networkMutex.Lock();
+	// Sockets still bound can no longer send
+	DataStructures::List<RNS2_Virtual*> boundSockets;
+	DataStructures::List<SystemAddress> boundAddresses;
+	sockets.GetAsList(boundSockets, boundAddresses, _FILE_AND_LINE_);
+	unsigned int i;
+	for (i=0; i < boundSockets.Size(); i++)
+		boundSockets[i]->network=0;
+	sockets.Clear(_FILE_AND_LINE_);
+
+	Datagram *datagram;
+	while ((datagram=PopDatagram())!=0)
+		FreeDatagram(datagram);
+	while (inFlight.Size())
+		FreeDatagram(inFlight.Pop(0));
+	for (i=0; i < linkList.Size(); i++)
+		RakNet::OP_DELETE(linkList[i], _FILE_AND_LINE_);
+	linkList.Clear(false, _FILE_AND_LINE_);
+	links.Clear(_FILE_AND_LINE_);
+	networkMutex.Unlock();
+}
+void VirtualNetwork::SetDefaultLinkSettings(const VirtualLinkSettings &settings)
+{
+	networkMutex.Lock();
+	defaultSettings=settings;
+	networkMutex.Unlock();
+}
+void VirtualNetwork::SetLinkSettings(const SystemAddress &from, const SystemAddress &to, const VirtualLinkSettings &settings)
+{
+	networkMutex.Lock();
+	Link *link=GetLink(from, to);
+	link->settings=settings;
+	link->hasSettings=true;
+	networkMutex.Unlock();
+}
+void VirtualNetwork::SetRandomSeed(unsigned int seed)
+{
+	networkMutex.Lock();
+	random.SeedMT(seed);
+	networkMutex.Unlock();
+}
+void VirtualNetwork::Update(void)
+{
+	networkMutex.Lock();
+	Datagram *datagram;
+	while ((datagram=PopDatagram())!=0)
+		RouteDatagram(datagram);
+
+	TimeUS time=RakNet::GetTimeUS();
+	while (inFlight.Size() && inFlight.PeekWeight().deliveryTime <= time)
+		DeliverDatagram(inFlight.Pop(0));
+	networkMutex.Unlock();
+}
+bool VirtualNetwork::StartUpdateThread(int intervalMS)
+{
+	if (updateThreadActive)
+		return true;
+	endUpdateThread=false;
+	updateIntervalMS=intervalMS;
+	updateThreadActive=true;
+	if (RakNet::RakThread::Create(UpdateLoop, this)!=0)
+	{
+		updateThreadActive=false;
+		return false;
+	}
+	return true;
+}
+void VirtualNetwork::StopUpdateThread(void)
+{
+	endUpdateThread=true;
+	while (updateThreadActive)
+		RakSleep(1);
+}
+void VirtualNetwork::GetStatistics(VirtualNetworkStatistics *_statistics)
+{
+	networkMutex.Lock();
+	*_statistics=statistics;
+	_statistics->datagramsInFlight=inFlight.Size();
+	networkMutex.Unlock();
+}
+bool VirtualNetwork::BindSocket(RNS2_Virtual *s, SystemAddress *address)
+{
+	networkMutex.Lock();
+	if (address->GetPort()==0)
+	{
+		// The next port not in use at this address
+		unsigned int tries;
+		for (tries=0; tries < 65536; tries++)
+		{
+			if (nextPort==0)
+				nextPort=1024;
+			address->SetPortHostOrder(nextPort++);
+			if (sockets.HasData(*address)==false)
+				break;
+		}
+		if (tries==65536)
+		{
+			networkMutex.Unlock();
+			return false;
+		}
+	}
+	if (sockets.HasData(*address))
+	{
+		networkMutex.Unlock();
+		return false;
+	}
+	s->boundAddress=*address;
+	sockets.Push(*address, s, _FILE_AND_LINE_);
+	networkMutex.Unlock();
+	return true;
+}
+void VirtualNetwork::UnbindSocket(RNS2_Virtual *s)
+{
+	// Waits for Update() to finish, so nothing is delivered to the socket once this returns
+	networkMutex.Lock();
+	sockets.Remove(s->GetBoundAddress(), _FILE_AND_LINE_);
+	networkMutex.Unlock();
+	s->network=0;
+}
+VirtualNetwork::Datagram *VirtualNetwork::AllocateDatagram(int length, const char *file, unsigned int line)
+{
+	return (Datagram *) rakMalloc_Ex(sizeof(Datagram)-MAXIMUM_MTU_SIZE+length, file, line);
+}
+void VirtualNetwork::FreeDatagram(Datagram *datagram)
+{
+	rakFree_Ex(datagram, _FILE_AND_LINE_);
+}
+void VirtualNetwork::PushDatagram(Datagram *datagram)
+{
+	datagram->next=0;
+	// Full barrier, so the datagram is written before other threads can reach it
+	Datagram *previous=(Datagram*) RakNet::LocklessExchangePointer((void * volatile *) &sentHead, datagram);
+	// Until this store, Update() stops at previous. It picks up datagram next time
+	previous->next=datagram;
+}
+VirtualNetwork::Datagram *VirtualNetwork::PopDatagram(void)
+{
+	// Only one thread pops, as networkMutex is held
+	Datagram *tail=sentTail;
+	Datagram *next=tail->next;
+	if (tail==&sentStub)
+	{
+		if (next==0)
+			return 0;
+		sentTail=next;
+		tail=next;
+		next=next->next;
+	}
+	RakNet::LocklessMemoryBarrier();
+	if (next)
+	{
+		sentTail=next;
+		return tail;
+	}
+	if (tail!=sentHead)
+	{
+		// A sender is between swapping the head and linking its datagram
+		return 0;
+	}
+	// Put the stub back behind the last datagram, so it can be taken without emptying the queue
+	PushDatagram(&sentStub);
+	next=tail->next;
+	if (next)
+	{
+		sentTail=next;
+		return tail;
+	}
+	return 0;
+}
+VirtualNetwork::Link *VirtualNetwork::GetLink(const SystemAddress &from, const SystemAddress &to)
+{
+	LinkKey key;
+	key.from=from;
+	key.to=to;
+	Link **existing=links.Peek(key);
+	if (existing)
+		return *existing;
+	Link *link = RakNet::OP_NEW<Link>(_FILE_AND_LINE_);
+	link->hasSettings=false;
+	link->sendFinishTime=0;
+	link->lastDeliveryTime=0;
+	links.Push(key, link, _FILE_AND_LINE_);
+	linkList.Insert(link, _FILE_AND_LINE_);
+	return link;
+}
+void VirtualNetwork::RouteDatagram(Datagram *datagram)
+{
+	statistics.datagramsSent++;
+	Link *link=GetLink(datagram->from, datagram->to);
+	const VirtualLinkSettings &settings = link->hasSettings ? link->settings : defaultSettings;
+	if (settings.lossChance > 0.0f && random.FrandomMT() < settings.lossChance)
+	{
+		statistics.datagramsLost++;
+		FreeDatagram(datagram);
+		return;
+	}
+
+	// Wait for the datagrams before this one to finish sending, then take the time to send this one
+	TimeUS sendFinishTime=datagram->sendTime;
+	if (settings.bytesPerSecond > 0.0)
+	{
+		if (link->sendFinishTime > sendFinishTime)
+			sendFinishTime=link->sendFinishTime;
+		sendFinishTime+=(TimeUS) ((double) datagram->length*1000000.0/settings.bytesPerSecond);
+		link->sendFinishTime=sendFinishTime;
+	}
+
+	DeliveryKey key;
+	key.deliveryTime=sendFinishTime+settings.latency;
+	if (settings.jitter > 0)
+		key.deliveryTime+=random.RandomMT() % (settings.jitter+1);
+	if (settings.reorderChance > 0.0f && random.FrandomMT() < settings.reorderChance)
+	{
+		key.deliveryTime+=1+random.RandomMT() % (settings.latency+settings.jitter+1);
+	}
+	else
+	{
+		if (key.deliveryTime < link->lastDeliveryTime)
+			key.deliveryTime=link->lastDeliveryTime;
+		link->lastDeliveryTime=key.deliveryTime;
+	}
+	key.sequence=nextSequence++;
+	inFlight.Push(key, datagram, _FILE_AND_LINE_);
+}
+void VirtualNetwork::DeliverDatagram(Datagram *datagram)
+{
+	RNS2_Virtual **s=sockets.Peek(datagram->to);
+	if (s==0)
+	{
+		statistics.datagramsUnroutable++;
+		FreeDatagram(datagram);
+		return;
+	}
+
+	RNS2EventHandler *handler=(*s)->GetEventHandler();
+	RNS2RecvStruct *recvStruct=handler->AllocRNS2RecvStruct(_FILE_AND_LINE_);
+	if (recvStruct)
+	{
+		memcpy(recvStruct->data, datagram->data, datagram->length);
+		recvStruct->bytesRead=datagram->length;
+		recvStruct->systemAddress=datagram->from;
+		recvStruct->timeRead=RakNet::GetTimeUS();
+		recvStruct->socket=*s;
+		handler->OnRNS2Recv(recvStruct);
+		statistics.datagramsDelivered++;
+		statistics.bytesDelivered+=datagram->length;
+	}
+	FreeDatagram(datagram);
+}
+RAK_THREAD_DECLARATION(VirtualNetwork::UpdateLoop)
+{
+	VirtualNetwork *network = (VirtualNetwork *) arguments;
+	while (network->endUpdateThread==false)
+	{
+		network->Update();
+		RakSleep(network->updateIntervalMS);
+	}
+	network->updateThreadActive=false;
+	return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ *  Copyright (c) 2014, Oculus VR, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/// \file VirtualNetwork.h
+/// \brief A network inside one process, for running many RakPeer instances without UDP sockets
+///
+/// Each link between two virtual sockets can have limited bandwidth, latency, jitter, reordering and loss.
+/// To use it, set SocketDescriptor::virtualNetwork before calling RakPeer::Startup(), and call VirtualNetwork::Update() often, or StartUpdateThread() once.
+/// For runs faster than real time, call SetTimeSource(TIME_SOURCE_VIRTUAL) then SetVirtualTimeScale() or AdvanceVirtualTime() from GetTime.h
+///
+
+
+#ifndef __VIRTUAL_NETWORK_H
+#define __VIRTUAL_NETWORK_H
+
+#include "RakNetSocket2.h"
+#include "RakNetTypes.h"
+#include "SimpleMutex.h"
+#include "RakThread.h"
+#include "Rand.h"
+#include "DS_Hash.h"
+#include "DS_Heap.h"
+#include "DS_List.h"
+#include "Export.h"
+
+namespace RakNet
+{
+
+class VirtualNetwork;
+
+/// How datagrams cross a link from one virtual socket to another. Links are one way
+struct RAK_DLL_EXPORT VirtualLinkSettings
+{
+	VirtualLinkSettings();
+
+	/// Bytes per second the link carries. Datagrams wait behind each other when it is busy. 0 for no limit
+	double bytesPerSecond;
+	/// Microseconds for a datagram to cross the link once sent
+	TimeUS latency;
+	/// Each datagram gets up to this many microseconds of random extra latency. This alone does not reorder datagrams
+	TimeUS jitter;
+	/// Chance from 0 to 1 that a datagram is held back by up to latency+jitter more, so datagrams sent after it can arrive first
+	float reorderChance;
+	/// Chance from 0 to 1 that a datagram is lost
+	float lossChance;
+};
+
+/// Counts for everything sent on a VirtualNetwork since it was created
+struct RAK_DLL_EXPORT VirtualNetworkStatistics
+{
+	uint64_t datagramsSent;
+	uint64_t datagramsDelivered;
+	/// Lost to VirtualLinkSettings::lossChance
+	uint64_t datagramsLost;
+	/// Sent to an address no socket is bound to
+	uint64_t datagramsUnroutable;
+	uint64_t bytesDelivered;
+	/// Sent but not yet delivered
+	unsigned int datagramsInFlight;
+};
+
+/// A RakNetSocket2 on a VirtualNetwork. RakPeer::Startup() creates these when SocketDescriptor::virtualNetwork is set
+class RAK_DLL_EXPORT RNS2_Virtual : public RakNetSocket2
+{
+public:
+	RNS2_Virtual();
+	virtual ~RNS2_Virtual();
+
+	/// \param[in] network The network to join
+	/// \param[in] port Port on the network. 0 to be given one no other socket has
+	/// \param[in] hostAddress IPV4 address on the network. 0 or an empty string for 127.0.0.1
+	/// \param[in] eventHandler Gets every datagram delivered to this socket
+	/// \return BR_FAILED_TO_BIND_SOCKET if another socket has the address
+	RNS2BindResult Bind( VirtualNetwork *network, unsigned short port, const char *hostAddress, RNS2EventHandler *eventHandler );
+
+	/// Copies the datagram into the network and returns at once. It is delivered by a later VirtualNetwork::Update()
+	virtual RNS2SendResult Send( RNS2_SendParameters *sendParameters, const char *file, unsigned int line );
+
+	VirtualNetwork *GetNetwork(void) const;
+
+protected:
+	friend class VirtualNetwork;
+	VirtualNetwork *network;
+};
+
+/// Routes datagrams between RNS2_Virtual sockets in this process
+/// Sending from any thread is lock free. Update() delivers, from one thread at a time
+class RAK_DLL_EXPORT VirtualNetwork
+{
+public:
+	VirtualNetwork();
+	~VirtualNetwork();
+
+	/// Settings for links without their own. Defaults to no limits, latency or loss
+	void SetDefaultLinkSettings(const VirtualLinkSettings &settings);
+
+	/// Settings for datagrams from \a from to \a to. Can be called before either socket is bound
+	void SetLinkSettings(const SystemAddress &from, const SystemAddress &to, const VirtualLinkSettings &settings);
+
+	/// Seeds the random numbers used for jitter, reordering and loss, so runs can be repeated
+	void SetRandomSeed(unsigned int seed);
+
+	/// Routes what was sent since the last call, and delivers every datagram due by GetTimeUS() to its socket's RNS2EventHandler, which for RakPeer wakes its update thread
+	void Update(void);
+
+	/// Calls Update() from a thread of its own until StopUpdateThread() or destruction
+	/// \param[in] intervalMS Real milliseconds between updates. With a virtual time scale above 1, datagrams can arrive up to intervalMS times the scale late
+	/// \return false if the thread could not be created
+	bool StartUpdateThread(int intervalMS);
+	void StopUpdateThread(void);
+
+	void GetStatistics(VirtualNetworkStatistics *statistics);
+
+	/// \internal
+	struct Datagram
+	{
+		Datagram * volatile next;
+		SystemAddress from;
+		SystemAddress to;
+		TimeUS sendTime;
+		int length;
+		// Allocated to length
+		char data[MAXIMUM_MTU_SIZE];
+	};
+	/// \internal
+	bool BindSocket(RNS2_Virtual *s, SystemAddress *address);
+	/// \internal
+	void UnbindSocket(RNS2_Virtual *s);
+	/// \internal
+	Datagram *AllocateDatagram(int length, const char *file, unsigned int line);
+	/// \internal
+	void PushDatagram(Datagram *datagram);
+
+	/// \internal
+	struct LinkKey
+	{
+		SystemAddress from;
+		SystemAddress to;
+		bool operator==(const LinkKey &right) const {return from==right.from && to==right.to;}
+		static unsigned long ToInteger(const LinkKey &key);
+	};
+	/// \internal
+	struct Link
+	{
+		VirtualLinkSettings settings;
+		bool hasSettings;
+		// When the datagram sent last finishes sending at bytesPerSecond
+		TimeUS sendFinishTime;
+		// Datagrams are not delivered before the one sent before them unless reordered
+		TimeUS lastDeliveryTime;
+	};
+	/// \internal
+	struct DeliveryKey
+	{
+		TimeUS deliveryTime;
+		// Datagrams due at the same time are delivered in the order sent
+		uint32_t sequence;
+		bool operator<(const DeliveryKey &right) const {return deliveryTime < right.deliveryTime || (deliveryTime==right.deliveryTime && sequence-right.sequence > 0x80000000);}
+		bool operator>(const DeliveryKey &right) const {return right < *this;}
+		bool operator<=(const DeliveryKey &right) const {return !(right < *this);}
+		bool operator>=(const DeliveryKey &right) const {return !(*this < right);}
+	};
+
+protected:
+	Datagram *PopDatagram(void);
+	void RouteDatagram(Datagram *datagram);
+	void DeliverDatagram(Datagram *datagram);
+	Link *GetLink(const SystemAddress &from, const SystemAddress &to);
+	void FreeDatagram(Datagram *datagram);
+
+	// Intrusive queue of datagrams sent and not yet routed. Any thread pushes onto sentHead, Update() pops from sentTail
+	Datagram * volatile sentHead;
+	Datagram *sentTail;
+	Datagram sentStub;
+
+	// Everything else is guarded by networkMutex, which Update(), binding and settings take
+	SimpleMutex networkMutex;
+	DataStructures::Hash<SystemAddress, RNS2_Virtual*, 16384, SystemAddress::ToInteger> sockets;
+	DataStructures::Hash<LinkKey, Link*, 32768, LinkKey::ToInteger> links;
+	DataStructures::List<Link*> linkList;
+	DataStructures::Heap<DeliveryKey, Datagram*, false> inFlight;
+	VirtualLinkSettings defaultSettings;
+	RakNetRandom random;
+	uint32_t nextSequence;
+	unsigned short nextPort;
+	VirtualNetworkStatistics statistics;
+
+	volatile bool endUpdateThread;
+	volatile bool updateThreadActive;
+	int updateIntervalMS;
+	static RAK_THREAD_DECLARATION(UpdateLoop);
+};
+
+} // namespace RakNet
+
+#endif
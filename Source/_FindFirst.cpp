@@ -125,6 +125,7 @@ int _findnext(long h, _finddata_t *f)
                                  // are not supported.
 
                 f->size = filestat.st_size;
+                f->time_write = filestat.st_mtime;
                 strncpy(f->name, entry->d_name, STRING_BUFFER_SIZE);
                 
                 return 0;
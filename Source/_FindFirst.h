@@ -9,6 +9,7 @@
 #if (defined(__GNUC__) || defined(__ARMCC_VERSION) || defined(__GCCXML__) || defined(__S3E__) ) && !defined(__WIN32)
 
 #include <dirent.h>
+#include <time.h>
 
 #include "RakString.h"
 
@@ -35,6 +36,7 @@ typedef struct _finddata_t
 	char            name[STRING_BUFFER_SIZE];
 	int            attrib;
 	unsigned long   size;
+	time_t          time_write;
 } _finddata;
 
 /** 
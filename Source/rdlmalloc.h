@@ -518,6 +518,12 @@ extern "C" {
 	void** rak_mspace_independent_comalloc(mspace msp, size_t n_elements,
 		size_t sizes[], void* chunks[]);
 
+	/*
+	rak_mspace_bulk_free frees each non-null element of the array, all
+	allocated from the given space, taking its lock only once.
+	*/
+	void rak_mspace_bulk_free(mspace msp, void* array[], size_t n_elements);
+
 	/*
 	rak_mspace_footprint() returns the number of bytes obtained from the
 	system for this space.
@@ -1796,6 +1802,12 @@ extern "C" {
 	void** rak_mspace_independent_comalloc(mspace msp, size_t n_elements,
 		size_t sizes[], void* chunks[]);
 
+	/*
+	rak_mspace_bulk_free frees each non-null element of the array, all
+	allocated from the given space, taking its lock only once.
+	*/
+	void rak_mspace_bulk_free(mspace msp, void* array[], size_t n_elements);
+
 	/*
 	rak_mspace_footprint() returns the number of bytes obtained from the
 	system for this space.